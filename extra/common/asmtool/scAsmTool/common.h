@@ -28,6 +28,7 @@
 #include "scAsmCommand.h"
 #include "scAsmAssembler.h"
 #include "scAsmTool.h"
+#include "scAsmBatch.h"
 
 #define stricmp _stricmp
 #define MAXLINE 4096
\ No newline at end of file
@@ -24,7 +24,16 @@ int main(int argc, char *argv[])
 		goto usage;
 	}
 
-	if (stricmp(argv[2], "/D") == 0) {
+	if (scAsmBatch::IsBatchMode(argv[2])) {
+		int part = -1;
+		const char *cache = NULL;
+		for (int i = 5; i < argc; i++) {
+			if (stricmp(argv[i], "/PART") == 0 && i + 1 < argc) part = atoi(argv[++i]);
+			else if (stricmp(argv[i], "/CACHE") == 0 && i + 1 < argc) cache = argv[++i];
+			else if (stricmp(argv[i], "/DBG") == 0) scAsmTool::dbgflag = true;
+		}
+		scAsmBatch::Run(argv[1], argv[2], argv[3], atoi(argv[4]), part, cache);
+	} else if (stricmp(argv[2], "/D") == 0) {
 		scAsmDisassembler::Instance()->DisassembleSCE(argv[3], argv[4]);
 	} else if (stricmp(argv[2], "/A") == 0) {
 		scAsmAssembler::Instance()->AssembleSCE(argv[3], argv[4]);
@@ -34,11 +43,12 @@ int main(int argc, char *argv[])
 		goto usage;
 	}
 
-	scAsmTool::die(0);
+	scAsmTool::die(scAsmTool::GetErrorCnt() > 0 ? 1 : 0);
 	
 usage:
 	printf(" иʽ\n");
 	printf("    scAsmTool [/3|/3A] [/D|/A] [ļX] [ļY] [/DBG]\n");
+	printf("    scAsmTool [/3|/3A] [/BD|/BA|/BT] [бL] [N] [/CACHE ļC] [/DBG]\n");
 	printf("\n");
 	printf(" 汾ѡ\n");
 	printf("    /3     ʹָ\n");
@@ -48,6 +58,14 @@ usage:
 	printf("    /D     ģʽ X Ϊ Y\n");
 	printf("    /A     ģʽ X Ϊ Y\n");
 	printf("    /T     ģʽ Y Ƿ X ͬḲļ\n");
+	printf("    /BD /BA /BT  ģʽ L ÿļ X Y ֱʹ /D /A /T\n");
+	printf("\n");
+	printf(" ѡ\n");
+	printf("    L      бļÿһļX Y;Ϊע\n");
+	printf("           ҲĿ¼ /BD  /BTĿ¼ SCE ļͬ ASM ļ\n");
+	printf("    N      ͬʱеĽ0 Ϊ CPU д scAsmTool_batch_*.log\n");
+	printf("    /CACHE ࣨ /BA C м¼ÿ ASM ļļɢֵ\n");
+	printf("           ٴʱļԴļδıļ\n");
 	printf("\n");
 	printf(" ѡ\n");
 	printf("    /DBG   Ϣ\n");
@@ -57,6 +75,8 @@ usage:
 	printf("    scAsmTool /3 /D Q01.SCE Q01.ASM       Q01.SCE Ϊ Q01.ASM\n");
 	printf("    scAsmTool /3 /T Q01.SCE Q01.ASM      ԷǷܾȷΪԭļ\n");
 	printf("    scAsmTool /3 /A Q01.ASM Q01NEW.SCE    Q01.ASM Ϊ Q01NEW.SCE\n");
+	printf("    scAsmTool /3 /BT scene 0              scene Ŀ¼ SCE ļ\n");
+	printf("    scAsmTool /3 /BA list.txt 0 /CACHE list.cache   list.txt ļ\n");
 	
 
 	printf("\n");
@@ -1,42 +1,48 @@
 #include "common.h"
 
+static scAsmAssembler *inst = NULL;
 scAsmAssembler *scAsmAssembler::Instance()
 {
-    static scAsmAssembler inst;
-    return &inst;
+    if (!inst) inst = new scAsmAssembler;
+    return inst;
+}
+void scAsmAssembler::Reset()
+{
+    delete inst;
+    inst = NULL;
 }
 
 bool scAsmAssembler::AsmLexer::IsSpecial(int p)
 {
-	assert(p <= (int)text[ln].length());
-	return !!strchr("#@$:()\"", text[ln][p]);
+	assert(p <= (int)src->text[ln].length());
+	return !!strchr("#@$:()\"", src->text[ln][p]);
 }
 bool scAsmAssembler::AsmLexer::IsSpace(int p)
 {
-	assert(p <= (int)text[ln].length());
-	return text[ln][p] == ',' || isspace((unsigned char)text[ln][p]);
+	assert(p <= (int)src->text[ln].length());
+	return src->text[ln][p] == ',' || isspace((unsigned char)src->text[ln][p]);
 }
 bool scAsmAssembler::AsmLexer::IsLineComment(int p)
 {
-	assert(p <= (int)text[ln].length());
-	return text[ln][p] == '/' && text[ln][p + 1] == '/';
+	assert(p <= (int)src->text[ln].length());
+	return src->text[ln][p] == '/' && src->text[ln][p + 1] == '/';
 }
 bool scAsmAssembler::AsmLexer::IsBlockCommentBegin(int p)
 {
-	assert(p <= (int)text[ln].length());
-	return text[ln][p] == '/' && text[ln][p + 1] == '*';
+	assert(p <= (int)src->text[ln].length());
+	return src->text[ln][p] == '/' && src->text[ln][p + 1] == '*';
 }
 bool scAsmAssembler::AsmLexer::IsBlockCommentEnd(int p)
 {
-	assert(p <= (int)text[ln].length());
-	return text[ln][p] == '*' && text[ln][p + 1] == '/';
+	assert(p <= (int)src->text[ln].length());
+	return src->text[ln][p] == '*' && src->text[ln][p + 1] == '/';
 }
 
 void scAsmAssembler::AsmLexer::SkipSpace()
 {
-	if (col < (int)text[ln].length()) {
+	if (col < (int)src->text[ln].length()) {
 		while (IsSpace(col)) col++;
-		if (IsLineComment(col)) col = text[ln].length();
+		if (IsLineComment(col)) col = src->text[ln].length();
 		if (IsBlockCommentBegin(col)) {
 			AsmToken t = MakeEmptyTokenAtCurrentPosition();
 			while (1) {
@@ -45,8 +51,8 @@ void scAsmAssembler::AsmLexer::SkipSpace()
 					break;
 				}
 				col++;
-				if (col >= text[ln].length()) {
-					t.ecol = text[ln].length() - 1;
+				if (col >= src->text[ln].length()) {
+					t.ecol = src->text[ln].length() - 1;
 					scAsmAssembler::Instance()->ReportError(LVL_ERROR, t, "עûнֵ֧ڿעͣ");
 					break;
 				}
@@ -66,14 +72,14 @@ int scAsmAssembler::AsmToken::GetParamType()
 	default: return VAR_NONE;
 	}
 }
-std::shared_ptr<scAsmAssembler::CodeBuffer::BufferItem> scAsmAssembler::AsmToken::GetParamValue(AsmBlock &block)
+scAsmAssembler::BufferItemPtr scAsmAssembler::AsmToken::GetParamValue(AsmBlock &block)
 {
 	switch (type) {
-	case TOK_FLOAT: return scAsmAssembler::Instance()->code.NewItem()->SetValue<float>(fvalue);
-	case TOK_INT: return scAsmAssembler::Instance()->code.NewItem()->SetValue<int>(ivalue);
-	case TOK_VAR: return scAsmAssembler::Instance()->code.NewItem()->SetValue<WORD>(block.GetUserVarID(*this));
-	case TOK_LOC: return scAsmAssembler::Instance()->code.NewItem()->SetValue<DWORD>(0, CodeBuffer::RELOC_DIFFERENCE, block.codebegin, block.FindLabel(*this));
-	case TOK_STR: return scAsmAssembler::Instance()->code.NewItem()->SetValue<WORD>((WORD)(svalue.length() + 1))->AppendData(svalue.c_str(), svalue.length() + 1);;
+	case TOK_FLOAT: return scAsmAssembler::Instance()->code.NewItem().SetValue<float>(fvalue);
+	case TOK_INT: return scAsmAssembler::Instance()->code.NewItem().SetValue<int>(ivalue);
+	case TOK_VAR: return scAsmAssembler::Instance()->code.NewItem().SetValue<WORD>(block.GetUserVarID(*this));
+	case TOK_LOC: return scAsmAssembler::Instance()->code.NewItem().SetValue<DWORD>(0, CodeBuffer::RELOC_DIFFERENCE, block.codebegin, block.FindLabel(*this));
+	case TOK_STR: return scAsmAssembler::Instance()->code.NewItem().SetValue<WORD>((WORD)(svalue.length() + 1)).AppendData(svalue.c_str(), svalue.length() + 1);;
 	default: assert(0); return scAsmAssembler::Instance()->code.NewItem();
 	}
 }
@@ -89,17 +95,25 @@ void scAsmAssembler::AsmToken::Expect(TOKENTYPE expect_type)
 		}
 	}
 }
-void scAsmAssembler::AsmToken::Expect(const std::string &expect_svalue)
+void scAsmAssembler::AsmToken::Expect(const char *expect_svalue)
 {
-	if (svalue.compare(expect_svalue) != 0) {
+	if (strcmp(svalue.c_str(), expect_svalue) != 0) {
 		scAsmAssembler::Instance()->ReportError(LVL_ERROR, *this, "λòӦָõ");
 	}
 }
-void scAsmAssembler::AsmToken::Expect(TOKENTYPE expect_type, const std::string &expect_svalue)
+void scAsmAssembler::AsmToken::Expect(TOKENTYPE expect_type, const char *expect_svalue)
 {
 	Expect(expect_type);
 	Expect(expect_svalue);
 }
+const std::string &scAsmAssembler::AsmToken::GetFile() const
+{
+	return scAsmAssembler::Instance()->source[srcid]->txtfn;
+}
+const std::string &scAsmAssembler::AsmToken::GetLine() const
+{
+	return scAsmAssembler::Instance()->source[srcid]->text[ln];
+}
 void scAsmAssembler::AsmToken::MacroSubstitute(AsmToken &vtok)
 {
 	assert(type == TOK_IDENTIFIER);
@@ -171,8 +185,7 @@ void scAsmAssembler::AsmToken::PostProcess()
 scAsmAssembler::AsmToken scAsmAssembler::AsmLexer::MakeEmptyTokenAtCurrentPosition()
 {
 	AsmToken ret;
-	ret.txtfn = txtfn;
-	ret.txtline = text[ln];
+	ret.srcid = srcid;
 	ret.ln = ln;
 	ret.col = col;
 	ret.ecol = col;
@@ -184,7 +197,7 @@ scAsmAssembler::AsmToken scAsmAssembler::AsmLexer::NextToken(TOKENTYPE expect)
 		return inclexer->NextToken(expect);
 	}
 
-	std::string &line = text[ln];
+	std::string &line = src->text[ln];
 	SkipSpace();
 	assert(col <= (int)line.length());
 
@@ -250,7 +263,7 @@ bool scAsmAssembler::AsmLexer::NextLine()
 		return true;
 	}
 
-	if (ln + 1 >= (int) text.size()) {
+	if (ln + 1 >= (int) src->text.size()) {
 		return false;
 	}
 	ln++;
@@ -261,7 +274,7 @@ bool scAsmAssembler::AsmLexer::NextLine()
 std::string scAsmAssembler::AsmLexer::GetCurrentFile()
 {
 	if (inclexer) return inclexer->GetCurrentFile();
-	return txtfn;
+	return src->txtfn;
 }
 
 void scAsmAssembler::AsmLexer::IncludeFile(const std::string &incfile)
@@ -277,23 +290,28 @@ void scAsmAssembler::AsmLexer::IncludeFile(const std::string &incfile)
 
 void scAsmAssembler::AsmLexer::LoadFile(const std::string &txtfile)
 {
-	txtfn = txtfile;
+	auto &source = scAsmAssembler::Instance()->source;
+	source.push_back(std::make_unique<AsmSource>());
+	srcid = source.size() - 1;
+	src = source.back().get();
+	src->txtfn = txtfile;
 	
-	text.clear();
 	ln = col = 0;
 	FILE *fp = safe_fopen(txtfile.c_str(), "r");
-	int ch;
-	std::string buf;
-	while ((ch = fgetc(fp)) != EOF) {
-		if (ch == '\n') {
-			text.push_back(buf);
-			buf.clear();
-		} else {
-			buf += ch;
-		}
+	std::string data;
+	char buf[MAXLINE];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		data.append(buf, n);
 	}
-	if (!buf.empty()) text.push_back(buf);
 	fclose(fp);
+	src->hash = hashdata(data.data(), data.size());
+	size_t pos = 0, next;
+	while ((next = data.find('\n', pos)) != data.npos) {
+		src->text.push_back(data.substr(pos, next - pos));
+		pos = next + 1;
+	}
+	if (pos < data.size()) src->text.push_back(data.substr(pos));
 }
 
 void scAsmAssembler::ParseBlock(const AsmToken &begintok)
@@ -444,9 +462,46 @@ void scAsmAssembler::ParseSCE()
 
 scAsmAssembler::CodeBuffer::CodeBuffer() {}
 
-std::shared_ptr<scAsmAssembler::CodeBuffer::BufferItem> scAsmAssembler::CodeBuffer::NewItem()
+scAsmAssembler::BufferItemPtr scAsmAssembler::CodeBuffer::NewItem()
+{
+	item.push_back(BufferItem());
+	return ItemRef(this, item.size() - 1);
+}
+
+scAsmAssembler::BufferItemPtr scAsmAssembler::CodeBuffer::ItemRef::SetData(const void *newdata, unsigned newlen)
 {
-	return std::make_shared<BufferItem>();
+	BufferItem &it = buf->item[id];
+	if (newlen > it.len) {
+		// old space is left unused
+		it.offset = buf->pool.size();
+		buf->pool.resize(it.offset + newlen);
+	}
+	it.len = newlen;
+	if (newlen) memcpy(buf->pool.data() + it.offset, newdata, newlen);
+	return *this;
+}
+scAsmAssembler::BufferItemPtr scAsmAssembler::CodeBuffer::ItemRef::AppendData(const void *newdata, unsigned newlen)
+{
+	BufferItem &it = buf->item[id];
+	if (it.offset + it.len != buf->pool.size()) {
+		// move to end of pool, so it can grow
+		unsigned newoffset = buf->pool.size();
+		buf->pool.resize(newoffset + it.len);
+		if (it.len) memcpy(buf->pool.data() + newoffset, buf->pool.data() + it.offset, it.len);
+		it.offset = newoffset;
+	}
+	buf->pool.resize(it.offset + it.len + newlen);
+	if (newlen) memcpy(buf->pool.data() + it.offset + it.len, newdata, newlen);
+	it.len += newlen;
+	return *this;
+}
+scAsmAssembler::BufferItemPtr scAsmAssembler::CodeBuffer::ItemRef::SetReloc(RELOCTYPE rtype, ItemRef ptr, ItemRef ptr2)
+{
+	BufferItem &it = buf->item[id];
+	it.rtype = rtype;
+	it.ptr = ptr.id;
+	it.ptr2 = ptr2.id;
+	return *this;
 }
 
 
@@ -454,10 +509,11 @@ std::shared_ptr<scAsmAssembler::CodeBuffer::BufferItem> scAsmAssembler::CodeBuff
 void scAsmAssembler::CodeBuffer::Dump()
 {
 	unsigned addr = 0;
-	for (auto &item: code) {
+	for (int id: code) {
+		BufferItem &it = item[id];
 		printf("%08X: ", addr);
-		for (unsigned char byte: item->data) {
-			printf("%02X ", (unsigned)byte);
+		for (unsigned i = 0; i < it.len; i++) {
+			printf("%02X ", (unsigned)pool[it.offset + i]);
 			addr++;
 		}
 		printf("\n");
@@ -466,35 +522,37 @@ void scAsmAssembler::CodeBuffer::Dump()
 void scAsmAssembler::CodeBuffer::AssignAddress()
 {
 	unsigned addr = 0;
-	for (auto &item: code) {
-		item->addr = addr;
-		addr += item->data.size();
+	for (int id: code) {
+		item[id].addr = addr;
+		addr += item[id].len;
 	}
 }
 void scAsmAssembler::CodeBuffer::Relocate()
 {
 	AssignAddress();
-	for (auto &item: code) {
+	for (int id: code) {
+		BufferItem &it = item[id];
+		unsigned char *data = pool.data() + it.offset;
 		unsigned value = 0;
-		switch (item->rtype) {
-		case RELOC_ABSOLUTE: value = item->ptr.lock()->addr; break;
-		case RELOC_DIFFERENCE: value = item->ptr2.lock()->addr - item->ptr.lock()->addr; break;
+		switch (it.rtype) {
+		case RELOC_ABSOLUTE: value = item[it.ptr].addr; break;
+		case RELOC_DIFFERENCE: value = item[it.ptr2].addr - item[it.ptr].addr; break;
 		default: continue;
 		}
 
-		switch (item->data.size()) {
+		switch (it.len) {
 		case 2: {
 			unsigned short x;
-			memcpy(&x, item->data.data(), 2);
+			memcpy(&x, data, 2);
 			x += value;
-			memcpy(item->data.data(), &x, 2);
+			memcpy(data, &x, 2);
 			break;
 		}
 		case 4: {
 			unsigned x;
-			memcpy(&x, item->data.data(), 4);
+			memcpy(&x, data, 4);
 			x += value;
-			memcpy(item->data.data(), &x, 4);
+			memcpy(data, &x, 4);
 			break;
 		}
 		default: assert(0);
@@ -504,35 +562,31 @@ void scAsmAssembler::CodeBuffer::Relocate()
 std::vector<unsigned char> scAsmAssembler::CodeBuffer::GetData()
 {
 	std::vector<unsigned char> r;
-	for (auto &item: code) {
-		for (unsigned char byte: item->data) {
-			r.push_back(byte);
-		}
+	for (int id: code) {
+		BufferItem &it = item[id];
+		r.insert(r.end(), pool.begin() + it.offset, pool.begin() + it.offset + it.len);
 	}
 	return r;
 }
 void scAsmAssembler::CodeBuffer::WriteFile(const char *outfile)
 {
+	std::vector<unsigned char> r = GetData();
 	FILE *fp = safe_fopen(outfile, "wb");
-	for (auto &item: code) {
-		for (unsigned char byte: item->data) {
-			fputc(byte, fp);
-		}
-	}
+	fwrite(r.data(), 1, r.size(), fp);
 	fclose(fp);
 }
 
-void scAsmAssembler::CodeBuffer::AppendItem(std::shared_ptr<BufferItem> item)
+void scAsmAssembler::CodeBuffer::AppendItem(ItemRef item)
 {
-	code.push_back(item);
+	code.push_back(item.GetID());
 }
 
 void scAsmAssembler::CodeBuffer::AppendData(const void *newdata, unsigned newlen)
 {
-	AppendItem(NewItem()->SetData(newdata, newlen));
+	AppendItem(NewItem().SetData(newdata, newlen));
 }
 
-std::shared_ptr<scAsmAssembler::CodeBuffer::BufferItem> scAsmAssembler::AsmBlock::NewLabel(const AsmToken &tok)
+scAsmAssembler::BufferItemPtr scAsmAssembler::AsmBlock::NewLabel(const AsmToken &tok)
 {
 	BufferItemPtr p = scAsmAssembler::Instance()->code.NewItem();
 	if (labelindex.insert(std::make_pair(tok.svalue, p)).second == false) {
@@ -540,7 +594,7 @@ std::shared_ptr<scAsmAssembler::CodeBuffer::BufferItem> scAsmAssembler::AsmBlock
 	}
 	return p;
 }
-std::shared_ptr<scAsmAssembler::CodeBuffer::BufferItem> scAsmAssembler::AsmBlock::FindLabel(AsmToken &tok)
+scAsmAssembler::BufferItemPtr scAsmAssembler::AsmBlock::FindLabel(AsmToken &tok)
 {
 	auto it = labelindex.find(tok.svalue);
 	if (it == labelindex.end()) {
@@ -581,11 +635,11 @@ void scAsmAssembler::ReportError(int level, const AsmToken &tok, const char *fmt
 }
 void scAsmAssembler::ReportError(int level, const AsmToken &tok, const char *fmt, va_list ap)
 {
-	if (tok.ln < 0 || tok.col < 0 || tok.ecol < 0) {
+	if (tok.srcid < 0 || tok.ln < 0 || tok.col < 0 || tok.ecol < 0) {
 		scAsmTool::ResetLoc();
 	} else {
-		scAsmTool::SetFile(getpathfilepart(tok.txtfn.c_str()));
-		scAsmTool::SetLine(tok.txtline);
+		scAsmTool::SetFile(getpathfilepart(tok.GetFile().c_str()));
+		scAsmTool::SetLine(tok.GetLine());
 		scAsmTool::SetLoc(tok.ln, tok.col, tok.ecol);
 	}
 	scAsmTool::ReportError(level, fmt, ap);
@@ -602,7 +656,7 @@ void scAsmAssembler::GenCode()
 	for (auto &curblock: block) {
 		curblock.blockbegin = code.NewItem();
 		code.AppendValue<DWORD>(curblock.id);
-		code.AppendItem(code.NewItem()->SetValue(0, CodeBuffer::RELOC_ABSOLUTE, curblock.blockbegin));
+		code.AppendItem(code.NewItem().SetValue(0, CodeBuffer::RELOC_ABSOLUTE, curblock.blockbegin));
 		char desc[64]; strncpy(desc, curblock.desc.data(), sizeof(desc)); desc[64 - 1] = 0;
 		code.AppendValue(desc);
 	}
@@ -632,7 +686,7 @@ void scAsmAssembler::GenCode()
 		// byte code
 		curblock.codebegin = code.NewItem();
 		curblock.codeend = code.NewItem();
-		code.AppendItem(code.NewItem()->SetValue(0, CodeBuffer::RELOC_DIFFERENCE, curblock.codebegin, curblock.codeend));
+		code.AppendItem(code.NewItem().SetValue(0, CodeBuffer::RELOC_DIFFERENCE, curblock.codebegin, curblock.codeend));
 		code.AppendItem(curblock.codebegin);
 
 		for (auto &instr: curblock.instr) { // create label items
@@ -667,7 +721,7 @@ void scAsmAssembler::GenCode()
 					} else if (it->type == TOK_LP) {
 						listflag--;
 						paramcnt++;
-						varnumitem->SetValue<WORD>(varnum);
+						varnumitem.SetValue<WORD>(varnum);
 					} else {
 						if (listflag == 0) {
 							paramcnt++;
@@ -687,7 +741,7 @@ void scAsmAssembler::GenCode()
 				for (auto rid: rparamflag) {
 					paramflag |= 1 << (paramcnt - rid);
 				}
-				paramflagitem->SetValue<WORD>(paramflag);
+				paramflagitem.SetValue<WORD>(paramflag);
 			}
 		}
 
@@ -708,6 +762,16 @@ void scAsmAssembler::DoAssemble(const char *asmfile)
 	printf(" ضλ ...\n");
 	code.Relocate();
 }
+void scAsmAssembler::GetDependency(std::vector<std::pair<std::string, unsigned long long> > &dep)
+{
+	std::set<std::string> seen;
+	dep.clear();
+	for (auto &s: source) {
+		if (seen.insert(s->txtfn).second) {
+			dep.push_back(std::make_pair(s->txtfn, s->hash));
+		}
+	}
+}
 void scAsmAssembler::AssembleSCE(const char *asmfile, const char *scefile)
 {
 	printf(" ڶ %s лಢ %s ...\n", asmfile, scefile);
@@ -9,52 +9,48 @@ class scAsmAssembler {
 			RELOC_ABSOLUTE,
 			RELOC_DIFFERENCE,
 		};
-		class BufferItem : public std::enable_shared_from_this<BufferItem> {
+		// all items are kept in one array, and refer to each other by index
+		// data of all items is kept in one byte pool
+		class BufferItem {
 		public:
 			unsigned addr = 0;
-			std::vector<unsigned char> data;
+			unsigned offset = 0, len = 0; // data in pool
 			RELOCTYPE rtype = RELOC_NONE;
-			std::weak_ptr<BufferItem> ptr, ptr2;
-			std::shared_ptr<BufferItem> SetData(const void *newdata, unsigned newlen)
-			{
-				data.resize(newlen);
-				memcpy(data.data(), newdata, newlen);
-				return shared_from_this();
-			}
-			std::shared_ptr<BufferItem> AppendData(const void *newdata, unsigned newlen)
-			{
-				size_t offset = data.size();
-				data.resize(offset + newlen);
-				memcpy(data.data() + offset, newdata, newlen);
-				return shared_from_this();
-			}
-			template<class T> std::shared_ptr<BufferItem> SetValue(const T &value)
+			int ptr = -1, ptr2 = -1;
+		};
+		class ItemRef {
+			CodeBuffer *buf = NULL;
+			int id = -1;
+		public:
+			ItemRef() {}
+			ItemRef(CodeBuffer *buf, int id) : buf(buf), id(id) {}
+			int GetID() const { return id; }
+			ItemRef SetData(const void *newdata, unsigned newlen);
+			ItemRef AppendData(const void *newdata, unsigned newlen);
+			ItemRef SetReloc(RELOCTYPE rtype, ItemRef ptr, ItemRef ptr2);
+			template<class T> ItemRef SetValue(const T &value)
 			{
-				data.resize(sizeof(T));
-				memcpy(data.data(), &value, sizeof(T));
-				return shared_from_this();
+				return SetData(&value, sizeof(T));
 			}
-			template<class T> std::shared_ptr<BufferItem> SetValue(const T &value, RELOCTYPE rtype, std::weak_ptr<BufferItem> ptr = std::weak_ptr<BufferItem>(), std::weak_ptr<BufferItem> ptr2 = std::weak_ptr<BufferItem>())
+			template<class T> ItemRef SetValue(const T &value, RELOCTYPE rtype, ItemRef ptr = ItemRef(), ItemRef ptr2 = ItemRef())
 			{
-				SetValue<T>(value);
-				this->rtype = rtype;
-				this->ptr = ptr;
-				this->ptr2 = ptr2;
-				return shared_from_this();
+				return SetData(&value, sizeof(T)).SetReloc(rtype, ptr, ptr2);
 			}
 		};
 	private:
-		std::list<std::shared_ptr<BufferItem> > code;
+		std::vector<BufferItem> item;
+		std::vector<unsigned char> pool;
+		std::vector<int> code; // item index, in output order
 
 		CodeBuffer(const CodeBuffer&) = delete;  
 		CodeBuffer& operator = (const CodeBuffer&) = delete;
 	public:
-		std::shared_ptr<BufferItem> NewItem();
-		void AppendItem(std::shared_ptr<BufferItem> item);
+		ItemRef NewItem();
+		void AppendItem(ItemRef item);
 		void AppendData(const void *newdata, unsigned newlen);
 		template<class T> void AppendValue(const T &data)
 		{
-			AppendItem(NewItem()->SetValue<T>(data));
+			AppendItem(NewItem().SetValue<T>(data));
 		}
 		void Dump();
 		void AssignAddress();
@@ -63,7 +59,7 @@ class scAsmAssembler {
 		void WriteFile(const char *outfile);
 		CodeBuffer();
 	};
-	typedef std::shared_ptr<CodeBuffer::BufferItem> BufferItemPtr;
+	typedef CodeBuffer::ItemRef BufferItemPtr;
 
 
 	enum TOKENTYPE {
@@ -86,10 +82,16 @@ class scAsmAssembler {
 		ANY_TOK, // any token match flag
 	};
 
-	class AsmToken {
+	// text of all loaded files, kept until assembler is destroyed
+	class AsmSource {
 	public:
 		std::string txtfn;
-		std::string txtline;
+		std::vector<std::string> text;
+		unsigned long long hash; // hash of file data, for build cache
+	};
+	class AsmToken {
+	public:
+		int srcid = -1; // index in source, text is not copied to every token
 		enum TOKENTYPE type = TOK_INVALID;
 		std::string svalue;
 		float fvalue = .0f;
@@ -100,8 +102,10 @@ class scAsmAssembler {
 		void PostProcess();
 		void Dump();
 		void Expect(TOKENTYPE expect_type);
-		void Expect(const std::string &expect_svalue);
-		void Expect(TOKENTYPE expect_type, const std::string &expect_svalue);
+		void Expect(const char *expect_svalue);
+		void Expect(TOKENTYPE expect_type, const char *expect_svalue);
+		const std::string &GetFile() const;
+		const std::string &GetLine() const;
 		int GetParamType();
 		BufferItemPtr GetParamValue(AsmBlock &block);
 	};
@@ -116,8 +120,8 @@ class scAsmAssembler {
 
 		void SkipSpace();
 
-		std::string txtfn;
-		std::vector<std::string> text;
+		int srcid = -1;
+		AsmSource *src = NULL;
 		std::string incfn;
 		std::unique_ptr<AsmLexer> inclexer;
 
@@ -171,6 +175,7 @@ class scAsmAssembler {
 		int GetUserVarID(AsmToken &tok);
 	};
 
+	std::vector<std::unique_ptr<AsmSource> > source;
 	AsmLexer lexer;
 	std::vector<AsmBlock> block;
 	CodeBuffer code;
@@ -189,10 +194,14 @@ public:
 	void AssembleSCE(const char *asmfile, const char *scefile);
 	void AssembleSCETest(const char *groundtruth, const char *asmfile);
 
+	// (file, hash) of all loaded source files, including included ones
+	void GetDependency(std::vector<std::pair<std::string, unsigned long long> > &dep);
+
 private:
 	scAsmAssembler() {}
 public:
 	scAsmAssembler(scAsmAssembler const&) = delete;
 	void operator=(scAsmAssembler const&) = delete;
 	static scAsmAssembler *Instance();
+	static void Reset();
 };
\ No newline at end of file
@@ -0,0 +1,412 @@
+#include "common.h"
+
+// batch mode
+//   many files are processed in one process, so command definitions are only built once
+//   list is a file list (same "X Y" as single file mode, one pair per line), or a directory
+//   (for directory, foobar.sce is paired with foobar.asm next to it, only /BD and /BT)
+//   with JOBS > 1, the list is split among JOBS child processes (item i goes to part i % JOBS),
+//   each child writes its output to BATCH_LOGFILE, and result lines are collected from these logs
+//
+// build cache (/BA with /CACHE FILE)
+//   for each file assembled without error, the output file and all source files it loaded
+//   (including #include'd ones) are recorded with their hashes in cache file,
+//   next time, files whose output and sources are all unchanged are skipped
+//   cache file is only read by children, and written by parent after all children exit
+//   cache file format:
+//     #CACHE VEROPT BUILT_ON    (whole cache is discarded if version option or tool build differs)
+//     > X
+//     < HASH Y
+//     = HASH FILE               (one line for each source file)
+//   paths are recorded as given, so same working directory should be used each time
+
+#define BATCH_LOGFILE "scAsmTool_batch_%d.log"
+#define BATCH_RESULT "#BATCH"
+#define BATCH_CACHED "#CACHED"
+#define BATCH_OUTPUT "#OUT"
+#define BATCH_DEPEND "#DEP"
+#define BATCH_MAXJOBS MAXIMUM_WAIT_OBJECTS
+
+enum scAsmBatch::BATCHMODE scAsmBatch::mode;
+std::vector<scAsmBatch::BatchItem> scAsmBatch::item;
+bool scAsmBatch::childflag;
+std::string scAsmBatch::cachefile;
+std::string scAsmBatch::cacheheader;
+std::map<std::string, scAsmBatch::CacheEntry> scAsmBatch::cache;
+
+bool scAsmBatch::IsBatchMode(const char *modeopt)
+{
+	return stricmp(modeopt, "/BD") == 0 || stricmp(modeopt, "/BA") == 0 || stricmp(modeopt, "/BT") == 0;
+}
+
+void scAsmBatch::LoadList(const char *listfile)
+{
+	FILE *fp = safe_fopen(listfile, "r");
+	char buf[MAXLINE];
+	while (fgets(buf, sizeof(buf), fp)) {
+		// tokens are separated by spaces, use quotes if path contains spaces
+		std::vector<std::string> tok;
+		char *p = buf;
+		while (1) {
+			while (*p && strchr(" \t\r\n", *p)) p++;
+			if (!*p || *p == ';') break;
+			std::string s;
+			if (*p == '"') {
+				for (p++; *p && *p != '"'; p++) s += *p;
+				if (*p) p++;
+			} else {
+				for (; *p && !strchr(" \t\r\n", *p); p++) s += *p;
+			}
+			tok.push_back(s);
+		}
+		if (tok.empty()) continue;
+		if (tok.size() != 2) {
+			scAsmTool::ReportError(LVL_FATAL, "бļʽ%s", buf);
+		}
+		BatchItem it;
+		it.x = tok[0];
+		it.y = tok[1];
+		item.push_back(it);
+	}
+	fclose(fp);
+}
+
+void scAsmBatch::LoadDirectory(const std::string &dir)
+{
+	WIN32_FIND_DATAA fd;
+	HANDLE hFind = FindFirstFileA((dir + "\\*").c_str(), &fd);
+	if (hFind == INVALID_HANDLE_VALUE) return;
+	std::vector<std::string> subdir;
+	do {
+		std::string path = dir + "\\" + fd.cFileName;
+		if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			if (strcmp(fd.cFileName, ".") != 0 && strcmp(fd.cFileName, "..") != 0) subdir.push_back(path);
+		} else {
+			size_t len = path.length();
+			if (len > 4 && stricmp(path.c_str() + len - 4, ".sce") == 0) {
+				BatchItem it;
+				it.x = path;
+				it.y = path.substr(0, len - 4) + ".asm";
+				item.push_back(it);
+			}
+		}
+	} while (FindNextFileA(hFind, &fd));
+	FindClose(hFind);
+	for (auto &d: subdir) LoadDirectory(d);
+}
+
+std::string scAsmBatch::CacheKey(const std::string &x)
+{
+	std::string key(x);
+	for (auto &c: key) {
+		if (c == '/') c = '\\';
+		else if (c >= 'A' && c <= 'Z') c = c - 'A' + 'a';
+	}
+	return key;
+}
+
+void scAsmBatch::LoadCache(const char *veropt)
+{
+	cacheheader = std::string("#CACHE ") + veropt + " " + built_on;
+	FILE *fp = fopen(cachefile.c_str(), "r");
+	if (!fp) return;
+	char buf[MAXLINE];
+	bool valid = false;
+	CacheEntry *cur = NULL;
+	while (fgets(buf, sizeof(buf), fp)) {
+		char *p = strpbrk(buf, "\r\n");
+		if (p) *p = '\0';
+		if (!valid) {
+			valid = strcmp(buf, cacheheader.c_str()) == 0;
+			if (!valid) break;
+			continue;
+		}
+		if (buf[0] == '>' && buf[1] == ' ') {
+			std::string x(buf + 2);
+			cur = &cache[CacheKey(x)];
+			*cur = CacheEntry();
+			cur->x = x;
+		} else if (cur && (buf[0] == '<' || buf[0] == '=') && buf[1] == ' ') {
+			unsigned long long hash;
+			int n = 0;
+			if (sscanf(buf + 2, "%llx %n", &hash, &n) < 1 || n == 0) continue;
+			if (buf[0] == '<') {
+				cur->y = buf + 2 + n;
+				cur->yhash = hash;
+			} else {
+				cur->dep.push_back(std::make_pair(std::string(buf + 2 + n), hash));
+			}
+		}
+	}
+	fclose(fp);
+	if (!valid) {
+		printf(" ļ %s 뵱ǰ汾ȫ»\n\n", cachefile.c_str());
+		cache.clear();
+	}
+}
+
+void scAsmBatch::SaveCache()
+{
+	// entries of files not in current list are kept
+	for (auto &it: item) {
+		if (it.cached) continue;
+		std::string key = CacheKey(it.x);
+		if (it.done && it.errcnt == 0 && !it.result.dep.empty()) {
+			cache[key] = it.result;
+		} else {
+			cache.erase(key);
+		}
+	}
+
+	FILE *fp = fopen(cachefile.c_str(), "w");
+	if (!fp) {
+		scAsmTool::ReportError(LVL_ERROR, "޷д뻺ļ '%s'", cachefile.c_str());
+		return;
+	}
+	fprintf(fp, "%s\n", cacheheader.c_str());
+	for (auto &c: cache) {
+		CacheEntry &e = c.second;
+		fprintf(fp, "> %s\n", e.x.c_str());
+		fprintf(fp, "< %016llx %s\n", e.yhash, e.y.c_str());
+		for (auto &d: e.dep) {
+			fprintf(fp, "= %016llx %s\n", d.second, d.first.c_str());
+		}
+	}
+	fclose(fp);
+}
+
+bool scAsmBatch::IsUpToDate(const BatchItem &it)
+{
+	auto c = cache.find(CacheKey(it.x));
+	if (c == cache.end()) return false;
+	const CacheEntry &e = c->second;
+	unsigned long long hash;
+	if (e.dep.empty() || CacheKey(e.y) != CacheKey(it.y)) return false;
+	if (!hashfile(it.y.c_str(), "rb", &hash) || hash != e.yhash) return false;
+	for (auto &d: e.dep) {
+		// same mode as AsmLexer::LoadFile()
+		if (!hashfile(d.first.c_str(), "r", &hash) || hash != d.second) return false;
+	}
+	return true;
+}
+
+void scAsmBatch::RunItem(int id)
+{
+	BatchItem &it = item[id];
+	if (mode == MODE_A && !cachefile.empty() && IsUpToDate(it)) {
+		printf(" %s ļδı䣬\n", it.x.c_str());
+		it.done = it.cached = true;
+		if (childflag) printf("%s %d\n", BATCH_CACHED, id);
+		printf("%s %d 0 0 %s\n\n", BATCH_RESULT, id, it.x.c_str());
+		fflush(stdout);
+		return;
+	}
+
+	scAsmTool::ResetCnt();
+	scAsmTool::ResetLoc();
+	scAsmTool::batchflag = true;
+	try {
+		switch (mode) {
+			case MODE_D: scAsmDisassembler::Instance()->DisassembleSCE(it.x.c_str(), it.y.c_str()); break;
+			case MODE_A: scAsmAssembler::Instance()->AssembleSCE(it.x.c_str(), it.y.c_str()); break;
+			case MODE_T: scAsmAssembler::Instance()->AssembleSCETest(it.x.c_str(), it.y.c_str()); break;
+		}
+	} catch (scAsmTool::BatchAbort &) {
+		// error messages are already printed
+	}
+	scAsmTool::batchflag = false;
+
+	// record dependencies for build cache, before assembler state is gone
+	if (mode == MODE_A && !cachefile.empty() && scAsmTool::GetErrorCnt() == 0) {
+		CacheEntry &r = it.result;
+		r.x = it.x;
+		r.y = it.y;
+		scAsmAssembler::Instance()->GetDependency(r.dep);
+		if (!hashfile(it.y.c_str(), "rb", &r.yhash)) r.dep.clear();
+		if (childflag && !r.dep.empty()) {
+			printf("%s %d %016llx\n", BATCH_OUTPUT, id, r.yhash);
+			for (auto &d: r.dep) {
+				printf("%s %d %016llx %s\n", BATCH_DEPEND, id, d.second, d.first.c_str());
+			}
+		}
+	}
+
+	// each file starts with fresh state
+	scAsmDisassembler::Reset();
+	scAsmAssembler::Reset();
+
+	it.done = true;
+	it.errcnt = scAsmTool::GetErrorCnt();
+	it.warncnt = scAsmTool::GetWarnCnt();
+	printf("%s %d %d %d %s\n\n", BATCH_RESULT, id, it.errcnt, it.warncnt, it.x.c_str());
+	fflush(stdout);
+	scAsmTool::ResetCnt();
+}
+
+void scAsmBatch::RunPart(int part, int jobs)
+{
+	for (int i = part; i < (int) item.size(); i += jobs) {
+		RunItem(i);
+	}
+}
+
+void scAsmBatch::RunJobs(const char *veropt, const char *modeopt, const char *list, int jobs)
+{
+	char exepath[MAX_PATH];
+	GetModuleFileNameA(NULL, exepath, sizeof(exepath));
+
+	std::vector<HANDLE> proc;
+	for (int i = 0; i < jobs; i++) {
+		char logfile[MAXLINE];
+		sprintf(logfile, BATCH_LOGFILE, i);
+		SECURITY_ATTRIBUTES sa = { sizeof(sa), NULL, TRUE };
+		HANDLE hLog = CreateFileA(logfile, GENERIC_WRITE, FILE_SHARE_READ, &sa, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (hLog == INVALID_HANDLE_VALUE) {
+			scAsmTool::ReportError(LVL_FATAL, "޷־ļ '%s'", logfile);
+		}
+
+		std::string cmd = std::string("\"") + exepath + "\" " + veropt + " " + modeopt + " \"" + list + "\" " + std::to_string(jobs) + " /PART " + std::to_string(i);
+		if (!cachefile.empty()) cmd += " /CACHE \"" + cachefile + "\"";
+		if (scAsmTool::dbgflag) cmd += " /DBG";
+		std::vector<char> cmdbuf(cmd.begin(), cmd.end());
+		cmdbuf.push_back('\0');
+
+		STARTUPINFOA si;
+		PROCESS_INFORMATION pi;
+		memset(&si, 0, sizeof(si));
+		si.cb = sizeof(si);
+		si.dwFlags = STARTF_USESTDHANDLES;
+		si.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+		si.hStdOutput = hLog;
+		si.hStdError = hLog;
+		if (!CreateProcessA(NULL, cmdbuf.data(), NULL, NULL, TRUE, 0, NULL, NULL, &si, &pi)) {
+			scAsmTool::ReportError(LVL_FATAL, "޷ӽ̣%s", cmd.c_str());
+		}
+		CloseHandle(pi.hThread);
+		CloseHandle(hLog);
+		proc.push_back(pi.hProcess);
+	}
+	WaitForMultipleObjects(proc.size(), proc.data(), TRUE, INFINITE);
+	for (auto h: proc) CloseHandle(h);
+
+	for (int i = 0; i < jobs; i++) {
+		char logfile[MAXLINE];
+		sprintf(logfile, BATCH_LOGFILE, i);
+		ReadLog(logfile);
+	}
+}
+
+void scAsmBatch::ReadLog(const char *logfile)
+{
+	FILE *fp = fopen(logfile, "r");
+	if (!fp) return;
+	char buf[MAXLINE];
+	while (fgets(buf, sizeof(buf), fp)) {
+		int id, errcnt, warncnt;
+		unsigned long long hash;
+		int n = 0;
+		char *p = strpbrk(buf, "\r\n");
+		if (p) *p = '\0';
+		if (strncmp(buf, BATCH_CACHED " ", strlen(BATCH_CACHED) + 1) == 0) {
+			if (sscanf(buf + strlen(BATCH_CACHED), "%d", &id) == 1 && id >= 0 && id < (int) item.size()) item[id].cached = true;
+			continue;
+		}
+		if (strncmp(buf, BATCH_OUTPUT " ", strlen(BATCH_OUTPUT) + 1) == 0) {
+			if (sscanf(buf + strlen(BATCH_OUTPUT), "%d %llx", &id, &hash) == 2 && id >= 0 && id < (int) item.size()) {
+				item[id].result.x = item[id].x;
+				item[id].result.y = item[id].y;
+				item[id].result.yhash = hash;
+			}
+			continue;
+		}
+		if (strncmp(buf, BATCH_DEPEND " ", strlen(BATCH_DEPEND) + 1) == 0) {
+			if (sscanf(buf + strlen(BATCH_DEPEND), "%d %llx %n", &id, &hash, &n) >= 2 && n > 0 && id >= 0 && id < (int) item.size()) {
+				item[id].result.dep.push_back(std::make_pair(std::string(buf + strlen(BATCH_DEPEND) + n), hash));
+			}
+			continue;
+		}
+		if (strncmp(buf, BATCH_RESULT " ", strlen(BATCH_RESULT) + 1) != 0) continue;
+		if (sscanf(buf + strlen(BATCH_RESULT), "%d %d %d", &id, &errcnt, &warncnt) != 3) continue;
+		if (id < 0 || id >= (int) item.size()) continue;
+		item[id].done = true;
+		item[id].errcnt = errcnt;
+		item[id].warncnt = warncnt;
+	}
+	fclose(fp);
+}
+
+void scAsmBatch::Summary(int jobs, DWORD elapsed)
+{
+	int nok = 0, nfail = 0, nwarn = 0, ncached = 0;
+	for (auto &it: item) {
+		if (it.done && it.errcnt == 0) nok++; else nfail++;
+		if (it.cached) ncached++;
+		nwarn += it.warncnt;
+	}
+	printf("  %d ļɹ %d ʧ %d  %d %d ̣ʱ %.3f 룩\n", (int) item.size(), nok, nfail, nwarn, jobs, elapsed / 1000.0);
+	if (!cachefile.empty()) printf("  %d ļδı䣬\n", ncached);
+	if (jobs > 1) printf(" ļϸ " BATCH_LOGFILE " ־ļ\n", 0);
+	printf("\n");
+
+	scAsmTool::ResetCnt();
+	scAsmTool::ResetLoc();
+	for (size_t i = 0; i < item.size(); i++) {
+		BatchItem &it = item[i];
+		if (!it.done) {
+			scAsmTool::ReportError(LVL_ERROR, "δɣ%sӽ %d 쳣˳", it.x.c_str(), (int) i % jobs);
+		} else if (it.errcnt > 0) {
+			scAsmTool::ReportError(LVL_ERROR, "ʧܣ%s%d %d 棩", it.x.c_str(), it.errcnt, it.warncnt);
+		}
+	}
+}
+
+void scAsmBatch::Run(const char *veropt, const char *modeopt, const char *list, int jobs, int part, const char *cache)
+{
+	if (stricmp(modeopt, "/BD") == 0) mode = MODE_D;
+	else if (stricmp(modeopt, "/BA") == 0) mode = MODE_A;
+	else mode = MODE_T;
+
+	childflag = part >= 0;
+	if (cache) {
+		if (mode != MODE_A) {
+			scAsmTool::ReportError(LVL_FATAL, "/CACHE ֻ /BA");
+		}
+		cachefile = cache;
+		LoadCache(veropt);
+	}
+
+	DWORD attr = GetFileAttributesA(list);
+	if (attr != INVALID_FILE_ATTRIBUTES && (attr & FILE_ATTRIBUTE_DIRECTORY)) {
+		if (mode == MODE_A) {
+			scAsmTool::ReportError(LVL_FATAL, "Ŀ¼ֻ /BD  /BT/BA ʹбļ");
+		}
+		std::string dir(list);
+		while (!dir.empty() && (dir.back() == '\\' || dir.back() == '/')) dir.pop_back();
+		LoadDirectory(dir);
+		std::sort(item.begin(), item.end(), [](const BatchItem &a, const BatchItem &b) { return stricmp(a.x.c_str(), b.x.c_str()) < 0; });
+	} else {
+		LoadList(list);
+	}
+
+	if (part >= 0) {
+		// child process, run our part only
+		RunPart(part, jobs);
+		return;
+	}
+
+	if (jobs <= 0) {
+		SYSTEM_INFO si;
+		GetSystemInfo(&si);
+		jobs = si.dwNumberOfProcessors;
+	}
+	jobs = std::max(1, std::min(std::min(jobs, (int) item.size()), BATCH_MAXJOBS));
+
+	printf(" ģʽ %d ļʹ %d  ...\n\n", (int) item.size(), jobs);
+	DWORD st = GetTickCount();
+	if (jobs == 1) {
+		RunPart(0, 1);
+	} else {
+		RunJobs(veropt, modeopt, list, jobs);
+	}
+	Summary(jobs, GetTickCount() - st);
+	if (!cachefile.empty()) SaveCache();
+}
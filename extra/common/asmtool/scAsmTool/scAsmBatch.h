@@ -0,0 +1,46 @@
+#pragma once
+
+class scAsmBatch {
+	enum BATCHMODE {
+		MODE_D,
+		MODE_A,
+		MODE_T,
+	};
+	typedef std::vector<std::pair<std::string, unsigned long long> > DepList;
+	class CacheEntry {
+	public:
+		std::string x, y;
+		unsigned long long yhash = 0;
+		DepList dep;
+	};
+	class BatchItem {
+	public:
+		std::string x, y;
+		bool done = false;
+		bool cached = false; // up to date, not assembled again
+		int errcnt = 0, warncnt = 0;
+		CacheEntry result; // valid if assembled without error
+	};
+	static enum BATCHMODE mode;
+	static std::vector<BatchItem> item;
+	static bool childflag;
+	static std::string cachefile;
+	static std::string cacheheader;
+	static std::map<std::string, CacheEntry> cache;
+
+	static void LoadList(const char *listfile);
+	static void LoadDirectory(const std::string &dir);
+	static void RunItem(int id);
+	static void RunPart(int part, int jobs);
+	static void RunJobs(const char *veropt, const char *modeopt, const char *list, int jobs);
+	static void ReadLog(const char *logfile);
+	static void Summary(int jobs, DWORD elapsed);
+
+	static std::string CacheKey(const std::string &x);
+	static void LoadCache(const char *veropt);
+	static void SaveCache();
+	static bool IsUpToDate(const BatchItem &it);
+public:
+	static void Run(const char *veropt, const char *modeopt, const char *list, int jobs, int part, const char *cache);
+	static bool IsBatchMode(const char *modeopt);
+};
@@ -8,15 +8,27 @@ const char *scCmdDef::GetCmdName()
 	if (cmdname && strncmp(cmdname, "cmd_", 4) == 0) cmdname += 4;
 	return cmdname;
 }
+static std::string cmdname_key(const char *cmdname)
+{
+	std::string key(cmdname);
+	for (auto &ch: key) ch = tolower((unsigned char) ch);
+	return key;
+}
 int scCmdDef::GetCmdID(const char *cmdname)
 {
-	for (int i = 0; i < SC_MAX_CMD; i++) {
-		scCmdDef &cmddef = GetCmdDef(i);
-		const char *curcmdname = cmddef.GetCmdName();
-		if (curcmdname == NULL) continue;
-		if (stricmp(curcmdname, cmdname) == 0) return i;
+	// index is built on first call, definitions don't change after InitCmdDef_*()
+	//   first match wins, same as linear search
+	static std::map<std::string, int> cmdindex;
+	if (cmdindex.empty()) {
+		for (int i = 0; i < SC_MAX_CMD; i++) {
+			scCmdDef &cmddef = GetCmdDef(i);
+			const char *curcmdname = cmddef.GetCmdName();
+			if (curcmdname == NULL) continue;
+			cmdindex.insert(std::make_pair(cmdname_key(curcmdname), i));
+		}
 	}
-	return -1;
+	auto it = cmdindex.find(cmdname_key(cmdname));
+	return it != cmdindex.end() ? it->second : -1;
 }
 scCmdDef &scCmdDef::GetCmdDef(int id)
 {
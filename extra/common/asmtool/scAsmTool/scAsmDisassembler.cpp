@@ -1,8 +1,14 @@
 #include "common.h"
+static scAsmDisassembler *inst = NULL;
 scAsmDisassembler *scAsmDisassembler::Instance()
 {
-    static scAsmDisassembler inst;
-    return &inst;
+    if (!inst) inst = new scAsmDisassembler;
+    return inst;
+}
+void scAsmDisassembler::Reset()
+{
+    delete inst;
+    inst = NULL;
 }
 void scAsmDisassembler::ReadSCEFile(const char *scefile)
 {
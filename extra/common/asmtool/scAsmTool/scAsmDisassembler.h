@@ -100,4 +100,5 @@ public:
 	scAsmDisassembler(scAsmDisassembler const&) = delete;
 	void operator=(scAsmDisassembler const&) = delete;
 	static scAsmDisassembler *Instance();
+	static void Reset();
 };
\ No newline at end of file
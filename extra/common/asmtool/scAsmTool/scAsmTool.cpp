@@ -7,6 +7,7 @@ std::string scAsmTool::fn("<unknown>");
 std::string scAsmTool::line;
 int scAsmTool::msgcnt[LVL_MAX] = {};
 bool scAsmTool::dbgflag = false;
+bool scAsmTool::batchflag = false;
 
 void scAsmTool::SetLine(const std::string &line)
 {
@@ -75,9 +76,14 @@ int scAsmTool::GetWarnCnt()
 {
 	return msgcnt[LVL_WARN];
 }
+void scAsmTool::ResetCnt()
+{
+	for (int i = 0; i < LVL_MAX; i++) msgcnt[i] = 0;
+}
 
 __declspec(noreturn) void scAsmTool::die(int exitcode)
 {
+	if (batchflag) throw BatchAbort();
 	//assert(exitcode == 0);
 	if (!exitcode) printf(" -- ɹ --");
 	if (exitcode) printf(" -- ʧܣ %d --", exitcode);
@@ -28,8 +28,13 @@ public:
 	static int GetErrorCnt();
 	static int GetWarnCnt();
 
+	static void ResetCnt();
+
+	// in batch mode, die() throws BatchAbort instead of exiting, so next file can go on
+	class BatchAbort {};
 	__declspec(noreturn) static void die(int exitcode);
 	static std::string cmdline;
 	static bool dbgflag;
+	static bool batchflag;
 };
 
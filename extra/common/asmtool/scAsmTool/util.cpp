@@ -34,4 +34,30 @@ const char *getpathfilepart(const char *path)
 	if (strrchr(path, '\\')) path = strrchr(path, '\\') + 1;
 	if (strrchr(path, '/')) path = strrchr(path, '/') + 1;
 	return path;
-}
\ No newline at end of file
+}
+
+// FNV-1a, used by build cache to detect changed files
+unsigned long long hashdata(const void *ptr, size_t len, unsigned long long hash)
+{
+	const unsigned char *p = (const unsigned char *) ptr;
+	if (hash == 0) hash = 0xCBF29CE484222325ULL;
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+bool hashfile(const char *path, const char *mode, unsigned long long *hash)
+{
+	FILE *fp = fopen(path, mode);
+	if (!fp) return false;
+	char buf[MAXLINE];
+	size_t n;
+	*hash = hashdata(NULL, 0);
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		*hash = hashdata(buf, n, *hash);
+	}
+	fclose(fp);
+	return true;
+}
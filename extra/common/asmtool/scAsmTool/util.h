@@ -12,3 +12,6 @@ extern int _safe_fseek(FILE *stream, long offset, int whence, const char *msg);
 #define safe_fseek(stream, offset, whence) _safe_fseek(stream, offset, whence, "fseek(" #stream ", " #offset ", " #whence ")")
 
 extern const char *getpathfilepart(const char *path);
+
+extern unsigned long long hashdata(const void *ptr, size_t len, unsigned long long hash = 0);
+extern bool hashfile(const char *path, const char *mode, unsigned long long *hash);
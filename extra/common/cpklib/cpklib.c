@@ -0,0 +1,464 @@
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpklib.h"
+
+// gbCrc32 implementation
+//   same algorithm as engine, but 8 bytes are processed at once (slice-by-8)
+//   SliceTbl[n][b] is the state after n + 1 steps starting from b << 24 with zero data
+static unsigned CrcTbl[0x100];
+static unsigned SliceTbl[8][0x100];
+void cpk_crc32_init(void)
+{
+	unsigned v0 = 0;
+	unsigned *v1 = CrcTbl;
+	unsigned v2;
+	unsigned v3;
+	do {
+		v2 = 8;
+		v3 = v0 << 24;
+		do {
+			if (v3 & 0x80000000) {
+				v3 = 2 * v3 ^ 0x04C11DB7;
+			} else {
+				v3 *= 2;
+			}
+			--v2;
+		} while (v2);
+		*v1 = v3;
+		++v1;
+		++v0;
+	} while (v1 < CrcTbl + 0x100);
+	int i, n;
+	for (i = 0; i < 0x100; i++) {
+		SliceTbl[0][i] = CrcTbl[i];
+	}
+	for (n = 1; n < 8; n++) {
+		for (i = 0; i < 0x100; i++) {
+			unsigned v = SliceTbl[n - 1][i];
+			SliceTbl[n][i] = CrcTbl[v >> 24] ^ (v << 8);
+		}
+	}
+}
+
+unsigned cpk_crc32(const char *str)
+{
+	unsigned char *s = (unsigned char *) str;
+	int size = strlen(str);
+	unsigned x = 0;
+	int i;
+	for (i = 0; i < 4; i++) {
+		x = (x << 8);
+		if (i < size) x |= *s++;
+	}
+	x = ~x;
+	size -= 4;
+	while (size >= 8) {
+		x = SliceTbl[7][x >> 24] ^ SliceTbl[6][(x >> 16) & 0xFF] ^ SliceTbl[5][(x >> 8) & 0xFF] ^ SliceTbl[4][x & 0xFF]
+		  ^ SliceTbl[3][s[0]] ^ SliceTbl[2][s[1]] ^ SliceTbl[1][s[2]] ^ SliceTbl[0][s[3]]
+		  ^ ((unsigned) s[4] << 24 | (unsigned) s[5] << 16 | (unsigned) s[6] << 8 | s[7]);
+		s += 8;
+		size -= 8;
+	}
+	while (size-- > 0) {
+		x = CrcTbl[x >> 24] ^ (*s++ | (x << 8));
+	}
+	return ~x;
+}
+
+
+
+// LZO1X decompressor
+//   all reads and writes are bounds checked, so broken data can't crash us
+//   state is the number of literals after last match (4 means a long run),
+//   it decides the meaning of instructions below 16
+//   output and return value are same as the byte-by-byte version, but matches
+//   are copied with memcpy() or in 8-byte chunks when distance allows,
+//   nothing is written past the bytes which are really decoded
+//   PAL3patch/PAL3Apatch have a copy of this decoder in patch_cpklzo.c, keep them in sync
+//   lzotest.c checks this decoder against the byte-by-byte version
+#define LZO_NEED_IP(n) do { if ((unsigned) (ip_end - ip) < (unsigned) (n)) return 0; } while (0)
+#define LZO_NEED_OP(n) do { if ((unsigned) (op_end - op) < (unsigned) (n)) return 0; } while (0)
+#define LZO_COPY_LITERALS(n) do { LZO_NEED_IP(n); LZO_NEED_OP(n); memcpy(op, ip, n); op += n; ip += n; } while (0)
+
+static int lzo_extlen(const unsigned char **pip, const unsigned char *ip_end, unsigned *len)
+{
+    const unsigned char *ip = *pip;
+    unsigned t = *len;
+    while (1) {
+        LZO_NEED_IP(1);
+        if (*ip) break;
+        if (t > 0x7FFFFFFF) return 0;
+        t += 255;
+        ip++;
+    }
+    t += *ip++;
+    *pip = ip;
+    *len = t;
+    return 1;
+}
+
+int cpk_lzo1x_decompress(const unsigned char *in, unsigned in_len, unsigned char *out, unsigned *out_len)
+{
+    const unsigned char *ip = in, *ip_end = in + in_len;
+    unsigned char *op = out, *op_end = out + *out_len;
+    unsigned t, len, dist, word, state = 0;
+
+    LZO_NEED_IP(1);
+    if (*ip > 17) {
+        t = *ip++ - 17;
+        LZO_COPY_LITERALS(t);
+        state = t < 4 ? t : 4;
+    }
+
+    while (1) {
+        LZO_NEED_IP(1);
+        t = *ip++;
+        if (t < 16) {
+            if (state == 0) {
+                // long literal run
+                len = t;
+                if (len == 0) {
+                    len = 15;
+                    if (!lzo_extlen(&ip, ip_end, &len)) return 0;
+                }
+                len += 3;
+                LZO_COPY_LITERALS(len);
+                state = 4;
+                continue;
+            }
+            // short match, distance depends on state
+            LZO_NEED_IP(1);
+            if (state < 4) {
+                len = 2;
+                dist = (t >> 2) + (*ip++ << 2) + 1;
+            } else {
+                len = 3;
+                dist = (t >> 2) + (*ip++ << 2) + 2049;
+            }
+        } else if (t < 32) {
+            len = t & 7;
+            if (len == 0) {
+                len = 7;
+                if (!lzo_extlen(&ip, ip_end, &len)) return 0;
+            }
+            len += 2;
+            LZO_NEED_IP(2);
+            word = ip[0] | (ip[1] << 8);
+            ip += 2;
+            dist = ((t & 8) << 11) + (word >> 2);
+            if (dist == 0) {
+                // end of stream
+                break;
+            }
+            dist += 0x4000;
+            t = word;
+        } else if (t < 64) {
+            len = t & 31;
+            if (len == 0) {
+                len = 31;
+                if (!lzo_extlen(&ip, ip_end, &len)) return 0;
+            }
+            len += 2;
+            LZO_NEED_IP(2);
+            word = ip[0] | (ip[1] << 8);
+            ip += 2;
+            dist = (word >> 2) + 1;
+            t = word;
+        } else {
+            LZO_NEED_IP(1);
+            len = (t >> 5) + 1;
+            dist = ((t >> 2) & 7) + (*ip++ << 3) + 1;
+        }
+
+        // copy match, may overlap
+        //   an 8-byte chunk never reads bytes written by itself if distance is at least 8
+        if (dist > (unsigned) (op - out)) return 0;
+        LZO_NEED_OP(len);
+        const unsigned char *m_pos = op - dist;
+        if (dist >= len) {
+            memcpy(op, m_pos, len);
+            op += len;
+        } else if (dist >= 8) {
+            for (; len >= 8; len -= 8) {
+                memcpy(op, m_pos, 8);
+                op += 8;
+                m_pos += 8;
+            }
+            memcpy(op, m_pos, len);
+            op += len;
+        } else {
+            while (len--) *op++ = *m_pos++;
+        }
+
+        // copy trailing literals
+        state = t & 3;
+        if (state) LZO_COPY_LITERALS(state);
+    }
+
+    *out_len = op - out;
+    return 1;
+}
+
+
+
+// CPK reader
+int cpk_open(struct cpkarchive *cpk, const char *cpkfile)
+{
+    LARGE_INTEGER li;
+    SYSTEM_INFO si;
+    DWORD nread, tblsize;
+
+    memset(cpk, 0, sizeof(*cpk));
+    cpk->hFile = CreateFile(cpkfile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (cpk->hFile == INVALID_HANDLE_VALUE) {
+        cpk->hFile = NULL;
+        return 0;
+    }
+    if (!GetFileSizeEx(cpk->hFile, &li)) goto fail;
+    cpk->filesize = li.QuadPart;
+    GetSystemInfo(&si);
+    cpk->granularity = si.dwAllocationGranularity;
+
+    // read and check header
+    if (!ReadFile(cpk->hFile, &cpk->hdr, sizeof(cpk->hdr), &nread, NULL) || nread != sizeof(cpk->hdr)) goto fail;
+    if (cpk->hdr.dwLable != CPK_LABEL || cpk->hdr.dwValidTableNum > CPK_MAXTABLENUM) goto fail;
+    cpk->nr_tbl = cpk->hdr.dwValidTableNum;
+    tblsize = cpk->nr_tbl * sizeof(struct CPKTable);
+    if ((unsigned long long) cpk->hdr.dwTableStart + tblsize > cpk->filesize) goto fail;
+
+    cpk->hMapping = CreateFileMapping(cpk->hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!cpk->hMapping) goto fail;
+
+    // map whole file if possible, or read table and map entries one by one
+    cpk->view = MapViewOfFile(cpk->hMapping, FILE_MAP_READ, 0, 0, 0);
+    if (cpk->view) {
+        cpk->tbl = (const struct CPKTable *) (cpk->view + cpk->hdr.dwTableStart);
+    } else {
+        cpk->tblcopy = malloc(tblsize ? tblsize : 1);
+        if (!cpk->tblcopy) goto fail;
+        li.QuadPart = cpk->hdr.dwTableStart;
+        if (!SetFilePointerEx(cpk->hFile, li, NULL, FILE_BEGIN)) goto fail;
+        if (!ReadFile(cpk->hFile, cpk->tblcopy, tblsize, &nread, NULL) || nread != tblsize) goto fail;
+        cpk->tbl = cpk->tblcopy;
+    }
+    return 1;
+fail:
+    cpk_close(cpk);
+    return 0;
+}
+
+void cpk_close(struct cpkarchive *cpk)
+{
+    if (cpk->view) UnmapViewOfFile(cpk->view);
+    if (cpk->hMapping) CloseHandle(cpk->hMapping);
+    if (cpk->hFile) CloseHandle(cpk->hFile);
+    free(cpk->tblcopy);
+    memset(cpk, 0, sizeof(*cpk));
+}
+
+int cpk_is_valid(struct cpkarchive *cpk, int tindex)
+{
+    const struct CPKTable *t = &cpk->tbl[tindex];
+    return t->dwExtraInfoSize != 0 && (t->dwFlag & CPK_FLAG_VALID) && !(t->dwFlag & CPK_FLAG_DELETED);
+}
+
+int cpk_is_dir(struct cpkarchive *cpk, int tindex)
+{
+    // reference CPK::IsDir
+    return !!(cpk->tbl[tindex].dwFlag & CPK_FLAG_DIR);
+}
+
+int cpk_is_compressed(struct cpkarchive *cpk, int tindex)
+{
+    return !cpk_is_dir(cpk, tindex) && !(cpk->tbl[tindex].dwFlag & CPK_FLAG_NOTCOMPRESSED);
+}
+
+int cpk_find_crc(struct cpkarchive *cpk, unsigned crc)
+{
+    // table is sorted by CRC
+    int lo = 0, hi = cpk->nr_tbl;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cpk->tbl[mid].dwCRC < crc) lo = mid + 1; else hi = mid;
+    }
+    return lo < cpk->nr_tbl && cpk->tbl[lo].dwCRC == crc ? lo : -1;
+}
+
+int cpk_find(struct cpkarchive *cpk, const char *path)
+{
+    char buf[CPK_MAXPATH];
+    if (strlen(path) >= sizeof(buf)) return -1;
+    cpk_normalize_path(buf, path);
+    _strlwr(buf);
+    return cpk_find_crc(cpk, cpk_crc32(buf));
+}
+
+int cpk_map(struct cpkarchive *cpk, int tindex, struct cpkview *v)
+{
+    const struct CPKTable *t = &cpk->tbl[tindex];
+    unsigned long long begin = t->dwStartPos;
+    unsigned long long end = begin + t->dwPackedSize + t->dwExtraInfoSize;
+    if (end > cpk->filesize) return 0;
+
+    if (cpk->view) {
+        v->base = NULL;
+        v->data = cpk->view + begin;
+        return 1;
+    }
+
+    unsigned long long offset = begin / cpk->granularity * cpk->granularity;
+    SIZE_T size = end - offset;
+    v->base = MapViewOfFile(cpk->hMapping, FILE_MAP_READ, offset >> 32, offset & 0xFFFFFFFF, size ? size : 1);
+    if (!v->base) return 0;
+    v->data = (const unsigned char *) v->base + (begin - offset);
+    return 1;
+}
+
+void cpk_unmap(struct cpkview *v)
+{
+    if (v->base) UnmapViewOfFile(v->base);
+    v->base = NULL;
+    v->data = NULL;
+}
+
+// get name of entry, returns length of name, or -1 if failed
+int cpk_get_name(struct cpkarchive *cpk, int tindex, char *buf, int bufsize)
+{
+    const struct CPKTable *t = &cpk->tbl[tindex];
+    struct cpkview v;
+    int len;
+    if (!cpk_map(cpk, tindex, &v)) return -1;
+    const char *name = (const char *) v.data + t->dwPackedSize;
+    for (len = 0; len < (int) t->dwExtraInfoSize && name[len]; len++);
+    if (len < bufsize) {
+        memcpy(buf, name, len);
+        buf[len] = '\0';
+    } else {
+        len = -1;
+    }
+    cpk_unmap(&v);
+    return len;
+}
+
+// get full path of entry (without leading '\\'), returns length of path, or -1 if failed
+int cpk_get_path(struct cpkarchive *cpk, int tindex, char *buf, int bufsize)
+{
+    int stack[CPK_MAXPATH / 2];
+    int depth = 0, len = 0, n;
+
+    // walk up to root, depth is limited in case table is broken
+    while (1) {
+        if (depth >= (int) (sizeof(stack) / sizeof(stack[0]))) return -1;
+        stack[depth++] = tindex;
+        if (cpk->tbl[tindex].dwFatherCRC == 0) break;
+        tindex = cpk_find_crc(cpk, cpk->tbl[tindex].dwFatherCRC);
+        if (tindex < 0) return -1;
+    }
+
+    while (depth > 0) {
+        if (len > 0) {
+            if (len + 1 >= bufsize) return -1;
+            buf[len++] = '\\';
+        }
+        n = cpk_get_name(cpk, stack[--depth], buf + len, bufsize - len);
+        if (n < 0) return -1;
+        len += n;
+    }
+    if (len >= bufsize) return -1;
+    buf[len] = '\0';
+    return len;
+}
+
+// read whole entry into buffer, returns 1 if success
+//   bufsize should be at least dwOriginSize
+//   stored data is copied from view, compressed data is decompressed from view
+int cpk_read(struct cpkarchive *cpk, int tindex, void *buf, unsigned bufsize)
+{
+    const struct CPKTable *t = &cpk->tbl[tindex];
+    struct cpkview v;
+    unsigned size = t->dwOriginSize;
+    int ret;
+    if (bufsize < size) return 0;
+    if (!cpk_map(cpk, tindex, &v)) return 0;
+    if (cpk_is_compressed(cpk, tindex)) {
+        ret = cpk_lzo1x_decompress(v.data, t->dwPackedSize, buf, &size) && size == t->dwOriginSize;
+    } else {
+        ret = t->dwPackedSize == size;
+        if (ret) memcpy(buf, v.data, size);
+    }
+    cpk_unmap(&v);
+    return ret;
+}
+
+
+
+// CPK writer helpers
+
+// normalize separators to single '\\', leading and trailing ones are removed
+void cpk_normalize_path(char *buf, const char *path)
+{
+    char *dst = buf;
+    const char *src = path;
+    while (*src && strchr("/\\", *src)) src++;
+    while (*src) {
+        if (strchr("/\\", *src)) {
+            while (*src && strchr("/\\", *src)) src++;
+            if (*src) *dst++ = '\\';
+        } else {
+            *dst++ = *src++;
+        }
+    }
+    *dst = '\0';
+}
+
+// make extrainfo for name, buf should have strlen(name) + CPK_EXTRAINFO_PADSIZE bytes
+//   returns size of extrainfo
+int cpk_make_extrainfo(char *buf, const char *name)
+{
+    int len = strlen(name);
+    memcpy(buf, name, len);
+    memset(buf + len, 0, 2);
+    memset(buf + len + 2, 0xCC, CPK_EXTRAINFO_PADSIZE - 2);
+    return len + CPK_EXTRAINFO_PADSIZE;
+}
+
+static int tblcmp(const void *a, const void *b)
+{
+    const struct CPKTable *ta = a, *tb = b;
+    if (ta->dwCRC < tb->dwCRC) return -1;
+    if (ta->dwCRC > tb->dwCRC) return 1;
+    return 0;
+}
+
+// sort table by CRC, returns 0 if there are duplicate CRCs
+int cpk_sort_table(struct CPKTable *tbl, int nr_tbl)
+{
+    int i;
+    qsort(tbl, nr_tbl, sizeof(struct CPKTable), tblcmp);
+    for (i = 1; i < nr_tbl; i++) {
+        if (tbl[i - 1].dwCRC == tbl[i].dwCRC) return 0;
+    }
+    return 1;
+}
+
+// make header for archive with a full size table
+void cpk_make_header(struct CPKHeader *hdr, int nr_tbl, unsigned package_size)
+{
+    *hdr = (struct CPKHeader) {
+        .dwLable = CPK_LABEL,
+        .dwVersion = CPK_VERSION,
+        .dwTableStart = sizeof(struct CPKHeader),
+        .dwDataStart = sizeof(struct CPKHeader) + sizeof(struct CPKTable) * CPK_MAXTABLENUM,
+        .dwMaxFileNum = CPK_MAXTABLENUM,
+        .dwFileNum = nr_tbl,
+        .dwIsFormatted = 0,
+        .dwSizeOfHeader = sizeof(struct CPKHeader),
+        .dwValidTableNum = nr_tbl,
+        .dwMaxTableNum = CPK_MAXTABLENUM,
+        .dwFragmentNum = 0,
+        .dwPackageSize = package_size,
+    };
+    memset(hdr->dwReserved, 0, sizeof(hdr->dwReserved));
+}
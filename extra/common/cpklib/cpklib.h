@@ -0,0 +1,100 @@
+#ifndef PAL3PATCH_CPKLIB_H
+#define PAL3PATCH_CPKLIB_H
+
+// standalone CPK library for tools
+//   the archive is memory-mapped and parsed in place, GBENGINE.DLL is not needed
+//   entries are copied or decompressed from the mapped view directly into caller buffers
+//   an opened archive is read-only, so it can be shared by many threads
+//
+//   build: compile cpklib.c together with the tool, e.g. CL /O2 uncpk.c ..\cpklib\cpklib.c
+
+#include <windows.h>
+
+// these structures are read from PAL3A.PDB
+struct CPKHeader {
+    ULONG dwLable;
+    ULONG dwVersion;
+    ULONG dwTableStart;
+    ULONG dwDataStart;
+    ULONG dwMaxFileNum;
+    ULONG dwFileNum;
+    ULONG dwIsFormatted;
+    ULONG dwSizeOfHeader;
+    ULONG dwValidTableNum;
+    ULONG dwMaxTableNum;
+    ULONG dwFragmentNum;
+    ULONG dwPackageSize;
+    ULONG dwReserved[0x14];
+};
+struct CPKTable {
+    ULONG dwCRC;
+    ULONG dwFlag;
+    ULONG dwFatherCRC;
+    ULONG dwStartPos;
+    ULONG dwPackedSize;
+    ULONG dwOriginSize;
+    ULONG dwExtraInfoSize;
+};
+
+#define CPK_LABEL 0x1A545352
+#define CPK_VERSION 1
+#define CPK_MAXTABLENUM 0x8000
+#define CPK_MAXPATH 4096
+
+// table flags
+#define CPK_FLAG_VALID          0x00000001
+#define CPK_FLAG_DIR            0x00000002
+#define CPK_FLAG_DELETED        0x00000010
+#define CPK_FLAG_NOTCOMPRESSED  0x00010000
+
+// flags written by mkcpk
+#define CPK_TBLFLAG_FILE 0x00010005
+#define CPK_TBLFLAG_DIR  0x00000003
+
+// extrainfo is the name followed by padding (2 zeros and 0x38 bytes of 0xCC)
+#define CPK_EXTRAINFO_PADSIZE 0x3A
+
+struct cpkarchive {
+    HANDLE hFile;
+    HANDLE hMapping;
+    unsigned long long filesize;
+    DWORD granularity;
+    const unsigned char *view; // view of whole file, NULL if there is not enough address space
+    struct CPKHeader hdr;
+    const struct CPKTable *tbl; // points into view, or a private copy
+    struct CPKTable *tblcopy;
+    int nr_tbl;
+};
+
+// mapped data of one entry, packed data followed by extrainfo
+struct cpkview {
+    void *base; // view to unmap, NULL if data is in whole file view
+    const unsigned char *data;
+};
+
+// gbCrc32
+extern void cpk_crc32_init(void);
+extern unsigned cpk_crc32(const char *str);
+
+// reader
+extern int cpk_open(struct cpkarchive *cpk, const char *cpkfile);
+extern void cpk_close(struct cpkarchive *cpk);
+extern int cpk_is_valid(struct cpkarchive *cpk, int tindex);
+extern int cpk_is_dir(struct cpkarchive *cpk, int tindex);
+extern int cpk_is_compressed(struct cpkarchive *cpk, int tindex);
+extern int cpk_find_crc(struct cpkarchive *cpk, unsigned crc);
+extern int cpk_find(struct cpkarchive *cpk, const char *path);
+extern int cpk_map(struct cpkarchive *cpk, int tindex, struct cpkview *v);
+extern void cpk_unmap(struct cpkview *v);
+extern int cpk_get_name(struct cpkarchive *cpk, int tindex, char *buf, int bufsize);
+extern int cpk_get_path(struct cpkarchive *cpk, int tindex, char *buf, int bufsize);
+extern int cpk_read(struct cpkarchive *cpk, int tindex, void *buf, unsigned bufsize);
+extern int cpk_lzo1x_decompress(const unsigned char *in, unsigned in_len, unsigned char *out, unsigned *out_len);
+
+// writer helpers
+extern void cpk_normalize_path(char *buf, const char *path);
+extern int cpk_make_extrainfo(char *buf, const char *name);
+extern int cpk_sort_table(struct CPKTable *tbl, int nr_tbl);
+extern void cpk_make_header(struct CPKHeader *hdr, int nr_tbl, unsigned package_size);
+
+#endif
@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpklib.h"
+
+// build: CL /O2 lzotest.c cpklib.c
+// usage: lzotest [SEED] [CASES]
+//   checks cpk_lzo1x_decompress() against the plain byte-by-byte decoder below
+//   random valid LZO1X streams are generated, then mutated and decoded with
+//   exact, larger and smaller output buffers, return values and output must match,
+//   and nothing may be written past the decoded bytes
+
+
+
+// reference decoder, same as cpk_lzo1x_decompress() before chunked copies
+#define LZO_NEED_IP(n) do { if ((unsigned) (ip_end - ip) < (unsigned) (n)) return 0; } while (0)
+#define LZO_NEED_OP(n) do { if ((unsigned) (op_end - op) < (unsigned) (n)) return 0; } while (0)
+#define LZO_COPY_LITERALS(n) do { LZO_NEED_IP(n); LZO_NEED_OP(n); while (n--) *op++ = *ip++; } while (0)
+
+static int ref_extlen(const unsigned char **pip, const unsigned char *ip_end, unsigned *len)
+{
+    const unsigned char *ip = *pip;
+    unsigned t = *len;
+    while (1) {
+        LZO_NEED_IP(1);
+        if (*ip) break;
+        if (t > 0x7FFFFFFF) return 0;
+        t += 255;
+        ip++;
+    }
+    t += *ip++;
+    *pip = ip;
+    *len = t;
+    return 1;
+}
+
+static int ref_decompress(const unsigned char *in, unsigned in_len, unsigned char *out, unsigned *out_len)
+{
+    const unsigned char *ip = in, *ip_end = in + in_len;
+    unsigned char *op = out, *op_end = out + *out_len;
+    unsigned t, len, dist, word, state = 0;
+
+    LZO_NEED_IP(1);
+    if (*ip > 17) {
+        t = *ip++ - 17;
+        state = t < 4 ? t : 4;
+        LZO_COPY_LITERALS(t);
+    }
+
+    while (1) {
+        LZO_NEED_IP(1);
+        t = *ip++;
+        if (t < 16) {
+            if (state == 0) {
+                len = t;
+                if (len == 0) {
+                    len = 15;
+                    if (!ref_extlen(&ip, ip_end, &len)) return 0;
+                }
+                len += 3;
+                LZO_COPY_LITERALS(len);
+                state = 4;
+                continue;
+            }
+            LZO_NEED_IP(1);
+            if (state < 4) {
+                len = 2;
+                dist = (t >> 2) + (*ip++ << 2) + 1;
+            } else {
+                len = 3;
+                dist = (t >> 2) + (*ip++ << 2) + 2049;
+            }
+        } else if (t < 32) {
+            len = t & 7;
+            if (len == 0) {
+                len = 7;
+                if (!ref_extlen(&ip, ip_end, &len)) return 0;
+            }
+            len += 2;
+            LZO_NEED_IP(2);
+            word = ip[0] | (ip[1] << 8);
+            ip += 2;
+            dist = ((t & 8) << 11) + (word >> 2);
+            if (dist == 0) break;
+            dist += 0x4000;
+            t = word;
+        } else if (t < 64) {
+            len = t & 31;
+            if (len == 0) {
+                len = 31;
+                if (!ref_extlen(&ip, ip_end, &len)) return 0;
+            }
+            len += 2;
+            LZO_NEED_IP(2);
+            word = ip[0] | (ip[1] << 8);
+            ip += 2;
+            dist = (word >> 2) + 1;
+            t = word;
+        } else {
+            LZO_NEED_IP(1);
+            len = (t >> 5) + 1;
+            dist = ((t >> 2) & 7) + (*ip++ << 3) + 1;
+        }
+
+        if (dist > (unsigned) (op - out)) return 0;
+        LZO_NEED_OP(len);
+        const unsigned char *m_pos = op - dist;
+        while (len--) *op++ = *m_pos++;
+
+        state = t & 3;
+        if (state) {
+            len = state;
+            LZO_COPY_LITERALS(len);
+        }
+    }
+
+    *out_len = op - out;
+    return 1;
+}
+
+
+
+// random stream generator
+#define MAXSTREAM (1 << 20)
+#define GUARD 64
+
+static unsigned rnd_state;
+
+static unsigned rnd(unsigned n)
+{
+    rnd_state = rnd_state * 1103515245 + 12345;
+    return ((rnd_state >> 8) & 0xFFFFFF) % n;
+}
+
+static unsigned rnd_range(unsigned lo, unsigned hi)
+{
+    return lo + rnd(hi - lo + 1);
+}
+
+static unsigned umin(unsigned a, unsigned b)
+{
+    return a < b ? a : b;
+}
+
+// put n in extended length form, n > base
+static unsigned char *put_extlen(unsigned char *s, unsigned n, unsigned base)
+{
+    n -= base;
+    while (n > 255) {
+        *s++ = 0;
+        n -= 255;
+    }
+    *s++ = n;
+    return s;
+}
+
+static unsigned char *put_literals(unsigned char *s, unsigned n)
+{
+    while (n--) *s++ = rnd(256);
+    return s;
+}
+
+// returns stream length, decoded length is stored to *olen
+static unsigned gen_stream(unsigned char *buf, unsigned *olen)
+{
+    unsigned char *s = buf;
+    unsigned out = 0, state, n, k, d, x, len, tl, w;
+    int i, nr_insn;
+
+    // first literal run
+    if (rnd(10) < 7) {
+        n = rnd_range(1, 238);
+        *s++ = n + 17;
+        state = n < 4 ? n : 4;
+    } else {
+        n = rnd_range(4, 40);
+        if (n - 3 <= 15) {
+            *s++ = n - 3;
+        } else {
+            *s++ = 0;
+            s = put_extlen(s, n - 3, 15);
+        }
+        state = 4;
+    }
+    s = put_literals(s, n);
+    out += n;
+
+    nr_insn = rnd_range(1, 300);
+    for (i = 0; i < nr_insn; i++) {
+        if (state == 0 && (rnd(2) || out < 9)) {
+            // long literal run
+            n = rnd(2) ? rnd_range(4, 18) : rnd_range(19, 700);
+            if (n - 3 <= 15) {
+                *s++ = n - 3;
+            } else {
+                *s++ = 0;
+                s = put_extlen(s, n - 3, 15);
+            }
+            s = put_literals(s, n);
+            out += n;
+            state = 4;
+            continue;
+        }
+        tl = rnd(5);
+        if (tl) tl--;
+        k = rnd(100);
+        if (state > 0 && k < 15) {
+            // short match after literals
+            if (state < 4) {
+                d = rnd_range(1, umin(1024, out));
+                x = d - 1;
+                *s++ = ((x & 3) << 2) | tl;
+                *s++ = x >> 2;
+                out += 2;
+            } else {
+                if (out < 2049) continue;
+                d = rnd_range(2049, umin(3072, out));
+                x = d - 2049;
+                *s++ = ((x & 3) << 2) | tl;
+                *s++ = x >> 2;
+                out += 3;
+            }
+        } else if (k < 50) {
+            // M2
+            d = rnd_range(1, umin(2048, out));
+            len = rnd_range(3, 8);
+            x = d - 1;
+            *s++ = ((len - 1) << 5) | ((x & 7) << 2) | tl;
+            *s++ = x >> 3;
+            out += len;
+        } else if (k < 85) {
+            // M3
+            d = rnd_range(1, umin(16384, out));
+            len = rnd(2) ? rnd_range(3, 33) : rnd_range(34, 600);
+            x = d - 1;
+            if (len - 2 <= 31) {
+                *s++ = 32 | (len - 2);
+            } else {
+                *s++ = 32;
+                s = put_extlen(s, len - 2, 31);
+            }
+            w = (x << 2) | tl;
+            *s++ = w & 255;
+            *s++ = w >> 8;
+            out += len;
+        } else {
+            // M4
+            if (out < 16385) continue;
+            d = rnd_range(16385, umin(49151, out));
+            len = rnd_range(3, 300);
+            x = d - 16384;
+            w = (x >> 14) & 1;
+            x &= 0x3FFF;
+            if (len - 2 <= 7) {
+                *s++ = 16 | (w << 3) | (len - 2);
+            } else {
+                *s++ = 16 | (w << 3);
+                s = put_extlen(s, len - 2, 7);
+            }
+            w = (x << 2) | tl;
+            *s++ = w & 255;
+            *s++ = w >> 8;
+            out += len;
+        }
+        s = put_literals(s, tl);
+        out += tl;
+        state = tl;
+    }
+
+    // end of stream
+    *s++ = 17;
+    *s++ = 0;
+    *s++ = 0;
+    *olen = out;
+    return s - buf;
+}
+
+// check bytes in [begin, end) are still 0xAA
+static int untouched(const unsigned char *begin, const unsigned char *end)
+{
+    for (; begin < end; begin++) {
+        if (*begin != 0xAA) return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    static unsigned char stream[MAXSTREAM], mut[MAXSTREAM];
+    static unsigned char a[MAXSTREAM + GUARD], b[MAXSTREAM + GUARD];
+    unsigned seed = argc > 1 ? strtoul(argv[1], NULL, 0) : 1;
+    int nr_cases = argc > 2 ? atoi(argv[2]) : 3000;
+    unsigned len, olen, il, cap, la, lb;
+    int i, m, k, ra, rb;
+    long total = 0, valid = 0, bad = 0;
+
+    rnd_state = seed;
+    for (i = 0; i < nr_cases; i++) {
+        len = gen_stream(stream, &olen);
+        for (m = 0; m < 40; m++) {
+            // first 4 rounds keep the stream intact
+            il = len;
+            memcpy(mut, stream, il);
+            if (m >= 4) {
+                for (k = rnd_range(1, 4); k > 0; k--) mut[rnd(il)] ^= 1 << rnd(8);
+                if (rnd(4) == 0) il = rnd(il);
+            }
+            switch (m % 4) {
+                case 0: cap = olen; break;
+                case 1: cap = olen + rnd(20); break;
+                case 2: cap = olen ? rnd(olen) : 0; break;
+                default: cap = olen + 100; break;
+            }
+            if (cap > MAXSTREAM) cap = MAXSTREAM;
+            memset(a, 0xAA, cap + GUARD);
+            memset(b, 0xAA, cap + GUARD);
+            la = lb = cap;
+            ra = ref_decompress(mut, il, a, &la);
+            rb = cpk_lzo1x_decompress(mut, il, b, &lb);
+            total++;
+            if (m == 0 && (!ra || la != olen)) {
+                printf("generator error, case %d.\n", i);
+                bad++;
+            }
+            if (ra != rb || (ra && (la != lb || memcmp(a, b, la) != 0))) {
+                printf("mismatch, case %d round %d: ref=%d/%u new=%d/%u\n", i, m, ra, la, rb, lb);
+                bad++;
+            } else if (!untouched(b + (rb ? lb : cap), b + cap + GUARD)) {
+                printf("write past output, case %d round %d.\n", i, m);
+                bad++;
+            }
+            valid += ra;
+        }
+    }
+    printf("%ld streams, %ld decoded, %ld errors.\n", total, valid, bad);
+    return bad != 0;
+}
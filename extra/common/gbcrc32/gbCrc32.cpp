@@ -1,11 +1,13 @@
 #include <windows.h>
 #include <cassert>
 #include <cstdio>
+#include <cstring>
 
 // gbCrc32 definition
 class gbCrc32 {
 public:
 	static unsigned CrcTbl[0x100];
+	static unsigned SliceTbl[8][0x100];
 	static void gbCrc32Init();
 	static unsigned gbCrc32Compute(const char *str, int size);
 	static unsigned gbCrc32Compute(const char *str);
@@ -13,7 +15,11 @@ public:
 
 
 // gbCrc32 implementation
+//   same algorithm as engine, but 8 bytes are processed at once (slice-by-8)
+//   SliceTbl[n][b] is the state after n + 1 steps starting from b << 24 with zero data
+//   state bytes go through 8..5 more steps, data bytes through 4..1, last 4 are just xored
 unsigned gbCrc32::CrcTbl[0x100];
+unsigned gbCrc32::SliceTbl[8][0x100];
 void gbCrc32::gbCrc32Init()
 {
 	unsigned v0 = 0;
@@ -35,6 +41,15 @@ void gbCrc32::gbCrc32Init()
 		++v1;
 		++v0;
 	} while (v1 < CrcTbl + 0x100);
+	for (int i = 0; i < 0x100; i++) {
+		SliceTbl[0][i] = CrcTbl[i];
+	}
+	for (int n = 1; n < 8; n++) {
+		for (int i = 0; i < 0x100; i++) {
+			unsigned v = SliceTbl[n - 1][i];
+			SliceTbl[n][i] = CrcTbl[v >> 24] ^ (v << 8);
+		}
+	}
 }
 unsigned gbCrc32::gbCrc32Compute(const char *str, int size)
 {
@@ -47,6 +62,13 @@ unsigned gbCrc32::gbCrc32Compute(const char *str, int size)
 	}
 	x = ~x;
 	size -= 4;
+	while (size >= 8) {
+		x = SliceTbl[7][x >> 24] ^ SliceTbl[6][(x >> 16) & 0xFF] ^ SliceTbl[5][(x >> 8) & 0xFF] ^ SliceTbl[4][x & 0xFF]
+		  ^ SliceTbl[3][s[0]] ^ SliceTbl[2][s[1]] ^ SliceTbl[1][s[2]] ^ SliceTbl[0][s[3]]
+		  ^ ((unsigned) s[4] << 24 | (unsigned) s[5] << 16 | (unsigned) s[6] << 8 | s[7]);
+		s += 8;
+		size -= 8;
+	}
 	while (size-- > 0) {
 		x = CrcTbl[x >> 24] ^ (*s++ | (x << 8));
 	}
@@ -54,18 +76,8 @@ unsigned gbCrc32::gbCrc32Compute(const char *str, int size)
 }
 unsigned gbCrc32::gbCrc32Compute(const char *str)
 {
-	unsigned char *s = (unsigned char *) str;
-	unsigned x = 0;
-	int i;
-	for (i = 0; i < 4; i++) {
-		x = (x << 8);
-		if (*s) x |= *s++;
-	}
-	x = ~x;
-	while (*s) {
-		x = CrcTbl[x >> 24] ^ (*s++ | (x << 8));
-	}
-	return ~x;
+	// string version stops at first NUL, including the first 4 bytes
+	return gbCrc32Compute(str, strlen(str));
 }
 
 
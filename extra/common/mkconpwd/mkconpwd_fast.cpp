@@ -1,12 +1,14 @@
 #include <vector>
-#include <queue>
+#include <string>
+#include <algorithm>
+#include <cstdlib>
 #include <cassert>
 #include <ctime>
 #include <cstring>
 #include <cstdio>
 #include <thread>
 #include <mutex>
-#include <condition_variable>
+#include <atomic>
 #include <chrono>
 
 // gbCrc32 definition
@@ -80,74 +82,61 @@ unsigned gbCrc32::gbCrc32Compute(const char *str)
 
 
 
-// ArrayBlockingQueue
-template<class T>
-class BlockingQueue {
-	std::queue<T> q;
-	std::mutex mtx;
-	std::condition_variable cv_full, cv_empty;
-	size_t max_size;
-
-public:
-	BlockingQueue(size_t max_size) : max_size(max_size)
-	{
-		assert(max_size > 0);
-	}
-	void push(const T &in_val)
-	{
-		{
-			std::unique_lock<std::mutex> lck(mtx);
-			while (q.size() >= max_size) {
-				cv_empty.wait(lck);
-			}
-			q.push(in_val);
-		}
-		cv_full.notify_one();
-	}
-	void pop(T &out_val)
-	{
-		{
-			std::unique_lock<std::mutex> lck(mtx);
-			while (q.empty()) {
-				cv_full.wait(lck);
-			}
-			out_val = q.front(); q.pop();
-		}
-		cv_empty.notify_one();
-	}
-};
-
-
-
-
 class MkConPwd {
 public:
 	static const int MAXLEN = 50;
 	static const int MAXSIGMA = 50;
+	static const int MAXWORKERS = 256;
+	static const int CHECKPOINT = 60; // seconds between checkpoints
 	static const char LOGFILE[];
 
 private:
 	unsigned target;
 	const char *sigma;
 	int maxlen;
+	int workerlen;
 	int sz;
 	
-	struct Job {
-		int len;
-		std::string base;
-		Job() : len(0) {}
-		Job(int len, std::string base) : len(len), base(base) {}
-	};
-
-	BlockingQueue<Job> *q;
+	// jobs are numbered over the whole search space, in the order they are searched
+	//   job k is (len, base) with base of length len - workerlen, or empty if len <= workerlen
+	//   jobbase[len] is the number of the first job of len, so numbers don't depend on maxlen
+	//   workers take the next number from jobnext, there is nothing else to share
+	//   all jobs before min(jobnext, jobcur[]) are finished, that is saved as checkpoint
+	unsigned long long jobbase[MAXLEN + 2];
+	unsigned long long njobs;
+	std::atomic<unsigned long long> jobnext;
+	std::atomic<unsigned long long> jobcur[MAXWORKERS];
+	std::atomic<int> nr_exited;
 	std::mutex fmtx;
 
+	// meet-in-the-middle solver
+	//   gbCrc32 is a plain CRC after the first 4 bytes, and each step can be undone:
+	//   the low byte of CrcTbl[] is unique, so it tells which entry was used
+	//   states after all prefixes of length plen are sorted in ptbl,
+	//   then suffixes are unwound from the target state and looked up in ptbl
+	//   cost is O(sz^plen + sz^(len-plen)) instead of O(sz^len)
+	std::vector<std::pair<unsigned, unsigned> > ptbl; // (state after prefix, prefix index)
+	int ptbllen;
+	unsigned char invtbl[0x100]; // low byte of CrcTbl[i] => i
+
+	int sigmapos[0x100]; // character => index in sigma, -1 if not in sigma
+
 private:
 	void reportfound(const char *str, int wrkid);
 	void searchkrnl(const char *base, int len, int wrkid);
+	void searchjob(const char *base, int len, int wrkid);
+	void getjob(unsigned long long k, int &len, char *base);
 	void worker(int wrkid);
+	unsigned long long loadcheckpoint();
+	unsigned long long savecheckpoint(int workers);
+	void initsigma(const char *sigma);
+	void beginsearch();
+	void searchshort(int len);
+	void buildprefix(int plen);
+	void mitmworker(int len, int plen, int wrkid, int workers);
 public:
 	void run(unsigned target, const char *sigma, int maxlen, int workerlen, int maxworkers);
+	void runmitm(unsigned target, const char *sigma, int maxlen, int maxprefix, int workers);
 };
 
 const char MkConPwd::LOGFILE[] = "conpwd.txt";
@@ -169,91 +158,164 @@ void MkConPwd::searchkrnl(const char *base, int len, int wrkid)
 	unsigned s[MAXLEN + 1];
 	int bl = strlen(base);
 	assert(bl >= 4);
-	int l = len;
+	assert(len >= 1);
+	int l = len - 1; // last character is solved directly
 	int z = 0, f = -1;
 	
+	// state is carried down the tree, each character costs one table step
 	s[0] = ~gbCrc32::gbCrc32Compute(base);
 	unsigned ntarget = ~target;
 
-	do if (++f >= sz || z >= l)	{
-		f = a[--z];
-	} else {
-		s[z + 1] = gbCrc32::CrcTbl[s[z] >> 24] ^ (sigma[f] | (s[z] << 8));
-		a[z++] = f;
-		f = -1;
+	// last step is CrcTbl[x >> 24] ^ (x << 8) ^ c, so only one c can match
+	//   we get it by xor, instead of trying every character in sigma
+	do {
 		if (z >= l) {
-			if (s[z] == ntarget) {
+			unsigned c = ntarget ^ gbCrc32::CrcTbl[s[z] >> 24] ^ (s[z] << 8);
+			if (c < 0x100 && sigmapos[c] >= 0) {
 				char b[MAXLEN + 1];
 				strcpy(b, base);
 				for (int i = 0; i < z; i++) b[bl + i] = sigma[a[i]];
-				b[bl + z] = 0;
+				b[bl + z] = c;
+				b[bl + z + 1] = 0;
 				reportfound(b, wrkid);
 			}
 		}
+		if (++f >= sz || z >= l) {
+			if (--z >= 0) f = a[z];
+		} else {
+			s[z + 1] = gbCrc32::CrcTbl[s[z] >> 24] ^ (sigma[f] | (s[z] << 8));
+			a[z++] = f;
+			f = -1;
+		}
 	} while (z >= 0);
 }
-void MkConPwd::worker(int wrkid)
+void MkConPwd::searchjob(const char *base, int len, int wrkid)
 {
-	printf("INFO: worker %d initialized.\n", wrkid);
-	while (1) {
-		Job j; q->pop(j); 
-		if (j.len <= 0) break;
-
-		printf("INFO: worker %d got job (len=%d, base='%s')\n", wrkid, j.len, j.base.c_str());
-		
-		int bl = j.base.length();
-		int l = j.len;
-		int z = 0, f = -1;
-		int a[4];
-		char s[5];
-		if (bl + l <= 4) {
-			strcpy(s, j.base.c_str());
-			s[bl + l] = 0;
+	int bl = strlen(base);
+	int l = len;
+	int z = 0, f = -1;
+	int a[4];
+	char s[5];
+	if (bl + l <= 4) {
+		strcpy(s, base);
+		s[bl + l] = 0;
+		do if (++f >= sz || z >= l)	{
+			if (--z >= 0) f = a[z];
+		} else {
+			s[bl + z] = sigma[f];
+			a[z++] = f;
+			f = -1;
+			if (z >= l) {
+				//printf("%s\n", s);
+				if (gbCrc32::gbCrc32Compute(s) == target) {
+					reportfound(s, wrkid);
+				}
+			}
+		} while (z >= 0);
+	} else {
+		if (bl >= 4) {
+			searchkrnl(base, len, wrkid);
+		} else {
+			l = 4 - bl;
+			strcpy(s, base);
+			s[4] = 0;
 			do if (++f >= sz || z >= l)	{
-				f = a[--z];
+				if (--z >= 0) f = a[z];
 			} else {
 				s[bl + z] = sigma[f];
 				a[z++] = f;
 				f = -1;
 				if (z >= l) {
-					//printf("%s\n", s);
-					if (gbCrc32::gbCrc32Compute(s) == target) {
-						reportfound(s, wrkid);
-					}
+					searchkrnl(s, len - l, wrkid);
 				}
 			} while (z >= 0);
-		} else {
-			if (bl >= 4) {
-				searchkrnl(j.base.c_str(), j.len, wrkid);
-			} else {
-				l = 4 - bl;
-				strcpy(s, j.base.c_str());
-				s[4] = 0;
-				do if (++f >= sz || z >= l)	{
-					f = a[--z];
-				} else {
-					s[bl + z] = sigma[f];
-					a[z++] = f;
-					f = -1;
-					if (z >= l) {
-						searchkrnl(s, j.len - l, wrkid);
-					}
-				} while (z >= 0);
-			}
 		}
 	}
+}
+void MkConPwd::getjob(unsigned long long k, int &len, char *base)
+{
+	int curlen = 1;
+	while (k >= jobbase[curlen + 1]) curlen++;
+	unsigned long long idx = k - jobbase[curlen];
+	int l = std::max(curlen - workerlen, 0);
+	for (int i = l - 1; i >= 0; i--) {
+		base[i] = sigma[idx % sz];
+		idx /= sz;
+	}
+	base[l] = 0;
+	len = curlen - l;
+}
+void MkConPwd::worker(int wrkid)
+{
+	printf("INFO: worker %d initialized.\n", wrkid);
+	while (1) {
+		// publish a lower bound before taking the job, so checkpoint never skips it
+		jobcur[wrkid] = jobnext.load();
+		unsigned long long k = jobnext++;
+		if (k >= njobs) break;
+		jobcur[wrkid] = k;
+
+		int len;
+		char base[MAXLEN + 1];
+		getjob(k, len, base);
+		searchjob(base, len, wrkid);
+	}
+	jobcur[wrkid] = njobs;
+	nr_exited++;
 	printf("INFO: worker %d exited.\n", wrkid);
 }
 
+unsigned long long MkConPwd::loadcheckpoint()
+{
+	// last checkpoint with same target, workerlen and sigma wins
+	unsigned long long ret = 0;
+	char buf[MAXSIGMA + 100];
+	FILE *fp = fopen(LOGFILE, "r");
+	if (!fp) return 0;
+	while (fgets(buf, sizeof(buf), fp)) {
+		unsigned t;
+		int wl, n;
+		unsigned long long k;
+		if (sscanf(buf, "; checkpoint %x %d %llu %n", &t, &wl, &k, &n) != 3) continue;
+		char *p = buf + n;
+		p[strcspn(p, "\r\n")] = 0;
+		if (t == target && wl == workerlen && strcmp(p, sigma) == 0) ret = k;
+	}
+	fclose(fp);
+	return ret;
+}
+unsigned long long MkConPwd::savecheckpoint(int workers)
+{
+	unsigned long long k = jobnext.load();
+	for (int i = 0; i < workers; i++) k = std::min(k, jobcur[i].load());
+	k = std::min(k, njobs);
+
+	std::unique_lock<std::mutex> lck(fmtx);
+	FILE *fp = fopen(LOGFILE, "a");
+	fprintf(fp, "; checkpoint %08x %d %llu %s\n", target, workerlen, k, sigma);
+	fclose(fp);
+	return k;
+}
+
+void MkConPwd::initsigma(const char *sigma)
+{
+	this->sigma = sigma;
+	sz = strlen(sigma);
+	for (int i = 0; i < 0x100; i++) sigmapos[i] = -1;
+	for (int i = sz - 1; i >= 0; i--) sigmapos[(unsigned char) sigma[i]] = i;
+}
+
 void MkConPwd::run(unsigned target, const char *sigma, int maxlen, int workerlen, int workers)
 {
 	this->target = target;
-	this->sigma = sigma;
 	this->maxlen = maxlen;
-	sz = strlen(sigma);
+	this->workerlen = workerlen;
+	initsigma(sigma);
 	
 	assert(maxlen <= MAXLEN);
 	assert(sz <= MAXSIGMA);
+	assert(workers > 0 && workers <= MAXWORKERS);
+	assert(workerlen > 0);
 
 	printf("INFO: MkConPwd::MAXLEN = %d\n", MkConPwd::MAXLEN);
 	printf("INFO: MkConPwd::MAXSIGMA = %d\n", MkConPwd::MAXLEN);
@@ -261,6 +323,53 @@ void MkConPwd::run(unsigned target, const char *sigma, int maxlen, int workerlen
 
 	printf("INFO: target=%08x, sigma='%s'.\n", target, sigma);
 	printf("INFO: maxlen=%d, workerlen=%d, workers=%d\n", maxlen, workerlen, workers);
+
+	jobbase[1] = 0;
+	for (int curlen = 1; curlen <= maxlen; curlen++) {
+		unsigned long long n = 1;
+		for (int i = workerlen; i < curlen; i++) {
+			assert(n <= ~0ULL / sz);
+			n *= sz;
+		}
+		assert(jobbase[curlen] <= ~0ULL - n);
+		jobbase[curlen + 1] = jobbase[curlen] + n;
+	}
+	njobs = jobbase[maxlen + 1];
+
+	unsigned long long start = std::min(loadcheckpoint(), njobs);
+	if (start > 0) printf("INFO: resuming from checkpoint, %llu of %llu jobs already done\n", start, njobs);
+	beginsearch();
+
+	clock_t st = clock();
+
+	std::vector<std::thread> wrk;
+	jobnext = start;
+	nr_exited = 0;
+	for (int i = 0; i < workers; i++) jobcur[i] = start;
+	for (int i = 0; i < workers; i++) wrk.push_back(std::thread(&MkConPwd::worker, this, i));
+	std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+	while (nr_exited < workers) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		if (std::chrono::steady_clock::now() - last >= std::chrono::seconds(CHECKPOINT)) {
+			unsigned long long k = savecheckpoint(workers);
+			int len;
+			char base[MAXLEN + 1];
+			if (k < njobs) {
+				getjob(k, len, base);
+				printf("INFO: checkpoint, %llu of %llu jobs done (len=%d, base='%s')\n", k, njobs, len + (int) strlen(base), base);
+			}
+			last = std::chrono::steady_clock::now();
+		}
+	}
+	for (int i = 0; i < workers; i++) wrk[i].join();
+	savecheckpoint(workers);
+
+	clock_t ed = clock();
+	printf("INFO: search exhausted, time = %.3fs\n", ((double) (ed - st) / CLOCKS_PER_SEC));
+}
+
+void MkConPwd::beginsearch()
+{
 	printf("INFO: search started ...\n");
 
 	FILE *fp = fopen(LOGFILE, "a");
@@ -268,36 +377,131 @@ void MkConPwd::run(unsigned target, const char *sigma, int maxlen, int workerlen
 	time(&rawtime);
 	fprintf(fp, "\n; %s\n\n", ctime(&rawtime));
 	fclose(fp);
+}
+
+void MkConPwd::searchshort(int len)
+{
+	// len <= 4, just try them all
+	int z = 0, f = -1;
+	int a[4];
+	char s[5];
+	s[len] = 0;
+	do if (++f >= sz || z >= len) {
+		if (--z >= 0) f = a[z];
+	} else {
+		s[z] = sigma[f];
+		a[z++] = f;
+		f = -1;
+		if (z >= len) {
+			if (gbCrc32::gbCrc32Compute(s) == target) {
+				reportfound(s, 0);
+			}
+		}
+	} while (z >= 0);
+}
+
+void MkConPwd::buildprefix(int plen)
+{
+	if (ptbllen == plen) return;
+	unsigned n = 1;
+	for (int i = 0; i < plen; i++) n *= sz;
+	printf("INFO: building prefix table (plen=%d, entries=%u) ...\n", plen, n);
+
+	ptbl.resize(n);
+	char s[MAXLEN + 1];
+	for (unsigned idx = 0; idx < n; idx++) {
+		unsigned v = idx;
+		for (int i = plen - 1; i >= 0; i--) {
+			s[i] = sigma[v % sz];
+			v /= sz;
+		}
+		ptbl[idx] = std::make_pair(~gbCrc32::gbCrc32Compute(s, plen), idx);
+	}
+	std::sort(ptbl.begin(), ptbl.end());
+	ptbllen = plen;
+}
+
+void MkConPwd::mitmworker(int len, int plen, int wrkid, int workers)
+{
+	unsigned char sigma[MAXSIGMA + 1];
+	strcpy((char *) sigma, this->sigma);
+	int l = len - plen;
+	int a[MAXLEN]; // a[0] is the last character
+	unsigned s[MAXLEN + 1];
+	int z = 0, f = -1;
+
+	s[0] = ~target;
+	do if (++f >= sz || z >= l) {
+		if (--z >= 0) f = a[z];
+	} else if (z == 0 && f % workers != wrkid) {
+		// last character is split between workers
+		continue;
+	} else {
+		// undo one step: s[z] = CrcTbl[h] ^ (c | (s[z + 1] << 8))
+		unsigned y = s[z] ^ sigma[f];
+		unsigned h = invtbl[y & 0xFF];
+		s[z + 1] = ((y ^ gbCrc32::CrcTbl[h]) >> 8) | (h << 24);
+		a[z++] = f;
+		f = -1;
+		if (z >= l) {
+			std::vector<std::pair<unsigned, unsigned> >::iterator it;
+			it = std::lower_bound(ptbl.begin(), ptbl.end(), std::make_pair(s[z], 0u));
+			for (; it != ptbl.end() && it->first == s[z]; it++) {
+				char b[MAXLEN + 1];
+				unsigned v = it->second;
+				for (int i = plen - 1; i >= 0; i--) {
+					b[i] = sigma[v % sz];
+					v /= sz;
+				}
+				for (int i = 0; i < l; i++) b[plen + i] = sigma[a[l - 1 - i]];
+				b[len] = 0;
+				reportfound(b, wrkid);
+			}
+		}
+	} while (z >= 0);
+}
+
+void MkConPwd::runmitm(unsigned target, const char *sigma, int maxlen, int maxprefix, int workers)
+{
+	this->target = target;
+	this->maxlen = maxlen;
+	initsigma(sigma);
+	ptbllen = -1;
+
+	assert(maxlen <= MAXLEN);
+	assert(sz <= MAXSIGMA);
+	assert(maxprefix >= 4);
+	assert(workers > 0);
+
+	memset(invtbl, 0, sizeof(invtbl));
+	for (int i = 0; i < 0x100; i++) invtbl[gbCrc32::CrcTbl[i] & 0xFF] = i;
+	for (int i = 0; i < 0x100; i++) assert((gbCrc32::CrcTbl[invtbl[i]] & 0xFF) == (unsigned) i);
+
+	printf("INFO: MkConPwd::MAXLEN = %d\n", MkConPwd::MAXLEN);
+	printf("INFO: MkConPwd::MAXSIGMA = %d\n", MkConPwd::MAXLEN);
+	printf("INFO: MkConPwd::LOGFILE = %s\n", MkConPwd::LOGFILE);
+
+	printf("INFO: target=%08x, sigma='%s'.\n", target, sigma);
+	printf("INFO: maxlen=%d, maxprefix=%d, workers=%d (meet-in-the-middle)\n", maxlen, maxprefix, workers);
+	beginsearch();
 
 	clock_t st = clock();
 
-	std::vector<std::thread> wrk;
-	q = new BlockingQueue<Job>(workers);
-	for (int i = 0; i < workers; i++) wrk.push_back(std::thread(&MkConPwd::worker, this, i));
 	for (int curlen = 1; curlen <= maxlen; curlen++) {
-		if (curlen <= workerlen) {
-			q->push(Job(curlen, ""));
-		} else {
-			int l = curlen - workerlen;
-			int z = 0, f = -1;
-			int a[MAXLEN];
-			char s[MAXLEN + 1];
-			s[l] = 0;
-			do if (++f >= sz || z >= l)	{
-				f = a[--z];
-			} else {
-				s[z] = sigma[f];
-				a[z++] = f;
-				f = -1;
-				if (z >= l) {
-					q->push(Job(workerlen, s));
-				}
-			} while (z >= 0);
+		if (curlen <= 4) {
+			searchshort(curlen);
+			continue;
 		}
+
+		// first 4 characters are the initial state, so prefix is at least 4
+		int plen = std::min(std::max(4, curlen - curlen / 2), maxprefix);
+		buildprefix(plen);
+		printf("INFO: searching len=%d (prefix=%d, suffix=%d) ...\n", curlen, plen, curlen - plen);
+
+		std::vector<std::thread> wrk;
+		for (int i = 0; i < workers; i++) wrk.push_back(std::thread(&MkConPwd::mitmworker, this, curlen, plen, i, workers));
+		for (int i = 0; i < workers; i++) wrk[i].join();
 	}
-	for (int i = 0; i < workers; i++) q->push(Job());
-	for (int i = 0; i < workers; i++) wrk[i].join();
-	delete q;
 
 	clock_t ed = clock();
 	printf("INFO: search exhausted, time = %.3fs\n", ((double) (ed - st) / CLOCKS_PER_SEC));
@@ -310,15 +514,22 @@ int main(int argc, char *argv[])
 	int maxlen = 10;
 	int workerlen = 8;
 	unsigned workers = std::thread::hardware_concurrency();
+	const char *mode = "brute"; // "brute" or "mitm"
 	if (argc > 1) target = strtoul(argv[1], NULL, 16); else printf("WARNING: target defaulted to %08x\n", target);
 	if (argc > 2) sigma = argv[2]; else printf("WARNING: sigma defaulted to '%s'\n", sigma);
 	if (argc > 3) maxlen = atoi(argv[3]); else printf("WARNING: maxlen defaulted to %d\n", maxlen);
 	if (argc > 4) workerlen = atoi(argv[4]); else printf("WARNING: workerlen defaulted to %d\n", workerlen);
 	if (argc > 5) workers = atoi(argv[5]); else printf("WARNING: workers defaulted to %d\n", workers);
+	if (argc > 6) mode = argv[6];
 
 	gbCrc32::gbCrc32Init();
 	MkConPwd mkconpwd;
-	mkconpwd.run(target, sigma, maxlen, workerlen, workers);
+	if (strcmp(mode, "mitm") == 0) {
+		// workerlen is the maximum prefix length, prefix table has sigma^workerlen entries
+		mkconpwd.runmitm(target, sigma, maxlen, workerlen, workers);
+	} else {
+		mkconpwd.run(target, sigma, maxlen, workerlen, workers);
+	}
 	
 	return 0;
 }
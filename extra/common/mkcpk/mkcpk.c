@@ -1,20 +1,29 @@
 // this program can make uncompressed CPK files
 //  usage:
-//    mkcpk.exe [CPKFILE]
+//    mkcpk.exe [-t TRACEFILE] [-j THREADS] [-w WINDOW] [-d] [CPKFILE]
 //      then put a file list to stdin, like:
 //               dir1/dir2/file1
 //               dir3/file2
 //               file3
 //      the order of files in list will be the order in CPK
+//      if TRACEFILE (made by cpktrace patchset) is given,
+//        files in trace will be placed first, in first-touch order
+//      THREADS is the number of file reader threads (default 1)
+//      WINDOW is the max size of file data in memory, in MB (default 64)
+//      the output is always the same regardless of THREADS and WINDOW
+//      if -d is given, files with same content and same base name
+//        will share one copy of data in CPK
+//  build:
+//    CL /O2 mkcpk.c ..\cpklib\cpklib.c
 
 
+#include <windows.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
-
-typedef unsigned long ULONG;
+#include "../cpklib/cpklib.h"
 
 #define fail(fmt, ...) (fprintf(stderr, "  FATAL: " fmt "\n", ##__VA_ARGS__), exit(1))
 #define warning(fmt, ...) (fprintf(stderr, "  WARNING: " fmt "\n", ##__VA_ARGS__))
@@ -24,85 +33,194 @@ static int cmp_stricmp(const void *a, const void *b)
     return _stricmp(*(const char **)a, *(const char **)b);
 }
 
-// gbCrc32 implementation
-static unsigned CrcTbl[0x100];
-static void gbCrc32Init()
+#define MAXLINE 4096
+#define DIR_SEPARATOR "/\\"
+
+static struct CPKHeader cpkhdr;
+static struct CPKTable cpktbl[CPK_MAXTABLENUM];
+
+static char filelist[CPK_MAXTABLENUM][MAXLINE];
+static char *filelist_sorted[CPK_MAXTABLENUM];
+static int nr_files;
+
+// cpk trace file format, see patch_cpktrace.c
+#define CPKTRACE_MAGIC 0x544B5043
+#define CPKTRACE_VERSION 1
+#define CPKTRACE_NAMELEN 64
+#define CPKTRACE_MAP 1
+struct cpktrace_header {
+    unsigned magic;
+    unsigned version;
+    unsigned nr_names;
+    unsigned nr_records;
+    unsigned nr_dropped;
+};
+struct cpktrace_record {
+    unsigned long long timestamp;
+    unsigned char type;
+    unsigned char cpkid;
+    unsigned short reserved;
+    int tblidx;
+    unsigned crc;
+    unsigned offset;
+    unsigned size;
+    unsigned latency;
+};
+
+static unsigned filecrc[CPK_MAXTABLENUM];
+static int fileorder[CPK_MAXTABLENUM];
+static int filerank[CPK_MAXTABLENUM];
+
+// file reader pipeline
+//   readers load whole files in output order, writer writes them in order
+//   bytes being held are limited by window, except the one writer is waiting
+struct datajob {
+    char *data;
+    unsigned size;
+    int ready;
+};
+
+static struct datajob datajobs[CPK_MAXTABLENUM];
+static int nr_readers = 1;
+static unsigned long long window_size = 64 << 20;
+static unsigned long long window_used;
+static int next_read, next_write;
+static CRITICAL_SECTION pipe_cs;
+static CONDITION_VARIABLE pipe_cv;
+
+static DWORD WINAPI reader_thread(LPVOID param)
 {
-	unsigned v0 = 0;
-	unsigned *v1 = CrcTbl;
-	unsigned v2;
-	unsigned v3;
-	do {
-		v2 = 8;
-		v3 = v0 << 24;
-		do {
-			if (v3 & 0x80000000) {
-				v3 = 2 * v3 ^ 0x04C11DB7;
-			} else {
-				v3 *= 2;
-			}
-			--v2;
-		} while (v2);
-		*v1 = v3;
-		++v1;
-		++v0;
-	} while (v1 < CrcTbl + 0x100);
+    while (1) {
+        EnterCriticalSection(&pipe_cs);
+        int i = next_read++;
+        LeaveCriticalSection(&pipe_cs);
+        if (i >= nr_files) break;
+        
+        const char *fpath = filelist[fileorder[i]];
+        FILE *datafp = fopen(fpath, "rb");
+        if (!datafp) fail("can't open '%s'.", fpath);
+        if (fseek(datafp, 0, SEEK_END) != 0) fail("can't seek '%s'.", fpath);
+        long filesz = ftell(datafp);
+        if (filesz < 0) fail("can't get size of '%s'.", fpath);
+        rewind(datafp);
+        
+        // wait for window space
+        EnterCriticalSection(&pipe_cs);
+        while (i != next_write && window_used + filesz > window_size) {
+            SleepConditionVariableCS(&pipe_cv, &pipe_cs, INFINITE);
+        }
+        window_used += filesz;
+        LeaveCriticalSection(&pipe_cs);
+        
+        char *data = malloc(filesz ? filesz : 1);
+        if (!data) fail("can't allocate memory for '%s'.", fpath);
+        if (fread(data, 1, filesz, datafp) != (size_t) filesz) fail("can't read '%s'.", fpath);
+        fclose(datafp);
+        
+        EnterCriticalSection(&pipe_cs);
+        datajobs[i].data = data;
+        datajobs[i].size = filesz;
+        datajobs[i].ready = 1;
+        LeaveCriticalSection(&pipe_cs);
+        WakeAllConditionVariable(&pipe_cv);
+    }
+    return 0;
 }
 
-static unsigned gbCrc32Compute(const char *str)
+static struct datajob *wait_datajob(int i)
 {
-	unsigned char *s = (unsigned char *) str;
-	unsigned x = 0;
-	int i;
-	for (i = 0; i < 4; i++) {
-		x = (x << 8);
-		if (*s) x |= *s++;
-	}
-	x = ~x;
-	while (*s) {
-		x = CrcTbl[x >> 24] ^ (*s++ | (x << 8));
-	}
-	return ~x;
+    EnterCriticalSection(&pipe_cs);
+    next_write = i;
+    WakeAllConditionVariable(&pipe_cv);
+    while (!datajobs[i].ready) {
+        SleepConditionVariableCS(&pipe_cv, &pipe_cs, INFINITE);
+    }
+    LeaveCriticalSection(&pipe_cs);
+    return &datajobs[i];
 }
 
+static void done_datajob(struct datajob *job)
+{
+    EnterCriticalSection(&pipe_cs);
+    window_used -= job->size;
+    free(job->data);
+    job->data = NULL;
+    LeaveCriticalSection(&pipe_cs);
+    WakeAllConditionVariable(&pipe_cv);
+}
 
-
-// these structures are read from PAL3A.PDB
-struct CPKHeader {
-    ULONG dwLable;
-    ULONG dwVersion;
-    ULONG dwTableStart;
-    ULONG dwDataStart;
-    ULONG dwMaxFileNum;
-    ULONG dwFileNum;
-    ULONG dwIsFormatted;
-    ULONG dwSizeOfHeader;
-    ULONG dwValidTableNum;
-    ULONG dwMaxTableNum;
-    ULONG dwFragmentNum;
-    ULONG dwPackageSize;
-    ULONG dwReserved[0x14];
-};
-struct CPKTable {
-    ULONG dwCRC;
-    ULONG dwFlag;
-    ULONG dwFatherCRC;
-    ULONG dwStartPos;
-    ULONG dwPackedSize;
-    ULONG dwOriginSize;
-    ULONG dwExtraInfoSize;
+// content dedup
+//   extrainfo must follow data, so only entries with same data
+//   and same base name (thus same extrainfo) can share a payload
+#define DEDUP_HASHSIZE 65536
+struct payload {
+    unsigned long long hash;
+    unsigned start;
+    unsigned size;
+    char *name;
+    int next;
 };
 
-#define MAXLINE 4096
-#define DIR_SEPARATOR "/\\"
-#define CPK_MAXTABLENUM 0x8000
+static int dedup_enabled;
+static struct payload payloads[CPK_MAXTABLENUM];
+static int nr_payloads;
+static int payload_head[DEDUP_HASHSIZE];
+static int nr_shared;
+static unsigned long long shared_bytes;
 
-static struct CPKHeader cpkhdr;
-static struct CPKTable cpktbl[CPK_MAXTABLENUM];
+static unsigned long long fnv1a64(const void *data, unsigned size)
+{
+    const unsigned char *p = data;
+    unsigned long long h = 0xCBF29CE484222325ULL;
+    unsigned i;
+    for (i = 0; i < size; i++) {
+        h ^= p[i];
+        h *= 0x100000001B3ULL;
+    }
+    return h ^ size;
+}
 
-static char filelist[CPK_MAXTABLENUM][MAXLINE];
-static char *filelist_sorted[CPK_MAXTABLENUM];
-static int nr_files;
+// compare data with a payload already written to fp
+static int payload_equal(FILE *fp, const struct payload *pl, const char *data)
+{
+    static char chunk[65536];
+    long end = ftell(fp);
+    unsigned off, n;
+    int same = 1;
+    if (fseek(fp, pl->start, SEEK_SET) != 0) fail("can't seek output file.");
+    for (off = 0; same && off < pl->size; off += n) {
+        n = pl->size - off < sizeof(chunk) ? pl->size - off : sizeof(chunk);
+        if (fread(chunk, 1, n, fp) != n) fail("can't read back output file.");
+        same = memcmp(chunk, data + off, n) == 0;
+    }
+    if (fseek(fp, end, SEEK_SET) != 0) fail("can't seek output file.");
+    return same;
+}
+
+// find a payload with same data and name, returns NULL if not found
+static struct payload *find_payload(FILE *fp, unsigned long long hash, const char *data, unsigned size, const char *name)
+{
+    int i;
+    for (i = payload_head[hash % DEDUP_HASHSIZE]; i >= 0; i = payloads[i].next) {
+        struct payload *pl = &payloads[i];
+        if (pl->hash == hash && pl->size == size && strcmp(pl->name, name) == 0 && payload_equal(fp, pl, data)) {
+            return pl;
+        }
+    }
+    return NULL;
+}
+
+static void add_payload(unsigned long long hash, unsigned start, unsigned size, const char *name)
+{
+    struct payload *pl = &payloads[nr_payloads];
+    pl->hash = hash;
+    pl->start = start;
+    pl->size = size;
+    pl->name = _strdup(name);
+    if (!pl->name) fail("can't allocate memory.");
+    pl->next = payload_head[hash % DEDUP_HASHSIZE];
+    payload_head[hash % DEDUP_HASHSIZE] = nr_payloads++;
+}
 
 static size_t fwrite_safe(const void *ptr, size_t size, size_t nmemb, FILE *stream)
 {
@@ -128,6 +246,68 @@ static int tblcmp(const void *a, const void *b)
     return 0;
 }
 
+static int crccmp(const void *a, const void *b)
+{
+    unsigned ca = filecrc[*(const int *) a], cb = filecrc[*(const int *) b];
+    return ca < cb ? -1 : ca > cb;
+}
+
+static int rankcmp(const void *a, const void *b)
+{
+    int ra = filerank[*(const int *) a], rb = filerank[*(const int *) b];
+    if (ra != rb) return ra < rb ? -1 : 1;
+    return *(const int *) a - *(const int *) b;
+}
+
+static void load_trace(const char *tracefn, const char *cpkfn)
+{
+    int i;
+    unsigned j;
+    FILE *tfp = fopen(tracefn, "rb");
+    if (!tfp) fail("can't open trace file '%s'.", tracefn);
+    struct cpktrace_header hdr;
+    if (fread(&hdr, sizeof(hdr), 1, tfp) != 1 || hdr.magic != CPKTRACE_MAGIC || hdr.version != CPKTRACE_VERSION) {
+        fail("invalid trace file '%s'.", tracefn);
+    }
+
+    // only use records of the cpk with same name, if there is one
+    const char *cpkbase = cpkfn + strlen(cpkfn);
+    while (cpkbase > cpkfn && !strchr(DIR_SEPARATOR, cpkbase[-1])) cpkbase--;
+    int cpkid = -1;
+    char name[CPKTRACE_NAMELEN];
+    for (j = 0; j < hdr.nr_names; j++) {
+        if (fread(name, sizeof(name), 1, tfp) != 1) fail("invalid trace file '%s'.", tracefn);
+        name[sizeof(name) - 1] = '\0';
+        if (cpkid < 0 && _stricmp(name, cpkbase) == 0) cpkid = j;
+    }
+    if (cpkid < 0) warning("no records of '%s' in trace, using all records.", cpkbase);
+
+    // rank files by first touch
+    for (i = 0; i < nr_files; i++) {
+        filerank[i] = CPK_MAXTABLENUM;
+    }
+    qsort(fileorder, nr_files, sizeof(int), crccmp);
+    int nr_touched = 0;
+    struct cpktrace_record rec;
+    for (j = 0; j < hdr.nr_records; j++) {
+        if (fread(&rec, sizeof(rec), 1, tfp) != 1) fail("invalid trace file '%s'.", tracefn);
+        if (rec.type != CPKTRACE_MAP || rec.tblidx < 0) continue;
+        if (cpkid >= 0 && rec.cpkid != cpkid) continue;
+        int lo = 0, hi = nr_files;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (filecrc[fileorder[mid]] < rec.crc) lo = mid + 1; else hi = mid;
+        }
+        if (lo < nr_files && filecrc[fileorder[lo]] == rec.crc && filerank[fileorder[lo]] == CPK_MAXTABLENUM) {
+            filerank[fileorder[lo]] = nr_touched++;
+        }
+    }
+    fclose(tfp);
+
+    qsort(fileorder, nr_files, sizeof(int), rankcmp);
+    printf("  %d file(s) ordered by trace.\n", nr_touched);
+}
+
 int main(int argc, char *argv[])
 {
     int i;
@@ -135,12 +315,30 @@ int main(int argc, char *argv[])
     char buf[MAXLINE];
     
     // init gbCrc32
-    gbCrc32Init();
+    cpk_crc32_init();
     
-    // parse cpk file name
-    const char *cpkfn = "newcpk.cpk";
-    if (argc >= 2) cpkfn = argv[1];
-    else warning("cpk file name default to '%s'", cpkfn);
+    // parse arguments
+    const char *cpkfn = NULL;
+    const char *tracefn = NULL;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            tracefn = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            nr_readers = atoi(argv[++i]);
+            if (nr_readers < 1 || nr_readers > 64) fail("invalid number of threads.");
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            window_size = (unsigned long long) atoi(argv[++i]) << 20;
+            if (window_size == 0) fail("invalid window size.");
+        } else if (strcmp(argv[i], "-d") == 0) {
+            dedup_enabled = 1;
+        } else {
+            cpkfn = argv[i];
+        }
+    }
+    if (!cpkfn) {
+        cpkfn = "newcpk.cpk";
+        warning("cpk file name default to '%s'", cpkfn);
+    }
     
     // read file list
     nr_files = 0;
@@ -155,6 +353,15 @@ int main(int argc, char *argv[])
     }
     if (nr_files == 0) fail("file list is empty.");
     
+    // compute hash of normalized path, and get data order
+    for (i = 0; i < nr_files; i++) {
+        cpk_normalize_path(buf, filelist[i]);
+        _strlwr(buf);
+        filecrc[i] = cpk_crc32(buf);
+        fileorder[i] = i;
+    }
+    if (tracefn) load_trace(tracefn, cpkfn);
+    
     // sort file list
     for (i = 0; i < nr_files; i++) {
         filelist_sorted[i] = filelist[i];
@@ -162,7 +369,10 @@ int main(int argc, char *argv[])
     qsort(filelist_sorted, nr_files, sizeof(char *), cmp_stricmp);
     
     // open cpk file for write
-    fp = fopen(cpkfn, "wb");
+    //   also readable, dedup reads back written data to verify
+    fp = fopen(cpkfn, "w+b");
+    if (!fp) fail("can't open '%s' for write.", cpkfn);
+    memset(payload_head, -1, sizeof(payload_head));
     
     // write dummy header and crc table
     //   will be overwrited later
@@ -171,10 +381,8 @@ int main(int argc, char *argv[])
     fwrite_safe(&cpkhdr, sizeof(cpkhdr), 1, fp);
     fwrite_safe(&cpktbl, sizeof(cpktbl), 1, fp);
     
-    // make dummy data for extrainfo
-    char extrainfo[0x3A];
-    memset(extrainfo, 0, 2);
-    memset(extrainfo + 2, 0xCC, 0x38);
+    char extrainfo[MAXLINE + CPK_EXTRAINFO_PADSIZE];
+    int extsize;
 
     // make dir entry
     char dirstr[MAXLINE];
@@ -210,30 +418,25 @@ int main(int argc, char *argv[])
                 strcpy(dirstack[lvl], token);
                 token = strtok(NULL, DIR_SEPARATOR);
             }
-            unsigned offset = 0, extsize = 0;
+            unsigned offset = 0;
+            extsize = 0;
             if (token) {
                 // create dir
                 printf("  create dir entry for '%s'\n", dirstr);
-                tblflag = 0x00000003;
-                
-                // parse base name
-                char *basename = strrchr(buf, '\\');
-                if (basename) basename++;
-                else basename = buf;
+                tblflag = CPK_TBLFLAG_DIR;
                 
-                // write extrainfo
+                // write extrainfo, dir stack top is the base name
                 offset = ftell(fp);
-                fwrite_safe(basename, 1, strlen(basename), fp);
-                fwrite_safe(extrainfo, 1, sizeof(extrainfo), fp);
-                extsize = strlen(basename) + sizeof(extrainfo);
+                extsize = cpk_make_extrainfo(extrainfo, dirstack[lvl]);
+                fwrite_safe(extrainfo, 1, extsize, fp);
                 
             } else {
                 // create file
                 printf("  create file entry for '%s'\n", dirstr);
-                tblflag = 0x00010005;
+                tblflag = CPK_TBLFLAG_FILE;
             }
             _strlwr(dirstr);
-            dircrc[lvl] = gbCrc32Compute(dirstr);
+            dircrc[lvl] = cpk_crc32(dirstr);
             if (nr_tbl >= CPK_MAXTABLENUM) {
                 fail("too many table entries.");
             }
@@ -252,33 +455,25 @@ int main(int argc, char *argv[])
     }
     
     // sort table entries
-    qsort(cpktbl, nr_tbl, sizeof(struct CPKTable), tblcmp);
-    for (i = 1; i < nr_tbl; i++) {
-        if (cpktbl[i - 1].dwCRC == cpktbl[i].dwCRC) {
-            fail("duplicate filename CRC.");
-        }
+    if (!cpk_sort_table(cpktbl, nr_tbl)) {
+        fail("duplicate filename CRC.");
     }
 
 
+    // start file readers
+    HANDLE readers[64];
+    InitializeCriticalSection(&pipe_cs);
+    InitializeConditionVariable(&pipe_cv);
+    for (i = 0; i < nr_readers; i++) {
+        readers[i] = CreateThread(NULL, 0, reader_thread, NULL, 0, NULL);
+        if (!readers[i]) fail("can't create reader thread.");
+    }
+    
     // copy file data
     for (i = 0; i < nr_files; i++) {
-        char *fpath = filelist[i];
+        char *fpath = filelist[fileorder[i]];
         // normalize path
-        strcpy(buf, fpath);
-        char *dst = buf, *src = buf;
-        while (*src) {
-            if (strchr(DIR_SEPARATOR, *src)) {
-                while (*src && strchr(DIR_SEPARATOR, *src)) src++;
-                if (*src) {
-                    *dst++ = '\\';
-                } else {
-                    *dst = '\0';
-                    break;
-                }
-            } else {
-                *dst++ = *src++;
-            }
-        }
+        cpk_normalize_path(buf, fpath);
         
         // parse base name
         char fn[MAXLINE];
@@ -291,54 +486,52 @@ int main(int argc, char *argv[])
         _strlwr(buf);
         struct CPKTable tblkey;
         tblkey = (struct CPKTable) {
-            .dwCRC = gbCrc32Compute(buf),
+            .dwCRC = filecrc[fileorder[i]],
         };
         
         // binary search in table
         struct CPKTable *p;
         p = bsearch(&tblkey, cpktbl, nr_tbl, sizeof(struct CPKTable), tblcmp);
         
-        // copy data
-        p->dwStartPos = ftell(fp);
-        FILE *datafp = fopen(fpath, "rb");
-        if (!datafp) fail("can't open '%s'.", fpath);
-        int cnt;
-        int r;
-        unsigned filesz = 0;
-        char databuf[MAXLINE];
-        while ((cnt = fread(databuf, 1, sizeof(databuf), datafp)) > 0) {
-            r = fwrite_safe(databuf, 1, cnt, fp);
-            filesz += r;
+        // share payload if same data and name is already written
+        struct datajob *job = wait_datajob(i);
+        unsigned filesz = job->size;
+        extsize = cpk_make_extrainfo(extrainfo, fn);
+        p->dwPackedSize = p->dwOriginSize = filesz;
+        p->dwExtraInfoSize = extsize;
+        if (dedup_enabled) {
+            unsigned long long hash = fnv1a64(job->data, filesz);
+            struct payload *pl = find_payload(fp, hash, job->data, filesz, fn);
+            if (pl) {
+                p->dwStartPos = pl->start;
+                done_datajob(job);
+                nr_shared++;
+                shared_bytes += filesz + extsize;
+                printf("  share data for '%s'\n", buf);
+                continue;
+            }
+            add_payload(hash, ftell(fp), filesz, fn);
         }
-        fclose(datafp);
         
-        p->dwPackedSize = p->dwOriginSize = filesz;
+        // copy data
+        p->dwStartPos = ftell(fp);
+        fwrite_safe(job->data, 1, filesz, fp);
+        done_datajob(job);
         
         // write extrainfo
-        fwrite_safe(fn, 1, strlen(fn), fp);
-        fwrite_safe(extrainfo, 1, sizeof(extrainfo), fp);
-        p->dwExtraInfoSize = strlen(fn) + sizeof(extrainfo);
+        fwrite_safe(extrainfo, 1, extsize, fp);
         
         printf("  copy data for '%s'\n", buf);
     }
+    WaitForMultipleObjects(nr_readers, readers, TRUE, INFINITE);
+    for (i = 0; i < nr_readers; i++) {
+        CloseHandle(readers[i]);
+    }
+    DeleteCriticalSection(&pipe_cs);
     
     
     // make cpk header
-    cpkhdr = (struct CPKHeader) {
-        .dwLable = 0x1A545352,
-        .dwVersion = 1,
-        .dwTableStart = sizeof(struct CPKHeader),
-        .dwDataStart = sizeof(struct CPKHeader) + sizeof(struct CPKTable) * CPK_MAXTABLENUM,
-        .dwMaxFileNum = CPK_MAXTABLENUM,
-        .dwFileNum = nr_tbl,
-        .dwIsFormatted = 0,
-        .dwSizeOfHeader = sizeof(struct CPKHeader),
-        .dwValidTableNum = nr_tbl,
-        .dwMaxTableNum = CPK_MAXTABLENUM,
-        .dwFragmentNum = 0,
-        .dwPackageSize = ftell(fp),
-    };
-    memset(cpkhdr.dwReserved, 0, sizeof(cpkhdr.dwReserved));
+    cpk_make_header(&cpkhdr, nr_tbl, ftell(fp));
     
     // write cpk header
     rewind(fp);
@@ -347,6 +540,7 @@ int main(int argc, char *argv[])
     
     fclose(fp);
     printf("    %d file(s) packed.\n", nr_files);
+    if (dedup_enabled) printf("    %d file(s) shared data, %.1f MB saved.\n", nr_shared, shared_bytes / 1048576.0);
 
     return 0;
 }
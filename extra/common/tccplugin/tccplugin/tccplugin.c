@@ -12,6 +12,10 @@
 #include "PAL3Apatch.h"
 #endif
 
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
 #define TCCPLUGINAPI_EXPORTS
 #include "tccplugin.h"
 
@@ -26,6 +30,18 @@ static void tccmsg_to_cstr(void *opaque, const char *msg)
     cstr_strcat(s, "\n");
 }
 
+static TCCState *cpi_new_tcc(struct cpi *self, int output_type)
+{
+    TCCState *tcc = tcc_new();
+    if (!tcc) return NULL;
+    
+    // initialize tcc
+    tcc_set_error_func(tcc, &self->tccmsg, tccmsg_to_cstr);
+    tcc_set_output_type(tcc, output_type);
+    tcc_set_options(tcc, "-Wall -fms-extensions -mms-bitfields");
+    return tcc;
+}
+
 
 void cpi_ctor(struct cpi *self)
 {
@@ -33,12 +49,8 @@ void cpi_ctor(struct cpi *self)
     memset(self, 0, sizeof(*self));
     cstr_ctor(&self->tccmsg);
     cstr_ctor(&self->srclist);
-    self->tcc = tcc_new();
-    
-    // initialize tcc
-    tcc_set_error_func(self->tcc, &self->tccmsg, tccmsg_to_cstr);
-    tcc_set_output_type(self->tcc, TCC_OUTPUT_MEMORY);
-    tcc_set_options(self->tcc, "-Wall -fms-extensions -mms-bitfields");
+    cstr_ctor(&self->defines);
+    self->tcc = cpi_new_tcc(self, TCC_OUTPUT_MEMORY);
 }
 void cpi_dtor(struct cpi *self)
 {
@@ -49,6 +61,291 @@ void cpi_dtor(struct cpi *self)
     if (self->runmem) VirtualFree(self->runmem, 0, MEM_RELEASE);
     cstr_dtor(&self->tccmsg);
     cstr_dtor(&self->srclist);
+    cstr_dtor(&self->defines);
+}
+
+void cpi_define_symbol(struct cpi *self, const char *sym, const char *value)
+{
+    if (!value) value = "";
+    tcc_define_symbol(self->tcc, sym, value);
+    cstr_strcat(&self->defines, sym);
+    cstr_strcat(&self->defines, "=");
+    cstr_strcat(&self->defines, value);
+    cstr_strcat(&self->defines, "\n");
+}
+
+
+
+// compiled object cache
+//   each C source is compiled to an object file in TCCPLUGIN_CACHE_PATH,
+//   named by hash of its path, with a key file beside it
+//   the key is a hash of converted source text, defined symbols, include path,
+//   and size/mtime of headers and libtcc.dll, the object is rebuilt if key changes
+//   libtcc doesn't report dependencies, so headers are fingerprinted by directory
+
+#define FNV64_INIT 0xCBF29CE484222325ULL
+
+static unsigned long long fnv64(unsigned long long h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    while (len--) {
+        h ^= *p++;
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+static unsigned long long fnv64_str(unsigned long long h, const char *s)
+{
+    return fnv64(h, s, strlen(s) + 1);
+}
+
+static void fingerprint_file(const char *filepath, void *arg)
+{
+    unsigned long long *h = arg;
+    wchar_t wpath[MAXLINE];
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    *h = fnv64_str(*h, filepath);
+    if (utf8_filepath_to_wstr_fullpath(filepath, wpath, MAXLINE, NULL) && GetFileAttributesExW(wpath, GetFileExInfoStandard, &attr)) {
+        *h = fnv64(*h, &attr.nFileSizeLow, sizeof(attr.nFileSizeLow));
+        *h = fnv64(*h, &attr.ftLastWriteTime, sizeof(attr.ftLastWriteTime));
+    }
+}
+
+static unsigned long long cache_env_hash()
+{
+    static int ready = 0;
+    static unsigned long long h;
+    if (!ready) {
+        h = FNV64_INIT;
+        fingerprint_file(TCCPLUGIN_INSTALL_PATH "\\libtcc.dll", &h);
+        enum_files(TCCPLUGIN_INSTALL_PATH "\\include", "*.h", fingerprint_file, &h);
+#ifdef BUILD_FOR_PAL3
+        enum_files(TCCPLUGIN_INSTALL_PATH "\\include\\PAL3patch", "*.h", fingerprint_file, &h);
+#endif
+#ifdef BUILD_FOR_PAL3A
+        enum_files(TCCPLUGIN_INSTALL_PATH "\\include\\PAL3Apatch", "*.h", fingerprint_file, &h);
+#endif
+        ready = 1;
+    }
+    return h;
+}
+
+static unsigned long long cpi_cache_key(struct cpi *self, const char *filepath, const char *srctext, const char *incpath)
+{
+    struct cstr srcdir; cstr_ctor(&srcdir);
+    unsigned long long h = cache_env_hash();
+    h = fnv64_str(h, srctext);
+    h = fnv64_str(h, cstr_getstr(&self->defines));
+    h = fnv64_str(h, incpath);
+    
+    // headers beside the source
+    const char *filepart = get_filepart(filepath);
+    if (filepart != filepath) {
+        cstr_strcpy(&srcdir, filepath);
+        cstr_pop(&srcdir, strlen(filepart) + 1);
+    } else {
+        cstr_strcpy(&srcdir, ".");
+    }
+    enum_files(cstr_getstr(&srcdir), "*.h", fingerprint_file, &h);
+    
+    cstr_dtor(&srcdir);
+    return h;
+}
+
+static void cpi_apply_defines(struct cpi *self, TCCState *tcc)
+{
+    char *buf = strdup(cstr_getstr(&self->defines));
+    char *line;
+    if (!buf) return;
+    for (line = strtok(buf, "\n"); line; line = strtok(NULL, "\n")) {
+        char *eq = strchr(line, '=');
+        if (!eq) continue;
+        *eq = '\0';
+        tcc_define_symbol(tcc, line, eq + 1);
+    }
+    free(buf);
+}
+
+
+// header snapshot
+//   libtcc can't save a parsed TCCState, so the snapshot is preprocessed text
+//   the prologue of a source (leading preprocessor lines, up to the last
+//   top-level #include) is preprocessed once with "-E -dD" to a file in
+//   TCCPLUGIN_CACHE_PATH, named by hash of prologue and cache key inputs
+//   then the source is compiled as snapshot + rest of source, so editing
+//   plugin code doesn't re-read and re-preprocess PATCHAPI headers
+//   sources without such a prologue, or any failure, fall back to plain text
+
+static size_t find_prologue(const char *srctext, int *nr_lines)
+{
+    // returns length of prologue, 0 if there is none
+    const char *p = srctext;
+    size_t prologue = 0;
+    int depth = 0, lines = 0, has_include = 0, cont = 0;
+    *nr_lines = 0;
+    while (*p) {
+        const char *eol = strchr(p, '\n');
+        const char *next = eol ? eol + 1 : p + strlen(p);
+        const char *s = p;
+        const char *e = eol ? eol : next;
+        while (s < e && (*s == ' ' || *s == '\t')) s++;
+        while (e > s && (e[-1] == '\r' || e[-1] == ' ' || e[-1] == '\t')) e--;
+        if (cont) {
+            // continuation of previous directive
+        } else if (*s == '#') {
+            s++;
+            while (s < e && (*s == ' ' || *s == '\t')) s++;
+            if (strncmp(s, "if", 2) == 0) depth++;
+            else if (strncmp(s, "endif", 5) == 0) depth--;
+            else if (strncmp(s, "include", 7) == 0) has_include = 1;
+        } else if (s != e && strncmp(s, "//", 2) != 0) {
+            break;
+        }
+        cont = e > s && e[-1] == '\\';
+        lines++;
+        p = next;
+        if (depth < 0) break;
+        if (!cont && depth == 0 && has_include) {
+            prologue = p - srctext;
+            *nr_lines = lines;
+        }
+    }
+    return prologue;
+}
+
+static int preprocess_to_file(struct cpi *self, const char *text, const char *incpath, const char *outpath)
+{
+    // tcc writes preprocessed text to stdout, redirect it to outpath
+    int fd, oldfd, r;
+    TCCState *pptcc = cpi_new_tcc(self, TCC_OUTPUT_PREPROCESS);
+    if (!pptcc) return 0;
+    tcc_set_options(pptcc, "-dD");
+    cpi_apply_defines(self, pptcc);
+    if (*incpath) tcc_add_include_path(pptcc, incpath);
+    
+    fd = _open(outpath, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+    if (fd < 0) {
+        tcc_delete(pptcc);
+        return 0;
+    }
+    fflush(stdout);
+    oldfd = _dup(1);
+    r = _dup2(fd, 1) == 0 && tcc_compile_string(pptcc, text) != -1;
+    fflush(stdout);
+    if (oldfd >= 0) {
+        _dup2(oldfd, 1);
+        _close(oldfd);
+    }
+    _close(fd);
+    tcc_delete(pptcc);
+    return r;
+}
+
+static int cpi_snapshot_text(struct cpi *self, const char *srctext, const char *incpath, struct cstr *out)
+{
+    // make compile text using snapshot, returns 0 if not possible
+    char snappath[MAXLINE], tmppath[MAXLINE];
+    struct cstr prologue; cstr_ctor(&prologue);
+    char *snap = NULL;
+    int ret = 0;
+    int nr_lines;
+    size_t len = find_prologue(srctext, &nr_lines);
+    if (!len) goto done;
+    
+    cstr_strncat(&prologue, srctext, len);
+    unsigned long long h = fnv64_str(cache_env_hash(), cstr_getstr(&prologue));
+    h = fnv64_str(h, cstr_getstr(&self->defines));
+    h = fnv64_str(h, incpath);
+    snprintf(snappath, sizeof(snappath), "%s\\%08X%08X.snap.h", TCCPLUGIN_CACHE_PATH, (unsigned) (h >> 32), (unsigned) h);
+    
+    snap = read_file_as_cstring(snappath);
+    if (!snap) {
+        // write to temp file first, so a partial snapshot won't be used
+        snprintf(tmppath, sizeof(tmppath), "%s.tmp", snappath);
+        create_dir(TCCPLUGIN_CACHE_PATH);
+        if (!preprocess_to_file(self, cstr_getstr(&prologue), incpath, tmppath) || !MoveFileExA(tmppath, snappath, MOVEFILE_REPLACE_EXISTING)) {
+            plog("can't make header snapshot '%s'.", snappath);
+            DeleteFileA(tmppath);
+            goto done;
+        }
+        plog("header snapshot '%s' created.", snappath);
+        snap = read_file_as_cstring(snappath);
+        if (!snap) goto done;
+    }
+    if (!*snap) goto done;
+    
+    // restore line numbers of rest of source
+    cstr_strcpy(out, snap);
+    cstr_format(&prologue, "\n#line %d \"<string>\"\n", nr_lines + 1);
+    cstr_strcat(out, cstr_getstr(&prologue));
+    cstr_strcat(out, srctext + len);
+    ret = 1;
+done:
+    cstr_dtor(&prologue);
+    patch_free(snap);
+    return ret;
+}
+
+static int cpi_compile_cached(struct cpi *self, const char *filepath, const char *srctext, const char *incpath)
+{
+    // returns 0 on success, -1 on compile error, -2 if cache is not usable
+    char objpath[MAXLINE], keypath[MAXLINE], key[32];
+    char *oldkey = NULL;
+    struct cstr snaptext; cstr_ctor(&snaptext);
+    TCCState *objtcc = NULL;
+    FILE *fp;
+    int r = -2;
+    unsigned long long h;
+    
+    h = fnv64_str(FNV64_INIT, filepath);
+    snprintf(objpath, sizeof(objpath), "%s\\%08X%08X.o", TCCPLUGIN_CACHE_PATH, (unsigned) (h >> 32), (unsigned) h);
+    snprintf(keypath, sizeof(keypath), "%s\\%08X%08X.key", TCCPLUGIN_CACHE_PATH, (unsigned) (h >> 32), (unsigned) h);
+    h = cpi_cache_key(self, filepath, srctext, incpath);
+    snprintf(key, sizeof(key), "%08X%08X", (unsigned) (h >> 32), (unsigned) h);
+    
+    // try cached object
+    oldkey = read_file_as_cstring(keypath);
+    if (oldkey && strcmp(oldkey, key) == 0) {
+        if (tcc_add_file(self->tcc, objpath) != -1) {
+            plog("using cached object '%s'.", objpath);
+            r = 0;
+        } else {
+            plog("can't load cached object '%s'.", objpath);
+            DeleteFileA(keypath);
+        }
+        goto done;
+    }
+    
+    // compile to object file
+    create_dir(TCCPLUGIN_CACHE_PATH);
+    DeleteFileA(keypath);
+    objtcc = cpi_new_tcc(self, TCC_OUTPUT_OBJ);
+    if (!objtcc) goto done;
+    cpi_apply_defines(self, objtcc);
+    if (*incpath) tcc_add_include_path(objtcc, incpath);
+    if (tcc_compile_string(objtcc, cpi_snapshot_text(self, srctext, incpath, &snaptext) ? cstr_getstr(&snaptext) : srctext) == -1) {
+        r = -1;
+        goto done;
+    }
+    if (tcc_output_file(objtcc, objpath) == -1) {
+        plog("can't write cached object '%s'.", objpath);
+        goto done;
+    }
+    if (tcc_add_file(self->tcc, objpath) == -1) goto done;
+    r = 0;
+    
+    // write key last, so a partial object won't be used
+    fp = fopen(keypath, "w");
+    if (fp) {
+        fputs(key, fp);
+        fclose(fp);
+    }
+    
+done:
+    if (objtcc) tcc_delete(objtcc);
+    cstr_dtor(&snaptext);
+    patch_free(oldkey);
+    return r;
 }
 
 int cpi_add_c_source(struct cpi *self, const char *filepath)
@@ -107,9 +404,13 @@ int cpi_add_c_source(struct cpi *self, const char *filepath)
         wstr_discardbuffer(&wincpath);
     }
     
-    // do compile
+    // do compile, use cached object if possible
     cstr_clear(&self->tccmsg);
-    r = tcc_compile_string(self->tcc, srctext);
+    r = cpi_compile_cached(self, filepath, srctext, cstr_getstr(&incpath));
+    if (r == -2) {
+        cstr_clear(&self->tccmsg);
+        r = tcc_compile_string(self->tcc, srctext);
+    }
     cpi_try_dump_tccmsg(self);
     
     if (r == -1) {
@@ -284,13 +585,13 @@ int run_c_program(const char *filepath, const char *entrysymbol, int persist)
     struct cstr filepart_string; cstr_ctor(&filepart_string);
     
     cstr_format(&filepart_string, "\"%s\"", get_filepart(filepath));
-    tcc_define_symbol(s.tcc, "TCCPLUGIN_FILE", cstr_getstr(&filepart_string));
+    cpi_define_symbol(&s, "TCCPLUGIN_FILE", cstr_getstr(&filepart_string));
     
     #ifdef BUILD_FOR_PAL3
-    tcc_define_symbol(s.tcc, "BUILD_FOR_PAL3", "1");
+    cpi_define_symbol(&s, "BUILD_FOR_PAL3", "1");
     #endif
     #ifdef BUILD_FOR_PAL3A
-    tcc_define_symbol(s.tcc, "BUILD_FOR_PAL3A", "1");
+    cpi_define_symbol(&s, "BUILD_FOR_PAL3A", "1");
     #endif
     
     cpi_add_c_source(&s, filepath);
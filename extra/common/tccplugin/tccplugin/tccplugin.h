@@ -24,10 +24,12 @@ struct cpi { // C plugin instance
     struct cstr srclist;
     int err_flag;
     int user_ignore_err;
+    struct cstr defines; // "name=value\n" list, part of object cache key
 };
 
 extern TCCPLUGINAPI void cpi_ctor(struct cpi *self);
 extern TCCPLUGINAPI void cpi_dtor(struct cpi *self);
+extern TCCPLUGINAPI void cpi_define_symbol(struct cpi *self, const char *sym, const char *value);
 extern TCCPLUGINAPI int cpi_add_c_source(struct cpi *self, const char *filepath);
 extern TCCPLUGINAPI int cpi_link(struct cpi *self);
 extern TCCPLUGINAPI int cpi_run(struct cpi *self, const char *entryname);
@@ -45,6 +47,7 @@ extern TCCPLUGINAPI void search_cplugins(const char *dirpath, struct cstr *filel
 
 #define TCCPLUGIN_MSGBOX_TITLE "TCC Plugin for PAL3patch"
 #define TCCPLUGIN_INSTALL_PATH "plugins\\tcc"
+#define TCCPLUGIN_CACHE_PATH TCCPLUGIN_INSTALL_PATH "\\cache"
 
 #endif
 
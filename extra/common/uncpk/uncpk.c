@@ -3,9 +3,13 @@
 #include <direct.h>
 #include <errno.h>
 #include <locale.h>
+#include "../cpklib/cpklib.h"
 
-// requirements:
-//   put 'GBENGINE.DLL', 'MSS32.DLL', 'TOPO.DLL', 'IJL15.DLL' with this program
+// build: CL /O2 uncpk.c ..\cpklib\cpklib.c
+//   CPK is read by cpklib, game DLLs are not needed
+// usage: uncpk CPK_NAME DIR_PREFIX [THREADS]
+//        uncpk -v CPK_NAME [THREADS]
+//   -v verifies all entries without writing anything
 
 
 static void fail(const char *fmt, ...)
@@ -19,130 +23,6 @@ static void fail(const char *fmt, ...)
     va_end(ap);
 }
 
-HMODULE LoadLibrary_safe(LPCTSTR lpFileName)
-{
-    HMODULE ret = LoadLibrary(lpFileName);
-    if (!ret) fail("can't load library '%s'.", lpFileName);
-    return ret;
-}
-
-FARPROC GetProcAddress_safe(HMODULE hModule, LPCSTR lpProcName)
-{
-    FARPROC ret = GetProcAddress(hModule, lpProcName);
-    if (!ret) fail("can't find proc address for '%s'.", lpProcName);
-    return ret;
-}
-
-
-
-// these structures are read from PAL3A.PDB
-enum ECPKMode { 
-    CPKM_Null,
-    CPKM_Normal,
-    CPKM_FileMapping,
-    CPKM_Overlapped,
-    CPKM_End,
-};
-struct CPKHeader {
-    ULONG dwLable;
-    ULONG dwVersion;
-    ULONG dwTableStart;
-    ULONG dwDataStart;
-    ULONG dwMaxFileNum;
-    ULONG dwFileNum;
-    ULONG dwIsFormatted;
-    ULONG dwSizeOfHeader;
-    ULONG dwValidTableNum;
-    ULONG dwMaxTableNum;
-    ULONG dwFragmentNum;
-    ULONG dwPackageSize;
-    ULONG dwReserved[0x14];
-};
-struct CPKTable {
-    ULONG dwCRC;
-    ULONG dwFlag;
-    ULONG dwFatherCRC;
-    ULONG dwStartPos;
-    ULONG dwPackedSize;
-    ULONG dwOriginSize;
-    ULONG dwExtraInfoSize;
-};
-struct CPKFile {
-    BYTE bValid;
-    ULONG dwCRC;
-    ULONG dwFatherCRC;
-    int nTableIndex;
-    void *lpMapAddress;
-    void *lpStartAddress;
-    ULONG dwOffset;
-    BYTE bCompressed;
-    void *lpMem;
-    ULONG dwFileSize;
-    ULONG dwPointer;
-    struct CPKTable *pTableItem;
-};
-struct gbVFile;
-struct CPK {
-    ULONG m_dwAllocGranularity;
-    enum ECPKMode m_eMode;
-    struct CPKHeader m_CPKHeader;
-    struct CPKTable m_CPKTable[0x8000];
-    struct gbVFile *m_pgbVFile[0x8];
-    BYTE m_bLoaded;
-    ULONG m_dwCPKHandle;
-    ULONG m_dwCPKMappingHandle;
-    char m_szCPKFileName[0x104];
-    int m_nOpenedFileNum;
-};
-
-
-
-
-
-// helper macros
-#define TOPTR(addr) ((void *)(addr))
-#define TOUINT(x) ((unsigned)(x))
-#define MAKE_THISCALL_FUNCPTR(addr, ret_type, this_type, ...) ((ret_type (__fastcall *)(this_type, int, ##__VA_ARGS__)) TOPTR(addr))
-#define THISCALL_WRAPPER(func, this, ...) func(this, 0, ##__VA_ARGS__)
-
-#define CPK_ctor(this) THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(pCPK_ctor, void, struct CPK *), this)
-#define CPK_Load(this, cpkname) THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(pCPK_Load, BOOL, struct CPK *, const char *), this, cpkname)
-#define CPK_GetTableIndexFromCRC(this, crc) THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(pCPK_GetTableIndexFromCRC, int, struct CPK *, unsigned long), this, crc)
-#define CPK_Open(this, path) THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(pCPK_Open, struct CPKFile *, struct CPK *, const char *), this, path)
-#define CPK_Close(this, fp) THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(pCPK_Close, BOOL, struct CPK *, struct CPKFile *), this, fp)
-#define CPK_Read(this, buf, size, fp) THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(pCPK_Read, BOOL, struct CPK *, void *, unsigned long, struct CPKFile *), this, buf, size, fp)
-
-// function pointers
-void *pCPK_ctor;
-void *pCPK_Load;
-void *pCPK_GetTableIndexFromCRC;
-void *pCPK_Open;
-void *pCPK_Close;
-void *pCPK_Read;
-char *(*gbsetlocale)(int, const char *);
-
-// dynamic linker
-void dynlink()
-{
-    HMODULE h_gbengine = LoadLibrary_safe("GBENGINE.DLL");
-    pCPK_ctor = GetProcAddress_safe(h_gbengine, "??0CPK@@QAE@XZ");
-    pCPK_Load = GetProcAddress_safe(h_gbengine, "?Load@CPK@@QAE_NPBD@Z");
-    pCPK_GetTableIndexFromCRC = GetProcAddress_safe(h_gbengine, "?GetTableIndexFromCRC@CPK@@AAEHK@Z");
-    pCPK_Open = GetProcAddress_safe(h_gbengine, "?Open@CPK@@QAEPAVCPKFile@@PBD@Z");
-    pCPK_Close = GetProcAddress_safe(h_gbengine, "?Close@CPK@@QAE_NPAVCPKFile@@@Z");
-    pCPK_Read = GetProcAddress_safe(h_gbengine, "?Read@CPK@@QAE_NPAXKPAVCPKFile@@@Z");
-
-#define P2A(p) (TOUINT(p) - TOUINT(h_gbengine) + 0x10000000)
-#define A2P(a) TOPTR((a) - 0x10000000 + TOUINT(h_gbengine))
-    if (P2A(pCPK_ctor) == 0x1002c4b0 && P2A(pCPK_Load) == 0x1002c660 && P2A(pCPK_GetTableIndexFromCRC) == 0x1002da00 && P2A(pCPK_Open) == 0x1002cc50 && P2A(pCPK_Close) == 0x1002d1a0 && P2A(pCPK_Read) == 0x1002d270) {
-        gbsetlocale = A2P(0x100e6b41); // PAL3
-    }
-    if (P2A(pCPK_ctor) == 0x1002a2e0 && P2A(pCPK_Load) == 0x1002a450 && P2A(pCPK_GetTableIndexFromCRC) == 0x1002b1e0 && P2A(pCPK_Open) == 0x1002a800 && P2A(pCPK_Close) == 0x1002ac10 && P2A(pCPK_Read) == 0x1002acf0) {
-        gbsetlocale = A2P(0x100c7dc7); // PAL3A
-    }
-    if (!gbsetlocale) fail("address of setlocale() is unknown.");
-}
-
 
 
 
@@ -151,93 +31,45 @@ void dynlink()
 #define MAXLINE 4096
 
 const char *cpkfile;
-struct CPK cpk;
-char *cpk_namelist[0x8000]; // only file name
-char *cpk_pathlist[0x8000]; // full path
+struct cpkarchive cpk;
+char *cpk_pathlist[CPK_MAXTABLENUM]; // full path
 
 int cpk_dircount;
-char *cpk_dirlist[0x8000]; // use pointers from cpk_pathlist[]
+char *cpk_dirlist[CPK_MAXTABLENUM]; // use pointers from cpk_pathlist[]
 
 char prefix[MAXLINE];
 
+int verify_only; // report corrupt entries instead of extracting
+volatile LONG corrupt_cnt;
+
 
 void init_cpk()
 {
     printf("init cpk ...\n");
-    if (sizeof(struct CPK) != 0xe01bc) fail("sizeof(struct CPK) is wrong, current is %08X.", sizeof(struct CPK));
-    CPK_ctor(&cpk);
-    CPK_Load(&cpk, cpkfile);
+    if (!cpk_open(&cpk, cpkfile)) fail("can't open '%s' as CPK.", cpkfile);
 }
 
-int is_valid(int tindex)
-{
-    return cpk.m_CPKTable[tindex].dwExtraInfoSize != 0 && ((cpk.m_CPKTable[tindex].dwFlag & 1) && !(cpk.m_CPKTable[tindex].dwFlag & 0x10));
-}
-
-void make_cpk_namelist()
+void make_cpk_pathlist()
 {
-    printf("load names ...\n");
-    FILE *fp = fopen(cpkfile, "rb");
-    if (!fp) fail("can't open file '%s'.", cpkfile);
-    memset(cpk_namelist, 0, sizeof(cpk_namelist));
+    printf("make paths ...\n");
+    memset(cpk_pathlist, 0, sizeof(cpk_pathlist));
     int i;
-    for (i = 0; i < cpk.m_CPKHeader.dwValidTableNum; i++) {
-        long name_offset = cpk.m_CPKTable[i].dwStartPos + cpk.m_CPKTable[i].dwPackedSize;
-        long name_length = cpk.m_CPKTable[i].dwExtraInfoSize;
-        if (!is_valid(i)) {
+    char buf[MAXLINE];
+    for (i = 0; i < cpk.nr_tbl; i++) {
+        if (!cpk_is_valid(&cpk, i)) {
             printf("ignoring empty file entry %d.\n", i);
             continue;
         }
-        
-        if (fseek(fp, name_offset, SEEK_SET) != 0) {
-            fail("can't seek to %08X.", name_offset);
-        }
-        cpk_namelist[i] = malloc(name_length);
-        if (fread(cpk_namelist[i], 1, name_length, fp) != name_length) {
-            fail("can't read next %08X bytes.", name_length);
+        if (cpk_get_path(&cpk, i, buf, sizeof(buf)) < 0) {
+            if (!verify_only) fail("can't get path of entry %d.", i);
+            printf("  CORRUPT: entry %d, can't get path.\n", i);
+            corrupt_cnt++;
+            continue;
         }
-        
-        //printf("%s\n", cpk_namelist[i]);
-    }
-    fclose(fp);
-}
-
-int get_full_path(int tindex, char *buf)
-{
-    int len;
-    ULONG father_crc = cpk.m_CPKTable[tindex].dwFatherCRC;
-    if (father_crc == 0) {
-        if (buf) *buf = 0;
-        len = 0;
-    } else {
-        len = get_full_path(CPK_GetTableIndexFromCRC(&cpk, father_crc), buf);
-    }
-    if (buf) {
-        buf[len] = '\\';
-        strcpy(buf + len + 1, cpk_namelist[tindex]);
-    }
-    len += 1 + strlen(cpk_namelist[tindex]);
-    return len;
-}
-void make_cpk_pathlist()
-{
-    printf("make paths ...\n");
-    memset(cpk_pathlist, 0, sizeof(cpk_pathlist));
-    int i;
-    for (i = 0; i < cpk.m_CPKHeader.dwValidTableNum; i++) {
-        if (!is_valid(i)) continue;
-        int len = get_full_path(i, NULL);
-        cpk_pathlist[i] = malloc(len + 1);
-        get_full_path(i, cpk_pathlist[i]);
+        cpk_pathlist[i] = strdup(buf);
     }
 }
 
-int is_dir(int tindex)
-{
-    // reference CPK::IsDir
-    return (cpk.m_CPKTable[tindex].dwFlag >> 1) & 1;
-}
-
 int dircmp(const void *a, const void *b)
 {
     return strcmp(*(const char **)a, *(const char **)b);
@@ -253,8 +85,8 @@ void make_dir()
     
     int i;
     cpk_dircount = 0;
-    for (i = 0; i < cpk.m_CPKHeader.dwValidTableNum; i++) {
-        if (!is_dir(i)) continue;
+    for (i = 0; i < cpk.nr_tbl; i++) {
+        if (!cpk_is_valid(&cpk, i) || !cpk_is_dir(&cpk, i)) continue;
         cpk_dirlist[cpk_dircount++] = cpk_pathlist[i];
     }
     
@@ -262,7 +94,7 @@ void make_dir()
     
     mkdir_safe(prefix);
     for (i = 0; i < cpk_dircount; i++) {
-        char *dir = cpk_dirlist[i] + 1;
+        char *dir = cpk_dirlist[i];
         char target_dir[MAXLINE];
         snprintf(target_dir, sizeof(target_dir), "%s\\%s", prefix, dir);
         //printf("mkdir %s\n", target_dir);
@@ -280,84 +112,186 @@ int str_iendwith(const char *a, const char *b)
 
 int rankcmp(const void *pa, const void *pb)
 {
-    DWORD a = cpk.m_CPKTable[*(const int *)pa].dwStartPos;
-    DWORD b = cpk.m_CPKTable[*(const int *)pb].dwStartPos;
+    DWORD a = cpk.tbl[*(const int *)pa].dwStartPos;
+    DWORD b = cpk.tbl[*(const int *)pb].dwStartPos;
     return a == b ? 0 : (a < b ? -1 : 1);
 }
 
-void extract_files()
+// extract worker
+//   all workers share the read-only archive, data is read from mapped view directly
+#define MAXTHREADS 32
+
+int nr_threads = 1;
+static int r[CPK_MAXTABLENUM];
+volatile LONG next_job;
+volatile LONG extract_cnt;
+CRITICAL_SECTION progress_cs;
+unsigned long long extract_bytes;
+
+DWORD WINAPI extract_worker(LPVOID param)
 {
-    int extract_cnt = 0;
-    printf("extracting files ...\n");
-    
     int i, j;
+    char *buf = NULL;
+    int bufsize = 0;
+    unsigned long long bytes = 0;
     
-    static int r[0x8000];
-    for (i = 0; i < cpk.m_CPKHeader.dwValidTableNum; i++) {
-        r[i] = i;
-    }
-    qsort(r, cpk.m_CPKHeader.dwValidTableNum, sizeof(int), rankcmp);
-    
-    for (j = 0; j < cpk.m_CPKHeader.dwValidTableNum; j++) {
-        if (j % 1000 == 0) printf("  progress %d/%d ...\n", j, (int) cpk.m_CPKHeader.dwValidTableNum);
+    while ((j = InterlockedIncrement(&next_job) - 1) < cpk.nr_tbl) {
+        if (j % 1000 == 0) {
+            EnterCriticalSection(&progress_cs);
+            printf("  progress %d/%d ...\n", j, cpk.nr_tbl);
+            LeaveCriticalSection(&progress_cs);
+        }
         i = r[j];
         
-        if (!is_valid(i)) continue;
-        if (is_dir(i)) continue;
+        if (!cpk_is_valid(&cpk, i)) continue;
+        char *path = cpk_pathlist[i];
+        if (!path) continue;
         
-
+        // table checks, name hash and parent must match
+        if (verify_only) {
+            char lwr[MAXLINE];
+            snprintf(lwr, sizeof(lwr), "%s", path);
+            _strlwr(lwr);
+            const char *err = NULL;
+            if (cpk_crc32(lwr) != cpk.tbl[i].dwCRC) {
+                err = "name CRC mismatch";
+            } else if (cpk.tbl[i].dwFatherCRC && cpk_find_crc(&cpk, cpk.tbl[i].dwFatherCRC) < 0) {
+                err = "parent not found";
+            }
+            if (err) {
+                EnterCriticalSection(&progress_cs);
+                printf("  CORRUPT: entry %d '%s', %s.\n", i, path, err);
+                LeaveCriticalSection(&progress_cs);
+                InterlockedIncrement(&corrupt_cnt);
+                continue;
+            }
+        }
+        
+        if (cpk_is_dir(&cpk, i)) continue;
         
-        // read from CPK
-        char *path = cpk_pathlist[i] + 1;
+        // read from CPK, reuse buffer between files
+        //   in verify mode, a failed read is reported instead of fatal
+        //   cpk_read checks data range, decompressed size and packed size
         //printf("path=%s\n", path);
-        int size = cpk.m_CPKTable[i].dwOriginSize;
-        char *buf = malloc(size); 
-        struct CPKFile *cpkfp = CPK_Open(&cpk, path);
-        if (!cpkfp) fail("CPK_Open() failed, path = %s", path);
-        CPK_Read(&cpk, buf, size, cpkfp);
-        CPK_Close(&cpk, cpkfp);
-
-
+        int size = cpk.tbl[i].dwOriginSize;
+        if (size > bufsize) {
+            free(buf);
+            bufsize = size;
+            buf = malloc(bufsize);
+            if (!buf && !verify_only) fail("can't allocate %08X bytes.", bufsize);
+            if (!buf) bufsize = 0;
+        }
+        if (!cpk_read(&cpk, i, buf, bufsize)) {
+            if (!verify_only) fail("can't read '%s' from CPK.", path);
+            EnterCriticalSection(&progress_cs);
+            printf("  CORRUPT: entry %d '%s', can't read data (packed %u, origin %u).\n", i, path, (unsigned) cpk.tbl[i].dwPackedSize, (unsigned) cpk.tbl[i].dwOriginSize);
+            LeaveCriticalSection(&progress_cs);
+            InterlockedIncrement(&corrupt_cnt);
+            continue;
+        }
         
+        if (verify_only) {
+            InterlockedIncrement(&extract_cnt);
+            bytes += size;
+            continue;
+        }
+        
+        // write whole file in one call
         char target_path[MAXLINE];
         snprintf(target_path, sizeof(target_path), "%s\\%s", prefix, path);
         //printf("target file = %s\n", target_path);
-        FILE *fp = fopen(target_path, "wb");
-        if (!fp) fail("can't open '%s' for writing.", target_path);
-        if (fwrite(buf, 1, size, fp) != size) fail("write to '%s' failed.", target_path);
-        fclose(fp);
-        
-        extract_cnt++;
+        HANDLE hFile = CreateFile(target_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) fail("can't open '%s' for writing.", target_path);
+        DWORD written;
+        if (!WriteFile(hFile, buf, size, &written, NULL) || written != size) fail("write to '%s' failed.", target_path);
+        CloseHandle(hFile);
         
-        free(buf);
+        InterlockedIncrement(&extract_cnt);
+        bytes += size;
     }
     
-    printf("extracted %d files.\n", extract_cnt);
+    free(buf);
+    EnterCriticalSection(&progress_cs);
+    extract_bytes += bytes;
+    LeaveCriticalSection(&progress_cs);
+    return 0;
 }
 
+void extract_files()
+{
+    printf(verify_only ? "verifying files ...\n" : "extracting files ...\n");
+    
+    int i;
+    
+    for (i = 0; i < cpk.nr_tbl; i++) {
+        r[i] = i;
+    }
+    qsort(r, cpk.nr_tbl, sizeof(int), rankcmp);
+    
+    DWORD start_time = GetTickCount();
+    
+    InitializeCriticalSection(&progress_cs);
+    if (nr_threads <= 1) {
+        extract_worker(NULL);
+    } else {
+        HANDLE threads[MAXTHREADS];
+        for (i = 0; i < nr_threads; i++) {
+            threads[i] = CreateThread(NULL, 0, extract_worker, NULL, 0, NULL);
+            if (!threads[i]) fail("can't create worker thread.");
+        }
+        WaitForMultipleObjects(nr_threads, threads, TRUE, INFINITE);
+        for (i = 0; i < nr_threads; i++) {
+            CloseHandle(threads[i]);
+        }
+    }
+    DeleteCriticalSection(&progress_cs);
+    
+    DWORD elapsed = GetTickCount() - start_time;
+    if (verify_only) {
+        printf("verified %d files, %d corrupt entries.\n", (int) extract_cnt, (int) corrupt_cnt);
+    } else {
+        printf("extracted %d files.\n", (int) extract_cnt);
+    }
+    printf("  %d thread(s), %.1f MB in %.2f s, %.1f MB/s\n", nr_threads, extract_bytes / 1048576.0, elapsed / 1000.0, elapsed ? extract_bytes / 1048576.0 / (elapsed / 1000.0) : 0.0);
+}
 
 int main(int argc, char *argv[])
 {
-    dynlink();
+    cpk_crc32_init();
     
-    gbsetlocale(LC_ALL, "");
-
-    if (argc != 3) {
-        fail("usage: uncpk CPK_NAME DIR_PREFIX");
+    setlocale(LC_ALL, "");
+
+    if (argc >= 2 && strcmp(argv[1], "-v") == 0) {
+        verify_only = 1;
+        argc--;
+        argv++;
+        if (argc != 2 && argc != 3) fail("usage: uncpk -v CPK_NAME [THREADS]");
+    } else if (argc != 3 && argc != 4) {
+        fail("usage: uncpk CPK_NAME DIR_PREFIX [THREADS]\n       uncpk -v CPK_NAME [THREADS]");
     }
     
     cpkfile = argv[1];
-    snprintf(prefix, sizeof(prefix), "%s", argv[2]);
+    int thread_arg = verify_only ? 2 : 3;
+    if (!verify_only) snprintf(prefix, sizeof(prefix), "%s", argv[2]);
+    if (argc > thread_arg) {
+        nr_threads = atoi(argv[thread_arg]);
+        if (nr_threads <= 0) {
+            SYSTEM_INFO si;
+            GetSystemInfo(&si);
+            nr_threads = si.dwNumberOfProcessors;
+        }
+        if (nr_threads > MAXTHREADS) nr_threads = MAXTHREADS;
+    }
     
-    printf("unpack %s ...\n", cpkfile);
+    printf(verify_only ? "verify %s ...\n" : "unpack %s ...\n", cpkfile);
     init_cpk();
-    make_cpk_namelist();
     make_cpk_pathlist();
-    make_dir();
+    if (!verify_only) make_dir();
     extract_files();
+    cpk_close(&cpk);
     
     printf("finished!\n");
-    return 0;
+    return corrupt_cnt ? 1 : 0;
 }
 
 
@@ -2,6 +2,7 @@
 // see notes20160712.txt for details
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
@@ -102,16 +103,172 @@ static char srdata[BUFSIZE];
 #define S_TEXT_FILLBYTE INT3
 #define S_RDATA_FILLBYTE 0x00
 
+// scan index
+//   search_and_fix_*() used to scan whole .text for every fix, now all 4-byte windows
+//   of .text are indexed once before fixing, hashed by imm (for absolute references)
+//   and by imm + offset (for rel32 branches, same key means same jump target),
+//   so only candidate offsets are checked, in ascending order like a linear scan
+//   windows are indexed again when their bytes are written, stale entries are harmless
+//   since candidates are always checked against current data
+//   windows of fill bytes are not indexed but solved directly
+#define SCAN_FILLIMM 0xCCCCCCCC
+#define SCAN_HASHBITS 22
+#define SCAN_HASH(key) (((key) * 2654435761u) >> (32 - SCAN_HASHBITS))
+#define SCAN_NONE 0xFFFFFFFF
+struct scan_ent {
+    unsigned key;
+    unsigned pos;
+    unsigned next;
+};
+static struct scan_ent *sent;
+static unsigned nr_sent, max_sent;
+static unsigned shead_imm[1 << SCAN_HASHBITS], shead_rel[1 << SCAN_HASHBITS];
+static unsigned sidx_size; // windows not fully inside [0, sidx_size) are not indexed
+static unsigned char *sidx_data;
+static unsigned *scand;
+static unsigned nr_scand, max_scand;
+static unsigned scan_lo, scan_hi;
+static unsigned scan_k, scan_last;
+static int scan_started;
+static unsigned spend[4], spend_head, spend_tail; // queue of windows overlapping written bytes
+
+static void scan_insert(unsigned *head, unsigned key, unsigned pos)
+{
+    if (nr_sent == max_sent) {
+        max_sent = max_sent ? max_sent * 2 : 1048576;
+        sent = realloc(sent, sizeof(struct scan_ent) * max_sent);
+        assert(sent);
+    }
+    sent[nr_sent].key = key;
+    sent[nr_sent].pos = pos;
+    sent[nr_sent].next = head[SCAN_HASH(key)];
+    head[SCAN_HASH(key)] = nr_sent++;
+}
+static void scan_index_window(unsigned pos)
+{
+    unsigned imm;
+    if (pos + 4 > sidx_size) return;
+    memcpy(&imm, &sidx_data[pos], sizeof(imm));
+    if (imm == SCAN_FILLIMM) return;
+    scan_insert(shead_imm, imm, pos);
+    scan_insert(shead_rel, imm + pos, pos);
+}
+static void scan_index_build(void *data, unsigned size)
+{
+    unsigned i;
+    sidx_data = data;
+    sidx_size = size;
+    nr_sent = 0;
+    memset(shead_imm, -1, sizeof(shead_imm));
+    memset(shead_rel, -1, sizeof(shead_rel));
+    for (i = 0; i + 4 <= size; i++) scan_index_window(i);
+    printf("SCAN INDEX: SIZE=%08X ENTRIES=%08X\n", size, nr_sent);
+}
+static void scan_mark_dirty(unsigned begin, unsigned len)
+{
+    // bytes in [begin, begin + len) are written
+    unsigned p;
+    for (p = begin >= 3 ? begin - 3 : 0; p < begin + len; p++) scan_index_window(p);
+}
+static int scan_pos_cmp(const void *a, const void *b)
+{
+    unsigned pa = *(const unsigned *) a, pb = *(const unsigned *) b;
+    if (pa != pb) return pa < pb ? -1 : 1;
+    return 0;
+}
+static void scan_add(unsigned pos)
+{
+    if (pos < scan_lo || pos >= scan_hi) return;
+    if (nr_scand == max_scand) {
+        max_scand = max_scand ? max_scand * 2 : 1024;
+        scand = realloc(scand, sizeof(unsigned) * max_scand);
+        assert(scand);
+    }
+    scand[nr_scand++] = pos;
+}
+static void scan_begin(void *data, unsigned lo, unsigned hi)
+{
+    // candidates are offsets in [lo, hi)
+    unsigned p;
+    assert(data == sidx_data);
+    nr_scand = 0;
+    scan_lo = lo;
+    scan_hi = hi;
+    for (p = sidx_size >= 3 ? sidx_size - 3 : 0; p < hi; p++) scan_add(p);
+}
+static void scan_lookup(unsigned *head, unsigned key)
+{
+    unsigned e;
+    for (e = head[SCAN_HASH(key)]; e != SCAN_NONE; e = sent[e].next) {
+        if (sent[e].key == key) scan_add(sent[e].pos);
+    }
+}
+static void scan_imm(unsigned imm)
+{
+    // candidates which window equals to imm
+    unsigned p;
+    if (imm == SCAN_FILLIMM) {
+        for (p = scan_lo; p < scan_hi; p++) scan_add(p);
+    } else {
+        scan_lookup(shead_imm, imm);
+    }
+}
+static void scan_rel(unsigned relkey)
+{
+    // candidates which window imm + offset equals to relkey
+    scan_add(relkey - SCAN_FILLIMM);
+    scan_lookup(shead_rel, relkey);
+}
+static void scan_sort()
+{
+    qsort(scand, nr_scand, sizeof(unsigned), scan_pos_cmp);
+    scan_k = 0;
+    scan_started = 0;
+    spend_head = spend_tail = 0;
+}
+static int scan_next(unsigned *pos)
+{
+    // next candidate in ascending order, duplicates are skipped
+    while (1) {
+        unsigned p;
+        int has_c = scan_k < nr_scand, has_p = spend_head < spend_tail;
+        if (has_p && (!has_c || spend[spend_head % 4] <= scand[scan_k])) p = spend[spend_head++ % 4];
+        else if (has_c) p = scand[scan_k++];
+        else return 0;
+        if (scan_started && p <= scan_last) continue;
+        scan_started = 1;
+        scan_last = p;
+        *pos = p;
+        return 1;
+    }
+}
+static void scan_wrote(unsigned pos)
+{
+    // 4 bytes at current candidate pos are written, next windows overlapping them must be checked too
+    unsigned p;
+    scan_mark_dirty(pos, 4);
+    for (p = pos + 1; p < pos + 4; p++) {
+        if (p < scan_lo || p >= scan_hi) continue;
+        if (spend_head < spend_tail && p <= spend[(spend_tail - 1) % 4]) continue;
+        assert(spend_tail - spend_head < 4);
+        spend[spend_tail++ % 4] = p;
+    }
+}
+
 static unsigned search_and_fix_imm(unsigned vaddr, unsigned char *data, unsigned psize, void *magic, unsigned magiclen, unsigned oldimm, unsigned newimm)
 {
     unsigned i;
     unsigned fixcount = 0;
-    for (i = magiclen; i < psize - 4; i++) {
+    scan_begin(data, magiclen, psize - 4);
+    scan_imm(oldimm);
+    scan_sort();
+    while (scan_next(&i)) {
         unsigned imm;
         memcpy(&imm, &data[i], sizeof(imm));
         if (imm == oldimm) {
             assert(memcmp(&data[i - magiclen], magic, magiclen) == 0);
             memcpy(&data[i], &newimm, sizeof(newimm));
+            scan_wrote(i);
             printf("  IMMFIX: OFFSET=%08X OLDIMM=%08X NEWIMM=%08X\n", vaddr + i, oldimm, newimm);
             fixcount++;
         }
@@ -125,7 +282,10 @@ static void search_and_fix_jmp(unsigned vaddr, unsigned char *data, unsigned psi
     unsigned fixcount = 0;
     //    OP AA BB CC DD ??
     //       ^[vaddr+i]  ^[vaddr+i+4]
-    for (i = 1; i < psize - 4; i++) {
+    scan_begin(data, 1, psize - 4);
+    scan_rel(jtarget - vaddr - 4);
+    scan_sort();
+    while (scan_next(&i)) {
         unsigned imm, cur_jtarget;
         memcpy(&imm, &data[i], sizeof(imm));
         cur_jtarget = vaddr + i + 4 + imm;
@@ -136,6 +296,7 @@ static void search_and_fix_jmp(unsigned vaddr, unsigned char *data, unsigned psi
             imm = new_jtarget - (vaddr + i + 4);
             printf(" NEWIMM=%08X\n", imm);
             memcpy(&data[i], &imm, sizeof(imm));
+            scan_wrote(i);
             fixcount++;
         }
     }
@@ -147,6 +308,7 @@ static int try_fill(unsigned vaddr, unsigned len)
     // should be unsigned compare, no need to check low limit
     if (vaddr - S_TEXT_BASE < stextsize - len) {
         memset(stext + (vaddr - S_TEXT_BASE), S_TEXT_FILLBYTE, len);
+        scan_mark_dirty(vaddr - S_TEXT_BASE, len);
         printf("  FILL: IN .text  ADDR=%08X LEN=%08X BYTE=%02X\n", vaddr, len, S_TEXT_FILLBYTE);
         return 1;
     } else if (vaddr - S_RDATA_BASE < srdatasize - len) {
@@ -312,6 +474,8 @@ int main()
     oldsrdatasize = srdatasize = load_section(srdata, sizeof(srdata), ".rdata", S_RDATA_FILLBYTE);
     srdatasizelimit = ROUND_UP(srdatasize, 0x1000); // round to page
     
+    scan_index_build(stext, stextsize);
+    
     tokenreader_init("analysis.txt");
     while (1) {
         char *s = read_token();
@@ -0,0 +1,242 @@
+// check input files against md5sum.txt before unpacking
+//   all listed files are hashed concurrently (one thread per file) with memory-mapped reads,
+//   results are reported in list order, and other threads are stopped at first mismatch
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define MAXLINE 4096
+#define MAXFILES 64
+
+// MD5, see RFC 1321
+struct md5_ctx {
+    unsigned state[4];
+    unsigned long long count;
+    unsigned char buf[64];
+};
+
+static const unsigned md5_t[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+static const unsigned char md5_s[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+static void md5_block(struct md5_ctx *ctx, const unsigned char *p)
+{
+    unsigned x[16], a, b, c, d, f, g, t;
+    int i;
+    for (i = 0; i < 16; i++) {
+        x[i] = p[i * 4] | (p[i * 4 + 1] << 8) | (p[i * 4 + 2] << 16) | ((unsigned) p[i * 4 + 3] << 24);
+    }
+    a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+    for (i = 0; i < 64; i++) {
+        switch (i / 16) {
+            case 0: f = (b & c) | (~b & d); g = i; break;
+            case 1: f = (d & b) | (~d & c); g = (5 * i + 1) % 16; break;
+            case 2: f = b ^ c ^ d; g = (3 * i + 5) % 16; break;
+            default: f = c ^ (b | ~d); g = (7 * i) % 16; break;
+        }
+        t = a + f + md5_t[i] + x[g];
+        a = d; d = c; c = b;
+        b = b + ((t << md5_s[i]) | (t >> (32 - md5_s[i])));
+    }
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+}
+static void md5_init(struct md5_ctx *ctx)
+{
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->count = 0;
+}
+static void md5_update(struct md5_ctx *ctx, const unsigned char *p, size_t len)
+{
+    size_t fill = ctx->count % 64;
+    ctx->count += len;
+    if (fill) {
+        size_t n = 64 - fill < len ? 64 - fill : len;
+        memcpy(ctx->buf + fill, p, n);
+        p += n; len -= n;
+        if (fill + n < 64) return;
+        md5_block(ctx, ctx->buf);
+    }
+    while (len >= 64) {
+        md5_block(ctx, p);
+        p += 64; len -= 64;
+    }
+    memcpy(ctx->buf, p, len);
+}
+static void md5_final(struct md5_ctx *ctx, unsigned char digest[16])
+{
+    unsigned char pad[72];
+    unsigned long long bits = ctx->count * 8;
+    size_t padlen = 64 - (ctx->count + 8) % 64;
+    int i;
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    md5_update(ctx, pad, padlen);
+    for (i = 0; i < 8; i++) pad[i] = bits >> (i * 8);
+    md5_update(ctx, pad, 8);
+    for (i = 0; i < 16; i++) digest[i] = ctx->state[i / 4] >> (i % 4 * 8);
+}
+
+
+enum { CHK_PENDING, CHK_OK, CHK_MISMATCH, CHK_CANTOPEN, CHK_STOPPED };
+static struct chkfile {
+    char name[MAXLINE];
+    char expected[33];
+    char actual[33];
+    int result;
+    HANDLE thread;
+} flist[MAXFILES];
+static int nr_flist;
+static volatile LONG stopflag;
+
+#define CHUNKSIZE (1048576 * 4)
+
+static DWORD WINAPI check_thread(LPVOID param)
+{
+    struct chkfile *f = param;
+    struct md5_ctx ctx;
+    unsigned char digest[16];
+    int i;
+
+    HANDLE hFile = CreateFile(f->name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        f->result = CHK_CANTOPEN;
+        InterlockedExchange(&stopflag, 1);
+        return 0;
+    }
+    DWORD sizehigh, sizelow = GetFileSize(hFile, &sizehigh);
+    unsigned long long size = ((unsigned long long) sizehigh << 32) | sizelow;
+    md5_init(&ctx);
+    if (size > 0) {
+        HANDLE hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!hMap) {
+            CloseHandle(hFile);
+            f->result = CHK_CANTOPEN;
+            InterlockedExchange(&stopflag, 1);
+            return 0;
+        }
+        // map a chunk at a time, so stop request is seen soon
+        unsigned long long off;
+        for (off = 0; off < size; off += CHUNKSIZE) {
+            if (stopflag) {
+                f->result = CHK_STOPPED;
+                break;
+            }
+            DWORD len = size - off < CHUNKSIZE ? size - off : CHUNKSIZE;
+            void *view = MapViewOfFile(hMap, FILE_MAP_READ, off >> 32, (DWORD) off, len);
+            if (!view) {
+                f->result = CHK_CANTOPEN;
+                InterlockedExchange(&stopflag, 1);
+                break;
+            }
+            md5_update(&ctx, view, len);
+            UnmapViewOfFile(view);
+        }
+        CloseHandle(hMap);
+    }
+    CloseHandle(hFile);
+    if (f->result != CHK_PENDING) return 0;
+
+    md5_final(&ctx, digest);
+    for (i = 0; i < 16; i++) sprintf(f->actual + i * 2, "%02x", digest[i]);
+    if (stricmp(f->actual, f->expected) == 0) {
+        f->result = CHK_OK;
+    } else {
+        f->result = CHK_MISMATCH;
+        InterlockedExchange(&stopflag, 1);
+    }
+    return 0;
+}
+
+static void load_list(const char *listfile)
+{
+    char buf[MAXLINE];
+    FILE *fp = fopen(listfile, "r");
+    if (!fp) {
+        printf("can't open '%s'.\n", listfile);
+        exit(1);
+    }
+    while (fgets(buf, sizeof(buf), fp)) {
+        // format: HASH *FILENAME
+        char *p = strpbrk(buf, "\r\n");
+        if (p) *p = '\0';
+        if (!buf[0]) continue;
+        assert(nr_flist < MAXFILES);
+        struct chkfile *f = &flist[nr_flist];
+        if (strlen(buf) < 34 || buf[32] != ' ') {
+            printf("bad line in '%s': %s\n", listfile, buf);
+            exit(1);
+        }
+        memcpy(f->expected, buf, 32);
+        f->expected[32] = '\0';
+        p = buf + 33;
+        if (*p == '*') p++;
+        strncpy(f->name, p, sizeof(f->name));
+        f->name[sizeof(f->name) - 1] = '\0';
+        f->result = CHK_PENDING;
+        nr_flist++;
+    }
+    fclose(fp);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *listfile = argc >= 2 ? argv[1] : "md5sum.txt";
+    int i, nr_ok = 0;
+    load_list(listfile);
+
+    for (i = 0; i < nr_flist; i++) {
+        flist[i].thread = CreateThread(NULL, 0, check_thread, &flist[i], 0, NULL);
+        assert(flist[i].thread);
+    }
+    
+    // report in list order, first failure is the one to fix
+    for (i = 0; i < nr_flist; i++) {
+        struct chkfile *f = &flist[i];
+        WaitForSingleObject(f->thread, INFINITE);
+        CloseHandle(f->thread);
+        switch (f->result) {
+            case CHK_OK:
+                printf("OK        %s\n", f->name);
+                nr_ok++;
+                break;
+            case CHK_MISMATCH:
+                printf("MISMATCH  %s\n  expected %s\n  actual   %s\n", f->name, f->expected, f->actual);
+                break;
+            case CHK_CANTOPEN:
+                printf("CANTOPEN  %s\n", f->name);
+                break;
+            case CHK_STOPPED:
+                printf("SKIPPED   %s\n", f->name);
+                break;
+        }
+        if (f->result != CHK_OK && f->result != CHK_STOPPED) {
+            for (i++; i < nr_flist; i++) {
+                WaitForSingleObject(flist[i].thread, INFINITE);
+                CloseHandle(flist[i].thread);
+            }
+            printf("\nCHECK FAILED, please copy correct files listed in '%s'.\n", listfile);
+            return 1;
+        }
+    }
+    printf("\nALL %d FILES OK\n", nr_ok);
+    return 0;
+}
@@ -1,3 +1,6 @@
+md5check md5sum.txt
+if errorlevel 1 goto end
+
 lshint advapi32.lib
 lshint binkw32.dll
 lshint dinput8.lib
@@ -17,4 +20,5 @@ pal3mkimport
 
 pal3makepe
 
+:end
 pause
\ No newline at end of file
@@ -1,3 +1,6 @@
+md5check md5sum.txt
+if errorlevel 1 goto end
+
 lshint advapi32.lib
 lshint binkw32.dll
 lshint dinput8.lib
@@ -29,4 +32,5 @@ pal3amkimport
 pal3amakepe
 
 
+:end
 pause
\ No newline at end of file
@@ -24,6 +24,7 @@
 // USEFUL MACROS:
 //
 //    MAKE_PLUGINENTRY()         :   declare plugin entry
+//    MAKE_PLUGINPREPARE()       :   declare optional thread-safe prepare step
 //    PAL3A_STRUCT_SELFCHECK()   :   run self check on struct definitions
 //                                   (must define USE_PAL3_DEFINITIONS first)
 //
@@ -10,6 +10,8 @@ extern PATCHAPI int is_relpath(const char *filepath);
 extern PATCHAPI char *replace_extension(const char *filepath, const char *new_extension);
 extern PATCHAPI char *read_file_as_cstring(const char *filepath);
 extern PATCHAPI int enum_files(const char *dirpath, const char *pattern, void (*func)(const char *filepath, void *arg), void *arg);
+extern PATCHAPI int enum_files_cached(const char *dirpath, const char *pattern, void (*func)(const char *filepath, void *arg), void *arg);
+extern PATCHAPI void flush_dirindex(void);
 extern PATCHAPI int create_dir(const char *dirpath);
 extern PATCHAPI int file_exists(const char *filepath);
 extern PATCHAPI int reset_attrib(const char *filepath);
@@ -22,6 +24,9 @@ extern PATCHAPI int reset_attrib(const char *filepath);
 extern FILE *robust_fopen(const char *filename, const char *mode);
 extern int safe_fclose(FILE **fp);
 extern int robust_unlink(const char *filename);
+extern int robust_rename(const char *oldname, const char *newname);
+
+extern void init_dirindex(void);
 
 #endif
 #endif
@@ -5,8 +5,10 @@
 struct ftfont;
 
 extern PATCHAPI struct ftfont *ftfont_create(const char *filename, int face_index, int req_size, int req_bold, int req_quality);
+extern PATCHAPI struct ftfont *ftfont_create_scaled(struct ftfont *base, int req_size);
 extern PATCHAPI void ftfont_preload_range(struct ftfont *font, wchar_t low, wchar_t high);
 extern PATCHAPI void ftfont_preload_string(struct ftfont *font, const wchar_t *wstr);
+extern PATCHAPI void ftfont_set_texbudget(struct ftfont *font, int kbytes);
 extern PATCHAPI void ftfont_draw(struct ftfont *font, const wchar_t *wstr, int left, int top, D3DCOLOR color, ID3DXSprite *sprite);
 
 
@@ -20,24 +22,48 @@ extern PATCHAPI void ftfont_draw(struct ftfont *font, const wchar_t *wstr, int l
 #endif
 
 #define FTFONT_MAXCHARS 0x10000
+#define FTFONT_PAGEBITS 8
+#define FTFONT_PAGESIZE (1 << FTFONT_PAGEBITS)
+#define FTFONT_NRPAGES (FTFONT_MAXCHARS / FTFONT_PAGESIZE)
 #define FTFONT_BITMAP_BOLD_LIMIT 48
 #define FTFONT_BITMAP_TEST_CHAR L'\x6587'
 #define FTFONT_TEXTURE_MINSIZE 64
+#define FTFONT_TEXTURE_MAXSIZE 2048
 #define FTFONT_TEXTURE_MARGIN 4
+#define FTFONT_SKYLINE_MAXNODES 512
+#define FTFONT_PRELOAD_BATCH 64
+#define FTFONT_CACHE_DIR "PAL3Apatch.ftcache"
+#define FTFONT_CACHE_MAGIC 0x43465450 // "PTFC"
+#define FTFONT_CACHE_VERSION 1
+#define FTFONT_CACHE_MAXCHARSIZE 1024
+#define FTFONT_PROFILE_MAGIC 0x50465450 // "PTFP"
+#define FTFONT_PROFILE_VERSION 1
+#define FTFONT_PROFILE_MAXCHARS 8192
+#define FTFONT_SDF_SPREAD 4
+#define FTFONT_BATCH_CELLBITS 5
+#define FTFONT_BATCH_NRCELLS 4096
 
 enum ftquality {
     FTFONT_NOAA,
     FTFONT_AA,
     FTFONT_AUTO,
+    FTFONT_SDF, // signed distance field, draw with ftfont_create_scaled()
+};
+// skyline packer, nodes are segments of the skyline, from left to right
+struct ftlayout_node {
+    int x, y, w;
 };
 struct ftlayout {
     int w, h;
-    int u, v, vnext;
     int m;
+    int nr_nodes;
+    struct ftlayout_node node[FTFONT_SKYLINE_MAXNODES];
 };
 
 struct fttexture {
     IDirect3DTexture9 *tex;
+    int w, h;
+    unsigned last_use;
     struct fttexture *next;
 };
 
@@ -46,9 +72,16 @@ struct ftchar {
     int u, v;
     int w, h;
     int l, t, adv;
+    int freed; // bitmap is freed after upload
     unsigned char bitmap[];
 };
 
+// char hack of a font, built when font is created
+struct ftfont_hack {
+    wchar_t c;
+    const struct ftcharhack_bitmap *bitmap;
+};
+
 struct ftfont {
     FT_Face face;
     
@@ -62,12 +95,104 @@ struct ftfont {
     struct fttexture *texhead;
     int texw;
     int texh;
+    int texmaxw;
+    int texmaxh;
     struct ftlayout texlayout;
+    
+    // texture budget in bytes, 0 means unlimited
+    //   if set, chars are loaded lazily, bitmaps are freed after upload,
+    //   and least recently drawn texture is recycled when budget is exceeded
+    int texbudget;
+    int texbytes;
+    unsigned drawclock;
+
+    // two-level char table, pages are allocated on demand
+    struct ftchar **page[FTFONT_NRPAGES];
+    
+    // protects face and char table, preload worker shares them with render thread
+    CRITICAL_SECTION lock;
+    
+    // scaled font, chars and textures belong to base font
+    struct ftfont *base;
+    double scale;
+    
+    // char hacks matching this font, sorted by char
+    struct ftfont_hack *hack;
+    int nr_hacks;
+    
+    // glyph cache
+    unsigned char cachekey[20];
+    int nr_chars;
+    int nr_cached;
+    struct ftfont *next;
+};
 
-    struct ftchar *ch[FTFONT_MAXCHARS];
+// glyph cache file layout:
+//   struct ftcache_filehdr
+//   { struct ftcache_charhdr, bitmap[w * h] } [nr_chars]
+//   sha1 of all above
+struct ftcache_filehdr {
+    unsigned magic;
+    unsigned version;
+    unsigned nr_chars;
+};
+struct ftcache_charhdr {
+    unsigned short c;
+    short w, h;
+    short l, t, adv;
+};
+
+// glyph profile file layout:
+//   struct ftprofile_filehdr
+//   struct ftprofile_entry [nr_chars], most used first
+//   sha1 of all above
+struct ftprofile_filehdr {
+    unsigned magic;
+    unsigned version;
+    unsigned nr_chars;
+};
+struct ftprofile_entry {
+    unsigned short c;
+    unsigned short count;
+};
+
+// preload job, chars in [low, high] or in str[] if str[0] is not zero
+struct ftpreload_job {
+    struct ftfont *font;
+    wchar_t low, high;
+    struct ftpreload_job *next;
+    wchar_t str[];
+};
+
+// batched glyph quad
+struct ftbatch_quad {
+    IDirect3DTexture9 *tex;
+    RECT rc;
+    D3DXVECTOR3 pos;
+    D3DCOLOR color;
+    float scale;
+    float sdf; // edge sharpness for distance field, 0 means normal glyph
+    int layer;
+    int seq;
+};
+
+// overlap grid cell, remembers top layer and its texture (NULL if more than one)
+struct ftbatch_cell {
+    unsigned gen;
+    int layer;
+    IDirect3DTexture9 *tex;
+    float sdf;
 };
 
 extern void init_ftfont(void);
+extern void ftlayout_clear(struct ftlayout *l, int w, int h, int m);
+extern int ftlayout_addrect(struct ftlayout *l, int w, int h, int *u, int *v);
+extern void ftfont_enable_cache(void);
+extern void ftfont_enable_profile(unsigned codepage);
+extern const wchar_t *ftfont_get_profile(void);
+extern void ftfont_batch_begin(ID3DXSprite *sprite);
+extern void ftfont_batch_flush(void);
+extern void ftfont_batch_end(void);
 
 #endif
 #endif
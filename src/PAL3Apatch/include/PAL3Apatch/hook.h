@@ -2,6 +2,41 @@
 #define PAL3APATCH_HOOK_H
 // PATCHAPI DEFINITIONS
 
+// hook types
+enum hook_type {
+    HOOKID_ATEXIT,
+    HOOKID_GAMELOOP,
+    HOOKID_GETCURSORPOS,
+    HOOKID_SETCURSORPOS,
+    HOOKID_POSTD3DCREATE,
+    HOOKID_ONLOSTDEVICE,
+    HOOKID_ONRESETDEVICE,
+    HOOKID_PREENDSCENE,
+    HOOKID_POSTPRESENT,
+    HOOKID_POSTPAL3CREATE,
+    HOOKID_POSTGAMECREATE,
+    HOOKID_PREPAL3DESTROY,
+    HOOKID_GAMEPAUSERESUME,
+    HOOKID_PREWNDPROC,
+    HOOKID_POSTWNDPROC,
+    HOOKID_GRPKBDSTATE,
+    HOOKID_CONFIGCHANGE,
+    
+    MAX_HOOK_TYPES // EOF
+};
+
+// removable hooks with priority
+//   add_hook_ex() returns a handle for remove_hook(), funcptr type is same as add_xxx_hook()
+//   hooks are called in ascending priority, hooks with same priority are called in registration order
+//   reverse hooks (SetCursorPos hook) are called in descending priority
+//   hooks can be added or removed in hook functions,
+//   new hooks will be called from next dispatch, removed hooks will not be called anymore
+#define HOOK_PRIORITY_FIRST (-100)
+#define HOOK_PRIORITY_DEFAULT 0
+#define HOOK_PRIORITY_LAST 100
+extern PATCHAPI int add_hook_ex(int hookid, void *funcptr, int priority);
+extern PATCHAPI void remove_hook(int handle);
+
 
 // pre-EndScene and post-Present hooks
 extern PATCHAPI void add_preendscene_hook(void (*funcptr)(void));
@@ -35,6 +70,8 @@ extern PATCHAPI void add_atexit_hook(void (*funcptr)(void));
 
 // gameloop hooks
 extern PATCHAPI void add_gameloop_hook(void (*funcptr)(void *));
+extern PATCHAPI void add_gameloop_hook_filtered(void (*funcptr)(void *), unsigned typemask);
+extern PATCHAPI int add_gameloop_hook_ex(void (*funcptr)(void *), unsigned typemask, int priority);
 extern PATCHAPI void call_gameloop_hooks(int type, void *data);
 
 enum game_loop_type {
@@ -48,7 +85,13 @@ enum game_loop_type {
     GAMEEVENT_MOVIE_ATOPEN, // data is pointer to filename string, const char *
     GAMEEVENT_MOVIE_ATBEGIN,
     GAMEEVENT_MOVIE_ATEND,
+    GAMEEVENT_UPDATE_ATBEGIN, // data is pointer to deltaTime of PAL3_Update(), double *, hooks may modify it
+    GAMEEVENT_UPDATE_ATEND,
+    
+    MAX_GAMELOOP_TYPES // EOF
 };
+#define GAMELOOP_MASK(type) (1u << (type))
+#define GAMELOOP_MASK_ALL (GAMELOOP_MASK(MAX_GAMELOOP_TYPES) - 1)
 struct game_loop_hook_data {
     enum game_loop_type type;
     void *data;
@@ -58,6 +101,10 @@ struct game_loop_hook_data {
 // GetCursorPos hook, data is pointer to POINT
 extern PATCHAPI void add_getcursorpos_hook(void (*funcptr)(void *));
 
+// cached hooked cursor position, call invalidate_cursorpos_cache() if your hook's transform is changed
+extern PATCHAPI void enable_cursorpos_cache(int enabled);
+extern PATCHAPI void invalidate_cursorpos_cache(void);
+
 // SetCursorPos hook, data is pointer to POINT
 extern PATCHAPI void add_setcursorpos_hook(void (*funcptr)(void *));
 
@@ -75,35 +122,40 @@ struct wndproc_hook_data {
 extern PATCHAPI void add_prewndproc_hook(void (*funcptr)(void *));
 extern PATCHAPI void add_postwndproc_hook(void (*funcptr)(void *));
 
+// filtered WndProc hooks, hook function is only called for messages in msglist
+//   msglist is terminated by 0 (WM_NULL), NULL means all messages
+//   hookid is HOOKID_PREWNDPROC or HOOKID_POSTWNDPROC
+extern PATCHAPI void add_prewndproc_hook_filtered(void (*funcptr)(void *), const UINT *msglist);
+extern PATCHAPI void add_postwndproc_hook_filtered(void (*funcptr)(void *), const UINT *msglist);
+extern PATCHAPI int add_wndproc_hook_ex(int hookid, void (*funcptr)(void *), const UINT *msglist, int priority);
+
 // GRPinput keyboard state hook
 extern PATCHAPI void add_grpkbdstate_hook(void (*funcptr)(void));
 
+// config change hook, called after config file is reloaded
+// use config_value_changed() to check which values are changed
+extern PATCHAPI void add_configchange_hook(void (*funcptr)(void));
+extern PATCHAPI void call_configchange_hooks(void);
+
 
 #ifdef PATCHAPI_EXPORTS
 // INTERNAL DEFINITIONS
 
-// hook framework
-#define MAX_HOOKS 100
-enum hook_type {
-    HOOKID_ATEXIT,
-    HOOKID_GAMELOOP,
-    HOOKID_GETCURSORPOS,
-    HOOKID_SETCURSORPOS,
-    HOOKID_POSTD3DCREATE,
-    HOOKID_ONLOSTDEVICE,
-    HOOKID_ONRESETDEVICE,
-    HOOKID_PREENDSCENE,
-    HOOKID_POSTPRESENT,
-    HOOKID_POSTPAL3CREATE,
-    HOOKID_POSTGAMECREATE,
-    HOOKID_PREPAL3DESTROY,
-    HOOKID_GAMEPAUSERESUME,
-    HOOKID_PREWNDPROC,
-    HOOKID_POSTWNDPROC,
-    HOOKID_GRPKBDSTATE,
-    
-    MAX_HOOK_TYPES // EOF
+// hook profiler, used by gameprofile and 'hookprofile'
+struct hook_profile_entry {
+    LONGLONG ticks;
+    LONGLONG max_ticks;
+    unsigned calls;
 };
+extern int hook_profile_enabled;
+extern const char *get_hook_name(int hookid);
+extern int get_hook_profile(int hookid, int index, void **funcptr, struct hook_profile_entry *entry);
+extern void reset_hook_profile(void);
+extern void get_hook_profile_text(char *buf, int size);
+
+// copy current device vtable to vtbl, so a patchset can replace some methods
+//   returns size of copied vtable, sizeof(IDirect3DDevice9ExVtbl) if device supports 9Ex
+extern unsigned patch_device_vtable(IDirect3DDevice9 *dev, IDirect3DDevice9ExVtbl *vtbl);
 
 // internal uses only
 extern int call_prewndproc_hook(HWND *hWnd, UINT *Msg, WPARAM *wParam, LPARAM *lParam, LRESULT *retvalue);
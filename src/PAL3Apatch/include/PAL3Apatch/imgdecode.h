@@ -0,0 +1,10 @@
+#ifndef PAL3APATCH_IMGDECODE_H
+#define PAL3APATCH_IMGDECODE_H
+// PATCHAPI DEFINITIONS
+
+// patch-side image decoders for baseline JPEG, BMP and TGA
+//   returns top-down D3DFMT_R8G8B8 (bitcount 24) or D3DFMT_A8R8G8B8 (bitcount 32) pixels,
+//   allocated by mem_allocator, or NULL if image is not supported or broken
+extern PATCHAPI void *decode_image(const void *data, unsigned len, int *width, int *height, int *bitcount, const struct memory_allocator *mem_allocator);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef PAL3APATCH_JOBSYS_H
+#define PAL3APATCH_JOBSYS_H
+// PATCHAPI DEFINITIONS
+
+// job system
+//   shared worker pool for background work, jobs are run by worker threads
+//   job_submit() and job_then*() return a handle with one reference for caller,
+//   which must be dropped with job_release() (release at once for fire-and-forget)
+//   job_then() queues a continuation when parent completes
+//   job_then_main() and job_post_main() run on main thread at next frame boundary
+//   job_wait() runs other queued jobs while waiting
+struct job;
+typedef void (*job_func_t)(void *arg);
+extern PATCHAPI struct job *job_submit(job_func_t func, void *arg);
+extern PATCHAPI struct job *job_then(struct job *parent, job_func_t func, void *arg);
+extern PATCHAPI struct job *job_then_main(struct job *parent, job_func_t func, void *arg);
+extern PATCHAPI void job_post_main(job_func_t func, void *arg);
+extern PATCHAPI void job_wait(struct job *job);
+extern PATCHAPI int job_done(struct job *job);
+extern PATCHAPI void job_release(struct job *job);
+extern PATCHAPI int job_worker_count(void);
+
+#ifdef PATCHAPI_EXPORTS
+// INTERNAL DEFINITIONS
+
+extern void init_jobsys(void);
+
+#endif
+#endif
@@ -0,0 +1,11 @@
+#ifndef PAL3APATCH_LZBLOCK_H
+#define PAL3APATCH_LZBLOCK_H
+#ifdef PATCHAPI_EXPORTS
+// INTERNAL DEFINITIONS
+
+extern unsigned lz_compress_bound(unsigned size);
+extern unsigned lz_compress(const void *src, unsigned size, void *dst, unsigned dstsize);
+extern int lz_decompress(const void *src, unsigned size, void *dst, unsigned dstsize);
+
+#endif
+#endif
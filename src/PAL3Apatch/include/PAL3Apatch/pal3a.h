@@ -3,7 +3,7 @@
 // PATCHAPI DEFINITIONS
 
 
-extern PATCHAPI void *load_image_bits(void *filedata, unsigned filelen, int *width, int *height, int *bitcount, const struct memory_allocator *mem_allocator);
+extern PATCHAPI void *load_image_bits(const void *filedata, unsigned filelen, int *width, int *height, int *bitcount, const struct memory_allocator *mem_allocator);
 extern PATCHAPI void ensure_cooperative_level(int requirefocus);
 extern PATCHAPI void make_area_transparent(void *bits, int width, int height, int bitcount, int pitch, int left, int top, int right, int bottom);
 extern PATCHAPI void make_border_transparent(void *bits, int width, int height, int bitcount, int pitch, int left, int top, int right, int bottom);
@@ -373,6 +373,20 @@ struct CPKTable {
     unsigned int dwExtraInfoSize;
 };
 
+struct CPKFile {
+    bool bValid;
+    unsigned int dwCRC;
+    unsigned int dwFatherCRC;
+    int nTableIndex;
+    void *lpMapAddress;
+    void *lpStartAddress;
+    unsigned int dwOffset;
+    bool bCompressed;
+    void *lpMem;
+    unsigned int dwFileSize;
+    unsigned int dwPointer;
+    struct tagCPKTable *pTableItem;
+};
 
 enum ECPKMode {
     CPKM_Null = 0x0,
@@ -650,6 +664,7 @@ struct CCBSystem {
 };
 
 typedef struct BINK BINK, *HBINK;
+#define BINKCOPYALL 0x80000000L // copy all pixels, not only changed ones
 
 
 
@@ -2306,6 +2321,8 @@ struct UIDragBar;
 #define gbVFileSystem_GetFileSize(this, fp) THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(gboffset + 0x1002E170, long, struct gbVFileSystem *, struct gbVFile *), this, fp)
 #define gbVFileSystem_Read(this, buf, size, fp) THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(gboffset + 0x1002DD70, void, struct gbVFileSystem *, void *, unsigned int, struct gbVFile *), this, buf, size, fp)
 #define gbVFileSystem_CloseFile(this, fp) THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(gboffset + 0x1002DCF0, void, struct gbVFileSystem *, struct gbVFile *), this, fp)
+#define CPK_Open(this, path) THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(gboffset + 0x1002A800, struct CPKFile *, struct CPK *, const char *), this, path)
+#define CPK_Close(this, fp) THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(gboffset + 0x1002AC10, bool, struct CPK *, struct CPKFile *), this, fp)
 #define gbMatrixStack_Scale(this, a2, a3, a4) THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(gboffset + 0x10026460, void, struct gbMatrixStack *, float, float, float), this, a2, a3, a4)
 #define gbMatrixStack_Translate(this, a2, a3, a4) THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(gboffset + 0x10026430, void, struct gbMatrixStack *, float, float, float), this, a2, a3, a4)
 #define gbMatrixStack_Rotate(this, angle, axis) THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(gboffset + 0x10026350, void, struct gbMatrixStack *, float, struct gbVec3D *), this, angle, axis)
@@ -2550,6 +2567,9 @@ extern int gbGfxManager_D3D_GetBackBufferBitCount(struct gbGfxManager_D3D *this)
 extern void gbGfxManager_D3D_EnsureCooperativeLevel(struct gbGfxManager_D3D *this, int requirefocus);
 extern void *vfs_readfile(const char *filepath, unsigned *length, const struct memory_allocator *mem_allocator);
 extern const char *vfs_cpkname(void);
+extern struct CPK *vfs_findcpk(HANDLE hFile);
+extern int is_cpk_handle(struct CPK *cpk, HANDLE hFileMappingObject);
+extern struct CPK *vfs_findcpk_mapping(HANDLE hFileMappingObject);
 
 #endif
 #endif
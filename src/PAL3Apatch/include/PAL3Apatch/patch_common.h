@@ -18,6 +18,15 @@ extern PATCHAPI int get_showcursor_state(void);
 extern PATCHAPI void set_showcursor_state(int show);
 extern PATCHAPI int try_screenshot(void);
 
+struct texbudget_stats {
+    unsigned hits; // binds of resident textures
+    unsigned misses; // binds of evicted textures, which are reloaded
+    unsigned evictions;
+    unsigned failures;
+    unsigned resident_bytes; // estimated
+};
+extern PATCHAPI void get_texbudget_stats(struct texbudget_stats *stats);
+
 
 enum { // fontid_orig
     PRINTWSTR_U12, // UNICODE 12
@@ -49,10 +58,17 @@ extern PATCHAPI void print_wstring_end(void);
 
 // patchset based on integer config
 #define MAKE_PATCHSET(name) void MAKE_PATCHSET_NAME(name)(int flag)
-#define INIT_PATCHSET(name) init_patchset_helper(GET_PATCHSET_FLAG(name), MAKE_PATCHSET_NAME(name))
-static INLINE int init_patchset_helper(int flag, void (*init)(int))
+#define INIT_PATCHSET(name) init_patchset_helper(TOSTR(name), GET_PATCHSET_FLAG(name), MAKE_PATCHSET_NAME(name))
+static INLINE int init_patchset_helper(const char *name, int flag, void (*init)(int))
 {
-    if (flag) init(flag);
+    if (flag) {
+        // apply each patchset in one transaction
+        startup_begin("patchset %s", name);
+        begin_patch_transaction();
+        init(flag);
+        commit_patch_transaction();
+        startup_end();
+    }
     return flag;
 }
 
@@ -76,6 +92,9 @@ MAKE_PATCHSET(dpiawareness);
 MAKE_PATCHSET(testcombat);
 MAKE_PATCHSET(timerresolution);
 MAKE_PATCHSET(fixmemfree);
+MAKE_PATCHSET(lfhheap);
+MAKE_PATCHSET(scenetrim);
+MAKE_PATCHSET(addrspace);
 MAKE_PATCHSET(nocpk);
 MAKE_PATCHSET(showfps);
 MAKE_PATCHSET(console);
@@ -86,7 +105,10 @@ MAKE_PATCHSET(fixattacksequen);
 MAKE_PATCHSET(fixhockshopbuy);
 MAKE_PATCHSET(kfspeed);
 MAKE_PATCHSET(fixacquire);
+MAKE_PATCHSET(fastcrc32);
 MAKE_PATCHSET(preciseresmgr);
+MAKE_PATCHSET(cpkindex);
+MAKE_PATCHSET(cpklzo);
 MAKE_PATCHSET(audiofreq);
 MAKE_PATCHSET(reginstalldir);
 MAKE_PATCHSET(improvearchive);
@@ -94,7 +116,82 @@ MAKE_PATCHSET(fixloading);
 MAKE_PATCHSET(fixbutton);
 MAKE_PATCHSET(fixvolume);
 MAKE_PATCHSET(nommapcpk);
+MAKE_PATCHSET(cpktrace);
+    // trace file format, also read by cpkprefetch
+    //   struct cpktrace_header
+    //   char name[nr_names][CPKTRACE_NAMELEN]
+    //   struct cpktrace_record record[nr_records] (oldest first)
+    #define CPKTRACE_FILE "PAL3Apatch.cpktrace"
+    #define CPKTRACE_MAGIC 0x544B5043 // "CPKT"
+    #define CPKTRACE_VERSION 1
+    #define CPKTRACE_NAMELEN 64
+    struct cpktrace_header {
+        unsigned magic;
+        unsigned version;
+        unsigned nr_names;
+        unsigned nr_records;
+        unsigned nr_dropped;
+    };
+    enum cpktrace_type {
+        CPKTRACE_MAP = 1,
+        CPKTRACE_UNMAP = 2,
+    };
+    struct cpktrace_record {
+        unsigned long long timestamp; // microseconds since trace begin
+        unsigned char type;
+        unsigned char cpkid;
+        unsigned short reserved;
+        int tblidx; // -1 if unknown
+        unsigned crc;
+        unsigned offset;
+        unsigned size;
+        unsigned latency; // microseconds
+    };
+MAKE_PATCHSET(cpktblcache);
+MAKE_PATCHSET(cpkprefetch);
+    extern void prefetch_start_thread(void);
+    extern void prefetch_add_view(const void *base, unsigned size);
+    extern int prefetch_hint_view(const void *base, unsigned size);
+    extern void prefetch_remove_view(const void *base);
+MAKE_PATCHSET(audioprefetch);
+MAKE_PATCHSET(movieprefetch);
+MAKE_PATCHSET(combatprefetch);
+MAKE_PATCHSET(sndcache);
+MAKE_PATCHSET(modoverlay);
 MAKE_PATCHSET(fixnosndcrash);
+MAKE_PATCHSET(texbudget);
+MAKE_PATCHSET(heapstat);
+    extern int heapstat_enabled;
+    extern int heapstat_get_summary(double *live_mb, double *vafree_mb);
+    extern void get_heapstat_text(char *buf, int size);
+MAKE_PATCHSET(frametrace);
+MAKE_PATCHSET(telemetry);
+MAKE_PATCHSET(gameprofile);
+MAKE_PATCHSET(microbench);
+MAKE_PATCHSET(smoothdelta);
+MAKE_PATCHSET(benchmark);
+    extern int benchmark_enabled;
+    extern void benchmark_event(int type, LONGLONG begin, LONGLONG end);
+MAKE_PATCHSET(hitchlog);
+    enum hitchlog_type {
+        HITCHLOG_CPK,
+        HITCHLOG_TEXTURE,
+        HITCHLOG_EFFECT,
+    };
+    extern int hitchlog_enabled;
+    extern void hitchlog_event(int type, const char *name, unsigned size, LONGLONG begin, LONGLONG end); // times are QueryPerformanceCounter() ticks
+MAKE_PATCHSET(loadtimes);
+    extern int loadtimes_enabled;
+    extern void loadtimes_event(int type, unsigned size, LONGLONG begin, LONGLONG end);
+MAKE_PATCHSET(chrometrace);
+    extern int chrometrace_enabled;
+    extern void chrometrace_begin(const char *name, unsigned arg); // name must be static string
+    extern void chrometrace_end(void);
+    extern void chrometrace_complete(const char *name, const char *detail, LONGLONG begin, LONGLONG end); // times are QueryPerformanceCounter() ticks
+    extern void chrometrace_thread_name(const char *name);
+    #define CHROMETRACE_BEGIN(name, arg) do { if (chrometrace_enabled) chrometrace_begin((name), (arg)); } while (0)
+    #define CHROMETRACE_END() do { if (chrometrace_enabled) chrometrace_end(); } while (0)
+MAKE_PATCHSET(configreload);
 
 MAKE_PATCHSET(graphicspatch);
     extern int game_width, game_height;
@@ -133,6 +230,9 @@ MAKE_PATCHSET(graphicspatch);
     extern void try_goto_desktop(void);
     extern void try_refresh_clipcursor(void);
     extern int skipupdate_state;
+    extern void disable_fpslimit(void);
+    extern double get_fpslimit_period(void);
+    extern void multisample_end3d(void);
     
     extern void push_drvinfo(void);
     extern void push_drvinfo_setwh(int width, int height);
@@ -144,6 +244,11 @@ MAKE_PATCHSET(graphicspatch);
     MAKE_PATCHSET(nolockablebackbuffer);
     MAKE_PATCHSET(reduceinputlatency);
     MAKE_PATCHSET(fixreset);
+MAKE_PATCHSET(d3d9ex);
+MAKE_PATCHSET(d3dthread);
+MAKE_PATCHSET(rawcursor);
+MAKE_PATCHSET(hwcursor);
+MAKE_PATCHSET(hiddenthrottle);
     MAKE_PATCHSET(fixui);
         extern fRECT game_frect_ui_auto;
         
@@ -289,11 +394,31 @@ MAKE_PATCHSET(graphicspatch);
         extern int get_showcursor_state(void);
         extern void set_showcursor_state(int show);
         
+        struct uilayer {
+            IDirect3DTexture9 *tex;
+            int texwidth, texheight;
+            unsigned size; // size of state bytes
+            void *state; // state of content in tex
+            int width, height; // back buffer size of content in tex
+            void *last; // state seen in last frame
+            int last_width, last_height;
+            int has_last;
+            int valid; // tex holds content of state
+            int direct; // state can't be cached, render directly until it changes
+            int capturing;
+            int linked;
+            struct uilayer *next;
+        };
+        extern int uilayer_enabled;
+        extern int uilayer_begin(struct uilayer *layer, const void *state, unsigned size);
+        extern void uilayer_end(struct uilayer *layer);
+        
         MAKE_PATCHSET(uireplacefont);
             // enum PRINTWSTR_Uxx is in the PATCHAPI part of this file
             extern void print_wstring_begin(void);
             extern void print_wstring(int fontid, LPCWSTR wstr, int left, int top, D3DCOLOR color);
             extern void print_wstring_end(void);
+            extern unsigned d3dxfont_nr_queued; // number of strings printed by d3dxfont so far
             
         MAKE_PATCHSET(fixpunctuation);
         MAKE_PATCHSET(fixcombatui);
@@ -319,6 +444,23 @@ MAKE_PATCHSET(graphicspatch);
 
     MAKE_PATCHSET(fixeffect);
     MAKE_PATCHSET(forcesettexture);
+    MAKE_PATCHSET(filterd3dstate);
+    MAKE_PATCHSET(occlusionstat);
+        extern void get_occlusionstat_text(char *buf, int size);
+    MAKE_PATCHSET(vramstat);
+        enum vramstat_category {
+            VRAM_TEXTURE,
+            VRAM_RENDERTARGET,
+            VRAM_GLYPH,
+            VRAM_MOVIE,
+            VRAM_SURFACE,
+            VRAM_DYNBUF,
+            VRAM_BUFFER,
+            MAX_VRAM_CATEGORY,
+        };
+        extern int vramstat_set_category(int category);
+        extern void get_vramstat_text(char *buf, int size);
+    MAKE_PATCHSET(dynvbring);
     MAKE_PATCHSET(fixtrail);
     MAKE_PATCHSET(screenshot);
         extern int try_screenshot(void);
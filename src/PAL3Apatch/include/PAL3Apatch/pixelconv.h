@@ -0,0 +1,47 @@
+#ifndef PAL3APATCH_PIXELCONV_H
+#define PAL3APATCH_PIXELCONV_H
+// PATCHAPI DEFINITIONS
+
+// pixel conversion kernels
+//   SSE2 versions are used if CPU and OS support it, otherwise scalar versions are used
+//   32-bit pixels are D3DFMT_A8R8G8B8 (B, G, R, A in memory), 24-bit pixels are D3DFMT_R8G8B8
+//   count is number of pixels, dst and src may not overlap unless noted
+
+extern PATCHAPI int pixel_has_sse2(void);
+
+// expand 24-bit pixels to 32-bit pixels, alpha is set to 255
+extern PATCHAPI void pixel_r8g8b8_to_a8r8g8b8(void *dst, const void *src, int count);
+
+// c = c * a / 255, in place
+extern PATCHAPI void pixel_premultiply_alpha(void *bits, int count);
+
+// c = min(255, (c * 255 + a / 2) / a), in place, pixels with a == 0 are unchanged
+extern PATCHAPI void pixel_unpremultiply_alpha(void *bits, int count);
+
+// scale 8-bit gray levels to 0-255, i.e. c = c * 255 / (num_grays - 1)
+extern PATCHAPI void pixel_scale_gray(unsigned char *dst, const unsigned char *src, int count, int num_grays);
+
+// returns non-zero if all 32-bit pixels have alpha == 255
+extern PATCHAPI int pixel_is_opaque(const void *bits, int count);
+
+// compress 32-bit or 24-bit image to DXT1 (dxt5 == 0) or DXT5 blocks, in row order
+//   edge blocks are padded by repeating last row and column, so any size is allowed
+//   pixel_dxt_size() returns size of compressed data
+extern PATCHAPI unsigned pixel_dxt_size(int width, int height, int dxt5);
+extern PATCHAPI void pixel_compress_dxt(void *dst, const void *src, int width, int height, int bitcount, int dxt5);
+
+
+#ifdef PATCHAPI_EXPORTS
+// INTERNAL DEFINITIONS
+
+// functions using SSE2 intrinsics, only call them if pixel_has_sse2()
+#ifdef __GNUC__
+#define SSE2_FUNC __attribute__((target("sse2")))
+#else
+#define SSE2_FUNC
+#endif
+
+extern void init_pixel_kernels(void);
+
+#endif
+#endif
@@ -24,8 +24,10 @@ extern PATCHAPI void plugin_fail(const char *module, int indent, const char *fmt
 #define PLUGINSYMBOL_PLATFORM        pal3apatch_plugin_platform
 #define PLUGINSYMBOL_BUILTON         pal3apatch_plugin_builton
 #define PLUGINSYMBOL_COMPILER        pal3apatch_plugin_compiler
+#define PLUGINSYMBOL_PREPARE         pal3apatch_plugin_prepare
 
 #define DECL_PLUGINENTRY(name) int (name)(void)
+#define DECL_PLUGINPREPARE(name) int (name)(void)
 
 
 extern PATCHAPI void load_plugin_dll(const char *filename);
@@ -54,6 +56,13 @@ extern PATCHAPI void search_plugins(const char *dirpath);
 #define MAKE_PLUGINENTRY() PLUGINAPI DECL_PLUGINENTRY(PLUGINSYMBOL_ENTRY)
 extern MAKE_PLUGINENTRY();
 
+// optional prepare step, called before plugin entry
+//   when plugins are loaded by directory search, prepare steps of all plugins
+//   run in parallel on worker threads, so it must be thread-safe and
+//   must not install any patch or hook (do these in plugin entry)
+#define MAKE_PLUGINPREPARE() PLUGINAPI DECL_PLUGINPREPARE(PLUGINSYMBOL_PREPARE)
+extern MAKE_PLUGINPREPARE();
+
 #define LOG_INDENT_VAR plugin_log_indent
 #define log_enter() (++(LOG_INDENT_VAR))
 #define log_leave() (--(LOG_INDENT_VAR))
@@ -23,7 +23,10 @@ typedef struct _DIMOUSESTATE2 {
     BYTE    rgbButtons[8];
 } DIMOUSESTATE2, *LPDIMOUSESTATE2;
 
+#define DIK_F7              0x41
 #define DIK_F8              0x42
+#define DIK_F9              0x43
+#define DIK_F12             0x58
 
 #endif
 
@@ -76,6 +79,7 @@ typedef struct _D3DXIMAGE_INFO {
 } D3DXIMAGE_INFO;
 
 #define D3DX_DEFAULT ((UINT) -1)
+#define D3DX_FILTER_NONE (1 << 0)
 
 typedef struct _D3DMATRIX D3DXMATRIX, *LPD3DXMATRIX;
 typedef struct D3DXVECTOR2 {
@@ -340,6 +344,53 @@ HRESULT WINAPI D3DXFillTexture(
     LPD3DXFILL2D pFunction,
     LPVOID pData
 );
+HRESULT WINAPI D3DXCreateTexture(
+    LPDIRECT3DDEVICE9 pDevice,
+    UINT Width,
+    UINT Height,
+    UINT MipLevels,
+    DWORD Usage,
+    D3DFORMAT Format,
+    D3DPOOL Pool,
+    LPDIRECT3DTEXTURE9 *ppTexture
+);
+HRESULT WINAPI D3DXCheckTextureRequirements(
+    LPDIRECT3DDEVICE9 pDevice,
+    UINT *pWidth,
+    UINT *pHeight,
+    UINT *pNumMipLevels,
+    DWORD Usage,
+    D3DFORMAT *pFormat,
+    D3DPOOL Pool
+);
+HRESULT WINAPI D3DXLoadSurfaceFromMemory(
+    LPDIRECT3DSURFACE9 pDestSurface,
+    CONST PALETTEENTRY *pDestPalette,
+    CONST RECT *pDestRect,
+    LPCVOID pSrcMemory,
+    D3DFORMAT SrcFormat,
+    UINT SrcPitch,
+    CONST PALETTEENTRY *pSrcPalette,
+    CONST RECT *pSrcRect,
+    DWORD Filter,
+    D3DCOLOR ColorKey
+);
+HRESULT WINAPI D3DXLoadSurfaceFromSurface(
+    LPDIRECT3DSURFACE9 pDestSurface,
+    CONST PALETTEENTRY *pDestPalette,
+    CONST RECT *pDestRect,
+    LPDIRECT3DSURFACE9 pSrcSurface,
+    CONST PALETTEENTRY *pSrcPalette,
+    CONST RECT *pSrcRect,
+    DWORD Filter,
+    D3DCOLOR ColorKey
+);
+HRESULT WINAPI D3DXFilterTexture(
+    LPDIRECT3DBASETEXTURE9 pBaseTexture,
+    CONST PALETTEENTRY *pPalette,
+    UINT SrcLevel,
+    DWORD Filter
+);
 HRESULT WINAPI D3DXSaveSurfaceToFileA(
     LPCTSTR pDestFile,
     D3DXIMAGE_FILEFORMAT DestFormat,
@@ -353,11 +404,13 @@ HRESULT WINAPI D3DXSaveSurfaceToFileA(
 // method macros
 
 #define ID3DXSprite_Release(p) (p)->lpVtbl->Release(p)
+#define ID3DXSprite_GetTransform(p,a) (p)->lpVtbl->GetTransform(p,a)
 #define ID3DXSprite_SetTransform(p,a) (p)->lpVtbl->SetTransform(p,a)
 #define ID3DXSprite_SetWorldViewRH(p,a,b) (p)->lpVtbl->SetWorldViewRH(p,a,b)
 #define ID3DXSprite_SetWorldViewLH(p,a,b) (p)->lpVtbl->SetWorldViewLH(p,a,b)
 #define ID3DXSprite_Draw(p,a,b,c,d,e) (p)->lpVtbl->Draw(p,a,b,c,d,e)
 #define ID3DXSprite_Begin(p,a) (p)->lpVtbl->Begin(p,a)
+#define ID3DXSprite_Flush(p) (p)->lpVtbl->Flush(p)
 #define ID3DXSprite_End(p) (p)->lpVtbl->End(p)
 #define ID3DXSprite_OnLostDevice(p) (p)->lpVtbl->OnLostDevice(p)
 #define ID3DXSprite_OnResetDevice(p) (p)->lpVtbl->OnResetDevice(p)
@@ -8,4 +8,12 @@ extern PATCHAPI int wal_check(char *dst[], char *src[], int n, const char *sum);
 extern PATCHAPI int wal_replace1(const char *dst, const char *src, const char *sum);
 extern PATCHAPI int wal_check1(const char *dst, const char *src, const char *sum);
 
+
+#ifdef PATCHAPI_EXPORTS
+// INTERNAL DEFINITIONS
+
+extern void init_wal(void);
+
+#endif
+
 #endif
@@ -9332,3 +9332,52 @@ const wchar_t big5table[] = { // cp950
          0,      0,      0,      0,      0,      0,      0,      0,
          0,      0,      0,      0,      0,      0,      0,      0,
 };
+
+
+// get decode table for codepage, returns NULL if there is no table
+const wchar_t *cjktable_get(UINT codepage)
+{
+    if (codepage == CP_ACP) codepage = GetACP();
+    switch (codepage) {
+    case CODEPAGE_CHS: return gbktable;
+    case CODEPAGE_CHT: return big5table;
+    default: return NULL;
+    }
+}
+
+// decode a GBK or BIG5 string with table lookup
+//   stops at NUL or after len bytes (len < 0 means until NUL)
+//   buf should have room for (bytes + 1) chars
+//   returns number of chars written, not including the terminating NUL
+int cjktable_decode(const char *s, int len, const wchar_t *table, wchar_t *buf)
+{
+    const unsigned char *p = (const unsigned char *) s;
+    const unsigned char *end = p + (len >= 0 ? (size_t) len : strlen(s));
+    wchar_t *d = buf;
+    while (p < end) {
+        // fast path for ASCII, 4 bytes at a time
+        while (end - p >= 4) {
+            unsigned v;
+            memcpy(&v, p, 4);
+            if ((v & 0x80808080) || ((v - 0x01010101) & ~v & 0x80808080)) break;
+            d[0] = p[0]; d[1] = p[1]; d[2] = p[2]; d[3] = p[3];
+            d += 4; p += 4;
+        }
+        if (p >= end) break;
+        
+        unsigned char b1 = *p++;
+        if (b1 < 0x80) {
+            if (!b1) break;
+            *d++ = b1;
+        } else {
+            wchar_t c = 0xfffd;
+            if (p < end && *p) {
+                int i = ((b1 << 8) | *p++) - 0x8000;
+                if (table[i]) c = table[i];
+            }
+            *d++ = c;
+        }
+    }
+    *d = 0;
+    return d - buf;
+}
@@ -20,6 +20,13 @@ void add_effect_hook(const char *eff_file, const char *old_str, const char *new_
     p->new_str = strdup(new_str);
 }
 
+static void warn_no_replace(struct effecthook_t *p)
+{
+    if (strcmp(p->eff_file, "*") != 0) {
+        warning("no replace occured. (effhook: file='%s' old='%s' new='%s')", p->eff_file, p->old_str, p->new_str);
+    }
+}
+
 // apply a single hook, alloc a new buffer for return
 static char *do_effhook_replace(struct effecthook_t *p, const char *eff)
 {
@@ -59,55 +66,312 @@ static char *do_effhook_replace(struct effecthook_t *p, const char *eff)
     }
     *new_eff = '\0';
     
-    if (!flag && strcmp(p->eff_file, "*") != 0) {
-        warning("no replace occured. (effhook: file='%s' old='%s' new='%s')", p->eff_file, p->old_str, p->new_str);
-    }
+    if (!flag) warn_no_replace(p);
     
     assert(strlen(ret) == (unsigned) eff_new_len);
     return ret;
 }
 
-// apply all hooks, alloc a new buffer for return
-static char *run_all_effect_hooks(const char *fn, const char *eff)
+
+// single pass replace
+//   hooks for an effect file are grouped and compiled into one case-insensitive
+//   Aho-Corasick automaton, so the effect text is scanned only once
+//   hooks are applied in turn, and later hooks see the output of earlier ones,
+//   so single pass is only used if it gives the same result as applying in turn,
+//   that is, no pattern may overlap another pattern or a replacement string
+//   otherwise the group falls back to do_effhook_replace() for each hook
+
+#define EFFHOOK_MAXGROUPS 64
+
+struct effhook_node {
+    int child;   // first child, -1 if none
+    int sibling; // next sibling, -1 if none
+    int fail;
+    int hook;    // index to group hooks, if a pattern ends here, otherwise -1
+    unsigned char ch;
+};
+
+struct effhook_group {
+    char *eff_file;
+    int hooks[MAX_EFFECTHOOKS]; // indices to effhooks[], in order
+    int nr_hooks;
+    int single_pass;
+    struct effhook_node *nodes;
+    int nr_nodes;
+    int root_next[256];
+};
+
+static struct effhook_group effgroups[EFFHOOK_MAXGROUPS];
+static int nr_effgroups = 0;
+static int effgroups_nr_hooks = 0; // nr_effhooks when groups were built
+
+static unsigned char effhook_lower(unsigned char ch)
+{
+    // same as strnicmp() in "C" locale
+    return ch >= 'A' && ch <= 'Z' ? ch - 'A' + 'a' : ch;
+}
+
+// check if sub occurs in s, case-insensitive
+static int effhook_contains(const char *s, const char *sub)
+{
+    size_t n = strlen(sub);
+    for (; *s; s++) {
+        if (strnicmp(s, sub, n) == 0) return 1;
+    }
+    return 0;
+}
+
+// check if a non-empty proper suffix of a is a prefix of b, case-insensitive
+static int effhook_overlaps(const char *a, const char *b)
+{
+    size_t la = strlen(a), lb = strlen(b), k;
+    for (k = 1; k < la && k <= lb; k++) {
+        if (strnicmp(a + la - k, b, k) == 0) return 1;
+    }
+    return 0;
+}
+
+static int effhook_independent(struct effhook_group *g)
+{
+    int i, j;
+    for (i = 0; i < g->nr_hooks; i++) {
+        struct effecthook_t *a = &effhooks[g->hooks[i]];
+        
+        // deleting text may join its neighbours into a pattern
+        if (!a->old_str[0] || !a->new_str[0]) return 0;
+        
+        for (j = 0; j < g->nr_hooks; j++) {
+            struct effecthook_t *b = &effhooks[g->hooks[j]];
+            if (i == j) continue;
+            if (effhook_contains(a->old_str, b->old_str) || effhook_overlaps(a->old_str, b->old_str)) return 0;
+            if (effhook_contains(a->new_str, b->old_str) || effhook_contains(b->old_str, a->new_str)) return 0;
+            if (effhook_overlaps(a->new_str, b->old_str) || effhook_overlaps(b->old_str, a->new_str)) return 0;
+        }
+    }
+    return 1;
+}
+
+static int effhook_node_child(struct effhook_group *g, int node, unsigned char ch)
+{
+    int i;
+    if (node == 0) return g->root_next[ch];
+    for (i = g->nodes[node].child; i >= 0; i = g->nodes[i].sibling) {
+        if (g->nodes[i].ch == ch) return i;
+    }
+    return -1;
+}
+
+static int effhook_node_new(struct effhook_group *g, int parent, unsigned char ch)
+{
+    if ((g->nr_nodes & (g->nr_nodes - 1)) == 0) {
+        struct effhook_node *nodes = realloc(g->nodes, imax(g->nr_nodes * 2, 64) * sizeof(struct effhook_node));
+        if (!nodes) return -1;
+        g->nodes = nodes;
+    }
+    int id = g->nr_nodes++;
+    struct effhook_node *n = &g->nodes[id];
+    n->child = -1;
+    n->sibling = -1;
+    n->fail = 0;
+    n->hook = -1;
+    n->ch = ch;
+    if (parent >= 0) {
+        n->sibling = g->nodes[parent].child;
+        g->nodes[parent].child = id;
+        if (parent == 0) g->root_next[ch] = id;
+    }
+    return id;
+}
+
+static int effhook_build(struct effhook_group *g)
+{
+    int i;
+    int *queue;
+    int head, tail;
+    
+    memset(g->root_next, -1, sizeof(g->root_next));
+    if (effhook_node_new(g, -1, 0) < 0) return 0;
+    
+    // build trie
+    for (i = 0; i < g->nr_hooks; i++) {
+        const char *s = effhooks[g->hooks[i]].old_str;
+        int node = 0;
+        for (; *s; s++) {
+            unsigned char ch = effhook_lower(*s);
+            int next = effhook_node_child(g, node, ch);
+            if (next < 0 && (next = effhook_node_new(g, node, ch)) < 0) return 0;
+            node = next;
+        }
+        g->nodes[node].hook = i;
+    }
+    
+    // build fail links by BFS
+    queue = malloc(g->nr_nodes * sizeof(int));
+    if (!queue) return 0;
+    head = tail = 0;
+    queue[tail++] = 0;
+    while (head < tail) {
+        int u = queue[head++];
+        int v;
+        for (v = g->nodes[u].child; v >= 0; v = g->nodes[v].sibling) {
+            int f = g->nodes[u].fail;
+            int x = -1;
+            if (u != 0) {
+                while ((x = effhook_node_child(g, f, g->nodes[v].ch)) < 0 && f) f = g->nodes[f].fail;
+            }
+            g->nodes[v].fail = x >= 0 ? x : 0;
+            queue[tail++] = v;
+        }
+    }
+    free(queue);
+    return 1;
+}
+
+static void free_effhook_groups(void)
 {
-    if (strrchr(fn, '\\')) fn = strrchr(fn, '\\') + 1;
-    char *str = strdup(eff);
     int i;
+    for (i = 0; i < nr_effgroups; i++) {
+        free(effgroups[i].eff_file);
+        free(effgroups[i].nodes);
+    }
+    memset(effgroups, 0, sizeof(effgroups));
+    nr_effgroups = 0;
+}
+
+static struct effhook_group *get_effhook_group(const char *fn)
+{
+    int i;
+    struct effhook_group *g;
+    
+    // hooks may be added by plugins at any time
+    if (effgroups_nr_hooks != nr_effhooks || nr_effgroups >= EFFHOOK_MAXGROUPS) {
+        free_effhook_groups();
+        effgroups_nr_hooks = nr_effhooks;
+    }
+    for (i = 0; i < nr_effgroups; i++) {
+        if (stricmp(effgroups[i].eff_file, fn) == 0) return &effgroups[i];
+    }
+    
+    g = &effgroups[nr_effgroups++];
+    g->eff_file = strdup(fn);
     for (i = 0; i < nr_effhooks; i++) {
         if (strcmp(effhooks[i].eff_file, "*") == 0 || stricmp(effhooks[i].eff_file, fn) == 0) {
-            char *new_str = do_effhook_replace(&effhooks[i], str);
+            g->hooks[g->nr_hooks++] = i;
+        }
+    }
+    g->single_pass = g->nr_hooks > 1 && effhook_independent(g) && effhook_build(g);
+    return g;
+}
+
+static char *do_effhook_single_pass(struct effhook_group *g, const char *eff)
+{
+    int matched[MAX_EFFECTHOOKS];
+    struct cstr out;
+    const char *copied = eff;
+    const char *ptr;
+    int state = 0;
+    int i;
+    
+    memset(matched, 0, sizeof(matched));
+    cstr_ctor(&out);
+    bvec_breserve(&out.v, strlen(eff) + 1);
+    
+    for (ptr = eff; *ptr; ptr++) {
+        unsigned char ch = effhook_lower(*ptr);
+        int next;
+        while ((next = effhook_node_child(g, state, ch)) < 0 && state) state = g->nodes[state].fail;
+        state = next >= 0 ? next : 0;
+        
+        // patterns never overlap, so restart from root after a match
+        if (g->nodes[state].hook >= 0) {
+            struct effecthook_t *p = &effhooks[g->hooks[g->nodes[state].hook]];
+            const char *start = ptr + 1 - strlen(p->old_str);
+            cstr_push(&out, copied, start - copied);
+            cstr_strcat(&out, p->new_str);
+            copied = ptr + 1;
+            matched[g->nodes[state].hook] = 1;
+            state = 0;
+        }
+    }
+    cstr_strcat(&out, copied);
+    
+    for (i = 0; i < g->nr_hooks; i++) {
+        if (!matched[i]) warn_no_replace(&effhooks[g->hooks[i]]);
+    }
+    return cstr_mdtor(&out);
+}
+
+static const char *effect_basename(const char *fn)
+{
+    return strrchr(fn, '\\') ? strrchr(fn, '\\') + 1 : fn;
+}
+
+// apply all hooks, alloc a new buffer for return
+char *run_all_effect_hooks(const char *fn, const char *eff)
+{
+    struct effhook_group *g = get_effhook_group(effect_basename(fn));
+    char *str;
+    CHROMETRACE_BEGIN("effect hooks", g->nr_hooks);
+    if (g->single_pass) {
+        str = do_effhook_single_pass(g, eff);
+    } else {
+        int i;
+        str = strdup(eff);
+        for (i = 0; i < g->nr_hooks; i++) {
+            char *new_str = do_effhook_replace(&effhooks[g->hooks[i]], str);
             free(str);
             str = new_str;
         }
     }
+    CHROMETRACE_END();
     return str;
 }
 
+// time effect compilation for hitchlog, loadtimes, benchmark and chrometrace
+static const char *hitchlog_eff_filename;
+static HRESULT WINAPI D3DXCreateEffect_hitchlog(IDirect3DDevice9 *pDevice, LPCVOID pSrcData, UINT SrcDataLen, const void *pDefines, void *pInclude, DWORD Flags, void *pPool, void **ppEffect, void **ppCompilationErrors)
+{
+    LARGE_INTEGER begin, end;
+    QueryPerformanceCounter(&begin);
+    HRESULT ret = ((HRESULT (WINAPI *)(IDirect3DDevice9 *, LPCVOID, UINT, const void *, void *, DWORD, void *, void **, void **)) TOPTR(gboffset + 0x10031BA2))(pDevice, pSrcData, SrcDataLen, pDefines, pInclude, Flags, pPool, ppEffect, ppCompilationErrors);
+    QueryPerformanceCounter(&end);
+    hitchlog_event(HITCHLOG_EFFECT, hitchlog_eff_filename, SrcDataLen, begin.QuadPart, end.QuadPart);
+    return ret;
+}
+
 static MAKE_ASMPATCH(hook_D3DXCreateEffect)
 {
     char *eff_filename = TOPTR(M_DWORD(R_ESP + 0x3C)); // effect filename
     char *eff_filedata = TOPTR(M_DWORD(R_ESP + 0x4)); // effect content
     unsigned int eff_filelen = M_DWORD(R_ESP + 0x8);
     
-    char *old_eff = malloc(eff_filelen + 1);
-    memcpy(old_eff, eff_filedata, eff_filelen);
-    old_eff[eff_filelen] = '\0';
-    
-    if (strlen(old_eff) != eff_filelen) {
-        warning("invalid effect file '%s', skip.", eff_filename);
-    } else {
-        //plog("fn=%s, old_eff = %s\n", eff_filename, old_eff);        
-        static char *new_eff = NULL;
-        free(new_eff);
-        new_eff = run_all_effect_hooks(eff_filename, old_eff);
+    // leave effect data untouched if no hook applies
+    if (get_effhook_group(effect_basename(eff_filename))->nr_hooks > 0) {
+        char *old_eff = malloc(eff_filelen + 1);
+        memcpy(old_eff, eff_filedata, eff_filelen);
+        old_eff[eff_filelen] = '\0';
         
-        M_DWORD(R_ESP + 0x4) = TOUINT(new_eff);
-        M_DWORD(R_ESP + 0x8) = strlen(new_eff);
+        if (strlen(old_eff) != eff_filelen) {
+            warning("invalid effect file '%s', skip.", eff_filename);
+        } else {
+            //plog("fn=%s, old_eff = %s\n", eff_filename, old_eff);        
+            static char *new_eff = NULL;
+            free(new_eff);
+            new_eff = run_all_effect_hooks(eff_filename, old_eff);
+            
+            M_DWORD(R_ESP + 0x4) = TOUINT(new_eff);
+            M_DWORD(R_ESP + 0x8) = strlen(new_eff);
+        }
+        
+        free(old_eff);
     }
     
-    free(old_eff);
-    
-    LINK_CALL(gboffset + 0x10031BA2);
+    if (hitchlog_enabled || loadtimes_enabled || benchmark_enabled || chrometrace_enabled) {
+        hitchlog_eff_filename = eff_filename;
+        LINK_CALL(TOUINT(D3DXCreateEffect_hitchlog));
+    } else {
+        LINK_CALL(gboffset + 0x10031BA2);
+    }
 }
 
 void init_effect_hooks()
@@ -1,6 +1,114 @@
 // patch framework
 #include "common.h"
 
+// number of memcpy_to_process() calls, for startup timeline
+unsigned memcpy_to_process_count = 0;
+
+// patch transaction
+//   between begin_patch_transaction() and commit_patch_transaction(),
+//   memcpy_to_process() makes each page writable only once and keeps it so,
+//   protections are restored and instruction cache is flushed once per page at commit
+//   writes are still applied immediately, so later patches can read back
+//   code patched by earlier ones (e.g. get_wrapper_branch_jtarget())
+//   original bytes are saved, abort_patch_transaction() undoes all writes
+//   transactions can be nested, only the outermost one takes effect
+
+struct patchtx_page {
+    unsigned base;
+    DWORD oldprotect;
+};
+struct patchtx_write {
+    unsigned addr;
+    unsigned size;
+    unsigned char *oldbytes;
+};
+
+static int patchtx_depth = 0;
+static unsigned patchtx_pagesize;
+static struct bvec patchtx_pages; // struct patchtx_page
+static struct bvec patchtx_writes; // struct patchtx_write
+
+void begin_patch_transaction()
+{
+    if (patchtx_depth++ > 0) return;
+    if (!patchtx_pagesize) {
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        patchtx_pagesize = si.dwPageSize;
+    }
+    bvec_ctor(&patchtx_pages);
+    bvec_ctor(&patchtx_writes);
+}
+
+static void patchtx_unprotect(unsigned dest, unsigned size)
+{
+    unsigned page;
+    for (page = dest & ~(patchtx_pagesize - 1); page < dest + size; page += patchtx_pagesize) {
+        struct patchtx_page *p;
+        for (p = bvec_tbegin(&patchtx_pages, struct patchtx_page); p != bvec_tend(&patchtx_pages, struct patchtx_page); p++) {
+            if (p->base == page) break;
+        }
+        if (p != bvec_tend(&patchtx_pages, struct patchtx_page)) continue;
+        
+        struct patchtx_page newpage = { page, 0 };
+        if (!VirtualProtect(TOPTR(page), patchtx_pagesize, PAGE_EXECUTE_READWRITE, &newpage.oldprotect)) fail("VirtualProtect() failed.");
+        bvec_tpushback(&patchtx_pages, &newpage, struct patchtx_page);
+    }
+}
+
+static void patchtx_record(unsigned dest, unsigned size)
+{
+    // the same range may be patched again (e.g. chained wrappers)
+    // but partially overlapped writes are likely to be conflicts
+    struct patchtx_write *w;
+    for (w = bvec_tbegin(&patchtx_writes, struct patchtx_write); w != bvec_tend(&patchtx_writes, struct patchtx_write); w++) {
+        if (dest < w->addr + w->size && w->addr < dest + size && (dest != w->addr || size != w->size)) {
+            plog("patch at %08X (size %u) partially overlaps patch at %08X (size %u).", dest, size, w->addr, w->size);
+        }
+    }
+    
+    struct patchtx_write newwrite = { dest, size, malloc(size) };
+    if (!newwrite.oldbytes) fail("out of memory.");
+    memcpy(newwrite.oldbytes, TOPTR(dest), size);
+    bvec_tpushback(&patchtx_writes, &newwrite, struct patchtx_write);
+}
+
+static void patchtx_finish(int undo)
+{
+    struct patchtx_write *w;
+    if (undo) {
+        for (w = bvec_tend(&patchtx_writes, struct patchtx_write); w != bvec_tbegin(&patchtx_writes, struct patchtx_write); ) {
+            w--;
+            memcpy(TOPTR(w->addr), w->oldbytes, w->size);
+        }
+    }
+    for (w = bvec_tbegin(&patchtx_writes, struct patchtx_write); w != bvec_tend(&patchtx_writes, struct patchtx_write); w++) {
+        free(w->oldbytes);
+    }
+    
+    struct patchtx_page *p;
+    for (p = bvec_tbegin(&patchtx_pages, struct patchtx_page); p != bvec_tend(&patchtx_pages, struct patchtx_page); p++) {
+        DWORD tmp;
+        if (!VirtualProtect(TOPTR(p->base), patchtx_pagesize, p->oldprotect, &tmp)) fail("VirtualProtect() failed.");
+        flush_instruction_cache(TOPTR(p->base), patchtx_pagesize);
+    }
+    bvec_dtor(&patchtx_pages);
+    bvec_dtor(&patchtx_writes);
+}
+
+void commit_patch_transaction()
+{
+    if (patchtx_depth <= 0) fail("no patch transaction to commit.");
+    if (--patchtx_depth > 0) return;
+    patchtx_finish(0);
+}
+
+void abort_patch_transaction()
+{
+    if (patchtx_depth <= 0) fail("no patch transaction to abort.");
+    patchtx_depth = 0;
+    patchtx_finish(1);
+}
 
 void memcpy_to_process(unsigned dest, const void *src, unsigned size)
 {
@@ -14,6 +122,13 @@ void memcpy_to_process(unsigned dest, const void *src, unsigned size)
     // use VirtualProtect instead
     DWORD flOldProtect, tmp;
     BOOL ret;
+    memcpy_to_process_count++;
+    if (patchtx_depth > 0) {
+        patchtx_unprotect(dest, size);
+        patchtx_record(dest, size);
+        memcpy(TOPTR(dest), src, size);
+        return;
+    }
     ret = VirtualProtect(TOPTR(dest), size, PAGE_EXECUTE_READWRITE, &flOldProtect);
     if (!ret) fail("VirtualProtect() failed.");
     memcpy(TOPTR(dest), src, size);
@@ -41,12 +156,13 @@ void make_branch(unsigned addr, unsigned char opcode, const void *jtarget, unsig
 {
     unsigned jmpimm = (unsigned) jtarget - (addr + 5);
     if (size < 5) fail("size is to small to make a branch instuction");
-    unsigned char *instrbuf = malloc(size);
+    unsigned char smallbuf[16];
+    unsigned char *instrbuf = size <= sizeof(smallbuf) ? smallbuf : malloc(size);
     if (size > 5) memset(instrbuf + 5, 0x90, size - 5);
     instrbuf[0] = opcode;
     memcpy(instrbuf + 1, &jmpimm, 4);
     memcpy_to_process(addr, instrbuf, size);
-    free(instrbuf);
+    if (instrbuf != smallbuf) free(instrbuf);
 }
 
 void make_jmp(unsigned addr, const void *jtarget)
@@ -98,6 +214,27 @@ void make_wrapper_branch_batch(unsigned *addr_list, int count, const void *jtarg
 {
     while (count--) make_wrapper_branch(*addr_list++, jtarget);
 }
+unsigned get_wrapper_branch_jtarget(unsigned addr)
+{
+    // get current target of a branch which make_wrapper_branch() can handle
+    // useful when a branch might be already patched by other patchsets
+    unsigned char opcode[2];
+    unsigned ptr;
+    memcpy_from_process(opcode, addr, 2);
+    switch (opcode[0]) {
+        case 0xE9:
+        case 0xE8:
+            return get_branch_jtarget(addr, opcode[0]);
+        case 0xFF:
+            if (opcode[1] == 0x15) {
+                memcpy_from_process(&ptr, addr + 2, sizeof(ptr));
+                return M_DWORD(ptr);
+            }
+            fail("unknown branch opcode %02X %02X.", opcode[0], opcode[1]);
+        default:
+            fail("unknown branch opcode %02X.", opcode[0]);
+    }
+}
 
 void make_uint(unsigned addr, unsigned uint)
 {
@@ -119,6 +256,18 @@ void check_code(unsigned addr, const void *code, unsigned size)
     free(buf);
 }
 
+// format address as 'MODULE+OFFSET', works on win9x too
+void get_address_symbol(const void *addr, char *buf, int size)
+{
+    MEMORY_BASIC_INFORMATION mbi;
+    char path[MAXLINE];
+    if (VirtualQuery(addr, &mbi, sizeof(mbi)) && mbi.AllocationBase && GetModuleFileNameA(mbi.AllocationBase, path, sizeof(path))) {
+        snprintf(buf, size, "%s+0x%X", get_filepart(path), TOUINT(addr) - TOUINT(mbi.AllocationBase));
+    } else {
+        snprintf(buf, size, "0x%08X", TOUINT(addr));
+    }
+}
+
 unsigned get_module_base(const char *modulename)
 {
     HMODULE hmodule = GetModuleHandle(modulename);
@@ -151,14 +300,37 @@ void hook_iat(void *iatbase, void *oldptr, void *newptr)
     }
 }
 
+// installed import hooks, so a function can be hooked again by another patchset
+#define MAX_IMPORT_HOOKS 64
+static struct import_hook {
+    void *image_base;
+    const char *dllname;
+    const char *funcname;
+    void *curptr; // current pointer in iat
+} import_hooks[MAX_IMPORT_HOOKS];
+static int nr_import_hooks;
+
 void *hook_import_table(void *image_base, const char *dllname, const char *funcname, void *newptr)
 {
     // hook import table of module 'image_base'
-    // return value is original function ptr
+    // return value is original function ptr,
+    //   or previous hook if the function is already hooked, the new hook should call it
     void *oldptr = get_func_address(dllname, funcname);
     if (!oldptr) {
         fail("can't find address of %s in dll %s.", funcname, dllname);
     }
+    int i;
+    for (i = 0; i < nr_import_hooks; i++) {
+        struct import_hook *h = &import_hooks[i];
+        if (h->image_base == image_base && stricmp(h->dllname, dllname) == 0 && strcmp(h->funcname, funcname) == 0) {
+            oldptr = h->curptr;
+            h->curptr = newptr;
+            break;
+        }
+    }
+    if (i == nr_import_hooks && nr_import_hooks < MAX_IMPORT_HOOKS) {
+        import_hooks[nr_import_hooks++] = (struct import_hook) { image_base, dllname, funcname, newptr };
+    }
     if (image_base == GetModuleHandle(NULL)) {
         // we must hardcode IAT address since PAL3.EXE is packed
         void *iatbase = NULL;
@@ -193,18 +365,33 @@ void *hook_import_table(void *image_base, const char *dllname, const char *funcn
 }
 
 
+// dyncode slab allocator
+//   dynamic code is packed into slabs reserved at allocation granularity,
+//   and pages of a slab are committed only when they are needed
+//   every buffer is aligned to DYNCODE_ALIGN
+#define DYNCODE_SLABSIZE 0x10000
 #define DYNCODE_PAGESIZE 4096
-static void *dyncode_page = NULL;
-static unsigned dyncode_ptr;
+#define DYNCODE_ALIGN 16
+static void *dyncode_slab = NULL;
+static unsigned dyncode_ptr; // next free offset in slab
+static unsigned dyncode_committed; // committed bytes in slab
 void *alloc_dyncode_buffer(unsigned size)
 {
-    if (!size || size > DYNCODE_PAGESIZE) fail("invalid size %08X.", size);
-    if (!dyncode_page || dyncode_ptr + size > DYNCODE_PAGESIZE) {
-        dyncode_page = VirtualAlloc(NULL, DYNCODE_PAGESIZE, MEM_COMMIT, PAGE_EXECUTE_READWRITE);
-        if (!dyncode_page) fail("can't alloc memory for dynamic code.");
-        dyncode_ptr = 0;
+    if (!size || size > DYNCODE_SLABSIZE) fail("invalid size %08X.", size);
+    size = (size + DYNCODE_ALIGN - 1) & ~(DYNCODE_ALIGN - 1);
+    if (!dyncode_slab || dyncode_ptr + size > DYNCODE_SLABSIZE) {
+        dyncode_slab = VirtualAlloc(NULL, DYNCODE_SLABSIZE, MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+        if (!dyncode_slab) fail("can't reserve memory for dynamic code.");
+        dyncode_ptr = dyncode_committed = 0;
+    }
+    if (dyncode_ptr + size > dyncode_committed) {
+        unsigned new_committed = (dyncode_ptr + size + DYNCODE_PAGESIZE - 1) & ~(DYNCODE_PAGESIZE - 1);
+        if (!VirtualAlloc(PTRADD(dyncode_slab, dyncode_committed), new_committed - dyncode_committed, MEM_COMMIT, PAGE_EXECUTE_READWRITE)) {
+            fail("can't alloc memory for dynamic code.");
+        }
+        dyncode_committed = new_committed;
     }
-    void *ret = PTRADD(dyncode_page, dyncode_ptr);
+    void *ret = PTRADD(dyncode_slab, dyncode_ptr);
     dyncode_ptr += size;
     return ret;
 }
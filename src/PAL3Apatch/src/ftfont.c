@@ -14,16 +14,13 @@ void init_ftfont()
 
 
 
-static void ftlayout_clear(struct ftlayout *l, int w, int h, int m)
-{
-    *l = (struct ftlayout) {
-        .w = w,
-        .h = h,
-        .m = m,
-        .u = m,
-        .v = m,
-        .vnext = m,
-    };
+void ftlayout_clear(struct ftlayout *l, int w, int h, int m)
+{
+    l->w = w;
+    l->h = h;
+    l->m = m;
+    l->nr_nodes = 1;
+    l->node[0] = (struct ftlayout_node) { .x = m, .y = m, .w = w - m };
 }
 
 static void ftlayout_setfull(struct ftlayout *l)
@@ -31,7 +28,24 @@ static void ftlayout_setfull(struct ftlayout *l)
     ftlayout_clear(l, 0, 0, 1);
 }
 
-static int ftlayout_addrect(struct ftlayout *l, int w, int h, int *u, int *v)
+// lowest y for a w*h rect whose left edge is at node i, or -1 if it doesn't fit
+static int ftlayout_fit(struct ftlayout *l, int i, int w, int h)
+{
+    int x = l->node[i].x;
+    int y = 0;
+    if (x + w > l->w) return -1;
+    int left = w;
+    while (left > 0) {
+        // nodes cover the whole width, so i won't go out of range
+        if (l->node[i].y > y) y = l->node[i].y;
+        if (y + h > l->h) return -1;
+        left -= l->node[i].w;
+        i++;
+    }
+    return y;
+}
+
+int ftlayout_addrect(struct ftlayout *l, int w, int h, int *u, int *v)
 {
     // return value:
     //  <0 --- impossible, even create a new layout with same width and height
@@ -45,30 +59,395 @@ static int ftlayout_addrect(struct ftlayout *l, int w, int h, int *u, int *v)
         // not possible
         return -1;
     }
-    if (w > l->w - l->u) {
-        // no space left in current line
-        // switch to new line
-        l->u = l->m;
-        l->v = l->vnext;
+    
+    // find lowest position, prefer narrower node if same
+    int i, best = -1, besty = INT_MAX, bestw = INT_MAX;
+    for (i = 0; i < l->nr_nodes; i++) {
+        int y = ftlayout_fit(l, i, w, h);
+        if (y >= 0 && (y < besty || (y == besty && l->node[i].w < bestw))) {
+            best = i;
+            besty = y;
+            bestw = l->node[i].w;
+        }
     }
-    if (h > l->h - l->v) {
+    if (best < 0 || l->nr_nodes >= FTFONT_SKYLINE_MAXNODES) {
         // no room, need a new layout
         return 0;
     }
     
-    *u = l->u;
-    *v = l->v;
-    l->u += w;
-    if (l->v + h >= l->vnext) l->vnext = l->v + h;
+    *u = l->node[best].x;
+    *v = besty;
+    
+    // insert new node, then shrink or remove nodes under it
+    memmove(&l->node[best + 1], &l->node[best], (l->nr_nodes - best) * sizeof(struct ftlayout_node));
+    l->nr_nodes++;
+    l->node[best] = (struct ftlayout_node) { .x = *u, .y = besty + h, .w = w };
+    for (i = best + 1; i < l->nr_nodes; ) {
+        int shrink = l->node[i - 1].x + l->node[i - 1].w - l->node[i].x;
+        if (shrink <= 0) break;
+        if (shrink < l->node[i].w) {
+            l->node[i].x += shrink;
+            l->node[i].w -= shrink;
+            break;
+        }
+        memmove(&l->node[i], &l->node[i + 1], (l->nr_nodes - i - 1) * sizeof(struct ftlayout_node));
+        l->nr_nodes--;
+    }
+    
+    // merge nodes with same height
+    for (i = 0; i + 1 < l->nr_nodes; ) {
+        if (l->node[i].y == l->node[i + 1].y) {
+            l->node[i].w += l->node[i + 1].w;
+            memmove(&l->node[i + 1], &l->node[i + 2], (l->nr_nodes - i - 2) * sizeof(struct ftlayout_node));
+            l->nr_nodes--;
+        } else {
+            i++;
+        }
+    }
     return 1;
 }
 
 
 
+static struct ftchar *ftfont_getchar(struct ftfont *font, wchar_t c)
+{
+    struct ftchar **page = font->page[c >> FTFONT_PAGEBITS];
+    return page ? page[c & (FTFONT_PAGESIZE - 1)] : NULL;
+}
+
+static void ftfont_setchar(struct ftfont *font, wchar_t c, struct ftchar *ch)
+{
+    struct ftchar ***page = &font->page[c >> FTFONT_PAGEBITS];
+    if (!*page) {
+        *page = calloc(FTFONT_PAGESIZE, sizeof(struct ftchar *));
+        if (!*page) {
+            free(ch);
+            return;
+        }
+    }
+    (*page)[c & (FTFONT_PAGESIZE - 1)] = ch;
+    font->nr_chars++;
+}
+
+
+
+// persistent glyph cache
+//   rasterized chars are saved to FTFONT_CACHE_DIR at exit,
+//   and loaded when a font with the same key is created,
+//   so preloading cached chars won't call freetype at all
+//   textures are still assigned on demand when drawing
+//   key is hash of font file identity and all rasterization parameters
+
+static int ftcache_enabled;
+static struct ftfont *ftcache_fonts;
+
+static void ftcache_path(struct ftfont *font, char *path)
+{
+    int i;
+    strcpy(path, FTFONT_CACHE_DIR "\\");
+    for (i = 0; i < 20; i++) sprintf(path + strlen(path), "%02x", font->cachekey[i]);
+    strcat(path, ".ftc");
+}
+
+static int ftcache_makekey(struct ftfont *font, const char *filename, int face_index, int req_size, int req_bold, int req_quality)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    if (!GetFileAttributesExA(filename, GetFileExInfoStandard, &attr)) return 0;
+    
+    // file size, mtime and leading bytes (table directory) identify the font file
+    unsigned char head[4096];
+    size_t headlen = 0;
+    FILE *fp = robust_fopen(filename, "rb");
+    if (!fp) return 0;
+    headlen = fread(head, 1, sizeof(head), fp);
+    fclose(fp);
+    
+    int param[] = { face_index, req_size, req_bold, req_quality };
+    SHA1_CTX ctx;
+    SHA1Init(&ctx);
+    SHA1Update(&ctx, (const unsigned char *) FTFONT_VERSTR, strlen(FTFONT_VERSTR));
+    SHA1Update(&ctx, (const unsigned char *) &attr.nFileSizeLow, sizeof(attr.nFileSizeLow));
+    SHA1Update(&ctx, (const unsigned char *) &attr.nFileSizeHigh, sizeof(attr.nFileSizeHigh));
+    SHA1Update(&ctx, (const unsigned char *) &attr.ftLastWriteTime, sizeof(attr.ftLastWriteTime));
+    SHA1Update(&ctx, head, headlen);
+    SHA1Update(&ctx, (const unsigned char *) param, sizeof(param));
+    SHA1Final(font->cachekey, &ctx);
+    return 1;
+}
+
+static void ftcache_load(struct ftfont *font)
+{
+    char path[MAXLINE];
+    ftcache_path(font, path);
+    FILE *fp = robust_fopen(path, "rb");
+    if (!fp) return;
+    
+    // read whole file and verify checksum first
+    unsigned char *data = NULL;
+    long len;
+    if (fseek(fp, 0, SEEK_END) != 0 || (len = ftell(fp)) < (long) (sizeof(struct ftcache_filehdr) + 20)) goto bad;
+    data = malloc(len);
+    if (!data) goto done;
+    if (fseek(fp, 0, SEEK_SET) != 0 || fread(data, 1, len, fp) != (size_t) len) goto bad;
+    
+    unsigned char sum[20];
+    SHA1_CTX ctx;
+    SHA1Init(&ctx);
+    SHA1Update(&ctx, data, len - 20);
+    SHA1Final(sum, &ctx);
+    if (memcmp(sum, data + len - 20, 20) != 0) goto bad;
+    
+    const struct ftcache_filehdr *hdr = (const void *) data;
+    if (hdr->magic != FTFONT_CACHE_MAGIC || hdr->version != FTFONT_CACHE_VERSION) goto bad;
+    
+    const unsigned char *ptr = data + sizeof(struct ftcache_filehdr);
+    const unsigned char *end = data + len - 20;
+    unsigned i;
+    for (i = 0; i < hdr->nr_chars; i++) {
+        struct ftcache_charhdr chdr;
+        if (end - ptr < (int) sizeof(chdr)) goto bad;
+        memcpy(&chdr, ptr, sizeof(chdr));
+        ptr += sizeof(chdr);
+        if (chdr.w <= 0 || chdr.w > FTFONT_CACHE_MAXCHARSIZE || chdr.h <= 0 || chdr.h > FTFONT_CACHE_MAXCHARSIZE) goto bad;
+        int size = chdr.w * chdr.h;
+        if (end - ptr < size) goto bad;
+        if (!ftfont_getchar(font, chdr.c)) {
+            struct ftchar *ch = malloc(sizeof(struct ftchar) + size);
+            if (!ch) break;
+            ch->tex = NULL;
+            ch->freed = 0;
+            ch->u = ch->v = 0;
+            ch->w = chdr.w;
+            ch->h = chdr.h;
+            ch->l = chdr.l;
+            ch->t = chdr.t;
+            ch->adv = chdr.adv;
+            memcpy(ch->bitmap, ptr, size);
+            ftfont_setchar(font, chdr.c, ch);
+        }
+        ptr += size;
+    }
+    goto done;
+bad:
+    warning("invalid glyph cache file '%s', ignored.", path);
+done:
+    font->nr_cached = font->nr_chars;
+    free(data);
+    fclose(fp);
+}
+
+static void ftcache_save(struct ftfont *font)
+{
+    char path[MAXLINE];
+    ftcache_path(font, path);
+    FILE *fp = robust_fopen(path, "wb");
+    if (!fp) {
+        warning("can't write glyph cache file '%s'.", path);
+        return;
+    }
+    
+    SHA1_CTX ctx;
+    unsigned char sum[20];
+    struct ftcache_filehdr hdr = {
+        .magic = FTFONT_CACHE_MAGIC,
+        .version = FTFONT_CACHE_VERSION,
+        .nr_chars = font->nr_chars,
+    };
+    unsigned c;
+    SHA1Init(&ctx);
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    SHA1Update(&ctx, (const unsigned char *) &hdr, sizeof(hdr));
+    for (c = 0; c < FTFONT_MAXCHARS; c++) {
+        struct ftchar *ch = ftfont_getchar(font, c);
+        if (!ch) continue;
+        struct ftcache_charhdr chdr = {
+            .c = c,
+            .w = ch->w,
+            .h = ch->h,
+            .l = ch->l,
+            .t = ch->t,
+            .adv = ch->adv,
+        };
+        fwrite(&chdr, sizeof(chdr), 1, fp);
+        fwrite(ch->bitmap, 1, ch->w * ch->h, fp);
+        SHA1Update(&ctx, (const unsigned char *) &chdr, sizeof(chdr));
+        SHA1Update(&ctx, ch->bitmap, ch->w * ch->h);
+    }
+    SHA1Final(sum, &ctx);
+    fwrite(sum, sizeof(sum), 1, fp);
+    if (safe_fclose(&fp) != 0) {
+        warning("can't write glyph cache file '%s'.", path);
+        robust_unlink(path);
+        return;
+    }
+    font->nr_cached = font->nr_chars;
+}
+
+static void ftcache_atexit(void)
+{
+    struct ftfont *font;
+    for (font = ftcache_fonts; font; font = font->next) {
+        EnterCriticalSection(&font->lock);
+        // bounded fonts don't keep all bitmaps, don't overwrite cache with them
+        if (font->nr_chars != font->nr_cached && !font->texbudget) ftcache_save(font);
+        LeaveCriticalSection(&font->lock);
+    }
+}
+
+void ftfont_enable_cache(void)
+{
+    if (ftcache_enabled) return;
+    if (!file_exists(FTFONT_CACHE_DIR) && !create_dir(FTFONT_CACHE_DIR)) {
+        warning("can't create glyph cache directory '%s'.", FTFONT_CACHE_DIR);
+        return;
+    }
+    ftcache_enabled = 1;
+    add_atexit_hook(ftcache_atexit);
+}
+
+
+
+// glyph usage profile
+//   chars drawn in this session are marked in a bitmap, and merged into
+//   a persistent profile at exit, each session adds one to counts of drawn chars
+//   profile is per game (cache directory) and per codepage,
+//   ftfont_get_profile() gives most used chars first, for preloading
+
+static int ftprofile_enabled;
+static char ftprofile_path[MAXLINE];
+static unsigned char ftprofile_used[FTFONT_MAXCHARS / 8];
+static unsigned short ftprofile_count[FTFONT_MAXCHARS];
+static wchar_t ftprofile_str[FTFONT_PROFILE_MAXCHARS + 1];
+
+static int ftprofile_cmp(const void *a, const void *b)
+{
+    wchar_t ca = *(const wchar_t *) a, cb = *(const wchar_t *) b;
+    if (ftprofile_count[ca] != ftprofile_count[cb]) return ftprofile_count[ca] > ftprofile_count[cb] ? -1 : 1;
+    return ca < cb ? -1 : ca > cb;
+}
+
+// collect chars with non-zero count into ftprofile_str[], most used first
+static int ftprofile_sort(void)
+{
+    static wchar_t buf[FTFONT_MAXCHARS];
+    unsigned c;
+    int n = 0;
+    for (c = 1; c < FTFONT_MAXCHARS; c++) {
+        if (ftprofile_count[c]) buf[n++] = c;
+    }
+    qsort(buf, n, sizeof(wchar_t), ftprofile_cmp);
+    if (n > FTFONT_PROFILE_MAXCHARS) n = FTFONT_PROFILE_MAXCHARS;
+    memcpy(ftprofile_str, buf, n * sizeof(wchar_t));
+    ftprofile_str[n] = 0;
+    return n;
+}
+
+static void ftprofile_load(void)
+{
+    FILE *fp = robust_fopen(ftprofile_path, "rb");
+    if (!fp) return;
+    
+    struct ftprofile_filehdr hdr;
+    struct ftprofile_entry ent;
+    unsigned char sum[20], filesum[20];
+    SHA1_CTX ctx;
+    unsigned i;
+    SHA1Init(&ctx);
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1) goto bad;
+    if (hdr.magic != FTFONT_PROFILE_MAGIC || hdr.version != FTFONT_PROFILE_VERSION || hdr.nr_chars > FTFONT_PROFILE_MAXCHARS) goto bad;
+    SHA1Update(&ctx, (const unsigned char *) &hdr, sizeof(hdr));
+    for (i = 0; i < hdr.nr_chars; i++) {
+        if (fread(&ent, sizeof(ent), 1, fp) != 1) goto bad;
+        SHA1Update(&ctx, (const unsigned char *) &ent, sizeof(ent));
+        ftprofile_count[ent.c] = ent.count;
+    }
+    SHA1Final(sum, &ctx);
+    if (fread(filesum, sizeof(filesum), 1, fp) != 1 || memcmp(sum, filesum, sizeof(sum)) != 0) goto bad;
+    ftprofile_sort();
+    goto done;
+bad:
+    warning("invalid glyph profile '%s', ignored.", ftprofile_path);
+    memset(ftprofile_count, 0, sizeof(ftprofile_count));
+done:
+    fclose(fp);
+}
+
+static void ftprofile_atexit(void)
+{
+    unsigned c;
+    int i, n, changed = 0;
+    
+    // merge session usage, halve all counts before overflow
+    for (c = 1; c < FTFONT_MAXCHARS; c++) {
+        if (!(ftprofile_used[c >> 3] & (1 << (c & 7)))) continue;
+        if (ftprofile_count[c] == 0xFFFF) {
+            unsigned j;
+            for (j = 0; j < FTFONT_MAXCHARS; j++) ftprofile_count[j] >>= 1;
+        }
+        ftprofile_count[c]++;
+        changed = 1;
+    }
+    if (!changed) return;
+    n = ftprofile_sort();
+    
+    FILE *fp = robust_fopen(ftprofile_path, "wb");
+    if (!fp) {
+        warning("can't write glyph profile '%s'.", ftprofile_path);
+        return;
+    }
+    SHA1_CTX ctx;
+    unsigned char sum[20];
+    struct ftprofile_filehdr hdr = {
+        .magic = FTFONT_PROFILE_MAGIC,
+        .version = FTFONT_PROFILE_VERSION,
+        .nr_chars = n,
+    };
+    SHA1Init(&ctx);
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    SHA1Update(&ctx, (const unsigned char *) &hdr, sizeof(hdr));
+    for (i = 0; i < n; i++) {
+        struct ftprofile_entry ent = {
+            .c = ftprofile_str[i],
+            .count = ftprofile_count[ftprofile_str[i]],
+        };
+        fwrite(&ent, sizeof(ent), 1, fp);
+        SHA1Update(&ctx, (const unsigned char *) &ent, sizeof(ent));
+    }
+    SHA1Final(sum, &ctx);
+    fwrite(sum, sizeof(sum), 1, fp);
+    if (safe_fclose(&fp) != 0) {
+        warning("can't write glyph profile '%s'.", ftprofile_path);
+        robust_unlink(ftprofile_path);
+    }
+}
+
+void ftfont_enable_profile(unsigned codepage)
+{
+    if (ftprofile_enabled) return;
+    if (!file_exists(FTFONT_CACHE_DIR) && !create_dir(FTFONT_CACHE_DIR)) {
+        warning("can't create glyph cache directory '%s'.", FTFONT_CACHE_DIR);
+        return;
+    }
+    snprintf(ftprofile_path, sizeof(ftprofile_path), "%s\\profile_cp%u.ftp", FTFONT_CACHE_DIR, codepage);
+    ftprofile_load();
+    ftprofile_enabled = 1;
+    add_atexit_hook(ftprofile_atexit);
+}
+
+const wchar_t *ftfont_get_profile(void)
+{
+    return ftprofile_str;
+}
+
+
+
 // font face has initialized
 // adjust size and quality
 static void ftfont_optimize_size_quality(struct ftfont *font)
 {
+    // distance field needs outlines at requested size
+    if (font->quality == FTFONT_SDF) return;
+    
     // dirty hack: disable bitmap font for MingLiU > 17px
     if (font->face->family_name && strstr(font->face->family_name, "MingLiU")) {
         if (font->size > 17 && font->quality != FTFONT_NOAA) {
@@ -103,6 +482,42 @@ static void ftfont_optimize_size_quality(struct ftfont *font)
     }
 }
 
+static int ftfont_hack_cmp(const void *a, const void *b)
+{
+    wchar_t ca = ((const struct ftfont_hack *) a)->c, cb = ((const struct ftfont_hack *) b)->c;
+    return ca < cb ? -1 : ca > cb;
+}
+
+// collect char hacks matching font name and size, first matching table wins
+//   so loading a char won't scan all hack tables
+static void ftfont_build_hack_index(struct ftfont *font)
+{
+    const char *fontname = font->face->family_name;
+    const struct ftcharhack **p;
+    const wchar_t *f;
+    int n = 0, i;
+    
+    // check font name and quality
+    if (!fontname) return;
+    if (font->quality == FTFONT_AA || font->quality == FTFONT_SDF) return;
+    
+    for (p = charhack; *p; p++) {
+        if (font->size == (*p)->size && strstr(fontname, (*p)->fontname)) n += wcslen((*p)->charmap);
+    }
+    if (n == 0) return;
+    font->hack = malloc(n * sizeof(struct ftfont_hack));
+    if (!font->hack) return;
+    for (p = charhack; *p; p++) {
+        if (font->size != (*p)->size || !strstr(fontname, (*p)->fontname)) continue;
+        for (f = (*p)->charmap; *f; f++) {
+            for (i = 0; i < font->nr_hacks && font->hack[i].c != *f; i++);
+            if (i < font->nr_hacks) continue;
+            font->hack[font->nr_hacks++] = (struct ftfont_hack) { .c = *f, .bitmap = &(*p)->bitmap[f - (*p)->charmap] };
+        }
+    }
+    qsort(font->hack, font->nr_hacks, sizeof(struct ftfont_hack), ftfont_hack_cmp);
+}
+
 struct ftfont *ftfont_create(const char *filename, int face_index, int req_size, int req_bold, int req_quality)
 {
     struct ftfont *ret = NULL;
@@ -139,7 +554,7 @@ struct ftfont *ftfont_create(const char *filename, int face_index, int req_size,
     ret->yshift = ret->size * face->descender / face->units_per_EM;
 
     // check if using bitmap font
-    if (ret->quality != FTFONT_AA) {
+    if (ret->quality != FTFONT_AA && ret->quality != FTFONT_SDF) {
         e = FT_Load_Char(face, FTFONT_BITMAP_TEST_CHAR, FT_LOAD_DEFAULT);
         if (!e) {
             if (face->glyph->format == FT_GLYPH_FORMAT_BITMAP) {
@@ -148,6 +563,15 @@ struct ftfont *ftfont_create(const char *filename, int face_index, int req_size,
         }
     }
     
+    ftfont_build_hack_index(ret);
+    InitializeCriticalSection(&ret->lock);
+    
+    // load cached chars
+    if (ftcache_enabled && ftcache_makekey(ret, filename, face_index, req_size, req_bold, req_quality)) {
+        ftcache_load(ret);
+        ret->next = ftcache_fonts;
+        ftcache_fonts = ret;
+    }
     return ret;
 fail:
     if (face) FT_Done_Face(face);
@@ -155,55 +579,74 @@ fail:
     return NULL;
 }
 
+// create a font drawing chars of base font at another size
+//   base font should be a distance field font, or chars will be blurred
+struct ftfont *ftfont_create_scaled(struct ftfont *base, int req_size)
+{
+    struct ftfont *ret;
+    if (!base || base->base || req_size <= 0) return NULL;
+    ret = malloc(sizeof(struct ftfont));
+    if (!ret) return NULL;
+    memset(ret, 0, sizeof(struct ftfont));
+    ret->face = base->face;
+    ret->size = req_size;
+    ret->bold = base->bold;
+    ret->quality = base->quality;
+    ret->base = base;
+    ret->scale = (double) req_size / base->size;
+    ret->yshift = req_size * base->face->descender / base->face->units_per_EM;
+    InitializeCriticalSection(&ret->lock);
+    return ret;
+}
+
+// limit texture memory of a font, should be called before any char is drawn
+void ftfont_set_texbudget(struct ftfont *font, int kbytes)
+{
+    if (font->base) font = font->base;
+    font->texbudget = imax(kbytes, 0) * 1024;
+}
+
 
 static struct ftchar *ftfont_charhack(struct ftfont *font, wchar_t c)
 {
     struct ftchar *ret = NULL;
     
-    // get font name
-    const char *fontname = font->face->family_name;
-    if (!fontname) goto fail;
-    
-    // check quality
-    if (font->quality == FTFONT_AA) goto fail;
-    
     // lookup for hacks
-    const struct ftcharhack **p;
-    for (p = charhack; *p; p++) {
-        const wchar_t *f;
-        if (font->size == (*p)->size && strstr(fontname, (*p)->fontname) && (f = wcschr((*p)->charmap, c))) {
-            const struct ftcharhack_bitmap *bitmap = &(*p)->bitmap[f - (*p)->charmap];
-            assert((int) strlen(bitmap->data) == bitmap->w * bitmap->h);
-            int should_embolden = font->bold >= FTFONT_BITMAP_BOLD_LIMIT;
-            ret = malloc(sizeof(struct ftchar) + (bitmap->w + should_embolden) * bitmap->h);
-            if (!ret) goto fail;
-            ret->tex = NULL;
-            ret->u = ret->v = 0;
-            ret->w = bitmap->w + should_embolden;
-            ret->h = bitmap->h;
-            ret->l = 0;
-            ret->t = bitmap->h + bitmap->yshift;
-            ret->adv = bitmap->w;
-            const char *src = bitmap->data;
-            unsigned char *dst = ret->bitmap;
-            if (should_embolden) {
-                int i, j;
-                for (i = 0; i < bitmap->h; i++) {
-                    unsigned char *dst_line = dst;
-                    *dst++ = 0;
-                    for (j = 0; j < bitmap->w; j++) {
-                        *dst++ = *src++ == '1' ? 0xFF : 0;
-                    }
-                    for (j = 0; j < bitmap->w; j++) {
-                        *dst_line |= *(dst_line + 1);
-                        dst_line++;
-                    }
-                }
-            } else {
-                while (*src) *dst++ = *src++ == '1' ? 0xFF : 0;
+    struct ftfont_hack key = { .c = c }, *hack;
+    if (font->nr_hacks == 0) goto fail;
+    hack = bsearch(&key, font->hack, font->nr_hacks, sizeof(struct ftfont_hack), ftfont_hack_cmp);
+    if (!hack) goto fail;
+    
+    const struct ftcharhack_bitmap *bitmap = hack->bitmap;
+    assert((int) strlen(bitmap->data) == bitmap->w * bitmap->h);
+    int should_embolden = font->bold >= FTFONT_BITMAP_BOLD_LIMIT;
+    ret = malloc(sizeof(struct ftchar) + (bitmap->w + should_embolden) * bitmap->h);
+    if (!ret) goto fail;
+    ret->tex = NULL;
+    ret->freed = 0;
+    ret->u = ret->v = 0;
+    ret->w = bitmap->w + should_embolden;
+    ret->h = bitmap->h;
+    ret->l = 0;
+    ret->t = bitmap->h + bitmap->yshift;
+    ret->adv = bitmap->w;
+    const char *src = bitmap->data;
+    unsigned char *dst = ret->bitmap;
+    if (should_embolden) {
+        int i, j;
+        for (i = 0; i < bitmap->h; i++) {
+            unsigned char *dst_line = dst;
+            *dst++ = 0;
+            for (j = 0; j < bitmap->w; j++) {
+                *dst++ = *src++ == '1' ? 0xFF : 0;
+            }
+            for (j = 0; j < bitmap->w; j++) {
+                *dst_line |= *(dst_line + 1);
+                dst_line++;
             }
-            break;
         }
+    } else {
+        while (*src) *dst++ = *src++ == '1' ? 0xFF : 0;
     }
     
     return ret;
@@ -213,6 +656,109 @@ fail:
 }
 
 
+// squared euclidean distance transform in 1D (Felzenszwalb & Huttenlocher)
+//   f and d may not be the same, v and z are temp buffers of n and n + 1
+static void ftfont_edt1d(const double *f, double *d, int n, int stride, int *v, double *z)
+{
+    int k = 0, q;
+    v[0] = 0;
+    z[0] = -1e20;
+    z[1] = 1e20;
+    for (q = 1; q < n; q++) {
+        double s;
+        while (1) {
+            int p = v[k];
+            s = ((f[q * stride] + q * q) - (f[p * stride] + p * p)) / (2 * q - 2 * p);
+            if (s > z[k]) break;
+            k--;
+        }
+        k++;
+        v[k] = q;
+        z[k] = s;
+        z[k + 1] = 1e20;
+    }
+    for (k = 0, q = 0; q < n; q++) {
+        while (z[k + 1] < q) k++;
+        d[q] = (q - v[k]) * (q - v[k]) + f[v[k] * stride];
+    }
+}
+
+static void ftfont_edt2d(double *g, int w, int h, double *tmp, int *v, double *z)
+{
+    int x, y;
+    for (x = 0; x < w; x++) {
+        ftfont_edt1d(g + x, tmp, h, w, v, z);
+        for (y = 0; y < h; y++) g[y * w + x] = tmp[y];
+    }
+    for (y = 0; y < h; y++) {
+        ftfont_edt1d(g + y * w, tmp, w, 1, v, z);
+        memcpy(g + y * w, tmp, w * sizeof(double));
+    }
+}
+
+// make a distance field char from a coverage char
+//   the field is padded by FTFONT_SDF_SPREAD pixels, 0x80 is the edge,
+//   one unit is 1 / (2 * FTFONT_SDF_SPREAD) pixel, outside is lower
+//   edge pixels are placed by coverage, see mapbox's tiny-sdf
+static struct ftchar *ftfont_make_sdf(const struct ftchar *src)
+{
+    const int r = FTFONT_SDF_SPREAD;
+    int w = src->w + 2 * r, h = src->h + 2 * r, n = imax(w, h);
+    int x, y;
+    struct ftchar *ch = malloc(sizeof(struct ftchar) + w * h);
+    double *outer = malloc(sizeof(double) * w * h);
+    double *inner = malloc(sizeof(double) * w * h);
+    double *tmp = malloc(sizeof(double) * n);
+    double *z = malloc(sizeof(double) * (n + 1));
+    int *v = malloc(sizeof(int) * n);
+    if (!ch || !outer || !inner || !tmp || !z || !v) {
+        free(ch);
+        ch = NULL;
+        goto done;
+    }
+    
+    for (y = 0; y < h; y++) {
+        for (x = 0; x < w; x++) {
+            int sx = x - r, sy = y - r;
+            double a = sx >= 0 && sx < src->w && sy >= 0 && sy < src->h ? src->bitmap[sy * src->w + sx] / 255.0 : 0.0;
+            int i = y * w + x;
+            if (a >= 1.0) {
+                outer[i] = 0;
+                inner[i] = 1e20;
+            } else if (a <= 0.0) {
+                outer[i] = 1e20;
+                inner[i] = 0;
+            } else {
+                double d = 0.5 - a;
+                outer[i] = d > 0 ? d * d : 0;
+                inner[i] = d < 0 ? d * d : 0;
+            }
+        }
+    }
+    ftfont_edt2d(outer, w, h, tmp, v, z);
+    ftfont_edt2d(inner, w, h, tmp, v, z);
+    for (x = 0; x < w * h; x++) {
+        double d = sqrt(outer[x]) - sqrt(inner[x]);
+        ch->bitmap[x] = fmin(fmax(round(255 * (0.5 - d / (2 * r))), 0), 255);
+    }
+    
+    ch->tex = NULL;
+    ch->freed = 0;
+    ch->u = ch->v = 0;
+    ch->w = w;
+    ch->h = h;
+    ch->l = src->l - r;
+    ch->t = src->t + r;
+    ch->adv = src->adv;
+done:
+    free(outer);
+    free(inner);
+    free(tmp);
+    free(z);
+    free(v);
+    return ch;
+}
+
 static void ftfont_loadchar(struct ftfont *font, wchar_t c)
 {
     FT_GlyphSlot slot = font->face->glyph;
@@ -220,23 +766,27 @@ static void ftfont_loadchar(struct ftfont *font, wchar_t c)
     struct ftchar *ch = NULL;
     int w, bw;
     int h, bh;
-    int i, j;
+    int i;
     int should_embolden_bitmap = 0;
     FT_Int32 load_flags = FT_LOAD_DEFAULT;
     FT_Render_Mode render_mode = FT_RENDER_MODE_NORMAL;
     FT_Bitmap bmp;
     
     // check if already loaded
-    if (font->ch[c]) return;
+    if (ftfont_getchar(font, c)) return;
     
     // check if there is a hack
-    font->ch[c] = ftfont_charhack(font, c);
-    if (font->ch[c]) return;
+    ch = ftfont_charhack(font, c);
+    if (ch) {
+        ftfont_setchar(font, c, ch);
+        return;
+    }
     
     // process quality setting
     switch (font->quality) {
         case FTFONT_NOAA: load_flags = FT_LOAD_TARGET_MONO; render_mode = FT_RENDER_MODE_MONO; break;
         case FTFONT_AA: load_flags = FT_LOAD_NO_BITMAP; break;
+        case FTFONT_SDF: load_flags = FT_LOAD_NO_BITMAP | FT_LOAD_NO_HINTING; break;
         case FTFONT_AUTO: break;
     }
     
@@ -290,12 +840,18 @@ static void ftfont_loadchar(struct ftfont *font, wchar_t c)
     
     // copy bitmap
     for (i = 0; i < bh; i++) {
-        for (j = 0; j < bw; j++) {
-            ch->bitmap[w * i + j] = bmp.buffer[bmp.pitch * i + j] * 255 / (bmp.num_grays - 1);
-        }
+        pixel_scale_gray(ch->bitmap + w * i, bmp.buffer + bmp.pitch * i, bw, bmp.num_grays);
+    }
+
+    // convert coverage to distance field
+    if (font->quality == FTFONT_SDF) {
+        struct ftchar *sdf = ftfont_make_sdf(ch);
+        free(ch);
+        ch = sdf;
+        if (!ch) goto bmpfail;
     }
 
-    font->ch[c] = ch;
+    ftfont_setchar(font, c, ch);
     ch = NULL;
 bmpfail:
     FT_Bitmap_Done(library, &bmp);
@@ -303,25 +859,179 @@ fail:
     free(ch);
 }
 
+static struct ftchar *ftfont_loadchar_locked(struct ftfont *font, wchar_t c)
+{
+    struct ftchar *ch;
+    EnterCriticalSection(&font->lock);
+    ftfont_loadchar(font, c);
+    ch = ftfont_getchar(font, c);
+    LeaveCriticalSection(&font->lock);
+    return ch;
+}
+
+
+
+// background preload
+//   preload requests are queued and rasterized by a worker thread,
+//   chars not ready yet will be loaded by render thread when drawing
+//   if the worker can't be started, chars are loaded synchronously
+
+static CRITICAL_SECTION preload_cs;
+static HANDLE preload_event;
+static struct ftpreload_job *preload_head, **preload_tail = &preload_head;
+static volatile LONG preload_state; // 0 = not started, 1 = starting, 2 = running, -1 = failed
+
+static void ftfont_preload_sync(struct ftpreload_job *job)
+{
+    if (job->str[0]) {
+        const wchar_t *p;
+        for (p = job->str; *p; p++) {
+            ftfont_loadchar_locked(job->font, *p);
+        }
+    } else {
+        unsigned c;
+        for (c = job->low; c <= job->high; c++) {
+            ftfont_loadchar_locked(job->font, c);
+        }
+    }
+}
+
+static DWORD WINAPI ftfont_preload_worker(LPVOID lpParameter)
+{
+    while (WaitForSingleObject(preload_event, INFINITE) == WAIT_OBJECT_0) {
+        while (1) {
+            EnterCriticalSection(&preload_cs);
+            struct ftpreload_job *job = preload_head;
+            if (job) {
+                preload_head = job->next;
+                if (!preload_head) preload_tail = &preload_head;
+            }
+            LeaveCriticalSection(&preload_cs);
+            if (!job) break;
+            ftfont_preload_sync(job);
+            free(job);
+        }
+    }
+    return 0;
+}
+
+static int ftfont_preload_start(void)
+{
+    // first caller starts the worker, others wait for it
+    if (InterlockedCompareExchange(&preload_state, 1, 0) == 0) {
+        InitializeCriticalSection(&preload_cs);
+        preload_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+        HANDLE hThread = preload_event ? CreateThread(NULL, 0, ftfont_preload_worker, NULL, 0, NULL) : NULL;
+        if (hThread) {
+            sched_set_thread(hThread, SCHED_BACKGROUND);
+            CloseHandle(hThread);
+            InterlockedExchange(&preload_state, 2);
+        } else {
+            warning("can't create font preload thread.");
+            InterlockedExchange(&preload_state, -1);
+        }
+    }
+    while (preload_state == 1) Sleep(0);
+    return preload_state > 0;
+}
+
+static void ftfont_preload_queue(struct ftpreload_job *job)
+{
+    if (!ftfont_preload_start()) {
+        ftfont_preload_sync(job);
+        free(job);
+        return;
+    }
+    job->next = NULL;
+    EnterCriticalSection(&preload_cs);
+    *preload_tail = job;
+    preload_tail = &job->next;
+    LeaveCriticalSection(&preload_cs);
+    SetEvent(preload_event);
+}
+
 void ftfont_preload_range(struct ftfont *font, wchar_t low, wchar_t high)
 {
-    wchar_t c;
-    for (c = low; c <= high; c++) {
-        ftfont_loadchar(font, c);
+    if (font->base) font = font->base;
+    if (font->texbudget) return; // chars are loaded lazily
+    
+    // split large ranges, so render thread won't wait long for a lock
+    unsigned c, end;
+    for (c = low; c <= high; c = end + 1) {
+        end = imin(c + FTFONT_PRELOAD_BATCH - 1, high);
+        struct ftpreload_job *job = malloc(sizeof(struct ftpreload_job) + sizeof(wchar_t));
+        if (!job) return;
+        job->font = font;
+        job->low = c;
+        job->high = end;
+        job->str[0] = 0;
+        ftfont_preload_queue(job);
     }
 }
 void ftfont_preload_string(struct ftfont *font, const wchar_t *wstr)
 {
+    if (font->base) font = font->base;
+    if (font->texbudget) return; // chars are loaded lazily
     while (*wstr) {
-        ftfont_preload_range(font, *wstr, *wstr);
-        wstr++;
+        size_t len = wcslen(wstr);
+        if (len > FTFONT_PRELOAD_BATCH) len = FTFONT_PRELOAD_BATCH;
+        struct ftpreload_job *job = malloc(sizeof(struct ftpreload_job) + (len + 1) * sizeof(wchar_t));
+        if (!job) return;
+        job->font = font;
+        job->low = job->high = 0;
+        memcpy(job->str, wstr, len * sizeof(wchar_t));
+        job->str[len] = 0;
+        ftfont_preload_queue(job);
+        wstr += len;
     }
 }
 
 
 
 
-static void ftfont_assign_texture(struct ftfont *font, wchar_t c)
+// evict all chars on a texture, they will be loaded again when needed
+static void ftfont_evict_texture(struct ftfont *font, struct fttexture *t)
+{
+    int i, j;
+    EnterCriticalSection(&font->lock);
+    for (i = 0; i < FTFONT_NRPAGES; i++) {
+        struct ftchar **page = font->page[i];
+        if (!page) continue;
+        for (j = 0; j < FTFONT_PAGESIZE; j++) {
+            if (page[j] && page[j]->tex == t) {
+                free(page[j]);
+                page[j] = NULL;
+                font->nr_chars--;
+            }
+        }
+    }
+    LeaveCriticalSection(&font->lock);
+}
+
+// find least recently drawn texture and make it current texture
+static struct fttexture *ftfont_recycle_texture(struct ftfont *font, ID3DXSprite *sprite)
+{
+    struct fttexture **p, **lru = NULL;
+    for (p = &font->texhead; *p; p = &(*p)->next) {
+        if (!lru || (*p)->last_use < (*lru)->last_use) lru = p;
+    }
+    if (!lru) return NULL;
+    
+    // queued draws may still use this texture
+    ftfont_batch_flush();
+    ID3DXSprite_Flush(sprite);
+    
+    struct fttexture *t = *lru;
+    *lru = t->next;
+    t->next = font->texhead;
+    font->texhead = t;
+    ftfont_evict_texture(font, t);
+    fill_texture(t->tex, 0x00FFFFFF);
+    ftlayout_clear(&font->texlayout, t->w, t->h, FTFONT_TEXTURE_MARGIN);
+    return t;
+}
+
+static struct ftchar *ftfont_assign_texture(struct ftfont *font, wchar_t c, ID3DXSprite *sprite)
 {
     struct fttexture *new_node = NULL;
     IDirect3DTexture9 *new_tex = NULL;
@@ -329,15 +1039,36 @@ static void ftfont_assign_texture(struct ftfont *font, wchar_t c)
     D3DLOCKED_RECT lrc;
     int r, u, v;
     
-    // load char first
-    ftfont_loadchar(font, c);
-    struct ftchar *ch = font->ch[c];
-    if (!ch) return;
-    if (ch->tex) return;
+    // load char first, if preload worker hasn't done it yet
+    struct ftchar *ch = ftfont_loadchar_locked(font, c);
+    if (!ch) return NULL;
+    if (ch->tex) return ch;
     
     // layout char
     r = ftlayout_addrect(&font->texlayout, ch->w, ch->h, &u, &v);
+    if (r <= 0 && font->texbudget && font->texhead && font->texbytes + font->texw * font->texh * 4 > font->texbudget) {
+        // over budget, reuse a texture instead
+        if (ftfont_recycle_texture(font, sprite)) {
+            // char may be evicted too, if it was on that texture
+            ch = ftfont_loadchar_locked(font, c);
+            if (!ch) return NULL;
+            r = ftlayout_addrect(&font->texlayout, ch->w, ch->h, &u, &v);
+        }
+    }
     if (r <= 0) {
+        // each new texture is twice as large as the last one, up to device limit
+        if (!font->texmaxw) {
+            D3DCAPS9 caps;
+            font->texmaxw = font->texmaxh = FTFONT_TEXTURE_MAXSIZE;
+            if (SUCCEEDED(IDirect3DDevice9_GetDeviceCaps(pd3dDevice, &caps))) {
+                font->texmaxw = imax(imin(font->texmaxw, caps.MaxTextureWidth), FTFONT_TEXTURE_MINSIZE);
+                font->texmaxh = imax(imin(font->texmaxh, caps.MaxTextureHeight), FTFONT_TEXTURE_MINSIZE);
+            }
+        }
+        if (font->texhead) {
+            if (font->texw < font->texmaxw) font->texw *= 2;
+            if (font->texh < font->texmaxh) font->texh *= 2;
+        }
         while (ch->w + 2 * FTFONT_TEXTURE_MARGIN > font->texw) font->texw *= 2;
         while (ch->h + 2 * FTFONT_TEXTURE_MARGIN > font->texh) font->texh *= 2;
 
@@ -345,14 +1076,20 @@ static void ftfont_assign_texture(struct ftfont *font, wchar_t c)
         if (!new_node) goto fail;
         memset(new_node, 0, sizeof(struct fttexture));
         
-        if (FAILED(IDirect3DDevice9_CreateTexture(pd3dDevice, font->texw, font->texh, 1, 0, D3DFMT_A8R8G8B8, D3DPOOL_MANAGED, &new_tex, NULL))) {
+        int old_category = vramstat_set_category(VRAM_GLYPH);
+        HRESULT hr = IDirect3DDevice9_CreateTexture(pd3dDevice, font->texw, font->texh, 1, 0, D3DFMT_A8R8G8B8, D3DPOOL_MANAGED, &new_tex, NULL);
+        vramstat_set_category(old_category);
+        if (FAILED(hr)) {
             new_tex = NULL;
             goto fail;
         }
         fill_texture(new_tex, 0x00FFFFFF);
         new_node->tex = new_tex;
+        new_node->w = font->texw;
+        new_node->h = font->texh;
         new_node->next = font->texhead;
         font->texhead = new_node;
+        font->texbytes += font->texw * font->texh * 4;
         ftlayout_clear(&font->texlayout, font->texw, font->texh, FTFONT_TEXTURE_MARGIN);
         r = ftlayout_addrect(&font->texlayout, ch->w, ch->h, &u, &v);
         assert(r > 0);
@@ -375,27 +1112,278 @@ static void ftfont_assign_texture(struct ftfont *font, wchar_t c)
         IDirect3DTexture9_UnlockRect(ch->tex->tex, 0);
     }
     
-    return;
+    // bitmap is not needed any more for bounded fonts
+    if (font->texbudget) {
+        EnterCriticalSection(&font->lock);
+        struct ftchar *shrinked = realloc(ch, sizeof(struct ftchar));
+        if (shrinked) {
+            ch = shrinked;
+            ch->freed = 1;
+            font->page[c >> FTFONT_PAGEBITS][c & (FTFONT_PAGESIZE - 1)] = ch;
+        }
+        LeaveCriticalSection(&font->lock);
+    }
+    
+    return ch;
 fail:
     free(new_node);
     if (new_tex) IDirect3DTexture9_Release(new_tex);
+    return ch;
+}
+
+
+
+// glyph batching
+//   between ftfont_batch_begin() and ftfont_batch_end(), glyphs drawn to
+//   the batching sprite are collected, and submitted sorted by texture,
+//   so ID3DXSprite can merge them into a few draw calls
+//   draw order is kept for overlapping glyphs: each glyph gets a layer
+//   above all earlier glyphs it may overlap with different texture,
+//   and quads are sorted by (layer, texture, original order)
+//   overlap is tested on a hashed grid, collisions only add extra layers
+
+// distance field drawing
+//   alpha is remapped by a ps_2_0 shader, so edge is always about one pixel wide:
+//     a = saturate((alpha - 0.5) * k + 0.5), k = 2 * FTFONT_SDF_SPREAD * scale
+//   without pixel shader support, alpha test at the edge is used instead
+
+static IDirect3DPixelShader9 *sdf_shader;
+static int sdf_shader_tried;
+static DWORD sdf_saved_minfilter, sdf_saved_magfilter;
+static DWORD sdf_saved_alphatest, sdf_saved_alpharef, sdf_saved_alphafunc;
+
+static const DWORD sdf_shader_code[] = {
+    0xFFFF0200,                                     // ps_2_0
+    0x0200001F, 0x80000000, 0xB0030000,             // dcl t0.xy
+    0x0200001F, 0x80000000, 0x900F0000,             // dcl v0
+    0x0200001F, 0x90000000, 0xA00F0800,             // dcl_2d s0
+    0x03000042, 0x800F0000, 0xB0E40000, 0xA0E40800, // texld r0, t0, s0
+    0x04000004, 0x80180000, 0x80FF0000, 0xA0000000, 0xA0550000, // mad_sat r0.w, r0.w, c0.x, c0.y
+    0x03000005, 0x800F0000, 0x80E40000, 0x90E40000, // mul r0, r0, v0
+    0x02000001, 0x800F0800, 0x80E40000,             // mov oC0, r0
+    0x0000FFFF,                                     // end
+};
+
+static float ftfont_sdf_sharpness(struct ftfont *font, float scale)
+{
+    return font->quality == FTFONT_SDF ? 2 * FTFONT_SDF_SPREAD * scale : 0.0f;
+}
+
+static void ftfont_sdf_update(float k)
+{
+    if (sdf_shader) {
+        float c[4] = { k, 0.5f - 0.5f * k, 0.0f, 0.0f };
+        IDirect3DDevice9_SetPixelShaderConstantF(pd3dDevice, 0, c, 1);
+    }
+}
+
+static void ftfont_sdf_begin(float k)
+{
+    if (!sdf_shader_tried) {
+        D3DCAPS9 caps;
+        sdf_shader_tried = 1;
+        if (SUCCEEDED(IDirect3DDevice9_GetDeviceCaps(pd3dDevice, &caps)) && caps.PixelShaderVersion >= D3DPS_VERSION(2, 0)) {
+            if (FAILED(IDirect3DDevice9_CreatePixelShader(pd3dDevice, sdf_shader_code, &sdf_shader))) sdf_shader = NULL;
+        }
+        if (!sdf_shader) warning("can't create distance field pixel shader, fallback to alpha test.");
+    }
+    IDirect3DDevice9_GetSamplerState(pd3dDevice, 0, D3DSAMP_MINFILTER, &sdf_saved_minfilter);
+    IDirect3DDevice9_GetSamplerState(pd3dDevice, 0, D3DSAMP_MAGFILTER, &sdf_saved_magfilter);
+    IDirect3DDevice9_SetSamplerState(pd3dDevice, 0, D3DSAMP_MINFILTER, D3DTEXF_LINEAR);
+    IDirect3DDevice9_SetSamplerState(pd3dDevice, 0, D3DSAMP_MAGFILTER, D3DTEXF_LINEAR);
+    if (sdf_shader) {
+        IDirect3DDevice9_SetPixelShader(pd3dDevice, sdf_shader);
+        ftfont_sdf_update(k);
+    } else {
+        IDirect3DDevice9_GetRenderState(pd3dDevice, D3DRS_ALPHATESTENABLE, &sdf_saved_alphatest);
+        IDirect3DDevice9_GetRenderState(pd3dDevice, D3DRS_ALPHAREF, &sdf_saved_alpharef);
+        IDirect3DDevice9_GetRenderState(pd3dDevice, D3DRS_ALPHAFUNC, &sdf_saved_alphafunc);
+        IDirect3DDevice9_SetRenderState(pd3dDevice, D3DRS_ALPHATESTENABLE, TRUE);
+        IDirect3DDevice9_SetRenderState(pd3dDevice, D3DRS_ALPHAREF, 0x80);
+        IDirect3DDevice9_SetRenderState(pd3dDevice, D3DRS_ALPHAFUNC, D3DCMP_GREATEREQUAL);
+    }
+}
+
+static void ftfont_sdf_end(void)
+{
+    IDirect3DDevice9_SetSamplerState(pd3dDevice, 0, D3DSAMP_MINFILTER, sdf_saved_minfilter);
+    IDirect3DDevice9_SetSamplerState(pd3dDevice, 0, D3DSAMP_MAGFILTER, sdf_saved_magfilter);
+    if (sdf_shader) {
+        IDirect3DDevice9_SetPixelShader(pd3dDevice, NULL);
+    } else {
+        IDirect3DDevice9_SetRenderState(pd3dDevice, D3DRS_ALPHATESTENABLE, sdf_saved_alphatest);
+        IDirect3DDevice9_SetRenderState(pd3dDevice, D3DRS_ALPHAREF, sdf_saved_alpharef);
+        IDirect3DDevice9_SetRenderState(pd3dDevice, D3DRS_ALPHAFUNC, sdf_saved_alphafunc);
+    }
+}
+
+// draw a quad scaled around its top-left corner, base is current sprite transform
+static void ftfont_sprite_draw(ID3DXSprite *sprite, IDirect3DTexture9 *tex, const RECT *rc, const D3DXVECTOR3 *pos, D3DCOLOR color, float scale, const D3DXMATRIX *base)
+{
+    if (scale == 1.0f) {
+        ID3DXSprite_Draw(sprite, tex, rc, NULL, pos, color);
+        return;
+    }
+    
+    // m = scale * translate * base
+    D3DXMATRIX m;
+    int j;
+    for (j = 0; j < 4; j++) {
+        m.m[0][j] = scale * base->m[0][j];
+        m.m[1][j] = scale * base->m[1][j];
+        m.m[2][j] = base->m[2][j];
+        m.m[3][j] = pos->x * base->m[0][j] + pos->y * base->m[1][j] + pos->z * base->m[2][j] + base->m[3][j];
+    }
+    ID3DXSprite_SetTransform(sprite, &m);
+    ID3DXSprite_Draw(sprite, tex, rc, NULL, NULL, color);
+    ID3DXSprite_SetTransform(sprite, base);
+}
+
+
+
+static ID3DXSprite *batch_sprite;
+static struct ftbatch_quad *batch_quads;
+static int batch_count;
+static struct ftbatch_cell batch_cells[FTFONT_BATCH_NRCELLS];
+static unsigned batch_gen;
+
+static struct ftbatch_cell *ftfont_batch_cell(int cx, int cy)
+{
+    struct ftbatch_cell *cell = &batch_cells[((unsigned) cx * 73856093u ^ (unsigned) cy * 19349663u) & (FTFONT_BATCH_NRCELLS - 1)];
+    if (cell->gen != batch_gen) {
+        cell->gen = batch_gen;
+        cell->layer = -1;
+        cell->tex = NULL;
+        cell->sdf = 0.0f;
+    }
+    return cell;
+}
+
+static void ftfont_batch_add(IDirect3DTexture9 *tex, const RECT *rc, const D3DXVECTOR3 *pos, D3DCOLOR color, float scale, float sdf)
+{
+    if ((batch_count & (batch_count - 1)) == 0) {
+        struct ftbatch_quad *q = realloc(batch_quads, imax(batch_count * 2, 256) * sizeof(struct ftbatch_quad));
+        if (!q) return;
+        batch_quads = q;
+    }
+    
+    int x0 = floor(pos->x), y0 = floor(pos->y);
+    int cx0 = x0 >> FTFONT_BATCH_CELLBITS, cx1 = (int) ceil(pos->x + (rc->right - rc->left) * scale) >> FTFONT_BATCH_CELLBITS;
+    int cy0 = y0 >> FTFONT_BATCH_CELLBITS, cy1 = (int) ceil(pos->y + (rc->bottom - rc->top) * scale) >> FTFONT_BATCH_CELLBITS;
+    int cx, cy;
+    
+    // find layer, quads with same texture and same sdf sharpness can share a layer
+    int layer = 0;
+    for (cy = cy0; cy <= cy1; cy++) {
+        for (cx = cx0; cx <= cx1; cx++) {
+            struct ftbatch_cell *cell = ftfont_batch_cell(cx, cy);
+            if (cell->layer >= 0) layer = imax(layer, cell->tex == tex && cell->sdf == sdf ? cell->layer : cell->layer + 1);
+        }
+    }
+    
+    // update cells
+    for (cy = cy0; cy <= cy1; cy++) {
+        for (cx = cx0; cx <= cx1; cx++) {
+            struct ftbatch_cell *cell = ftfont_batch_cell(cx, cy);
+            if (layer > cell->layer) {
+                cell->layer = layer;
+                cell->tex = tex;
+                cell->sdf = sdf;
+            } else if (cell->tex != tex || cell->sdf != sdf) {
+                cell->tex = NULL;
+            }
+        }
+    }
+    
+    batch_quads[batch_count] = (struct ftbatch_quad) {
+        .tex = tex,
+        .rc = *rc,
+        .pos = *pos,
+        .color = color,
+        .scale = scale,
+        .sdf = sdf,
+        .layer = layer,
+        .seq = batch_count,
+    };
+    batch_count++;
+}
+
+static int ftbatch_quad_cmp(const void *a, const void *b)
+{
+    const struct ftbatch_quad *x = a, *y = b;
+    if (x->layer != y->layer) return x->layer < y->layer ? -1 : 1;
+    if (x->tex != y->tex) return TOUINT(x->tex) < TOUINT(y->tex) ? -1 : 1;
+    if (x->sdf != y->sdf) return x->sdf < y->sdf ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
 }
 
-static int ftfont_draw_char(struct ftfont *font, wchar_t c, int left, int top, D3DCOLOR color, ID3DXSprite *sprite)
+void ftfont_batch_flush(void)
 {
+    if (!batch_sprite || !batch_count) return;
+    qsort(batch_quads, batch_count, sizeof(struct ftbatch_quad), ftbatch_quad_cmp);
+    D3DXMATRIX base;
+    ID3DXSprite_GetTransform(batch_sprite, &base);
+    float cur_sdf = 0.0f;
+    int i;
+    for (i = 0; i < batch_count; i++) {
+        struct ftbatch_quad *q = &batch_quads[i];
+        if (q->sdf != cur_sdf) {
+            // distance field quads need different states, flush sprite first
+            ID3DXSprite_Flush(batch_sprite);
+            if (cur_sdf == 0.0f) {
+                ftfont_sdf_begin(q->sdf);
+            } else if (q->sdf == 0.0f) {
+                ftfont_sdf_end();
+            } else {
+                ftfont_sdf_update(q->sdf);
+            }
+            cur_sdf = q->sdf;
+        }
+        ftfont_sprite_draw(batch_sprite, q->tex, &q->rc, &q->pos, q->color, q->scale, &base);
+    }
+    if (cur_sdf != 0.0f) {
+        ID3DXSprite_Flush(batch_sprite);
+        ftfont_sdf_end();
+    }
+    batch_count = 0;
+    batch_gen++;
+}
+
+void ftfont_batch_begin(ID3DXSprite *sprite)
+{
+    ftfont_batch_flush();
+    batch_sprite = sprite;
+    batch_count = 0;
+    batch_gen++;
+}
+
+void ftfont_batch_end(void)
+{
+    ftfont_batch_flush();
+    batch_sprite = NULL;
+}
+
+static int ftfont_draw_char(struct ftfont *font, wchar_t c, int left, int top, D3DCOLOR color, ID3DXSprite *sprite, const D3DXMATRIX *base)
+{
+    // scaled font draws chars of its base font
+    struct ftfont *src = font->base ? font->base : font;
+    float scale = font->base ? font->scale : 1.0f;
     int adv = font->size;
-    ftfont_assign_texture(font, c);
-    struct ftchar *ch = font->ch[c];
+    struct ftchar *ch = ftfont_assign_texture(src, c, sprite);
+    if (ftprofile_enabled) ftprofile_used[c >> 3] |= 1 << (c & 7);
     top += font->size + font->yshift;
     left += font->xshift;
     if (ch && ch->tex) {
-        adv = ch->adv;
+        ch->tex->last_use = src->drawclock;
+        adv = round(ch->adv * scale);
         RECT rc;
         set_rect_ltwh(&rc, ch->u, ch->v, ch->w, ch->h);
-        left += ch->l;
-        top -= ch->t;
-        D3DXVECTOR3 pos = { left, top, 0.0f };
-        ID3DXSprite_Draw(sprite, ch->tex->tex, &rc, NULL, &pos, color);
+        D3DXVECTOR3 pos = { left + ch->l * scale, top - ch->t * scale, 0.0f };
+        if (sprite == batch_sprite) {
+            ftfont_batch_add(ch->tex->tex, &rc, &pos, color, scale, ftfont_sdf_sharpness(src, scale));
+        } else {
+            ftfont_sprite_draw(sprite, ch->tex->tex, &rc, &pos, color, scale, base);
+        }
     }
     return adv;
 }
@@ -403,12 +1391,28 @@ static int ftfont_draw_char(struct ftfont *font, wchar_t c, int left, int top, D
 void ftfont_draw(struct ftfont *font, const wchar_t *wstr, int left, int top, D3DCOLOR color, ID3DXSprite *sprite)
 {
     int nleft;
+    D3DXMATRIX base;
+    float sdf = 0.0f;
+    (font->base ? font->base : font)->drawclock++;
+    if (sprite != batch_sprite) {
+        // not batching, set states for distance field here
+        ID3DXSprite_GetTransform(sprite, &base);
+        sdf = ftfont_sdf_sharpness(font->base ? font->base : font, font->base ? font->scale : 1.0f);
+        if (sdf != 0.0f) {
+            ID3DXSprite_Flush(sprite);
+            ftfont_sdf_begin(sdf);
+        }
+    }
     for (nleft = left; *wstr; wstr++) {
         if (*wstr == '\n') {
             nleft = left;
             top += font->size * font->face->height / font->face->units_per_EM;
         } else if (*wstr != '\r') {
-            nleft += ftfont_draw_char(font, *wstr, nleft, top, color, sprite);
+            nleft += ftfont_draw_char(font, *wstr, nleft, top, color, sprite, &base);
         }
     }
+    if (sdf != 0.0f) {
+        ID3DXSprite_Flush(sprite);
+        ftfont_sdf_end();
+    }
 }
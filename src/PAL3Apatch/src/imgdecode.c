@@ -0,0 +1,722 @@
+#include "common.h"
+#include <emmintrin.h>
+
+// patch-side image decoders
+//   baseline JPEG: huffman coded, 8-bit, grayscale or YCbCr, luma sampling up to 2x2,
+//     chroma is upsampled by replication, IDCT and color conversion have SSE2 versions,
+//     which give exactly the same result as scalar versions
+//   BMP: uncompressed 24-bit or 8-bit paletted
+//   TGA: uncompressed or RLE, 24-bit or 32-bit
+
+#define IMGDEC_MAXSIZE 16384
+
+
+
+// JPEG
+
+#define JPEG_FAST_BITS 9
+
+struct jpeg_huff {
+    unsigned short fast[1 << JPEG_FAST_BITS]; // symbol index by next JPEG_FAST_BITS bits, 0xFFFF if code is longer
+    short fastac[1 << JPEG_FAST_BITS]; // AC only, value << 8 | run << 4 | bits, 0 if code and value are longer
+    unsigned short code[256];
+    unsigned char values[256];
+    unsigned char size[257];
+    unsigned maxcode[18];
+    int delta[17]; // symbol index - code, for codes of each length
+    int valid;
+};
+
+struct jpeg_comp {
+    int id;
+    int h, v;
+    int tq, td, ta;
+    int dcpred;
+    unsigned char *plane;
+    int stride;
+};
+
+struct jpeg_dec {
+    const unsigned char *p, *end;
+    unsigned bitbuf; // MSB aligned
+    int bits;
+    int marker; // non-zero if a marker is reached in entropy coded data
+    struct jpeg_huff huff[2][4]; // dc, ac
+    unsigned short qt[4][64]; // in zigzag order
+    int qtvalid[4];
+    int width, height;
+    int ncomp;
+    struct jpeg_comp comp[3];
+    int hmax, vmax;
+    int restart;
+    int adobe_rgb;
+};
+
+static const unsigned char jpeg_zigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10,
+    17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+static int jpeg_u16(const unsigned char *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+static int jpeg_clamp16(int x)
+{
+    return imin(imax(x, -32768), 32767);
+}
+
+static int jpeg_build_huff(struct jpeg_huff *h, const unsigned char *counts)
+{
+    int i, j, k = 0, code = 0;
+    for (i = 0; i < 16; i++) {
+        for (j = 0; j < counts[i]; j++) {
+            if (k >= 256) return 0;
+            h->size[k++] = i + 1;
+        }
+    }
+    h->size[k] = 0;
+    for (j = 1, k = 0; j <= 16; j++) {
+        h->delta[j] = k - code;
+        while (h->size[k] == j) h->code[k++] = code++;
+        if (code > (1 << j)) return 0;
+        h->maxcode[j] = code << (16 - j);
+        code <<= 1;
+    }
+    h->maxcode[17] = 0xFFFFFFFF;
+    for (i = 0; i < (1 << JPEG_FAST_BITS); i++) h->fast[i] = 0xFFFF;
+    for (i = 0; i < k; i++) {
+        if (h->size[i] <= JPEG_FAST_BITS) {
+            int first = h->code[i] << (JPEG_FAST_BITS - h->size[i]);
+            for (j = 0; j < (1 << (JPEG_FAST_BITS - h->size[i])); j++) h->fast[first + j] = i;
+        }
+    }
+    h->valid = 1;
+    return 1;
+}
+
+// combine code and value of short AC codes, must be called after values are set
+static void jpeg_build_fastac(struct jpeg_huff *h)
+{
+    int i;
+    for (i = 0; i < (1 << JPEG_FAST_BITS); i++) {
+        int k = h->fast[i];
+        h->fastac[i] = 0;
+        if (k == 0xFFFF) continue;
+        int rs = h->values[k], run = rs >> 4, s = rs & 15, len = h->size[k];
+        if (!s || len + s > JPEG_FAST_BITS) continue;
+        int v = (i << len) & ((1 << JPEG_FAST_BITS) - 1); // bits after code
+        v >>= JPEG_FAST_BITS - s;
+        if (v < (1 << (s - 1))) v += 1 - (1 << s);
+        if (v >= -128 && v <= 127) h->fastac[i] = v * 256 + run * 16 + len + s;
+    }
+}
+
+// make sure at least 25 bits are in buffer, zeros are fed after a marker
+static void jpeg_fill(struct jpeg_dec *d)
+{
+    while (d->bits <= 24) {
+        unsigned c = 0;
+        if (!d->marker && d->p < d->end) {
+            c = *d->p++;
+            if (c == 0xFF) {
+                if (d->p < d->end && *d->p == 0) {
+                    d->p++; // stuffed zero
+                } else {
+                    d->marker = 1;
+                    d->p--;
+                    c = 0;
+                }
+            }
+        }
+        d->bitbuf |= c << (24 - d->bits);
+        d->bits += 8;
+    }
+}
+
+static int jpeg_huffdecode(struct jpeg_dec *d, const struct jpeg_huff *h)
+{
+    int k;
+    unsigned c;
+    if (d->bits < 16) jpeg_fill(d);
+    k = h->fast[d->bitbuf >> (32 - JPEG_FAST_BITS)];
+    if (k != 0xFFFF) {
+        d->bitbuf <<= h->size[k];
+        d->bits -= h->size[k];
+        return h->values[k];
+    }
+    for (k = JPEG_FAST_BITS + 1; (d->bitbuf >> 16) >= h->maxcode[k]; k++);
+    if (k > 16) return -1;
+    c = (d->bitbuf >> (32 - k)) + h->delta[k];
+    if (c >= 256 || h->size[c] != k) return -1;
+    d->bitbuf <<= k;
+    d->bits -= k;
+    return h->values[c];
+}
+
+// read n bits (1 <= n <= 16) and extend sign
+static int jpeg_receive(struct jpeg_dec *d, int n)
+{
+    unsigned v;
+    if (d->bits < n) jpeg_fill(d);
+    v = d->bitbuf >> (32 - n);
+    d->bitbuf <<= n;
+    d->bits -= n;
+    return v < (1u << (n - 1)) ? (int) v - (1 << n) + 1 : (int) v;
+}
+
+// decode a block to natural order dequantized coefficients
+// returns 1 if block has AC coefficients, 0 if DC only, -1 if failed
+static int jpeg_block(struct jpeg_dec *d, short *coef, struct jpeg_comp *c)
+{
+    const struct jpeg_huff *hac = &d->huff[1][c->ta];
+    const unsigned short *q = d->qt[c->tq];
+    int t, k, ac = 0;
+
+    memset(coef, 0, 64 * sizeof(short));
+    t = jpeg_huffdecode(d, &d->huff[0][c->td]);
+    if (t < 0 || t > 16) return -1;
+    if (t) c->dcpred = jpeg_clamp16(c->dcpred + jpeg_receive(d, t));
+    coef[0] = jpeg_clamp16(c->dcpred * q[0]);
+    for (k = 1; k < 64; k++) {
+        if (d->bits < 16) jpeg_fill(d);
+        int fast = hac->fastac[d->bitbuf >> (32 - JPEG_FAST_BITS)];
+        if (fast) {
+            k += (fast >> 4) & 15;
+            d->bitbuf <<= fast & 15;
+            d->bits -= fast & 15;
+            coef[jpeg_zigzag[k]] = jpeg_clamp16((fast >> 8) * q[k]);
+            ac = 1;
+            continue;
+        }
+        int rs = jpeg_huffdecode(d, hac);
+        if (rs < 0) return -1;
+        if (!(rs & 15)) {
+            if (rs != 0xF0) break; // EOB
+            k += 15; // ZRL
+            continue;
+        }
+        k += rs >> 4;
+        if (k > 63) return -1;
+        coef[jpeg_zigzag[k]] = jpeg_clamp16(jpeg_receive(d, rs & 15) * q[k]);
+        ac = 1;
+    }
+    return ac;
+}
+
+// IDCT
+//   separable integer IDCT, constants are scaled by 4096, as in jidctint.c
+//   rotation constants are combined per input, so each output is a sum of products,
+//   which is done by _mm_madd_epi16() in SSE2 version
+//   first pass keeps 2 extra bits, and is saturated to 16-bit
+
+#define JPEG_PASS1_BIAS 512
+#define JPEG_PASS1_SHIFT 10
+#define JPEG_PASS2_BIAS (65536 + (128 << 17))
+#define JPEG_PASS2_SHIFT 17
+
+#define JPEG_IDCT_1D(s0, s1, s2, s3, s4, s5, s6, s7, bias, shift, out0, out1, out2, out3, out4, out5, out6, out7) do { \
+    int t2 = (s2) * 2217 + (s6) * -5350; \
+    int t3 = (s2) * 5352 + (s6) * 2217; \
+    int t0 = ((s0) + (s4)) * 4096 + (bias); \
+    int t1 = ((s0) - (s4)) * 4096 + (bias); \
+    int x0 = t0 + t3, x3 = t0 - t3, x1 = t1 + t2, x2 = t1 - t2; \
+    int o3 = (s1) * 5683 + (s3) * 4816 + (s5) * 3219 + (s7) * 1131; \
+    int o2 = (s1) * 4816 + (s3) * -1129 + (s5) * -5681 + (s7) * -3218; \
+    int o1 = (s1) * 3219 + (s3) * -5681 + (s5) * 1132 + (s7) * 4816; \
+    int o0 = (s1) * 1131 + (s3) * -3218 + (s5) * 4816 + (s7) * -5680; \
+    out0 = (x0 + o3) >> (shift); out7 = (x0 - o3) >> (shift); \
+    out1 = (x1 + o2) >> (shift); out6 = (x1 - o2) >> (shift); \
+    out2 = (x2 + o1) >> (shift); out5 = (x2 - o1) >> (shift); \
+    out3 = (x3 + o0) >> (shift); out4 = (x3 - o0) >> (shift); \
+} while (0)
+
+static void jpeg_idct_scalar(unsigned char *out, int stride, const short *coef)
+{
+    short v[64];
+    int i, k, o[8];
+    for (i = 0; i < 8; i++) {
+        const short *s = coef + i;
+        JPEG_IDCT_1D(s[0], s[8], s[16], s[24], s[32], s[40], s[48], s[56], JPEG_PASS1_BIAS, JPEG_PASS1_SHIFT, o[0], o[1], o[2], o[3], o[4], o[5], o[6], o[7]);
+        for (k = 0; k < 8; k++) v[k * 8 + i] = jpeg_clamp16(o[k]);
+    }
+    for (i = 0; i < 8; i++, out += stride) {
+        const short *s = v + i * 8;
+        JPEG_IDCT_1D(s[0], s[1], s[2], s[3], s[4], s[5], s[6], s[7], JPEG_PASS2_BIAS, JPEG_PASS2_SHIFT, o[0], o[1], o[2], o[3], o[4], o[5], o[6], o[7]);
+        for (k = 0; k < 8; k++) out[k] = imin(imax(o[k], 0), 255);
+    }
+}
+
+// DC only block, same result as full IDCT
+static void jpeg_idct_dc(unsigned char *out, int stride, int dc)
+{
+    int v = jpeg_clamp16((dc * 4096 + JPEG_PASS1_BIAS) >> JPEG_PASS1_SHIFT);
+    int x = imin(imax((v * 4096 + JPEG_PASS2_BIAS) >> JPEG_PASS2_SHIFT, 0), 255);
+    int i;
+    for (i = 0; i < 8; i++, out += stride) memset(out, x, 8);
+}
+
+#define JPEG_PAIR(a, b) _mm_set_epi16((b), (a), (b), (a), (b), (a), (b), (a))
+
+static SSE2_FUNC void jpeg_idct_1d_sse2(__m128i *r, __m128i bias, __m128i shift)
+{
+    __m128i l26 = _mm_unpacklo_epi16(r[2], r[6]), h26 = _mm_unpackhi_epi16(r[2], r[6]);
+    __m128i l04 = _mm_unpacklo_epi16(r[0], r[4]), h04 = _mm_unpackhi_epi16(r[0], r[4]);
+    __m128i l13 = _mm_unpacklo_epi16(r[1], r[3]), h13 = _mm_unpackhi_epi16(r[1], r[3]);
+    __m128i l57 = _mm_unpacklo_epi16(r[5], r[7]), h57 = _mm_unpackhi_epi16(r[5], r[7]);
+    __m128i l[8], h[8];
+    int k;
+
+#define JPEG_MADD2(lo, hi, a, b, c, d) \
+    __m128i lo = _mm_add_epi32(_mm_madd_epi16(l13, JPEG_PAIR(a, b)), _mm_madd_epi16(l57, JPEG_PAIR(c, d))); \
+    __m128i hi = _mm_add_epi32(_mm_madd_epi16(h13, JPEG_PAIR(a, b)), _mm_madd_epi16(h57, JPEG_PAIR(c, d)))
+
+    __m128i lt2 = _mm_madd_epi16(l26, JPEG_PAIR(2217, -5350)), ht2 = _mm_madd_epi16(h26, JPEG_PAIR(2217, -5350));
+    __m128i lt3 = _mm_madd_epi16(l26, JPEG_PAIR(5352, 2217)), ht3 = _mm_madd_epi16(h26, JPEG_PAIR(5352, 2217));
+    __m128i lt0 = _mm_add_epi32(_mm_madd_epi16(l04, JPEG_PAIR(4096, 4096)), bias), ht0 = _mm_add_epi32(_mm_madd_epi16(h04, JPEG_PAIR(4096, 4096)), bias);
+    __m128i lt1 = _mm_add_epi32(_mm_madd_epi16(l04, JPEG_PAIR(4096, -4096)), bias), ht1 = _mm_add_epi32(_mm_madd_epi16(h04, JPEG_PAIR(4096, -4096)), bias);
+    __m128i lx0 = _mm_add_epi32(lt0, lt3), hx0 = _mm_add_epi32(ht0, ht3);
+    __m128i lx3 = _mm_sub_epi32(lt0, lt3), hx3 = _mm_sub_epi32(ht0, ht3);
+    __m128i lx1 = _mm_add_epi32(lt1, lt2), hx1 = _mm_add_epi32(ht1, ht2);
+    __m128i lx2 = _mm_sub_epi32(lt1, lt2), hx2 = _mm_sub_epi32(ht1, ht2);
+    JPEG_MADD2(lo3, ho3, 5683, 4816, 3219, 1131);
+    JPEG_MADD2(lo2, ho2, 4816, -1129, -5681, -3218);
+    JPEG_MADD2(lo1, ho1, 3219, -5681, 1132, 4816);
+    JPEG_MADD2(lo0, ho0, 1131, -3218, 4816, -5680);
+#undef JPEG_MADD2
+
+    l[0] = _mm_add_epi32(lx0, lo3); h[0] = _mm_add_epi32(hx0, ho3);
+    l[7] = _mm_sub_epi32(lx0, lo3); h[7] = _mm_sub_epi32(hx0, ho3);
+    l[1] = _mm_add_epi32(lx1, lo2); h[1] = _mm_add_epi32(hx1, ho2);
+    l[6] = _mm_sub_epi32(lx1, lo2); h[6] = _mm_sub_epi32(hx1, ho2);
+    l[2] = _mm_add_epi32(lx2, lo1); h[2] = _mm_add_epi32(hx2, ho1);
+    l[5] = _mm_sub_epi32(lx2, lo1); h[5] = _mm_sub_epi32(hx2, ho1);
+    l[3] = _mm_add_epi32(lx3, lo0); h[3] = _mm_add_epi32(hx3, ho0);
+    l[4] = _mm_sub_epi32(lx3, lo0); h[4] = _mm_sub_epi32(hx3, ho0);
+    for (k = 0; k < 8; k++) {
+        r[k] = _mm_packs_epi32(_mm_sra_epi32(l[k], shift), _mm_sra_epi32(h[k], shift));
+    }
+}
+
+static SSE2_FUNC void jpeg_transpose_sse2(__m128i *r)
+{
+    __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]), a1 = _mm_unpackhi_epi16(r[0], r[1]);
+    __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]), a3 = _mm_unpackhi_epi16(r[2], r[3]);
+    __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]), a5 = _mm_unpackhi_epi16(r[4], r[5]);
+    __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]), a7 = _mm_unpackhi_epi16(r[6], r[7]);
+    __m128i b0 = _mm_unpacklo_epi32(a0, a2), b1 = _mm_unpackhi_epi32(a0, a2);
+    __m128i b2 = _mm_unpacklo_epi32(a1, a3), b3 = _mm_unpackhi_epi32(a1, a3);
+    __m128i b4 = _mm_unpacklo_epi32(a4, a6), b5 = _mm_unpackhi_epi32(a4, a6);
+    __m128i b6 = _mm_unpacklo_epi32(a5, a7), b7 = _mm_unpackhi_epi32(a5, a7);
+    r[0] = _mm_unpacklo_epi64(b0, b4); r[1] = _mm_unpackhi_epi64(b0, b4);
+    r[2] = _mm_unpacklo_epi64(b1, b5); r[3] = _mm_unpackhi_epi64(b1, b5);
+    r[4] = _mm_unpacklo_epi64(b2, b6); r[5] = _mm_unpackhi_epi64(b2, b6);
+    r[6] = _mm_unpacklo_epi64(b3, b7); r[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+static SSE2_FUNC void jpeg_idct_sse2(unsigned char *out, int stride, const short *coef)
+{
+    __m128i r[8];
+    int k;
+    for (k = 0; k < 8; k++) r[k] = _mm_loadu_si128((const __m128i *) (coef + k * 8));
+    jpeg_idct_1d_sse2(r, _mm_set1_epi32(JPEG_PASS1_BIAS), _mm_cvtsi32_si128(JPEG_PASS1_SHIFT));
+    jpeg_transpose_sse2(r);
+    jpeg_idct_1d_sse2(r, _mm_set1_epi32(JPEG_PASS2_BIAS), _mm_cvtsi32_si128(JPEG_PASS2_SHIFT));
+    jpeg_transpose_sse2(r);
+    for (k = 0; k < 8; k++, out += stride) {
+        _mm_storel_epi64((__m128i *) out, _mm_packus_epi16(r[k], r[k]));
+    }
+}
+
+// color conversion
+//   YCbCr to B, G, R, constants are scaled by 16384
+//   if h2 is non-zero, chroma samples are replicated horizontally
+
+#define JPEG_CR_R 22970
+#define JPEG_CB_G -5638
+#define JPEG_CR_G -11700
+#define JPEG_CB_B 29032
+
+static void jpeg_ycc_scalar(unsigned char *out, const unsigned char *y, const unsigned char *cb, const unsigned char *cr, int count, int h2)
+{
+    int i;
+    for (i = 0; i < count; i++, out += 3) {
+        int b = cb[i >> h2] - 128, r = cr[i >> h2] - 128;
+        out[0] = imin(imax(y[i] + ((b * JPEG_CB_B + 8192) >> 14), 0), 255);
+        out[1] = imin(imax(y[i] + ((b * JPEG_CB_G + r * JPEG_CR_G + 8192) >> 14), 0), 255);
+        out[2] = imin(imax(y[i] + ((r * JPEG_CR_R + 8192) >> 14), 0), 255);
+    }
+}
+
+// pack 4 pixels of B, G, R, X to 12 bytes
+static SSE2_FUNC __m128i jpeg_pack24_sse2(__m128i v)
+{
+    const __m128i lo24 = _mm_set_epi32(0, 0x00FFFFFF, 0, 0x00FFFFFF);
+    const __m128i hi24 = _mm_set_epi32(0x0000FFFF, 0xFF000000, 0x0000FFFF, 0xFF000000);
+    const __m128i lo48 = _mm_set_epi32(0, 0, 0x0000FFFF, 0xFFFFFFFF);
+    v = _mm_or_si128(_mm_and_si128(v, lo24), _mm_and_si128(_mm_srli_epi64(v, 8), hi24));
+    return _mm_or_si128(_mm_and_si128(v, lo48), _mm_srli_si128(_mm_andnot_si128(lo48, v), 2));
+}
+
+static SSE2_FUNC void jpeg_ycc_sse2(unsigned char *out, const unsigned char *y, const unsigned char *cb, const unsigned char *cr, int count, int h2)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i c128 = _mm_set1_epi16(128);
+    const __m128i round = _mm_set1_epi32(8192);
+    const __m128i alpha = _mm_set1_epi8(-1);
+    int i;
+    // 16-byte stores write 4 bytes after 8 pixels, so leave 2 pixels to scalar version
+    for (i = 0; i + 10 <= count; i += 8, out += 24) {
+        __m128i c8 = _mm_loadl_epi64((const __m128i *) (cb + (i >> h2)));
+        __m128i r8 = _mm_loadl_epi64((const __m128i *) (cr + (i >> h2)));
+        if (h2) {
+            c8 = _mm_unpacklo_epi8(c8, c8);
+            r8 = _mm_unpacklo_epi8(r8, r8);
+        }
+        __m128i y16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (y + i)), zero);
+        __m128i b16 = _mm_sub_epi16(_mm_unpacklo_epi8(c8, zero), c128);
+        __m128i r16 = _mm_sub_epi16(_mm_unpacklo_epi8(r8, zero), c128);
+        __m128i lo = _mm_unpacklo_epi16(b16, r16), hi = _mm_unpackhi_epi16(b16, r16);
+#define JPEG_YCC_TERM(a, b) _mm_packs_epi32( \
+            _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(lo, JPEG_PAIR(a, b)), round), 14), \
+            _mm_srai_epi32(_mm_add_epi32(_mm_madd_epi16(hi, JPEG_PAIR(a, b)), round), 14))
+        __m128i bb = _mm_packus_epi16(_mm_add_epi16(y16, JPEG_YCC_TERM(JPEG_CB_B, 0)), zero);
+        __m128i gg = _mm_packus_epi16(_mm_add_epi16(y16, JPEG_YCC_TERM(JPEG_CB_G, JPEG_CR_G)), zero);
+        __m128i rr = _mm_packus_epi16(_mm_add_epi16(y16, JPEG_YCC_TERM(0, JPEG_CR_R)), zero);
+#undef JPEG_YCC_TERM
+        __m128i bg = _mm_unpacklo_epi8(bb, gg), ra = _mm_unpacklo_epi8(rr, alpha);
+        _mm_storeu_si128((__m128i *) out, jpeg_pack24_sse2(_mm_unpacklo_epi16(bg, ra)));
+        _mm_storeu_si128((__m128i *) (out + 12), jpeg_pack24_sse2(_mm_unpackhi_epi16(bg, ra)));
+    }
+    jpeg_ycc_scalar(out, y + i, cb + (i >> h2), cr + (i >> h2), count - i, h2);
+}
+
+static int jpeg_restart(struct jpeg_dec *d)
+{
+    // drop buffered bits, and skip to next RSTn marker
+    d->bitbuf = 0;
+    d->bits = 0;
+    d->marker = 0;
+    while (d->p + 1 < d->end && !(d->p[0] == 0xFF && d->p[1] >= 0xD0 && d->p[1] <= 0xD7)) d->p++;
+    if (d->p + 1 >= d->end) return 0;
+    d->p += 2;
+    return 1;
+}
+
+static int jpeg_scan(struct jpeg_dec *d)
+{
+    int sse2 = pixel_has_sse2();
+    int mcux = (d->width + d->hmax * 8 - 1) / (d->hmax * 8);
+    int mcuy = (d->height + d->vmax * 8 - 1) / (d->vmax * 8);
+    int mx, my, i, bx, by, todo = d->restart;
+    short coef[64];
+
+    for (my = 0; my < mcuy; my++) {
+        for (mx = 0; mx < mcux; mx++) {
+            if (d->restart && todo-- == 0) {
+                if (!jpeg_restart(d)) return 0;
+                for (i = 0; i < d->ncomp; i++) d->comp[i].dcpred = 0;
+                todo = d->restart - 1;
+            }
+            for (i = 0; i < d->ncomp; i++) {
+                struct jpeg_comp *c = &d->comp[i];
+                for (by = 0; by < c->v; by++) {
+                    for (bx = 0; bx < c->h; bx++) {
+                        unsigned char *out = c->plane + ((my * c->v + by) * 8) * c->stride + (mx * c->h + bx) * 8;
+                        int ac = jpeg_block(d, coef, c);
+                        if (ac < 0) return 0;
+                        if (!ac) {
+                            jpeg_idct_dc(out, c->stride, coef[0]);
+                        } else if (sse2) {
+                            jpeg_idct_sse2(out, c->stride, coef);
+                        } else {
+                            jpeg_idct_scalar(out, c->stride, coef);
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return 1;
+}
+
+// convert planes to 24-bit pixels
+static void jpeg_output(struct jpeg_dec *d, unsigned char *bits)
+{
+    int sse2 = pixel_has_sse2();
+    int w = d->width, x, y;
+    for (y = 0; y < d->height; y++) {
+        const unsigned char *ysrc = d->comp[0].plane + y * d->comp[0].stride;
+        unsigned char *dst = bits + y * w * 3;
+        if (d->ncomp == 1) {
+            for (x = 0; x < w; x++, dst += 3) dst[0] = dst[1] = dst[2] = ysrc[x];
+            continue;
+        }
+        const unsigned char *cb = d->comp[1].plane + (y / d->vmax) * d->comp[1].stride;
+        const unsigned char *cr = d->comp[2].plane + (y / d->vmax) * d->comp[2].stride;
+        if (sse2) jpeg_ycc_sse2(dst, ysrc, cb, cr, w, d->hmax - 1); else jpeg_ycc_scalar(dst, ysrc, cb, cr, w, d->hmax - 1);
+    }
+}
+
+static int jpeg_parse(struct jpeg_dec *d, const unsigned char *p, const unsigned char *end)
+{
+    int i, j, k;
+    p += 2; // SOI
+    while (end - p >= 4) {
+        if (p[0] != 0xFF) return 0;
+        int marker = p[1];
+        if (marker == 0xFF) {
+            p++; // fill byte
+            continue;
+        }
+        if (marker == 0xD9) return 0; // EOI before SOS
+        int len = jpeg_u16(p + 2);
+        const unsigned char *seg = p + 4, *segend = p + 2 + len;
+        if (len < 2 || segend > end) return 0;
+        switch (marker) {
+            case 0xDB: // DQT
+                while (seg < segend) {
+                    int pq = seg[0] >> 4, tq = seg[0] & 15;
+                    if (pq > 1 || tq > 3 || segend - seg < 1 + 64 * (pq + 1)) return 0;
+                    for (k = 0; k < 64; k++) d->qt[tq][k] = pq ? jpeg_u16(seg + 1 + k * 2) : seg[1 + k];
+                    d->qtvalid[tq] = 1;
+                    seg += 1 + 64 * (pq + 1);
+                }
+                break;
+            case 0xC4: // DHT
+                while (seg < segend) {
+                    int tc = seg[0] >> 4, th = seg[0] & 15, total = 0;
+                    if (tc > 1 || th > 3 || segend - seg < 17) return 0;
+                    for (k = 0; k < 16; k++) total += seg[1 + k];
+                    if (total > 256 || segend - seg < 17 + total) return 0;
+                    struct jpeg_huff *h = &d->huff[tc][th];
+                    memcpy(h->values, seg + 17, total);
+                    if (!jpeg_build_huff(h, seg + 1)) return 0;
+                    if (tc) jpeg_build_fastac(h);
+                    seg += 17 + total;
+                }
+                break;
+            case 0xC0: // SOF0, baseline
+            case 0xC1: // SOF1, extended huffman
+                if (len < 8 || seg[0] != 8) return 0;
+                d->height = jpeg_u16(seg + 1);
+                d->width = jpeg_u16(seg + 3);
+                d->ncomp = seg[5];
+                if (!d->width || !d->height || d->width > IMGDEC_MAXSIZE || d->height > IMGDEC_MAXSIZE) return 0;
+                if ((d->ncomp != 1 && d->ncomp != 3) || len < 8 + d->ncomp * 3) return 0;
+                for (i = 0; i < d->ncomp; i++) {
+                    struct jpeg_comp *c = &d->comp[i];
+                    c->id = seg[6 + i * 3];
+                    c->h = seg[7 + i * 3] >> 4;
+                    c->v = seg[7 + i * 3] & 15;
+                    c->tq = seg[8 + i * 3];
+                    if (c->tq > 3) return 0;
+                }
+                if (d->ncomp == 1) {
+                    // non-interleaved, MCU is always a single block
+                    d->comp[0].h = d->comp[0].v = 1;
+                } else if (d->comp[1].h != 1 || d->comp[1].v != 1 || d->comp[2].h != 1 || d->comp[2].v != 1) {
+                    return 0;
+                }
+                if (d->comp[0].h < 1 || d->comp[0].h > 2 || d->comp[0].v < 1 || d->comp[0].v > 2) return 0;
+                d->hmax = d->comp[0].h;
+                d->vmax = d->comp[0].v;
+                break;
+            case 0xDD: // DRI
+                if (len < 4) return 0;
+                d->restart = jpeg_u16(seg);
+                break;
+            case 0xEE: // APP14
+                if (len >= 14 && memcmp(seg, "Adobe", 5) == 0 && seg[11] == 0) d->adobe_rgb = 1;
+                break;
+            case 0xDA: // SOS
+                if (!d->ncomp || d->adobe_rgb || len < 3 + seg[0] * 2 + 3 || seg[0] != d->ncomp) return 0;
+                for (i = 0; i < d->ncomp; i++) {
+                    int id = seg[1 + i * 2], tables = seg[2 + i * 2];
+                    for (j = 0; j < d->ncomp && d->comp[j].id != id; j++);
+                    if (j != i) return 0; // components must be in frame order
+                    d->comp[i].td = tables >> 4;
+                    d->comp[i].ta = tables & 15;
+                    if (d->comp[i].td > 3 || d->comp[i].ta > 3) return 0;
+                    if (!d->huff[0][d->comp[i].td].valid || !d->huff[1][d->comp[i].ta].valid || !d->qtvalid[d->comp[i].tq]) return 0;
+                }
+                d->p = segend;
+                d->end = end;
+                return 1;
+            default:
+                if ((marker >= 0xC2 && marker <= 0xCF) || marker < 0xC0) return 0; // progressive, lossless, arithmetic or bad
+                break;
+        }
+        p = segend;
+    }
+    return 0;
+}
+
+static void *decode_jpeg(const unsigned char *data, unsigned len, int *width, int *height, const struct memory_allocator *mem_allocator)
+{
+    struct jpeg_dec *d = calloc(1, sizeof(struct jpeg_dec));
+    void *bits = NULL;
+    int i, ok = 0;
+    if (!d) return NULL;
+    if (!jpeg_parse(d, data, data + len)) goto done;
+    int mcux = (d->width + d->hmax * 8 - 1) / (d->hmax * 8);
+    int mcuy = (d->height + d->vmax * 8 - 1) / (d->vmax * 8);
+    for (i = 0; i < d->ncomp; i++) {
+        struct jpeg_comp *c = &d->comp[i];
+        c->stride = mcux * c->h * 8;
+        c->plane = malloc(c->stride * mcuy * c->v * 8);
+        if (!c->plane) goto done;
+    }
+    if (!jpeg_scan(d)) goto done;
+    bits = mem_allocator->malloc(d->width * d->height * 3);
+    if (!bits) goto done;
+    jpeg_output(d, bits);
+    *width = d->width;
+    *height = d->height;
+    ok = 1;
+done:
+    if (!ok && bits) {
+        mem_allocator->free(bits);
+        bits = NULL;
+    }
+    for (i = 0; i < 3; i++) free(d->comp[i].plane);
+    free(d);
+    return bits;
+}
+
+
+
+// BMP
+
+static unsigned bmp_u32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned) p[3] << 24;
+}
+
+static void *decode_bmp(const unsigned char *data, unsigned len, int *width, int *height, const struct memory_allocator *mem_allocator)
+{
+    if (len < 54) return NULL;
+    unsigned offset = bmp_u32(data + 10), hdrsize = bmp_u32(data + 14);
+    int w = bmp_u32(data + 18), h = bmp_u32(data + 22);
+    int planes = data[26] | data[27] << 8, bpp = data[28] | data[29] << 8;
+    unsigned compression = bmp_u32(data + 30), colors = bmp_u32(data + 46);
+    int topdown = h < 0, x, y;
+    h = abs(h);
+    if (hdrsize < 40 || planes != 1 || compression != 0 || (bpp != 24 && bpp != 8)) return NULL;
+    if (w <= 0 || w > IMGDEC_MAXSIZE || h <= 0 || h > IMGDEC_MAXSIZE) return NULL;
+    unsigned pitch = (w * bpp / 8 + 3) & ~3;
+    if (offset > len || (len - offset) / pitch < (unsigned) h) return NULL;
+
+    const unsigned char *palette = NULL;
+    if (bpp == 8) {
+        if (!colors || colors > 256) colors = 256;
+        if (hdrsize > len - 14 || (len - 14 - hdrsize) / 4 < colors) return NULL;
+        palette = data + 14 + hdrsize;
+    }
+
+    unsigned char *bits = mem_allocator->malloc(w * h * 3);
+    if (!bits) return NULL;
+    for (y = 0; y < h; y++) {
+        const unsigned char *src = data + offset + pitch * (topdown ? y : h - 1 - y);
+        unsigned char *dst = bits + y * w * 3;
+        if (bpp == 24) {
+            memcpy(dst, src, w * 3);
+        } else {
+            for (x = 0; x < w; x++, dst += 3) {
+                const unsigned char *c = src[x] < colors ? palette + src[x] * 4 : (const unsigned char *) "\0\0\0";
+                dst[0] = c[0];
+                dst[1] = c[1];
+                dst[2] = c[2];
+            }
+        }
+    }
+    *width = w;
+    *height = h;
+    return bits;
+}
+
+
+
+// TGA
+
+static void *decode_tga(const unsigned char *data, unsigned len, int *width, int *height, int *bitcount, const struct memory_allocator *mem_allocator)
+{
+    if (len < 18) return NULL;
+    int idlen = data[0], cmaptype = data[1], type = data[2];
+    int w = data[12] | data[13] << 8, h = data[14] | data[15] << 8;
+    int bpp = data[16], desc = data[17];
+    if (cmaptype != 0 || (type != 2 && type != 10) || (bpp != 24 && bpp != 32) || (desc & 0x10)) return NULL;
+    if (!w || w > IMGDEC_MAXSIZE || !h || h > IMGDEC_MAXSIZE) return NULL;
+
+    const unsigned char *src = data + 18 + idlen, *end = data + len;
+    int pixsize = bpp / 8, y;
+    unsigned size = w * h * pixsize;
+    if (src > end) return NULL;
+    unsigned char *bits = mem_allocator->malloc(size);
+    if (!bits) return NULL;
+    if (type == 2) {
+        if ((unsigned) (end - src) < size) goto fail;
+        memcpy(bits, src, size);
+    } else {
+        // RLE packets may cross scanlines
+        unsigned char *dst = bits, *dstend = bits + size;
+        while (dst < dstend) {
+            if (src >= end) goto fail;
+            int n = (*src & 0x7F) + 1, rle = *src++ & 0x80;
+            unsigned bytes = n * pixsize;
+            if (bytes > (unsigned) (dstend - dst)) goto fail;
+            if (rle) {
+                if (end - src < pixsize) goto fail;
+                for (; n > 0; n--, dst += pixsize) memcpy(dst, src, pixsize);
+                src += pixsize;
+            } else {
+                if ((unsigned) (end - src) < bytes) goto fail;
+                memcpy(dst, src, bytes);
+                dst += bytes;
+                src += bytes;
+            }
+        }
+    }
+    if (!(desc & 0x20)) {
+        // bottom-up, flip in place
+        unsigned pitch = w * pixsize;
+        unsigned char *tmp = malloc(pitch);
+        if (!tmp) goto fail;
+        for (y = 0; y < h / 2; y++) {
+            memcpy(tmp, bits + y * pitch, pitch);
+            memcpy(bits + y * pitch, bits + (h - 1 - y) * pitch, pitch);
+            memcpy(bits + (h - 1 - y) * pitch, tmp, pitch);
+        }
+        free(tmp);
+    }
+    *width = w;
+    *height = h;
+    *bitcount = bpp;
+    return bits;
+fail:
+    mem_allocator->free(bits);
+    return NULL;
+}
+
+
+
+void *decode_image(const void *data, unsigned len, int *width, int *height, int *bitcount, const struct memory_allocator *mem_allocator)
+{
+    const unsigned char *p = data;
+    if (len >= 4 && p[0] == 0xFF && p[1] == 0xD8) {
+        *bitcount = 24;
+        return decode_jpeg(p, len, width, height, mem_allocator);
+    }
+    if (len >= 2 && p[0] == 'B' && p[1] == 'M') {
+        *bitcount = 24;
+        return decode_bmp(p, len, width, height, mem_allocator);
+    }
+    return decode_tga(p, len, width, height, bitcount, mem_allocator);
+}
@@ -0,0 +1,139 @@
+#include "common.h"
+
+// LZ4 block format compressor and decompressor
+//   greedy matcher with single-entry hash table, fast enough for small files
+//   output can be decoded by LZ4_decompress_safe(), and vice versa
+
+#define LZ_MINMATCH 4
+#define LZ_LASTLITERALS 5
+#define LZ_MFLIMIT 12
+#define LZ_HASHLOG 12
+#define LZ_MAXOFFSET 65535
+
+static unsigned lz_read32(const unsigned char *p)
+{
+    unsigned v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned lz_hash(unsigned v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASHLOG);
+}
+
+static unsigned char *lz_putlen(unsigned char *op, unsigned len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+static unsigned char *lz_putseq(unsigned char *op, const unsigned char *lit, unsigned litlen, unsigned offset, unsigned mlen)
+{
+    // mlen is match length minus LZ_MINMATCH, offset is 0 for last sequence
+    unsigned char *token = op++;
+    *token = (litlen >= 15 ? 15 : litlen) << 4;
+    if (litlen >= 15) op = lz_putlen(op, litlen - 15);
+    memcpy(op, lit, litlen);
+    op += litlen;
+    if (offset) {
+        *token |= mlen >= 15 ? 15 : mlen;
+        *op++ = offset & 0xFF;
+        *op++ = offset >> 8;
+        if (mlen >= 15) op = lz_putlen(op, mlen - 15);
+    }
+    return op;
+}
+
+unsigned lz_compress_bound(unsigned size)
+{
+    return size + size / 255 + 16;
+}
+
+unsigned lz_compress(const void *src, unsigned size, void *dst, unsigned dstsize)
+{
+    // returns compressed size, or 0 on failure
+    const unsigned char *base = src, *ip = src, *anchor = src;
+    const unsigned char *iend = base + size;
+    unsigned char *op = dst;
+    unsigned *table;
+    
+    if (dstsize < lz_compress_bound(size)) return 0;
+    table = calloc(1 << LZ_HASHLOG, sizeof(unsigned));
+    if (!table) return 0;
+    
+    if (size > LZ_MFLIMIT) {
+        // last match must start LZ_MFLIMIT bytes before end, last LZ_LASTLITERALS bytes are literals
+        const unsigned char *mflimit = iend - LZ_MFLIMIT;
+        const unsigned char *matchlimit = iend - LZ_LASTLITERALS;
+        while (ip < mflimit) {
+            unsigned h = lz_hash(lz_read32(ip));
+            const unsigned char *ref = base + table[h];
+            table[h] = ip - base;
+            if (ref >= ip || ip - ref > LZ_MAXOFFSET || lz_read32(ref) != lz_read32(ip)) {
+                ip++;
+                continue;
+            }
+            const unsigned char *mp = ip + LZ_MINMATCH, *rp = ref + LZ_MINMATCH;
+            while (mp < matchlimit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+            op = lz_putseq(op, anchor, ip - anchor, ip - ref, mp - ip - LZ_MINMATCH);
+            ip = anchor = mp;
+        }
+    }
+    op = lz_putseq(op, anchor, iend - anchor, 0, 0);
+    
+    free(table);
+    return op - (unsigned char *) dst;
+}
+
+static int lz_getlen(const unsigned char **ip, const unsigned char *iend, unsigned *len)
+{
+    unsigned b;
+    do {
+        if (*ip >= iend) return 0;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 1;
+}
+
+int lz_decompress(const void *src, unsigned size, void *dst, unsigned dstsize)
+{
+    // returns decompressed size, or -1 on malformed input
+    const unsigned char *ip = src, *iend = ip + size;
+    unsigned char *op = dst, *oend = op + dstsize;
+    
+    while (ip < iend) {
+        unsigned token = *ip++;
+        unsigned len = token >> 4;
+        if (len == 15 && !lz_getlen(&ip, iend, &len)) return -1;
+        if (len > (unsigned) (iend - ip) || len > (unsigned) (oend - op)) return -1;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        
+        // last sequence has literals only
+        if (ip >= iend) break;
+        
+        if (iend - ip < 2) return -1;
+        unsigned offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (unsigned) (op - (unsigned char *) dst)) return -1;
+        len = token & 15;
+        if (len == 15 && !lz_getlen(&ip, iend, &len)) return -1;
+        len += LZ_MINMATCH;
+        if (len > (unsigned) (oend - op)) return -1;
+        
+        // overlapped copy, byte by byte
+        const unsigned char *ref = op - offset;
+        while (len--) *op++ = *ref++;
+    }
+    return op - (unsigned char *) dst;
+}
@@ -0,0 +1,193 @@
+#include "common.h"
+
+// address space tracing and headroom
+//   VirtualAlloc() calls (mostly from MSVC6 CRT small-block heap) and CPK view
+//   mappings of PAL3A.EXE and GBENGINE.DLL are counted, failures are logged
+//   together with the largest free block at that moment
+//   large reservations without a fixed address are placed top-down, so they
+//   stack up from the top of address space instead of cutting the low part,
+//   where small heap regions live, into pieces
+//   a contiguous emergency region is reserved at startup, before address space
+//   is fragmented, it is released when a traced allocation fails, and the
+//   failed allocation is retried once
+//   large-address-aware can't be switched on at runtime, it is only reported
+
+#define ADDRSPACE_LARGESIZE (4 * 1024 * 1024) // reservations at least this size go top-down, sbh regions are 1 MB
+#define ADDRSPACE_SAMPLEINTERVAL 10000 // sample address space every N milliseconds
+
+struct addrspace_info {
+    unsigned free_total;
+    unsigned free_largest;
+    unsigned free_regions;
+};
+
+static void *emergency_region;
+static unsigned emergency_size;
+
+static volatile LONG nr_valloc, nr_valloc_fail, nr_valloc_topdown;
+static volatile LONG nr_vfree;
+static volatile LONG nr_mapview, nr_mapview_fail;
+static volatile LONG nr_retry_ok;
+static unsigned min_largest = UINT_MAX;
+static DWORD last_sample;
+
+static LPVOID (WINAPI *VirtualAlloc_pal3a)(LPVOID, SIZE_T, DWORD, DWORD);
+static LPVOID (WINAPI *VirtualAlloc_gb)(LPVOID, SIZE_T, DWORD, DWORD);
+static BOOL (WINAPI *VirtualFree_pal3a)(LPVOID, SIZE_T, DWORD);
+static BOOL (WINAPI *VirtualFree_gb)(LPVOID, SIZE_T, DWORD);
+static LPVOID (WINAPI *MapViewOfFile_next)(HANDLE, DWORD, DWORD, DWORD, SIZE_T);
+
+static void query_addrspace(struct addrspace_info *info)
+{
+    SYSTEM_INFO si;
+    MEMORY_BASIC_INFORMATION mbi;
+    GetSystemInfo(&si);
+    memset(info, 0, sizeof(*info));
+    
+    unsigned addr = TOUINT(si.lpMinimumApplicationAddress);
+    unsigned end = TOUINT(si.lpMaximumApplicationAddress);
+    while (addr < end && VirtualQuery(TOPTR(addr), &mbi, sizeof(mbi))) {
+        unsigned size = mbi.RegionSize;
+        if (mbi.State == MEM_FREE) {
+            info->free_total += size;
+            if (size > info->free_largest) info->free_largest = size;
+            info->free_regions++;
+        }
+        if (addr + size < addr) break;
+        addr += size;
+    }
+}
+
+static void sample_addrspace(void)
+{
+    struct addrspace_info info;
+    query_addrspace(&info);
+    if (info.free_largest < min_largest) min_largest = info.free_largest;
+}
+
+// release emergency region, return true if there was one to release
+static int release_emergency(SIZE_T request)
+{
+    void *region = InterlockedExchangePointer(&emergency_region, NULL);
+    if (!region) return 0;
+    
+    struct addrspace_info info;
+    query_addrspace(&info);
+    warning("allocation of %u bytes failed (largest free block %u KB), releasing %u MB emergency region.", (unsigned) request, info.free_largest / 1024, emergency_size / 1048576);
+    VirtualFree(region, 0, MEM_RELEASE);
+    return 1;
+}
+
+static LPVOID addrspace_valloc(LPVOID (WINAPI *next)(LPVOID, SIZE_T, DWORD, DWORD), LPVOID lpAddress, SIZE_T dwSize, DWORD flAllocationType, DWORD flProtect)
+{
+    InterlockedIncrement(&nr_valloc);
+    if (!lpAddress && (flAllocationType & MEM_RESERVE) && dwSize >= ADDRSPACE_LARGESIZE && !(flAllocationType & MEM_TOP_DOWN)) {
+        flAllocationType |= MEM_TOP_DOWN;
+        InterlockedIncrement(&nr_valloc_topdown);
+    }
+    
+    LPVOID ret = next(lpAddress, dwSize, flAllocationType, flProtect);
+    if (!ret) {
+        // committing pages in existing region fails for other reasons, there is nothing to release
+        InterlockedIncrement(&nr_valloc_fail);
+        if (!lpAddress && release_emergency(dwSize)) {
+            ret = next(lpAddress, dwSize, flAllocationType, flProtect);
+            if (ret) InterlockedIncrement(&nr_retry_ok);
+        }
+    }
+    return ret;
+}
+static LPVOID WINAPI VirtualAlloc_pal3a_wrapper(LPVOID lpAddress, SIZE_T dwSize, DWORD flAllocationType, DWORD flProtect)
+{
+    return addrspace_valloc(VirtualAlloc_pal3a, lpAddress, dwSize, flAllocationType, flProtect);
+}
+static LPVOID WINAPI VirtualAlloc_gb_wrapper(LPVOID lpAddress, SIZE_T dwSize, DWORD flAllocationType, DWORD flProtect)
+{
+    return addrspace_valloc(VirtualAlloc_gb, lpAddress, dwSize, flAllocationType, flProtect);
+}
+
+static BOOL WINAPI VirtualFree_pal3a_wrapper(LPVOID lpAddress, SIZE_T dwSize, DWORD dwFreeType)
+{
+    InterlockedIncrement(&nr_vfree);
+    return VirtualFree_pal3a(lpAddress, dwSize, dwFreeType);
+}
+static BOOL WINAPI VirtualFree_gb_wrapper(LPVOID lpAddress, SIZE_T dwSize, DWORD dwFreeType)
+{
+    InterlockedIncrement(&nr_vfree);
+    return VirtualFree_gb(lpAddress, dwSize, dwFreeType);
+}
+
+static LPVOID WINAPI MapViewOfFile_addrspace(HANDLE hFileMappingObject, DWORD dwDesiredAccess, DWORD dwFileOffsetHigh, DWORD dwFileOffsetLow, SIZE_T dwNumberOfBytesToMap)
+{
+    InterlockedIncrement(&nr_mapview);
+    LPVOID ret = MapViewOfFile_next(hFileMappingObject, dwDesiredAccess, dwFileOffsetHigh, dwFileOffsetLow, dwNumberOfBytesToMap);
+    if (!ret) {
+        InterlockedIncrement(&nr_mapview_fail);
+        if (release_emergency(dwNumberOfBytesToMap)) {
+            ret = MapViewOfFile_next(hFileMappingObject, dwDesiredAccess, dwFileOffsetHigh, dwFileOffsetLow, dwNumberOfBytesToMap);
+            if (ret) InterlockedIncrement(&nr_retry_ok);
+        }
+    }
+    return ret;
+}
+
+static void addrspace_gameloop_hook(void *arg)
+{
+    DWORD now = GetTickCount();
+    if (now - last_sample >= ADDRSPACE_SAMPLEINTERVAL) {
+        last_sample = now;
+        sample_addrspace();
+    }
+}
+
+static void addrspace_report(void)
+{
+    struct addrspace_info info;
+    query_addrspace(&info);
+    if (info.free_largest < min_largest) min_largest = info.free_largest;
+    plog("addrspace: %ld valloc (%ld failed, %ld top-down), %ld vfree, %ld mapview (%ld failed), %ld retried ok, emergency region %s.",
+        (long) nr_valloc, (long) nr_valloc_fail, (long) nr_valloc_topdown, (long) nr_vfree, (long) nr_mapview, (long) nr_mapview_fail, (long) nr_retry_ok, emergency_region ? "unused" : (emergency_size ? "released" : "none"));
+    plog("addrspace: at exit %u MB free in %u regions, largest %u KB, smallest largest-free-block seen %u KB.",
+        info.free_total / 1048576, info.free_regions, info.free_largest / 1024, min_largest / 1024);
+}
+
+MAKE_PATCHSET(addrspace)
+{
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    PIMAGE_DOS_HEADER pdoshdr = (void *) GetModuleHandle(NULL);
+    PIMAGE_NT_HEADERS pnthdr = PTRADD(pdoshdr, pdoshdr->e_lfanew);
+    int laa = !!(pnthdr->FileHeader.Characteristics & IMAGE_FILE_LARGE_ADDRESS_AWARE);
+    
+    struct addrspace_info info;
+    query_addrspace(&info);
+    plog("addrspace: large-address-aware %s, user space limit %08X, %u MB free in %u regions, largest %u KB.",
+        laa ? "on" : "off", TOUINT(si.lpMaximumApplicationAddress), info.free_total / 1048576, info.free_regions, info.free_largest / 1024);
+    min_largest = info.free_largest;
+    
+    // reserve emergency region top-down, keep at most a quarter of the largest free block
+    unsigned reserve = imax(get_int_from_configfile("addrspace_reserve"), 0) * 1048576u;
+    if (reserve > info.free_largest / 4) reserve = info.free_largest / 4;
+    reserve &= ~(si.dwAllocationGranularity - 1);
+    if (reserve) {
+        emergency_region = VirtualAlloc(NULL, reserve, MEM_RESERVE | MEM_TOP_DOWN, PAGE_NOACCESS);
+        if (emergency_region) {
+            emergency_size = reserve;
+        } else {
+            warning("can't reserve %u MB emergency region.", reserve / 1048576);
+        }
+    }
+    
+    VirtualAlloc_pal3a = hook_import_table(GetModuleHandle(NULL), "KERNEL32.DLL", "VirtualAlloc", VirtualAlloc_pal3a_wrapper);
+    VirtualFree_pal3a = hook_import_table(GetModuleHandle(NULL), "KERNEL32.DLL", "VirtualFree", VirtualFree_pal3a_wrapper);
+    VirtualAlloc_gb = hook_import_table(TOPTR(gboffset + 0x10000000), "KERNEL32.DLL", "VirtualAlloc", VirtualAlloc_gb_wrapper);
+    VirtualFree_gb = hook_import_table(TOPTR(gboffset + 0x10000000), "KERNEL32.DLL", "VirtualFree", VirtualFree_gb_wrapper);
+    
+    // chain to current target, cpktrace, hitchlog and others may have patched MapViewOfFile() call
+    MapViewOfFile_next = TOPTR(get_wrapper_branch_jtarget(gboffset + 0x1002B332));
+    make_wrapper_branch(gboffset + 0x1002B332, MapViewOfFile_addrspace);
+    
+    last_sample = GetTickCount();
+    add_gameloop_hook_filtered(addrspace_gameloop_hook, GAMELOOP_MASK(GAMELOOP_NORMAL) | GAMELOOP_MASK(GAMELOOP_SLEEP));
+    add_atexit_hook(addrspace_report);
+}
@@ -0,0 +1,43 @@
+#include "common.h"
+
+// audio read-ahead
+//   music and sound effects are decoded by MSS from views of SoundMgr's CPK,
+//   so a stream refill may page fault on a cold view while a scene is loading
+//   every view mapped from this CPK is queued to the CPK prefetch thread,
+//   which touches it ahead of playback, before any manifest ranges
+//
+//   decoding is still done by MSS, only the compressed data is read ahead
+
+static unsigned audio_limit;
+
+static LPVOID (WINAPI *MapViewOfFile_next)(HANDLE, DWORD, DWORD, DWORD, SIZE_T);
+static BOOL (WINAPI *UnmapViewOfFile_next)(LPCVOID);
+
+static LPVOID WINAPI MapViewOfFile_audio(HANDLE hFileMappingObject, DWORD dwDesiredAccess, DWORD dwFileOffsetHigh, DWORD dwFileOffsetLow, SIZE_T dwNumberOfBytesToMap)
+{
+    LPVOID ret = MapViewOfFile_next(hFileMappingObject, dwDesiredAccess, dwFileOffsetHigh, dwFileOffsetLow, dwNumberOfBytesToMap);
+    if (ret && is_cpk_handle(&SoundMgr_Inst()->m_Cpk, hFileMappingObject)) {
+        prefetch_add_view(ret, imin(dwNumberOfBytesToMap, audio_limit));
+    }
+    return ret;
+}
+
+static BOOL WINAPI UnmapViewOfFile_audio(LPCVOID lpBaseAddress)
+{
+    prefetch_remove_view(lpBaseAddress);
+    return UnmapViewOfFile_next(lpBaseAddress);
+}
+
+MAKE_PATCHSET(audioprefetch)
+{
+    audio_limit = imax(flag, 0) * 1048576u;
+    if (!audio_limit) return;
+
+    prefetch_start_thread();
+
+    // chain to current targets, since nommapcpk and cpktrace may have patched these calls
+    MapViewOfFile_next = TOPTR(get_wrapper_branch_jtarget(gboffset + 0x1002B332));
+    UnmapViewOfFile_next = TOPTR(get_wrapper_branch_jtarget(gboffset + 0x1002B354));
+    make_wrapper_branch(gboffset + 0x1002B332, MapViewOfFile_audio);
+    make_wrapper_branch(gboffset + 0x1002B354, UnmapViewOfFile_audio);
+}
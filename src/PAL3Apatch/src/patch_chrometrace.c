@@ -0,0 +1,336 @@
+#include "common.h"
+
+// chrome trace-event export
+//   scoped timing zones are recorded into per-thread rings, press Ctrl+F12
+//   to dump zones ended in last 'flag' seconds to CHROMETRACE_FILE, in Chrome
+//   trace-event JSON, which can be opened by chrome://tracing or Perfetto
+//
+//   zones come from hook dispatch (hook.c), asm patches (asmpatch.c), jobs
+//   (jobsys.c), effect hooks (effecthook.c), CPK maps (wrapped here), and
+//   texture loads and effect compilations (through hitchlog_event())
+//   each ring keeps last 'chrometrace_events' zones of its thread
+//
+//   zone names must be static strings, details are copied
+//   rings are written by owner thread and read by dumper under ring lock,
+//   the lock is not contended except when dumping
+//   dumps are written by a job, so a large dump doesn't stall the game
+
+#define CHROMETRACE_FILE "PAL3Apatch.chrometrace.%d.json"
+#define CHROMETRACE_DEPTH 32
+#define CHROMETRACE_NAMELEN 32
+#define CHROMETRACE_DETAILLEN 48
+
+struct chrometrace_zone {
+    LONGLONG begin, end;
+    const char *name;
+    unsigned arg;
+    char detail[CHROMETRACE_DETAILLEN];
+};
+
+struct chrometrace_ring {
+    DWORD tid;
+    char name[CHROMETRACE_NAMELEN];
+    CRITICAL_SECTION cs;
+    struct chrometrace_zone *zones;
+    unsigned head, count;
+    
+    // open zones, only touched by owner
+    int depth;
+    struct chrometrace_zone stack[CHROMETRACE_DEPTH];
+};
+
+struct chrometrace_dump {
+    int id;
+    LONGLONG now;
+    struct bvec zones; // struct chrometrace_zone
+    struct bvec tids; // DWORD, thread of each zone
+};
+
+int chrometrace_enabled = 0;
+
+static LARGE_INTEGER ct_freq, ct_begin;
+static LONGLONG ct_window;
+static unsigned ct_ring_size;
+static DWORD ct_tls, ct_main_tid;
+static CRITICAL_SECTION ct_cs; // protects ct_rings
+static struct bvec ct_rings; // struct chrometrace_ring *
+static volatile LONG ct_dumping;
+static int ct_hotkey, ct_nr_dumps;
+
+static LPVOID (WINAPI *MapViewOfFile_next)(HANDLE, DWORD, DWORD, DWORD, SIZE_T);
+
+static struct chrometrace_ring *get_ring()
+{
+    // TlsGetValue() clears last error, keep it for hooked API callers
+    DWORD err = GetLastError();
+    struct chrometrace_ring *r = TlsGetValue(ct_tls);
+    if (!r) {
+        r = calloc(1, sizeof(struct chrometrace_ring));
+        if (r) r->zones = malloc(ct_ring_size * sizeof(struct chrometrace_zone));
+        if (!r || !r->zones) fail("can't allocate chrome trace buffer.");
+        r->tid = GetCurrentThreadId();
+        strcpy(r->name, r->tid == ct_main_tid ? "main" : "thread");
+        InitializeCriticalSection(&r->cs);
+        EnterCriticalSection(&ct_cs);
+        bvec_tpushback(&ct_rings, &r, struct chrometrace_ring *);
+        LeaveCriticalSection(&ct_cs);
+        TlsSetValue(ct_tls, r);
+    }
+    SetLastError(err);
+    return r;
+}
+
+static void push_zone(struct chrometrace_ring *r, const struct chrometrace_zone *zone)
+{
+    EnterCriticalSection(&r->cs);
+    r->zones[(r->head + r->count) % ct_ring_size] = *zone;
+    if (r->count < ct_ring_size) {
+        r->count++;
+    } else {
+        r->head = (r->head + 1) % ct_ring_size;
+    }
+    LeaveCriticalSection(&r->cs);
+}
+
+void chrometrace_begin(const char *name, unsigned arg)
+{
+    struct chrometrace_ring *r = get_ring();
+    if (r->depth < CHROMETRACE_DEPTH) {
+        struct chrometrace_zone *z = &r->stack[r->depth];
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        z->begin = now.QuadPart;
+        z->name = name;
+        z->arg = arg;
+        z->detail[0] = '\0';
+    }
+    r->depth++;
+}
+
+void chrometrace_end()
+{
+    struct chrometrace_ring *r = get_ring();
+    if (r->depth <= 0) return;
+    if (--r->depth < CHROMETRACE_DEPTH) {
+        struct chrometrace_zone *z = &r->stack[r->depth];
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        z->end = now.QuadPart;
+        push_zone(r, z);
+    }
+}
+
+void chrometrace_complete(const char *name, const char *detail, LONGLONG begin, LONGLONG end)
+{
+    struct chrometrace_zone z;
+    z.begin = begin;
+    z.end = end;
+    z.name = name;
+    z.arg = 0;
+    snprintf(z.detail, sizeof(z.detail), "%s", detail ? detail : "");
+    push_zone(get_ring(), &z);
+}
+
+void chrometrace_thread_name(const char *name)
+{
+    struct chrometrace_ring *r = get_ring();
+    if (strcmp(r->name, name) != 0) {
+        EnterCriticalSection(&r->cs);
+        snprintf(r->name, sizeof(r->name), "%s", name);
+        LeaveCriticalSection(&r->cs);
+    }
+}
+
+static LPVOID WINAPI MapViewOfFile_chrometrace(HANDLE hFileMappingObject, DWORD dwDesiredAccess, DWORD dwFileOffsetHigh, DWORD dwFileOffsetLow, SIZE_T dwNumberOfBytesToMap)
+{
+    LARGE_INTEGER begin, end;
+    QueryPerformanceCounter(&begin);
+    LPVOID ret = MapViewOfFile_next(hFileMappingObject, dwDesiredAccess, dwFileOffsetHigh, dwFileOffsetLow, dwNumberOfBytesToMap);
+    DWORD err = GetLastError();
+    QueryPerformanceCounter(&end);
+    
+    struct CPK *cpk = vfs_findcpk_mapping(hFileMappingObject);
+    char detail[CHROMETRACE_DETAILLEN];
+    snprintf(detail, sizeof(detail), "%s+%08X", cpk ? get_filepart(cpk->m_szCPKFileName) : "?", (unsigned) dwFileOffsetLow);
+    chrometrace_complete("cpk map", detail, begin.QuadPart, end.QuadPart);
+    SetLastError(err);
+    return ret;
+}
+
+static void json_string(FILE *fp, const char *str)
+{
+    // names and details are in game codepage, JSON wants UTF-8
+    wchar_t *wstr = cs2wcs_alloc(str, target_codepage);
+    char *ustr = wstr ? wcs2cs_alloc(wstr, CP_UTF8) : NULL;
+    const unsigned char *p;
+    fputc('"', fp);
+    for (p = (const unsigned char *) (ustr ? ustr : ""); *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(fp, "\\%c", *p);
+        } else if (*p < 0x20) {
+            fprintf(fp, "\\u%04X", *p);
+        } else {
+            fputc(*p, fp);
+        }
+    }
+    fputc('"', fp);
+    free(ustr);
+    free(wstr);
+}
+
+static double ticks2us(LONGLONG ticks)
+{
+    return ticks * 1000000.0 / ct_freq.QuadPart;
+}
+
+static void chrometrace_write(void *arg)
+{
+    struct chrometrace_dump *d = arg;
+    char filename[MAXLINE];
+    int i, n = bvec_tsize(&d->zones, struct chrometrace_zone);
+    
+    snprintf(filename, sizeof(filename), CHROMETRACE_FILE, d->id);
+    FILE *fp = robust_fopen(filename, "w");
+    if (!fp) {
+        warning("can't open chrome trace file '%s'.", filename);
+        goto done;
+    }
+    
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"PAL3A\"}}");
+    EnterCriticalSection(&ct_cs);
+    for (i = 0; i < (int) bvec_tsize(&ct_rings, struct chrometrace_ring *); i++) {
+        struct chrometrace_ring *r = bvec_tat(&ct_rings, i, struct chrometrace_ring *);
+        char name[CHROMETRACE_NAMELEN];
+        EnterCriticalSection(&r->cs);
+        strcpy(name, r->name);
+        LeaveCriticalSection(&r->cs);
+        fprintf(fp, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":", (unsigned) r->tid);
+        json_string(fp, name);
+        fprintf(fp, "}}");
+    }
+    LeaveCriticalSection(&ct_cs);
+    
+    for (i = 0; i < n; i++) {
+        struct chrometrace_zone *z = &bvec_tat(&d->zones, i, struct chrometrace_zone);
+        fprintf(fp, ",\n{\"name\":");
+        json_string(fp, z->name);
+        fprintf(fp, ",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f", (unsigned) bvec_tat(&d->tids, i, DWORD), ticks2us(z->begin - ct_begin.QuadPart), ticks2us(z->end - z->begin));
+        if (z->arg || z->detail[0]) {
+            fprintf(fp, ",\"args\":{");
+            if (z->arg) fprintf(fp, "\"addr\":\"%08X\"%s", z->arg, z->detail[0] ? "," : "");
+            if (z->detail[0]) {
+                fprintf(fp, "\"detail\":");
+                json_string(fp, z->detail);
+            }
+            fputc('}', fp);
+        }
+        fputc('}', fp);
+    }
+    fprintf(fp, "\n]}\n");
+    
+    if (safe_fclose(&fp) != 0) {
+        warning("can't write chrome trace file '%s'.", filename);
+    } else {
+        plog("chrome trace: %d zones written to '%s'.", n, filename);
+    }
+done:
+    bvec_dtor(&d->zones);
+    bvec_dtor(&d->tids);
+    free(d);
+    InterlockedExchange(&ct_dumping, 0);
+}
+
+static void chrometrace_dump()
+{
+    struct chrometrace_dump *d;
+    LARGE_INTEGER now;
+    unsigned i, j;
+    
+    // skip if last dump is still being written
+    if (InterlockedExchange(&ct_dumping, 1)) return;
+    
+    d = malloc(sizeof(struct chrometrace_dump));
+    if (!d) fail("out of memory.");
+    QueryPerformanceCounter(&now);
+    d->id = ++ct_nr_dumps;
+    d->now = now.QuadPart;
+    bvec_ctor(&d->zones);
+    bvec_ctor(&d->tids);
+    
+    // copy zones in time window, rings are locked one by one
+    EnterCriticalSection(&ct_cs);
+    for (i = 0; i < bvec_tsize(&ct_rings, struct chrometrace_ring *); i++) {
+        struct chrometrace_ring *r = bvec_tat(&ct_rings, i, struct chrometrace_ring *);
+        EnterCriticalSection(&r->cs);
+        for (j = 0; j < r->count; j++) {
+            struct chrometrace_zone *z = &r->zones[(r->head + j) % ct_ring_size];
+            if (d->now - z->end > ct_window) continue;
+            bvec_tpushback(&d->zones, z, struct chrometrace_zone);
+            bvec_tpushback(&d->tids, &r->tid, DWORD);
+        }
+        LeaveCriticalSection(&r->cs);
+    }
+    LeaveCriticalSection(&ct_cs);
+    
+    job_release(job_submit(chrometrace_write, d));
+}
+
+static void ct_gameloop_hook(void *arg)
+{
+    if (ct_hotkey) {
+        ct_hotkey = 0;
+        chrometrace_dump();
+    }
+}
+
+static void ct_wndproc_hook(void *arg)
+{
+    struct wndproc_hook_data *data = arg;
+    
+    if (data->Msg == WM_KEYUP && data->wParam == VK_F12 && GetKeyState(VK_CONTROL) < 0) {
+        ct_hotkey = 1;
+        data->retvalue = 0;
+        data->processed = 1;
+    }
+}
+static const UINT ct_wndproc_msgs[] = { WM_KEYUP, 0 };
+
+static void ct_grpkbdstate_hook()
+{
+    if (GetKeyState(VK_CONTROL) < 0) g_input.m_keyRaw[DIK_F12] = 0;
+}
+
+static void ct_atexit()
+{
+    // wait a while for last dump
+    int i;
+    for (i = 0; ct_dumping && i < 500; i++) Sleep(10);
+    chrometrace_enabled = 0;
+}
+
+MAKE_PATCHSET(chrometrace)
+{
+    if (!QueryPerformanceFrequency(&ct_freq)) {
+        warning("can't query performance frequency, chrome trace disabled.");
+        return;
+    }
+    QueryPerformanceCounter(&ct_begin);
+    ct_window = (LONGLONG) flag * ct_freq.QuadPart;
+    ct_ring_size = imax(get_int_from_configfile("chrometrace_events"), 1);
+    ct_main_tid = GetCurrentThreadId();
+    ct_tls = TlsAlloc();
+    if (ct_tls == TLS_OUT_OF_INDEXES) fail("can't allocate TLS index for chrome trace.");
+    InitializeCriticalSection(&ct_cs);
+    bvec_ctor(&ct_rings);
+    
+    // chain to current target, hitchlog and others may have patched MapViewOfFile() call
+    MapViewOfFile_next = TOPTR(get_wrapper_branch_jtarget(gboffset + 0x1002B332));
+    make_wrapper_branch(gboffset + 0x1002B332, MapViewOfFile_chrometrace);
+    
+    add_gameloop_hook_filtered(ct_gameloop_hook, GAMELOOP_MASK(GAMELOOP_NORMAL));
+    add_postwndproc_hook_filtered(ct_wndproc_hook, ct_wndproc_msgs);
+    add_grpkbdstate_hook(ct_grpkbdstate_hook);
+    add_atexit_hook(ct_atexit);
+    chrometrace_enabled = 1;
+}
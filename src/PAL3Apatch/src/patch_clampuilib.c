@@ -243,6 +243,6 @@ static MAKE_THISCALL(void, ArtistPlugIn_GetPlugFileInfo_wrapper, struct ArtistPl
 MAKE_PATCHSET(clampuilib)
 {
     INIT_WRAPPER_CALL(ArtistPlugIn_GetPlugFileInfo_wrapper, { 0x004557A8 });
-    add_texture_hook(texlib_loader);
+    add_texture_hook_filtered(texlib_loader, NULL, make_texture_hook_magic(TEXLIB_MAGIC), NULL);
     add_texture_hook(clamp_outside);
 }
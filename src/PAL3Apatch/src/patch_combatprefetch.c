@@ -0,0 +1,282 @@
+#include "common.h"
+
+// combat prefetch
+//   entering combat loads party skill effects, monster models, combat UI
+//   and sounds on main thread, which causes the first-turn hitch
+//   CPK views mapped while a combat starts (the loop iteration that switches
+//   to combat, and COMBATPREFETCH_RECORDMS after it) are recorded to
+//   COMBATPREFETCH_FILE under the scene CPK the combat happens in,
+//   when that scene CPK is loaded again, the recorded ranges are read by a
+//   background job with vfsread, so the file cache is warm before next combat
+//   in that scene (monster groups are bound to scenes), reading stops when
+//   scene CPK is switched
+//
+//   manifest format:
+//     [SCENECPK]
+//     OFFSET SIZE CPKFILE   (hex, in first-touch order)
+//
+//   only file data is read ahead, textures and effects are still created by engine
+
+#define COMBATPREFETCH_FILE "PAL3patch.combatprefetch"
+#define COMBATPREFETCH_MAXSECTION 256
+#define COMBATPREFETCH_MAXRANGE 512
+#define COMBATPREFETCH_MAXNAMES 16
+#define COMBATPREFETCH_MAXPENDING 1024
+#define COMBATPREFETCH_RECORDMS 3000
+#define COMBATPREFETCH_BUFSIZE 0x40000
+
+struct cp_range {
+    unsigned offset;
+    unsigned size;
+    int nameid;
+};
+
+struct cp_section {
+    char name[CPKTRACE_NAMELEN];
+    struct cp_range *r;
+    int n;
+};
+
+struct cp_job {
+    struct cp_section *s;
+    LONG gen;
+};
+
+static struct cp_section sections[COMBATPREFETCH_MAXSECTION];
+static int nr_sections;
+static char cp_names[COMBATPREFETCH_MAXNAMES][sizeof(((struct CPK *) 0)->m_szCPKFileName)];
+static int nr_names;
+static int manifest_dirty;
+static unsigned prefetch_limit;
+
+// views mapped since last loop iteration, or since combat started
+static CRITICAL_SECTION cp_cs;
+static struct cp_range pending[COMBATPREFETCH_MAXPENDING];
+static int nr_pending;
+static int in_combat, recording;
+static DWORD record_begin;
+static DWORD cp_threadid;
+static char record_scene[CPKTRACE_NAMELEN];
+
+static volatile LONG cp_gen;
+static char last_cpkfile[sizeof(((struct CPK *) 0)->m_szCPKFileName)];
+static unsigned nr_recorded, nr_prefetched;
+static volatile LONG nr_kbytes;
+
+static LPVOID (WINAPI *MapViewOfFile_next)(HANDLE, DWORD, DWORD, DWORD, SIZE_T);
+
+static struct cp_section *find_section(const char *name)
+{
+    int i;
+    for (i = 0; i < nr_sections; i++) {
+        if (stricmp(sections[i].name, name) == 0) return &sections[i];
+    }
+    return NULL;
+}
+
+static struct cp_section *new_section(const char *name)
+{
+    struct cp_section *s = find_section(name);
+    if (s) return s;
+    if (nr_sections >= COMBATPREFETCH_MAXSECTION) return NULL;
+    s = &sections[nr_sections++];
+    snprintf(s->name, sizeof(s->name), "%s", name);
+    s->r = NULL;
+    s->n = 0;
+    return s;
+}
+
+// only main thread touches name table
+static int find_nameid(const char *cpkfile)
+{
+    int i;
+    for (i = 0; i < nr_names; i++) {
+        if (stricmp(cp_names[i], cpkfile) == 0) return i;
+    }
+    if (nr_names >= COMBATPREFETCH_MAXNAMES) return -1;
+    snprintf(cp_names[nr_names], sizeof(cp_names[nr_names]), "%s", cpkfile);
+    return nr_names++;
+}
+
+static int add_range(struct cp_section *s, unsigned offset, unsigned size, int nameid)
+{
+    int i;
+    for (i = 0; i < s->n; i++) {
+        if (s->r[i].nameid == nameid && s->r[i].offset == offset) {
+            if (s->r[i].size >= size) return 0;
+            s->r[i].size = size;
+            return 1;
+        }
+    }
+    if (s->n >= COMBATPREFETCH_MAXRANGE) return 0;
+    if ((s->n & (s->n - 1)) == 0) {
+        struct cp_range *r = realloc(s->r, imax(s->n * 2, 16) * sizeof(struct cp_range));
+        if (!r) return 0;
+        s->r = r;
+    }
+    s->r[s->n++] = (struct cp_range) { offset, size, nameid };
+    return 1;
+}
+
+static void load_manifest(void)
+{
+    char *data = read_file_as_cstring(COMBATPREFETCH_FILE);
+    if (!data) return;
+    struct cp_section *s = NULL;
+    char *saveptr;
+    char *line;
+    for (line = strtok_r(data, "\r\n", &saveptr); line; line = strtok_r(NULL, "\r\n", &saveptr)) {
+        str_trim(line, " \t");
+        if (!*line || *line == ';') continue;
+        if (*line == '[') {
+            str_rtrim(line, "]");
+            s = new_section(line + 1);
+        } else {
+            unsigned offset, size;
+            int pos, nameid;
+            if (s && sscanf(line, "%x %x %n", &offset, &size, &pos) == 2 && line[pos] && (nameid = find_nameid(line + pos)) >= 0) {
+                add_range(s, offset, size, nameid);
+            }
+        }
+    }
+    free(data);
+}
+
+static void save_manifest(void)
+{
+    if (!manifest_dirty) return;
+    FILE *fp = robust_fopen(COMBATPREFETCH_FILE, "w");
+    if (!fp) {
+        warning("can't write combat prefetch manifest.");
+        return;
+    }
+    int i, j;
+    fprintf(fp, "; combat prefetch manifest, CPK ranges mapped at combat start in each scene CPK\n");
+    for (i = 0; i < nr_sections; i++) {
+        fprintf(fp, "[%s]\n", sections[i].name);
+        for (j = 0; j < sections[i].n; j++) {
+            fprintf(fp, "%08X %X %s\n", sections[i].r[j].offset, sections[i].r[j].size, cp_names[sections[i].r[j].nameid]);
+        }
+    }
+    fclose(fp);
+}
+
+static LPVOID WINAPI MapViewOfFile_combatprefetch(HANDLE hFileMappingObject, DWORD dwDesiredAccess, DWORD dwFileOffsetHigh, DWORD dwFileOffsetLow, SIZE_T dwNumberOfBytesToMap)
+{
+    LPVOID ret = MapViewOfFile_next(hFileMappingObject, dwDesiredAccess, dwFileOffsetHigh, dwFileOffsetLow, dwNumberOfBytesToMap);
+    if (ret && GetCurrentThreadId() == cp_threadid) {
+        struct CPK *cpk = vfs_findcpk_mapping(hFileMappingObject);
+        int nameid = cpk ? find_nameid(cpk->m_szCPKFileName) : -1;
+        EnterCriticalSection(&cp_cs);
+        if (nameid >= 0 && nr_pending < COMBATPREFETCH_MAXPENDING) {
+            pending[nr_pending++] = (struct cp_range) { dwFileOffsetLow, dwNumberOfBytesToMap, nameid };
+        }
+        LeaveCriticalSection(&cp_cs);
+    }
+    return ret;
+}
+
+static void combatprefetch_job(void *arg)
+{
+    struct cp_job *job = arg;
+    struct cp_section *s = job->s;
+    void *buf = malloc(COMBATPREFETCH_BUFSIZE);
+    unsigned total = 0;
+    int i;
+    for (i = 0; buf && i < s->n && total < prefetch_limit && job->gen == cp_gen; i++) {
+        struct vfsread_file *fp = vfsread_open_range(cp_names[s->r[i].nameid], s->r[i].offset, imin(s->r[i].size, prefetch_limit - total));
+        if (!fp) continue;
+        unsigned pos = 0, size = vfsread_size(fp);
+        while (pos < size && job->gen == cp_gen) {
+            int nbytes = vfsread_read(fp, buf, pos, imin(size - pos, COMBATPREFETCH_BUFSIZE));
+            if (nbytes <= 0) break;
+            pos += nbytes;
+        }
+        total += pos;
+        vfsread_close(fp);
+    }
+    InterlockedExchangeAdd(&nr_kbytes, (total + 512) / 1024);
+    free(buf);
+    free(job);
+}
+
+static void combatprefetch_check(void)
+{
+    if (!g_pVFileSys || !g_pVFileSys->m_cpk.m_bLoaded) return;
+    const char *cpkfile = g_pVFileSys->m_cpk.m_szCPKFileName;
+    if (strcmp(cpkfile, last_cpkfile) == 0) return;
+    strcpy(last_cpkfile, cpkfile);
+
+    // stop reading ranges of last scene
+    InterlockedIncrement(&cp_gen);
+    struct cp_section *s = find_section(vfs_cpkname());
+    if (!s || !s->n) return;
+    struct cp_job *job = malloc(sizeof(struct cp_job));
+    if (!job) return;
+    job->s = s;
+    job->gen = cp_gen;
+    job_release(job_submit(combatprefetch_job, job));
+    nr_prefetched++;
+}
+
+// move pending views to scene section, ranges are only read by jobs after scene CPK switch
+static void commit_pending(void)
+{
+    struct cp_section *s = new_section(record_scene);
+    int i;
+    EnterCriticalSection(&cp_cs);
+    for (i = 0; s && i < nr_pending; i++) {
+        if (add_range(s, pending[i].offset, pending[i].size, pending[i].nameid)) manifest_dirty = 1;
+    }
+    nr_pending = 0;
+    LeaveCriticalSection(&cp_cs);
+    nr_recorded++;
+}
+
+static void combatprefetch_gameloop_hook(void *arg)
+{
+    int combat = PAL3_s_gamestate == GAME_COMBAT;
+
+    // keep views of the iteration that switched to combat
+    if (combat && !in_combat && g_pVFileSys && g_pVFileSys->m_cpk.m_bLoaded) {
+        recording = 1;
+        record_begin = GetTickCount();
+        snprintf(record_scene, sizeof(record_scene), "%s", vfs_cpkname());
+    }
+    in_combat = combat;
+
+    if (recording && (!combat || GetTickCount() - record_begin >= COMBATPREFETCH_RECORDMS)) {
+        commit_pending();
+        recording = 0;
+    }
+    if (!recording) {
+        EnterCriticalSection(&cp_cs);
+        nr_pending = 0;
+        LeaveCriticalSection(&cp_cs);
+    }
+
+    combatprefetch_check();
+}
+
+static void combatprefetch_atexit(void)
+{
+    plog("combat prefetch: %u combat starts recorded, %u scenes read ahead, %.1f MB read.", nr_recorded, nr_prefetched, nr_kbytes / 1024.0);
+    save_manifest();
+}
+
+MAKE_PATCHSET(combatprefetch)
+{
+    prefetch_limit = imax(flag, 0) * 1048576u;
+    if (!prefetch_limit) return;
+
+    cp_threadid = GetCurrentThreadId();
+    InitializeCriticalSection(&cp_cs);
+    load_manifest();
+
+    // chain to current target, cpktrace, hitchlog and others may have patched MapViewOfFile() call
+    MapViewOfFile_next = TOPTR(get_wrapper_branch_jtarget(gboffset + 0x1002B332));
+    make_wrapper_branch(gboffset + 0x1002B332, MapViewOfFile_combatprefetch);
+
+    add_gameloop_hook(combatprefetch_gameloop_hook);
+    add_atexit_hook(combatprefetch_atexit);
+}
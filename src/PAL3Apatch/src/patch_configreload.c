@@ -0,0 +1,81 @@
+#include "common.h"
+
+// reload config file at runtime
+//   CONFIG_FILE is reloaded when it is modified, or when Ctrl+F9 is pressed
+//   changed values are applied by config change hooks, see add_configchange_hook()
+//   only some settings support this, others still require restarting the game
+
+static HANDLE cr_notify = INVALID_HANDLE_VALUE;
+static FILETIME cr_mtime;
+static int cr_hotkey;
+
+static int get_config_mtime(FILETIME *mtime)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    if (!GetFileAttributesExA(CONFIG_FILE, GetFileExInfoStandard, &attr)) return 0;
+    *mtime = attr.ftLastWriteTime;
+    return 1;
+}
+
+static void cr_reload()
+{
+    int changed = reload_config_file();
+    if (changed > 0) {
+        plog("config file reloaded, %d values changed.", changed);
+        call_configchange_hooks();
+    }
+}
+
+static void cr_gameloop_hook(void *arg)
+{
+    if (cr_hotkey) {
+        cr_hotkey = 0;
+        get_config_mtime(&cr_mtime);
+        cr_reload();
+        return;
+    }
+    
+    // notification is signaled for any file in game folder, compare mtime of config file
+    if (cr_notify == INVALID_HANDLE_VALUE || WaitForSingleObject(cr_notify, 0) != WAIT_OBJECT_0) return;
+    FindNextChangeNotification(cr_notify);
+    FILETIME mtime;
+    if (!get_config_mtime(&mtime) || CompareFileTime(&mtime, &cr_mtime) == 0) return;
+    cr_mtime = mtime;
+    cr_reload();
+}
+
+static void cr_wndproc_hook(void *arg)
+{
+    struct wndproc_hook_data *data = arg;
+    
+    if (data->Msg == WM_KEYUP && data->wParam == VK_F9 && GetKeyState(VK_CONTROL) < 0) {
+        cr_hotkey = 1;
+        data->retvalue = 0;
+        data->processed = 1;
+    }
+}
+static const UINT cr_wndproc_msgs[] = { WM_KEYUP, 0 };
+
+static void cr_grpkbdstate_hook()
+{
+    if (GetKeyState(VK_CONTROL) < 0) g_input.m_keyRaw[DIK_F9] = 0;
+}
+
+static void cr_atexit()
+{
+    if (cr_notify != INVALID_HANDLE_VALUE) FindCloseChangeNotification(cr_notify);
+}
+
+MAKE_PATCHSET(configreload)
+{
+    get_config_mtime(&cr_mtime);
+    cr_notify = FindFirstChangeNotificationA(".", FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME);
+    if (cr_notify == INVALID_HANDLE_VALUE) {
+        warning("can't watch config file for changes, only hotkey is available.");
+    }
+    
+    add_gameloop_hook_filtered(cr_gameloop_hook, GAMELOOP_MASK(GAMELOOP_NORMAL));
+    add_postwndproc_hook_filtered(cr_wndproc_hook, cr_wndproc_msgs);
+    add_grpkbdstate_hook(cr_grpkbdstate_hook);
+    add_atexit_hook(cr_atexit);
+}
@@ -0,0 +1,230 @@
+#include "common.h"
+
+// CPK LZO decoder
+//   compressed CPK entries are decoded by the miniLZO 1.04 copy in GBENGINE.DLL,
+//   we redirect its calls in CPK::Open() and CPK::Read() to our decoder below,
+//   which is a copy of cpk_lzo1x_decompress() in extra/common/cpklib
+//   (extra/common/cpklib/lzotest.c checks it against the byte-by-byte version)
+//
+//   lzo1x_decompress() itself is not exported, its call sites are located at runtime:
+//     a call inside the exported functions, followed by "add esp, 14h" (5 cdecl arguments),
+//     whose target compares with 17 at very beginning ("if (*ip > 17)")
+//   all call sites must call the same function, and it must decode a sample stream,
+//   otherwise nothing is patched
+//
+//   our decoder uses *out_len as output buffer size and writes exactly the decoded bytes,
+//   if it fails, e.g. *out_len is not set by engine or data is broken,
+//   the original decoder is called, so result is always the same as original
+
+#define LZO_E_OK 0
+#define CPKLZO_SCANSIZE 0x800
+#define CPKLZO_MAXSITES 8
+
+typedef int (*lzo_decompress_t)(const unsigned char *, unsigned, unsigned char *, unsigned *, void *);
+
+static lzo_decompress_t lzo_orig;
+static volatile LONG nr_fast, nr_fallback;
+
+#define LZO_NEED_IP(n) do { if ((unsigned) (ip_end - ip) < (unsigned) (n)) return 0; } while (0)
+#define LZO_NEED_OP(n) do { if ((unsigned) (op_end - op) < (unsigned) (n)) return 0; } while (0)
+#define LZO_COPY_LITERALS(n) do { LZO_NEED_IP(n); LZO_NEED_OP(n); memcpy(op, ip, n); op += n; ip += n; } while (0)
+
+static int lzo_extlen(const unsigned char **pip, const unsigned char *ip_end, unsigned *len)
+{
+    const unsigned char *ip = *pip;
+    unsigned t = *len;
+    while (1) {
+        LZO_NEED_IP(1);
+        if (*ip) break;
+        if (t > 0x7FFFFFFF) return 0;
+        t += 255;
+        ip++;
+    }
+    t += *ip++;
+    *pip = ip;
+    *len = t;
+    return 1;
+}
+
+// returns 0 on any error, including input not fully consumed
+static int lzo_decompress_exact(const unsigned char *in, unsigned in_len, unsigned char *out, unsigned *out_len)
+{
+    const unsigned char *ip = in, *ip_end = in + in_len;
+    unsigned char *op = out, *op_end = out + *out_len;
+    unsigned t, len, dist, word, state = 0;
+
+    LZO_NEED_IP(1);
+    if (*ip > 17) {
+        t = *ip++ - 17;
+        LZO_COPY_LITERALS(t);
+        state = t < 4 ? t : 4;
+    }
+
+    while (1) {
+        LZO_NEED_IP(1);
+        t = *ip++;
+        if (t < 16) {
+            if (state == 0) {
+                // long literal run
+                len = t;
+                if (len == 0) {
+                    len = 15;
+                    if (!lzo_extlen(&ip, ip_end, &len)) return 0;
+                }
+                len += 3;
+                LZO_COPY_LITERALS(len);
+                state = 4;
+                continue;
+            }
+            // short match, distance depends on state
+            LZO_NEED_IP(1);
+            if (state < 4) {
+                len = 2;
+                dist = (t >> 2) + (*ip++ << 2) + 1;
+            } else {
+                len = 3;
+                dist = (t >> 2) + (*ip++ << 2) + 2049;
+            }
+        } else if (t < 32) {
+            len = t & 7;
+            if (len == 0) {
+                len = 7;
+                if (!lzo_extlen(&ip, ip_end, &len)) return 0;
+            }
+            len += 2;
+            LZO_NEED_IP(2);
+            word = ip[0] | (ip[1] << 8);
+            ip += 2;
+            dist = ((t & 8) << 11) + (word >> 2);
+            if (dist == 0) {
+                // end of stream
+                break;
+            }
+            dist += 0x4000;
+            t = word;
+        } else if (t < 64) {
+            len = t & 31;
+            if (len == 0) {
+                len = 31;
+                if (!lzo_extlen(&ip, ip_end, &len)) return 0;
+            }
+            len += 2;
+            LZO_NEED_IP(2);
+            word = ip[0] | (ip[1] << 8);
+            ip += 2;
+            dist = (word >> 2) + 1;
+            t = word;
+        } else {
+            LZO_NEED_IP(1);
+            len = (t >> 5) + 1;
+            dist = ((t >> 2) & 7) + (*ip++ << 3) + 1;
+        }
+
+        // copy match, may overlap
+        //   an 8-byte chunk never reads bytes written by itself if distance is at least 8
+        if (dist > (unsigned) (op - out)) return 0;
+        LZO_NEED_OP(len);
+        const unsigned char *m_pos = op - dist;
+        if (dist >= len) {
+            memcpy(op, m_pos, len);
+            op += len;
+        } else if (dist >= 8) {
+            for (; len >= 8; len -= 8) {
+                memcpy(op, m_pos, 8);
+                op += 8;
+                m_pos += 8;
+            }
+            memcpy(op, m_pos, len);
+            op += len;
+        } else {
+            while (len--) *op++ = *m_pos++;
+        }
+
+        // copy trailing literals
+        state = t & 3;
+        if (state) LZO_COPY_LITERALS(state);
+    }
+
+    // miniLZO reports an error if input is not fully consumed
+    if (ip != ip_end) return 0;
+    *out_len = op - out;
+    return 1;
+}
+
+static int cpklzo_decompress(const unsigned char *in, unsigned in_len, unsigned char *out, unsigned *out_len, void *wrkmem)
+{
+    unsigned len = *out_len;
+    if (len && lzo_decompress_exact(in, in_len, out, &len)) {
+        InterlockedIncrement(&nr_fast);
+        *out_len = len;
+        return LZO_E_OK;
+    }
+    InterlockedIncrement(&nr_fallback);
+    return lzo_orig(in, in_len, out, out_len, wrkmem);
+}
+
+// check if func starts like lzo1x_decompress(), i.e. compares with 17 very early
+static int cpklzo_islzo(const unsigned char *func)
+{
+    int i;
+    for (i = 0; i < 32; i++) {
+        if (func[i] == 0x3C && func[i + 1] == 0x11) return 1; // cmp al, 11h
+        if (func[i] == 0x80 && (func[i + 1] & 0xF8) == 0x38 && func[i + 2] == 0x11) return 1; // cmp byte ptr [reg], 11h
+        if (func[i] == 0x83 && (func[i + 1] & 0xF8) == 0xF8 && func[i + 2] == 0x11) return 1; // cmp reg, 11h
+    }
+    return 0;
+}
+
+// find calls to lzo1x_decompress() in [func, func + CPKLZO_SCANSIZE), returns number of sites
+static int cpklzo_findsites(const char *funcname, unsigned *sites, int maxsites, unsigned *target)
+{
+    unsigned base = get_module_base("GBENGINE.DLL");
+    PIMAGE_NT_HEADERS pnthdr = TOPTR(base + ((PIMAGE_DOS_HEADER) TOPTR(base))->e_lfanew);
+    unsigned limit = base + pnthdr->OptionalHeader.SizeOfImage;
+    unsigned char *func = (unsigned char *) GetProcAddress(GetModuleHandle("GBENGINE.DLL"), funcname);
+    int i, n = 0;
+    if (!func) return 0;
+    for (i = 0; i < CPKLZO_SCANSIZE && TOUINT(func) + i + 8 <= limit; i++) {
+        if (func[i] != 0xE8 || func[i + 5] != 0x83 || func[i + 6] != 0xC4 || func[i + 7] != 0x14) continue;
+        unsigned callee = TOUINT(func) + i + 5 + *(unsigned *) &func[i + 1];
+        if (callee < base || callee + 64 > limit || !cpklzo_islzo(TOPTR(callee))) continue;
+        if (*target && *target != callee) return -1;
+        *target = callee;
+        if (n < maxsites) sites[n++] = TOUINT(func) + i;
+    }
+    return n;
+}
+
+static void cpklzo_report(void)
+{
+    plog("cpklzo: %ld decoded, %ld by engine decoder.", nr_fast, nr_fallback);
+}
+
+MAKE_PATCHSET(cpklzo)
+{
+    // "abc" as literals, then end of stream
+    static const unsigned char sample[] = "\x14" "abc" "\x11\x00\x00";
+    unsigned char out[16], wrkmem[64];
+    unsigned sites[CPKLZO_MAXSITES];
+    unsigned target = 0, len;
+    int i, n1, n2;
+
+    n1 = cpklzo_findsites("?Open@CPK@@QAEPAVCPKFile@@PBD@Z", sites, CPKLZO_MAXSITES, &target);
+    n2 = n1 < 0 ? -1 : cpklzo_findsites("?Read@CPK@@QAE_NPAXKPAVCPKFile@@@Z", sites + n1, CPKLZO_MAXSITES - n1, &target);
+    if (n1 < 0 || n2 < 0 || n1 + n2 == 0) {
+        warning("can't locate LZO decoder in GBENGINE.DLL, cpklzo is not used.");
+        return;
+    }
+
+    lzo_orig = TOPTR(target);
+    len = sizeof(out);
+    if (lzo_orig(sample, sizeof(sample) - 1, out, &len, wrkmem) != LZO_E_OK || len != 3 || memcmp(out, "abc", 3) != 0) {
+        warning("function at %08X is not LZO decoder, cpklzo is not used.", target);
+        return;
+    }
+
+    for (i = 0; i < n1 + n2; i++) {
+        make_call(sites[i], cpklzo_decompress);
+    }
+    add_atexit_hook(cpklzo_report);
+}
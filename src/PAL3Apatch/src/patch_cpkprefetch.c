@@ -0,0 +1,431 @@
+#include "common.h"
+
+// CPK prefetch
+//   when the scene CPK is switched, a background thread reads the ranges
+//   listed for that CPK in CPKPREFETCH_FILE, so the OS file cache is warm
+//   before engine asks for them
+//
+//   CPKPREFETCH_FILE is regenerated from CPKTRACE_FILE if the trace is newer,
+//   only CPKs appeared in the trace are replaced
+//
+//   manifest format:
+//     [CPKNAME]
+//     OFFSET SIZE   (hex, in first-touch order)
+//
+//   the same thread also touches views queued by prefetch_add_view() (see audioprefetch),
+//   queued views are served before manifest ranges, between every read
+//
+//   with cpkprefetch_hint, every view mapped from a CPK is passed to
+//   PrefetchVirtualMemory() (Windows 8 and later), so first-touch page faults
+//   are batched into large reads issued by the OS, queued views are hinted
+//   instead of touched, older systems fall back to touching them
+
+#define CPKPREFETCH_FILE "PAL3Apatch.cpkprefetch"
+#define CPKPREFETCH_MAXSECTION 256
+#define CPKPREFETCH_MERGEGAP 0x10000
+#define CPKPREFETCH_BUFSIZE 0x40000
+#define CPKPREFETCH_MAXVIEWS 8
+#define CPKPREFETCH_VIEWCHUNK 0x10000
+#define CPKPREFETCH_PAGESIZE 0x1000
+
+struct pf_range {
+    unsigned offset;
+    unsigned size;
+};
+
+struct pf_section {
+    char name[CPKTRACE_NAMELEN];
+    struct pf_range *r;
+    int n;
+};
+
+static struct pf_section sections[CPKPREFETCH_MAXSECTION];
+static int nr_sections;
+static unsigned prefetch_limit;
+
+static CRITICAL_SECTION pf_cs;
+static HANDLE pf_event;
+static volatile LONG pf_gen;
+static char pf_path[sizeof(((struct CPK *) 0)->m_szCPKFileName)];
+static struct pf_section *pf_cur;
+static char last_cpkfile[sizeof(((struct CPK *) 0)->m_szCPKFileName)];
+static int pf_started;
+
+// queued views, slot is freed when view is fully touched or removed
+//   base is read without lock by prefetch_remove_view(),
+//   views are only touched under pf_view_cs, so they can't be unmapped meanwhile
+struct pf_view {
+    const unsigned char *volatile base;
+    unsigned size;
+    unsigned done;
+};
+static struct pf_view pf_views[CPKPREFETCH_MAXVIEWS];
+static CRITICAL_SECTION pf_view_cs;
+static volatile unsigned char pf_sink;
+static unsigned pf_nr_views, pf_view_bytes;
+
+struct myWIN32_MEMORY_RANGE_ENTRY {
+    PVOID VirtualAddress;
+    SIZE_T NumberOfBytes;
+};
+static BOOL (WINAPI *myPrefetchVirtualMemory)(HANDLE, ULONG_PTR, struct myWIN32_MEMORY_RANGE_ENTRY *, ULONG);
+static int pf_hint_init;
+static volatile LONG pf_nr_hints, pf_hint_kbytes;
+
+static LPVOID (WINAPI *MapViewOfFile_next)(HANDLE, DWORD, DWORD, DWORD, SIZE_T);
+
+static void (*UpdateLoading_next)(void);
+
+static struct pf_section *find_section(const char *name)
+{
+    int i;
+    for (i = 0; i < nr_sections; i++) {
+        if (stricmp(sections[i].name, name) == 0) return &sections[i];
+    }
+    return NULL;
+}
+
+static struct pf_section *new_section(const char *name)
+{
+    struct pf_section *s = find_section(name);
+    if (s) {
+        free(s->r);
+    } else {
+        if (nr_sections >= CPKPREFETCH_MAXSECTION) return NULL;
+        s = &sections[nr_sections++];
+        snprintf(s->name, sizeof(s->name), "%s", name);
+    }
+    s->r = NULL;
+    s->n = 0;
+    return s;
+}
+
+static void add_range(struct pf_section *s, unsigned offset, unsigned size)
+{
+    // merge with last range if they are close
+    if (s->n > 0) {
+        struct pf_range *last = &s->r[s->n - 1];
+        if (offset >= last->offset && offset <= last->offset + last->size + CPKPREFETCH_MERGEGAP) {
+            last->size = imax(last->size, offset + size - last->offset);
+            return;
+        }
+    }
+    if ((s->n & (s->n - 1)) == 0) {
+        struct pf_range *r = realloc(s->r, imax(s->n * 2, 16) * sizeof(struct pf_range));
+        if (!r) return;
+        s->r = r;
+    }
+    s->r[s->n++] = (struct pf_range) { offset, size };
+}
+
+static int get_mtime(const char *filepath, FILETIME *mtime)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    if (!GetFileAttributesExA(filepath, GetFileExInfoStandard, &attr)) return 0;
+    *mtime = attr.ftLastWriteTime;
+    return 1;
+}
+
+static void load_manifest(void)
+{
+    char *data = read_file_as_cstring(CPKPREFETCH_FILE);
+    if (!data) return;
+    struct pf_section *s = NULL;
+    char *saveptr;
+    char *line;
+    for (line = strtok_r(data, "\r\n", &saveptr); line; line = strtok_r(NULL, "\r\n", &saveptr)) {
+        str_trim(line, " \t");
+        if (!*line || *line == ';') continue;
+        if (*line == '[') {
+            str_rtrim(line, "]");
+            s = new_section(line + 1);
+        } else {
+            unsigned offset, size;
+            if (s && sscanf(line, "%x %x", &offset, &size) == 2) add_range(s, offset, size);
+        }
+    }
+    free(data);
+}
+
+static void save_manifest(void)
+{
+    FILE *fp = robust_fopen(CPKPREFETCH_FILE, "w");
+    if (!fp) {
+        warning("can't write cpk prefetch manifest.");
+        return;
+    }
+    int i, j;
+    fprintf(fp, "; CPK prefetch manifest, generated from %s\n", CPKTRACE_FILE);
+    for (i = 0; i < nr_sections; i++) {
+        fprintf(fp, "[%s]\n", sections[i].name);
+        for (j = 0; j < sections[i].n; j++) {
+            fprintf(fp, "%08X %X\n", sections[i].r[j].offset, sections[i].r[j].size);
+        }
+    }
+    fclose(fp);
+}
+
+static int range_offset_cmp(const void *a, const void *b)
+{
+    const struct cpktrace_record *x = a, *y = b;
+    if (x->offset != y->offset) return x->offset < y->offset ? -1 : 1;
+    return x->timestamp < y->timestamp ? -1 : x->timestamp > y->timestamp;
+}
+
+static int range_time_cmp(const void *a, const void *b)
+{
+    const struct cpktrace_record *x = a, *y = b;
+    return x->timestamp < y->timestamp ? -1 : x->timestamp > y->timestamp;
+}
+
+static int merge_trace(void)
+{
+    FILE *fp = robust_fopen(CPKTRACE_FILE, "rb");
+    if (!fp) return 0;
+
+    struct cpktrace_header hdr;
+    char (*names)[CPKTRACE_NAMELEN] = NULL;
+    struct cpktrace_record *rec = NULL;
+    int ret = 0;
+    unsigned i, j, n;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != CPKTRACE_MAGIC || hdr.version != CPKTRACE_VERSION) goto done;
+    names = malloc(imax(hdr.nr_names, 1) * CPKTRACE_NAMELEN);
+    rec = malloc(imax(hdr.nr_records, 1) * sizeof(struct cpktrace_record));
+    if (!names || !rec) goto done;
+    if (fread(names, CPKTRACE_NAMELEN, hdr.nr_names, fp) != hdr.nr_names) goto done;
+    if (fread(rec, sizeof(struct cpktrace_record), hdr.nr_records, fp) != hdr.nr_records) goto done;
+
+    for (i = 0; i < hdr.nr_names; i++) {
+        names[i][CPKTRACE_NAMELEN - 1] = '\0';
+
+        // collect map records of this CPK, keep first touch of each offset
+        for (n = j = 0; j < hdr.nr_records; j++) {
+            if (rec[j].type == CPKTRACE_MAP && rec[j].cpkid == i && rec[j].tblidx >= 0) {
+                struct cpktrace_record t = rec[n];
+                rec[n++] = rec[j];
+                rec[j] = t;
+            }
+        }
+        if (n == 0) continue;
+        qsort(rec, n, sizeof(struct cpktrace_record), range_offset_cmp);
+        for (j = 1; j < n; j++) {
+            if (rec[j].offset == rec[j - 1].offset) rec[j].type = 0;
+        }
+        qsort(rec, n, sizeof(struct cpktrace_record), range_time_cmp);
+
+        struct pf_section *s = new_section(names[i]);
+        if (!s) break;
+        for (j = 0; j < n; j++) {
+            if (rec[j].type == CPKTRACE_MAP) add_range(s, rec[j].offset, rec[j].size);
+        }
+    }
+    ret = 1;
+done:
+    free(names);
+    free(rec);
+    fclose(fp);
+    return ret;
+}
+
+// touch pages of queued views, one chunk of each view at a time
+static void prefetch_views(void)
+{
+    int i, busy = 1;
+    while (busy) {
+        busy = 0;
+        EnterCriticalSection(&pf_view_cs);
+        for (i = 0; i < CPKPREFETCH_MAXVIEWS; i++) {
+            struct pf_view *v = &pf_views[i];
+            if (!v->base) continue;
+            unsigned end = imin(v->done + CPKPREFETCH_VIEWCHUNK, v->size);
+            pf_view_bytes += end - v->done;
+            for (; v->done < end; v->done += CPKPREFETCH_PAGESIZE) pf_sink += v->base[v->done];
+            pf_sink += v->base[end - 1];
+            v->done = end;
+            if (v->done >= v->size) v->base = NULL;
+            busy = 1;
+        }
+        LeaveCriticalSection(&pf_view_cs);
+    }
+}
+
+static void prefetch_init_hint(void)
+{
+    if (pf_hint_init) return;
+    pf_hint_init = 1;
+    if (get_int_from_configfile("cpkprefetch_hint")) {
+        myPrefetchVirtualMemory = (void *) GetProcAddress(GetModuleHandle("KERNEL32.DLL"), "PrefetchVirtualMemory");
+    }
+}
+
+int prefetch_hint_view(const void *base, unsigned size)
+{
+    // returns 0 if hint is not available, caller may touch the view instead
+    if (!myPrefetchVirtualMemory || !base || !size) return 0;
+    struct myWIN32_MEMORY_RANGE_ENTRY range = { (PVOID) base, size };
+    if (!myPrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0)) return 0;
+    InterlockedIncrement(&pf_nr_hints);
+    InterlockedExchangeAdd(&pf_hint_kbytes, (size + 512) / 1024);
+    return 1;
+}
+
+static LPVOID WINAPI MapViewOfFile_hint(HANDLE hFileMappingObject, DWORD dwDesiredAccess, DWORD dwFileOffsetHigh, DWORD dwFileOffsetLow, SIZE_T dwNumberOfBytesToMap)
+{
+    LPVOID ret = MapViewOfFile_next(hFileMappingObject, dwDesiredAccess, dwFileOffsetHigh, dwFileOffsetLow, dwNumberOfBytesToMap);
+
+    // views are heap buffers under nommapcpk (mapping handle is the file handle), nothing to hint
+    if (ret && !vfs_findcpk(hFileMappingObject)) prefetch_hint_view(ret, dwNumberOfBytesToMap);
+    return ret;
+}
+
+void prefetch_add_view(const void *base, unsigned size)
+{
+    int i;
+    if (!size) return;
+    if (prefetch_hint_view(base, size)) return;
+    EnterCriticalSection(&pf_view_cs);
+    for (i = 0; i < CPKPREFETCH_MAXVIEWS; i++) {
+        struct pf_view *v = &pf_views[i];
+        if (!v->base) {
+            v->size = size;
+            v->done = 0;
+            v->base = base;
+            pf_nr_views++;
+            break;
+        }
+    }
+    LeaveCriticalSection(&pf_view_cs);
+    if (i < CPKPREFETCH_MAXVIEWS) SetEvent(pf_event);
+}
+
+void prefetch_remove_view(const void *base)
+{
+    int i;
+    for (i = 0; i < CPKPREFETCH_MAXVIEWS; i++) {
+        if (pf_views[i].base == base) {
+            EnterCriticalSection(&pf_view_cs);
+            if (pf_views[i].base == base) pf_views[i].base = NULL;
+            LeaveCriticalSection(&pf_view_cs);
+        }
+    }
+}
+
+static DWORD WINAPI prefetch_thread(LPVOID lpParameter)
+{
+    void *buf = malloc(CPKPREFETCH_BUFSIZE);
+    LONG done_gen = 0;
+    if (!buf) return 0;
+    while (WaitForSingleObject(pf_event, INFINITE) == WAIT_OBJECT_0) {
+        char path[sizeof(pf_path)];
+        struct pf_section *s;
+        prefetch_views();
+        EnterCriticalSection(&pf_cs);
+        LONG gen = pf_gen;
+        strcpy(path, pf_path);
+        s = pf_cur;
+        LeaveCriticalSection(&pf_cs);
+
+        // the event may be set by queued views only
+        if (!s || gen == done_gen) continue;
+        done_gen = gen;
+
+        unsigned total = 0;
+        int i;
+        for (i = 0; i < s->n && total < prefetch_limit && gen == pf_gen; i++) {
+            struct vfsread_file *fp = vfsread_open_range(path, s->r[i].offset, imin(s->r[i].size, prefetch_limit - total));
+            if (!fp) continue;
+            unsigned pos = 0, size = vfsread_size(fp);
+            while (pos < size && gen == pf_gen) {
+                prefetch_views();
+                int nbytes = vfsread_read(fp, buf, pos, imin(size - pos, CPKPREFETCH_BUFSIZE));
+                if (nbytes <= 0) break;
+                pos += nbytes;
+                total += nbytes;
+            }
+            vfsread_close(fp);
+        }
+    }
+    free(buf);
+    return 0;
+}
+
+static void prefetch_check(void)
+{
+    if (!g_pVFileSys || !g_pVFileSys->m_cpk.m_bLoaded) return;
+    const char *cpkfile = g_pVFileSys->m_cpk.m_szCPKFileName;
+    if (strcmp(cpkfile, last_cpkfile) == 0) return;
+    strcpy(last_cpkfile, cpkfile);
+
+    const char *separator = strrchr(cpkfile, '\\');
+    struct pf_section *s = find_section(separator ? separator + 1 : cpkfile);
+    EnterCriticalSection(&pf_cs);
+    InterlockedIncrement(&pf_gen);
+    strcpy(pf_path, cpkfile);
+    pf_cur = s;
+    LeaveCriticalSection(&pf_cs);
+    if (s) SetEvent(pf_event);
+}
+
+static void prefetch_report(void)
+{
+    plog("cpk prefetch: %u views queued, %.1f MB touched, %u views hinted, %.1f MB hinted.", pf_nr_views, pf_view_bytes / 1048576.0, (unsigned) pf_nr_hints, pf_hint_kbytes / 1024.0);
+}
+
+void prefetch_start_thread(void)
+{
+    if (pf_started) return;
+    pf_started = 1;
+    prefetch_init_hint();
+    InitializeCriticalSection(&pf_cs);
+    InitializeCriticalSection(&pf_view_cs);
+    pf_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!pf_event) fail("can't create prefetch event.");
+    HANDLE hThread = CreateThread(NULL, 0, prefetch_thread, NULL, 0, NULL);
+    if (!hThread) fail("can't create prefetch thread.");
+    sched_set_thread(hThread, SCHED_BACKGROUND);
+    CloseHandle(hThread);
+    add_atexit_hook(prefetch_report);
+}
+
+static void UpdateLoading_prefetch(void)
+{
+    prefetch_check();
+    UpdateLoading_next();
+}
+
+static void prefetch_gameloop_hook(void *arg)
+{
+    prefetch_check();
+}
+
+MAKE_PATCHSET(cpkprefetch)
+{
+    prefetch_limit = imax(flag, 0) * 1048576u;
+
+    // regenerate manifest if trace is newer
+    FILETIME trace_mtime, manifest_mtime;
+    load_manifest();
+    if (get_mtime(CPKTRACE_FILE, &trace_mtime) && (!get_mtime(CPKPREFETCH_FILE, &manifest_mtime) || CompareFileTime(&trace_mtime, &manifest_mtime) > 0)) {
+        if (merge_trace()) {
+            save_manifest();
+        } else {
+            warning("can't read cpk trace file '%s'.", CPKTRACE_FILE);
+        }
+    }
+
+    // hint every mapped view, even if there is no manifest yet
+    prefetch_init_hint();
+    if (myPrefetchVirtualMemory) {
+        // chain to current target, since nommapcpk and cpktrace may have patched this call
+        MapViewOfFile_next = TOPTR(get_wrapper_branch_jtarget(gboffset + 0x1002B332));
+        make_wrapper_branch(gboffset + 0x1002B332, MapViewOfFile_hint);
+    }
+    if (!nr_sections) return;
+
+    prefetch_start_thread();
+
+    // chain to current target, since fixloading may have patched these calls
+    UpdateLoading_next = TOPTR(get_wrapper_branch_jtarget(0x0041E8A1));
+    INIT_WRAPPER_CALL(UpdateLoading_prefetch, { 0x0041E8A1, 0x0041E9D0, 0x0041EAFD, 0x0041EB9C, 0x0041EBCD });
+    add_gameloop_hook(prefetch_gameloop_hook);
+}
@@ -0,0 +1,275 @@
+#include "common.h"
+
+// CPK table cache
+//   engine reads CPK header and then the whole table with ReadFile()
+//   we hook ReadFile() in GBENGINE's IAT, and when a table read follows a header read,
+//   serve it from a cache keyed by file size, mtime and header hash
+//   the cache is kept in CPKTBLCACHE_FILE between runs
+//
+//   file layout:
+//     struct tblcache_filehdr
+//     { struct tblcache_key, DWORD stored, data[stored] } [nr_entries]
+//     sha1 of all above
+
+#define CPKTBLCACHE_FILE "PAL3Apatch.cpktblcache"
+#define CPKTBLCACHE_MAGIC 0x43544B43 // "CKTC"
+#define CPKTBLCACHE_VERSION 1
+#define CPKTBLCACHE_MAXENTRY 128
+#define CPKTBLCACHE_MAXBYTES (16 << 20)
+#define CPKTBLCACHE_MAXPENDING 8
+#define CPK_LABEL 0x1A545352
+
+struct tblcache_filehdr {
+    unsigned magic;
+    unsigned version;
+    unsigned nr_entries;
+};
+
+struct tblcache_key {
+    DWORD size_lo, size_hi;
+    FILETIME mtime;
+    unsigned char hdrsum[20];
+    DWORD offset; // table offset in file
+    DWORD length; // bytes requested by engine
+};
+
+struct tblcache_entry {
+    struct tblcache_key key;
+    DWORD stored; // trailing zeros are not stored
+    void *data;
+    unsigned last_use;
+};
+
+// handles which header was just read from
+struct tblcache_pending {
+    HANDLE hFile;
+    struct tblcache_key key;
+};
+
+static BOOL (WINAPI *Real_ReadFile)(HANDLE, LPVOID, DWORD, LPDWORD, LPOVERLAPPED);
+
+static CRITICAL_SECTION tblcache_cs;
+static struct tblcache_entry entries[CPKTBLCACHE_MAXENTRY];
+static int nr_entries;
+static unsigned total_bytes;
+static unsigned use_clock;
+static int dirty;
+static struct tblcache_pending pending[CPKTBLCACHE_MAXPENDING];
+static unsigned nr_hit, nr_miss;
+
+static void entry_free(struct tblcache_entry *e)
+{
+    total_bytes -= e->stored;
+    free(e->data);
+    *e = entries[--nr_entries];
+}
+
+static struct tblcache_entry *entry_find(const struct tblcache_key *key)
+{
+    int i;
+    for (i = 0; i < nr_entries; i++) {
+        if (memcmp(&entries[i].key, key, sizeof(*key)) == 0) return &entries[i];
+    }
+    return NULL;
+}
+
+static void entry_add(const struct tblcache_key *key, const void *data, DWORD stored)
+{
+    struct tblcache_entry *e = entry_find(key);
+    if (e) entry_free(e);
+    if (stored > CPKTBLCACHE_MAXBYTES) return;
+
+    // evict least recently used entries
+    while (nr_entries >= CPKTBLCACHE_MAXENTRY || total_bytes + stored > CPKTBLCACHE_MAXBYTES) {
+        int i, lru = 0;
+        for (i = 1; i < nr_entries; i++) {
+            if (entries[i].last_use < entries[lru].last_use) lru = i;
+        }
+        entry_free(&entries[lru]);
+    }
+
+    void *copy = malloc(imax(stored, 1));
+    if (!copy) return;
+    memcpy(copy, data, stored);
+    e = &entries[nr_entries++];
+    e->key = *key;
+    e->stored = stored;
+    e->data = copy;
+    e->last_use = ++use_clock;
+    total_bytes += stored;
+}
+
+static int make_key(HANDLE hFile, const struct CPKHeader *hdr, struct tblcache_key *key)
+{
+    memset(key, 0, sizeof(*key));
+    key->size_lo = GetFileSize(hFile, &key->size_hi);
+    if (key->size_lo == INVALID_FILE_SIZE && GetLastError() != NO_ERROR) return 0;
+    if (!GetFileTime(hFile, NULL, NULL, &key->mtime)) return 0;
+    SHA1_CTX ctx;
+    SHA1Init(&ctx);
+    SHA1Update(&ctx, (const unsigned char *) hdr, sizeof(*hdr));
+    SHA1Final(key->hdrsum, &ctx);
+    key->offset = hdr->dwTableStart;
+    return 1;
+}
+
+static struct tblcache_pending *pending_find(HANDLE hFile)
+{
+    int i;
+    for (i = 0; i < CPKTBLCACHE_MAXPENDING; i++) {
+        if (pending[i].hFile == hFile) return &pending[i];
+    }
+    return NULL;
+}
+
+static BOOL WINAPI ReadFile_wrapper(HANDLE hFile, LPVOID lpBuffer, DWORD nNumberOfBytesToRead, LPDWORD lpNumberOfBytesRead, LPOVERLAPPED lpOverlapped)
+{
+    if (lpOverlapped || !lpNumberOfBytesRead) {
+        return Real_ReadFile(hFile, lpBuffer, nNumberOfBytesToRead, lpNumberOfBytesRead, lpOverlapped);
+    }
+
+    EnterCriticalSection(&tblcache_cs);
+    struct tblcache_pending *p = pending_find(hFile);
+    BOOL ret;
+    if (!p && nNumberOfBytesToRead != sizeof(struct CPKHeader)) {
+        LeaveCriticalSection(&tblcache_cs);
+        return Real_ReadFile(hFile, lpBuffer, nNumberOfBytesToRead, lpNumberOfBytesRead, lpOverlapped);
+    }
+    DWORD pos = SetFilePointer(hFile, 0, NULL, FILE_CURRENT);
+
+    if (p) {
+        // read after header, check if it is the table
+        struct tblcache_key key = p->key;
+        p->hFile = NULL;
+        if (pos == key.offset) {
+            key.length = nNumberOfBytesToRead;
+            struct tblcache_entry *e = entry_find(&key);
+            if (e) {
+                memcpy(lpBuffer, e->data, e->stored);
+                memset(PTRADD(lpBuffer, e->stored), 0, nNumberOfBytesToRead - e->stored);
+                SetFilePointer(hFile, pos + nNumberOfBytesToRead, NULL, FILE_BEGIN);
+                *lpNumberOfBytesRead = nNumberOfBytesToRead;
+                e->last_use = ++use_clock;
+                nr_hit++;
+                ret = TRUE;
+            } else {
+                ret = Real_ReadFile(hFile, lpBuffer, nNumberOfBytesToRead, lpNumberOfBytesRead, lpOverlapped);
+                if (ret && *lpNumberOfBytesRead == nNumberOfBytesToRead) {
+                    DWORD stored = nNumberOfBytesToRead;
+                    while (stored > 0 && ((unsigned char *) lpBuffer)[stored - 1] == 0) stored--;
+                    entry_add(&key, lpBuffer, stored);
+                    dirty = 1;
+                }
+                nr_miss++;
+            }
+            goto done;
+        }
+    }
+
+    ret = Real_ReadFile(hFile, lpBuffer, nNumberOfBytesToRead, lpNumberOfBytesRead, lpOverlapped);
+    if (ret && pos == 0 && nNumberOfBytesToRead == sizeof(struct CPKHeader) && *lpNumberOfBytesRead == sizeof(struct CPKHeader)) {
+        const struct CPKHeader *hdr = lpBuffer;
+        if (hdr->dwLable == CPK_LABEL && (p = pending_find(NULL))) {
+            if (make_key(hFile, hdr, &p->key)) p->hFile = hFile;
+        }
+    }
+done:
+    LeaveCriticalSection(&tblcache_cs);
+    return ret;
+}
+
+static void tblcache_load(void)
+{
+    FILE *fp = robust_fopen(CPKTBLCACHE_FILE, "rb");
+    if (!fp) return;
+
+    SHA1_CTX ctx;
+    unsigned char sum[20], filesum[20];
+    struct tblcache_filehdr hdr;
+    unsigned i;
+    SHA1Init(&ctx);
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1) goto bad;
+    if (hdr.magic != CPKTBLCACHE_MAGIC || hdr.version != CPKTBLCACHE_VERSION || hdr.nr_entries > CPKTBLCACHE_MAXENTRY) goto bad;
+    SHA1Update(&ctx, (const unsigned char *) &hdr, sizeof(hdr));
+    for (i = 0; i < hdr.nr_entries; i++) {
+        struct tblcache_key key;
+        DWORD stored;
+        if (fread(&key, sizeof(key), 1, fp) != 1) goto bad;
+        if (fread(&stored, sizeof(stored), 1, fp) != 1) goto bad;
+        if (stored > key.length || stored > CPKTBLCACHE_MAXBYTES) goto bad;
+        void *data = malloc(imax(stored, 1));
+        if (!data) goto bad;
+        if (fread(data, 1, stored, fp) != stored) {
+            free(data);
+            goto bad;
+        }
+        SHA1Update(&ctx, (const unsigned char *) &key, sizeof(key));
+        SHA1Update(&ctx, (const unsigned char *) &stored, sizeof(stored));
+        SHA1Update(&ctx, data, stored);
+        entry_add(&key, data, stored);
+        free(data);
+    }
+    SHA1Final(sum, &ctx);
+    if (fread(filesum, sizeof(filesum), 1, fp) != 1 || memcmp(sum, filesum, sizeof(sum)) != 0) goto bad;
+    fclose(fp);
+    return;
+bad:
+    warning("invalid cpk table cache file, ignored.");
+    while (nr_entries) entry_free(&entries[0]);
+    dirty = 1;
+    fclose(fp);
+}
+
+static void tblcache_save(void)
+{
+    EnterCriticalSection(&tblcache_cs);
+    plog("cpk table cache: %u hit, %u miss, %d entries.", nr_hit, nr_miss, nr_entries);
+    if (!dirty) goto done;
+
+    FILE *fp = robust_fopen(CPKTBLCACHE_FILE, "wb");
+    if (!fp) {
+        warning("can't write cpk table cache file.");
+        goto done;
+    }
+    SHA1_CTX ctx;
+    unsigned char sum[20];
+    struct tblcache_filehdr hdr = {
+        .magic = CPKTBLCACHE_MAGIC,
+        .version = CPKTBLCACHE_VERSION,
+        .nr_entries = nr_entries,
+    };
+    int i;
+    SHA1Init(&ctx);
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    SHA1Update(&ctx, (const unsigned char *) &hdr, sizeof(hdr));
+    for (i = 0; i < nr_entries; i++) {
+        struct tblcache_entry *e = &entries[i];
+        fwrite(&e->key, sizeof(e->key), 1, fp);
+        fwrite(&e->stored, sizeof(e->stored), 1, fp);
+        fwrite(e->data, 1, e->stored, fp);
+        SHA1Update(&ctx, (const unsigned char *) &e->key, sizeof(e->key));
+        SHA1Update(&ctx, (const unsigned char *) &e->stored, sizeof(e->stored));
+        SHA1Update(&ctx, e->data, e->stored);
+    }
+    SHA1Final(sum, &ctx);
+    fwrite(sum, sizeof(sum), 1, fp);
+    if (safe_fclose(&fp) != 0) {
+        warning("can't write cpk table cache file.");
+        robust_unlink(CPKTBLCACHE_FILE);
+    }
+done:
+    LeaveCriticalSection(&tblcache_cs);
+}
+
+MAKE_PATCHSET(cpktblcache)
+{
+    if (is_win9x()) {
+        // IAT patching is not compatible with KernelEx
+        warning("cpktblcache doesn't support win9x.");
+        return;
+    }
+    InitializeCriticalSection(&tblcache_cs);
+    tblcache_load();
+    Real_ReadFile = hook_import_table(TOPTR(gboffset + 0x10000000), "KERNEL32.DLL", "ReadFile", ReadFile_wrapper);
+    add_atexit_hook(tblcache_save);
+}
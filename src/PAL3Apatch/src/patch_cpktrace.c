@@ -0,0 +1,231 @@
+#include "common.h"
+
+// CPK access trace
+//   every CPK view map/unmap is recorded to a ring buffer,
+//   which will be written to CPKTRACE_FILE at exit
+//   see patch_common.h for file layout
+
+#define CPKTRACE_MAXNAMES 64
+#define CPKTRACE_MAXVIEWS 64
+#define CPKTRACE_MAXINDEX 8
+
+static CRITICAL_SECTION trace_cs;
+static LARGE_INTEGER trace_freq, trace_begin;
+
+static struct cpktrace_record *ring;
+static unsigned ring_size, ring_head, ring_count, ring_dropped;
+
+static char names[CPKTRACE_MAXNAMES][CPKTRACE_NAMELEN];
+static unsigned nr_names;
+
+// views which are mapped and not unmapped yet
+static struct {
+    LPCVOID base;
+    struct cpktrace_record rec;
+} views[CPKTRACE_MAXVIEWS];
+
+// table entries of a CPK, sorted by start position
+static struct {
+    struct CPK *cpk;
+    char cpkfile[sizeof(((struct CPK *) 0)->m_szCPKFileName)];
+    int *order;
+    int n;
+} tblindex[CPKTRACE_MAXINDEX];
+static unsigned tblindex_next;
+
+static LPVOID (WINAPI *MapViewOfFile_next)(HANDLE, DWORD, DWORD, DWORD, SIZE_T);
+static BOOL (WINAPI *UnmapViewOfFile_next)(LPCVOID);
+
+static unsigned long long trace_now(void)
+{
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return (t.QuadPart - trace_begin.QuadPart) * 1000000 / trace_freq.QuadPart;
+}
+
+static unsigned trace_nameid(const char *cpkfile)
+{
+    const char *separator = strrchr(cpkfile, '\\');
+    const char *name = separator ? separator + 1 : cpkfile;
+    unsigned i;
+    for (i = 0; i < nr_names; i++) {
+        if (stricmp(names[i], name) == 0) return i;
+    }
+    if (nr_names >= CPKTRACE_MAXNAMES) return CPKTRACE_MAXNAMES - 1;
+    snprintf(names[nr_names], CPKTRACE_NAMELEN, "%s", name);
+    return nr_names++;
+}
+
+static struct CPK *sort_cpk;
+static int tblorder_cmp(const void *a, const void *b)
+{
+    ULONG x = sort_cpk->m_CPKTable[*(const int *) a].dwStartPos;
+    ULONG y = sort_cpk->m_CPKTable[*(const int *) b].dwStartPos;
+    return x < y ? -1 : x > y;
+}
+
+static int trace_findentry(struct CPK *cpk, DWORD offset, DWORD size)
+{
+    unsigned i;
+    int j;
+    for (i = 0; i < CPKTRACE_MAXINDEX; i++) {
+        if (tblindex[i].cpk == cpk && strcmp(tblindex[i].cpkfile, cpk->m_szCPKFileName) == 0) break;
+    }
+    if (i >= CPKTRACE_MAXINDEX) {
+        i = tblindex_next++ % CPKTRACE_MAXINDEX;
+        free(tblindex[i].order);
+        tblindex[i].cpk = cpk;
+        strcpy(tblindex[i].cpkfile, cpk->m_szCPKFileName);
+        tblindex[i].n = imin(cpk->m_CPKHeader.dwValidTableNum, sizeof(cpk->m_CPKTable) / sizeof(cpk->m_CPKTable[0]));
+        tblindex[i].order = malloc(imax(tblindex[i].n, 1) * sizeof(int));
+        if (!tblindex[i].order) {
+            tblindex[i].cpk = NULL;
+            return -1;
+        }
+        for (j = 0; j < tblindex[i].n; j++) tblindex[i].order[j] = j;
+        sort_cpk = cpk;
+        qsort(tblindex[i].order, tblindex[i].n, sizeof(int), tblorder_cmp);
+    }
+
+    // views may be aligned down to allocation granularity
+    // so find the entries starting in range, and prefer the one ends with the view
+    int *order = tblindex[i].order;
+    int lo = 0, hi = tblindex[i].n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cpk->m_CPKTable[order[mid]].dwStartPos < offset) lo = mid + 1; else hi = mid;
+    }
+    int found = -1;
+    for (j = lo; j < tblindex[i].n; j++) {
+        struct CPKTable *tbl = &cpk->m_CPKTable[order[j]];
+        if (tbl->dwStartPos - offset >= size) break;
+        if (found < 0) found = order[j];
+        if (tbl->dwStartPos + tbl->dwPackedSize == offset + size || tbl->dwStartPos + tbl->dwPackedSize + tbl->dwExtraInfoSize == offset + size) {
+            found = order[j];
+            break;
+        }
+    }
+    return found;
+}
+
+static void trace_push(const struct cpktrace_record *rec)
+{
+    ring[(ring_head + ring_count) % ring_size] = *rec;
+    if (ring_count < ring_size) {
+        ring_count++;
+    } else {
+        ring_head = (ring_head + 1) % ring_size;
+        ring_dropped++;
+    }
+}
+
+static LPVOID WINAPI MapViewOfFile_trace(HANDLE hFileMappingObject, DWORD dwDesiredAccess, DWORD dwFileOffsetHigh, DWORD dwFileOffsetLow, SIZE_T dwNumberOfBytesToMap)
+{
+    unsigned long long t = trace_now();
+    LPVOID ret = MapViewOfFile_next(hFileMappingObject, dwDesiredAccess, dwFileOffsetHigh, dwFileOffsetLow, dwNumberOfBytesToMap);
+    unsigned long long t2 = trace_now();
+
+    EnterCriticalSection(&trace_cs);
+    struct cpktrace_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.timestamp = t;
+    rec.type = CPKTRACE_MAP;
+    rec.tblidx = -1;
+    rec.offset = dwFileOffsetLow;
+    rec.size = dwNumberOfBytesToMap;
+    rec.latency = t2 - t;
+
+    struct CPK *cpk = vfs_findcpk_mapping(hFileMappingObject);
+    if (cpk) {
+        rec.cpkid = trace_nameid(cpk->m_szCPKFileName);
+        rec.tblidx = trace_findentry(cpk, dwFileOffsetLow, dwNumberOfBytesToMap);
+        if (rec.tblidx >= 0) rec.crc = cpk->m_CPKTable[rec.tblidx].dwCRC;
+    } else {
+        rec.cpkid = trace_nameid(vfs_cpkname());
+    }
+    trace_push(&rec);
+
+    if (ret) {
+        int i;
+        for (i = 0; i < CPKTRACE_MAXVIEWS; i++) {
+            if (!views[i].base) {
+                views[i].base = ret;
+                views[i].rec = rec;
+                break;
+            }
+        }
+    }
+    LeaveCriticalSection(&trace_cs);
+    return ret;
+}
+
+static BOOL WINAPI UnmapViewOfFile_trace(LPCVOID lpBaseAddress)
+{
+    unsigned long long t = trace_now();
+    BOOL ret = UnmapViewOfFile_next(lpBaseAddress);
+    unsigned long long t2 = trace_now();
+
+    EnterCriticalSection(&trace_cs);
+    int i;
+    for (i = 0; i < CPKTRACE_MAXVIEWS; i++) {
+        if (views[i].base && views[i].base == lpBaseAddress) {
+            struct cpktrace_record rec = views[i].rec;
+            rec.timestamp = t;
+            rec.type = CPKTRACE_UNMAP;
+            rec.latency = t2 - t;
+            trace_push(&rec);
+            views[i].base = NULL;
+            break;
+        }
+    }
+    LeaveCriticalSection(&trace_cs);
+    return ret;
+}
+
+static void trace_flush(void)
+{
+    EnterCriticalSection(&trace_cs);
+    FILE *fp = robust_fopen(CPKTRACE_FILE, "wb");
+    if (fp) {
+        struct cpktrace_header hdr = {
+            .magic = CPKTRACE_MAGIC,
+            .version = CPKTRACE_VERSION,
+            .nr_names = nr_names,
+            .nr_records = ring_count,
+            .nr_dropped = ring_dropped,
+        };
+        fwrite(&hdr, sizeof(hdr), 1, fp);
+        fwrite(names, CPKTRACE_NAMELEN, nr_names, fp);
+        unsigned first = imin(ring_count, ring_size - ring_head);
+        fwrite(ring + ring_head, sizeof(struct cpktrace_record), first, fp);
+        fwrite(ring, sizeof(struct cpktrace_record), ring_count - first, fp);
+        fclose(fp);
+        plog("cpk trace: %u records written, %u dropped.", ring_count, ring_dropped);
+    } else {
+        warning("can't write cpk trace file '%s'.", CPKTRACE_FILE);
+    }
+    LeaveCriticalSection(&trace_cs);
+}
+
+MAKE_PATCHSET(cpktrace)
+{
+    ring_size = imax(flag, 0);
+    if (!ring_size) return;
+    if (!QueryPerformanceFrequency(&trace_freq)) {
+        warning("can't query performance frequency, cpk trace disabled.");
+        return;
+    }
+    QueryPerformanceCounter(&trace_begin);
+
+    ring = malloc(ring_size * sizeof(struct cpktrace_record));
+    if (!ring) fail("can't allocate cpk trace buffer.");
+    InitializeCriticalSection(&trace_cs);
+
+    // chain to current targets, since nommapcpk may have patched these calls
+    MapViewOfFile_next = TOPTR(get_wrapper_branch_jtarget(gboffset + 0x1002B332));
+    UnmapViewOfFile_next = TOPTR(get_wrapper_branch_jtarget(gboffset + 0x1002B354));
+    make_wrapper_branch(gboffset + 0x1002B332, MapViewOfFile_trace);
+    make_wrapper_branch(gboffset + 0x1002B354, UnmapViewOfFile_trace);
+
+    add_atexit_hook(trace_flush);
+}
@@ -0,0 +1,176 @@
+#include "common.h"
+
+// Direct3D 9Ex device
+//   Direct3DCreate9() in GBENGINE's IAT is replaced by Direct3DCreate9Ex(),
+//   and the device is created by CreateDeviceEx()
+//   a 9Ex device is not lost in windowed mode, and allows frame latency control
+//   and flip-ex swap effect (flag = 2, windowed only)
+//
+//   9Ex doesn't support D3DPOOL_MANAGED, so resources in managed pool
+//   are created in default pool, textures are made dynamic for locking
+//   we patch vtables by giving the objects a modified copy of their vtable
+
+#define D3D9EX_FLIPEX 2
+
+static int flipex_enabled;
+static int max_frame_latency;
+
+static IDirect3D9 *(WINAPI *Real_Direct3DCreate9)(UINT);
+static HRESULT (WINAPI *myDirect3DCreate9Ex)(UINT, IDirect3D9Ex **);
+
+static IDirect3D9ExVtbl d3d9ex_vtbl;
+static IDirect3DDevice9ExVtbl device_vtbl;
+static HRESULT (STDMETHODCALLTYPE *Real_CreateDevice)(IDirect3D9Ex *, UINT, D3DDEVTYPE, HWND, DWORD, D3DPRESENT_PARAMETERS *, IDirect3DDevice9 **);
+static HRESULT (STDMETHODCALLTYPE *Real_TestCooperativeLevel)(IDirect3DDevice9Ex *);
+static HRESULT (STDMETHODCALLTYPE *Real_Reset)(IDirect3DDevice9Ex *, D3DPRESENT_PARAMETERS *);
+static HRESULT (STDMETHODCALLTYPE *Real_CreateTexture)(IDirect3DDevice9Ex *, UINT, UINT, UINT, DWORD, D3DFORMAT, D3DPOOL, IDirect3DTexture9 **, HANDLE *);
+static HRESULT (STDMETHODCALLTYPE *Real_CreateVolumeTexture)(IDirect3DDevice9Ex *, UINT, UINT, UINT, UINT, DWORD, D3DFORMAT, D3DPOOL, IDirect3DVolumeTexture9 **, HANDLE *);
+static HRESULT (STDMETHODCALLTYPE *Real_CreateCubeTexture)(IDirect3DDevice9Ex *, UINT, UINT, DWORD, D3DFORMAT, D3DPOOL, IDirect3DCubeTexture9 **, HANDLE *);
+static HRESULT (STDMETHODCALLTYPE *Real_CreateVertexBuffer)(IDirect3DDevice9Ex *, UINT, DWORD, DWORD, D3DPOOL, IDirect3DVertexBuffer9 **, HANDLE *);
+static HRESULT (STDMETHODCALLTYPE *Real_CreateIndexBuffer)(IDirect3DDevice9Ex *, UINT, DWORD, D3DFORMAT, D3DPOOL, IDirect3DIndexBuffer9 **, HANDLE *);
+
+static void adjust_present_params(D3DPRESENT_PARAMETERS *pp)
+{
+    static int warned = 0;
+    if (!flipex_enabled || !pp->Windowed) return;
+    if (pp->MultiSampleType != D3DMULTISAMPLE_NONE || (pp->Flags & D3DPRESENTFLAG_LOCKABLE_BACKBUFFER)) {
+        // flip-ex requires no multisample and no lockable backbuffer
+        if (!warned) warning("flip-ex swap effect is not compatible with multisample or lockable backbuffer.");
+        warned = 1;
+        return;
+    }
+    pp->SwapEffect = D3DSWAPEFFECT_FLIPEX;
+    pp->BackBufferCount = imax(pp->BackBufferCount, 2);
+}
+
+static HRESULT STDMETHODCALLTYPE TestCooperativeLevel_wrapper(IDirect3DDevice9Ex *This)
+{
+    // 9Ex may return success codes like S_PRESENT_OCCLUDED, which are not lost device
+    HRESULT hr = Real_TestCooperativeLevel(This);
+    return SUCCEEDED(hr) ? D3D_OK : hr;
+}
+static HRESULT STDMETHODCALLTYPE Reset_wrapper(IDirect3DDevice9Ex *This, D3DPRESENT_PARAMETERS *pPresentationParameters)
+{
+    adjust_present_params(pPresentationParameters);
+    return Real_Reset(This, pPresentationParameters);
+}
+
+static HRESULT STDMETHODCALLTYPE CreateTexture_wrapper(IDirect3DDevice9Ex *This, UINT Width, UINT Height, UINT Levels, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DTexture9 **ppTexture, HANDLE *pSharedHandle)
+{
+    if (Pool == D3DPOOL_MANAGED) {
+        HRESULT hr = Real_CreateTexture(This, Width, Height, Levels, Usage | D3DUSAGE_DYNAMIC, Format, D3DPOOL_DEFAULT, ppTexture, pSharedHandle);
+        if (SUCCEEDED(hr)) return hr;
+        Pool = D3DPOOL_DEFAULT;
+    }
+    return Real_CreateTexture(This, Width, Height, Levels, Usage, Format, Pool, ppTexture, pSharedHandle);
+}
+static HRESULT STDMETHODCALLTYPE CreateVolumeTexture_wrapper(IDirect3DDevice9Ex *This, UINT Width, UINT Height, UINT Depth, UINT Levels, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DVolumeTexture9 **ppVolumeTexture, HANDLE *pSharedHandle)
+{
+    if (Pool == D3DPOOL_MANAGED) {
+        HRESULT hr = Real_CreateVolumeTexture(This, Width, Height, Depth, Levels, Usage | D3DUSAGE_DYNAMIC, Format, D3DPOOL_DEFAULT, ppVolumeTexture, pSharedHandle);
+        if (SUCCEEDED(hr)) return hr;
+        Pool = D3DPOOL_DEFAULT;
+    }
+    return Real_CreateVolumeTexture(This, Width, Height, Depth, Levels, Usage, Format, Pool, ppVolumeTexture, pSharedHandle);
+}
+static HRESULT STDMETHODCALLTYPE CreateCubeTexture_wrapper(IDirect3DDevice9Ex *This, UINT EdgeLength, UINT Levels, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DCubeTexture9 **ppCubeTexture, HANDLE *pSharedHandle)
+{
+    if (Pool == D3DPOOL_MANAGED) {
+        HRESULT hr = Real_CreateCubeTexture(This, EdgeLength, Levels, Usage | D3DUSAGE_DYNAMIC, Format, D3DPOOL_DEFAULT, ppCubeTexture, pSharedHandle);
+        if (SUCCEEDED(hr)) return hr;
+        Pool = D3DPOOL_DEFAULT;
+    }
+    return Real_CreateCubeTexture(This, EdgeLength, Levels, Usage, Format, Pool, ppCubeTexture, pSharedHandle);
+}
+static HRESULT STDMETHODCALLTYPE CreateVertexBuffer_wrapper(IDirect3DDevice9Ex *This, UINT Length, DWORD Usage, DWORD FVF, D3DPOOL Pool, IDirect3DVertexBuffer9 **ppVertexBuffer, HANDLE *pSharedHandle)
+{
+    // buffers in default pool are lockable, no need to be dynamic
+    if (Pool == D3DPOOL_MANAGED) Pool = D3DPOOL_DEFAULT;
+    return Real_CreateVertexBuffer(This, Length, Usage, FVF, Pool, ppVertexBuffer, pSharedHandle);
+}
+static HRESULT STDMETHODCALLTYPE CreateIndexBuffer_wrapper(IDirect3DDevice9Ex *This, UINT Length, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DIndexBuffer9 **ppIndexBuffer, HANDLE *pSharedHandle)
+{
+    if (Pool == D3DPOOL_MANAGED) Pool = D3DPOOL_DEFAULT;
+    return Real_CreateIndexBuffer(This, Length, Usage, Format, Pool, ppIndexBuffer, pSharedHandle);
+}
+
+static void hook_device(IDirect3DDevice9Ex *dev)
+{
+    device_vtbl = *dev->lpVtbl;
+    
+    Real_TestCooperativeLevel = device_vtbl.TestCooperativeLevel;
+    Real_Reset = device_vtbl.Reset;
+    Real_CreateTexture = device_vtbl.CreateTexture;
+    Real_CreateVolumeTexture = device_vtbl.CreateVolumeTexture;
+    Real_CreateCubeTexture = device_vtbl.CreateCubeTexture;
+    Real_CreateVertexBuffer = device_vtbl.CreateVertexBuffer;
+    Real_CreateIndexBuffer = device_vtbl.CreateIndexBuffer;
+    
+    device_vtbl.TestCooperativeLevel = TestCooperativeLevel_wrapper;
+    device_vtbl.Reset = Reset_wrapper;
+    device_vtbl.CreateTexture = CreateTexture_wrapper;
+    device_vtbl.CreateVolumeTexture = CreateVolumeTexture_wrapper;
+    device_vtbl.CreateCubeTexture = CreateCubeTexture_wrapper;
+    device_vtbl.CreateVertexBuffer = CreateVertexBuffer_wrapper;
+    device_vtbl.CreateIndexBuffer = CreateIndexBuffer_wrapper;
+    
+    dev->lpVtbl = &device_vtbl;
+}
+
+static HRESULT STDMETHODCALLTYPE CreateDevice_wrapper(IDirect3D9Ex *This, UINT Adapter, D3DDEVTYPE DeviceType, HWND hFocusWindow, DWORD BehaviorFlags, D3DPRESENT_PARAMETERS *pPresentationParameters, IDirect3DDevice9 **ppReturnedDeviceInterface)
+{
+    IDirect3DDevice9Ex *dev;
+    D3DDISPLAYMODEEX mode;
+    D3DPRESENT_PARAMETERS *pp = pPresentationParameters;
+    
+    adjust_present_params(pp);
+    memset(&mode, 0, sizeof(mode));
+    mode.Size = sizeof(mode);
+    mode.Width = pp->BackBufferWidth;
+    mode.Height = pp->BackBufferHeight;
+    mode.RefreshRate = pp->FullScreen_RefreshRateInHz;
+    mode.Format = pp->BackBufferFormat;
+    mode.ScanLineOrdering = D3DSCANLINEORDERING_PROGRESSIVE;
+    
+    HRESULT hr = IDirect3D9Ex_CreateDeviceEx(This, Adapter, DeviceType, hFocusWindow, BehaviorFlags, pp, pp->Windowed ? NULL : &mode, &dev);
+    if (FAILED(hr)) {
+        warning("can't create Direct3D 9Ex device, error %08X.", (unsigned) hr);
+        return Real_CreateDevice(This, Adapter, DeviceType, hFocusWindow, BehaviorFlags, pp, ppReturnedDeviceInterface);
+    }
+    
+    if (max_frame_latency > 0) {
+        IDirect3DDevice9Ex_SetMaximumFrameLatency(dev, max_frame_latency);
+    }
+    hook_device(dev);
+    *ppReturnedDeviceInterface = (IDirect3DDevice9 *) dev;
+    plog("using Direct3D 9Ex device, swap effect %d.", (int) pp->SwapEffect);
+    return hr;
+}
+
+static IDirect3D9 *WINAPI Direct3DCreate9_wrapper(UINT SDKVersion)
+{
+    IDirect3D9Ex *d3d9ex;
+    if (FAILED(myDirect3DCreate9Ex(SDKVersion, &d3d9ex))) {
+        warning("can't create Direct3D 9Ex object.");
+        return Real_Direct3DCreate9(SDKVersion);
+    }
+    d3d9ex_vtbl = *d3d9ex->lpVtbl;
+    Real_CreateDevice = d3d9ex_vtbl.CreateDevice;
+    d3d9ex_vtbl.CreateDevice = CreateDevice_wrapper;
+    d3d9ex->lpVtbl = &d3d9ex_vtbl;
+    return (IDirect3D9 *) d3d9ex;
+}
+
+MAKE_PATCHSET(d3d9ex)
+{
+    myDirect3DCreate9Ex = (void *) GetProcAddress(GetModuleHandle("D3D9.DLL"), "Direct3DCreate9Ex");
+    if (!myDirect3DCreate9Ex) {
+        // Direct3DCreate9Ex() is available since Windows Vista
+        warning("Direct3D 9Ex is not supported on this system.");
+        return;
+    }
+    flipex_enabled = flag == D3D9EX_FLIPEX;
+    max_frame_latency = imin(get_int_from_configfile("d3d9ex_maxframelatency"), 20);
+    
+    Real_Direct3DCreate9 = hook_import_table(TOPTR(gboffset + 0x10000000), "D3D9.DLL", "Direct3DCreate9", Direct3DCreate9_wrapper);
+}
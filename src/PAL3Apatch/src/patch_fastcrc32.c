@@ -0,0 +1,70 @@
+#include "common.h"
+
+// fast gbCrc32
+//   gbCrc32Compute() is called for every resource name and every CPK lookup,
+//   engine processes one byte per step: x = CrcTbl[x >> 24] ^ (c | (x << 8))
+//   (first 4 bytes are loaded as initial state, MSB first, padded with zero)
+//   each step is linear, so 8 steps can be done at once with 8 tables (slice-by-8):
+//     state bytes go through 8..5 more steps, data bytes through 4..1, last 4 are just xored
+//   crc_tbl[n][b] is the state after n + 1 steps starting from b << 24 with zero data
+//   results are bit-exact with engine's implementation
+
+static unsigned crc_tbl[8][0x100];
+
+static void fastcrc32_init(void)
+{
+    unsigned i, j, v;
+    for (i = 0; i < 0x100; i++) {
+        v = i << 24;
+        for (j = 0; j < 8; j++) {
+            v = (v & 0x80000000) ? (v << 1) ^ 0x04C11DB7 : (v << 1);
+        }
+        crc_tbl[0][i] = v;
+    }
+    for (i = 1; i < 8; i++) {
+        for (j = 0; j < 0x100; j++) {
+            v = crc_tbl[i - 1][j];
+            crc_tbl[i][j] = crc_tbl[0][v >> 24] ^ (v << 8);
+        }
+    }
+}
+
+static unsigned fastcrc32_block(const char *str, int size)
+{
+    const unsigned char *s = (const unsigned char *) str;
+    unsigned x = 0;
+    int i;
+    for (i = 0; i < 4; i++) {
+        x <<= 8;
+        if (i < size) x |= *s++;
+    }
+    x = ~x;
+    size -= 4;
+    while (size >= 8) {
+        x = crc_tbl[7][x >> 24] ^ crc_tbl[6][(x >> 16) & 0xFF] ^ crc_tbl[5][(x >> 8) & 0xFF] ^ crc_tbl[4][x & 0xFF]
+          ^ crc_tbl[3][s[0]] ^ crc_tbl[2][s[1]] ^ crc_tbl[1][s[2]] ^ crc_tbl[0][s[3]]
+          ^ ((unsigned) s[4] << 24 | (unsigned) s[5] << 16 | (unsigned) s[6] << 8 | s[7]);
+        s += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        x = crc_tbl[0][x >> 24] ^ (*s++ | (x << 8));
+    }
+    return ~x;
+}
+
+static unsigned fastcrc32_string(const char *str)
+{
+    // string version stops at first NUL, including the first 4 bytes
+    return fastcrc32_block(str, strlen(str));
+}
+
+MAKE_PATCHSET(fastcrc32)
+{
+    fastcrc32_init();
+    make_jmp(gboffset + 0x10026710, fastcrc32_string);
+    
+    // block version is found by its exported name
+    void *blockfunc = GetProcAddress(GetModuleHandle("GBENGINE.DLL"), "?gbCrc32Compute@@YAIPBDH@Z");
+    if (blockfunc) make_jmp(TOUINT(blockfunc), fastcrc32_block);
+}
@@ -0,0 +1,214 @@
+#include "common.h"
+
+// redundant Direct3D 9 state filter
+//   SetRenderState(), SetTextureStageState(), SetSamplerState() and SetTexture()
+//   are compared with a shadow copy of device state, calls which change nothing are dropped
+//   we patch the device vtable by giving it a modified copy of its vtable
+//
+//   the shadow copy is invalidated when
+//     device is reset, since all states are set to defaults
+//     a state block is applied, state blocks are also given a modified vtable
+//   calls between BeginStateBlock() and EndStateBlock() are always passed,
+//   since they are recorded instead of being applied
+
+#define SF_MAXRS 256
+#define SF_MAXSTAGE 8
+#define SF_MAXTSS 33
+#define SF_MAXSAMPLER 16
+#define SF_MAXSS 14
+
+struct sf_shadow {
+    DWORD rs[SF_MAXRS];
+    DWORD tss[SF_MAXSTAGE][SF_MAXTSS];
+    DWORD ss[SF_MAXSAMPLER][SF_MAXSS];
+    IDirect3DBaseTexture9 *tex[SF_MAXSAMPLER];
+    
+    // non-zero if value above is known
+    unsigned char rs_valid[SF_MAXRS];
+    unsigned char tss_valid[SF_MAXSTAGE][SF_MAXTSS];
+    unsigned char ss_valid[SF_MAXSAMPLER][SF_MAXSS];
+    unsigned char tex_valid[SF_MAXSAMPLER];
+};
+
+static struct sf_shadow shadow;
+static int recording;
+static int disabled;
+static unsigned nr_passed, nr_filtered;
+
+
+// big enough for both IDirect3DDevice9 and IDirect3DDevice9Ex
+static IDirect3DDevice9ExVtbl device_vtbl;
+static IDirect3DStateBlock9Vtbl stateblock_vtbl;
+static const IDirect3DStateBlock9Vtbl *orig_stateblock_vtbl;
+
+static HRESULT (STDMETHODCALLTYPE *Real_Reset)(IDirect3DDevice9 *, D3DPRESENT_PARAMETERS *);
+static HRESULT (STDMETHODCALLTYPE *Real_SetRenderState)(IDirect3DDevice9 *, D3DRENDERSTATETYPE, DWORD);
+static HRESULT (STDMETHODCALLTYPE *Real_SetTextureStageState)(IDirect3DDevice9 *, DWORD, D3DTEXTURESTAGESTATETYPE, DWORD);
+static HRESULT (STDMETHODCALLTYPE *Real_SetSamplerState)(IDirect3DDevice9 *, DWORD, D3DSAMPLERSTATETYPE, DWORD);
+static HRESULT (STDMETHODCALLTYPE *Real_SetTexture)(IDirect3DDevice9 *, DWORD, IDirect3DBaseTexture9 *);
+static HRESULT (STDMETHODCALLTYPE *Real_CreateStateBlock)(IDirect3DDevice9 *, D3DSTATEBLOCKTYPE, IDirect3DStateBlock9 **);
+static HRESULT (STDMETHODCALLTYPE *Real_BeginStateBlock)(IDirect3DDevice9 *);
+static HRESULT (STDMETHODCALLTYPE *Real_EndStateBlock)(IDirect3DDevice9 *, IDirect3DStateBlock9 **);
+static HRESULT (STDMETHODCALLTYPE *Real_Apply)(IDirect3DStateBlock9 *);
+
+static void invalidate_shadow(void)
+{
+    memset(&shadow, 0, sizeof(shadow));
+}
+
+static HRESULT STDMETHODCALLTYPE Apply_wrapper(IDirect3DStateBlock9 *This)
+{
+    HRESULT hr = Real_Apply(This);
+    invalidate_shadow();
+    return hr;
+}
+
+static void hook_stateblock(IDirect3DStateBlock9 *sb)
+{
+    if (sb->lpVtbl == &stateblock_vtbl) return;
+    if (!orig_stateblock_vtbl) {
+        orig_stateblock_vtbl = sb->lpVtbl;
+        stateblock_vtbl = *sb->lpVtbl;
+        Real_Apply = stateblock_vtbl.Apply;
+        stateblock_vtbl.Apply = Apply_wrapper;
+    }
+    if (sb->lpVtbl != orig_stateblock_vtbl) {
+        // we can't see when this one is applied
+        warning("unknown state block vtable, d3d state filter disabled.");
+        disabled = 1;
+        return;
+    }
+    sb->lpVtbl = &stateblock_vtbl;
+}
+
+static HRESULT STDMETHODCALLTYPE Reset_wrapper(IDirect3DDevice9 *This, D3DPRESENT_PARAMETERS *pPresentationParameters)
+{
+    HRESULT hr = Real_Reset(This, pPresentationParameters);
+    invalidate_shadow();
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE SetRenderState_wrapper(IDirect3DDevice9 *This, D3DRENDERSTATETYPE State, DWORD Value)
+{
+    unsigned i = State;
+    if (recording || disabled || i >= SF_MAXRS) return Real_SetRenderState(This, State, Value);
+    if (shadow.rs_valid[i] && shadow.rs[i] == Value) {
+        nr_filtered++;
+        return D3D_OK;
+    }
+    nr_passed++;
+    HRESULT hr = Real_SetRenderState(This, State, Value);
+    shadow.rs[i] = Value;
+    shadow.rs_valid[i] = SUCCEEDED(hr);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE SetTextureStageState_wrapper(IDirect3DDevice9 *This, DWORD Stage, D3DTEXTURESTAGESTATETYPE Type, DWORD Value)
+{
+    unsigned i = Type;
+    if (recording || disabled || Stage >= SF_MAXSTAGE || i >= SF_MAXTSS) return Real_SetTextureStageState(This, Stage, Type, Value);
+    if (shadow.tss_valid[Stage][i] && shadow.tss[Stage][i] == Value) {
+        nr_filtered++;
+        return D3D_OK;
+    }
+    nr_passed++;
+    HRESULT hr = Real_SetTextureStageState(This, Stage, Type, Value);
+    shadow.tss[Stage][i] = Value;
+    shadow.tss_valid[Stage][i] = SUCCEEDED(hr);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE SetSamplerState_wrapper(IDirect3DDevice9 *This, DWORD Sampler, D3DSAMPLERSTATETYPE Type, DWORD Value)
+{
+    unsigned i = Type;
+    if (recording || disabled || Sampler >= SF_MAXSAMPLER || i >= SF_MAXSS) return Real_SetSamplerState(This, Sampler, Type, Value);
+    if (shadow.ss_valid[Sampler][i] && shadow.ss[Sampler][i] == Value) {
+        nr_filtered++;
+        return D3D_OK;
+    }
+    nr_passed++;
+    HRESULT hr = Real_SetSamplerState(This, Sampler, Type, Value);
+    shadow.ss[Sampler][i] = Value;
+    shadow.ss_valid[Sampler][i] = SUCCEEDED(hr);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE SetTexture_wrapper(IDirect3DDevice9 *This, DWORD Stage, IDirect3DBaseTexture9 *pTexture)
+{
+    // bound textures are referenced by device, so pointers can't be reused while bound
+    if (recording || disabled || Stage >= SF_MAXSAMPLER) return Real_SetTexture(This, Stage, pTexture);
+    if (shadow.tex_valid[Stage] && shadow.tex[Stage] == pTexture) {
+        nr_filtered++;
+        return D3D_OK;
+    }
+    nr_passed++;
+    HRESULT hr = Real_SetTexture(This, Stage, pTexture);
+    shadow.tex[Stage] = pTexture;
+    shadow.tex_valid[Stage] = SUCCEEDED(hr);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE CreateStateBlock_wrapper(IDirect3DDevice9 *This, D3DSTATEBLOCKTYPE Type, IDirect3DStateBlock9 **ppSB)
+{
+    HRESULT hr = Real_CreateStateBlock(This, Type, ppSB);
+    if (SUCCEEDED(hr)) hook_stateblock(*ppSB);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE BeginStateBlock_wrapper(IDirect3DDevice9 *This)
+{
+    HRESULT hr = Real_BeginStateBlock(This);
+    if (SUCCEEDED(hr)) recording = 1;
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE EndStateBlock_wrapper(IDirect3DDevice9 *This, IDirect3DStateBlock9 **ppSB)
+{
+    HRESULT hr = Real_EndStateBlock(This, ppSB);
+    recording = 0;
+    if (SUCCEEDED(hr)) hook_stateblock(*ppSB);
+    return hr;
+}
+
+static void hook_device(void)
+{
+    IDirect3DDevice9 *dev = GB_GfxMgr->m_pd3dDevice;
+    IDirect3DDevice9Vtbl *vtbl = (IDirect3DDevice9Vtbl *) &device_vtbl;
+    
+    if (!dev || dev->lpVtbl == vtbl) return;
+    
+    patch_device_vtable(dev, &device_vtbl);
+    
+    Real_Reset = vtbl->Reset;
+    Real_SetRenderState = vtbl->SetRenderState;
+    Real_SetTextureStageState = vtbl->SetTextureStageState;
+    Real_SetSamplerState = vtbl->SetSamplerState;
+    Real_SetTexture = vtbl->SetTexture;
+    Real_CreateStateBlock = vtbl->CreateStateBlock;
+    Real_BeginStateBlock = vtbl->BeginStateBlock;
+    Real_EndStateBlock = vtbl->EndStateBlock;
+    
+    vtbl->Reset = Reset_wrapper;
+    vtbl->SetRenderState = SetRenderState_wrapper;
+    vtbl->SetTextureStageState = SetTextureStageState_wrapper;
+    vtbl->SetSamplerState = SetSamplerState_wrapper;
+    vtbl->SetTexture = SetTexture_wrapper;
+    vtbl->CreateStateBlock = CreateStateBlock_wrapper;
+    vtbl->BeginStateBlock = BeginStateBlock_wrapper;
+    vtbl->EndStateBlock = EndStateBlock_wrapper;
+    
+    invalidate_shadow();
+    dev->lpVtbl = vtbl;
+}
+
+static void report_filtered(void)
+{
+    plog("d3d state filter: %u passed, %u filtered.", nr_passed, nr_filtered);
+}
+
+MAKE_PATCHSET(filterd3dstate)
+{
+    // run first, so state blocks created by other post-create hooks are also seen
+    add_hook_ex(HOOKID_POSTD3DCREATE, hook_device, HOOK_PRIORITY_FIRST);
+    add_atexit_hook(report_filtered);
+}
@@ -25,7 +25,44 @@ static void post_UIBigMap(struct UIWnd *this)
     fixui_popstate();
 }
 
-static MAKE_UIWND_RENDER_WRAPPER_CUSTOM(UIBigMap_Render_wrapper, 0x0044EE44, pre_UIBigMap, post_UIBigMap)
+// big map is cached as a ui layer (see uilayercache in config)
+//   moving spirit and dialogs are hidden while rendering the layer, and rendered after it
+//   so only map, elements themselves and fading decide if layer is still valid
+#define UIBigMap_Render(this) THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(0x0044EE44, void, struct UIBigMap *), this)
+static struct uilayer bigmap_layer;
+static struct UIBigMap bigmap_state;
+
+static MAKE_THISCALL(void, UIBigMap_Render_wrapper, struct UIBigMap *this)
+{
+    pre_UIBigMap(pUIWND(this));
+    if (uilayer_enabled) {
+        struct UIWnd *dyn[] = { pUIWND(&this->m_spirit), pUIWND(&this->m_Answer), pUIWND(&this->m_Msg) };
+        int visible[sizeof(dyn) / sizeof(dyn[0])];
+        unsigned i;
+        
+        // state of static part
+        bigmap_state = *this;
+        memset(&bigmap_state.m_spiritRect, 0, (char *) &bigmap_state.m_curElement - (char *) &bigmap_state.m_spiritRect);
+        memset(&bigmap_state.m_Answer, 0, (char *) &bigmap_state.scnname - (char *) &bigmap_state.m_Answer);
+        bigmap_state.m_alphatime = 0;
+        
+        for (i = 0; i < sizeof(dyn) / sizeof(dyn[0]); i++) {
+            visible[i] = dyn[i]->m_bvisible;
+            dyn[i]->m_bvisible = 0;
+        }
+        if (uilayer_begin(&bigmap_layer, &bigmap_state, sizeof(bigmap_state))) {
+            UIBigMap_Render(this);
+            uilayer_end(&bigmap_layer);
+        }
+        for (i = 0; i < sizeof(dyn) / sizeof(dyn[0]); i++) {
+            dyn[i]->m_bvisible = visible[i];
+            if (visible[i]) UIWnd_vfptr_Render(dyn[i]);
+        }
+    } else {
+        UIBigMap_Render(this);
+    }
+    post_UIBigMap(pUIWND(this));
+}
 static MAKE_UIWND_UPDATE_WRAPPER_CUSTOM(UIBigMap_Update_wrapper, 0x0044F124, pre_UIBigMap, post_UIBigMap)
 
 MAKE_PATCHSET(fixbigmap)
@@ -7,6 +7,41 @@
 
 static int ccbui_dstrect_type;
 
+// combat layout cache
+//   results computed from a fixed input are cached per call site, and are only
+//   recomputed when game rect, combat rect or combat scale factor changes
+struct cb_layout {
+    int valid;
+    RECT in, out;
+    fRECT src_frect, dst_frect;
+    double len_factor;
+};
+static int cb_layout_hit(struct cb_layout *c, const RECT *in)
+{
+    fRECT *src_frect = &game_frect;
+    fRECT *dst_frect = get_ptag_frect(ccbui_dstrect_type);
+    if (c->valid && c->len_factor == cb_scalefactor && memcmp(&c->in, in, sizeof(RECT)) == 0
+     && memcmp(&c->src_frect, src_frect, sizeof(fRECT)) == 0
+     && memcmp(&c->dst_frect, dst_frect, sizeof(fRECT)) == 0) {
+        return 1;
+    }
+    c->valid = 0;
+    c->in = *in;
+    c->src_frect = *src_frect;
+    c->dst_frect = *dst_frect;
+    c->len_factor = cb_scalefactor;
+    return 0;
+}
+
+// spec state icon layout of monsters, see CCBUI_Render()
+//   visible icons change with party and monster composition, so they are part of the key
+//   icons are only moved if they are not at cached positions
+struct cb_icon_layout {
+    unsigned mask;
+    POINT pos[19];
+};
+static struct cb_icon_layout cb_icon_cache[11];
+
 // patch C2DSpark, only size is changed, position is not changed
 // FIXME: there may be better ways to do the same job using transform framework
 static MAKE_THISCALL(void, C2DSpark_Render_wrapper, struct C2DSpark *this)
@@ -102,6 +137,9 @@ static MAKE_THISCALL(bool, CCBUI_Create_wrapper, struct CCBUI *this)
 {
     if (!CCBUI_Create(this)) return false;
     
+    // new combat, icon windows are new
+    memset(cb_icon_cache, 0, sizeof(cb_icon_cache));
+    
     int i, j;
     struct uiwnd_ptag ptag;
     
@@ -213,21 +251,37 @@ static MAKE_THISCALL(void, CCBUI_Render, struct CCBUI *this)
     int icon_seq[]   = {  0,  1,  2,  3,  6,  7,  4,  5,  8,  9, 10, 11, 12, 13, 14, 15, 16, 17, 18};
     int icon_width[] = { 24, 24, 24, 24, 24, 24, 24, 24, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20}; 
     for (i = 5; i < 11; i++) {
+        struct cb_icon_layout *c = &cb_icon_cache[i];
+        unsigned mask = 0;
+        int hit = 1;
+        for (k = 0; k < 19; k++) {
+            j = icon_seq[k];
+            struct UIStatic *pWnd = this->m_pRoleSpecState[j][i];
+            if (pWnd->m_bcreateok && pWnd->m_bvisible) {
+                mask |= 1u << k;
+                if (pWnd->m_rect.left != c->pos[k].x || pWnd->m_rect.top != c->pos[k].y) hit = 0;
+            }
+        }
+        if (hit && mask == c->mask) continue;
+        
         int left = 0, top = 0;
         int firstflag = 1;
         for (k = 0; k < 19; k++) {
             j = icon_seq[k];
             struct UIStatic *pWnd = this->m_pRoleSpecState[j][i];
-            if (pWnd->m_bcreateok && pWnd->m_bvisible) {
+            if (mask & (1u << k)) {
                 if (firstflag) {
                     left = pWnd->m_rect.left;
                     top = pWnd->m_rect.top;
                     firstflag = 0;
                 }
                 UIWnd_MoveWindow(pUIWND(pWnd), left, top);
+                c->pos[k].x = left;
+                c->pos[k].y = top;
                 left += ceil(icon_width[j] * cb_scalefactor - eps);
             }
         }
+        c->mask = mask;
     }
     
     // call baseclass's Render()
@@ -247,10 +301,21 @@ static MAKE_THISCALL(void, CCBUI_Render, struct CCBUI *this)
 
 static MAKE_THISCALL(RECT *, CCBUI_GetNimbusArea_wrapper, struct CCBUI *this, RECT *rc, enum ECBFiveNimbus nimbustype)
 {
+    static struct cb_layout c[CBFN_Max];
     CCBUI_GetNimbusArea(this, rc, nimbustype);
-    CB_PUSHSTATE(TR_HIGH, TR_LOW);
-    fixui_adjust_RECT(rc, rc);
-    CB_POPSTATE();
+    if (nimbustype < 0 || nimbustype >= CBFN_Max) {
+        CB_PUSHSTATE(TR_HIGH, TR_LOW);
+        fixui_adjust_RECT(rc, rc);
+        CB_POPSTATE();
+        return rc;
+    }
+    if (!cb_layout_hit(&c[nimbustype], rc)) {
+        CB_PUSHSTATE(TR_HIGH, TR_LOW);
+        fixui_adjust_RECT(&c[nimbustype].out, rc);
+        CB_POPSTATE();
+        c[nimbustype].valid = 1;
+    }
+    *rc = c[nimbustype].out;
     return rc;
 }
 
@@ -1,8 +1,34 @@
 #include "common.h"
 
+// flag = 1: skip UpdateLoading() for as long as its last call took
+// flag = 2: redraw loading screen at a steady rate (every fixloading_interval ms),
+//           and keep the window from being marked as not responding
+//           engine loading code is not thread-safe, so loading itself stays on game thread,
+//           CPK reads and texture decoding are overlapped by cpkprefetch and texturehook_async
+
+static int loading_mode;
+static DWORD loading_interval;
 static DWORD last_update, pause_update;
+static void UpdateLoading_steady()
+{
+    // peek without removing, so system knows we are alive
+    MSG msg;
+    PeekMessage(&msg, NULL, 0, 0, PM_NOREMOVE);
+    
+    DWORD t = timeGetTime();
+    if (g_lastupdateloading != 0 && t - last_update < loading_interval) {
+        return;
+    }
+    last_update = t;
+    UpdateLoading();
+}
 static void UpdateLoading_wrapper()
 {
+    if (loading_mode == 2) {
+        UpdateLoading_steady();
+        return;
+    }
+    
     if (g_lastupdateloading == 0) {
         pause_update = 0;
         UpdateLoading();
@@ -23,5 +49,9 @@ static void UpdateLoading_wrapper()
 
 MAKE_PATCHSET(fixloading)
 {
+    loading_mode = flag;
+    if (loading_mode == 2) {
+        loading_interval = imax(get_int_from_configfile("fixloading_interval"), 1);
+    }
     INIT_WRAPPER_CALL(UpdateLoading_wrapper, { 0x0041E8A1, 0x0041E9D0, 0x0041EAFD, 0x0041EB9C, 0x0041EBCD });
 }
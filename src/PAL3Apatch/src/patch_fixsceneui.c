@@ -125,10 +125,11 @@ static MAKE_THISCALL(void, UISceneMap_Render_hookpart3, struct UIWnd *this)
 
 static MAKE_THISCALL(void, UISceneMap_Render_fixroleicon_gbMatrixStack_Translate_wrapper, struct gbMatrixStack *this, float x, float y, float z)
 {
-    gbMatrixStack_Translate(this, scenemap_dst_center.x, scenemap_dst_center.y, 0.0f);
-    gbMatrixStack_Scale(this, sceneui_scalefactor, sceneui_scalefactor, 1.0f);
-    gbMatrixStack_Translate(this, -scenemap_src_center.x, -scenemap_src_center.y, 0.0f);
-    gbMatrixStack_Translate(this, x, y, z);
+    // T(dst) * S(k) * T(-src) * T(p) == T(dst + k * (p - src)) * S(k),
+    // so each role icon needs two matrix operations instead of four
+    double k = sceneui_scalefactor;
+    gbMatrixStack_Translate(this, scenemap_dst_center.x + k * (x - scenemap_src_center.x), scenemap_dst_center.y + k * (y - scenemap_src_center.y), z);
+    gbMatrixStack_Scale(this, k, k, 1.0f);
 }
 
 static MAKE_THISCALL(void, UISceneMap_Render_fixroleicon_gbMatrixStack_Rotate_wrapper, struct gbMatrixStack *this, float angle, struct gbVec3D *axis)
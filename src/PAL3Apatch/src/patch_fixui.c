@@ -18,10 +18,23 @@ static void fixui_setdefaultstate(fRECT *src_frect, fRECT *dst_frect, int lr_met
     def_fs.no_cursor_virt = 0;
     def_fs.prev = NULL;
 }
+// state nodes are recycled through a free list,
+// since a state is pushed and popped for every visible window in every frame
+static struct fixui_state *fs_freelist;
+static struct fixui_state *fixui_allocstate()
+{
+    struct fixui_state *cur = fs_freelist;
+    if (cur) {
+        fs_freelist = cur->prev;
+    } else {
+        cur = malloc(sizeof(struct fixui_state));
+    }
+    return cur;
+}
 // allocate and construct a new state struct
 struct fixui_state *fixui_newstate(fRECT *src_frect, fRECT *dst_frect, int lr_method, int tb_method, double len_factor)
 {
-    struct fixui_state *cur = malloc(sizeof(struct fixui_state));
+    struct fixui_state *cur = fixui_allocstate();
     cur->src_frect = *src_frect;
     cur->dst_frect = *dst_frect;
     cur->lr_method = lr_method;
@@ -38,7 +51,7 @@ struct fixui_state *fixui_newstate(fRECT *src_frect, fRECT *dst_frect, int lr_me
 // duplicate current state
 struct fixui_state *fixui_dupstate()
 {
-    struct fixui_state *ptr = malloc(sizeof(struct fixui_state));
+    struct fixui_state *ptr = fixui_allocstate();
     *ptr = *fs;
     ptr->ps_data = NULL;
     ptr->prev = NULL;
@@ -50,6 +63,7 @@ void fixui_pushstate_node(struct fixui_state *cur)
     if (cur->prev != NULL) fail("double push detected.");
     cur->prev = fs;
     fs = cur;
+    invalidate_cursorpos_cache();
 }
 // pop current state from stack
 void fixui_popstate()
@@ -58,8 +72,10 @@ void fixui_popstate()
     // remove stack top item
     struct fixui_state *cur = fs;
     fs = cur->prev;
+    invalidate_cursorpos_cache();
     assert(cur->ps_data == NULL);
-    free(cur);
+    cur->prev = fs_freelist;
+    fs_freelist = cur;
 }
 // adjust structures
 void fixui_adjust_fRECT(fRECT *out_frect, const fRECT *frect)
@@ -192,18 +208,436 @@ void fixui_update_gamestate()
 // hook gbDynVertBuf::RenderUIQuad()
 static void *gbDynVertBuf_RenderUIQuad_original;
 #define gbDynVertBuf_RenderUIQuad(this, uiquad, count, render_effect, tex_array) THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(gbDynVertBuf_RenderUIQuad_original, void, struct gbDynVertBuf *, struct gbUIQuad *, int, struct gbRenderEffect *, struct gbTextureArray *), this, uiquad, count, render_effect, tex_array)
+
+static void uibatch_draw(struct gbDynVertBuf *vbuf, struct gbUIQuad *uiquad, int count, struct gbRenderEffect *render_effect, struct gbTextureArray *tex_array, int align)
+{
+    multisample_end3d();
+    if (align) IDirect3DDevice9_SetRenderState(GB_GfxMgr->m_pd3dDevice, D3DRS_MULTISAMPLEANTIALIAS, FALSE);
+    gbDynVertBuf_RenderUIQuad(vbuf, uiquad, count, render_effect, tex_array);
+    if (align) IDirect3DDevice9_SetRenderState(GB_GfxMgr->m_pd3dDevice, D3DRS_MULTISAMPLEANTIALIAS, TRUE);
+}
+
+
+
+// batch ui quads
+//   consecutive RenderUIQuad() calls with same vertex buffer, effect, texture and align flag
+//   are merged into one call, so engine fills its dynamic vertex buffer only once
+//   quads are never reordered, since ui elements may overlap each other
+//
+//   the batch must be drawn before anything else touches the device,
+//   so the device is given a modified copy of its vtable, which flushes the batch
+//   before draw calls, state changes and end of scene
+//   state blocks are also given a modified vtable, since Capture() must see the batch drawn
+#define UIBATCH_MAXQUAD 128
+
+static int uibatch_enabled;
+static struct gbUIQuad uibatch_quad[UIBATCH_MAXQUAD];
+static int uibatch_count;
+static struct gbDynVertBuf *uibatch_vbuf;
+static struct gbRenderEffect *uibatch_effect;
+static struct gbTextureArray *uibatch_tex;
+static int uibatch_align;
+static unsigned uibatch_nr_calls, uibatch_nr_draws;
+
+static void uibatch_flush()
+{
+    int count = uibatch_count;
+    if (count == 0) return;
+    
+    // detach batch first, device calls inside will see an empty batch
+    uibatch_count = 0;
+    uibatch_nr_draws++;
+    uibatch_draw(uibatch_vbuf, uibatch_quad, count, uibatch_effect, uibatch_tex, uibatch_align);
+}
+static void uibatch_add(struct gbDynVertBuf *vbuf, struct gbUIQuad *uiquad, int count, struct gbRenderEffect *render_effect, struct gbTextureArray *tex_array, int align)
+{
+    uibatch_nr_calls++;
+    if (uibatch_count > 0 && (vbuf != uibatch_vbuf || render_effect != uibatch_effect || tex_array != uibatch_tex || align != uibatch_align || uibatch_count + count > UIBATCH_MAXQUAD)) {
+        uibatch_flush();
+    }
+    if (count > UIBATCH_MAXQUAD) {
+        uibatch_nr_draws++;
+        uibatch_draw(vbuf, uiquad, count, render_effect, tex_array, align);
+        return;
+    }
+    memcpy(&uibatch_quad[uibatch_count], uiquad, sizeof(struct gbUIQuad) * count);
+    uibatch_count += count;
+    uibatch_vbuf = vbuf;
+    uibatch_effect = render_effect;
+    uibatch_tex = tex_array;
+    uibatch_align = align;
+}
+
+static IDirect3DDevice9ExVtbl uibatch_vtbl; // big enough for both IDirect3DDevice9 and IDirect3DDevice9Ex
+static IDirect3DStateBlock9Vtbl uibatch_sbvtbl;
+static const IDirect3DStateBlock9Vtbl *uibatch_orig_sbvtbl;
+
+// define a vtable entry which flushes batch before calling real method
+#define UIBATCH_WRAP(method, params, args) \
+    static HRESULT (STDMETHODCALLTYPE *Real_##method) params; \
+    static HRESULT STDMETHODCALLTYPE method##_uibatch params \
+    { \
+        uibatch_flush(); \
+        return Real_##method args; \
+    }
+UIBATCH_WRAP(Clear, (IDirect3DDevice9 *This, DWORD Count, CONST D3DRECT *pRects, DWORD Flags, D3DCOLOR Color, float Z, DWORD Stencil), (This, Count, pRects, Flags, Color, Z, Stencil))
+UIBATCH_WRAP(EndScene, (IDirect3DDevice9 *This), (This))
+UIBATCH_WRAP(Present, (IDirect3DDevice9 *This, CONST RECT *pSourceRect, CONST RECT *pDestRect, HWND hDestWindowOverride, CONST RGNDATA *pDirtyRegion), (This, pSourceRect, pDestRect, hDestWindowOverride, pDirtyRegion))
+UIBATCH_WRAP(StretchRect, (IDirect3DDevice9 *This, IDirect3DSurface9 *pSourceSurface, CONST RECT *pSourceRect, IDirect3DSurface9 *pDestSurface, CONST RECT *pDestRect, D3DTEXTUREFILTERTYPE Filter), (This, pSourceSurface, pSourceRect, pDestSurface, pDestRect, Filter))
+UIBATCH_WRAP(SetRenderTarget, (IDirect3DDevice9 *This, DWORD RenderTargetIndex, IDirect3DSurface9 *pRenderTarget), (This, RenderTargetIndex, pRenderTarget))
+UIBATCH_WRAP(SetDepthStencilSurface, (IDirect3DDevice9 *This, IDirect3DSurface9 *pNewZStencil), (This, pNewZStencil))
+UIBATCH_WRAP(SetTransform, (IDirect3DDevice9 *This, D3DTRANSFORMSTATETYPE State, CONST D3DMATRIX *pMatrix), (This, State, pMatrix))
+UIBATCH_WRAP(SetViewport, (IDirect3DDevice9 *This, CONST D3DVIEWPORT9 *pViewport), (This, pViewport))
+UIBATCH_WRAP(SetRenderState, (IDirect3DDevice9 *This, D3DRENDERSTATETYPE State, DWORD Value), (This, State, Value))
+UIBATCH_WRAP(SetTexture, (IDirect3DDevice9 *This, DWORD Stage, IDirect3DBaseTexture9 *pTexture), (This, Stage, pTexture))
+UIBATCH_WRAP(SetTextureStageState, (IDirect3DDevice9 *This, DWORD Stage, D3DTEXTURESTAGESTATETYPE Type, DWORD Value), (This, Stage, Type, Value))
+UIBATCH_WRAP(SetSamplerState, (IDirect3DDevice9 *This, DWORD Sampler, D3DSAMPLERSTATETYPE Type, DWORD Value), (This, Sampler, Type, Value))
+UIBATCH_WRAP(SetScissorRect, (IDirect3DDevice9 *This, CONST RECT *pRect), (This, pRect))
+UIBATCH_WRAP(DrawPrimitive, (IDirect3DDevice9 *This, D3DPRIMITIVETYPE PrimitiveType, UINT StartVertex, UINT PrimitiveCount), (This, PrimitiveType, StartVertex, PrimitiveCount))
+UIBATCH_WRAP(DrawIndexedPrimitive, (IDirect3DDevice9 *This, D3DPRIMITIVETYPE PrimitiveType, INT BaseVertexIndex, UINT MinVertexIndex, UINT NumVertices, UINT startIndex, UINT primCount), (This, PrimitiveType, BaseVertexIndex, MinVertexIndex, NumVertices, startIndex, primCount))
+UIBATCH_WRAP(DrawPrimitiveUP, (IDirect3DDevice9 *This, D3DPRIMITIVETYPE PrimitiveType, UINT PrimitiveCount, CONST void *pVertexStreamZeroData, UINT VertexStreamZeroStride), (This, PrimitiveType, PrimitiveCount, pVertexStreamZeroData, VertexStreamZeroStride))
+UIBATCH_WRAP(DrawIndexedPrimitiveUP, (IDirect3DDevice9 *This, D3DPRIMITIVETYPE PrimitiveType, UINT MinVertexIndex, UINT NumVertices, UINT PrimitiveCount, CONST void *pIndexData, D3DFORMAT IndexDataFormat, CONST void *pVertexStreamZeroData, UINT VertexStreamZeroStride), (This, PrimitiveType, MinVertexIndex, NumVertices, PrimitiveCount, pIndexData, IndexDataFormat, pVertexStreamZeroData, VertexStreamZeroStride))
+UIBATCH_WRAP(SetVertexShader, (IDirect3DDevice9 *This, IDirect3DVertexShader9 *pShader), (This, pShader))
+UIBATCH_WRAP(SetPixelShader, (IDirect3DDevice9 *This, IDirect3DPixelShader9 *pShader), (This, pShader))
+UIBATCH_WRAP(BeginStateBlock, (IDirect3DDevice9 *This), (This))
+UIBATCH_WRAP(Capture, (IDirect3DStateBlock9 *This), (This))
+UIBATCH_WRAP(Apply, (IDirect3DStateBlock9 *This), (This))
+
+static void uibatch_hookstateblock(IDirect3DStateBlock9 *sb)
+{
+    if (sb->lpVtbl == &uibatch_sbvtbl) return;
+    if (!uibatch_orig_sbvtbl) {
+        uibatch_orig_sbvtbl = sb->lpVtbl;
+        uibatch_sbvtbl = *sb->lpVtbl;
+        Real_Capture = uibatch_sbvtbl.Capture;
+        Real_Apply = uibatch_sbvtbl.Apply;
+        uibatch_sbvtbl.Capture = Capture_uibatch;
+        uibatch_sbvtbl.Apply = Apply_uibatch;
+    }
+    if (sb->lpVtbl != uibatch_orig_sbvtbl) {
+        // we can't see when this one is captured
+        warning("unknown state block vtable, ui quad batch disabled.");
+        uibatch_flush();
+        uibatch_enabled = 0;
+        return;
+    }
+    sb->lpVtbl = &uibatch_sbvtbl;
+}
+
+static HRESULT (STDMETHODCALLTYPE *Real_CreateStateBlock)(IDirect3DDevice9 *, D3DSTATEBLOCKTYPE, IDirect3DStateBlock9 **);
+static HRESULT STDMETHODCALLTYPE CreateStateBlock_uibatch(IDirect3DDevice9 *This, D3DSTATEBLOCKTYPE Type, IDirect3DStateBlock9 **ppSB)
+{
+    uibatch_flush();
+    HRESULT hr = Real_CreateStateBlock(This, Type, ppSB);
+    if (SUCCEEDED(hr)) uibatch_hookstateblock(*ppSB);
+    return hr;
+}
+static HRESULT (STDMETHODCALLTYPE *Real_EndStateBlock)(IDirect3DDevice9 *, IDirect3DStateBlock9 **);
+static HRESULT STDMETHODCALLTYPE EndStateBlock_uibatch(IDirect3DDevice9 *This, IDirect3DStateBlock9 **ppSB)
+{
+    HRESULT hr = Real_EndStateBlock(This, ppSB);
+    if (SUCCEEDED(hr)) uibatch_hookstateblock(*ppSB);
+    return hr;
+}
+
+static HRESULT (STDMETHODCALLTYPE *Real_Reset)(IDirect3DDevice9 *, D3DPRESENT_PARAMETERS *);
+static HRESULT STDMETHODCALLTYPE Reset_uibatch(IDirect3DDevice9 *This, D3DPRESENT_PARAMETERS *pPresentationParameters)
+{
+    // nothing can be drawn on a lost device
+    uibatch_count = 0;
+    return Real_Reset(This, pPresentationParameters);
+}
+
+#define UIBATCH_HOOK(method) (Real_##method = vtbl->method, vtbl->method = method##_uibatch)
+static void uibatch_hookdevice()
+{
+    IDirect3DDevice9 *dev = GB_GfxMgr->m_pd3dDevice;
+    IDirect3DDevice9Vtbl *vtbl = (IDirect3DDevice9Vtbl *) &uibatch_vtbl;
+    
+    if (!dev || dev->lpVtbl == vtbl) return;
+    
+    patch_device_vtable(dev, &uibatch_vtbl);
+    
+    UIBATCH_HOOK(Reset);
+    UIBATCH_HOOK(Clear);
+    UIBATCH_HOOK(EndScene);
+    UIBATCH_HOOK(Present);
+    UIBATCH_HOOK(StretchRect);
+    UIBATCH_HOOK(SetRenderTarget);
+    UIBATCH_HOOK(SetDepthStencilSurface);
+    UIBATCH_HOOK(SetTransform);
+    UIBATCH_HOOK(SetViewport);
+    UIBATCH_HOOK(SetRenderState);
+    UIBATCH_HOOK(SetTexture);
+    UIBATCH_HOOK(SetTextureStageState);
+    UIBATCH_HOOK(SetSamplerState);
+    UIBATCH_HOOK(SetScissorRect);
+    UIBATCH_HOOK(DrawPrimitive);
+    UIBATCH_HOOK(DrawIndexedPrimitive);
+    UIBATCH_HOOK(DrawPrimitiveUP);
+    UIBATCH_HOOK(DrawIndexedPrimitiveUP);
+    UIBATCH_HOOK(SetVertexShader);
+    UIBATCH_HOOK(SetPixelShader);
+    UIBATCH_HOOK(BeginStateBlock);
+    UIBATCH_HOOK(CreateStateBlock);
+    UIBATCH_HOOK(EndStateBlock);
+    
+    dev->lpVtbl = vtbl;
+    
+    // vtable is ready, batching is safe from now on
+    uibatch_enabled = 1;
+}
+static void uibatch_report()
+{
+    plog("ui quad batch: %u calls, %u draws.", uibatch_nr_calls, uibatch_nr_draws);
+}
+static void init_uibatch()
+{
+    if (!get_int_from_configfile("uibatchquad")) return;
+    // run first, so state blocks created by other post-create hooks are also seen
+    add_hook_ex(HOOKID_POSTD3DCREATE, uibatch_hookdevice, HOOK_PRIORITY_FIRST);
+    add_atexit_hook(uibatch_report);
+}
+
+
+
+// ui texture atlas
+//   small ui textures are copied into shared atlas pages when first drawn by RenderUIQuad(),
+//   their quads get uv rects remapped into the page, and are drawn with a stand-in
+//   texture array which refers to the page, so ui quad batch can merge quads of
+//   different small textures into one draw
+//
+//   this is done at draw time instead of TH_POST_IMAGELOAD stage of texture hooks,
+//   since only here we know a texture is used by ui, and its Direct3D object exists
+//   only single texture arrays, managed 2D textures up to UIATLAS_MAXSIZE,
+//   and quads with uv inside [0, 1] are remapped, since atlas can't repeat a texture
+//   each slot has a border of UIATLAS_PAD replicated edge pixels, so bilinear filtering
+//   at slot edges works like clamp addressing, pages have no mipmaps
+//
+//   source textures are referenced by atlas, so their pointers are not reused by other textures,
+//   when pages are full, all of them are dropped at start of next frame, at most once in UIATLAS_RESETFRAMES frames
+#define UIATLAS_PAGESIZE 1024
+#define UIATLAS_MAXPAGE 4
+#define UIATLAS_MAXSIZE 128
+#define UIATLAS_PAD 1
+#define UIATLAS_HASHSIZE 1024 // must be power of 2
+#define UIATLAS_RESETFRAMES 600
+
+struct uiatlas_page {
+    IDirect3DTexture9 *tex;
+    struct gbTexture_D3D gbtex;
+    struct gbTextureArray texarr;
+    int x, y, shelf_h;
+};
+struct uiatlas_slot {
+    IDirect3DBaseTexture9 *key; // NULL if unused
+    struct uiatlas_page *page; // NULL if texture is not eligible
+    float u0, v0, du, dv;
+};
+
+static int uiatlas_enabled;
+static struct uiatlas_page uiatlas_pages[UIATLAS_MAXPAGE];
+static int uiatlas_nr_pages;
+static struct uiatlas_slot uiatlas_hash[UIATLAS_HASHSIZE];
+static int uiatlas_nr_slots;
+static int uiatlas_full;
+static unsigned uiatlas_frame, uiatlas_lastreset;
+static unsigned uiatlas_nr_textures, uiatlas_nr_quads, uiatlas_nr_resets;
+
+static void uiatlas_reset()
+{
+    int i;
+    // batch may refer to stand-in texture arrays
+    uibatch_flush();
+    for (i = 0; i < UIATLAS_HASHSIZE; i++) {
+        if (uiatlas_hash[i].key && uiatlas_hash[i].page) IDirect3DBaseTexture9_Release(uiatlas_hash[i].key);
+    }
+    memset(uiatlas_hash, 0, sizeof(uiatlas_hash));
+    for (i = 0; i < uiatlas_nr_pages; i++) {
+        IDirect3DTexture9_Release(uiatlas_pages[i].tex);
+    }
+    memset(uiatlas_pages, 0, sizeof(uiatlas_pages));
+    uiatlas_nr_pages = 0;
+    uiatlas_nr_slots = 0;
+    uiatlas_full = 0;
+}
+
+static int uiatlas_copy(IDirect3DSurface9 *dst, IDirect3DSurface9 *src, int x, int y, int w, int h)
+{
+    // content in center, edges and corners are stretched from outermost pixels
+    int sx[3][2] = { { 0, 1 }, { 0, w }, { w - 1, w } };
+    int sy[3][2] = { { 0, 1 }, { 0, h }, { h - 1, h } };
+    int dx[3][2] = { { x - UIATLAS_PAD, x }, { x, x + w }, { x + w, x + w + UIATLAS_PAD } };
+    int dy[3][2] = { { y - UIATLAS_PAD, y }, { y, y + h }, { y + h, y + h + UIATLAS_PAD } };
+    int i, j;
+    for (i = 0; i < 3; i++) {
+        for (j = 0; j < 3; j++) {
+            RECT src_rc = { sx[j][0], sy[i][0], sx[j][1], sy[i][1] };
+            RECT dst_rc = { dx[j][0], dy[i][0], dx[j][1], dy[i][1] };
+            if (FAILED(D3DXLoadSurfaceFromSurface(dst, NULL, &dst_rc, src, NULL, &src_rc, D3DX_FILTER_POINT, 0))) return 0;
+        }
+    }
+    return 1;
+}
+
+static struct uiatlas_page *uiatlas_alloc(int w, int h, int *x, int *y)
+{
+    int i;
+    for (i = 0; i <= uiatlas_nr_pages; i++) {
+        if (i == UIATLAS_MAXPAGE) return NULL;
+        struct uiatlas_page *page = &uiatlas_pages[i];
+        if (i == uiatlas_nr_pages) {
+            if (FAILED(IDirect3DDevice9_CreateTexture(GB_GfxMgr->m_pd3dDevice, UIATLAS_PAGESIZE, UIATLAS_PAGESIZE, 1, 0, D3DFMT_A8R8G8B8, D3DPOOL_MANAGED, &page->tex, NULL))) return NULL;
+            uiatlas_nr_pages++;
+        }
+        if (page->x + w > UIATLAS_PAGESIZE) {
+            // start next shelf
+            page->x = 0;
+            page->y += page->shelf_h;
+            page->shelf_h = 0;
+        }
+        if (page->y + h <= UIATLAS_PAGESIZE) {
+            *x = page->x;
+            *y = page->y;
+            page->x += w;
+            page->shelf_h = imax(page->shelf_h, h);
+            return page;
+        }
+    }
+    return NULL;
+}
+
+static void uiatlas_insert(struct uiatlas_slot *slot, struct gbTexture_D3D *gbtex)
+{
+    IDirect3DTexture9 *tex = (IDirect3DTexture9 *) gbtex->pTex;
+    IDirect3DSurface9 *src = NULL, *dst = NULL;
+    D3DSURFACE_DESC desc;
+    int x, y;
+    
+    slot->key = gbtex->pTex;
+    slot->page = NULL;
+    uiatlas_nr_slots++;
+    
+    if (IDirect3DBaseTexture9_GetType(gbtex->pTex) != D3DRTYPE_TEXTURE) return;
+    if (FAILED(IDirect3DTexture9_GetLevelDesc(tex, 0, &desc))) return;
+    if (desc.Pool != D3DPOOL_MANAGED || desc.Width > UIATLAS_MAXSIZE || desc.Height > UIATLAS_MAXSIZE) return;
+    
+    struct uiatlas_page *page = uiatlas_alloc(desc.Width + UIATLAS_PAD * 2, desc.Height + UIATLAS_PAD * 2, &x, &y);
+    if (!page) {
+        // don't remember this texture, try again after reset
+        slot->key = NULL;
+        uiatlas_nr_slots--;
+        uiatlas_full = 1;
+        return;
+    }
+    x += UIATLAS_PAD;
+    y += UIATLAS_PAD;
+    
+    if (FAILED(IDirect3DTexture9_GetSurfaceLevel(tex, 0, &src))) goto done;
+    if (FAILED(IDirect3DTexture9_GetSurfaceLevel(page->tex, 0, &dst))) goto done;
+    if (!uiatlas_copy(dst, src, x, y, desc.Width, desc.Height)) goto done;
+    
+    if (!page->texarr.nTex) {
+        // stand-in texture is a copy of first texture in page, which refers to page instead
+        page->gbtex = *gbtex;
+        page->gbtex.Width = UIATLAS_PAGESIZE;
+        page->gbtex.Height = UIATLAS_PAGESIZE;
+        page->gbtex.pTex = (IDirect3DBaseTexture9 *) page->tex;
+        page->gbtex.pDS = NULL;
+        page->texarr.pTexPt[0] = (struct gbTexture *) &page->gbtex;
+        page->texarr.nTex = 1;
+    }
+    
+    IDirect3DBaseTexture9_AddRef(slot->key);
+    slot->page = page;
+    slot->u0 = (float) x / UIATLAS_PAGESIZE;
+    slot->v0 = (float) y / UIATLAS_PAGESIZE;
+    slot->du = (float) desc.Width / UIATLAS_PAGESIZE;
+    slot->dv = (float) desc.Height / UIATLAS_PAGESIZE;
+    uiatlas_nr_textures++;
+done:
+    if (src) IDirect3DSurface9_Release(src);
+    if (dst) IDirect3DSurface9_Release(dst);
+}
+
+static struct uiatlas_slot *uiatlas_lookup(struct gbTexture_D3D *gbtex)
+{
+    unsigned i = ((unsigned) gbtex->pTex >> 4) & (UIATLAS_HASHSIZE - 1);
+    while (uiatlas_hash[i].key) {
+        if (uiatlas_hash[i].key == gbtex->pTex) return &uiatlas_hash[i];
+        i = (i + 1) & (UIATLAS_HASHSIZE - 1);
+    }
+    // keep load factor below 3/4
+    if (uiatlas_nr_slots >= UIATLAS_HASHSIZE / 4 * 3) {
+        uiatlas_full = 1;
+        return NULL;
+    }
+    uiatlas_insert(&uiatlas_hash[i], gbtex);
+    return uiatlas_hash[i].key ? &uiatlas_hash[i] : NULL;
+}
+
+static struct gbTextureArray *uiatlas_remap(struct gbUIQuad *uiquad, int count, struct gbTextureArray *tex_array)
+{
+    int i;
+    if (!uiatlas_enabled || !tex_array || tex_array->nTex != 1 || !tex_array->pTexPt[0]) return tex_array;
+    struct gbTexture_D3D *gbtex = (struct gbTexture_D3D *) tex_array->pTexPt[0];
+    if (!gbtex->pTex) return tex_array;
+    
+    for (i = 0; i < count; i++) {
+        struct gbUIQuad *q = &uiquad[i];
+        if (fmin(fmin(q->su, q->eu), fmin(q->sv, q->ev)) < -eps) return tex_array;
+        if (fmax(fmax(q->su, q->eu), fmax(q->sv, q->ev)) > 1.0 + eps) return tex_array;
+    }
+    
+    struct uiatlas_slot *slot = uiatlas_lookup(gbtex);
+    if (!slot || !slot->page) return tex_array;
+    
+    for (i = 0; i < count; i++) {
+        struct gbUIQuad *q = &uiquad[i];
+        q->su = slot->u0 + q->su * slot->du;
+        q->eu = slot->u0 + q->eu * slot->du;
+        q->sv = slot->v0 + q->sv * slot->dv;
+        q->ev = slot->v0 + q->ev * slot->dv;
+    }
+    uiatlas_nr_quads += count;
+    return &slot->page->texarr;
+}
+
+static void uiatlas_gameloop(void *arg)
+{
+    uiatlas_frame++;
+    if (uiatlas_full && uiatlas_frame - uiatlas_lastreset >= UIATLAS_RESETFRAMES) {
+        uiatlas_reset();
+        uiatlas_lastreset = uiatlas_frame;
+        uiatlas_nr_resets++;
+    }
+}
+static void uiatlas_report()
+{
+    plog("ui texture atlas: %u textures, %u quads remapped, %u resets.", uiatlas_nr_textures, uiatlas_nr_quads, uiatlas_nr_resets);
+}
+static void init_uiatlas()
+{
+    uiatlas_enabled = get_int_from_configfile("uiatlas");
+    if (!uiatlas_enabled) return;
+    add_gameloop_hook_filtered(uiatlas_gameloop, GAMELOOP_MASK(GAMELOOP_NORMAL));
+    add_atexit_hook(uiatlas_report);
+}
 static MAKE_THISCALL(void, gbDynVertBuf_RenderUIQuad_wrapper, struct gbDynVertBuf *this, struct gbUIQuad *uiquad, int count, struct gbRenderEffect *render_effect, struct gbTextureArray *tex_array)
 {
     fixui_update_gamestate();
-    struct gbUIQuad *tmp_uiquad = malloc(sizeof(struct gbUIQuad) * count);
+    struct gbUIQuad *tmp_uiquad = frame_mem_allocator.malloc(sizeof(struct gbUIQuad) * count);
     int i;
     for (i = 0; i < count; i++) {
         fixui_adjust_gbUIQuad(&tmp_uiquad[i], &uiquad[i]);
     }
-    if (!fs->no_align) IDirect3DDevice9_SetRenderState(GB_GfxMgr->m_pd3dDevice, D3DRS_MULTISAMPLEANTIALIAS, FALSE);
-    gbDynVertBuf_RenderUIQuad(this, tmp_uiquad, count, render_effect, tex_array);
-    if (!fs->no_align) IDirect3DDevice9_SetRenderState(GB_GfxMgr->m_pd3dDevice, D3DRS_MULTISAMPLEANTIALIAS, TRUE);
-    free(tmp_uiquad);
+    tex_array = uiatlas_remap(tmp_uiquad, count, tex_array);
+    if (uibatch_enabled) {
+        uibatch_add(this, tmp_uiquad, count, render_effect, tex_array, !fs->no_align);
+    } else {
+        uibatch_draw(this, tmp_uiquad, count, render_effect, tex_array, !fs->no_align);
+    }
+    frame_mem_allocator.free(tmp_uiquad);
 }
 static void hook_gbDynVertBuf_RenderUIQuad()
 {
@@ -226,6 +660,262 @@ static void hook_gbDynVertBuf_RenderUIQuad()
 
 
 
+// ui layer cache
+//   a static ui subtree is rendered to a render target once, then in later frames
+//   the render target is drawn instead, until caller's state bytes or back buffer size change
+//   content is only captured when state is same as last frame, so changing windows
+//   are simply rendered directly
+//
+//   engine fonts are drawn at end of frame, not to the render target,
+//   so a state is rendered directly if any text is printed while capturing it
+//
+//   alpha channel is blended with (ONE, INVSRCALPHA) while capturing, and the render
+//   target is drawn with (ONE, INVSRCALPHA), so alpha blended ui looks same as drawn directly
+int uilayer_enabled;
+static struct uilayer *uilayer_list;
+static IDirect3DStateBlock9 *uilayer_sb;
+static IDirect3DSurface9 *uilayer_oldrt;
+static D3DVIEWPORT9 uilayer_oldvp;
+static unsigned uilayer_oldtext;
+static unsigned uilayer_nr_hits, uilayer_nr_captures, uilayer_nr_directs;
+
+static unsigned uilayer_textcount()
+{
+    // strings queued in engine fonts and d3dxfont
+    unsigned count = d3dxfont_nr_queued;
+    int i;
+    if (GB_GfxMgr->pFontMgr) {
+        for (i = GB_FONT_UNICODE12; i <= GB_FONT_ASC; i++) {
+            struct gbPrintFont *font = gbPrintFontMgr_GetFont(GB_GfxMgr->pFontMgr, i);
+            if (font) count += font->numInfo + font->num3DInfo;
+        }
+    }
+    return count;
+}
+
+static void uilayer_draw(struct uilayer *layer)
+{
+    IDirect3DDevice9 *dev = GB_GfxMgr->m_pd3dDevice;
+    float w = layer->texwidth, h = layer->texheight;
+    struct {
+        float x, y, z, rhw;
+        float u, v;
+    } vert[4] = {
+        { -0.5f, -0.5f, 0.0f, 1.0f, 0.0f, 0.0f },
+        { w - 0.5f, -0.5f, 0.0f, 1.0f, 1.0f, 0.0f },
+        { -0.5f, h - 0.5f, 0.0f, 1.0f, 0.0f, 1.0f },
+        { w - 0.5f, h - 0.5f, 0.0f, 1.0f, 1.0f, 1.0f },
+    };
+    
+    if (!uilayer_sb && FAILED(IDirect3DDevice9_CreateStateBlock(dev, D3DSBT_ALL, &uilayer_sb))) {
+        uilayer_sb = NULL;
+        return;
+    }
+    IDirect3DStateBlock9_Capture(uilayer_sb);
+    
+    IDirect3DDevice9_SetVertexShader(dev, NULL);
+    IDirect3DDevice9_SetPixelShader(dev, NULL);
+    IDirect3DDevice9_SetFVF(dev, D3DFVF_XYZRHW | D3DFVF_TEX1);
+    IDirect3DDevice9_SetTexture(dev, 0, (IDirect3DBaseTexture9 *) layer->tex);
+    IDirect3DDevice9_SetTexture(dev, 1, NULL);
+    IDirect3DDevice9_SetRenderState(dev, D3DRS_ZENABLE, D3DZB_FALSE);
+    IDirect3DDevice9_SetRenderState(dev, D3DRS_ZWRITEENABLE, FALSE);
+    IDirect3DDevice9_SetRenderState(dev, D3DRS_STENCILENABLE, FALSE);
+    IDirect3DDevice9_SetRenderState(dev, D3DRS_ALPHATESTENABLE, FALSE);
+    IDirect3DDevice9_SetRenderState(dev, D3DRS_ALPHABLENDENABLE, TRUE);
+    IDirect3DDevice9_SetRenderState(dev, D3DRS_SEPARATEALPHABLENDENABLE, FALSE);
+    IDirect3DDevice9_SetRenderState(dev, D3DRS_BLENDOP, D3DBLENDOP_ADD);
+    IDirect3DDevice9_SetRenderState(dev, D3DRS_SRCBLEND, D3DBLEND_ONE);
+    IDirect3DDevice9_SetRenderState(dev, D3DRS_DESTBLEND, D3DBLEND_INVSRCALPHA);
+    IDirect3DDevice9_SetRenderState(dev, D3DRS_CULLMODE, D3DCULL_NONE);
+    IDirect3DDevice9_SetRenderState(dev, D3DRS_LIGHTING, FALSE);
+    IDirect3DDevice9_SetRenderState(dev, D3DRS_FOGENABLE, FALSE);
+    IDirect3DDevice9_SetRenderState(dev, D3DRS_SCISSORTESTENABLE, FALSE);
+    IDirect3DDevice9_SetRenderState(dev, D3DRS_COLORWRITEENABLE, 0xF);
+    IDirect3DDevice9_SetTextureStageState(dev, 0, D3DTSS_COLOROP, D3DTOP_SELECTARG1);
+    IDirect3DDevice9_SetTextureStageState(dev, 0, D3DTSS_COLORARG1, D3DTA_TEXTURE);
+    IDirect3DDevice9_SetTextureStageState(dev, 0, D3DTSS_ALPHAOP, D3DTOP_SELECTARG1);
+    IDirect3DDevice9_SetTextureStageState(dev, 0, D3DTSS_ALPHAARG1, D3DTA_TEXTURE);
+    IDirect3DDevice9_SetTextureStageState(dev, 0, D3DTSS_TEXCOORDINDEX, 0);
+    IDirect3DDevice9_SetTextureStageState(dev, 0, D3DTSS_TEXTURETRANSFORMFLAGS, D3DTTFF_DISABLE);
+    IDirect3DDevice9_SetTextureStageState(dev, 1, D3DTSS_COLOROP, D3DTOP_DISABLE);
+    IDirect3DDevice9_SetTextureStageState(dev, 1, D3DTSS_ALPHAOP, D3DTOP_DISABLE);
+    IDirect3DDevice9_SetSamplerState(dev, 0, D3DSAMP_MINFILTER, D3DTEXF_POINT);
+    IDirect3DDevice9_SetSamplerState(dev, 0, D3DSAMP_MAGFILTER, D3DTEXF_POINT);
+    IDirect3DDevice9_SetSamplerState(dev, 0, D3DSAMP_MIPFILTER, D3DTEXF_NONE);
+    IDirect3DDevice9_SetSamplerState(dev, 0, D3DSAMP_ADDRESSU, D3DTADDRESS_CLAMP);
+    IDirect3DDevice9_SetSamplerState(dev, 0, D3DSAMP_ADDRESSV, D3DTADDRESS_CLAMP);
+    IDirect3DDevice9_DrawPrimitiveUP(dev, D3DPT_TRIANGLESTRIP, 2, vert, sizeof(vert[0]));
+    
+    IDirect3DStateBlock9_Apply(uilayer_sb);
+}
+
+static void uilayer_release(struct uilayer *layer)
+{
+    if (layer->tex) {
+        IDirect3DTexture9_Release(layer->tex);
+        layer->tex = NULL;
+    }
+    layer->valid = 0;
+}
+
+static int uilayer_capture(struct uilayer *layer, int width, int height)
+{
+    IDirect3DDevice9 *dev = GB_GfxMgr->m_pd3dDevice;
+    IDirect3DSurface9 *suf;
+    
+    if (layer->tex && (layer->texwidth != width || layer->texheight != height)) uilayer_release(layer);
+    if (!layer->tex) {
+        if (FAILED(IDirect3DDevice9_CreateTexture(dev, width, height, 1, D3DUSAGE_RENDERTARGET, D3DFMT_A8R8G8B8, D3DPOOL_DEFAULT, &layer->tex, NULL))) {
+            layer->tex = NULL;
+            return 0;
+        }
+        layer->texwidth = width;
+        layer->texheight = height;
+        if (!layer->linked) {
+            layer->next = uilayer_list;
+            uilayer_list = layer;
+            layer->linked = 1;
+        }
+    }
+    if (FAILED(IDirect3DTexture9_GetSurfaceLevel(layer->tex, 0, &suf))) return 0;
+    
+    // scene must be resolved before back buffer is switched away
+    multisample_end3d();
+    
+    // SetRenderTarget() will reset viewport
+    IDirect3DDevice9_GetRenderTarget(dev, 0, &uilayer_oldrt);
+    IDirect3DDevice9_GetViewport(dev, &uilayer_oldvp);
+    IDirect3DDevice9_SetRenderTarget(dev, 0, suf);
+    IDirect3DDevice9_SetViewport(dev, &uilayer_oldvp);
+    IDirect3DSurface9_Release(suf);
+    IDirect3DDevice9_Clear(dev, 0, NULL, D3DCLEAR_TARGET, 0, 1.0f, 0);
+    IDirect3DDevice9_SetRenderState(dev, D3DRS_SEPARATEALPHABLENDENABLE, TRUE);
+    IDirect3DDevice9_SetRenderState(dev, D3DRS_SRCBLENDALPHA, D3DBLEND_ONE);
+    IDirect3DDevice9_SetRenderState(dev, D3DRS_DESTBLENDALPHA, D3DBLEND_INVSRCALPHA);
+    return 1;
+}
+
+// returns non-zero if caller should render the subtree, then call uilayer_end()
+// otherwise cached content is already drawn
+int uilayer_begin(struct uilayer *layer, const void *state, unsigned size)
+{
+    int width = GB_GfxMgr->m_d3dsdBackBuffer.Width;
+    int height = GB_GfxMgr->m_d3dsdBackBuffer.Height;
+    
+    layer->capturing = 0;
+    if (!uilayer_enabled) return 1;
+    if (layer->size != size) {
+        free(layer->state);
+        free(layer->last);
+        layer->state = malloc(size);
+        layer->last = malloc(size);
+        layer->size = size;
+        layer->valid = layer->direct = layer->has_last = 0;
+        if (!layer->state || !layer->last) {
+            free(layer->state);
+            free(layer->last);
+            layer->state = layer->last = NULL;
+            layer->size = 0;
+            return 1;
+        }
+    }
+    
+    // same as cached state
+    if ((layer->valid || layer->direct) && layer->width == width && layer->height == height && memcmp(layer->state, state, size) == 0) {
+        if (layer->valid) {
+            uilayer_nr_hits++;
+            uilayer_draw(layer);
+            return 0;
+        }
+        uilayer_nr_directs++;
+        return 1;
+    }
+    
+    // capture only if state is same as last frame
+    int stable = layer->has_last && layer->last_width == width && layer->last_height == height && memcmp(layer->last, state, size) == 0;
+    memcpy(layer->last, state, size);
+    layer->last_width = width;
+    layer->last_height = height;
+    layer->has_last = 1;
+    layer->valid = layer->direct = 0;
+    if (!stable) {
+        uilayer_nr_directs++;
+        return 1;
+    }
+    
+    memcpy(layer->state, state, size);
+    layer->width = width;
+    layer->height = height;
+    if (!uilayer_capture(layer, width, height)) {
+        // don't retry until state changes
+        layer->direct = 1;
+        uilayer_nr_directs++;
+        return 1;
+    }
+    uilayer_oldtext = uilayer_textcount();
+    layer->capturing = 1;
+    uilayer_nr_captures++;
+    return 1;
+}
+void uilayer_end(struct uilayer *layer)
+{
+    IDirect3DDevice9 *dev = GB_GfxMgr->m_pd3dDevice;
+    if (!layer->capturing) return;
+    layer->capturing = 0;
+    
+    if (uilayer_textcount() != uilayer_oldtext) {
+        layer->direct = 1;
+    } else {
+        layer->valid = 1;
+    }
+    
+    // batched ui quads are flushed by first device call here, so they go to render target
+    IDirect3DDevice9_SetRenderState(dev, D3DRS_SEPARATEALPHABLENDENABLE, FALSE);
+    IDirect3DDevice9_SetRenderState(dev, D3DRS_SRCBLENDALPHA, D3DBLEND_ONE);
+    IDirect3DDevice9_SetRenderState(dev, D3DRS_DESTBLENDALPHA, D3DBLEND_ZERO);
+    IDirect3DDevice9_SetRenderTarget(dev, 0, uilayer_oldrt);
+    IDirect3DDevice9_SetViewport(dev, &uilayer_oldvp);
+    IDirect3DSurface9_Release(uilayer_oldrt);
+    uilayer_oldrt = NULL;
+    
+    // draw captured content for this frame, even if it can't be reused
+    uilayer_draw(layer);
+}
+static void uilayer_onlostdevice()
+{
+    struct uilayer *layer;
+    for (layer = uilayer_list; layer; layer = layer->next) {
+        uilayer_release(layer);
+        layer->direct = 0;
+    }
+    if (uilayer_sb) {
+        IDirect3DStateBlock9_Release(uilayer_sb);
+        uilayer_sb = NULL;
+    }
+}
+static void uilayer_checkcaps()
+{
+    if (!(GB_GfxMgr->m_d3dCaps.PrimitiveMiscCaps & D3DPMISCCAPS_SEPARATEALPHABLEND)) {
+        warning("separate alpha blending is not supported, ui layer cache disabled.");
+        uilayer_enabled = 0;
+    }
+}
+static void uilayer_report()
+{
+    plog("ui layer cache: %u hits, %u captures, %u direct renders.", uilayer_nr_hits, uilayer_nr_captures, uilayer_nr_directs);
+}
+static void init_uilayer()
+{
+    uilayer_enabled = get_int_from_configfile("uilayercache");
+    if (!uilayer_enabled) return;
+    add_postd3dcreate_hook(uilayer_checkcaps);
+    add_onlostdevice_hook(uilayer_onlostdevice);
+    add_atexit_hook(uilayer_report);
+}
+
+
+
 
 
 
@@ -259,6 +949,7 @@ static void hook_gbPrintFont_PrintString()
 static void set_cursor_virt(int enabled)
 {
     fs->no_cursor_virt = !enabled;
+    invalidate_cursorpos_cache();
 }
 static void getcursorpos_virtualization_hookfunc(void *arg)
 {
@@ -486,6 +1177,53 @@ static struct UIWnd *get_ptag_alt_father(struct uiwnd_ptag ptag)
     }
 }
 
+// transformed window rects of ptags
+//   the result depends only on ptag, window rect and the rects referenced by ptag,
+//   which change only when resolution is changed, so results are cached
+//   the referenced rects are part of the key, so a resolution change needs no flush
+#define PTAG_CACHE_SIZE 256
+struct ptag_cache_entry {
+    int valid;
+    unsigned key; // transform related bits of ptag
+    RECT rect;
+    fRECT trans_src_frect, trans_dst_frect;
+    double len_factor;
+    fRECT dst_frect;
+};
+static struct ptag_cache_entry ptag_cache[PTAG_CACHE_SIZE];
+
+static void ptag_transform(fRECT *dst_frect, struct uiwnd_ptag ptag, const RECT *rect, fRECT *trans_src_frect, fRECT *trans_dst_frect)
+{
+    unsigned key = ptag.scalefactor_index | ptag.self_srcrect_type << 4 | ptag.self_dstrect_type << 8 | ptag.self_dstrect_use43 << 12 | ptag.self_lr_method << 13 | ptag.self_tb_method << 16;
+    unsigned h = key * 31u + rect->left * 7u + rect->top * 13u + rect->right * 17u + rect->bottom * 19u;
+    struct ptag_cache_entry *e = &ptag_cache[h % PTAG_CACHE_SIZE];
+    double len_factor = scalefactor_table[ptag.scalefactor_index];
+    if (e->valid && e->key == key && e->len_factor == len_factor && memcmp(&e->rect, rect, sizeof(RECT)) == 0
+     && memcmp(&e->trans_src_frect, trans_src_frect, sizeof(fRECT)) == 0
+     && memcmp(&e->trans_dst_frect, trans_dst_frect, sizeof(fRECT)) == 0) {
+        *dst_frect = e->dst_frect;
+        return;
+    }
+    e->valid = 1;
+    e->key = key;
+    e->rect = *rect;
+    e->trans_src_frect = *trans_src_frect;
+    e->trans_dst_frect = *trans_dst_frect;
+    e->len_factor = len_factor;
+    
+    // transform to 4:3 rect if required
+    fRECT trans_dst_frect_43;
+    if (ptag.self_dstrect_use43) {
+        trans_dst_frect_43 = *trans_dst_frect;
+        trans_dst_frect = &trans_dst_frect_43;
+        get_ratio_frect(trans_dst_frect, trans_dst_frect, 4.0 / 3.0, TR_CENTER, TR_CENTER);
+    }
+    
+    set_frect_rect(dst_frect, rect);
+    transform_frect(dst_frect, dst_frect, trans_src_frect, trans_dst_frect, ptag.self_lr_method, ptag.self_tb_method, len_factor);
+    e->dst_frect = *dst_frect;
+}
+
 void push_ptag_state(struct UIWnd *pwnd)
 {
     if (!verify_ptag_magic(pwnd)) return;
@@ -515,21 +1253,12 @@ void push_ptag_state(struct UIWnd *pwnd)
         trans_dst_frect = get_ptag_frect(ptag.self_dstrect_type);
         if (!trans_dst_frect) fail("invalid ptag dstrect type %d.", ptag.self_dstrect_type);
         
-        // transform to 4:3 rect if required
-        fRECT trans_dst_frect_43;
-        if (ptag.self_dstrect_use43) {
-            trans_dst_frect_43 = *trans_dst_frect;
-            trans_dst_frect = &trans_dst_frect_43;
-            get_ratio_frect(trans_dst_frect, trans_dst_frect, 4.0 / 3.0, TR_CENTER, TR_CENTER);
-        }
-
         // transform window rect using ptag
         fRECT src_frect, dst_frect;
         double len_factor;
         set_frect_rect(&src_frect, &pwnd->m_rect);
         len_factor = scalefactor_table[ptag.scalefactor_index];
-        set_frect_rect(&dst_frect, &pwnd->m_rect);
-        transform_frect(&dst_frect, &dst_frect, trans_src_frect, trans_dst_frect, ptag.self_lr_method, ptag.self_tb_method, len_factor);
+        ptag_transform(&dst_frect, ptag, &pwnd->m_rect, trans_src_frect, trans_dst_frect);
         
         // scale window contents
         fixui_pushstate(&src_frect, &dst_frect, TR_SCALE_LOW, TR_SCALE_LOW, len_factor);
@@ -786,6 +1515,15 @@ MAKE_PATCHSET(fixui)
     // init fill border
     init_fillborder();
     
+    // init ui quad batch
+    init_uibatch();
+    
+    // init ui texture atlas
+    init_uiatlas();
+    
+    // init ui layer cache
+    init_uilayer();
+    
     // init align uirect
     init_align_uirect();
     
@@ -0,0 +1,323 @@
+#include "common.h"
+
+// frame timing trace
+//   per-frame records are pushed to a queue from the hooks in hook.c,
+//   and a background thread writes them to FRAMETRACE_FILE as CSV
+//
+//   columns:
+//     frame       frame number
+//     time        milliseconds since trace begin (at present)
+//     present     present-to-present time
+//     update      time spent in PAL3::Update() during this frame
+//     endscene    time between pre-EndScene and post-Present hooks
+//     gamestate   PAL3_s_gamestate
+//     scene       CPK name of current scene
+//     heap        live bytes of game heaps in MB, from heapstat (empty if disabled)
+//     vafree      largest free address space region in MB, from heapstat
+//     gpu         GPU time between frame begin and EndScene, from timestamp queries
+//                 (empty if not available)
+//     counters    performance counters with PERFCOUNTER_TRACE flag, 'name=value' separated by ';'
+//   all times except gpu are wall-clock, in milliseconds
+//
+//   timestamp queries are read without waiting for GPU,
+//   so a record is kept in a small ring until its queries are ready
+
+#define FRAMETRACE_FILE "PAL3Apatch.frametrace.csv"
+#define FRAMETRACE_QUEUE 4096
+#define FRAMETRACE_BATCH 256
+#define FRAMETRACE_SCENELEN 32
+#define FRAMETRACE_GPUQUERY 4
+#define FRAMETRACE_COUNTERLEN 256
+
+struct frametrace_record {
+    unsigned frame;
+    int gamestate;
+    double time;
+    float present;
+    float update;
+    float endscene;
+    char scene[FRAMETRACE_SCENELEN];
+    float heap; // negative if not available
+    float vafree;
+    float gpu; // negative if not available
+    char counters[FRAMETRACE_COUNTERLEN];
+};
+
+// timestamp queries of a frame, and its record waiting for them
+struct frametrace_gpuquery {
+    IDirect3DQuery9 *disjoint, *freq, *begin, *end;
+    int begun;
+    int issued;
+    int has_rec;
+    struct frametrace_record rec;
+};
+
+static LARGE_INTEGER trace_freq, trace_begin;
+static LARGE_INTEGER last_present, endscene_time;
+static LONGLONG update_ticks;
+static unsigned frame_count;
+
+static CRITICAL_SECTION queue_cs;
+static HANDLE queue_event;
+static HANDLE writer_thread;
+static struct frametrace_record queue[FRAMETRACE_QUEUE];
+static unsigned queue_head, queue_count, queue_dropped;
+static volatile LONG writer_quit;
+static FILE *trace_fp;
+
+static struct frametrace_gpuquery gpuquery[FRAMETRACE_GPUQUERY];
+static int gpuquery_ok;
+
+static LARGE_INTEGER update_begin;
+
+static double ticks2ms(LONGLONG ticks)
+{
+    return ticks * 1000.0 / trace_freq.QuadPart;
+}
+
+static DWORD WINAPI frametrace_writer(LPVOID lpParameter)
+{
+    static struct frametrace_record batch[FRAMETRACE_BATCH];
+    while (1) {
+        int quit = writer_quit;
+        if (!quit) WaitForSingleObject(queue_event, 1000);
+        
+        // drain queue in batches, file I/O is done without lock
+        unsigned i, n;
+        do {
+            EnterCriticalSection(&queue_cs);
+            n = imin(queue_count, FRAMETRACE_BATCH);
+            for (i = 0; i < n; i++) {
+                batch[i] = queue[(queue_head + i) % FRAMETRACE_QUEUE];
+            }
+            queue_head = (queue_head + n) % FRAMETRACE_QUEUE;
+            queue_count -= n;
+            LeaveCriticalSection(&queue_cs);
+            
+            for (i = 0; i < n; i++) {
+                struct frametrace_record *r = &batch[i];
+                fprintf(trace_fp, "%u,%.3f,%.3f,%.3f,%.3f,%d,%s,", r->frame, r->time, r->present, r->update, r->endscene, r->gamestate, r->scene);
+                if (r->heap >= 0) fprintf(trace_fp, "%.1f,%.1f", r->heap, r->vafree); else fputc(',', trace_fp);
+                fputc(',', trace_fp);
+                if (r->gpu >= 0) fprintf(trace_fp, "%.3f", r->gpu);
+                fprintf(trace_fp, ",%s\n", r->counters);
+            }
+        } while (n > 0);
+        
+        if (quit) break;
+    }
+    fflush(trace_fp);
+    return 0;
+}
+
+static void frametrace_push(const struct frametrace_record *rec)
+{
+    EnterCriticalSection(&queue_cs);
+    if (queue_count < FRAMETRACE_QUEUE) {
+        queue[(queue_head + queue_count) % FRAMETRACE_QUEUE] = *rec;
+        queue_count++;
+    } else {
+        // writer can't keep up, drop this record instead of blocking game
+        queue_dropped++;
+    }
+    int wakeup = queue_count >= FRAMETRACE_BATCH;
+    LeaveCriticalSection(&queue_cs);
+    if (wakeup) SetEvent(queue_event);
+}
+
+static void gpuquery_release()
+{
+    int i;
+    gpuquery_ok = 0;
+    for (i = 0; i < FRAMETRACE_GPUQUERY; i++) {
+        struct frametrace_gpuquery *q = &gpuquery[i];
+        if (q->has_rec) frametrace_push(&q->rec);
+        if (q->disjoint) IDirect3DQuery9_Release(q->disjoint);
+        if (q->freq) IDirect3DQuery9_Release(q->freq);
+        if (q->begin) IDirect3DQuery9_Release(q->begin);
+        if (q->end) IDirect3DQuery9_Release(q->end);
+        memset(q, 0, sizeof(*q));
+    }
+}
+
+static void gpuquery_create()
+{
+    IDirect3DDevice9 *dev = GB_GfxMgr->m_pd3dDevice;
+    int i;
+    gpuquery_ok = 1;
+    for (i = 0; i < FRAMETRACE_GPUQUERY; i++) {
+        struct frametrace_gpuquery *q = &gpuquery[i];
+        if (FAILED(IDirect3DDevice9_CreateQuery(dev, D3DQUERYTYPE_TIMESTAMPDISJOINT, &q->disjoint))
+         || FAILED(IDirect3DDevice9_CreateQuery(dev, D3DQUERYTYPE_TIMESTAMPFREQ, &q->freq))
+         || FAILED(IDirect3DDevice9_CreateQuery(dev, D3DQUERYTYPE_TIMESTAMP, &q->begin))
+         || FAILED(IDirect3DDevice9_CreateQuery(dev, D3DQUERYTYPE_TIMESTAMP, &q->end))) {
+            // timestamp queries are optional for drivers
+            gpuquery_release();
+            return;
+        }
+    }
+}
+
+// returns 1 if GPU time is ready, -1 if it is not available
+static int gpuquery_read(struct frametrace_gpuquery *q, float *gpu)
+{
+    BOOL disjoint;
+    UINT64 freq, begin, end;
+    HRESULT hr;
+    if (!q->issued) return -1;
+    if ((hr = IDirect3DQuery9_GetData(q->disjoint, &disjoint, sizeof(disjoint), 0)) != S_OK) return hr == S_FALSE ? 0 : -1;
+    if ((hr = IDirect3DQuery9_GetData(q->freq, &freq, sizeof(freq), 0)) != S_OK) return hr == S_FALSE ? 0 : -1;
+    if ((hr = IDirect3DQuery9_GetData(q->begin, &begin, sizeof(begin), 0)) != S_OK) return hr == S_FALSE ? 0 : -1;
+    if ((hr = IDirect3DQuery9_GetData(q->end, &end, sizeof(end), 0)) != S_OK) return hr == S_FALSE ? 0 : -1;
+    if (disjoint || freq == 0 || end < begin) return -1;
+    *gpu = (end - begin) * 1000.0 / freq;
+    return 1;
+}
+
+static void gpuquery_begin()
+{
+    struct frametrace_gpuquery *q = &gpuquery[frame_count % FRAMETRACE_GPUQUERY];
+    
+    // GPU is too far behind, give up this record
+    if (q->has_rec) {
+        frametrace_push(&q->rec);
+        q->has_rec = 0;
+    }
+    q->begun = 1;
+    q->issued = 0;
+    IDirect3DQuery9_Issue(q->disjoint, D3DISSUE_BEGIN);
+    IDirect3DQuery9_Issue(q->begin, D3DISSUE_END);
+}
+
+static void gpuquery_end()
+{
+    struct frametrace_gpuquery *q = &gpuquery[frame_count % FRAMETRACE_GPUQUERY];
+    
+    // no begin after device is reset, or EndScene is hooked twice in this frame
+    if (!q->begun) return;
+    q->begun = 0;
+    IDirect3DQuery9_Issue(q->end, D3DISSUE_END);
+    IDirect3DQuery9_Issue(q->freq, D3DISSUE_END);
+    IDirect3DQuery9_Issue(q->disjoint, D3DISSUE_END);
+    q->issued = 1;
+}
+
+static void gpuquery_submit(const struct frametrace_record *rec)
+{
+    unsigned i;
+    gpuquery[frame_count % FRAMETRACE_GPUQUERY].rec = *rec;
+    gpuquery[frame_count % FRAMETRACE_GPUQUERY].has_rec = 1;
+    
+    // push ready records from oldest one, keep frame order
+    for (i = 1; i <= FRAMETRACE_GPUQUERY; i++) {
+        struct frametrace_gpuquery *q = &gpuquery[(frame_count + i) % FRAMETRACE_GPUQUERY];
+        if (!q->has_rec) continue;
+        int ret = gpuquery_read(q, &q->rec.gpu);
+        if (ret == 0) break;
+        frametrace_push(&q->rec);
+        q->has_rec = 0;
+    }
+}
+
+static void frametrace_updatebegin(void *arg)
+{
+    QueryPerformanceCounter(&update_begin);
+}
+
+static void frametrace_updateend(void *arg)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    update_ticks += now.QuadPart - update_begin.QuadPart;
+}
+
+static void frametrace_preendscene()
+{
+    QueryPerformanceCounter(&endscene_time);
+    if (gpuquery_ok) gpuquery_end();
+}
+
+static void frametrace_postpresent()
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    
+    if (last_present.QuadPart != 0) {
+        struct frametrace_record rec;
+        rec.frame = frame_count;
+        rec.gamestate = PAL3_s_gamestate;
+        rec.time = ticks2ms(now.QuadPart - trace_begin.QuadPart);
+        rec.present = ticks2ms(now.QuadPart - last_present.QuadPart);
+        rec.update = ticks2ms(update_ticks);
+        rec.endscene = endscene_time.QuadPart ? ticks2ms(now.QuadPart - endscene_time.QuadPart) : 0;
+        snprintf(rec.scene, sizeof(rec.scene), "%s", g_pVFileSys ? vfs_cpkname() : "");
+        double heap, vafree;
+        if (heapstat_get_summary(&heap, &vafree)) {
+            rec.heap = heap;
+            rec.vafree = vafree;
+        } else {
+            rec.heap = rec.vafree = -1;
+        }
+        rec.gpu = -1;
+        perfcounter_get_text(rec.counters, sizeof(rec.counters), PERFCOUNTER_TRACE, ';');
+        if (gpuquery_ok) gpuquery_submit(&rec); else frametrace_push(&rec);
+    }
+    frame_count++;
+    last_present = now;
+    endscene_time.QuadPart = 0;
+    update_ticks = 0;
+    if (gpuquery_ok) gpuquery_begin();
+}
+
+static void frametrace_atexit()
+{
+    // device may be gone, waiting records are written without GPU time
+    int i;
+    gpuquery_ok = 0;
+    for (i = 0; i < FRAMETRACE_GPUQUERY; i++) {
+        if (gpuquery[i].has_rec) frametrace_push(&gpuquery[i].rec);
+        gpuquery[i].has_rec = 0;
+    }
+    
+    InterlockedExchange(&writer_quit, 1);
+    SetEvent(queue_event);
+    WaitForSingleObject(writer_thread, INFINITE);
+    CloseHandle(writer_thread);
+    if (safe_fclose(&trace_fp) != 0) {
+        warning("can't write frame trace file '%s'.", FRAMETRACE_FILE);
+    }
+    plog("frame trace: %u frames, %u dropped.", frame_count, queue_dropped);
+}
+
+MAKE_PATCHSET(frametrace)
+{
+    if (!QueryPerformanceFrequency(&trace_freq)) {
+        warning("can't query performance frequency, frame trace disabled.");
+        return;
+    }
+    QueryPerformanceCounter(&trace_begin);
+    
+    trace_fp = robust_fopen(FRAMETRACE_FILE, "w");
+    if (!trace_fp) {
+        warning("can't open frame trace file '%s'.", FRAMETRACE_FILE);
+        return;
+    }
+    fprintf(trace_fp, "frame,time,present,update,endscene,gamestate,scene,heap,vafree,gpu,counters\n");
+    
+    InitializeCriticalSection(&queue_cs);
+    queue_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!queue_event) fail("can't create frame trace event.");
+    writer_thread = CreateThread(NULL, 0, frametrace_writer, NULL, 0, NULL);
+    if (!writer_thread) fail("can't create frame trace thread.");
+    sched_set_thread(writer_thread, SCHED_BACKGROUND);
+    
+    add_gameloop_hook_filtered(frametrace_updatebegin, GAMELOOP_MASK(GAMEEVENT_UPDATE_ATBEGIN));
+    add_gameloop_hook_filtered(frametrace_updateend, GAMELOOP_MASK(GAMEEVENT_UPDATE_ATEND));
+    
+    add_preendscene_hook(frametrace_preendscene);
+    add_postpresent_hook(frametrace_postpresent);
+    add_atexit_hook(frametrace_atexit);
+    add_postd3dcreate_hook(gpuquery_create);
+    add_onlostdevice_hook(gpuquery_release);
+    add_onresetdevice_hook(gpuquery_create);
+}
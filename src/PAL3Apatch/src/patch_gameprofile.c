@@ -0,0 +1,160 @@
+#include "common.h"
+
+// game loop profiler
+//   phase boundaries are timestamped from existing hook points,
+//   time spent in every hook function is recorded by hook.c,
+//   averages are written to log every 'flag' seconds
+//
+//   phases:
+//     message     end of last loop to PAL3::Update() (window messages)
+//     input       PAL3::Update() to keyboard state updated
+//     update      until pre-EndScene hooks (game logic, scene and UI render)
+//     present     pre-EndScene hooks to post-Present hooks (EndScene and Present)
+//     postframe   post-Present hooks to the end of PAL3::Update()
+//   the engine renders scene and UI inside PAL3::Update() without a known boundary,
+//   so they are reported together as 'update'
+
+#define GAMEPROFILE_MAXREPORT 8
+
+enum gameprofile_phase {
+    GP_MESSAGE,
+    GP_INPUT,
+    GP_UPDATE,
+    GP_PRESENT,
+    GP_POSTFRAME,
+    GP_MAX_PHASES // EOF
+};
+static const char *const phase_name[GP_MAX_PHASES] = {
+    "message",
+    "input",
+    "update",
+    "present",
+    "postframe",
+};
+static LARGE_INTEGER gp_freq;
+static LONGLONG gp_interval;
+static LARGE_INTEGER gp_report_time;
+static LARGE_INTEGER gp_mark; // timestamp of last phase boundary
+static int gp_phase; // current phase, -1 if not in a frame
+static LONGLONG gp_ticks[GP_MAX_PHASES];
+static LONGLONG gp_frame_ticks, gp_frame_max;
+static LARGE_INTEGER gp_frame_begin;
+static unsigned gp_frames;
+
+static double ticks2ms(LONGLONG ticks)
+{
+    return ticks * 1000.0 / gp_freq.QuadPart;
+}
+
+// end current phase, and begin next phase
+static void gp_enter(int phase)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    if (gp_phase >= 0) gp_ticks[gp_phase] += now.QuadPart - gp_mark.QuadPart;
+    gp_mark = now;
+    gp_phase = phase;
+}
+
+static void gp_report()
+{
+    int i, j, k;
+    if (!gp_frames) return;
+    
+    plog("game profile: %u frames, avg %.3fms, max %.3fms.", gp_frames, ticks2ms(gp_frame_ticks) / gp_frames, ticks2ms(gp_frame_max));
+    for (i = 0; i < GP_MAX_PHASES; i++) {
+        plog("  phase %-10s %8.3fms/frame", phase_name[i], ticks2ms(gp_ticks[i]) / gp_frames);
+    }
+    
+    // report most expensive hook functions
+    struct {
+        int hookid;
+        void *funcptr;
+        struct hook_profile_entry entry;
+    } top[GAMEPROFILE_MAXREPORT];
+    int nr_top = 0;
+    for (i = 0; i < MAX_HOOK_TYPES; i++) {
+        void *funcptr;
+        struct hook_profile_entry entry;
+        for (j = 0; get_hook_profile(i, j, &funcptr, &entry); j++) {
+            if (!entry.calls) continue;
+            for (k = nr_top; k > 0 && top[k - 1].entry.ticks < entry.ticks; k--) {
+                if (k < GAMEPROFILE_MAXREPORT) top[k] = top[k - 1];
+            }
+            if (k < GAMEPROFILE_MAXREPORT) {
+                top[k].hookid = i;
+                top[k].funcptr = funcptr;
+                top[k].entry = entry;
+                if (nr_top < GAMEPROFILE_MAXREPORT) nr_top++;
+            }
+        }
+    }
+    for (i = 0; i < nr_top; i++) {
+        char sym[MAXLINE];
+        get_address_symbol(top[i].funcptr, sym, sizeof(sym));
+        plog("  hook %-14s %-32s %8.3fms/frame, %u calls, max %.3fms", get_hook_name(top[i].hookid), sym, ticks2ms(top[i].entry.ticks) / gp_frames, top[i].entry.calls, ticks2ms(top[i].entry.max_ticks));
+    }
+    
+    memset(gp_ticks, 0, sizeof(gp_ticks));
+    gp_frame_ticks = gp_frame_max = 0;
+    gp_frames = 0;
+    reset_hook_profile();
+}
+
+static void gp_updatebegin_hook(void *arg)
+{
+    gp_enter(GP_INPUT);
+    QueryPerformanceCounter(&gp_frame_begin);
+}
+static void gp_updateend_hook(void *arg)
+{
+    gp_enter(-1);
+    
+    LONGLONG frame_ticks = gp_mark.QuadPart - gp_frame_begin.QuadPart;
+    gp_frame_ticks += frame_ticks;
+    if (frame_ticks > gp_frame_max) gp_frame_max = frame_ticks;
+    gp_frames++;
+    
+    if (gp_mark.QuadPart - gp_report_time.QuadPart >= gp_interval) {
+        gp_report();
+        gp_report_time = gp_mark;
+    }
+}
+
+static void gp_grpkbdstate_hook()
+{
+    if (gp_phase == GP_INPUT) gp_enter(GP_UPDATE);
+}
+static void gp_preendscene_hook()
+{
+    if (gp_phase >= 0 && gp_phase < GP_PRESENT) gp_enter(GP_PRESENT);
+}
+static void gp_postpresent_hook()
+{
+    if (gp_phase == GP_PRESENT) gp_enter(GP_POSTFRAME);
+}
+static void gp_gameloop_hook(void *arg)
+{
+    gp_enter(GP_MESSAGE);
+}
+
+MAKE_PATCHSET(gameprofile)
+{
+    if (!QueryPerformanceFrequency(&gp_freq)) {
+        warning("can't query performance frequency, game profile disabled.");
+        return;
+    }
+    gp_interval = imax(flag, 1) * gp_freq.QuadPart;
+    QueryPerformanceCounter(&gp_report_time);
+    gp_phase = -1;
+    
+    add_gameloop_hook_filtered(gp_updatebegin_hook, GAMELOOP_MASK(GAMEEVENT_UPDATE_ATBEGIN));
+    add_gameloop_hook_filtered(gp_updateend_hook, GAMELOOP_MASK(GAMEEVENT_UPDATE_ATEND));
+    add_grpkbdstate_hook(gp_grpkbdstate_hook);
+    add_preendscene_hook(gp_preendscene_hook);
+    add_postpresent_hook(gp_postpresent_hook);
+    add_gameloop_hook_filtered(gp_gameloop_hook, GAMELOOP_MASK(GAMELOOP_NORMAL));
+    add_atexit_hook(gp_report);
+    
+    hook_profile_enabled = 1;
+}
@@ -0,0 +1,94 @@
+#include "common.h"
+
+// throttle game when window is hidden
+//   game already sleeps when it's inactive, but a window can be hidden while active,
+//   e.g. on a locked screen, cloaked by DWM (virtual desktops), or covered in full-screen mode
+//   window state is checked every HT_CHECKINTERVAL ms, window is hidden if
+//     it is minimized (IsIconic)
+//     it is cloaked (DwmGetWindowAttribute with DWMWA_CLOAKED, Windows 8 and later)
+//     device reports S_PRESENT_OCCLUDED (CheckDeviceState, only with d3d9ex)
+//   while hidden, game is paused like an inactive game: no update and no rendering,
+//   messages are processed and window state is checked again every HT_SLEEP ms,
+//   game resumes as soon as window is visible again
+
+#define HT_CHECKINTERVAL 250
+#define HT_SLEEP 250
+
+#define myDWMWA_CLOAKED 14
+#define myS_PRESENT_OCCLUDED ((HRESULT) 0x08760868)
+
+static const GUID ht_IID_IDirect3DDevice9Ex = { 0xb18b10ce, 0x2649, 0x405a, { 0x87, 0x0f, 0x95, 0xf7, 0x77, 0xd4, 0x31, 0x3a } };
+static HRESULT (WINAPI *myDwmGetWindowAttribute)(HWND, DWORD, PVOID, DWORD);
+static IDirect3DDevice9Ex *ht_devex;
+static DWORD ht_lastcheck;
+static unsigned ht_nr_hidden;
+static DWORD ht_hiddentime;
+
+static int ht_is_hidden()
+{
+    if (!game_hwnd) return 0;
+    if (IsIconic(game_hwnd)) return 1;
+    if (myDwmGetWindowAttribute) {
+        DWORD cloaked = 0;
+        if (SUCCEEDED(myDwmGetWindowAttribute(game_hwnd, myDWMWA_CLOAKED, &cloaked, sizeof(cloaked))) && cloaked) return 1;
+    }
+    if (ht_devex && IDirect3DDevice9Ex_CheckDeviceState(ht_devex, game_hwnd) == myS_PRESENT_OCCLUDED) return 1;
+    return 0;
+}
+
+static void ht_gameloop_hook(void *arg)
+{
+    DWORD now = GetTickCount();
+    if (now - ht_lastcheck < HT_CHECKINTERVAL) return;
+    ht_lastcheck = now;
+    if (!ht_is_hidden()) return;
+    
+    ht_nr_hidden++;
+    while (1) {
+        MSG msg;
+        // we must process message queue here
+        while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+            if (msg.message == WM_QUIT) {
+                PostQuitMessage(msg.wParam);
+                goto done;
+            }
+            TranslateMessage(&msg);
+            DispatchMessage(&msg);
+        }
+        if (!ht_is_hidden()) break;
+        
+        set_pauseresume(1);
+        call_gameloop_hooks(GAMELOOP_SLEEP, NULL);
+        Sleep(HT_SLEEP);
+    }
+done:
+    ht_lastcheck = GetTickCount();
+    ht_hiddentime += ht_lastcheck - now;
+}
+
+static void ht_postd3dcreate(void)
+{
+    IDirect3DDevice9 *dev = GB_GfxMgr->m_pd3dDevice;
+    // keep no reference, device lives until game exits
+    if (SUCCEEDED(IDirect3DDevice9_QueryInterface(dev, &ht_IID_IDirect3DDevice9Ex, (void **) &ht_devex))) {
+        IDirect3DDevice9Ex_Release(ht_devex);
+    } else {
+        ht_devex = NULL;
+    }
+}
+
+static void ht_report(void)
+{
+    plog("hiddenthrottle: hidden %u times, %.1f seconds total.", ht_nr_hidden, ht_hiddentime / 1000.0);
+}
+
+MAKE_PATCHSET(hiddenthrottle)
+{
+    HMODULE hDwmapi = LoadLibrary("DWMAPI.DLL");
+    if (hDwmapi) {
+        myDwmGetWindowAttribute = (void *) GetProcAddress(hDwmapi, "DwmGetWindowAttribute");
+    }
+    add_gameloop_hook_filtered(ht_gameloop_hook, GAMELOOP_MASK(GAMELOOP_NORMAL));
+    add_postd3dcreate_hook(ht_postd3dcreate);
+    add_atexit_hook(ht_report);
+}
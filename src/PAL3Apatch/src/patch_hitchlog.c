@@ -0,0 +1,233 @@
+#include "common.h"
+
+// hitch detector
+//   when a frame takes longer than 'flag' milliseconds, a snapshot is
+//   appended to HITCHLOG_FILE: phase timings of that frame, current CPK,
+//   and the last events (CPK view maps, texture loads, effect compilations)
+//   recorded during that frame
+//
+//   texture loads and effect compilations are reported by texturehook.c
+//   and effecthook.c through hitchlog_event(), which also feeds loadtimes and benchmark,
+//   and publishes load times as 'load.<type>_ms' performance counters and chrometrace zones
+//   phases are the same as gameprofile, see patch_gameprofile.c
+
+#define HITCHLOG_FILE "PAL3Apatch.hitchlog.txt"
+#define HITCHLOG_MAXREPORT 1000 // report at most this many hitches per run
+#define HITCHLOG_NAMELEN 128
+
+enum hitchlog_phase {
+    HL_MESSAGE,
+    HL_INPUT,
+    HL_UPDATE,
+    HL_PRESENT,
+    HL_POSTFRAME,
+    HL_MAX_PHASES // EOF
+};
+static const char *const phase_name[HL_MAX_PHASES] = {
+    "message",
+    "input",
+    "update",
+    "present",
+    "postframe",
+};
+static const char *const event_name[] = {
+    [HITCHLOG_CPK] = "cpk",
+    [HITCHLOG_TEXTURE] = "texture",
+    [HITCHLOG_EFFECT] = "effect",
+};
+
+struct hitchlog_record {
+    LONGLONG begin, end;
+    int type;
+    unsigned size;
+    char name[HITCHLOG_NAMELEN];
+};
+
+int hitchlog_enabled = 0;
+
+static LARGE_INTEGER hl_freq;
+static LONGLONG hl_threshold;
+static CRITICAL_SECTION hl_cs;
+static struct hitchlog_record *ring;
+static unsigned ring_size, ring_head, ring_count;
+static FILE *hl_fp;
+static unsigned hl_reported, hl_frames;
+
+static LARGE_INTEGER hl_mark; // timestamp of last phase boundary
+static int hl_phase; // current phase, -1 before first frame
+static LONGLONG hl_ticks[HL_MAX_PHASES];
+static LARGE_INTEGER hl_frame_begin;
+
+static LPVOID (WINAPI *MapViewOfFile_next)(HANDLE, DWORD, DWORD, DWORD, SIZE_T);
+
+static double ticks2ms(LONGLONG ticks)
+{
+    return ticks * 1000.0 / hl_freq.QuadPart;
+}
+
+static void hitchlog_perfcounter(int type, unsigned size, LONGLONG begin, LONGLONG end)
+{
+    static struct perfcounter *volatile pc_ms[sizeof(event_name) / sizeof(event_name[0])];
+    static struct perfcounter *volatile pc_bytes[sizeof(event_name) / sizeof(event_name[0])];
+    LARGE_INTEGER freq;
+    if (!pc_ms[type]) {
+        // registering is idempotent, so racing threads get the same counters
+        char name[PERFCOUNTER_NAMELEN];
+        snprintf(name, sizeof(name), "load.%s_bytes", event_name[type]);
+        pc_bytes[type] = perfcounter_register(name, PERFCOUNTER_COUNTER, PERFCOUNTER_TRACE);
+        snprintf(name, sizeof(name), "load.%s_ms", event_name[type]);
+        pc_ms[type] = perfcounter_register(name, PERFCOUNTER_HISTOGRAM, PERFCOUNTER_OVERLAY | PERFCOUNTER_TRACE);
+    }
+    QueryPerformanceFrequency(&freq);
+    perfcounter_add(pc_bytes[type], size);
+    perfcounter_sample(pc_ms[type], (end - begin) * 1000.0 / freq.QuadPart);
+}
+
+void hitchlog_event(int type, const char *name, unsigned size, LONGLONG begin, LONGLONG end)
+{
+    hitchlog_perfcounter(type, size, begin, end);
+    if (chrometrace_enabled && type != HITCHLOG_CPK) chrometrace_complete(event_name[type], name, begin, end); // CPK maps are wrapped by chrometrace itself
+    if (loadtimes_enabled) loadtimes_event(type, size, begin, end);
+    if (benchmark_enabled) benchmark_event(type, begin, end);
+    if (!hitchlog_enabled) return;
+    EnterCriticalSection(&hl_cs);
+    struct hitchlog_record *rec = &ring[(ring_head + ring_count) % ring_size];
+    if (ring_count < ring_size) {
+        ring_count++;
+    } else {
+        ring_head = (ring_head + 1) % ring_size;
+    }
+    rec->begin = begin;
+    rec->end = end;
+    rec->type = type;
+    rec->size = size;
+    snprintf(rec->name, sizeof(rec->name), "%s", name ? name : "");
+    LeaveCriticalSection(&hl_cs);
+}
+
+static LPVOID WINAPI MapViewOfFile_hitchlog(HANDLE hFileMappingObject, DWORD dwDesiredAccess, DWORD dwFileOffsetHigh, DWORD dwFileOffsetLow, SIZE_T dwNumberOfBytesToMap)
+{
+    LARGE_INTEGER begin, end;
+    QueryPerformanceCounter(&begin);
+    LPVOID ret = MapViewOfFile_next(hFileMappingObject, dwDesiredAccess, dwFileOffsetHigh, dwFileOffsetLow, dwNumberOfBytesToMap);
+    QueryPerformanceCounter(&end);
+    
+    struct CPK *cpk = vfs_findcpk_mapping(hFileMappingObject);
+    char name[HITCHLOG_NAMELEN];
+    snprintf(name, sizeof(name), "%s+%08X", cpk ? get_filepart(cpk->m_szCPKFileName) : "?", (unsigned) dwFileOffsetLow);
+    hitchlog_event(HITCHLOG_CPK, name, dwNumberOfBytesToMap, begin.QuadPart, end.QuadPart);
+    return ret;
+}
+
+static void hl_report(LONGLONG frame_ticks)
+{
+    int i;
+    if (!hl_fp) {
+        hl_fp = robust_fopen(HITCHLOG_FILE, "a");
+        if (!hl_fp) {
+            warning("can't open hitch log file '%s', hitch log disabled.", HITCHLOG_FILE);
+            hitchlog_enabled = 0;
+            return;
+        }
+        fprintf(hl_fp, "==== %s %s, threshold %.0fms\n", patch_version, build_info, ticks2ms(hl_threshold));
+    }
+    
+    fprintf(hl_fp, "hitch at frame %u: %.3fms, gamestate %d, cpk '%s'\n", hl_frames, ticks2ms(frame_ticks), PAL3_s_gamestate, vfs_cpkname());
+    for (i = 0; i < HL_MAX_PHASES; i++) {
+        fprintf(hl_fp, "  phase %-10s %8.3fms\n", phase_name[i], ticks2ms(hl_ticks[i]));
+    }
+    
+    // dump events of this frame, times are relative to frame begin
+    EnterCriticalSection(&hl_cs);
+    unsigned n = 0;
+    for (i = 0; i < (int) ring_count; i++) {
+        struct hitchlog_record *rec = &ring[(ring_head + i) % ring_size];
+        if (rec->begin < hl_frame_begin.QuadPart) continue;
+        fprintf(hl_fp, "  %+9.3fms %8.3fms %-7s %8u %s\n", ticks2ms(rec->begin - hl_frame_begin.QuadPart), ticks2ms(rec->end - rec->begin), event_name[rec->type], rec->size, rec->name);
+        n++;
+    }
+    LeaveCriticalSection(&hl_cs);
+    if (n == ring_size) fprintf(hl_fp, "  (older events are overwritten, increase hitchlog_events to see them)\n");
+    fflush(hl_fp);
+    
+    if (++hl_reported == HITCHLOG_MAXREPORT) {
+        fprintf(hl_fp, "too many hitches, hitch log disabled.\n");
+        fflush(hl_fp);
+        hitchlog_enabled = 0;
+    }
+}
+
+// end current phase, and begin next phase
+static void hl_enter(int phase)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    if (hl_phase >= 0) hl_ticks[hl_phase] += now.QuadPart - hl_mark.QuadPart;
+    hl_mark = now;
+    hl_phase = phase;
+}
+
+static void hl_updatebegin_hook(void *arg)
+{
+    if (hl_phase >= 0) hl_enter(HL_INPUT);
+}
+
+static void hl_grpkbdstate_hook()
+{
+    if (hl_phase == HL_INPUT) hl_enter(HL_UPDATE);
+}
+static void hl_preendscene_hook()
+{
+    if (hl_phase >= 0 && hl_phase < HL_PRESENT) hl_enter(HL_PRESENT);
+}
+static void hl_postpresent_hook()
+{
+    if (hl_phase == HL_PRESENT) hl_enter(HL_POSTFRAME);
+}
+static void hl_gameloop_hook(void *arg)
+{
+    int first = hl_phase < 0;
+    hl_enter(HL_MESSAGE);
+    if (!first) {
+        LONGLONG frame_ticks = hl_mark.QuadPart - hl_frame_begin.QuadPart;
+        if (frame_ticks >= hl_threshold && hitchlog_enabled) hl_report(frame_ticks);
+    }
+    hl_frames++;
+    hl_frame_begin = hl_mark;
+    memset(hl_ticks, 0, sizeof(hl_ticks));
+}
+
+static void hl_atexit()
+{
+    if (hl_fp) {
+        plog("hitch log: %u hitches recorded.", hl_reported);
+        safe_fclose(&hl_fp);
+    }
+}
+
+MAKE_PATCHSET(hitchlog)
+{
+    if (!QueryPerformanceFrequency(&hl_freq)) {
+        warning("can't query performance frequency, hitch log disabled.");
+        return;
+    }
+    hl_threshold = imax(flag, 1) * hl_freq.QuadPart / 1000;
+    ring_size = imax(get_int_from_configfile("hitchlog_events"), 1);
+    ring = malloc(ring_size * sizeof(struct hitchlog_record));
+    if (!ring) fail("can't allocate hitch log buffer.");
+    InitializeCriticalSection(&hl_cs);
+    hl_phase = -1;
+    
+    // chain to current target, since nommapcpk, cpktrace may have patched MapViewOfFile() call
+    MapViewOfFile_next = TOPTR(get_wrapper_branch_jtarget(gboffset + 0x1002B332));
+    make_wrapper_branch(gboffset + 0x1002B332, MapViewOfFile_hitchlog);
+    
+    add_gameloop_hook_filtered(hl_updatebegin_hook, GAMELOOP_MASK(GAMEEVENT_UPDATE_ATBEGIN));
+    add_grpkbdstate_hook(hl_grpkbdstate_hook);
+    add_preendscene_hook(hl_preendscene_hook);
+    add_postpresent_hook(hl_postpresent_hook);
+    add_gameloop_hook_filtered(hl_gameloop_hook, GAMELOOP_MASK(GAMELOOP_NORMAL));
+    add_atexit_hook(hl_atexit);
+    
+    hitchlog_enabled = 1;
+}
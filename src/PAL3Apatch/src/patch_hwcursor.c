@@ -0,0 +1,157 @@
+#include "common.h"
+
+// hardware cursor for soft-cursor mode
+//   in soft-cursor mode, UICursor::IRender() draws cursor texture as part of frame,
+//   so cursor moves once per frame, and lags behind mouse by whole frame latency
+//   with this patch, UICursor::IRender() doesn't draw anything,
+//   cursor textures are copied to D3D9 hardware cursor by SetCursorProperties(),
+//   scaled by softcursor_scalefactor, and cursor is moved by SetCursorPosition()
+//   when WM_MOUSEMOVE is received, so cursor moves at display refresh rate
+//
+//   needs softcursor=1, otherwise game uses its own cursor resources and UICursor has no texture
+//   cursor images are built once for each texture, in D3DPOOL_SCRATCH, which survives device reset
+//   cursor properties are set again after reset, since device forgets them
+//   with d3dthread, SetCursorPosition() in window procedure is a sync point of command queue
+
+struct hwcursor_image {
+    struct gbTexture *tex;
+    IDirect3DSurface9 *surface;
+    double scalefactor;
+};
+
+static struct hwcursor_image hc_image[CURSOR_NUM];
+static int hc_current = -1; // cursor type set to device, -1 if properties need to be set again
+static int hc_shown;
+static unsigned hc_nr_upload;
+static unsigned hc_nr_move;
+
+static unsigned round_pow2(unsigned x)
+{
+    unsigned r = 1;
+    while (r < x) r <<= 1;
+    return r;
+}
+
+static IDirect3DSurface9 *hc_build_image(struct gbTexture *tex, double scalefactor)
+{
+    IDirect3DDevice9 *dev = GB_GfxMgr->m_pd3dDevice;
+    IDirect3DTexture9 *d3dtex = (IDirect3DTexture9 *) ((struct gbTexture_D3D *) tex)->pTex;
+    IDirect3DSurface9 *src = NULL, *dst = NULL;
+    D3DSURFACE_DESC desc;
+    D3DLOCKED_RECT lrc;
+    
+    if (!d3dtex || FAILED(IDirect3DTexture9_GetSurfaceLevel(d3dtex, 0, &src))) return NULL;
+    if (FAILED(IDirect3DSurface9_GetDesc(src, &desc))) goto fail;
+    
+    // cursor bitmap must be D3DFMT_A8R8G8B8, use power of 2 size, and pad with transparent pixels
+    unsigned w = imax(1, floor(desc.Width * scalefactor + eps));
+    unsigned h = imax(1, floor(desc.Height * scalefactor + eps));
+    unsigned pw = round_pow2(w), ph = round_pow2(h);
+    if (FAILED(IDirect3DDevice9_CreateOffscreenPlainSurface(dev, pw, ph, D3DFMT_A8R8G8B8, D3DPOOL_SCRATCH, &dst, NULL))) goto fail;
+    if (FAILED(IDirect3DSurface9_LockRect(dst, &lrc, NULL, 0))) goto fail;
+    unsigned y;
+    for (y = 0; y < ph; y++) {
+        memset((char *) lrc.pBits + y * lrc.Pitch, 0, pw * 4);
+    }
+    IDirect3DSurface9_UnlockRect(dst);
+    
+    RECT rc = { 0, 0, w, h };
+    if (FAILED(D3DXLoadSurfaceFromSurface(dst, NULL, &rc, src, NULL, NULL, scalefactor == 1.0 ? D3DX_FILTER_NONE : D3DX_FILTER_TRIANGLE, 0))) goto fail;
+    IDirect3DSurface9_Release(src);
+    return dst;
+fail:
+    if (dst) IDirect3DSurface9_Release(dst);
+    IDirect3DSurface9_Release(src);
+    return NULL;
+}
+
+static IDirect3DSurface9 *hc_get_image(struct UICursor *this, int type)
+{
+    struct hwcursor_image *img = &hc_image[type];
+    double scalefactor = softcursor_scalefactor;
+    if (img->tex != this->m_tex[type] || img->scalefactor != scalefactor) {
+        if (img->surface) IDirect3DSurface9_Release(img->surface);
+        img->tex = this->m_tex[type];
+        img->scalefactor = scalefactor;
+        img->surface = img->tex ? hc_build_image(img->tex, scalefactor) : NULL;
+        if (img->tex && !img->surface) warning("can't build hardware cursor image for cursor type %d.", type);
+        hc_current = -1;
+    }
+    return img->surface;
+}
+
+static void hc_show(int show)
+{
+    if (hc_shown != show) {
+        IDirect3DDevice9_ShowCursor(GB_GfxMgr->m_pd3dDevice, show);
+        hc_shown = show;
+    }
+}
+
+// replacement of UICursor::IRender(), called at each frame
+static MAKE_THISCALL(void, UICursor_IRender_hwcursor, struct UICursor *this)
+{
+    IDirect3DDevice9 *dev = GB_GfxMgr->m_pd3dDevice;
+    int type = this->m_active;
+    if (!dev || !this->m_bShow || type < 0 || type >= CURSOR_NUM) {
+        hc_show(FALSE);
+        return;
+    }
+    
+    IDirect3DSurface9 *surface = hc_get_image(this, type);
+    if (!surface) {
+        hc_show(FALSE);
+        return;
+    }
+    if (hc_current != type) {
+        // hotspot is top-left corner, same as soft cursor
+        if (FAILED(IDirect3DDevice9_SetCursorProperties(dev, 0, 0, surface))) {
+            hc_show(FALSE);
+            return;
+        }
+        hc_current = type;
+        hc_shown = -1;
+        hc_nr_upload++;
+    }
+    hc_show(TRUE);
+}
+
+static void hc_wndproc_hook(void *arg)
+{
+    struct wndproc_hook_data *data = arg;
+    IDirect3DDevice9 *dev = GB_GfxMgr ? GB_GfxMgr->m_pd3dDevice : NULL;
+    if (!dev || hc_shown != TRUE) return;
+    
+    // SetCursorPosition() takes desktop coordinates in windowed mode
+    // in full-screen mode, client area is whole screen, so ClientToScreen() doesn't change anything
+    POINT pt = { .x = (short) LOWORD(data->lParam), .y = (short) HIWORD(data->lParam) };
+    ClientToScreen(data->hWnd, &pt);
+    IDirect3DDevice9_SetCursorPosition(dev, pt.x, pt.y, D3DCURSOR_IMMEDIATE_UPDATE);
+    hc_nr_move++;
+}
+static const UINT hc_wndproc_msgs[] = { WM_MOUSEMOVE, 0 };
+
+static void hc_onresetdevice(void)
+{
+    // cursor properties are lost after reset, images in D3DPOOL_SCRATCH are kept
+    hc_current = -1;
+    hc_shown = -1;
+}
+
+static void hc_report(void)
+{
+    plog("hwcursor: %u cursor uploads, %u cursor moves.", hc_nr_upload, hc_nr_move);
+}
+
+MAKE_PATCHSET(hwcursor)
+{
+    if (!get_int_from_configfile("softcursor")) {
+        warning("hwcursor needs softcursor=1, patch disabled.");
+        return;
+    }
+    hc_shown = -1;
+    make_jmp(0x0052B769, UICursor_IRender_hwcursor);
+    add_prewndproc_hook_filtered(hc_wndproc_hook, hc_wndproc_msgs);
+    add_onresetdevice_hook(hc_onresetdevice);
+    add_atexit_hook(hc_report);
+}
@@ -228,8 +228,20 @@ static void arc_wal_init(struct arc_wal *w, const char *arc)
         }
     }
 }
+static int arc_wal_pending(struct arc_wal *w)
+{
+    // save/load menus check every slot, so skip the full check
+    // if there is neither checksum file nor temporary file
+    int i;
+    if (file_exists(w->sum)) return 1;
+    for (i = 0; i < w->n; i++) {
+        if (file_exists(w->srcv[i])) return 1;
+    }
+    return 0;
+}
 static int arc_wal_check(struct arc_wal *w)
 {
+    if (!arc_wal_pending(w)) return 1;
     return wal_check(w->dstv, w->srcv, w->n, w->sum);
 }
 static int arc_wal_replace(struct arc_wal *w)
@@ -248,15 +260,209 @@ static void arc_wal_free(struct arc_wal *w)
 }
 
 static struct arc_wal rd;
+// compressed archive (improvearchive_compress)
+//   archive .wal written by engine is replaced by an LZ4 block with a small header
+//   before WAL commit, so .sum covers the compressed data and crash consistency is unchanged
+//   compressed archive is unpacked to a temporary file on read, engine opens it with
+//   'D' (delete on close), plain archives are read as before
+//   compressed archives are always unpacked, even if compression is disabled later
+
+#define MAX_ARC_SIZE (64 * 1024 * 1024)
+
+static const char arc_lz_magic[8] = "ARC_LZ4";
+struct arc_lz_hdr {
+    char magic[8];
+    unsigned rawsize;
+    unsigned lzsize;
+};
+
+static int compress_save;
+
+static int compress_arc(const char *filename)
+{
+    // returns 0 only if file is left damaged
+    FILE *fp = NULL;
+    void *raw = NULL;
+    void *lz = NULL;
+    unsigned lzsize, bound;
+    long rawsize;
+    int ret = 1;
+    
+    fp = fopen(filename, "rb");
+    if (!fp) goto done;
+    if (fseek(fp, 0, SEEK_END) != 0) goto done;
+    rawsize = ftell(fp);
+    if (rawsize <= 0 || rawsize > MAX_ARC_SIZE) goto done;
+    if (fseek(fp, 0, SEEK_SET) != 0) goto done;
+    raw = malloc(rawsize);
+    if (!raw) goto done;
+    if (fread(raw, 1, rawsize, fp) != (size_t) rawsize) goto done;
+    safe_fclose(&fp);
+    
+    bound = lz_compress_bound(rawsize);
+    lz = malloc(bound);
+    if (!lz) goto done;
+    lzsize = lz_compress(raw, rawsize, lz, bound);
+    if (!lzsize || lzsize + sizeof(struct arc_lz_hdr) >= (unsigned) rawsize) goto done;
+    
+    struct arc_lz_hdr hdr;
+    memcpy(hdr.magic, arc_lz_magic, sizeof(arc_lz_magic));
+    hdr.rawsize = rawsize;
+    hdr.lzsize = lzsize;
+    ret = 0;
+    fp = robust_fopen(filename, "wb");
+    if (!fp) goto done;
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) goto done;
+    if (fwrite(lz, 1, lzsize, fp) != lzsize) goto done;
+    if (safe_fclose(&fp) != 0) goto done;
+    ret = 1;
+    
+done:
+    safe_fclose(&fp);
+    free(lz);
+    free(raw);
+    return ret;
+}
+
+static int unpack_arc(const char *filename, char **tmpfile)
+{
+    // returns 0 if archive is compressed but can't be unpacked
+    //   *tmpfile is set to unpacked file if archive is compressed
+    FILE *fp = NULL;
+    void *raw = NULL;
+    void *lz = NULL;
+    struct arc_lz_hdr hdr;
+    int ret = 1;
+    
+    *tmpfile = NULL;
+    fp = fopen(filename, "rb");
+    if (!fp) goto done;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1) goto done;
+    if (memcmp(hdr.magic, arc_lz_magic, sizeof(arc_lz_magic)) != 0) goto done;
+    
+    ret = 0;
+    if (hdr.rawsize > MAX_ARC_SIZE || hdr.lzsize > lz_compress_bound(hdr.rawsize)) goto done;
+    raw = malloc(hdr.rawsize + 1);
+    lz = malloc(hdr.lzsize + 1);
+    if (!raw || !lz) goto done;
+    if (fread(lz, 1, hdr.lzsize, fp) != hdr.lzsize) goto done;
+    if (lz_decompress(lz, hdr.lzsize, raw, hdr.rawsize) != (int) hdr.rawsize) goto done;
+    safe_fclose(&fp);
+    
+    *tmpfile = replace_extension(filename, ".tmp");
+    fp = robust_fopen(*tmpfile, "wb");
+    if (!fp) goto done;
+    if (fwrite(raw, 1, hdr.rawsize, fp) != hdr.rawsize) goto done;
+    if (safe_fclose(&fp) != 0) goto done;
+    ret = 1;
+    
+done:
+    safe_fclose(&fp);
+    if (!ret) {
+        warning("can't unpack compressed archive '%s'.", filename);
+        free(*tmpfile);
+        *tmpfile = NULL;
+    }
+    free(lz);
+    free(raw);
+    return ret;
+}
+
+static FILE *open_arc(const char *filename, const char *mode)
+{
+    char *tmpfile;
+    if (!unpack_arc(filename, &tmpfile)) return NULL;
+    if (!tmpfile) return pal3afsopen(filename, mode, 0x40);
+    
+    char tmpmode[16];
+    snprintf(tmpmode, sizeof(tmpmode), "%sD", mode);
+    FILE *fp = pal3afsopen(tmpfile, tmpmode, 0x40);
+    free(tmpfile);
+    return fp;
+}
+
 static struct arc_wal wr;
 
+// background save (flag >= 2)
+//   archive is still written to .wal by engine on main thread,
+//   then screen image is copied, JPEG encoding and WAL commit run on job system
+//   .sum is written only after all .wal files are complete, so crash consistency is unchanged
+//   pending save is waited for before any later archive access, and at exit
+
+struct arc_save {
+    struct arc_wal w;
+    struct gbImage2D img;
+    int result;
+};
+
+static int async_save;
+static struct job *pending_save;
+
+static void arc_save_wait(void)
+{
+    if (pending_save) {
+        job_wait(pending_save);
+        job_release(pending_save);
+        pending_save = NULL;
+    }
+}
+
+static void write_arc_picture(struct gbImage2D *img, char *jpgfile)
+{
+    reset_attrib(jpgfile);
+    gbImage2D_WriteJpegImage(img, jpgfile, 100);
+    if (!file_exists(jpgfile)) {
+        FILE *fp = fopen(jpgfile, "wb");
+        safe_fclose(&fp);
+    }
+}
+
+static struct arc_save *arc_save_snapshot(void)
+{
+    struct gbImage2D *img = &PAL3_m_screenImg;
+    size_t size = img->pBits ? (size_t) img->Width * img->Height * (img->BitCount / 8) : 0;
+    struct arc_save *s = malloc(sizeof(struct arc_save));
+    if (!s) return NULL;
+    memset(s, 0, sizeof(*s));
+    s->img = *img;
+    s->img.pBits = NULL;
+    if (size) {
+        s->img.pBits = malloc(size);
+        if (!s->img.pBits) {
+            free(s);
+            return NULL;
+        }
+        memcpy(s->img.pBits, img->pBits, size);
+    }
+    return s;
+}
+
+static void arc_save_worker(void *arg)
+{
+    struct arc_save *s = arg;
+    if (s->w.mode != ARC_MODE_PAL3A_FIN) write_arc_picture(&s->img, s->w.src[ARC_FILE_PICTURE]);
+    s->result = (!compress_save || compress_arc(s->w.src[ARC_FILE_ARCHIVE])) && arc_wal_replace(&s->w);
+}
+
+static void arc_save_done(void *arg)
+{
+    // called on main thread
+    struct arc_save *s = arg;
+    if (!s->result) warning("can't commit archive '%s'.", s->w.dst[ARC_FILE_ARCHIVE]);
+    arc_wal_free(&s->w);
+    free(s->img.pBits);
+    free(s);
+}
+
 static FILE *my_fopen(const char *filename, const char *mode)
 {
     if (is_arc(filename)) {
+        arc_save_wait();
         if (*mode == 'r') {
             arc_wal_free(&rd);
             arc_wal_init(&rd, filename);
             arc_wal_check(&rd);
+            return open_arc(filename, mode);
         }
         if (*mode == 'w') {
             arc_wal_free(&wr);
@@ -272,17 +478,22 @@ static MAKE_THISCALL(BOOL, Archive_Save_wrapper, struct Archive *this, int index
 {
     BOOL ret = Archive_Save(this, index);
     if (ret) {
-        if (wr.mode != ARC_MODE_PAL3A_FIN) {
-            char *jpgfile = wr.src[ARC_FILE_PICTURE];
-            reset_attrib(jpgfile);
-            gbImage2D_WriteJpegImage(&PAL3_m_screenImg, jpgfile, 100);
-            if (!file_exists(jpgfile)) {
-                FILE *fp = fopen(jpgfile, "wb");
-                safe_fclose(&fp);
-            }
-        }
+        // task pictures depend on game state, always save them here
         save_taskpic(wr.src[ARC_FILE_TASKPIC]);
-        if (!arc_wal_replace(&wr)) ret = FALSE;
+        
+        struct arc_save *s = async_save ? arc_save_snapshot() : NULL;
+        if (s) {
+            // hand over wal to background save
+            s->w = wr;
+            memset(&wr, 0, sizeof(wr));
+            pending_save = job_submit(arc_save_worker, s);
+            job_release(job_then_main(pending_save, arc_save_done, s));
+            return ret;
+        }
+        
+        if (wr.mode != ARC_MODE_PAL3A_FIN) write_arc_picture(&PAL3_m_screenImg, wr.src[ARC_FILE_PICTURE]);
+        if (compress_save && !compress_arc(wr.src[ARC_FILE_ARCHIVE])) ret = FALSE;
+        else if (!arc_wal_replace(&wr)) ret = FALSE;
 
         arc_wal_free(&wr);
     }
@@ -303,6 +514,7 @@ static MAKE_THISCALL(BOOL, my_Archive_Delete, struct Archive *this, int index)
 {
     struct arc_wal rm;
     char s[128];
+    arc_save_wait();
     BOOL ret = PrepareDir();
     if (ret)
     {
@@ -319,6 +531,10 @@ static MAKE_THISCALL(BOOL, my_Archive_Delete, struct Archive *this, int index)
 
 MAKE_PATCHSET(improvearchive)
 {
+    async_save = flag >= 2;
+    compress_save = get_int_from_configfile("improvearchive_compress");
+    if (async_save) add_atexit_hook(arc_save_wait);
+    
     make_jmp(0x00541DFE, my_fopen);
     
     INIT_WRAPPER_CALL(Archive_Save_wrapper, { 0x004A25B7 });
@@ -0,0 +1,54 @@
+#include "common.h"
+
+// low-fragmentation heap for game CRT heaps
+//   GBENGINE.DLL and PAL3A.EXE are linked with static MSVC6 CRT, so there are
+//   no malloc/free imports to redirect, and operator new/delete call into
+//   CRT internals directly, replacing the allocator would leave blocks that
+//   can only be freed by the old one
+//   instead, we find the CRT heap with find_allocator_heap() and switch it
+//   to Windows LFH, the heap handle and every existing block stay valid,
+//   so mismatched frees still work
+//   blocks served by MSVC small-block heap are not affected
+
+#define HEAP_COMPATIBILITY_INFORMATION 0 // HeapCompatibilityInformation
+#define HEAP_COMPATIBILITY_LFH 2
+
+static BOOL (WINAPI *myHeapSetInformation)(HANDLE, int, PVOID, SIZE_T);
+static BOOL (WINAPI *myHeapQueryInformation)(HANDLE, int, PVOID, SIZE_T, PSIZE_T);
+
+static void enable_lfh(const char *name, const struct memory_allocator *allocator)
+{
+    HANDLE heap = find_allocator_heap(allocator);
+    if (!heap) {
+        warning("can't find CRT heap of %s, low-fragmentation heap not enabled.", name);
+        return;
+    }
+    
+    ULONG mode;
+    if (myHeapQueryInformation && myHeapQueryInformation(heap, HEAP_COMPATIBILITY_INFORMATION, &mode, sizeof(mode), NULL) && mode == HEAP_COMPATIBILITY_LFH) {
+        plog("lfhheap: heap %08X of %s already uses LFH.", TOUINT(heap), name);
+        return;
+    }
+    
+    // fails if heap is created with HEAP_NO_SERIALIZE, or under a debugger
+    mode = HEAP_COMPATIBILITY_LFH;
+    if (!myHeapSetInformation(heap, HEAP_COMPATIBILITY_INFORMATION, &mode, sizeof(mode))) {
+        warning("can't enable low-fragmentation heap for %s, error %u.", name, (unsigned) GetLastError());
+        return;
+    }
+    plog("lfhheap: LFH enabled for heap %08X of %s.", TOUINT(heap), name);
+}
+
+MAKE_PATCHSET(lfhheap)
+{
+    HMODULE hKernel32 = GetModuleHandle("KERNEL32.DLL");
+    myHeapSetInformation = TOPTR(GetProcAddress(hKernel32, "HeapSetInformation"));
+    myHeapQueryInformation = TOPTR(GetProcAddress(hKernel32, "HeapQueryInformation"));
+    if (is_win9x() || !myHeapSetInformation) {
+        warning("lfhheap requires Windows XP or later.");
+        return;
+    }
+    
+    enable_lfh("GBENGINE.DLL", &gb_mem_allocator);
+    if (flag >= 2) enable_lfh("PAL3A.EXE", &pal3a_mem_allocator);
+}
@@ -0,0 +1,208 @@
+#include "common.h"
+
+// per-scene load time breakdown
+//   a load is the run of consecutive frames in which UpdateLoading() is called,
+//   when it finishes, one line is appended to LOADTIMES_FILE:
+//     wall time, CPK view maps, texture loads, effect compilations, and the rest
+//
+//   events come from hitchlog_event(), see patch_hitchlog.c
+//   texture time doesn't include CPK maps made while loading that texture
+//   model parsing is not hooked, so it is counted in 'other'
+
+#define LOADTIMES_FILE "PAL3Apatch.loadtimes.csv"
+#define LOADTIMES_MAXCPKSPAN 64
+
+enum loadtimes_bucket {
+    LT_CPK,
+    LT_TEXTURE,
+    LT_EFFECT,
+    LT_MAX_BUCKETS // EOF
+};
+
+struct lt_span {
+    LONGLONG begin, end;
+};
+
+int loadtimes_enabled = 0;
+
+static LARGE_INTEGER lt_freq;
+static CRITICAL_SECTION lt_cs;
+static DWORD lt_threadid;
+
+static LARGE_INTEGER lt_frame_begin;
+static int lt_frame_loading;
+static LONGLONG lt_frame_ticks[LT_MAX_BUCKETS];
+static unsigned lt_frame_count[LT_MAX_BUCKETS];
+
+static int lt_active;
+static LONGLONG lt_begin;
+static LONGLONG lt_ticks[LT_MAX_BUCKETS];
+static unsigned lt_count[LT_MAX_BUCKETS];
+static unsigned lt_nframes;
+static int lt_gamestate;
+static char lt_oldscene[MAXLINE];
+
+// recent CPK maps, used to exclude them from texture and effect time
+static struct lt_span lt_cpkspan[LOADTIMES_MAXCPKSPAN];
+static unsigned lt_cpkspan_head;
+
+static FILE *lt_fp;
+static unsigned lt_reported;
+
+static void (*UpdateLoading_next)(void);
+static LPVOID (WINAPI *MapViewOfFile_next)(HANDLE, DWORD, DWORD, DWORD, SIZE_T);
+
+static double ticks2ms(LONGLONG ticks)
+{
+    return ticks * 1000.0 / lt_freq.QuadPart;
+}
+
+void loadtimes_event(int type, unsigned size, LONGLONG begin, LONGLONG end)
+{
+    // only events of game thread belong to scene loading
+    if (GetCurrentThreadId() != lt_threadid) return;
+    EnterCriticalSection(&lt_cs);
+    if (begin >= lt_frame_begin.QuadPart) {
+        LONGLONG ticks = end - begin;
+        switch (type) {
+            case HITCHLOG_CPK:
+                lt_cpkspan[lt_cpkspan_head++ % LOADTIMES_MAXCPKSPAN] = (struct lt_span) { begin, end };
+                lt_frame_ticks[LT_CPK] += ticks;
+                lt_frame_count[LT_CPK]++;
+                break;
+            case HITCHLOG_TEXTURE:
+            case HITCHLOG_EFFECT: {
+                // nested CPK maps are reported before the enclosing event
+                unsigned i, n = lt_cpkspan_head < LOADTIMES_MAXCPKSPAN ? lt_cpkspan_head : LOADTIMES_MAXCPKSPAN;
+                for (i = 1; i <= n; i++) {
+                    struct lt_span *s = &lt_cpkspan[(lt_cpkspan_head - i) % LOADTIMES_MAXCPKSPAN];
+                    if (s->begin < begin) break;
+                    if (s->end <= end) ticks -= s->end - s->begin;
+                }
+                int bucket = type == HITCHLOG_TEXTURE ? LT_TEXTURE : LT_EFFECT;
+                if (ticks > 0) lt_frame_ticks[bucket] += ticks;
+                lt_frame_count[bucket]++;
+                break;
+            }
+        }
+    }
+    LeaveCriticalSection(&lt_cs);
+}
+
+static LPVOID WINAPI MapViewOfFile_loadtimes(HANDLE hFileMappingObject, DWORD dwDesiredAccess, DWORD dwFileOffsetHigh, DWORD dwFileOffsetLow, SIZE_T dwNumberOfBytesToMap)
+{
+    LARGE_INTEGER begin, end;
+    QueryPerformanceCounter(&begin);
+    LPVOID ret = MapViewOfFile_next(hFileMappingObject, dwDesiredAccess, dwFileOffsetHigh, dwFileOffsetLow, dwNumberOfBytesToMap);
+    QueryPerformanceCounter(&end);
+    loadtimes_event(HITCHLOG_CPK, dwNumberOfBytesToMap, begin.QuadPart, end.QuadPart);
+    return ret;
+}
+
+static void lt_report(LONGLONG end)
+{
+    if (!lt_fp) {
+        int newfile = !file_exists(LOADTIMES_FILE);
+        lt_fp = robust_fopen(LOADTIMES_FILE, "a");
+        if (!lt_fp) {
+            warning("can't open load times file '%s', load times disabled.", LOADTIMES_FILE);
+            loadtimes_enabled = 0;
+            return;
+        }
+        if (newfile) fprintf(lt_fp, "version,scene,cpk,from,gamestate,frames,total_ms,cpk_ms,cpk_maps,texture_ms,textures,effect_ms,effects,other_ms\n");
+    }
+
+    LONGLONG total = end - lt_begin;
+    LONGLONG other = total - lt_ticks[LT_CPK] - lt_ticks[LT_TEXTURE] - lt_ticks[LT_EFFECT];
+    if (other < 0) other = 0;
+    const char *cpkfile = g_pVFileSys->m_cpk.m_bLoaded ? get_filepart(g_pVFileSys->m_cpk.m_szCPKFileName) : "";
+    fprintf(lt_fp, "%s,%s,%s,%s,%d,%u,%.3f,%.3f,%u,%.3f,%u,%.3f,%u,%.3f\n",
+        patch_version, vfs_cpkname(), cpkfile, lt_oldscene, lt_gamestate, lt_nframes,
+        ticks2ms(total),
+        ticks2ms(lt_ticks[LT_CPK]), lt_count[LT_CPK],
+        ticks2ms(lt_ticks[LT_TEXTURE]), lt_count[LT_TEXTURE],
+        ticks2ms(lt_ticks[LT_EFFECT]), lt_count[LT_EFFECT],
+        ticks2ms(other));
+    fflush(lt_fp);
+    lt_reported++;
+}
+
+static void lt_updatebegin_hook(void *arg)
+{
+    // remember which scene we are loading from
+    if (!lt_frame_loading && !lt_active && g_pVFileSys) snprintf(lt_oldscene, sizeof(lt_oldscene), "%s", vfs_cpkname());
+}
+
+static void UpdateLoading_loadtimes(void)
+{
+    lt_frame_loading = 1;
+    UpdateLoading_next();
+}
+
+static void lt_gameloop_hook(void *arg)
+{
+    LARGE_INTEGER now;
+    int i;
+    QueryPerformanceCounter(&now);
+    EnterCriticalSection(&lt_cs);
+    if (lt_frame_loading) {
+        // merge this frame into current load
+        if (!lt_active) {
+            lt_active = 1;
+            lt_begin = lt_frame_begin.QuadPart;
+            lt_nframes = 0;
+            lt_gamestate = PAL3_s_gamestate;
+            memset(lt_ticks, 0, sizeof(lt_ticks));
+            memset(lt_count, 0, sizeof(lt_count));
+        }
+        for (i = 0; i < LT_MAX_BUCKETS; i++) {
+            lt_ticks[i] += lt_frame_ticks[i];
+            lt_count[i] += lt_frame_count[i];
+        }
+        lt_nframes++;
+    } else if (lt_active) {
+        // load is finished at begin of this frame
+        lt_active = 0;
+        if (loadtimes_enabled && g_pVFileSys) lt_report(lt_frame_begin.QuadPart);
+    }
+    lt_frame_begin = now;
+    lt_frame_loading = 0;
+    memset(lt_frame_ticks, 0, sizeof(lt_frame_ticks));
+    memset(lt_frame_count, 0, sizeof(lt_frame_count));
+    LeaveCriticalSection(&lt_cs);
+}
+
+static void lt_atexit()
+{
+    if (lt_fp) {
+        plog("load times: %u loads recorded.", lt_reported);
+        safe_fclose(&lt_fp);
+    }
+}
+
+MAKE_PATCHSET(loadtimes)
+{
+    if (!QueryPerformanceFrequency(&lt_freq)) {
+        warning("can't query performance frequency, load times disabled.");
+        return;
+    }
+    InitializeCriticalSection(&lt_cs);
+    lt_threadid = GetCurrentThreadId();
+    QueryPerformanceCounter(&lt_frame_begin);
+
+    // chain to current targets, since fixloading, cpkprefetch may have patched UpdateLoading() calls
+    UpdateLoading_next = TOPTR(get_wrapper_branch_jtarget(0x0041E8A1));
+    INIT_WRAPPER_CALL(UpdateLoading_loadtimes, { 0x0041E8A1, 0x0041E9D0, 0x0041EAFD, 0x0041EB9C, 0x0041EBCD });
+
+    // hitchlog already reports CPK maps through hitchlog_event()
+    if (!hitchlog_enabled) {
+        MapViewOfFile_next = TOPTR(get_wrapper_branch_jtarget(gboffset + 0x1002B332));
+        make_wrapper_branch(gboffset + 0x1002B332, MapViewOfFile_loadtimes);
+    }
+
+    add_gameloop_hook_filtered(lt_updatebegin_hook, GAMELOOP_MASK(GAMEEVENT_UPDATE_ATBEGIN));
+    add_gameloop_hook_filtered(lt_gameloop_hook, GAMELOOP_MASK(GAMELOOP_NORMAL));
+    add_atexit_hook(lt_atexit);
+
+    loadtimes_enabled = 1;
+}
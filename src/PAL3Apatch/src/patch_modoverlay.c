@@ -0,0 +1,308 @@
+#include "common.h"
+
+// mod overlay
+//   loose files under "mod\<cpkname>\" replace entries with the same path in <cpkname>.cpk,
+//   CPKs are still used for everything else
+//   mod folder is indexed once at startup, CRCs of paths are computed on first table load
+//
+//   when engine reads a CPK table (ReadFile() into CPK::m_CPKTable), each overridden entry
+//   is rewritten in place: marked as not compressed, sizes set to the loose file,
+//   and start position moved to a private range beyond the end of CPK file
+//   a view mapped in that range is served from the loose file, read at map time
+//   lookups of all other files are untouched, and cost nothing
+//
+//   only files which already exist in a CPK can be overridden,
+//   and only CPKs in file mapping mode are overlaid
+
+#define MODOVERLAY_DIR "mod"
+#define MODOVERLAY_PADBYTE 0xCC
+
+struct modfile {
+    char cpkname[MAX_PATH]; // lower case, without extension
+    char relpath[MAXLINE]; // lower case, backslashes
+    char path[MAXLINE];
+    unsigned crc;
+};
+
+struct modentry {
+    struct modfile *f;
+    DWORD start;
+    DWORD size;
+    DWORD extrasize;
+};
+
+struct modcpk {
+    struct CPK *cpk;
+    DWORD begin, end; // private range
+    struct bvec entries; // struct modentry
+};
+
+static struct bvec modfiles; // struct modfile *
+static int modcrc_ready;
+static struct modcpk modcpks[4];
+static struct bvec modviews; // void *, buffers of served views
+static unsigned mod_patched, mod_served;
+static CRITICAL_SECTION mod_cs;
+
+static BOOL (WINAPI *ReadFile_next)(HANDLE, LPVOID, DWORD, LPDWORD, LPOVERLAPPED);
+static LPVOID (WINAPI *MapViewOfFile_next)(HANDLE, DWORD, DWORD, DWORD, SIZE_T);
+static BOOL (WINAPI *UnmapViewOfFile_next)(LPCVOID);
+
+static void mod_lower(char *s)
+{
+    for (; *s; s++) {
+        if ('A' <= *s && *s <= 'Z') *s += 'a' - 'A';
+        if (*s == '/') *s = '\\';
+    }
+}
+
+static void mod_scan(const char *cpkname, char *path, size_t baselen, size_t len)
+{
+    WIN32_FIND_DATAA fd;
+    HANDLE hFind;
+
+    if (len + 3 >= MAXLINE) return;
+    strcpy(path + len, "\\*");
+    hFind = FindFirstFileA(path, &fd);
+    if (hFind == INVALID_HANDLE_VALUE) return;
+    do {
+        size_t n = strlen(fd.cFileName);
+        if (strcmp(fd.cFileName, ".") == 0 || strcmp(fd.cFileName, "..") == 0) continue;
+        if (len + 1 + n >= MAXLINE) continue;
+        path[len] = '\\';
+        strcpy(path + len + 1, fd.cFileName);
+        if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            mod_scan(cpkname, path, baselen, len + 1 + n);
+        } else {
+            struct modfile *f = malloc(sizeof(struct modfile));
+            strcpy(f->cpkname, cpkname);
+            strcpy(f->relpath, path + baselen + 1);
+            mod_lower(f->relpath);
+            strcpy(f->path, path);
+            f->crc = 0;
+            bvec_tpushback(&modfiles, &f, struct modfile *);
+        }
+    } while (FindNextFileA(hFind, &fd));
+    FindClose(hFind);
+    path[len] = 0;
+}
+
+static void mod_index(void)
+{
+    WIN32_FIND_DATAA fd;
+    HANDLE hFind;
+    char path[MAXLINE];
+
+    hFind = FindFirstFileA(MODOVERLAY_DIR "\\*", &fd);
+    if (hFind == INVALID_HANDLE_VALUE) return;
+    do {
+        if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) || fd.cFileName[0] == '.') continue;
+        if (strlen(fd.cFileName) >= MAX_PATH) continue;
+        char cpkname[MAX_PATH];
+        strcpy(cpkname, fd.cFileName);
+        mod_lower(cpkname);
+        snprintf(path, sizeof(path), "%s\\%s", MODOVERLAY_DIR, fd.cFileName);
+        mod_scan(cpkname, path, strlen(path), strlen(path));
+    } while (FindNextFileA(hFind, &fd));
+    FindClose(hFind);
+}
+
+static struct CPK *mod_getcpk(int i)
+{
+    // same CPKs as vfs_findcpk()
+    switch (i) {
+        case 0: return g_pVFileSys ? &g_pVFileSys->m_cpk : NULL;
+        case 1: return &g_bink.m_Cpk;
+        case 2: return &g_bink.m_Cpk2;
+        case 3: return &SoundMgr_Inst()->m_Cpk;
+    }
+    return NULL;
+}
+
+// rewrite table entries of a freshly read CPK table
+static void mod_patchtable(struct modcpk *m, HANDLE hFile)
+{
+    char cpkname[MAX_PATH];
+    DWORD size_hi, size_lo;
+    DWORD gran = m->cpk->m_dwAllocGranularity;
+    unsigned long long pos;
+    int i, n = bvec_tsize(&modfiles, struct modfile *);
+
+    bvec_clear(&m->entries);
+    m->begin = m->end = 0;
+    if (m->cpk->m_eMode != CPKM_FileMapping || !gran) return;
+
+    // generate CRCs, gbCrc32 is surely ready when engine is loading a CPK
+    if (!modcrc_ready) {
+        for (i = 0; i < n; i++) {
+            struct modfile *f = bvec_tat(&modfiles, i, struct modfile *);
+            f->crc = gbCrc32Compute(f->relpath);
+        }
+        modcrc_ready = 1;
+    }
+
+    // CPK name is file part of CPK path without extension
+    snprintf(cpkname, sizeof(cpkname), "%s", get_filepart(m->cpk->m_szCPKFileName));
+    char *ext = strrchr(cpkname, '.');
+    if (ext) *ext = 0;
+    mod_lower(cpkname);
+
+    size_lo = GetFileSize(hFile, &size_hi);
+    if (size_lo == INVALID_FILE_SIZE && GetLastError() != NO_ERROR) return;
+    pos = (((unsigned long long) size_hi << 32) + size_lo + gran - 1) / gran * gran + gran;
+    m->begin = pos;
+
+    for (i = 0; i < n; i++) {
+        struct modfile *f = bvec_tat(&modfiles, i, struct modfile *);
+        WIN32_FILE_ATTRIBUTE_DATA attr;
+        if (strcmp(f->cpkname, cpkname) != 0) continue;
+        int tindex = vfsread_findcrc(m->cpk, f->crc);
+        if (tindex < 0) {
+            warning("mod file '%s' not found in '%s', ignored.", f->path, m->cpk->m_szCPKFileName);
+            continue;
+        }
+        if (!GetFileAttributesExA(f->path, GetFileExInfoStandard, &attr) || attr.nFileSizeHigh) continue;
+
+        struct CPKTable *t = &m->cpk->m_CPKTable[tindex];
+        unsigned long long next = pos + ((unsigned long long) attr.nFileSizeLow + t->dwExtraInfoSize + gran - 1) / gran * gran;
+        if (next > 0xFFFFFFFFu) break;
+
+        struct modentry e = { f, pos, attr.nFileSizeLow, t->dwExtraInfoSize };
+        bvec_tpushback(&m->entries, &e, struct modentry);
+        t->dwFlag |= 0x10000; // not compressed
+        t->dwStartPos = pos;
+        t->dwPackedSize = t->dwOriginSize = attr.nFileSizeLow;
+        pos = next;
+        mod_patched++;
+    }
+    m->end = pos;
+}
+
+static BOOL WINAPI ReadFile_modoverlay(HANDLE hFile, LPVOID lpBuffer, DWORD nNumberOfBytesToRead, LPDWORD lpNumberOfBytesRead, LPOVERLAPPED lpOverlapped)
+{
+    BOOL ret = ReadFile_next(hFile, lpBuffer, nNumberOfBytesToRead, lpNumberOfBytesRead, lpOverlapped);
+    if (!ret || lpOverlapped) return ret;
+
+    int i;
+    for (i = 0; i < 4; i++) {
+        struct CPK *cpk = mod_getcpk(i);
+        if (cpk && lpBuffer == cpk->m_CPKTable) {
+            EnterCriticalSection(&mod_cs);
+            modcpks[i].cpk = cpk;
+            mod_patchtable(&modcpks[i], hFile);
+            LeaveCriticalSection(&mod_cs);
+            break;
+        }
+    }
+    return ret;
+}
+
+// build view content of an overridden entry, data followed by extrainfo
+static int mod_fillview(const struct modentry *e, void *buf)
+{
+    HANDLE hFile;
+    DWORD nread = 0;
+    BOOL ok;
+
+    hFile = CreateFileA(e->f->path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return 0;
+    ok = ReadFile(hFile, buf, e->size, &nread, NULL);
+    CloseHandle(hFile);
+    if (!ok) return 0;
+    if (nread != e->size) {
+        warning("mod file '%s' is changed, size %u expected.", e->f->path, e->size);
+    }
+
+    // extrainfo is the name followed by padding
+    char *extra = PTRADD(buf, e->size);
+    const char *name = get_filepart(e->f->relpath);
+    memset(extra, MODOVERLAY_PADBYTE, e->extrasize);
+    memcpy(extra, name, imin(strlen(name), e->extrasize));
+    if (strlen(name) < e->extrasize) memset(extra + strlen(name), 0, imin(2, e->extrasize - strlen(name)));
+    return 1;
+}
+
+static LPVOID WINAPI MapViewOfFile_modoverlay(HANDLE hFileMappingObject, DWORD dwDesiredAccess, DWORD dwFileOffsetHigh, DWORD dwFileOffsetLow, SIZE_T dwNumberOfBytesToMap)
+{
+    int i, j, n;
+    if (dwFileOffsetHigh) goto next;
+
+    EnterCriticalSection(&mod_cs);
+    for (i = 0; i < 4; i++) {
+        struct modcpk *m = &modcpks[i];
+        if (!m->cpk || !m->cpk->m_bLoaded) continue;
+        if (m->cpk->m_dwCPKMappingHandle != TOUINT(hFileMappingObject) && m->cpk->m_dwCPKHandle != TOUINT(hFileMappingObject)) continue;
+        if (dwFileOffsetLow < m->begin || dwFileOffsetLow >= m->end) continue;
+
+        n = bvec_tsize(&m->entries, struct modentry);
+        for (j = 0; j < n; j++) {
+            struct modentry e = bvec_tat(&m->entries, j, struct modentry);
+            if (e.start != dwFileOffsetLow) continue;
+            LeaveCriticalSection(&mod_cs);
+
+            void *base = VirtualAlloc(NULL, imax(dwNumberOfBytesToMap, e.size + e.extrasize), MEM_COMMIT, PAGE_READWRITE);
+            if (!base) return NULL;
+            if (!mod_fillview(&e, base)) {
+                warning("can't read mod file '%s'.", e.f->path);
+            }
+
+            EnterCriticalSection(&mod_cs);
+            bvec_tpushback(&modviews, &base, void *);
+            mod_served++;
+            LeaveCriticalSection(&mod_cs);
+            return base;
+        }
+    }
+    LeaveCriticalSection(&mod_cs);
+next:
+    return MapViewOfFile_next(hFileMappingObject, dwDesiredAccess, dwFileOffsetHigh, dwFileOffsetLow, dwNumberOfBytesToMap);
+}
+
+static BOOL WINAPI UnmapViewOfFile_modoverlay(LPCVOID lpBaseAddress)
+{
+    int i, n;
+    EnterCriticalSection(&mod_cs);
+    n = bvec_tsize(&modviews, void *);
+    for (i = 0; i < n; i++) {
+        if (bvec_tat(&modviews, i, void *) == lpBaseAddress) {
+            bvec_tat(&modviews, i, void *) = bvec_tback(&modviews, void *);
+            bvec_tpopback(&modviews, void *);
+            LeaveCriticalSection(&mod_cs);
+            return VirtualFree((LPVOID) lpBaseAddress, 0, MEM_RELEASE);
+        }
+    }
+    LeaveCriticalSection(&mod_cs);
+    return UnmapViewOfFile_next(lpBaseAddress);
+}
+
+static void mod_report(void)
+{
+    plog("modoverlay: %u files indexed, %u entries overlaid, %u views served.", bvec_tsize(&modfiles, struct modfile *), mod_patched, mod_served);
+}
+
+MAKE_PATCHSET(modoverlay)
+{
+    int i;
+    if (is_win9x()) {
+        // IAT patching is not compatible with KernelEx
+        warning("modoverlay doesn't support win9x.");
+        return;
+    }
+
+    bvec_ctor(&modfiles);
+    bvec_ctor(&modviews);
+    for (i = 0; i < 4; i++) bvec_ctor(&modcpks[i].entries);
+    mod_index();
+    if (!bvec_tsize(&modfiles, struct modfile *)) return;
+
+    InitializeCriticalSection(&mod_cs);
+    add_atexit_hook(mod_report);
+
+    // chain to current hooks, since cpktblcache may have hooked ReadFile(),
+    // and nommapcpk, cpktrace, audioprefetch and sndcache may have patched these calls
+    ReadFile_next = hook_import_table(TOPTR(gboffset + 0x10000000), "KERNEL32.DLL", "ReadFile", ReadFile_modoverlay);
+    MapViewOfFile_next = TOPTR(get_wrapper_branch_jtarget(gboffset + 0x1002B332));
+    UnmapViewOfFile_next = TOPTR(get_wrapper_branch_jtarget(gboffset + 0x1002B354));
+    make_wrapper_branch(gboffset + 0x1002B332, MapViewOfFile_modoverlay);
+    make_wrapper_branch(gboffset + 0x1002B354, UnmapViewOfFile_modoverlay);
+}
@@ -0,0 +1,207 @@
+#include "common.h"
+
+// movie prefetch
+//   movies are played from views of gbBinkVideo's CPKs, so the first frames
+//   page fault on a cold file while the screen stays black
+//   movies opened in each scene CPK are recorded to MOVIEPREFETCH_FILE,
+//   when that scene CPK is loaded again, the recorded movies are read by
+//   a background job with vfsread, so the file cache is warm before the
+//   script starts the movie, reading stops when scene CPK is switched
+//
+//   manifest format:
+//     [CPKNAME]
+//     MOVIEFILE     (one per line)
+//
+//   the Bink handle is still opened by engine, only the file data is read ahead
+
+#define MOVIEPREFETCH_FILE "PAL3patch.movieprefetch"
+#define MOVIEPREFETCH_MAXSECTION 256
+#define MOVIEPREFETCH_MAXMOVIE 8
+#define MOVIEPREFETCH_MAXJOBS 2
+#define MOVIEPREFETCH_BUFSIZE 0x40000
+
+struct mp_section {
+    char name[CPKTRACE_NAMELEN];
+    char *movies[MOVIEPREFETCH_MAXMOVIE];
+    int n;
+};
+
+static struct mp_section sections[MOVIEPREFETCH_MAXSECTION];
+static int nr_sections;
+static int manifest_dirty;
+static unsigned movie_limit;
+
+struct mp_job {
+    struct vfsread_file *fp;
+    LONG gen;
+};
+
+static volatile LONG mp_gen;
+static char last_cpkfile[sizeof(((struct CPK *) 0)->m_szCPKFileName)];
+static unsigned nr_prefetched;
+static volatile LONG nr_kbytes;
+
+static struct mp_section *find_section(const char *name)
+{
+    int i;
+    for (i = 0; i < nr_sections; i++) {
+        if (stricmp(sections[i].name, name) == 0) return &sections[i];
+    }
+    return NULL;
+}
+
+static struct mp_section *new_section(const char *name)
+{
+    struct mp_section *s = find_section(name);
+    if (s) return s;
+    if (nr_sections >= MOVIEPREFETCH_MAXSECTION) return NULL;
+    s = &sections[nr_sections++];
+    snprintf(s->name, sizeof(s->name), "%s", name);
+    s->n = 0;
+    return s;
+}
+
+static int add_movie(struct mp_section *s, const char *moviefile)
+{
+    int i;
+    for (i = 0; i < s->n; i++) {
+        if (stricmp(s->movies[i], moviefile) == 0) return 0;
+    }
+    if (s->n >= MOVIEPREFETCH_MAXMOVIE) return 0;
+    s->movies[s->n++] = strdup(moviefile);
+    return 1;
+}
+
+static void load_manifest(void)
+{
+    char *data = read_file_as_cstring(MOVIEPREFETCH_FILE);
+    if (!data) return;
+    struct mp_section *s = NULL;
+    char *saveptr;
+    char *line;
+    for (line = strtok_r(data, "\r\n", &saveptr); line; line = strtok_r(NULL, "\r\n", &saveptr)) {
+        str_trim(line, " \t");
+        if (!*line || *line == ';') continue;
+        if (*line == '[') {
+            str_rtrim(line, "]");
+            s = new_section(line + 1);
+        } else if (s) {
+            add_movie(s, line);
+        }
+    }
+    free(data);
+}
+
+static void save_manifest(void)
+{
+    if (!manifest_dirty) return;
+    FILE *fp = robust_fopen(MOVIEPREFETCH_FILE, "w");
+    if (!fp) {
+        warning("can't write movie prefetch manifest.");
+        return;
+    }
+    int i, j;
+    fprintf(fp, "; movie prefetch manifest, movies opened in each scene CPK\n");
+    for (i = 0; i < nr_sections; i++) {
+        fprintf(fp, "[%s]\n", sections[i].name);
+        for (j = 0; j < sections[i].n; j++) {
+            fprintf(fp, "%s\n", sections[i].movies[j]);
+        }
+    }
+    fclose(fp);
+}
+
+static void movieprefetch_job(void *arg)
+{
+    struct mp_job *job = arg;
+    void *buf = malloc(MOVIEPREFETCH_BUFSIZE);
+    unsigned pos = 0, size = imin(vfsread_size(job->fp), movie_limit);
+    while (buf && pos < size && job->gen == mp_gen) {
+        int nbytes = vfsread_read(job->fp, buf, pos, imin(size - pos, MOVIEPREFETCH_BUFSIZE));
+        if (nbytes <= 0) break;
+        pos += nbytes;
+    }
+    InterlockedExchangeAdd(&nr_kbytes, (pos + 512) / 1024);
+    free(buf);
+    vfsread_close(job->fp);
+    free(job);
+}
+
+// find movie in gbBinkVideo's CPKs and start reading it
+static int prefetch_movie(const char *moviefile)
+{
+    struct CPK *cpks[] = { &g_bink.m_Cpk, &g_bink.m_Cpk2 };
+    const char *paths[] = { moviefile, get_filepart(moviefile) };
+    struct vfsread_file *fp = NULL;
+    int i, j;
+    for (i = 0; !fp && i < (int) (sizeof(cpks) / sizeof(cpks[0])); i++) {
+        for (j = 0; !fp && j < (int) (sizeof(paths) / sizeof(paths[0])); j++) {
+            fp = vfsread_open(cpks[i], paths[j]);
+        }
+    }
+    if (!fp) return 0;
+    struct mp_job *job = malloc(sizeof(struct mp_job));
+    if (!job) {
+        vfsread_close(fp);
+        return 0;
+    }
+    job->fp = fp;
+    job->gen = mp_gen;
+    job_release(job_submit(movieprefetch_job, job));
+    return 1;
+}
+
+static void movieprefetch_check(void)
+{
+    if (!g_pVFileSys || !g_pVFileSys->m_cpk.m_bLoaded) return;
+    const char *cpkfile = g_pVFileSys->m_cpk.m_szCPKFileName;
+    if (strcmp(cpkfile, last_cpkfile) == 0) return;
+    strcpy(last_cpkfile, cpkfile);
+
+    // stop reading movies of last scene
+    InterlockedIncrement(&mp_gen);
+    struct mp_section *s = find_section(vfs_cpkname());
+    if (!s) return;
+    int i, nr_jobs = 0;
+    for (i = 0; i < s->n && nr_jobs < MOVIEPREFETCH_MAXJOBS; i++) {
+        if (prefetch_movie(s->movies[i])) {
+            nr_jobs++;
+            nr_prefetched++;
+        }
+    }
+}
+
+static void movieprefetch_gameloop_hook(void *arg)
+{
+    movieprefetch_check();
+}
+
+static void movieprefetch_atopen(void *arg)
+{
+    struct game_loop_hook_data *hookarg = arg;
+    const char *moviefile = hookarg->data;
+
+    // record movie to current scene
+    struct mp_section *s;
+    if (moviefile && g_pVFileSys && g_pVFileSys->m_cpk.m_bLoaded && (s = new_section(vfs_cpkname()))) {
+        if (add_movie(s, moviefile)) manifest_dirty = 1;
+    }
+}
+
+static void movieprefetch_atexit(void)
+{
+    plog("movie prefetch: %u movies read ahead, %.1f MB read.", nr_prefetched, nr_kbytes / 1024.0);
+    save_manifest();
+}
+
+MAKE_PATCHSET(movieprefetch)
+{
+    movie_limit = imax(flag, 0) * 1048576u;
+    if (!movie_limit) return;
+
+    load_manifest();
+
+    add_gameloop_hook(movieprefetch_gameloop_hook);
+    add_gameloop_hook_filtered(movieprefetch_atopen, GAMELOOP_MASK(GAMEEVENT_MOVIE_ATOPEN));
+    add_atexit_hook(movieprefetch_atexit);
+}
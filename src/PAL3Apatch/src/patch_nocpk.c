@@ -1,7 +1,266 @@
 #include "common.h"
 
+// loose-file index
+//   without CPK, every resource open is a CreateFileA() probe in data tree,
+//   and many of them fail, since engine probes files which may not exist
+//   all files under top-level directories of game folder are indexed at startup,
+//   one background job for each directory, paths are stored as hashes
+//   engine's read-only opens under an indexed directory are checked with the index first,
+//   a path not in index fails at once, without touching the file system
+//
+//   each indexed directory is watched (with subtree), and is dropped from index
+//   when a change is seen, the check is done at each frame
+//   hash collisions only let a probe through, so the index never hides an existing file
+
+#define NOCPK_MAXROOT 64
+#define NOCPK_SKIPDIRS { "save", "snap" }
+
+struct nocpk_root {
+    char name[MAX_PATH]; // lower case
+    HANDLE hnotify;
+    volatile LONG dirty;
+    struct bvec hashes; // unsigned
+};
+
+static char nocpk_gamedir[MAXLINE]; // full path with trailing backslash, lower case
+static int nocpk_gamedirlen;
+static struct nocpk_root nocpk_roots[NOCPK_MAXROOT];
+static int nocpk_nroot;
+static volatile LONG nocpk_pending;
+static volatile LONG nocpk_ready;
+static unsigned *nocpk_table; // open addressing, zero is empty
+static unsigned nocpk_mask;
+static unsigned nocpk_nfile;
+static volatile LONG nocpk_hit, nocpk_miss, nocpk_pass;
+static LARGE_INTEGER nocpk_t0, nocpk_t1;
+
+static HANDLE (WINAPI *Real_CreateFileA)(LPCSTR, DWORD, DWORD, LPSECURITY_ATTRIBUTES, DWORD, DWORD, HANDLE);
+
+static char nocpk_lower(char ch)
+{
+    if ('A' <= ch && ch <= 'Z') ch += 'a' - 'A';
+    if (ch == '/') ch = '\\';
+    return ch;
+}
+
+// FNV-1a of relative path, never zero
+static unsigned nocpk_hash(const char *relpath)
+{
+    unsigned h = 2166136261u;
+    for (; *relpath; relpath++) {
+        h = (h ^ (unsigned char) nocpk_lower(*relpath)) * 16777619u;
+    }
+    return h ? h : 1;
+}
+
+static void nocpk_scan(struct nocpk_root *root, char *relpath, size_t len)
+{
+    WIN32_FIND_DATAA fd;
+    HANDLE hFind;
+    
+    if (len + 3 >= MAXLINE) return;
+    strcpy(relpath + len, "\\*");
+    hFind = FindFirstFileA(relpath, &fd);
+    if (hFind == INVALID_HANDLE_VALUE) return;
+    do {
+        size_t n = strlen(fd.cFileName);
+        if (strcmp(fd.cFileName, ".") == 0 || strcmp(fd.cFileName, "..") == 0) continue;
+        if (len + 1 + n >= MAXLINE) continue;
+        relpath[len] = '\\';
+        strcpy(relpath + len + 1, fd.cFileName);
+        if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            nocpk_scan(root, relpath, len + 1 + n);
+        } else {
+            unsigned h = nocpk_hash(relpath);
+            bvec_tpushback(&root->hashes, &h, unsigned);
+        }
+    } while (FindNextFileA(hFind, &fd));
+    FindClose(hFind);
+    relpath[len] = 0;
+}
+
+static void nocpk_merge(void)
+{
+    int i, j;
+    unsigned total = 0, size = 16;
+    
+    for (i = 0; i < nocpk_nroot; i++) total += bvec_tsize(&nocpk_roots[i].hashes, unsigned);
+    while (size < total * 2) size *= 2;
+    nocpk_table = calloc(size, sizeof(unsigned));
+    nocpk_mask = size - 1;
+    
+    for (i = 0; i < nocpk_nroot; i++) {
+        struct bvec *v = &nocpk_roots[i].hashes;
+        int n = bvec_tsize(v, unsigned);
+        for (j = 0; j < n; j++) {
+            unsigned h = bvec_tat(v, j, unsigned), k;
+            for (k = h & nocpk_mask; nocpk_table[k] && nocpk_table[k] != h; k = (k + 1) & nocpk_mask);
+            if (!nocpk_table[k]) {
+                nocpk_table[k] = h;
+                nocpk_nfile++;
+            }
+        }
+        bvec_dtor(v);
+    }
+    QueryPerformanceCounter(&nocpk_t1);
+    InterlockedExchange(&nocpk_ready, 1);
+}
+
+static void nocpk_scan_job(void *arg)
+{
+    struct nocpk_root *root = arg;
+    char relpath[MAXLINE];
+    strcpy(relpath, root->name);
+    nocpk_scan(root, relpath, strlen(relpath));
+    
+    // last finished job builds the table
+    if (InterlockedDecrement(&nocpk_pending) == 0) nocpk_merge();
+}
+
+static int nocpk_table_find(unsigned h)
+{
+    unsigned k;
+    for (k = h & nocpk_mask; nocpk_table[k]; k = (k + 1) & nocpk_mask) {
+        if (nocpk_table[k] == h) return 1;
+    }
+    return 0;
+}
+
+// returns 0 if file is known to be missing
+static int nocpk_may_exist(LPCSTR lpFileName)
+{
+    char fullpath[MAXLINE];
+    DWORD r;
+    int i;
+    
+    r = GetFullPathNameA(lpFileName, MAXLINE, fullpath, NULL);
+    if (r == 0 || r >= MAXLINE || (int) r <= nocpk_gamedirlen) return 1;
+    for (i = 0; i < nocpk_gamedirlen; i++) {
+        if (nocpk_lower(fullpath[i]) != nocpk_gamedir[i]) return 1;
+    }
+    
+    // find root directory by first component
+    const char *relpath = fullpath + nocpk_gamedirlen;
+    const char *sep = strchr(relpath, '\\');
+    if (!sep) return 1;
+    size_t rootlen = sep - relpath;
+    for (i = 0; i < nocpk_nroot; i++) {
+        struct nocpk_root *root = &nocpk_roots[i];
+        if (strlen(root->name) != rootlen) continue;
+        size_t j;
+        for (j = 0; j < rootlen && nocpk_lower(relpath[j]) == root->name[j]; j++);
+        if (j < rootlen) continue;
+        if (root->dirty) return 1;
+        return nocpk_table_find(nocpk_hash(relpath));
+    }
+    return 1;
+}
+
+static HANDLE WINAPI CreateFileA_nocpk(LPCSTR lpFileName, DWORD dwDesiredAccess, DWORD dwShareMode, LPSECURITY_ATTRIBUTES lpSecurityAttributes, DWORD dwCreationDisposition, DWORD dwFlagsAndAttributes, HANDLE hTemplateFile)
+{
+    if (nocpk_ready && lpFileName && dwCreationDisposition == OPEN_EXISTING && !(dwDesiredAccess & (GENERIC_WRITE | GENERIC_ALL)) && !(dwFlagsAndAttributes & FILE_FLAG_BACKUP_SEMANTICS)) {
+        if (!nocpk_may_exist(lpFileName)) {
+            InterlockedIncrement(&nocpk_miss);
+            SetLastError(ERROR_FILE_NOT_FOUND);
+            return INVALID_HANDLE_VALUE;
+        }
+        InterlockedIncrement(&nocpk_hit);
+    } else {
+        InterlockedIncrement(&nocpk_pass);
+    }
+    return Real_CreateFileA(lpFileName, dwDesiredAccess, dwShareMode, lpSecurityAttributes, dwCreationDisposition, dwFlagsAndAttributes, hTemplateFile);
+}
+
+static void nocpk_gameloop_hook(void *arg)
+{
+    int i;
+    for (i = 0; i < nocpk_nroot; i++) {
+        struct nocpk_root *root = &nocpk_roots[i];
+        if (!root->dirty && WaitForSingleObject(root->hnotify, 0) == WAIT_OBJECT_0) {
+            plog("nocpk index: directory '%s' is changed, index of it is dropped.", root->name);
+            InterlockedExchange(&root->dirty, 1);
+        }
+    }
+}
+
+static void nocpk_report(void)
+{
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    if (nocpk_ready) {
+        plog("nocpk index: %u files in %d directories, built in %.1f ms.", nocpk_nfile, nocpk_nroot, (nocpk_t1.QuadPart - nocpk_t0.QuadPart) * 1000.0 / freq.QuadPart);
+    }
+    plog("nocpk index: %u opens found, %u missing opens skipped, %u opens passed through.", (unsigned) nocpk_hit, (unsigned) nocpk_miss, (unsigned) nocpk_pass);
+}
+
+static int nocpk_is_skipdir(const char *name)
+{
+    static const char *const skipdirs[] = NOCPK_SKIPDIRS;
+    unsigned i;
+    if (name[0] == '.') return 1;
+    for (i = 0; i < sizeof(skipdirs) / sizeof(skipdirs[0]); i++) {
+        if (stricmp(name, skipdirs[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+static void nocpk_build_index(void)
+{
+    WIN32_FIND_DATAA fd;
+    HANDLE hFind;
+    DWORD r;
+    int i;
+    
+    r = GetFullPathNameA(".\\", MAXLINE, nocpk_gamedir, NULL);
+    if (r == 0 || r >= MAXLINE - 1) return;
+    nocpk_gamedirlen = strlen(nocpk_gamedir);
+    if (nocpk_gamedir[nocpk_gamedirlen - 1] != '\\') strcpy(nocpk_gamedir + nocpk_gamedirlen++, "\\");
+    for (i = 0; i < nocpk_gamedirlen; i++) nocpk_gamedir[i] = nocpk_lower(nocpk_gamedir[i]);
+    
+    QueryPerformanceCounter(&nocpk_t0);
+    
+    // collect top-level directories, watch them before scanning
+    hFind = FindFirstFileA("*", &fd);
+    if (hFind == INVALID_HANDLE_VALUE) return;
+    do {
+        if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) || nocpk_is_skipdir(fd.cFileName)) continue;
+        if (nocpk_nroot >= NOCPK_MAXROOT) {
+            warning("too many directories for nocpk index.");
+            break;
+        }
+        struct nocpk_root *root = &nocpk_roots[nocpk_nroot];
+        root->hnotify = FindFirstChangeNotificationA(fd.cFileName, TRUE, FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME);
+        if (root->hnotify == INVALID_HANDLE_VALUE) continue;
+        for (i = 0; fd.cFileName[i]; i++) root->name[i] = nocpk_lower(fd.cFileName[i]);
+        root->name[i] = 0;
+        bvec_ctor(&root->hashes);
+        nocpk_nroot++;
+    } while (FindNextFileA(hFind, &fd));
+    FindClose(hFind);
+    if (!nocpk_nroot) return;
+    
+    // scan in parallel
+    nocpk_pending = nocpk_nroot;
+    for (i = 0; i < nocpk_nroot; i++) {
+        job_release(job_submit(nocpk_scan_job, &nocpk_roots[i]));
+    }
+    
+    Real_CreateFileA = hook_import_table(TOPTR(gboffset + 0x10000000), "KERNEL32.DLL", "CreateFileA", CreateFileA_nocpk);
+    add_gameloop_hook_filtered(nocpk_gameloop_hook, GAMELOOP_MASK(GAMELOOP_NORMAL));
+    add_atexit_hook(nocpk_report);
+}
+
 MAKE_PATCHSET(nocpk)
 {
     PAL3_s_flag &= ~2;
     SIMPLE_PATCH(0x0040670F, "\x0C\x03", "\x0C\x01", 2);
+    
+    if (get_int_from_configfile("nocpk_index")) {
+        if (is_win9x()) {
+            // IAT patching is not compatible with KernelEx
+            warning("nocpk index doesn't support win9x.");
+        } else {
+            nocpk_build_index();
+        }
+    }
 }
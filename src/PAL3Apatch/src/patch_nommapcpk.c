@@ -1,5 +1,479 @@
 #include "common.h"
 
+// CPK read-ahead
+//   after a view is read, the CPK entries which follow it in file order
+//   are read in background with overlapped I/O (using our own file handle)
+//   a later view which falls in that range is served from the buffer
+
+#define MAX_READAHEAD 8
+
+enum readahead_state {
+    RA_IDLE,
+    RA_PENDING,
+    RA_READY,
+};
+
+struct readahead {
+    HANDLE hfile; // file handle used by engine
+    HANDLE hasync; // our overlapped file handle
+    struct CPK *cpk;
+    char cpkfile[sizeof(((struct CPK *) 0)->m_szCPKFileName)];
+    ULONG *ends; // sorted end offsets of all CPK entries
+    int nends;
+    void *buf;
+    DWORD off, len;
+    OVERLAPPED ov;
+    enum readahead_state state;
+};
+
+static DWORD readahead_size;
+static struct readahead ralist[MAX_READAHEAD];
+static CRITICAL_SECTION ra_cs;
+
+static int ulong_cmp(const void *a, const void *b)
+{
+    ULONG x = *(const ULONG *) a, y = *(const ULONG *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void ra_cancel(struct readahead *ra)
+{
+    DWORD nbytes;
+    if (ra->state == RA_PENDING) {
+        CancelIo(ra->hasync);
+        GetOverlappedResult(ra->hasync, &ra->ov, &nbytes, TRUE);
+    }
+    ra->state = RA_IDLE;
+}
+
+static void ra_release(struct readahead *ra)
+{
+    if (!ra->hfile) return;
+    ra_cancel(ra);
+    if (ra->hasync != INVALID_HANDLE_VALUE) CloseHandle(ra->hasync);
+    if (ra->ov.hEvent) CloseHandle(ra->ov.hEvent);
+    free(ra->ends);
+    free(ra->buf);
+    memset(ra, 0, sizeof(*ra));
+}
+
+static struct readahead *ra_get(HANDLE hFile)
+{
+    int i;
+    struct readahead *ra = NULL;
+    for (i = 0; i < MAX_READAHEAD; i++) {
+        if (ralist[i].hfile == hFile) {
+            ra = &ralist[i];
+            // handle values may be reused, make sure it's still the same CPK
+            if (ra->cpk->m_bLoaded && ra->cpk->m_dwCPKHandle == TOUINT(hFile) && strcmp(ra->cpk->m_szCPKFileName, ra->cpkfile) == 0) {
+                return ra;
+            }
+            ra_release(ra);
+            break;
+        }
+    }
+
+    struct CPK *cpk = vfs_findcpk(hFile);
+    if (!cpk) return NULL;
+    if (!ra) {
+        for (i = 0; i < MAX_READAHEAD; i++) {
+            if (!ralist[i].hfile) {
+                ra = &ralist[i];
+                break;
+            }
+        }
+        if (!ra) return NULL;
+    }
+
+    ra->hfile = hFile;
+    ra->cpk = cpk;
+    strcpy(ra->cpkfile, cpk->m_szCPKFileName);
+    ra->hasync = CreateFileA(ra->cpkfile, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+    if (ra->hasync == INVALID_HANDLE_VALUE) goto fail;
+    ra->ov.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    if (!ra->ov.hEvent) goto fail;
+    ra->buf = malloc(readahead_size);
+    if (!ra->buf) goto fail;
+
+    int n = imin(cpk->m_CPKHeader.dwValidTableNum, sizeof(cpk->m_CPKTable) / sizeof(cpk->m_CPKTable[0]));
+    ra->ends = malloc(imax(n, 1) * sizeof(ULONG));
+    if (!ra->ends) goto fail;
+    for (i = 0; i < n; i++) {
+        struct CPKTable *tbl = &cpk->m_CPKTable[i];
+        ra->ends[i] = tbl->dwStartPos + tbl->dwPackedSize + tbl->dwExtraInfoSize;
+    }
+    qsort(ra->ends, n, sizeof(ULONG), ulong_cmp);
+    ra->nends = n;
+    return ra;
+fail:
+    ra_release(ra);
+    // put a placeholder, so we won't retry for this CPK
+    ra->hfile = hFile;
+    ra->cpk = cpk;
+    strcpy(ra->cpkfile, cpk->m_szCPKFileName);
+    ra->hasync = INVALID_HANDLE_VALUE;
+    return NULL;
+}
+
+static void ra_issue(struct readahead *ra, DWORD start)
+{
+    ra_cancel(ra);
+
+    // read whole entries only, as many as buffer can hold
+    int lo = 0, hi = ra->nends;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (ra->ends[mid] <= start) lo = mid + 1; else hi = mid;
+    }
+    DWORD end = start;
+    for (; lo < ra->nends && ra->ends[lo] - start <= readahead_size; lo++) {
+        end = ra->ends[lo];
+    }
+    if (end == start) return;
+
+    ra->off = start;
+    ra->len = end - start;
+    ResetEvent(ra->ov.hEvent);
+    ra->ov.Offset = start;
+    ra->ov.OffsetHigh = 0;
+    if (ReadFile(ra->hasync, ra->buf, ra->len, NULL, &ra->ov) || GetLastError() == ERROR_IO_PENDING) {
+        ra->state = RA_PENDING;
+    }
+}
+
+static int ra_take(struct readahead *ra, void *dst, DWORD off, DWORD size)
+{
+    DWORD nbytes;
+    if (ra->state == RA_IDLE) return 0;
+    if (off < ra->off || size > ra->len || off - ra->off > ra->len - size) return 0;
+    if (ra->state == RA_PENDING) {
+        if (!GetOverlappedResult(ra->hasync, &ra->ov, &nbytes, TRUE) || nbytes != ra->len) {
+            ra->state = RA_IDLE;
+            return 0;
+        }
+        ra->state = RA_READY;
+    }
+    memcpy(dst, PTRADD(ra->buf, off - ra->off), size);
+    return 1;
+}
+
+// view buffer pool
+//   small views are rounded up to power-of-two size classes and recycled,
+//   large views are committed from a reserved address range,
+//   so loading scenes won't fragment the address space
+
+#define POOL_MINSHIFT 12 // 4KB
+#define POOL_MAXSHIFT 20 // 1MB
+#define POOL_NCLASS (POOL_MAXSHIFT - POOL_MINSHIFT + 1)
+#define POOL_HDRSIZE 16
+#define POOL_CHUNKSIZE 0x10000
+
+enum {
+    POOL_MALLOC = -1,
+    POOL_REGION = -2,
+};
+
+struct pool_block {
+    int cls;
+    size_t size;
+    struct pool_block *next;
+};
+
+static CRITICAL_SECTION pool_cs;
+static struct pool_block *pool_freelist[POOL_NCLASS];
+static size_t pool_capacity, pool_cached;
+static size_t pool_inuse, pool_peak;
+
+static char *region_base;
+static unsigned region_nchunks;
+static unsigned char *region_map;
+static size_t region_inuse, region_peak;
+
+static struct pool_block *region_alloc(size_t size)
+{
+    unsigned n = ROUND_UP(size, POOL_CHUNKSIZE) / POOL_CHUNKSIZE;
+    unsigned i, run = 0;
+    for (i = 0; i < region_nchunks; i++) {
+        run = region_map[i] ? 0 : run + 1;
+        if (run == n) {
+            i = i + 1 - n;
+            struct pool_block *blk = VirtualAlloc(region_base + i * POOL_CHUNKSIZE, n * POOL_CHUNKSIZE, MEM_COMMIT, PAGE_READWRITE);
+            if (!blk) return NULL;
+            memset(region_map + i, 1, n);
+            blk->cls = POOL_REGION;
+            blk->size = n * POOL_CHUNKSIZE;
+            region_inuse += blk->size;
+            if (region_inuse > region_peak) region_peak = region_inuse;
+            return blk;
+        }
+    }
+    return NULL;
+}
+
+static void region_free(struct pool_block *blk)
+{
+    unsigned i = PTRSUB(blk, region_base) / POOL_CHUNKSIZE;
+    unsigned n = blk->size / POOL_CHUNKSIZE;
+    region_inuse -= blk->size;
+    VirtualFree(blk, blk->size, MEM_DECOMMIT);
+    memset(region_map + i, 0, n);
+}
+
+static void *pool_alloc(size_t size)
+{
+    struct pool_block *blk = NULL;
+    size_t total = size + POOL_HDRSIZE;
+    if (total < size) return NULL;
+
+    EnterCriticalSection(&pool_cs);
+    if (pool_capacity && total <= ((size_t) 1 << POOL_MAXSHIFT)) {
+        int cls = 0;
+        while (((size_t) 1 << (cls + POOL_MINSHIFT)) < total) cls++;
+        size_t clssize = (size_t) 1 << (cls + POOL_MINSHIFT);
+        if ((blk = pool_freelist[cls])) {
+            pool_freelist[cls] = blk->next;
+            pool_cached -= clssize;
+        } else {
+            blk = malloc(clssize);
+        }
+        if (blk) {
+            blk->cls = cls;
+            blk->size = clssize;
+        }
+    } else if (region_base) {
+        blk = region_alloc(total);
+    }
+    if (!blk) {
+        blk = malloc(total);
+        if (blk) {
+            blk->cls = POOL_MALLOC;
+            blk->size = total;
+        }
+    }
+    if (blk) {
+        pool_inuse += blk->size;
+        if (pool_inuse > pool_peak) pool_peak = pool_inuse;
+    }
+    LeaveCriticalSection(&pool_cs);
+
+    return blk ? PTRADD(blk, POOL_HDRSIZE) : NULL;
+}
+
+static void pool_free(void *p)
+{
+    if (!p) return;
+    struct pool_block *blk = PTRADD(p, -POOL_HDRSIZE);
+
+    EnterCriticalSection(&pool_cs);
+    pool_inuse -= blk->size;
+    switch (blk->cls) {
+        case POOL_MALLOC:
+            free(blk);
+            break;
+        case POOL_REGION:
+            region_free(blk);
+            break;
+        default:
+            if (pool_cached + blk->size <= pool_capacity) {
+                blk->next = pool_freelist[blk->cls];
+                pool_freelist[blk->cls] = blk;
+                pool_cached += blk->size;
+            } else {
+                free(blk);
+            }
+            break;
+    }
+    LeaveCriticalSection(&pool_cs);
+}
+
+static void pool_report(void)
+{
+    plog("nommapcpk pool: peak usage %u KB, peak reserved region usage %u KB of %u KB.", TOUINT(pool_peak / 1024), TOUINT(region_peak / 1024), TOUINT(region_nchunks * (POOL_CHUNKSIZE / 1024)));
+}
+
+static void pool_init(void)
+{
+    int capacity_kb, region_kb;
+    const char *cfgstr = get_string_from_configfile("nommapcpk_pool");
+    if (sscanf(cfgstr, "%d,%d", &capacity_kb, &region_kb) != 2) {
+        fail("invalid nommapcpk pool config string '%s'.", cfgstr);
+    }
+    InitializeCriticalSection(&pool_cs);
+    pool_capacity = imax(capacity_kb, 0) * (size_t) 1024;
+
+    region_nchunks = imax(region_kb, 0) / (POOL_CHUNKSIZE / 1024);
+    if (region_nchunks) {
+        region_base = VirtualAlloc(NULL, region_nchunks * POOL_CHUNKSIZE, MEM_RESERVE, PAGE_NOACCESS);
+        region_map = calloc(region_nchunks, 1);
+        if (!region_base || !region_map) {
+            warning("can't reserve %u KB address space for nommapcpk pool.", region_nchunks * (POOL_CHUNKSIZE / 1024));
+            if (region_base) VirtualFree(region_base, 0, MEM_RELEASE);
+            free(region_map);
+            region_base = NULL;
+            region_map = NULL;
+            region_nchunks = 0;
+        }
+    }
+
+    add_atexit_hook(pool_report);
+}
+
+// mapping window cache
+//   used when file mapping is allowed, views are served from
+//   a few large aligned windows, which are kept mapped until evicted
+
+struct mapwin {
+    HANDLE hmap; // NULL if mapping handle is closed
+    DWORD access;
+    DWORD off, len;
+    void *base;
+    int refs;
+    unsigned last_use;
+};
+
+static CRITICAL_SECTION win_cs;
+static struct mapwin *winlist;
+static int win_count;
+static DWORD win_size, win_granularity;
+static unsigned win_clock;
+static unsigned win_hit, win_miss;
+
+static struct mapwin *win_find_view(LPCVOID p)
+{
+    int i;
+    for (i = 0; i < win_count; i++) {
+        struct mapwin *w = &winlist[i];
+        if (w->base && p >= w->base && (DWORD) PTRSUB(p, w->base) < w->len) return w;
+    }
+    return NULL;
+}
+
+static void win_release(struct mapwin *w)
+{
+    UnmapViewOfFile(w->base);
+    memset(w, 0, sizeof(*w));
+}
+
+static LPVOID WINAPI MapViewOfFile_window(HANDLE hFileMappingObject, DWORD dwDesiredAccess, DWORD dwFileOffsetHigh, DWORD dwFileOffsetLow, SIZE_T dwNumberOfBytesToMap)
+{
+    int i;
+    struct mapwin *w, *victim = NULL;
+    DWORD off = dwFileOffsetLow, size = dwNumberOfBytesToMap;
+
+    if (dwFileOffsetHigh != 0 || size == 0 || size > win_size) {
+        return MapViewOfFile(hFileMappingObject, dwDesiredAccess, dwFileOffsetHigh, dwFileOffsetLow, dwNumberOfBytesToMap);
+    }
+
+    EnterCriticalSection(&win_cs);
+    for (i = 0; i < win_count; i++) {
+        w = &winlist[i];
+        if (w->base && w->hmap == hFileMappingObject && w->access == dwDesiredAccess && off >= w->off && w->len >= size && off - w->off <= w->len - size) {
+            w->refs++;
+            w->last_use = ++win_clock;
+            win_hit++;
+            LeaveCriticalSection(&win_cs);
+            return PTRADD(w->base, off - w->off);
+        }
+        // prefer empty slot, then least recently used idle window
+        if (!w->base) {
+            if (!victim || victim->base) victim = w;
+        } else if (w->refs == 0 && (!victim || (victim->base && w->last_use < victim->last_use))) {
+            victim = w;
+        }
+    }
+    win_miss++;
+
+    if (!victim) {
+        // all windows are in use, map directly
+        LeaveCriticalSection(&win_cs);
+        return MapViewOfFile(hFileMappingObject, dwDesiredAccess, dwFileOffsetHigh, dwFileOffsetLow, dwNumberOfBytesToMap);
+    }
+    if (victim->base) win_release(victim);
+
+    // window is aligned to window size, shrink it if it exceeds end of file
+    DWORD woff = off - off % win_size;
+    DWORD wlen = ROUND_UP(off + size - woff, win_size);
+    void *base = MapViewOfFile(hFileMappingObject, dwDesiredAccess, 0, woff, wlen);
+    if (!base) {
+        woff = off - off % win_granularity;
+        wlen = off + size - woff;
+        base = MapViewOfFile(hFileMappingObject, dwDesiredAccess, 0, woff, wlen);
+    }
+    if (base) {
+        victim->hmap = hFileMappingObject;
+        victim->access = dwDesiredAccess;
+        victim->off = woff;
+        victim->len = wlen;
+        victim->base = base;
+        victim->refs = 1;
+        victim->last_use = ++win_clock;
+    }
+    LeaveCriticalSection(&win_cs);
+    return base ? PTRADD(base, off - woff) : NULL;
+}
+
+static BOOL WINAPI UnmapViewOfFile_window(LPCVOID lpBaseAddress)
+{
+    EnterCriticalSection(&win_cs);
+    struct mapwin *w = win_find_view(lpBaseAddress);
+    if (w && w->refs > 0) {
+        // keep window mapped, unless its mapping handle is already closed
+        if (--w->refs == 0 && !w->hmap) win_release(w);
+        LeaveCriticalSection(&win_cs);
+        return TRUE;
+    }
+    LeaveCriticalSection(&win_cs);
+    return UnmapViewOfFile(lpBaseAddress);
+}
+
+static BOOL WINAPI CloseHandle_window(HANDLE hObject)
+{
+    int i;
+    EnterCriticalSection(&win_cs);
+    for (i = 0; i < win_count; i++) {
+        struct mapwin *w = &winlist[i];
+        if (w->base && w->hmap == hObject) {
+            if (w->refs == 0) {
+                win_release(w);
+            } else {
+                w->hmap = NULL;
+            }
+        }
+    }
+    LeaveCriticalSection(&win_cs);
+    return CloseHandle(hObject);
+}
+
+static void win_report(void)
+{
+    plog("nommapcpk window: %u hit, %u miss.", win_hit, win_miss);
+}
+
+static void win_init(void)
+{
+    int size_kb, count;
+    const char *cfgstr = get_string_from_configfile("nommapcpk_window");
+    if (sscanf(cfgstr, "%d,%d", &size_kb, &count) != 2) {
+        fail("invalid nommapcpk window config string '%s'.", cfgstr);
+    }
+    if (size_kb <= 0 || count <= 0) return;
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    win_granularity = si.dwAllocationGranularity;
+    win_size = ROUND_UP(size_kb * 1024u, win_granularity);
+    win_count = count;
+    winlist = calloc(win_count, sizeof(struct mapwin));
+    if (!winlist) fail("can't allocate nommapcpk window list.");
+    InitializeCriticalSection(&win_cs);
+
+    make_call6(gboffset + 0x1002B304, CloseHandle_window);
+    make_call6(gboffset + 0x1002B332, MapViewOfFile_window);
+    make_call6(gboffset + 0x1002B354, UnmapViewOfFile_window);
+    add_atexit_hook(win_report);
+}
+
+
 static VOID WINAPI GetSystemInfo_wrapper(LPSYSTEM_INFO lpSystemInfo)
 {
     GetSystemInfo(lpSystemInfo);
@@ -11,40 +485,76 @@ static HANDLE WINAPI CreateFileMappingA_wrapper(HANDLE hFile, LPSECURITY_ATTRIBU
 }
 static BOOL WINAPI CloseHandle_wrapper(HANDLE hObject)
 {
+    int i;
+    if (readahead_size) {
+        EnterCriticalSection(&ra_cs);
+        for (i = 0; i < MAX_READAHEAD; i++) {
+            if (ralist[i].hfile == hObject) ra_release(&ralist[i]);
+        }
+        LeaveCriticalSection(&ra_cs);
+    }
     return TRUE;
 }
 static LPVOID WINAPI MapViewOfFile_wrapper(HANDLE hFileMappingObject, DWORD dwDesiredAccess, DWORD dwFileOffsetHigh, DWORD dwFileOffsetLow, SIZE_T dwNumberOfBytesToMap)
 {
     void *p = NULL;
     DWORD nBytesRead;
-    
+    struct readahead *ra = NULL;
+    int locked = 0;
+
     if (dwFileOffsetHigh != 0) goto fail;
-    
-    p = malloc(dwNumberOfBytesToMap);
+
+    p = pool_alloc(dwNumberOfBytesToMap);
     if (!p) goto fail;
-    
+
+    if (readahead_size) {
+        EnterCriticalSection(&ra_cs);
+        locked = 1;
+        ra = ra_get(hFileMappingObject);
+        if (ra && ra_take(ra, p, dwFileOffsetLow, dwNumberOfBytesToMap)) {
+            // move forward when more than half of buffer is consumed
+            if (dwFileOffsetLow + dwNumberOfBytesToMap - ra->off > ra->len / 2) {
+                ra_issue(ra, dwFileOffsetLow + dwNumberOfBytesToMap);
+            }
+            LeaveCriticalSection(&ra_cs);
+            return p;
+        }
+    }
+
     if (SetFilePointer(hFileMappingObject, dwFileOffsetLow, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER) goto fail;
-    
+
     if (!ReadFile(hFileMappingObject, p, dwNumberOfBytesToMap, &nBytesRead, NULL) || dwNumberOfBytesToMap != nBytesRead) goto fail;
-    
+
+    if (locked) {
+        if (ra) ra_issue(ra, dwFileOffsetLow + dwNumberOfBytesToMap);
+        LeaveCriticalSection(&ra_cs);
+    }
     return p;
 fail:
-    free(p);
+    if (locked) LeaveCriticalSection(&ra_cs);
+    pool_free(p);
     return NULL;
 }
 static BOOL WINAPI UnmapViewOfFile_wrapper(LPCVOID lpBaseAddress)
 {
-    free((void *) lpBaseAddress);
+    pool_free((void *) lpBaseAddress);
     return TRUE;
 }
 
 MAKE_PATCHSET(nommapcpk)
 {
     if (flag == 2 || is_win9x()) {
+        // Windows 9x doesn't support overlapped I/O on disk files
+        readahead_size = is_win9x() ? 0 : imax(get_int_from_configfile("nommapcpk_readahead"), 0) * 1024;
+        if (readahead_size) InitializeCriticalSection(&ra_cs);
+        pool_init();
+
         make_call6(gboffset + 0x1002B26A, GetSystemInfo_wrapper);
         make_call6(gboffset + 0x1002B2E6, CreateFileMappingA_wrapper);
         make_call6(gboffset + 0x1002B304, CloseHandle_wrapper);
         make_call6(gboffset + 0x1002B332, MapViewOfFile_wrapper);
         make_call6(gboffset + 0x1002B354, UnmapViewOfFile_wrapper);
+    } else if (flag == 3) {
+        win_init();
     }
 }
@@ -0,0 +1,81 @@
+#include "common.h"
+
+// raw input cursor
+//   the game calls GetCursorPos() several times per frame,
+//   each call is a system call, followed by all getcursorpos hooks
+//   with this patch, hooked position is computed once and cached by hook framework,
+//   cache is invalidated at each frame, and when WM_INPUT or WM_MOUSEMOVE is received
+//
+//   raw input is only used as notification of mouse movement,
+//   position is still read from GetCursorPos(), since raw mouse data are relative motions
+//   and don't follow pointer acceleration
+
+#define myWM_INPUT 0x00FF
+struct myRAWINPUTDEVICE {
+    USHORT usUsagePage;
+    USHORT usUsage;
+    DWORD dwFlags;
+    HWND hwndTarget;
+};
+
+static unsigned rc_nr_input;
+
+static int register_raw_mouse(HWND hwnd)
+{
+    HMODULE hUser32 = GetModuleHandle("USER32.DLL");
+    if (hUser32) {
+        BOOL (WINAPI *myRegisterRawInputDevices)(struct myRAWINPUTDEVICE *, UINT, UINT) = (void *) GetProcAddress(hUser32, "RegisterRawInputDevices");
+        if (myRegisterRawInputDevices) {
+            // generic desktop controls, mouse
+            struct myRAWINPUTDEVICE rid = { .usUsagePage = 0x01, .usUsage = 0x02, .dwFlags = 0, .hwndTarget = hwnd };
+            if (myRegisterRawInputDevices(&rid, 1, sizeof(rid))) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void rc_wndproc_hook(void *arg)
+{
+    struct wndproc_hook_data *data = arg;
+    switch (data->Msg) {
+        case myWM_INPUT:
+            rc_nr_input++;
+            // fall through
+        case WM_MOUSEMOVE:
+        case WM_MOVE:
+        case WM_SIZE:
+        case WM_ACTIVATE:
+            invalidate_cursorpos_cache();
+            break;
+    }
+    // WM_INPUT is left to DefWindowProc(), which cleans up raw input data
+}
+static const UINT rc_wndproc_msgs[] = { myWM_INPUT, WM_MOUSEMOVE, WM_MOVE, WM_SIZE, WM_ACTIVATE, 0 };
+
+static void rc_gameloop_hook(void *arg)
+{
+    invalidate_cursorpos_cache();
+}
+
+static void rc_postpal3create(void)
+{
+    if (!register_raw_mouse(game_hwnd)) {
+        warning("can't register raw input mouse, cursor cache is refreshed by WM_MOUSEMOVE only.");
+    }
+}
+
+static void rc_report(void)
+{
+    plog("rawcursor: %u raw input messages.", rc_nr_input);
+}
+
+MAKE_PATCHSET(rawcursor)
+{
+    enable_cursorpos_cache(1);
+    add_prewndproc_hook_filtered(rc_wndproc_hook, rc_wndproc_msgs);
+    add_gameloop_hook(rc_gameloop_hook);
+    add_postpal3create_hook(rc_postpal3create);
+    add_atexit_hook(rc_report);
+}
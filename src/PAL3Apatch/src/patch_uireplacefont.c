@@ -41,6 +41,34 @@ static ID3DXSprite *d3dxfont_sprite = NULL;
 static IDirect3DStateBlock9 *d3dxfont_stateblock = NULL;
 
 static int d3dxfont_ftfont = 0;
+
+// distance field base fonts, shared by all sizes with similar bold strength
+#define SDFBOLD_STEP 32
+static int d3dxfont_sdfsize = 0;
+static int d3dxfont_texbudget = 0;
+static struct {
+    int boldflag;
+    struct ftfont *pftfont;
+} d3dxfont_sdfbase[PRINTWSTR_MAXFONTS];
+static int d3dxfont_sdfbasecnt = 0;
+
+static struct ftfont *d3dxfont_getsdfbase(int fontsize, int boldflag)
+{
+    // bold strength is in pixels of font size, scale it to reference size
+    int bold = round((double) boldflag * d3dxfont_sdfsize / fontsize / SDFBOLD_STEP) * SDFBOLD_STEP;
+    int i;
+    for (i = 0; i < d3dxfont_sdfbasecnt; i++) {
+        if (d3dxfont_sdfbase[i].boldflag == bold) return d3dxfont_sdfbase[i].pftfont;
+    }
+    if (d3dxfont_sdfbasecnt >= PRINTWSTR_MAXFONTS) return NULL;
+    struct ftfont *base = ftfont_create(ftfont_filename, ftfont_index, d3dxfont_sdfsize, bold, FTFONT_SDF);
+    if (!base) return NULL;
+    d3dxfont_sdfbase[d3dxfont_sdfbasecnt].boldflag = bold;
+    d3dxfont_sdfbase[d3dxfont_sdfbasecnt].pftfont = base;
+    d3dxfont_sdfbasecnt++;
+    return base;
+}
+
 static int d3dxfont_shoulduse_ftfont(int size, int bold)
 {
     return d3dxfont_ftfont;
@@ -120,7 +148,15 @@ static void d3dxfont_insertfont(int fontsize, int boldflag, int preload)
     
     if (key.use_ftfont) {
         // create the font using FreeType font
-        key.pftfont = ftfont_create(ftfont_filename, ftfont_index, fontsize, boldflag, d3dxfont_quality);
+        if (d3dxfont_sdfsize > 0) {
+            struct ftfont *base = d3dxfont_getsdfbase(fontsize, boldflag);
+            key.pftfont = base ? ftfont_create_scaled(base, fontsize) : NULL;
+        } else {
+            key.pftfont = ftfont_create(ftfont_filename, ftfont_index, fontsize, boldflag, d3dxfont_quality);
+        }
+        if (key.pftfont && d3dxfont_texbudget > 0) {
+            ftfont_set_texbudget(key.pftfont, d3dxfont_texbudget);
+        }
         if (!key.pftfont) {
             // if create failed, fallback to D3DXFont
             warning("can't create freetype font for size '%d', fallback to d3dxfont.", fontsize);
@@ -219,6 +255,17 @@ static void d3dxfont_preload_fullcjk(struct d3dxfont_desc *font)
 static void d3dxfont_preload(int charset_level)
 {
     int i;
+    
+    // chars used in previous sessions first, preload queue is in order
+    const wchar_t *profile = ftfont_get_profile();
+    if (*profile && charset_level >= FONTPRELOAD_FREQUENTLYUSED) {
+        for (i = 0; i < d3dxfont_fontcnt; i++) {
+            if (d3dxfont_fontlist[i].preload >= FONTPRELOAD_FREQUENTLYUSED) {
+                d3dxfont_preload_string(&d3dxfont_fontlist[i], profile);
+            }
+        }
+    }
+    
     for (i = 0; i < d3dxfont_fontcnt; i++) {
         int cur_level = d3dxfont_fontlist[i].preload;
         struct d3dxfont_desc *font = &d3dxfont_fontlist[i];
@@ -237,6 +284,8 @@ static void d3dxfont_init()
     // the init function must called after IDirect3DDevice is initialized
     // the scalefactors should have been set at this time
     
+    startup_begin("d3dxfont_init");
+    
     // create fonts, O(n^2*log(n))
     int i, j; 
     for (i = 0; i < PRINTWSTR_COUNT; i++) {
@@ -291,6 +340,8 @@ static void d3dxfont_init()
     }
     
     d3dxfont_initflag = 1;
+    
+    startup_end();
 }
 
 
@@ -301,6 +352,9 @@ void print_wstring_begin()
 {
     if (!d3dxfont_initflag) return;
     
+    // text is UI, resolve multisampled 3D scene first
+    multisample_end3d();
+    
     // save device state
     IDirect3DStateBlock9_Capture(d3dxfont_stateblock);
     
@@ -317,6 +371,9 @@ void print_wstring_begin()
     IDirect3DDevice9_SetSamplerState(GB_GfxMgr->m_pd3dDevice, 0, D3DSAMP_MIPFILTER, D3DTEXF_NONE);
     IDirect3DDevice9_SetRenderState(GB_GfxMgr->m_pd3dDevice, D3DRS_ALPHATESTENABLE, FALSE);
     IDirect3DDevice9_SetRenderState(GB_GfxMgr->m_pd3dDevice, D3DRS_MULTISAMPLEANTIALIAS, FALSE);
+    
+    // collect glyphs, and draw them sorted by texture at end
+    ftfont_batch_begin(d3dxfont_sprite);
 }
 void print_wstring(int fontid, LPCWSTR wstr, int left, int top, D3DCOLOR color)
 {
@@ -327,6 +384,8 @@ void print_wstring(int fontid, LPCWSTR wstr, int left, int top, D3DCOLOR color)
     if (font->use_ftfont) {
         ftfont_draw(font->pftfont, wstr, left, top, color, sprite);
     } else {
+        // keep draw order with batched glyphs
+        ftfont_batch_flush();
         RECT rc;
         set_rect(&rc, left, top, 0, 0);
         ID3DXFont_DrawTextW(font->pfont, sprite, wstr, -1, &rc, DT_NOCLIP, color);
@@ -337,6 +396,7 @@ void print_wstring_end()
     if (!d3dxfont_initflag) return;
     
     // end drawing strings
+    ftfont_batch_end();
     ID3DXSprite_End(d3dxfont_sprite);
     
     // restore device state
@@ -382,9 +442,93 @@ static wchar_t *convert_gamestring(const char *str)
     }
 }
 
+// converted game string cache
+//   most UI text is the same from frame to frame, so keep converted strings
+//   in a hash table keyed by content, entries not used for GAMESTR_CACHE_MAXAGE
+//   flushes are dropped when the table is getting full
+//   entries are only dropped in flush, after all nodes referencing them are freed
+
+#define GAMESTR_CACHE_SIZE 1024 // must be power of 2
+#define GAMESTR_CACHE_MAXENTRY (GAMESTR_CACHE_SIZE / 2)
+#define GAMESTR_CACHE_MAXAGE 60
+
+struct gamestr_entry {
+    char *str;
+    unsigned hash;
+    wchar_t *wstr;
+    unsigned last_use;
+};
+
+static struct gamestr_entry gamestr_cache[GAMESTR_CACHE_SIZE];
+static int gamestr_count;
+static unsigned gamestr_clock;
+
+static unsigned gamestr_hash(const char *str)
+{
+    unsigned h = 2166136261u;
+    while (*str) h = (h ^ (unsigned char) *str++) * 16777619u;
+    return h;
+}
+
+// returns cached wstr, or NULL if cache is full
+static wchar_t *gamestr_lookup(const char *str)
+{
+    unsigned hash = gamestr_hash(str);
+    unsigned pos;
+    struct gamestr_entry *e;
+    for (pos = hash & (GAMESTR_CACHE_SIZE - 1); (e = &gamestr_cache[pos])->str; pos = (pos + 1) & (GAMESTR_CACHE_SIZE - 1)) {
+        if (e->hash == hash && strcmp(e->str, str) == 0) {
+            e->last_use = gamestr_clock;
+            return e->wstr;
+        }
+    }
+    if (gamestr_count >= GAMESTR_CACHE_MAXENTRY) return NULL;
+    char *copy = strdup(str);
+    wchar_t *wstr = convert_gamestring(str);
+    if (!copy || !wstr) {
+        free(copy);
+        free(wstr);
+        return NULL;
+    }
+    *e = (struct gamestr_entry) {
+        .str = copy,
+        .hash = hash,
+        .wstr = wstr,
+        .last_use = gamestr_clock,
+    };
+    gamestr_count++;
+    return wstr;
+}
+
+static void gamestr_expire(void)
+{
+    gamestr_clock++;
+    if (gamestr_count < GAMESTR_CACHE_MAXENTRY * 3 / 4) return;
+    
+    // drop old entries, and rehash the rest
+    static struct gamestr_entry old[GAMESTR_CACHE_SIZE];
+    int i;
+    memcpy(old, gamestr_cache, sizeof(old));
+    memset(gamestr_cache, 0, sizeof(gamestr_cache));
+    gamestr_count = 0;
+    for (i = 0; i < GAMESTR_CACHE_SIZE; i++) {
+        if (!old[i].str) continue;
+        if (gamestr_clock - old[i].last_use > GAMESTR_CACHE_MAXAGE) {
+            free(old[i].str);
+            free(old[i].wstr);
+        } else {
+            unsigned pos = old[i].hash & (GAMESTR_CACHE_SIZE - 1);
+            while (gamestr_cache[pos].str) pos = (pos + 1) & (GAMESTR_CACHE_SIZE - 1);
+            gamestr_cache[pos] = old[i];
+            gamestr_count++;
+        }
+    }
+}
+
 struct d3dxfont_strnode {
     int fontid;
     wchar_t *wstr;
+    int wstr_cached; // wstr belongs to cache, don't free
     double oleft, otop; // original (before transform) coord
     double tleft, ttop; // transformed coord
     double fleft, ftop; // final coord (for displaying)
@@ -393,6 +537,7 @@ struct d3dxfont_strnode {
 };
 
 static struct d3dxfont_strnode *d3dxfont_strlist_head = NULL, *d3dxfont_strlist_tail = NULL;
+unsigned d3dxfont_nr_queued;
 
 static MAKE_THISCALL(void, gbPrintFont_UNICODE_PrintString, struct gbPrintFont_UNICODE *this, const char *str, float x, float y, float endx, float endy)
 {
@@ -401,7 +546,9 @@ static MAKE_THISCALL(void, gbPrintFont_UNICODE_PrintString, struct gbPrintFont_U
     // make a node
     struct d3dxfont_strnode *node = malloc(sizeof(struct d3dxfont_strnode));
     node->fontid = d3dxfont_selectbysize(this->fontsize);
-    node->wstr = convert_gamestring(str);
+    node->wstr = gamestr_lookup(str);
+    node->wstr_cached = node->wstr != NULL;
+    if (!node->wstr_cached) node->wstr = convert_gamestring(str);
     node->color = this->curColor.Color; // FIXME: should we check gbColorQuad::ColorQuadFmt ?
 
     // calc coord
@@ -417,6 +564,7 @@ static MAKE_THISCALL(void, gbPrintFont_UNICODE_PrintString, struct gbPrintFont_U
     node->ftop = round(frect.top + eps);
 
     // append to linked-list
+    d3dxfont_nr_queued++;
     node->next = NULL;
     if (d3dxfont_strlist_head == NULL || d3dxfont_strlist_tail == NULL) {
         d3dxfont_strlist_head = d3dxfont_strlist_tail = node;
@@ -459,10 +607,11 @@ static MAKE_THISCALL(void, gbPrintFont_UNICODE_Flush, struct gbPrintFont_UNICODE
     // clear the linked-list and free memory
     for (node = d3dxfont_strlist_head; node; node = nextnode) {
         nextnode = node->next;
-        free(node->wstr);
+        if (!node->wstr_cached) free(node->wstr);
         free(node);
     }
     d3dxfont_strlist_head = d3dxfont_strlist_tail = NULL;
+    gamestr_expire();
 }
 
 static void ui_replacefont_d3dxfont_init()
@@ -481,6 +630,10 @@ static void ui_replacefont_d3dxfont_init()
     }
     
     d3dxfont_quality = get_int_from_configfile("uireplacefont_quality");
+    if (get_int_from_configfile("uireplacefont_glyphcache")) ftfont_enable_cache();
+    if (get_int_from_configfile("uireplacefont_glyphprofile")) ftfont_enable_profile(d3dxfont_codepage);
+    d3dxfont_sdfsize = get_int_from_configfile("uireplacefont_sdfsize");
+    d3dxfont_texbudget = get_int_from_configfile("uireplacefont_texbudget");
     const char *facename = get_string_from_configfile("uireplacefont_facename");
     int use_default = 0;
     if (stricmp(facename, "default") == 0) {
@@ -577,31 +730,97 @@ static int map_bitmapfontsize(int fontsize)
     return 16; // if fontsize is too small, default to 12
 }
 
+// layout cache for bitmap font
+//   menus draw same labels every frame, remember the adjusted rect and
+//   selected font for each (fixui state, rect, fontsize, middleflag)
+//   glyphs are laid out by engine, so string is not part of the key
+#define BMFONT_CACHE_SIZE 256
+enum {
+    BMFONT_DRAWTEXTEX,
+    BMFONT_PRINT,
+};
+struct bmfont_key {
+    fRECT src_frect, dst_frect;
+    double len_factor;
+    int lr_method, tb_method;
+    struct gbPrintFontMgr *fontmgr;
+    RECT rect;
+    int fontsize;
+    int middleflag;
+    int type;
+};
+struct bmfont_entry {
+    struct bmfont_key key;
+    int valid;
+    RECT new_rect;
+    struct gbPrintFont *new_font; // NULL if fontsize is unknown
+    int new_fontsize;
+};
+static struct bmfont_entry bmfont_cache[BMFONT_CACHE_SIZE];
+
+// returns entry for given key, new_* fields must be filled if entry is not valid
+static struct bmfont_entry *bmfont_lookup(int type, RECT *rect, int fontsize, int middleflag)
+{
+    struct bmfont_key key;
+    memset(&key, 0, sizeof(key)); // clear paddings for memcmp
+    key.src_frect = fs->src_frect;
+    key.dst_frect = fs->dst_frect;
+    key.len_factor = fs->len_factor;
+    key.lr_method = fs->lr_method;
+    key.tb_method = fs->tb_method;
+    key.fontmgr = GB_GfxMgr->pFontMgr;
+    key.rect = *rect;
+    key.fontsize = fontsize;
+    key.middleflag = middleflag;
+    key.type = type;
+    
+    unsigned h = 2166136261u;
+    const unsigned char *ptr;
+    for (ptr = (const unsigned char *) &key; ptr < (const unsigned char *) (&key + 1); ptr++) {
+        h = (h ^ *ptr) * 16777619u;
+    }
+    
+    // direct-mapped, just overwrite on collision
+    struct bmfont_entry *e = &bmfont_cache[h & (BMFONT_CACHE_SIZE - 1)];
+    if (!e->valid || memcmp(&e->key, &key, sizeof(key)) != 0) {
+        e->key = key;
+        e->valid = 0;
+    }
+    return e;
+}
+
 // hook UIDrawTextEx()
 static void UIDrawTextEx_wrapper(const char *str, RECT *rect, struct gbPrintFont *font, int fontsize, int middleflag)
 {
     fixui_update_gamestate();
     
-    // scale fontsize
-    int new_fontsize = map_bitmapfontsize(fontsize);
-    double font_scalefactor = (double) new_fontsize / fontsize;
-    
-    // scale rect using normal method
-    fRECT old_frect, new_frect;
-    set_frect_rect(&old_frect, rect);
-    fixui_adjust_fRECT(&new_frect, &old_frect);
-    
-    // scale rect by font_scalefactor
-    transform_frect(&new_frect, &old_frect, &old_frect, &new_frect, TR_CENTER, TR_CENTER, font_scalefactor);
+    struct bmfont_entry *e = bmfont_lookup(BMFONT_DRAWTEXTEX, rect, fontsize, middleflag);
+    if (!e->valid) {
+        // scale fontsize
+        int new_fontsize = map_bitmapfontsize(fontsize);
+        double font_scalefactor = (double) new_fontsize / fontsize;
+        
+        // scale rect using normal method
+        fRECT old_frect, new_frect;
+        set_frect_rect(&old_frect, rect);
+        fixui_adjust_fRECT(&new_frect, &old_frect);
+        
+        // scale rect by font_scalefactor
+        transform_frect(&new_frect, &old_frect, &old_frect, &new_frect, TR_CENTER, TR_CENTER, font_scalefactor);
+        
+        set_rect_frect(&e->new_rect, &new_frect);
+        e->new_font = get_gbprintfont(new_fontsize);
+        e->new_fontsize = new_fontsize;
+        e->valid = 1;
+    }
     
     // call original UIDrawTextEx()
-    RECT new_rect;
-    set_rect_frect(&new_rect, &new_frect);
-    struct gbPrintFont *new_font = get_gbprintfont(new_fontsize);
+    RECT new_rect = e->new_rect;
+    struct gbPrintFont *new_font = e->new_font;
     if (!new_font) new_font = font;
     new_font->curColor = font->curColor; // copy color
     fixui_pushidentity();
-    UIDrawTextEx(str, &new_rect, new_font, new_fontsize, middleflag);
+    UIDrawTextEx(str, &new_rect, new_font, e->new_fontsize, middleflag);
     fixui_popstate();
 }
 static void hook_UIDrawTextEx()
@@ -619,11 +838,16 @@ static void UIPrint_wrapper(int x, int y, char *str, struct gbColorQuad *color,
     fixui_update_gamestate();
     RECT tmp_rect;
     set_rect(&tmp_rect, x, y, 0, 0);
-    fixui_adjust_RECT(&tmp_rect, &tmp_rect);
-    fontsize = map_bitmapfontsize(fontsize);
+    struct bmfont_entry *e = bmfont_lookup(BMFONT_PRINT, &tmp_rect, fontsize, 0);
+    if (!e->valid) {
+        fixui_adjust_RECT(&e->new_rect, &tmp_rect);
+        e->new_font = NULL;
+        e->new_fontsize = map_bitmapfontsize(fontsize);
+        e->valid = 1;
+    }
     // UIPrint() will automaticly select gbPrintFont by fontsize
     fixui_pushidentity();
-    UIPrint(tmp_rect.left, tmp_rect.top, str, color, fontsize);
+    UIPrint(e->new_rect.left, e->new_rect.top, str, color, e->new_fontsize);
     fixui_popstate();
 }
 static void hook_UIPrint()
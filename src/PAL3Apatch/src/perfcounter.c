@@ -0,0 +1,235 @@
+#include "common.h"
+
+// performance counter registry
+//   each counter has one slot per thread, a slot is only written by its
+//   owner thread, so updates need no lock or interlocked operation
+//   readers sum all slots, a value being updated may be one update behind
+//   threads beyond PERFCOUNTER_MAXTHREADS share the last slot under a spinlock
+//   slots hold doubles, aligned 8-byte stores of x87/SSE are atomic on x86,
+//   so readers never see a torn value
+//
+//   counters are never unregistered, registry entries are appended under
+//   perfcounter_cs and published by incrementing nr_counters,
+//   so readers can enumerate without lock
+
+#define PERFCOUNTER_MAX 256
+#define PERFCOUNTER_MAXTHREADS 16
+#define PERFCOUNTER_SHARED PERFCOUNTER_MAXTHREADS
+
+struct perfcounter_slot {
+    volatile double sum;
+    volatile double min, max;
+    volatile unsigned count;
+    volatile unsigned buckets[PERFCOUNTER_BUCKETS];
+};
+
+struct perfcounter {
+    char name[PERFCOUNTER_NAMELEN];
+    int type;
+    unsigned flags;
+    volatile double gauge;
+    struct perfcounter_slot slots[PERFCOUNTER_MAXTHREADS + 1];
+};
+
+static struct perfcounter *counters[PERFCOUNTER_MAX];
+static volatile LONG nr_counters;
+static CRITICAL_SECTION perfcounter_cs;
+static DWORD perfcounter_tls;
+static volatile LONG nr_slots;
+static volatile LONG shared_lock;
+
+static struct perfcounter_slot *get_slot(struct perfcounter *pc, int *shared)
+{
+    // TLS value is slot index + 1, zero if not assigned yet
+    // TlsGetValue() clears last error, keep it for hooked API callers
+    DWORD err = GetLastError();
+    int idx = (int) TlsGetValue(perfcounter_tls) - 1;
+    if (idx < 0) {
+        idx = InterlockedIncrement(&nr_slots) - 1;
+        if (idx > PERFCOUNTER_SHARED) idx = PERFCOUNTER_SHARED;
+        TlsSetValue(perfcounter_tls, (LPVOID) (idx + 1));
+    }
+    SetLastError(err);
+    *shared = idx == PERFCOUNTER_SHARED;
+    if (*shared) {
+        while (InterlockedExchange(&shared_lock, 1)) Sleep(0);
+    }
+    return &pc->slots[idx];
+}
+
+static void put_slot(int shared)
+{
+    if (shared) InterlockedExchange(&shared_lock, 0);
+}
+
+struct perfcounter *perfcounter_find(const char *name)
+{
+    int i, n = nr_counters;
+    for (i = 0; i < n; i++) {
+        if (strcmp(counters[i]->name, name) == 0) return counters[i];
+    }
+    return NULL;
+}
+
+struct perfcounter *perfcounter_register(const char *name, int type, unsigned flags)
+{
+    struct perfcounter *pc;
+    int i;
+    EnterCriticalSection(&perfcounter_cs);
+    pc = perfcounter_find(name);
+    if (pc) {
+        if (pc->type != type) fail("performance counter '%s' registered with different types.", name);
+        pc->flags |= flags;
+        goto done;
+    }
+    if (nr_counters >= PERFCOUNTER_MAX) fail("too many performance counters.");
+    pc = malloc(sizeof(struct perfcounter));
+    if (!pc) fail("out of memory.");
+    memset(pc, 0, sizeof(struct perfcounter));
+    snprintf(pc->name, sizeof(pc->name), "%s", name);
+    pc->type = type;
+    pc->flags = flags;
+    for (i = 0; i <= PERFCOUNTER_MAXTHREADS; i++) {
+        pc->slots[i].min = HUGE_VAL;
+        pc->slots[i].max = -HUGE_VAL;
+    }
+    counters[nr_counters] = pc;
+    InterlockedIncrement(&nr_counters);
+done:
+    LeaveCriticalSection(&perfcounter_cs);
+    return pc;
+}
+
+void perfcounter_add(struct perfcounter *pc, double delta)
+{
+    int shared;
+    struct perfcounter_slot *s = get_slot(pc, &shared);
+    s->sum += delta;
+    put_slot(shared);
+}
+
+void perfcounter_set(struct perfcounter *pc, double value)
+{
+    pc->gauge = value;
+}
+
+void perfcounter_sample(struct perfcounter *pc, double value)
+{
+    int shared, e = 0;
+    struct perfcounter_slot *s = get_slot(pc, &shared);
+    if (value >= 1) frexp(value, &e);
+    s->buckets[imin(e, PERFCOUNTER_BUCKETS - 1)]++;
+    s->sum += value;
+    if (value < s->min) s->min = value;
+    if (value > s->max) s->max = value;
+    s->count++;
+    put_slot(shared);
+}
+
+const char *perfcounter_name(struct perfcounter *pc)
+{
+    return pc->name;
+}
+
+void perfcounter_read(struct perfcounter *pc, struct perfcounter_value *v)
+{
+    int i, j;
+    memset(v, 0, sizeof(struct perfcounter_value));
+    v->type = pc->type;
+    v->flags = pc->flags;
+    if (pc->type == PERFCOUNTER_GAUGE) {
+        v->value = v->min = v->max = pc->gauge;
+        return;
+    }
+    v->min = HUGE_VAL;
+    v->max = -HUGE_VAL;
+    for (i = 0; i <= PERFCOUNTER_MAXTHREADS; i++) {
+        struct perfcounter_slot *s = &pc->slots[i];
+        v->value += s->sum;
+        v->count += s->count;
+        if (s->min < v->min) v->min = s->min;
+        if (s->max > v->max) v->max = s->max;
+        for (j = 0; j < PERFCOUNTER_BUCKETS; j++) v->buckets[j] += s->buckets[j];
+    }
+    if (pc->type == PERFCOUNTER_HISTOGRAM) {
+        if (v->count) v->value /= v->count; else v->min = v->max = 0;
+    } else {
+        v->min = v->max = v->value;
+    }
+}
+
+double perfcounter_percentile(const struct perfcounter_value *v, double p)
+{
+    // upper bound of the bucket containing the percentile, clamped to max
+    unsigned target, acc = 0;
+    int i;
+    if (!v->count) return 0;
+    target = ceil(v->count * p / 100.0);
+    if (target < 1) target = 1;
+    for (i = 0; i < PERFCOUNTER_BUCKETS - 1; i++) {
+        acc += v->buckets[i];
+        if (acc >= target) break;
+    }
+    return fmin(ldexp(1.0, i), v->max);
+}
+
+int perfcounter_count()
+{
+    return nr_counters;
+}
+
+struct perfcounter *perfcounter_at(int index)
+{
+    return index >= 0 && index < nr_counters ? counters[index] : NULL;
+}
+
+static void format_value(char *buf, int size, struct perfcounter *pc, const struct perfcounter_value *v)
+{
+    if (v->type == PERFCOUNTER_HISTOGRAM) {
+        snprintf(buf, size, "%s=%u/%.3f/%.3f", pc->name, v->count, v->value, v->max);
+    } else {
+        snprintf(buf, size, "%s=%.*f", pc->name, v->value == floor(v->value) ? 0 : 3, v->value);
+    }
+}
+
+void perfcounter_get_text(char *buf, int size, unsigned flags, char sep)
+{
+    // entries with any of flags, separated by sep
+    // a '\n' separator also ends the last line, for overlay text
+    char *ptr = buf;
+    int i, n = nr_counters;
+    *ptr = '\0';
+    for (i = 0; i < n && buf + size - ptr > 1; i++) {
+        struct perfcounter_value v;
+        if (!(counters[i]->flags & flags)) continue;
+        perfcounter_read(counters[i], &v);
+        if (ptr != buf && sep != '\n') *ptr++ = sep;
+        format_value(ptr, buf + size - ptr, counters[i], &v);
+        ptr += strlen(ptr);
+        if (sep == '\n' && buf + size - ptr > 1) *ptr++ = '\n', *ptr = '\0';
+    }
+}
+
+static void perfcounter_atexit()
+{
+    int i, n = nr_counters;
+    for (i = 0; i < n; i++) {
+        struct perfcounter_value v;
+        char buf[MAXLINE];
+        perfcounter_read(counters[i], &v);
+        format_value(buf, sizeof(buf), counters[i], &v);
+        if (v.type == PERFCOUNTER_HISTOGRAM && v.count) {
+            plog("perf counter: %s, min %.3f, p50 %.3f, p99 %.3f.", buf, v.min, perfcounter_percentile(&v, 50), perfcounter_percentile(&v, 99));
+        } else {
+            plog("perf counter: %s.", buf);
+        }
+    }
+}
+
+void init_perfcounter()
+{
+    InitializeCriticalSection(&perfcounter_cs);
+    perfcounter_tls = TlsAlloc();
+    if (perfcounter_tls == TLS_OUT_OF_INDEXES) fail("can't allocate TLS for performance counters.");
+    add_atexit_hook(perfcounter_atexit);
+}
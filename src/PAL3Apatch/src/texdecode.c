@@ -0,0 +1,42 @@
+#include "common.h"
+
+// patch-side image decoding
+//   when enabled (or requested by a hook with thinfo->fastdecode), textures going to
+//   gbImage2D loader are decoded by decode_image() instead, in texhook_part1
+//   images decode_image() doesn't support are left to engine as before
+int texdec_enabled;
+static unsigned texdec_decoded, texdec_fallback;
+
+void texdec_loader(struct texture_hook_info *thinfo)
+{
+    if (thinfo->bits || test_texture_hook_noautoload(thinfo)) return;
+    
+    unsigned fdatalen;
+    const void *fdataptr = open_texture_hook_view(thinfo->loadpath, &fdatalen);
+    if (!fdataptr) return;
+    int width, height, bitcount;
+    void *bits = decode_image(fdataptr, fdatalen, &width, &height, &bitcount, thinfo->mem_allocator);
+    close_texture_hook_view(fdataptr);
+    if (!bits) {
+        texdec_fallback++;
+        return;
+    }
+    
+    // div_alpha is kept, so 32-bit images are processed same as engine loaded ones
+    thinfo->bits = bits;
+    thinfo->width = width;
+    thinfo->height = height;
+    thinfo->bitcount = bitcount;
+    texdec_decoded++;
+}
+
+static void texdec_report(void)
+{
+    plog("texture decode: %u decoded, %u left to engine.", texdec_decoded, texdec_fallback);
+}
+
+void init_texture_decode(void)
+{
+    texdec_enabled = get_int_from_configfile("texturedecode");
+    add_atexit_hook(texdec_report);
+}
@@ -0,0 +1,159 @@
+#include "common.h"
+
+// texture deduplication
+//   a TH_POST_IMAGELOAD stage service, hashes final image bits
+//   textures with same content (and same format) share one D3D texture
+//   hash is cached per cpkname + texpath, so same texture won't be hashed twice
+
+#define TEXDEDUP_PATHCACHE_SIZE 8192 // must be power of 2
+#define TEXDEDUP_MAXENTRY 4096
+
+struct texdedup_pathcache {
+    char *key; // "cpkname|texpath"
+    unsigned char sum[20];
+};
+
+struct texdedup_entry {
+    unsigned char sum[20];
+    int nLevels;
+    ULONG format;
+    IDirect3DBaseTexture9 *tex; // we hold a reference
+};
+
+int texdedup_enabled;
+static struct texdedup_pathcache *texdedup_paths;
+static struct texdedup_entry texdedup_list[TEXDEDUP_MAXENTRY];
+static int texdedup_count;
+static unsigned char texdedup_cursum[20];
+int texdedup_curvalid;
+static unsigned texdedup_hits, texdedup_hashed;
+
+// hash current compressed data, returns zero if not compressed
+static int texdedup_hashdxt(SHA1_CTX *ctx, const struct texture_hook_info *thinfo)
+{
+    struct texdxt_data *data = &texdxt_cur;
+    int i;
+    if (!data->levels) return 0;
+    int attr[6] = { data->width[0], data->height[0], data->levels, data->dxt5, thinfo->fakewidth, thinfo->fakeheight };
+    SHA1Update(ctx, (const unsigned char *) attr, sizeof(attr));
+    for (i = 0; i < data->levels; i++) {
+        SHA1Update(ctx, data->blocks[i], pixel_dxt_size(data->width[i], data->height[i], data->dxt5));
+    }
+    return 1;
+}
+
+unsigned texdedup_strhash(const char *s)
+{
+    unsigned h = 2166136261u;
+    while (*s) h = (h ^ (unsigned char) *s++) * 16777619u;
+    return h;
+}
+
+void texdedup_compute(struct texture_hook_info *thinfo)
+{
+    char key[MAXLINE * 2];
+    snprintf(key, sizeof(key), "%s|%s", thinfo->cpkname, thinfo->texpath);
+    unsigned pos = texdedup_strhash(key) & (TEXDEDUP_PATHCACHE_SIZE - 1);
+    unsigned probe;
+    for (probe = 0; probe < TEXDEDUP_PATHCACHE_SIZE; probe++, pos = (pos + 1) & (TEXDEDUP_PATHCACHE_SIZE - 1)) {
+        struct texdedup_pathcache *pc = &texdedup_paths[pos];
+        if (!pc->key) break;
+        if (strcmp(pc->key, key) == 0) {
+            memcpy(texdedup_cursum, pc->sum, sizeof(texdedup_cursum));
+            texdedup_curvalid = 1;
+            return;
+        }
+    }
+
+    // hash image and its attributes, or compressed data if it will be applied
+    SHA1_CTX ctx;
+    SHA1Init(&ctx);
+    if (!texdedup_hashdxt(&ctx, thinfo)) {
+        int attr[6] = { thinfo->width, thinfo->height, thinfo->bitcount, thinfo->div_alpha, thinfo->fakewidth, thinfo->fakeheight };
+        SHA1Update(&ctx, (const unsigned char *) attr, sizeof(attr));
+        SHA1Update(&ctx, thinfo->bits, thinfo->width * thinfo->height * (thinfo->bitcount / 8));
+    }
+    SHA1Final(texdedup_cursum, &ctx);
+    texdedup_curvalid = 1;
+    texdedup_hashed++;
+
+    // the cache is never cleared, stop caching when it's almost full
+    if (probe < TEXDEDUP_PATHCACHE_SIZE / 2 && !texdedup_paths[pos].key) {
+        texdedup_paths[pos].key = strdup(key);
+        memcpy(texdedup_paths[pos].sum, texdedup_cursum, sizeof(texdedup_cursum));
+    }
+}
+
+static void texdedup_purge(int all)
+{
+    // drop entries which no gbTexture is using
+    int i, j;
+    for (i = j = 0; i < texdedup_count; i++) {
+        IDirect3DBaseTexture9 *tex = texdedup_list[i].tex;
+        ULONG refcnt = IDirect3DBaseTexture9_AddRef(tex);
+        IDirect3DBaseTexture9_Release(tex);
+        if (all || refcnt <= 2) {
+            IDirect3DBaseTexture9_Release(tex);
+        } else {
+            texdedup_list[j++] = texdedup_list[i];
+        }
+    }
+    texdedup_count = j;
+}
+
+void texdedup_apply(struct gbTexture *this)
+{
+    struct gbTexture_D3D *d3dtex = (struct gbTexture_D3D *) this;
+    IDirect3DBaseTexture9 *tex = d3dtex->pTex;
+    if (!texdedup_curvalid || !tex || d3dtex->pDS) return;
+
+    int i;
+    for (i = 0; i < texdedup_count; i++) {
+        struct texdedup_entry *e = &texdedup_list[i];
+        if (memcmp(e->sum, texdedup_cursum, sizeof(e->sum)) == 0 && e->nLevels == this->nLevels && e->format == d3dtex->m_ImgFormat) {
+            if (e->tex != tex) {
+                IDirect3DBaseTexture9_AddRef(e->tex);
+                IDirect3DBaseTexture9_Release(tex);
+                d3dtex->pTex = e->tex;
+                texdedup_hits++;
+            }
+            return;
+        }
+    }
+
+    if (texdedup_count >= TEXDEDUP_MAXENTRY) texdedup_purge(0);
+    if (texdedup_count >= TEXDEDUP_MAXENTRY) return;
+    struct texdedup_entry *e = &texdedup_list[texdedup_count++];
+    memcpy(e->sum, texdedup_cursum, sizeof(e->sum));
+    e->nLevels = this->nLevels;
+    e->format = d3dtex->m_ImgFormat;
+    e->tex = tex;
+    IDirect3DBaseTexture9_AddRef(tex);
+}
+
+static void texdedup_onlostdevice(void)
+{
+    // D3DPOOL_DEFAULT textures must be all released before reset
+    texdedup_purge(1);
+}
+
+static void texdedup_report(void)
+{
+    plog("texture dedup: %u hashed, %u shared.", texdedup_hashed, texdedup_hits);
+}
+
+void init_texture_dedup(void)
+{
+    texdedup_enabled = get_int_from_configfile("texturededup");
+    if (!texdedup_enabled) return;
+    if (!GET_PATCHSET_FLAG(graphicspatch) || !GET_PATCHSET_FLAG(fixreset)) {
+        // we rely on fixreset to release shared textures before reset
+        warning("texturededup requires graphicspatch and fixreset.");
+        texdedup_enabled = 0;
+        return;
+    }
+    texdedup_paths = calloc(TEXDEDUP_PATHCACHE_SIZE, sizeof(struct texdedup_pathcache));
+    if (!texdedup_paths) fail("can't allocate texture dedup cache.");
+    add_onlostdevice_hook(texdedup_onlostdevice);
+    add_atexit_hook(texdedup_report);
+}
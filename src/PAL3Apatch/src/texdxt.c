@@ -0,0 +1,254 @@
+#include "common.h"
+
+// texture compression
+//   a TH_POST_IMAGELOAD stage service, final image and its mip chain are compressed
+//   to DXT1 if image is opaque, or DXT5 otherwise, by pixel_compress_dxt()
+//   engine then loads a 1x1 placeholder, which is replaced by compressed texture in texhook_part5
+//   large images are split into block rows and compressed by job system workers,
+//   async textures are compressed by texture async workers
+//   only 24-bit images and 32-bit images with div_alpha disabled are compressed,
+//   image size must be multiples of 4, and texpath must not start with prefixes
+//   in texturecompress_exclude (separated by '|'), so UI textures can stay uncompressed
+//   compressed data is stored in texture cache instead of image, if the texture is cached
+
+#define TEXDXT_MAXEXCLUDE 32
+#define TEXDXT_MAXPARTS 8
+#define TEXDXT_PARTBLOCKS 4096 // min blocks per part
+
+struct texdxt_part {
+    void *dst;
+    const void *src;
+    int width;
+    int height;
+    int bitcount;
+    int dxt5;
+};
+
+static int texdxt_enabled;
+static char *texdxt_exclude[TEXDXT_MAXEXCLUDE];
+static int texdxt_nr_exclude;
+struct texdxt_data texdxt_cur;
+int texdxt_curlevels;
+static volatile unsigned texdxt_compressed;
+unsigned texdxt_applied;
+
+void texdxt_free(struct texdxt_data *data)
+{
+    int i;
+    for (i = 0; i < data->levels; i++) free(data->blocks[i]);
+    data->levels = 0;
+}
+
+int texdxt_pathok(const char *texpath)
+{
+    int i;
+    if (!texdxt_enabled || texpath[0] == ':') return 0;
+    for (i = 0; i < texdxt_nr_exclude; i++) {
+        const char *p = texdxt_exclude[i], *s = texpath;
+        while (*p && texhook_normchar(*s) == *p) p++, s++;
+        if (!*p) return 0;
+    }
+    return 1;
+}
+
+int texdxt_wanted(struct texture_hook_info *thinfo)
+{
+    if (!thinfo->bits || thinfo->width % 4 || thinfo->height % 4) return 0;
+    if (thinfo->bitcount != 24 && (thinfo->bitcount != 32 || thinfo->div_alpha)) return 0;
+    return texdxt_pathok(thinfo->texpath);
+}
+
+static void texdxt_part_job(void *arg)
+{
+    struct texdxt_part *part = arg;
+    pixel_compress_dxt(part->dst, part->src, part->width, part->height, part->bitcount, part->dxt5);
+}
+
+// compress one level, split into parts of whole block rows if split is non-zero
+// the last part is compressed by caller
+static void texdxt_compress(void *dst, const void *src, int width, int height, int bitcount, int dxt5, int split)
+{
+    struct texdxt_part parts[TEXDXT_MAXPARTS];
+    struct job *jobs[TEXDXT_MAXPARTS];
+    int bw = (width + 3) / 4, rows = (height + 3) / 4;
+    int nr_parts = split ? imin(imin(job_worker_count() + 1, TEXDXT_MAXPARTS), imax(bw * rows / TEXDXT_PARTBLOCKS, 1)) : 1;
+    int i, row = 0;
+    for (i = 0; i < nr_parts; i++) {
+        int nrows = rows * (i + 1) / nr_parts - row;
+        parts[i].dst = PTRADD(dst, row * bw * (dxt5 ? 16 : 8));
+        parts[i].src = PTRADD(src, row * 4 * width * (bitcount / 8));
+        parts[i].width = width;
+        parts[i].height = imin(nrows * 4, height - row * 4);
+        parts[i].bitcount = bitcount;
+        parts[i].dxt5 = dxt5;
+        if (i < nr_parts - 1) jobs[i] = job_submit(texdxt_part_job, &parts[i]);
+        row += nrows;
+    }
+    texdxt_part_job(&parts[nr_parts - 1]);
+    for (i = 0; i < nr_parts - 1; i++) {
+        job_wait(jobs[i]);
+        job_release(jobs[i]);
+    }
+}
+
+// compress image of thinfo and its mip chain, thread-safe
+//   levels is nLevels of gbTexture, if no chain is generated, mip levels are made by box filter
+void texdxt_generate(struct texdxt_data *data, const struct texture_hook_info *thinfo, const struct texmip_chain *chain, int levels, int split)
+{
+    struct texmip_chain box;
+    const struct texmip_chain *mip = chain;
+    unsigned *conv = NULL;
+    int i;
+
+    texdxt_free(data);
+    box.levels = 0;
+    if (!chain->levels && levels != 1) {
+        const unsigned *src = thinfo->bits;
+        int w = thinfo->width, h = thinfo->height;
+        int maxlevels = levels > 1 ? imin(levels - 1, TEXMIP_MAXLEVELS) : TEXMIP_MAXLEVELS;
+        if (thinfo->bitcount == 24) {
+            conv = malloc(w * h * 4);
+            if (!conv) goto fail;
+            pixel_r8g8b8_to_a8r8g8b8(conv, thinfo->bits, w * h);
+            src = conv;
+        }
+        while ((w > 1 || h > 1) && box.levels < maxlevels) {
+            int nw = imax(w / 2, 1), nh = imax(h / 2, 1);
+            unsigned *dst = malloc(nw * nh * 4);
+            if (!dst) goto fail;
+            texmip_box(dst, src, w, h, nw, nh);
+            box.width[box.levels] = nw;
+            box.height[box.levels] = nh;
+            box.bits[box.levels++] = dst;
+            src = dst;
+            w = nw;
+            h = nh;
+        }
+        mip = &box;
+    }
+
+    data->dxt5 = thinfo->bitcount == 32 && !pixel_is_opaque(thinfo->bits, thinfo->width * thinfo->height);
+    for (i = 0; i <= mip->levels; i++) {
+        int w = i ? mip->width[i - 1] : thinfo->width;
+        int h = i ? mip->height[i - 1] : thinfo->height;
+        void *blocks = malloc(pixel_dxt_size(w, h, data->dxt5));
+        if (!blocks) goto fail;
+        data->width[data->levels] = w;
+        data->height[data->levels] = h;
+        data->blocks[data->levels++] = blocks;
+        if (i) {
+            texdxt_compress(blocks, mip->bits[i - 1], w, h, 32, data->dxt5, split);
+        } else {
+            texdxt_compress(blocks, thinfo->bits, w, h, thinfo->bitcount, data->dxt5, split);
+        }
+    }
+    InterlockedIncrement((LONG *) &texdxt_compressed);
+    goto done;
+fail:
+    texdxt_free(data);
+done:
+    texmip_free(&box);
+    free(conv);
+}
+
+// create managed DXT texture from compressed data
+IDirect3DTexture9 *texdxt_create(const struct texdxt_data *data)
+{
+    IDirect3DTexture9 *tex;
+    D3DSURFACE_DESC desc;
+    D3DLOCKED_RECT lrc;
+    int i, y;
+    if (FAILED(D3DXCreateTexture(GB_GfxMgr->m_pd3dDevice, data->width[0], data->height[0], data->levels, 0, data->dxt5 ? D3DFMT_DXT5 : D3DFMT_DXT1, D3DPOOL_MANAGED, &tex))) return NULL;
+    if ((int) IDirect3DTexture9_GetLevelCount(tex) != data->levels) goto fail;
+    for (i = 0; i < data->levels; i++) {
+        // D3DX may round size up, copy only if size is exactly what we want
+        if (FAILED(IDirect3DTexture9_GetLevelDesc(tex, i, &desc))) goto fail;
+        if ((int) desc.Width != data->width[i] || (int) desc.Height != data->height[i]) goto fail;
+        if (FAILED(IDirect3DTexture9_LockRect(tex, i, &lrc, NULL, 0))) goto fail;
+        int rowsize = (data->width[i] + 3) / 4 * (data->dxt5 ? 16 : 8);
+        int rows = (data->height[i] + 3) / 4;
+        for (y = 0; y < rows; y++) {
+            memcpy(PTRADD(lrc.pBits, y * lrc.Pitch), PTRADD(data->blocks[i], y * rowsize), rowsize);
+        }
+        IDirect3DTexture9_UnlockRect(tex, i);
+    }
+    return tex;
+fail:
+    IDirect3DTexture9_Release(tex);
+    return NULL;
+}
+
+// replace image of thinfo with a 1x1 placeholder, engine should see real texture size
+void texdxt_placeholder(struct texture_hook_info *thinfo)
+{
+    void *placeholder = thinfo->mem_allocator->malloc(4);
+    if (!placeholder) return;
+    memset(placeholder, 0, 4);
+    thinfo->mem_allocator->free(thinfo->bits);
+    if (!thinfo->fakewidth) thinfo->fakewidth = thinfo->width;
+    if (!thinfo->fakeheight) thinfo->fakeheight = thinfo->height;
+    thinfo->bits = placeholder;
+    thinfo->width = 1;
+    thinfo->height = 1;
+    thinfo->bitcount = 32;
+    thinfo->div_alpha = 0;
+}
+
+// replace placeholder D3D texture created by engine with compressed one
+void texdxt_apply(struct gbTexture *this, const struct texdxt_data *data)
+{
+    struct gbTexture_D3D *d3dtex = (struct gbTexture_D3D *) this;
+    IDirect3DBaseTexture9 *old = d3dtex->pTex;
+    if (!old || d3dtex->pDS || IDirect3DBaseTexture9_GetType(old) != D3DRTYPE_TEXTURE) return;
+
+    IDirect3DTexture9 *tex = texdxt_create(data);
+    if (!tex) return;
+    d3dtex->pTex = (IDirect3DBaseTexture9 *) tex;
+    IDirect3DBaseTexture9_Release(old);
+    texdxt_applied++;
+}
+
+static void texdxt_postd3dcreate(void)
+{
+    // don't make placeholders if device can't create DXT textures
+    D3DFORMAT fmts[2] = { D3DFMT_DXT1, D3DFMT_DXT5 };
+    int i;
+    for (i = 0; i < 2; i++) {
+        UINT w = 256, h = 256, levels = 1;
+        D3DFORMAT fmt = fmts[i];
+        if (FAILED(D3DXCheckTextureRequirements(GB_GfxMgr->m_pd3dDevice, &w, &h, &levels, 0, &fmt, D3DPOOL_MANAGED)) || fmt != fmts[i]) {
+            warning("device doesn't support DXT textures, texture compression disabled.");
+            texdxt_enabled = 0;
+            return;
+        }
+    }
+}
+
+static void texdxt_report(void)
+{
+    plog("texture compress: %u compressed, %u applied.", texdxt_compressed, texdxt_applied);
+}
+
+void init_texture_compress(void)
+{
+    texdxt_enabled = get_int_from_configfile("texturecompress");
+    if (!texdxt_enabled) return;
+    if (GET_PATCHSET_FLAG(graphicspatch) && GET_PATCHSET_FLAG(d3d9ex)) {
+        // managed textures are created in default pool by d3d9ex, which can't be locked
+        warning("texturecompress is not compatible with d3d9ex.");
+        texdxt_enabled = 0;
+        return;
+    }
+
+    char *list = strdup(get_string_from_configfile("texturecompress_exclude"));
+    char *saveptr, *prefix, *p;
+    if (!list) fail("out of memory.");
+    for (prefix = strtok_r(list, "|", &saveptr); prefix; prefix = strtok_r(NULL, "|", &saveptr)) {
+        if (!*prefix || texdxt_nr_exclude >= TEXDXT_MAXEXCLUDE) continue;
+        for (p = prefix; *p; p++) *p = texhook_normchar(*p);
+        texdxt_exclude[texdxt_nr_exclude++] = strdup(prefix);
+    }
+    free(list);
+    add_postd3dcreate_hook(texdxt_postd3dcreate);
+    add_atexit_hook(texdxt_report);
+}
@@ -0,0 +1,87 @@
+#include "common.h"
+
+// gbTexture lifetime tracking
+//   engine destroys textures by calling the scalar deleting destructor in vftable,
+//   the slot is found by looking for a call to gbTexture_D3D's destructor in its code,
+//   and replaced by a wrapper which calls texlife hooks before the object is destroyed
+//   vftables are hooked when a texture of that class is first watched,
+//   classes whose destructor doesn't call it directly can't be watched
+
+#define TEXLIFE_DTOR (gboffset + 0x1001B490)
+#define TEXLIFE_MAXVTBL 8
+#define TEXLIFE_MAXSLOT 16
+#define TEXLIFE_SCANSIZE 64
+#define TEXLIFE_MAXHOOKS 4
+
+struct texlife_vtbl {
+    void **vtbl;
+    void *orig; // NULL if class can't be watched
+};
+
+static struct texlife_vtbl texlife_vtbls[TEXLIFE_MAXVTBL];
+static int texlife_nr_vtbls;
+static void (*texlife_hooks[TEXLIFE_MAXHOOKS])(struct gbTexture *tex);
+static int texlife_nr_hooks;
+
+static MAKE_THISCALL(void *, texlife_dtor, struct gbTexture *this, unsigned flags)
+{
+    void **vtbl = *(void ***) this;
+    void *orig = NULL;
+    int i;
+    for (i = 0; i < texlife_nr_vtbls; i++) {
+        if (texlife_vtbls[i].vtbl == vtbl) {
+            orig = texlife_vtbls[i].orig;
+            break;
+        }
+    }
+    for (i = 0; i < texlife_nr_hooks; i++) texlife_hooks[i](this);
+    return THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(TOUINT(orig), void *, struct gbTexture *, unsigned), this, flags);
+}
+
+static int texlife_findslot(void **vtbl)
+{
+    unsigned base = get_module_base("GBENGINE.DLL");
+    PIMAGE_DOS_HEADER pdoshdr = TOPTR(base);
+    PIMAGE_NT_HEADERS pnthdr = PTRADD(pdoshdr, pdoshdr->e_lfanew);
+    unsigned end = base + pnthdr->OptionalHeader.SizeOfImage - TEXLIFE_SCANSIZE;
+    int i, j;
+    for (i = 0; i < TEXLIFE_MAXSLOT; i++) {
+        const unsigned char *code = vtbl[i];
+        if (TOUINT(code) < base || TOUINT(code) >= end) break; // not in GBENGINE, end of vftable
+        for (j = 0; j + 5 <= TEXLIFE_SCANSIZE; j++) {
+            if ((code[j] == 0xE8 || code[j] == 0xE9) && TOUINT(code + j + 5) + *(const int *) (code + j + 1) == TEXLIFE_DTOR) return i;
+        }
+    }
+    return -1;
+}
+
+// returns non-zero if texlife hooks will be called when tex is destroyed
+// should be called on main thread
+int texlife_watch(struct gbTexture *tex)
+{
+    void **vtbl = *(void ***) tex;
+    int i;
+    for (i = 0; i < texlife_nr_vtbls; i++) {
+        if (texlife_vtbls[i].vtbl == vtbl) return texlife_vtbls[i].orig != NULL;
+    }
+    if (texlife_nr_vtbls >= TEXLIFE_MAXVTBL) return 0;
+
+    struct texlife_vtbl *v = &texlife_vtbls[texlife_nr_vtbls++];
+    v->vtbl = vtbl;
+    v->orig = NULL;
+    int slot = texlife_findslot(vtbl);
+    if (slot < 0) {
+        warning("can't find destructor in texture vftable %p.", vtbl);
+        return 0;
+    }
+    void *wrapper = texlife_dtor;
+    v->orig = vtbl[slot];
+    memcpy_to_process(TOUINT(&vtbl[slot]), &wrapper, sizeof(wrapper));
+    return 1;
+}
+
+void add_texlife_hook(void (*func)(struct gbTexture *tex))
+{
+    if (texlife_nr_hooks >= TEXLIFE_MAXHOOKS) fail("too many texlife hooks.");
+    texlife_hooks[texlife_nr_hooks++] = func;
+}
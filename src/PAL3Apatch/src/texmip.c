@@ -0,0 +1,228 @@
+#include "common.h"
+
+// mipmap generation
+//   engine creates single-level D3D textures for images we loaded (e.g. by dds_loader),
+//   so for interested 32-bit textures with div_alpha disabled, a full mip chain is generated
+//   after TH_POST_IMAGELOAD processing, and replaces the D3D texture in texhook_part5
+//   the chain is stored in texture cache along with the image, if the texture is cached
+//   filters: 1 = box, 2 = kaiser (windowed sinc, sharper but slower)
+
+#define TEXMIP_BOX 1
+#define TEXMIP_KAISER 2
+#define TEXMIP_KAISER_TAPS 6
+#define TEXMIP_KAISER_ALPHA 4.0
+#define TEXMIP_KAISER_SHIFT 14
+#define TEXMIP_MAXSTAGES 4
+
+int texmip_filter;
+static float texmip_lodbias;
+static int texmip_kaiser_weight[TEXMIP_KAISER_TAPS];
+struct texmip_chain texmip_cur;
+static volatile unsigned texmip_generated;
+unsigned texmip_applied;
+
+void texmip_free(struct texmip_chain *chain)
+{
+    int i;
+    for (i = 0; i < chain->levels; i++) free(chain->bits[i]);
+    chain->levels = 0;
+}
+
+int texmip_wanted(struct texture_hook_info *thinfo)
+{
+    return texmip_filter && thinfo->interested && thinfo->bits && thinfo->bitcount == 32 && !thinfo->div_alpha && (thinfo->width > 1 || thinfo->height > 1);
+}
+
+void texmip_box(unsigned *dst, const unsigned *src, int w, int h, int nw, int nh)
+{
+    int x, y, c;
+    for (y = 0; y < nh; y++) {
+        const unsigned *row0 = src + imin(y * 2, h - 1) * w;
+        const unsigned *row1 = src + imin(y * 2 + 1, h - 1) * w;
+        for (x = 0; x < nw; x++) {
+            int x0 = imin(x * 2, w - 1), x1 = imin(x * 2 + 1, w - 1);
+            unsigned pixel = 0;
+            for (c = 0; c < 32; c += 8) {
+                unsigned sum = ((row0[x0] >> c) & 0xFF) + ((row0[x1] >> c) & 0xFF) + ((row1[x0] >> c) & 0xFF) + ((row1[x1] >> c) & 0xFF);
+                pixel |= ((sum + 2) >> 2) << c;
+            }
+            *dst++ = pixel;
+        }
+    }
+}
+
+static int texmip_kaiser(unsigned *dst, const unsigned *src, int w, int h, int nw, int nh)
+{
+    // separable filter, taps are centered at (x * 2 + 0.5)
+    int *tmp = malloc(nw * h * 4 * sizeof(int));
+    if (!tmp) return 0;
+    int x, y, c, k;
+    for (y = 0; y < h; y++) {
+        for (x = 0; x < nw; x++) {
+            for (c = 0; c < 4; c++) {
+                int sum = 0;
+                for (k = 0; k < TEXMIP_KAISER_TAPS; k++) {
+                    int sx = imin(imax(x * 2 + k - (TEXMIP_KAISER_TAPS / 2 - 1), 0), w - 1);
+                    sum += texmip_kaiser_weight[k] * (int) ((src[y * w + sx] >> (c * 8)) & 0xFF);
+                }
+                tmp[(y * nw + x) * 4 + c] = (sum + (1 << (TEXMIP_KAISER_SHIFT - 1))) >> TEXMIP_KAISER_SHIFT;
+            }
+        }
+    }
+    for (y = 0; y < nh; y++) {
+        for (x = 0; x < nw; x++) {
+            unsigned pixel = 0;
+            for (c = 0; c < 4; c++) {
+                int sum = 0;
+                for (k = 0; k < TEXMIP_KAISER_TAPS; k++) {
+                    int sy = imin(imax(y * 2 + k - (TEXMIP_KAISER_TAPS / 2 - 1), 0), h - 1);
+                    sum += texmip_kaiser_weight[k] * tmp[(sy * nw + x) * 4 + c];
+                }
+                sum = (sum + (1 << (TEXMIP_KAISER_SHIFT - 1))) >> TEXMIP_KAISER_SHIFT;
+                pixel |= (unsigned) imin(imax(sum, 0), 255) << (c * 8);
+            }
+            *dst++ = pixel;
+        }
+    }
+    free(tmp);
+    return 1;
+}
+
+static double texmip_bessel_i0(double x)
+{
+    double sum = 1.0, term = 1.0;
+    int k;
+    for (k = 1; k < 32; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+static void texmip_init_kaiser(void)
+{
+    // sinc with half cutoff, windowed by kaiser window
+    double weight[TEXMIP_KAISER_TAPS], total = 0;
+    int k, sum = 0;
+    for (k = 0; k < TEXMIP_KAISER_TAPS; k++) {
+        double d = k - (TEXMIP_KAISER_TAPS / 2 - 0.5); // distance to center, never zero
+        double r = d / (TEXMIP_KAISER_TAPS / 2.0);
+        weight[k] = sin(M_PI * d / 2) / (M_PI * d / 2) * texmip_bessel_i0(TEXMIP_KAISER_ALPHA * sqrt(1 - r * r)) / texmip_bessel_i0(TEXMIP_KAISER_ALPHA);
+        total += weight[k];
+    }
+    for (k = 0; k < TEXMIP_KAISER_TAPS; k++) {
+        texmip_kaiser_weight[k] = floor(weight[k] / total * (1 << TEXMIP_KAISER_SHIFT) + 0.5);
+        sum += texmip_kaiser_weight[k];
+    }
+    // make sure weights sum to one exactly
+    texmip_kaiser_weight[TEXMIP_KAISER_TAPS / 2 - 1] += ((1 << TEXMIP_KAISER_SHIFT) - sum) / 2;
+    texmip_kaiser_weight[TEXMIP_KAISER_TAPS / 2] += ((1 << TEXMIP_KAISER_SHIFT) - sum) - ((1 << TEXMIP_KAISER_SHIFT) - sum) / 2;
+}
+
+// generate mip chain from thinfo, thread-safe
+void texmip_generate(struct texmip_chain *chain, const struct texture_hook_info *thinfo)
+{
+    const unsigned *src = thinfo->bits;
+    int w = thinfo->width, h = thinfo->height;
+    texmip_free(chain);
+    while ((w > 1 || h > 1) && chain->levels < TEXMIP_MAXLEVELS) {
+        int nw = imax(w / 2, 1), nh = imax(h / 2, 1);
+        unsigned *dst = malloc(nw * nh * 4);
+        if (!dst) goto fail;
+        if (texmip_filter == TEXMIP_KAISER) {
+            if (!texmip_kaiser(dst, src, w, h, nw, nh)) {
+                free(dst);
+                goto fail;
+            }
+        } else {
+            texmip_box(dst, src, w, h, nw, nh);
+        }
+        chain->width[chain->levels] = nw;
+        chain->height[chain->levels] = nh;
+        chain->bits[chain->levels++] = dst;
+        src = dst;
+        w = nw;
+        h = nh;
+    }
+    InterlockedIncrement((LONG *) &texmip_generated);
+    return;
+fail:
+    texmip_free(chain);
+}
+
+// load mip chain to level 1 and above of tex
+int texmip_load(IDirect3DTexture9 *tex, const struct texmip_chain *chain)
+{
+    int i;
+    if ((int) IDirect3DTexture9_GetLevelCount(tex) != chain->levels + 1) return 0;
+    for (i = 0; i < chain->levels; i++) {
+        IDirect3DSurface9 *suf;
+        if (FAILED(IDirect3DTexture9_GetSurfaceLevel(tex, i + 1, &suf))) return 0;
+        RECT rc = { 0, 0, chain->width[i], chain->height[i] };
+        HRESULT hr = D3DXLoadSurfaceFromMemory(suf, NULL, NULL, chain->bits[i], D3DFMT_A8R8G8B8, chain->width[i] * 4, NULL, &rc, D3DX_FILTER_NONE, 0);
+        IDirect3DSurface9_Release(suf);
+        if (FAILED(hr)) return 0;
+    }
+    return 1;
+}
+
+// replace single-level D3D texture created by engine with a mipmapped one
+void texmip_apply(struct gbTexture *this, const struct texmip_chain *chain)
+{
+    struct gbTexture_D3D *d3dtex = (struct gbTexture_D3D *) this;
+    IDirect3DBaseTexture9 *old = d3dtex->pTex;
+    IDirect3DTexture9 *tex = NULL;
+    IDirect3DSurface9 *src = NULL, *dst = NULL;
+    D3DSURFACE_DESC desc;
+
+    if (!old || d3dtex->pDS) return;
+    if (IDirect3DBaseTexture9_GetType(old) != D3DRTYPE_TEXTURE || IDirect3DBaseTexture9_GetLevelCount(old) != 1) return;
+    if (FAILED(IDirect3DTexture9_GetLevelDesc((IDirect3DTexture9 *) old, 0, &desc))) return;
+    if (desc.Pool != D3DPOOL_MANAGED || imax(desc.Width / 2, 1) != chain->width[0] || imax(desc.Height / 2, 1) != chain->height[0]) return;
+
+    if (FAILED(D3DXCreateTexture(GB_GfxMgr->m_pd3dDevice, desc.Width, desc.Height, chain->levels + 1, 0, desc.Format, D3DPOOL_MANAGED, &tex))) return;
+    if (FAILED(IDirect3DTexture9_GetSurfaceLevel((IDirect3DTexture9 *) old, 0, &src))) src = NULL;
+    if (FAILED(IDirect3DTexture9_GetSurfaceLevel(tex, 0, &dst))) dst = NULL;
+    if (!src || !dst || FAILED(D3DXLoadSurfaceFromSurface(dst, NULL, NULL, src, NULL, NULL, D3DX_FILTER_NONE, 0)) || !texmip_load(tex, chain)) goto done;
+
+    d3dtex->pTex = (IDirect3DBaseTexture9 *) tex;
+    tex = NULL;
+    IDirect3DBaseTexture9_Release(old);
+    texmip_applied++;
+done:
+    if (src) IDirect3DSurface9_Release(src);
+    if (dst) IDirect3DSurface9_Release(dst);
+    if (tex) IDirect3DTexture9_Release(tex);
+}
+
+static void texmip_postpresent(void)
+{
+    // mip chains are useless if engine doesn't sample them
+    // sampler states are set once per frame, engine may still override them
+    IDirect3DDevice9 *dev = GB_GfxMgr->m_pd3dDevice;
+    DWORD i, mipfilter;
+    for (i = 0; i < TEXMIP_MAXSTAGES; i++) {
+        if (FAILED(IDirect3DDevice9_GetSamplerState(dev, i, D3DSAMP_MIPFILTER, &mipfilter)) || mipfilter == D3DTEXF_NONE) {
+            IDirect3DDevice9_SetSamplerState(dev, i, D3DSAMP_MIPFILTER, D3DTEXF_LINEAR);
+        }
+        IDirect3DDevice9_SetSamplerState(dev, i, D3DSAMP_MIPMAPLODBIAS, *(DWORD *) &texmip_lodbias);
+    }
+}
+
+static void texmip_report(void)
+{
+    plog("texture mipmap: %u generated, %u applied.", texmip_generated, texmip_applied);
+}
+
+void init_texture_mipmap(void)
+{
+    texmip_filter = get_int_from_configfile("texturemipmap");
+    if (texmip_filter != TEXMIP_BOX && texmip_filter != TEXMIP_KAISER) {
+        texmip_filter = 0;
+        return;
+    }
+    if (texmip_filter == TEXMIP_KAISER) texmip_init_kaiser();
+    texmip_lodbias = str2double(get_string_from_configfile("texturemipmap_lodbias"));
+    add_postpresent_hook(texmip_postpresent);
+    add_atexit_hook(texmip_report);
+}
@@ -0,0 +1,148 @@
+#include "common.h"
+
+// thread scheduling policy
+//   game threads (main thread and d3d thread) may run at raised priority,
+//   and may join MMCSS "Games" task to get boosted by multimedia scheduler
+//   worker threads are kept off the primary physical core,
+//   which game thread is asked to run on (ideal processor only, not pinned)
+//   process may opt out of power throttling, so timer resolution is honored
+//   when window is occluded and threads are not slowed down by EcoQoS
+
+static int sched_priority; // 0 = keep, 1 = raise game threads, 2 = also use MMCSS
+static int sched_affinity;
+static int sched_nothrottle;
+static DWORD_PTR sched_worker_mask; // 0 = don't restrict
+static int sched_primary_cpu = -1;
+static int sched_nr_cores;
+
+static HANDLE (WINAPI *myAvSetMmThreadCharacteristicsA)(LPCSTR, LPDWORD);
+
+#define myRelationProcessorCore 0
+struct mySYSTEM_LOGICAL_PROCESSOR_INFORMATION {
+    ULONG_PTR ProcessorMask;
+    DWORD Relationship;
+    union {
+        BYTE Flags;
+        DWORD NodeNumber;
+        ULONGLONG Reserved[2];
+    };
+};
+
+// find logical processors of the physical core which the lowest usable logical processor belongs to
+static DWORD_PTR sched_primary_core_mask(DWORD_PTR proc_mask)
+{
+    DWORD_PTR lowest = proc_mask & -proc_mask;
+    DWORD_PTR result = lowest;
+    
+    sched_nr_cores = 0;
+    BOOL (WINAPI *myGetLogicalProcessorInformation)(struct mySYSTEM_LOGICAL_PROCESSOR_INFORMATION *, PDWORD) = (void *) GetProcAddress(GetModuleHandle("KERNEL32.DLL"), "GetLogicalProcessorInformation");
+    if (myGetLogicalProcessorInformation) {
+        DWORD len = 0;
+        myGetLogicalProcessorInformation(NULL, &len);
+        struct mySYSTEM_LOGICAL_PROCESSOR_INFORMATION *info = len ? malloc(len) : NULL;
+        if (info && myGetLogicalProcessorInformation(info, &len)) {
+            unsigned i;
+            for (i = 0; i < len / sizeof(*info); i++) {
+                if (info[i].Relationship != myRelationProcessorCore || !(info[i].ProcessorMask & proc_mask)) continue;
+                sched_nr_cores++;
+                if (info[i].ProcessorMask & lowest) result = info[i].ProcessorMask & proc_mask;
+            }
+        }
+        free(info);
+    }
+    return result;
+}
+
+static void sched_init_topology(void)
+{
+    DWORD_PTR proc_mask, sys_mask;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &proc_mask, &sys_mask) || !proc_mask) return;
+    DWORD_PTR primary = sched_primary_core_mask(proc_mask);
+    
+    // on single core systems, there is nowhere else for workers to go
+    if (proc_mask & ~primary) sched_worker_mask = proc_mask & ~primary;
+    
+    int i;
+    for (i = 0; i < (int) sizeof(DWORD_PTR) * 8; i++) {
+        if (primary & ((DWORD_PTR) 1 << i)) {
+            sched_primary_cpu = i;
+            break;
+        }
+    }
+}
+
+#define myProcessPowerThrottling 4
+#define myPROCESS_POWER_THROTTLING_CURRENT_VERSION 1
+#define myPROCESS_POWER_THROTTLING_EXECUTION_SPEED 0x1
+#define myPROCESS_POWER_THROTTLING_IGNORE_TIMER_RESOLUTION 0x4
+struct myPROCESS_POWER_THROTTLING_STATE {
+    ULONG Version;
+    ULONG ControlMask;
+    ULONG StateMask;
+};
+
+static int sched_disable_throttling(void)
+{
+    BOOL (WINAPI *mySetProcessInformation)(HANDLE, int, LPVOID, DWORD) = (void *) GetProcAddress(GetModuleHandle("KERNEL32.DLL"), "SetProcessInformation");
+    if (!mySetProcessInformation) return 0;
+    
+    // control bits set with state bits cleared means "never throttle"
+    struct myPROCESS_POWER_THROTTLING_STATE state;
+    state.Version = myPROCESS_POWER_THROTTLING_CURRENT_VERSION;
+    state.ControlMask = myPROCESS_POWER_THROTTLING_EXECUTION_SPEED | myPROCESS_POWER_THROTTLING_IGNORE_TIMER_RESOLUTION;
+    state.StateMask = 0;
+    if (mySetProcessInformation(GetCurrentProcess(), myProcessPowerThrottling, &state, sizeof(state))) return 1;
+    
+    // systems before windows 11 reject unknown control bits
+    state.ControlMask = myPROCESS_POWER_THROTTLING_EXECUTION_SPEED;
+    return !!mySetProcessInformation(GetCurrentProcess(), myProcessPowerThrottling, &state, sizeof(state));
+}
+
+void sched_set_thread(HANDLE hThread, int sched_class)
+{
+    switch (sched_class) {
+        case SCHED_GAME:
+            if (sched_priority) {
+                SetThreadPriority(hThread, THREAD_PRIORITY_ABOVE_NORMAL);
+                // MMCSS only applies to calling thread
+                if (myAvSetMmThreadCharacteristicsA && hThread == GetCurrentThread()) {
+                    DWORD task_index = 0;
+                    if (!myAvSetMmThreadCharacteristicsA("Games", &task_index)) {
+                        warning("can't register thread to MMCSS, error %u.", (unsigned) GetLastError());
+                    }
+                }
+            }
+            break;
+        case SCHED_WORKER:
+            if (sched_affinity && sched_worker_mask) SetThreadAffinityMask(hThread, sched_worker_mask);
+            break;
+        case SCHED_BACKGROUND:
+            SetThreadPriority(hThread, THREAD_PRIORITY_BELOW_NORMAL);
+            if (sched_affinity && sched_worker_mask) SetThreadAffinityMask(hThread, sched_worker_mask);
+            break;
+    }
+}
+
+void init_threadsched(void)
+{
+    sched_priority = get_int_from_configfile("threadpriority");
+    sched_affinity = get_int_from_configfile("threadaffinity");
+    sched_nothrottle = get_int_from_configfile("nopowerthrottle");
+    
+    if (is_win9x()) return;
+    
+    sched_init_topology();
+    
+    if (sched_priority >= 2) {
+        HMODULE hAvrt = LoadLibrary("AVRT.DLL");
+        if (hAvrt) myAvSetMmThreadCharacteristicsA = (void *) GetProcAddress(hAvrt, "AvSetMmThreadCharacteristicsA");
+    }
+    
+    // current thread is game thread
+    sched_set_thread(GetCurrentThread(), SCHED_GAME);
+    if (sched_affinity && sched_worker_mask) SetThreadIdealProcessor(GetCurrentThread(), sched_primary_cpu);
+    
+    int throttle_disabled = sched_nothrottle && sched_disable_throttling();
+    
+    plog("threadsched: %d cores, primary cpu %d, worker mask %08X, priority %d, affinity %d, throttling %s.", sched_nr_cores, sched_primary_cpu, (unsigned) sched_worker_mask, sched_priority, sched_affinity, throttle_disabled ? "disabled" : "default");
+}
@@ -0,0 +1,201 @@
+#include "common.h"
+
+// thread-safe CPK reader
+//   one overlapped handle is opened for each CPK file and shared by all its readers,
+//   each reader has its own event, so readers of the same file don't wait for each other
+//   shared handles are closed with their last reader
+//   Windows 9x doesn't support overlapped I/O on disk files,
+//   so there each reader opens its own handle and seeks before reading
+//
+//   entries moved beyond end of CPK by modoverlay can't be opened,
+//   callers should fall back to engine in that case
+
+#define VFSREAD_MAXFILES 16
+
+struct vfsread_shared {
+    char path[MAX_PATH];
+    HANDLE hfile;
+    unsigned long long filesize;
+    int refs;
+};
+
+struct vfsread_file {
+    struct vfsread_shared *sf;
+    HANDLE hfile; // own handle on Windows 9x, otherwise same as sf->hfile
+    HANDLE event;
+    unsigned start, size;
+};
+
+static struct vfsread_shared shared_list[VFSREAD_MAXFILES];
+static CRITICAL_SECTION vfsread_cs;
+static int vfsread_overlapped;
+static int nr_readers, max_readers;
+static volatile LONG nr_reads, nr_kbytes;
+
+static HANDLE open_cpkfile(const char *path, int overlapped)
+{
+    return CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, overlapped ? FILE_FLAG_OVERLAPPED : FILE_ATTRIBUTE_NORMAL, NULL);
+}
+
+// must be called with vfsread_cs held
+static struct vfsread_shared *shared_get(const char *path)
+{
+    int i;
+    struct vfsread_shared *sf = NULL;
+    for (i = 0; i < VFSREAD_MAXFILES; i++) {
+        if (shared_list[i].refs && stricmp(shared_list[i].path, path) == 0) {
+            shared_list[i].refs++;
+            return &shared_list[i];
+        }
+        if (!shared_list[i].refs && !sf) sf = &shared_list[i];
+    }
+    if (!sf) return NULL;
+
+    DWORD size_lo, size_hi;
+    sf->hfile = open_cpkfile(path, vfsread_overlapped);
+    if (sf->hfile == INVALID_HANDLE_VALUE) return NULL;
+    size_lo = GetFileSize(sf->hfile, &size_hi);
+    if (size_lo == INVALID_FILE_SIZE && GetLastError() != NO_ERROR) {
+        CloseHandle(sf->hfile);
+        return NULL;
+    }
+    strcpy(sf->path, path);
+    sf->filesize = ((unsigned long long) size_hi << 32) + size_lo;
+    sf->refs = 1;
+    return sf;
+}
+
+// must be called with vfsread_cs held
+static void shared_put(struct vfsread_shared *sf)
+{
+    if (--sf->refs == 0) {
+        CloseHandle(sf->hfile);
+        memset(sf, 0, sizeof(*sf));
+    }
+}
+
+struct vfsread_file *vfsread_open_range(const char *cpkfile, unsigned offset, unsigned size)
+{
+    struct vfsread_file *fp;
+    if (strlen(cpkfile) >= MAX_PATH) return NULL;
+    fp = malloc(sizeof(struct vfsread_file));
+    if (!fp) return NULL;
+    memset(fp, 0, sizeof(*fp));
+    fp->start = offset;
+    fp->size = size;
+
+    EnterCriticalSection(&vfsread_cs);
+    fp->sf = shared_get(cpkfile);
+    if (fp->sf && (unsigned long long) offset + size > fp->sf->filesize) {
+        shared_put(fp->sf);
+        fp->sf = NULL;
+    }
+    if (fp->sf) max_readers = imax(max_readers, ++nr_readers);
+    LeaveCriticalSection(&vfsread_cs);
+    if (!fp->sf) {
+        free(fp);
+        return NULL;
+    }
+
+    if (vfsread_overlapped) {
+        fp->hfile = fp->sf->hfile;
+        fp->event = CreateEventA(NULL, TRUE, FALSE, NULL);
+        if (!fp->event) goto fail;
+    } else {
+        fp->hfile = open_cpkfile(cpkfile, 0);
+        if (fp->hfile == INVALID_HANDLE_VALUE) goto fail;
+    }
+    return fp;
+fail:
+    if (!vfsread_overlapped) fp->hfile = NULL;
+    vfsread_close(fp);
+    return NULL;
+}
+
+struct vfsread_file *vfsread_open_entry(struct CPK *cpk, int tblidx)
+{
+    if (!cpk->m_bLoaded || tblidx < 0 || tblidx >= imin(cpk->m_CPKHeader.dwValidTableNum, sizeof(cpk->m_CPKTable) / sizeof(cpk->m_CPKTable[0]))) return NULL;
+    struct CPKTable *t = &cpk->m_CPKTable[tblidx];
+    if (!(t->dwFlag & 0x10000)) return NULL; // compressed
+    return vfsread_open_range(cpk->m_szCPKFileName, t->dwStartPos, t->dwPackedSize);
+}
+
+struct vfsread_file *vfsread_open(struct CPK *cpk, const char *relpath)
+{
+    char path[MAXLINE];
+    char *p;
+    if (!cpk->m_bLoaded || strlen(relpath) >= sizeof(path)) return NULL;
+
+    // table is keyed by CRC of lower case path with backslashes
+    strcpy(path, relpath);
+    str_tolower(path);
+    for (p = path; *p; p++) {
+        if (*p == '/') *p = '\\';
+    }
+    return vfsread_open_entry(cpk, vfsread_findcrc(cpk, gbCrc32Compute(path)));
+}
+
+unsigned vfsread_size(struct vfsread_file *fp)
+{
+    return fp->size;
+}
+
+// read from given offset of entry, returns number of bytes read, or -1 on error
+int vfsread_read(struct vfsread_file *fp, void *buf, unsigned offset, unsigned size)
+{
+    DWORD nbytes = 0;
+    if (offset >= fp->size) return 0;
+    size = imin(size, fp->size - offset);
+    if (vfsread_overlapped) {
+        OVERLAPPED ov;
+        memset(&ov, 0, sizeof(ov));
+        ov.Offset = fp->start + offset;
+        ov.hEvent = fp->event;
+        if (!ReadFile(fp->hfile, buf, size, NULL, &ov) && GetLastError() != ERROR_IO_PENDING) return -1;
+        if (!GetOverlappedResult(fp->hfile, &ov, &nbytes, TRUE)) return -1;
+    } else {
+        if (SetFilePointer(fp->hfile, fp->start + offset, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER) return -1;
+        if (!ReadFile(fp->hfile, buf, size, &nbytes, NULL)) return -1;
+    }
+    InterlockedIncrement(&nr_reads);
+    InterlockedExchangeAdd(&nr_kbytes, (nbytes + 512) / 1024);
+    return nbytes;
+}
+
+void vfsread_close(struct vfsread_file *fp)
+{
+    if (!fp) return;
+    if (fp->event) CloseHandle(fp->event);
+    if (!vfsread_overlapped && fp->hfile) CloseHandle(fp->hfile);
+    EnterCriticalSection(&vfsread_cs);
+    shared_put(fp->sf);
+    nr_readers--;
+    LeaveCriticalSection(&vfsread_cs);
+    free(fp);
+}
+
+// find table index of given CRC, returns -1 if not found
+int vfsread_findcrc(struct CPK *cpk, unsigned crc)
+{
+    // table is sorted by CRC
+    int lo = 0, hi = imin(cpk->m_CPKHeader.dwValidTableNum, sizeof(cpk->m_CPKTable) / sizeof(cpk->m_CPKTable[0]));
+    int n = hi;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cpk->m_CPKTable[mid].dwCRC < crc) lo = mid + 1; else hi = mid;
+    }
+    return lo < n && cpk->m_CPKTable[lo].dwCRC == crc ? lo : -1;
+}
+
+static void vfsread_report(void)
+{
+    if (!nr_reads) return;
+    plog("vfsread: %u reads, %.1f MB, %d readers at most.", (unsigned) nr_reads, nr_kbytes / 1024.0, max_readers);
+}
+
+void init_vfsread(void)
+{
+    InitializeCriticalSection(&vfsread_cs);
+    vfsread_overlapped = !is_win9x();
+    add_atexit_hook(vfsread_report);
+}
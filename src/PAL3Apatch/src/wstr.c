@@ -2,21 +2,12 @@
 
 wchar_t *chinese_to_unicode(const char *s, const wchar_t *table)
 {
-    struct wstr v;
-    wstr_ctor(&v);
-    while (*s) {
-        wchar_t c = 0xfffd;
-        unsigned char b1 = *s++;
-        if (b1 < 0x80) {
-            c = b1;
-        } else if (*s) {
-            unsigned char b2 = *s++;
-            int i = ((b1 << 8) | b2) - 0x8000;
-            if (table[i]) c = table[i];
-        }
-        wstr_pushback(&v, c);
-    }
-    return wstr_mdtor(&v);
+    // each byte decodes to at most one char
+    int len = strlen(s);
+    wchar_t *ret = malloc(sizeof(wchar_t) * (len + 1));
+    if (!ret) return NULL;
+    cjktable_decode(s, len, table, ret);
+    return ret;
 }
 
 char *utf16_to_utf8(const wchar_t *s)
@@ -115,6 +106,13 @@ wchar_t *cs2wcs_alloc(const char *cstr, UINT src_cp)
         return utf8_to_utf16(cstr);
     }
     
+    // use table for GBK and BIG5, it's locale-independent and much faster
+    const wchar_t *table = cjktable_get(src_cp);
+    if (table) {
+        wchar_t *wstr = chinese_to_unicode(cstr, table);
+        if (wstr) return wstr;
+    }
+    
     wchar_t *ret = NULL;
     size_t len;
     
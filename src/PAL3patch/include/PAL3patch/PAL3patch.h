@@ -18,8 +18,17 @@ extern PATCHAPI void sforce_unpacker_entry(void);
 #define PAL3_KERNEL32_IATBASE TOPTR(0x0056A024)
 #define PAL3_WINMM_IATBASE TOPTR(0x0056A1C0)
 #define PAL3_USER32_IATBASE TOPTR(0x0056A134)
+#define PAL3_IAT_BEGIN 0x0056A000
+#define PAL3_IAT_END 0x0056B000
 
 extern unsigned sforce_unpacker_init(void);
+extern void cached_unpacker_entry(void);
+extern void cached_unpacker_init(void);
+
+// unpackcache.c
+extern int unpackcache_pending;
+extern void unpackcache_save(void);
+extern int unpackcache_load(void);
 
 #endif
 #endif
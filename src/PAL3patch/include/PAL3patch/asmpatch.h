@@ -12,6 +12,18 @@
         make_asmpatch_proc_call((addr), MAKE_ASMPATCH_NAME(name), (size)); \
     } while (0)
 
+// lite asmpatch, for hot patches
+//   FPU state is not saved, so patch_proc runs with FPU state of game
+//   (the FPU stack must have enough room for patch_proc)
+//   and the stack check is skipped
+//   define ASMPATCH_LITE_DEBUG to route lite patches through full entry
+//#define ASMPATCH_LITE_DEBUG
+#define INIT_ASMPATCH_LITE(name, addr, size, oldcode) \
+    do { \
+        check_code((addr), (oldcode), (size)); \
+        make_asmpatch_lite_proc_call((addr), MAKE_ASMPATCH_NAME(name), (size)); \
+    } while (0)
+
 struct trapframe;
 typedef void (*patch_proc_t)(struct trapframe *tf);
 struct trapframe {
@@ -30,6 +42,7 @@ struct trapframe {
 };
 
 extern PATCHAPI void make_asmpatch_proc_call(unsigned addr, patch_proc_t patch_proc, unsigned size);
+extern PATCHAPI void make_asmpatch_lite_proc_call(unsigned addr, patch_proc_t patch_proc, unsigned size);
 #define PUSH_DWORD(data) do { unsigned data_ = (data); *--(tf)->p_esp = data_; } while (0)
 #define POP_DWORD() (*(tf)->p_esp++)
 #define M_FLOAT(addr) (*(float *)(addr))
@@ -60,6 +73,7 @@ extern void patchentry(struct trapframe *tf);
 // asmentry.S
 extern unsigned max_push_dwords;
 extern void __stdcall asmentry(unsigned patch_id);
+extern void __stdcall asmentry_lite(unsigned patch_id);
 
 #endif
 #endif
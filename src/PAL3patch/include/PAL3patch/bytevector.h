@@ -68,6 +68,60 @@ extern BVECAPI void bvec_bpop(struct bvec *v, size_t size);
 #define bvec_tpopback(v, type) bvec_tpop((v), 1, type)
 
 
+// small-buffer byte vector definition
+//   same as bvec, but data up to SBVEC_INLINE_SIZE bytes lives in the struct
+//   itself, so short vectors on stack never touch heap
+//   since it points to itself, it MUST NOT be copied by assignment
+//   or memcpy(), use sbvec_copy() or sbvec_move() instead
+
+#define SBVEC_INLINE_SIZE 64
+
+struct sbvec {
+    struct bvec v;
+    unsigned char buf[SBVEC_INLINE_SIZE];
+};
+
+extern BVECAPI void sbvec_ctor(struct sbvec *v);
+extern BVECAPI void sbvec_bctor(struct sbvec *v, const void *data, size_t size);
+extern BVECAPI void sbvec_cctor(struct sbvec *v, const struct sbvec *src);
+extern BVECAPI void sbvec_dtor(struct sbvec *v);
+extern BVECAPI void *sbvec_mdtor(struct sbvec *v); // always returns malloc()-ed memory
+extern BVECAPI void sbvec_clear(struct sbvec *v);
+extern BVECAPI void sbvec_fclear(struct sbvec *v);
+extern BVECAPI void sbvec_copy(struct sbvec *dst, const struct sbvec *src);
+extern BVECAPI void sbvec_move(struct sbvec *dst, struct sbvec *src);
+extern BVECAPI void sbvec_swap(struct sbvec *a, struct sbvec *b);
+extern BVECAPI void sbvec_shrink(struct sbvec *v);
+extern BVECAPI void sbvec_breserve(struct sbvec *v, size_t size);
+extern BVECAPI void sbvec_bresize(struct sbvec *v, size_t size);
+extern BVECAPI void sbvec_bpush(struct sbvec *v, const void *data, size_t size);
+extern BVECAPI void sbvec_cpush(struct sbvec *dst, const struct sbvec *src);
+extern BVECAPI void sbvec_bpop(struct sbvec *v, size_t size);
+
+#define sbvec_bdata(sv) bvec_bdata(&(sv)->v)
+#define sbvec_bbegin(sv) bvec_bbegin(&(sv)->v)
+#define sbvec_bend(sv) bvec_bend(&(sv)->v)
+#define sbvec_empty(sv) bvec_empty(&(sv)->v)
+#define sbvec_bsize(sv) bvec_bsize(&(sv)->v)
+#define sbvec_bcapacity(sv) bvec_bcapacity(&(sv)->v)
+
+#define sbvec_tctor(v, base, nmemb, type) sbvec_bctor((v), (base), (nmemb) * sizeof(type))
+#define sbvec_tmdtor(v, type) ((bvec_typeof(type) *) sbvec_mdtor(v))
+#define sbvec_tdata(sv, type) bvec_tdata(&(sv)->v, type)
+#define sbvec_tbegin(sv, type) bvec_tbegin(&(sv)->v, type)
+#define sbvec_tend(sv, type) bvec_tend(&(sv)->v, type)
+#define sbvec_tat(sv, n, type) bvec_tat(&(sv)->v, n, type)
+#define sbvec_tfront(sv, type) bvec_tfront(&(sv)->v, type)
+#define sbvec_tback(sv, type) bvec_tback(&(sv)->v, type)
+#define sbvec_tsize(sv, type) bvec_tsize(&(sv)->v, type)
+#define sbvec_treserve(v, size, type) sbvec_breserve((v), (size) * sizeof(type))
+#define sbvec_tresize(v, size, type) sbvec_bresize((v), (size) * sizeof(type))
+#define sbvec_tpush(v, base, nmemb, type) sbvec_bpush((v), (base), (nmemb) * sizeof(type))
+#define sbvec_tpushback(v, ptr, type) sbvec_tpush((v), (ptr), 1, type)
+#define sbvec_tpop(v, nmemb, type) sbvec_bpop((v), (nmemb) * sizeof(type))
+#define sbvec_tpopback(v, type) sbvec_tpop((v), 1, type)
+
+
 // high-level interface (value)
 
 extern BVECAPI void bvec_push_char(struct bvec *v, char val);
@@ -80,11 +134,12 @@ extern BVECAPI void bvec_push_ptr(struct bvec *v, void *val);
 
 
 // high-level interface (string template)
+//   @vec is the underlying vector, bvec or sbvec
 
 
-#define BVEC_STRING_DECL(clsname, tchar, tname) \
+#define BVEC_STRING_DECL(clsname, tchar, tname, vec) \
     struct clsname { \
-        struct bvec v; \
+        struct vec v; \
     }; \
     extern BVECAPI void CONCAT3(clsname, _, ctor)(struct clsname *s); \
     extern BVECAPI void CONCAT3(clsname, _, cctor)(struct clsname *s, const struct clsname *src); \
@@ -123,8 +178,13 @@ extern BVECAPI void bvec_push_ptr(struct bvec *v, void *val);
     extern int CONCAT3(clsname, _, vformat)(struct clsname *s, const tchar *fmt, va_list ap); \
 // TEMPLATE END
 
-BVEC_STRING_DECL(wstr, wchar_t, wcs)
-BVEC_STRING_DECL(cstr, char, str)
+BVEC_STRING_DECL(wstr, wchar_t, wcs, bvec)
+BVEC_STRING_DECL(cstr, char, str, bvec)
+
+// small-buffer strings, same interface as wstr and cstr
+//   use them for short temporaries, and never assign them by value
+BVEC_STRING_DECL(swstr, wchar_t, wcs, sbvec)
+BVEC_STRING_DECL(scstr, char, str, sbvec)
 
 #define wstr_at(s, n) (*(wstr_data(s) + (n)))
 #define wstr_front(s) (*wstr_begin(s))
@@ -134,12 +194,25 @@ BVEC_STRING_DECL(cstr, char, str)
 #define cstr_front(s) (*cstr_begin(s))
 #define cstr_back(s) (*(cstr_end(s) - 1))
 
+#define swstr_at(s, n) (*(swstr_data(s) + (n)))
+#define swstr_front(s) (*swstr_begin(s))
+#define swstr_back(s) (*(swstr_end(s) - 1))
+
+#define scstr_at(s, n) (*(scstr_data(s) + (n)))
+#define scstr_front(s) (*scstr_begin(s))
+#define scstr_back(s) (*(scstr_end(s) - 1))
+
 
 // wstr wrapper
 
-extern BVECAPI void wstr_cs2wcs(struct wstr *s, const char *cstr, UINT src_cp);
-extern BVECAPI void cstr_wcs2cs(struct cstr *s, const wchar_t *wstr, UINT src_cp);
-extern BVECAPI void cstr_cs2cs(struct cstr *s, const char *cstr, UINT src_cp, UINT dst_cp);
+#define BVEC_STRING_CONV_DECL(wclsname, cclsname) \
+    extern BVECAPI void CONCAT3(wclsname, _, cs2wcs)(struct wclsname *s, const char *cstr, UINT src_cp); \
+    extern BVECAPI void CONCAT3(cclsname, _, wcs2cs)(struct cclsname *s, const wchar_t *wstr, UINT dst_cp); \
+    extern BVECAPI void CONCAT3(cclsname, _, cs2cs)(struct cclsname *s, const char *cstr, UINT src_cp, UINT dst_cp); \
+// TEMPLATE END
+
+BVEC_STRING_CONV_DECL(wstr, cstr)
+BVEC_STRING_CONV_DECL(swstr, scstr)
 
 
 #ifdef PATCHAPI_EXPORTS
@@ -148,13 +221,17 @@ extern BVECAPI void cstr_cs2cs(struct cstr *s, const char *cstr, UINT src_cp, UI
 #ifdef BVEC_DEBUG
 #define BVEC_DEFAULT_CAPACITY 1
 #define BVEC_STRING_DEFAULT_FORMATBUFFER 1
+#define SBVEC_STRING_DEFAULT_FORMATBUFFER(tchar) 1
 #else
 #define BVEC_DEFAULT_CAPACITY 32
 #define BVEC_STRING_DEFAULT_FORMATBUFFER 256
+#define SBVEC_STRING_DEFAULT_FORMATBUFFER(tchar) (SBVEC_INLINE_SIZE / sizeof(tchar))
 #endif
 
 BVEC_STRING_PRIVATE_DECL(wstr, wchar_t, wcs)
 BVEC_STRING_PRIVATE_DECL(cstr, char, str)
+BVEC_STRING_PRIVATE_DECL(swstr, wchar_t, wcs)
+BVEC_STRING_PRIVATE_DECL(scstr, char, str)
 
 #endif
 #endif
@@ -6,6 +6,30 @@ extern PATCHAPI const char *get_string_from_configfile_unsafe(const char *key);
 extern PATCHAPI const char *get_string_from_configfile(const char *key);
 extern PATCHAPI int get_int_from_configfile(const char *key);
 
+// cached config values
+//   key is resolved once by get_config_value(), parsed values are cached at first access
+//   so the accessors are cheap enough for hot code, fields are read-only for users
+#define CONFIG_MAXTUPLE 8
+struct config_value {
+    const char *key;
+    const char *str; // replaced when changed by reload, old string is kept valid
+    unsigned parsed; // bitmask of CONFIG_PARSED_XXX
+    int changed; // changed by last reload, see add_configchange_hook()
+    int ival;
+    double dval;
+    int ntuple;
+    double tuple[CONFIG_MAXTUPLE];
+};
+#define CONFIG_PARSED_INT    0x1
+#define CONFIG_PARSED_DOUBLE 0x2
+#define CONFIG_PARSED_TUPLE  0x4
+extern PATCHAPI struct config_value *find_config_value(const char *key); // return NULL if not found
+extern PATCHAPI struct config_value *get_config_value(const char *key);
+extern PATCHAPI int config_value_int(struct config_value *v);
+extern PATCHAPI double config_value_double(struct config_value *v);
+extern PATCHAPI int config_value_tuple(struct config_value *v, double *out, int maxn); // numbers separated by ',' ':' or 'x', returns count
+extern PATCHAPI int config_value_changed(const char *key);
+
 
 #ifdef PATCHAPI_EXPORTS
 // INTERNAL DEFINITIONS
@@ -13,9 +37,9 @@ extern PATCHAPI int get_int_from_configfile(const char *key);
 #define CONFIG_FILE     "PAL3patch.conf"
 #define CONFIG_FILE_WAL "PAL3patch.wal"
 #define CONFIG_FILE_SUM "PAL3patch.sum"
-#define MAX_CONFIG_LINES 1000
 
 extern void read_config_file(void);
+extern int reload_config_file(void);
 extern void dump_all_config(FILE *fp);
 
 #endif
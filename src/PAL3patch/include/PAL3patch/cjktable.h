@@ -4,6 +4,8 @@
 extern PATCHAPI const wchar_t cjktable[];
 extern PATCHAPI const wchar_t gbktable[];
 extern PATCHAPI const wchar_t big5table[];
+extern PATCHAPI const wchar_t *cjktable_get(UINT codepage);
+extern PATCHAPI int cjktable_decode(const char *s, int len, const wchar_t *table, wchar_t *buf);
 
 #ifdef PATCHAPI_EXPORTS
 // INTERNAL DEFINITIONS
@@ -314,11 +314,18 @@ extern "C" {
 #include "ftfont.h"
 #include "ftcharhack.h"
 #include "plugin.h"
+#include "jobsys.h"
+#include "perfcounter.h"
 #include "fsutil.h"
 #include "bytevector.h"
 #include "sha1.h"
+#include "lzblock.h"
 #include "wal.h"
 #include "badtools.h"
+#include "pixelconv.h"
+#include "imgdecode.h"
+#include "vfsread.h"
+#include "threadsched.h"
 
 
 #ifdef __cplusplus
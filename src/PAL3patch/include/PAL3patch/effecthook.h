@@ -12,5 +12,7 @@ extern PATCHAPI void init_effect_hooks(void);
 
 #define MAX_EFFECTHOOKS 100
 
+extern char *run_all_effect_hooks(const char *fn, const char *eff);
+
 #endif
 #endif
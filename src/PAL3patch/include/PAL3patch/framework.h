@@ -3,6 +3,9 @@
 // PATCHAPI DEFINITIONS
 
 extern PATCHAPI void memcpy_to_process(unsigned dest, const void *src, unsigned size);
+extern PATCHAPI void begin_patch_transaction(void);
+extern PATCHAPI void commit_patch_transaction(void);
+extern PATCHAPI void abort_patch_transaction(void);
 extern PATCHAPI void memcpy_from_process(void *dest, unsigned src, unsigned size);
 extern PATCHAPI void make_branch(unsigned addr, unsigned char opcode, const void *jtarget, unsigned size);
 extern PATCHAPI unsigned get_branch_jtarget(unsigned addr, unsigned char opcode);
@@ -11,6 +14,7 @@ extern PATCHAPI void make_call(unsigned addr, const void *jtarget);
 extern PATCHAPI void make_call6(unsigned addr, const void *jtarget);
 extern PATCHAPI void make_wrapper_branch(unsigned addr, const void *jtarget);
 extern PATCHAPI void make_wrapper_branch_batch(unsigned *addr_list, int count, const void *jtarget);
+extern PATCHAPI unsigned get_wrapper_branch_jtarget(unsigned addr);
 extern PATCHAPI void make_uint(unsigned addr, unsigned uint);
 extern PATCHAPI void make_pointer(unsigned addr, void *ptr);
 extern PATCHAPI void check_code(unsigned addr, const void *code, unsigned size);
@@ -72,5 +76,8 @@ extern PATCHAPI void *dup_vftable(void *vftable, unsigned size);
 #ifdef PATCHAPI_EXPORTS
 // INTERNAL DEFINITIONS
 
+extern unsigned memcpy_to_process_count;
+extern void get_address_symbol(const void *addr, char *buf, int size);
+
 #endif
 #endif
@@ -15,6 +15,12 @@ extern void NORETURN fail_impl(const char *file, int line, const char *func, con
 #define warning(fmt, ...) plog_impl(1, __FILE__, __LINE__, __func__, fmt, ## __VA_ARGS__)
 #define plog(fmt, ...) plog_impl(0, __FILE__, __LINE__, __func__, fmt, ## __VA_ARGS__)
 extern void plog_impl(int is_warning, const char *file, int line, const char *func, const char *fmt, ...);
+extern void init_logger(void);
+extern void flush_log(void);
+
+extern void startup_begin(const char *fmt, ...);
+extern void startup_end(void);
+extern void startup_report(void);
 
 #endif
 #endif
@@ -20,12 +20,35 @@ extern PATCHAPI struct memory_allocator pal3_mem_allocator;  // PAL3.EXE
 extern PATCHAPI struct memory_allocator gb_mem_allocator;    // GBENGINE.DLL
 extern PATCHAPI struct memory_allocator patch_mem_allocator; // PAL3PATCH.DLL
 
+
+// arena allocator
+//   bump-pointer allocation from chunks, all memory is released at once by mem_arena_reset()
+//   mem_arena_free() only gives back the most recent allocation, otherwise does nothing
+//   arenas are not thread-safe
+struct mem_arena_chunk;
+struct mem_arena {
+    struct mem_arena_chunk *head;
+    size_t chunk_size;
+};
+extern PATCHAPI void mem_arena_ctor(struct mem_arena *arena, size_t chunk_size);
+extern PATCHAPI void mem_arena_dtor(struct mem_arena *arena);
+extern PATCHAPI void *mem_arena_alloc(struct mem_arena *arena, size_t size);
+extern PATCHAPI void mem_arena_free(struct mem_arena *arena, void *ptr);
+extern PATCHAPI void mem_arena_reset(struct mem_arena *arena);
+
+// per-frame scratch memory, main thread only
+//   reset at the beginning of each game loop iteration
+extern PATCHAPI struct mem_arena frame_mem_arena;
+extern PATCHAPI struct memory_allocator frame_mem_allocator;
+
 #ifdef PATCHAPI_EXPORTS
 // INTERNAL DEFINITIONS
 
 #define cur_mem_allocator patch_mem_allocator
 
 extern void init_memory_allocators(void);
+extern void init_memory_arenas(void);
+extern HANDLE find_allocator_heap(const struct memory_allocator *allocator);
 
 #endif
 #endif
@@ -3,7 +3,7 @@
 // PATCHAPI DEFINITIONS
 
 
-extern PATCHAPI void *load_image_bits(void *filedata, unsigned filelen, int *width, int *height, int *bitcount, const struct memory_allocator *mem_allocator);
+extern PATCHAPI void *load_image_bits(const void *filedata, unsigned filelen, int *width, int *height, int *bitcount, const struct memory_allocator *mem_allocator);
 extern PATCHAPI void ensure_cooperative_level(int requirefocus);
 extern PATCHAPI void clamp_rect(void *bits, int width, int height, int bitcount, int pitch, int left, int top, int right, int bottom);
 extern PATCHAPI void copy_bits(void *dst, int dst_pitch, int dst_x, int dst_y, void *src, int src_pitch, int src_x, int src_y, int width, int height, int bitcount);
@@ -304,6 +304,11 @@ struct gbTexture_D3D {
     struct IDirect3DSurface9 *pDS;
     ULONG m_ImgFormat;
 };
+
+struct gbTextureArray {
+    struct gbTexture *pTexPt[16];
+    int nTex;
+};
 struct RenderTarget {
     int m_iMode;
     struct gbTexture_D3D m_Texture;
@@ -534,6 +539,7 @@ struct gbPrintFont_UNICODE {
 };
 
 typedef struct BINK BINK, *HBINK;
+#define BINKCOPYALL 0x80000000L // copy all pixels, not only changed ones
 
 struct gbBinkVideo {
     struct gbBinkVideoVtbl *vfptr;
@@ -1687,6 +1693,8 @@ struct Archive;
 #define gbVFileSystem_GetFileSize(this, fp) THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(gboffset + 0x10030BE0, long, struct gbVFileSystem *, struct gbVFile *), this, fp)
 #define gbVFileSystem_Read(this, buf, size, fp) THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(gboffset + 0x10030810, void, struct gbVFileSystem *, void *, unsigned int, struct gbVFile *), this, buf, size, fp)
 #define gbVFileSystem_CloseFile(this, fp) THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(gboffset + 0x100307A0, void, struct gbVFileSystem *, struct gbVFile *), this, fp)
+#define CPK_Open(this, path) THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(gboffset + 0x1002CC50, struct CPKFile *, struct CPK *, const char *), this, path)
+#define CPK_Close(this, fp) THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(gboffset + 0x1002D1A0, bool, struct CPK *, struct CPKFile *), this, fp)
 #define gbCrc32Compute ((unsigned (*)(const char *)) TOPTR(gboffset + 0x100277E0))
 #define gbCrc32Init ((void (*)(void)) TOPTR(gboffset + 0x10027730))
 #define gbAudioManager_GetMusicMasterVolume(this) ((this)->MusicMasterVol)
@@ -1819,6 +1827,7 @@ struct Archive;
     assert(sizeof(struct UIGameOver) == 0xE8); \
     assert(sizeof(struct HeadMsg) == 0x24); \
     assert(sizeof(struct gbTexture_D3D) == 0x60); \
+    assert(sizeof(struct gbTextureArray) == 0x44); \
     assert(sizeof(struct GRPinput) == 0x2958); \
     assert(sizeof(struct SoundMgr) == 0xE04FC); \
     assert(sizeof(struct gbAudioManager) == 0xF4); \
@@ -1853,6 +1862,9 @@ extern int gbGfxManager_D3D_GetBackBufferBitCount(struct gbGfxManager_D3D *this)
 extern void gbGfxManager_D3D_EnsureCooperativeLevel(struct gbGfxManager_D3D *this, int requirefocus);
 extern void *vfs_readfile(const char *filepath, unsigned *length, const struct memory_allocator *mem_allocator);
 extern const char *vfs_cpkname(void);
+extern struct CPK *vfs_findcpk(HANDLE hFile);
+extern int is_cpk_handle(struct CPK *cpk, HANDLE hFileMappingObject);
+extern struct CPK *vfs_findcpk_mapping(HANDLE hFileMappingObject);
 
 
 #endif
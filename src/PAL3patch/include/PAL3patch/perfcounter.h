@@ -0,0 +1,52 @@
+#ifndef PAL3PATCH_PERFCOUNTER_H
+#define PAL3PATCH_PERFCOUNTER_H
+// PATCHAPI DEFINITIONS
+
+// performance counters
+//   a registry of named counters, gauges and histograms,
+//   so patchsets and plugins can publish their statistics in one place
+//   perfcounter_register() returns the existing one if name is registered
+//   updates are lock-free and can be called from any thread
+//   flags select where a value is shown besides the summary in log at exit:
+//     PERFCOUNTER_OVERLAY   showfps overlay
+//     PERFCOUNTER_TRACE     'counters' column of frametrace
+//   text form is 'name=value', histograms are 'name=count/mean/max'
+enum perfcounter_type {
+    PERFCOUNTER_COUNTER,   // sum of perfcounter_add()
+    PERFCOUNTER_GAUGE,     // last value of perfcounter_set()
+    PERFCOUNTER_HISTOGRAM, // samples of perfcounter_sample()
+};
+#define PERFCOUNTER_OVERLAY 0x1
+#define PERFCOUNTER_TRACE   0x2
+
+#define PERFCOUNTER_NAMELEN 48
+#define PERFCOUNTER_BUCKETS 32 // bucket 0 is [0, 1), bucket i is [2^(i-1), 2^i)
+
+struct perfcounter;
+struct perfcounter_value {
+    int type;
+    unsigned flags;
+    double value; // sum, current value, or mean of samples
+    unsigned count; // number of samples
+    double min, max;
+    unsigned buckets[PERFCOUNTER_BUCKETS];
+};
+extern PATCHAPI struct perfcounter *perfcounter_register(const char *name, int type, unsigned flags);
+extern PATCHAPI struct perfcounter *perfcounter_find(const char *name);
+extern PATCHAPI void perfcounter_add(struct perfcounter *pc, double delta);
+extern PATCHAPI void perfcounter_set(struct perfcounter *pc, double value);
+extern PATCHAPI void perfcounter_sample(struct perfcounter *pc, double value);
+extern PATCHAPI const char *perfcounter_name(struct perfcounter *pc);
+extern PATCHAPI void perfcounter_read(struct perfcounter *pc, struct perfcounter_value *v);
+extern PATCHAPI double perfcounter_percentile(const struct perfcounter_value *v, double p);
+extern PATCHAPI int perfcounter_count(void);
+extern PATCHAPI struct perfcounter *perfcounter_at(int index);
+extern PATCHAPI void perfcounter_get_text(char *buf, int size, unsigned flags, char sep);
+
+#ifdef PATCHAPI_EXPORTS
+// INTERNAL DEFINITIONS
+
+extern void init_perfcounter(void);
+
+#endif
+#endif
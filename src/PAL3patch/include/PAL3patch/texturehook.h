@@ -27,6 +27,11 @@ struct texture_hook_info {
     int div_alpha; // if set to zero, disable div-alpha operation
     int fakewidth; // if set to zero, no fake texture width will apply
     int fakeheight; // if set to zero, no fake texture height will apply
+
+    // pre-imageload hook only
+    int async; // set to non-zero in TH_PRE_IMAGELOAD stage if this hook's TH_POST_IMAGELOAD processing is thread-safe
+    unsigned cachever; // set to non-zero in TH_PRE_IMAGELOAD stage if this hook's TH_POST_IMAGELOAD result can be cached, change it when processing changes
+    int fastdecode; // set to non-zero in TH_PRE_IMAGELOAD stage to let patch-side decoders load JPEG/BMP/TGA image instead of gbImage2D loaders (see texturedecode in config)
 };
 /*
   texture hook usage:
@@ -35,6 +40,16 @@ struct texture_hook_info {
         if interested, MUST set thinfo->interested to non-zero
         can change texture load path (set thinfo->loadpath, but tex->pName will not be changed)
         can load texture directly at this stage (set image data section)
+        if set thinfo->async along with thinfo->interested, and all other interested hooks
+          also set it, texture may be loaded asynchronously (see texturehook_async in config),
+          then TH_POST_IMAGELOAD callback will be called from a worker thread,
+          only for hooks interested in that texture, and div_alpha is ignored
+        if set thinfo->cachever, and all other interested hooks also set it,
+          result of TH_POST_IMAGELOAD stage may be cached on disk (see texturecache in config),
+          then on later loads neither the image is decoded nor the hooks are called,
+          so result should only depend on the image, texpath, cpkname and cachever
+        if set thinfo->fastdecode, image may be decoded by patch instead of engine,
+          if patch can't decode it, engine will load it as usual
         
     if type == TH_POST_IMAGELOAD:
         image is already loaded
@@ -66,6 +81,19 @@ extern PATCHAPI void mark_texture_hook_noautoload(struct texture_hook_info *thin
 
 // hook management functions
 extern PATCHAPI void add_texture_hook(void (*funcptr)(struct texture_hook_info *));
+// hook will only be called for textures matching all given filters
+//   cpkname: CPK name, e.g. "basedata.cpk"
+//   prefix: texpath prefix, '/' and '\\' are treated as same
+//   ext: texpath extension, e.g. ".tga"
+//   all filters are case-insensitive, NULL or "" matches anything
+extern PATCHAPI void add_texture_hook_filtered(void (*funcptr)(struct texture_hook_info *), const char *cpkname, const char *prefix, const char *ext);
+
+// read-only file view functions, for reading raw files in TH_PRE_IMAGELOAD stage
+//   uncompressed CPK entries are viewed from CPK's file mapping directly, without copying
+//   other files are read into memory
+//   views should be closed before callback returns, open returns NULL if failed
+extern PATCHAPI const void *open_texture_hook_view(const char *filepath, unsigned *length);
+extern PATCHAPI void close_texture_hook_view(const void *data);
 
 
 #ifdef PATCHAPI_EXPORTS
@@ -74,5 +102,111 @@ extern PATCHAPI void add_texture_hook(void (*funcptr)(struct texture_hook_info *
 #define MAX_TEXTURE_HOOKS 100
 extern void init_texture_hooks(void);
 
+// texture hook internals, used by texture services
+extern int nr_texhooks;
+extern void texhook_modname(int i, char *buf, int size);
+extern char texhook_normchar(char ch);
+extern void dds_loader_frommem(struct texture_hook_info *thinfo, const void *fdataptr, unsigned fdatalen);
+extern void run_texture_hooks_masked(struct texture_hook_info *thinfo, const unsigned char *hooks);
+
+// texture load statistics, see texstat.c
+#define TEXSTAT_MAXHOOKS 8 // hooks recorded per texture
+struct texstat_record {
+    char *name; // "cpkname|texpath"
+    int width;
+    int height;
+    unsigned bytes;
+    unsigned open_us, decode_us, hook_us, upload_us;
+    int nr_hooks;
+    struct {
+        int hookid;
+        unsigned us;
+    } hooks[TEXSTAT_MAXHOOKS];
+};
+extern int texstat_enabled;
+extern struct texstat_record texstat_cur;
+extern void init_texture_stat(void);
+extern LONGLONG texstat_now(void);
+extern unsigned texstat_us(LONGLONG from, LONGLONG to);
+extern void texstat_begin(void);
+extern void texstat_stage(unsigned *stage_us);
+extern void texstat_hook(int hookid, LONGLONG begin);
+extern int texstat_end(struct texture_hook_info *thinfo, struct gbTexture *this);
+extern void texstat_addasync(int idx, unsigned decode_us, unsigned upload_us);
+extern void get_texture_stat_text(char *buf, int size);
+
+// gbTexture lifetime tracking, see texlife.c
+extern int texlife_watch(struct gbTexture *tex);
+extern void add_texlife_hook(void (*func)(struct gbTexture *tex));
+
+// mipmap generation, see texmip.c
+#define TEXMIP_MAXLEVELS 15 // excluding level 0
+struct texmip_chain {
+    int levels; // excluding level 0
+    int width[TEXMIP_MAXLEVELS];
+    int height[TEXMIP_MAXLEVELS];
+    unsigned *bits[TEXMIP_MAXLEVELS]; // A8R8G8B8, allocated with malloc()
+};
+extern int texmip_filter;
+extern struct texmip_chain texmip_cur; // chain waiting to be applied in texhook_part5
+extern unsigned texmip_applied;
+extern void init_texture_mipmap(void);
+extern void texmip_free(struct texmip_chain *chain);
+extern int texmip_wanted(struct texture_hook_info *thinfo);
+extern void texmip_box(unsigned *dst, const unsigned *src, int w, int h, int nw, int nh);
+extern void texmip_generate(struct texmip_chain *chain, const struct texture_hook_info *thinfo);
+extern int texmip_load(IDirect3DTexture9 *tex, const struct texmip_chain *chain);
+extern void texmip_apply(struct gbTexture *this, const struct texmip_chain *chain);
+
+// texture compression, see texdxt.c
+struct texdxt_data {
+    int dxt5;
+    int levels; // including level 0, zero if not compressed
+    int width[TEXMIP_MAXLEVELS + 1];
+    int height[TEXMIP_MAXLEVELS + 1];
+    void *blocks[TEXMIP_MAXLEVELS + 1]; // allocated with malloc()
+};
+extern struct texdxt_data texdxt_cur; // data waiting to be applied in texhook_part5
+extern int texdxt_curlevels; // nLevels of current gbTexture
+extern unsigned texdxt_applied;
+extern void init_texture_compress(void);
+extern void texdxt_free(struct texdxt_data *data);
+extern int texdxt_pathok(const char *texpath);
+extern int texdxt_wanted(struct texture_hook_info *thinfo);
+extern void texdxt_generate(struct texdxt_data *data, const struct texture_hook_info *thinfo, const struct texmip_chain *chain, int levels, int split);
+extern IDirect3DTexture9 *texdxt_create(const struct texdxt_data *data);
+extern void texdxt_placeholder(struct texture_hook_info *thinfo);
+extern void texdxt_apply(struct gbTexture *this, const struct texdxt_data *data);
+
+// texture deduplication, see texdedup.c
+extern int texdedup_enabled;
+extern int texdedup_curvalid;
+extern void init_texture_dedup(void);
+extern unsigned texdedup_strhash(const char *s);
+extern void texdedup_compute(struct texture_hook_info *thinfo);
+extern void texdedup_apply(struct gbTexture *this);
+
+// persistent texture cache, see texcache.c
+extern int texcache_enabled;
+extern unsigned char texcache_curkey[20];
+extern int texcache_curvalid;
+extern int texcache_hit;
+extern void init_texture_cache(void);
+extern void texcache_write(const unsigned char *key, const struct texture_hook_info *thinfo, const struct texmip_chain *chain, const struct texdxt_data *dxt);
+extern int texcache_lookup(struct texture_hook_info *thinfo, const unsigned char *hooks, const unsigned *vers);
+
+// asynchronous texture loading, see texasync.c
+extern int texasync_enabled;
+extern struct texasync_job *texasync_curjob; // job waiting to be bound in texhook_part5
+extern void init_texture_async(void);
+extern void texasync_freejob(struct texasync_job *job);
+extern int texasync_begin(struct gbTexture *this, struct texture_hook_info *thinfo, const unsigned char *hooks);
+extern void texasync_bind(struct gbTexture *this, int statidx);
+
+// patch-side image decoding, see texdecode.c
+extern int texdec_enabled;
+extern void init_texture_decode(void);
+extern void texdec_loader(struct texture_hook_info *thinfo);
+
 #endif
 #endif
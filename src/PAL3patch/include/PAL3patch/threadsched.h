@@ -0,0 +1,25 @@
+#ifndef PAL3PATCH_THREADSCHED_H
+#define PAL3PATCH_THREADSCHED_H
+// PATCHAPI DEFINITIONS
+
+// thread scheduling policy
+//   SCHED_GAME: threads game waits for every frame (main thread, d3d thread),
+//               MMCSS is only applied if hThread is GetCurrentThread()
+//   SCHED_WORKER: threads game may wait for (jobs, movie decoding),
+//                 priority is kept, but kept off the primary core
+//   SCHED_BACKGROUND: threads no one waits for (logging, prefetching),
+//                     runs at lower priority and kept off the primary core
+enum {
+    SCHED_GAME,
+    SCHED_WORKER,
+    SCHED_BACKGROUND,
+};
+extern PATCHAPI void sched_set_thread(HANDLE hThread, int sched_class);
+
+#ifdef PATCHAPI_EXPORTS
+// INTERNAL DEFINITIONS
+
+extern void init_threadsched(void);
+
+#endif
+#endif
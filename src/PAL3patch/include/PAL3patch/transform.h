@@ -19,6 +19,17 @@ typedef struct { // segment
     double length;
 } fSEG;
 
+typedef struct { // precompiled transform of one axis, see compile_transform()
+    double lo_lo, lo_hi; // new_low = lo_lo * low + lo_hi * high + offset
+    double hi_lo, hi_hi; // new_high = hi_lo * low + hi_hi * high + offset
+    double offset;
+} fTRAXIS;
+
+typedef struct { // precompiled transform
+    fTRAXIS lr;
+    fTRAXIS tb;
+} fTRANSFORM;
+
 enum transform_method {
     TR_LOW,
     TR_HIGH,
@@ -62,6 +73,11 @@ extern PATCHAPI void transform_fseg(fSEG *out_fseg, const fSEG *fseg, double tot
 extern PATCHAPI void transform_frect(fRECT *out_frect, const fRECT *frect, const fRECT *src_frect, const fRECT *dst_frect, int lr_method, int tb_method, double len_factor);
 extern PATCHAPI void transform_fpoint(fPOINT *out_fpoint, const fPOINT *fpoint, const fRECT *src_frect, const fRECT *dst_frect, int lr_method, int tb_method, double len_factor);
 
+// batch transform functions, compile once, then transform arrays
+extern PATCHAPI void compile_transform(fTRANSFORM *tr, const fRECT *src_frect, const fRECT *dst_frect, int lr_method, int tb_method, double len_factor);
+extern PATCHAPI void transform_frect_batch(fRECT *out_frect, const fRECT *frect, int count, const fTRANSFORM *tr);
+extern PATCHAPI void transform_fpoint_batch(fPOINT *out_fpoint, const fPOINT *fpoint, int count, const fTRANSFORM *tr);
+
 
 #ifdef PATCHAPI_EXPORTS
 // INTERNAL DEFINITIONS
@@ -0,0 +1,29 @@
+#ifndef PAL3PATCH_VFSREAD_H
+#define PAL3PATCH_VFSREAD_H
+// PATCHAPI DEFINITIONS
+
+// thread-safe CPK reader
+//   entries are resolved from CPK table once at open time, and read with
+//   positional overlapped I/O on a handle shared by all readers of a CPK file,
+//   so reads never touch engine's file pointer or its CPK file slots
+//   vfsread_open() and vfsread_open_entry() read CPK table, call them on main thread
+//   vfsread_open_range() may be called on any thread
+//   a reader may be used by one thread at a time, use one reader per thread
+//   only uncompressed entries can be opened
+struct vfsread_file;
+extern PATCHAPI struct vfsread_file *vfsread_open(struct CPK *cpk, const char *relpath);
+extern PATCHAPI struct vfsread_file *vfsread_open_entry(struct CPK *cpk, int tblidx);
+extern PATCHAPI struct vfsread_file *vfsread_open_range(const char *cpkfile, unsigned offset, unsigned size);
+extern PATCHAPI unsigned vfsread_size(struct vfsread_file *fp);
+extern PATCHAPI int vfsread_read(struct vfsread_file *fp, void *buf, unsigned offset, unsigned size);
+extern PATCHAPI void vfsread_close(struct vfsread_file *fp);
+extern PATCHAPI int vfsread_findcrc(struct CPK *cpk, unsigned crc);
+
+#ifdef PATCHAPI_EXPORTS
+// INTERNAL DEFINITIONS
+
+extern void init_vfsread(void);
+
+#endif
+
+#endif
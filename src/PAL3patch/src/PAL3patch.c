@@ -68,6 +68,8 @@ fail:
 // init_stage1() should be called before unpacker is executed (if exists)
 static void init_stage1()
 {
+    startup_begin("init_stage1");
+    
     // do self-check
     self_check();
     
@@ -81,16 +83,25 @@ static void init_stage1()
     acquire_game_mutex();
     
     // read config
+    startup_begin("read_config_file");
     read_config_file();
+    startup_end();
 
     // init early patchsets in stage1
     INIT_PATCHSET(depcompatible);
     INIT_PATCHSET(dpiawareness);
+    
+    startup_end();
 }
 
 // init_stage2() should be called after EXE is unpacked
 static void init_stage2()
 {
+    startup_begin("init_stage2");
+    
+    // save unpacked image, must before anything is patched
+    if (unpackcache_pending) unpackcache_save();
+    
     // fix unpacker bug that would crash game when music is disabled in config.ini
     fix_unpacker_bug();
     
@@ -100,13 +111,46 @@ static void init_stage2()
     // init memory allocators
     init_memory_allocators();
     
+    // init pixel conversion kernels
+    init_pixel_kernels();
+    
+    // init directory index
+    init_dirindex();
+    
     // init hook framework
+    startup_begin("init_hooks");
+    begin_patch_transaction();
     init_hooks();
     init_effect_hooks();
     init_texture_hooks();
+    commit_patch_transaction();
+    startup_end();
+    
+    // init memory arenas, must after hook framework
+    init_memory_arenas();
+    
+    // set thread scheduling policy, must before any worker thread is created
+    init_threadsched();
+    
+    // start asynchronous log writer, must after hook framework
+    init_logger();
+    
+    // start job system, must after hook framework
+    init_jobsys();
+    
+    // init thread-safe CPK reader, must after hook framework
+    init_vfsread();
+    
+    // init performance counters, must after hook framework
+    init_perfcounter();
+    
+    // init WAL digest cache
+    init_wal();
     
     // init freetype
+    startup_begin("init_ftfont");
     init_ftfont();
+    startup_end();
     
     // init_locale() must called after INIT_PATCHSET(setlocale)
     INIT_PATCHSET(setlocale);
@@ -120,6 +164,8 @@ static void init_stage2()
     INIT_PATCHSET(terminateatexit);
     INIT_PATCHSET(timerresolution);
     INIT_PATCHSET(fixmemfree);
+    INIT_PATCHSET(lfhheap);
+    INIT_PATCHSET(addrspace);
     INIT_PATCHSET(nocpk);
     INIT_PATCHSET(console);
     INIT_PATCHSET(relativetimer);
@@ -129,7 +175,9 @@ static void init_stage2()
     INIT_PATCHSET(fixhockshopbuy);
     INIT_PATCHSET(kfspeed);
     INIT_PATCHSET(fixacquire);
+    INIT_PATCHSET(fastcrc32);
     INIT_PATCHSET(preciseresmgr);
+    INIT_PATCHSET(cpklzo);
     INIT_PATCHSET(audiofreq);
     INIT_PATCHSET(showfps);
     INIT_PATCHSET(reduceinputlatency); // should after INIT_PATCHSET(showfps)
@@ -138,7 +186,22 @@ static void init_stage2()
     INIT_PATCHSET(improvearchive);
     INIT_PATCHSET(fixloading);
     INIT_PATCHSET(nommapcpk);
+    INIT_PATCHSET(cpktrace); // should after INIT_PATCHSET(nommapcpk)
+    INIT_PATCHSET(cpktblcache);
+    INIT_PATCHSET(cpkprefetch); // should after INIT_PATCHSET(fixloading)
+    INIT_PATCHSET(audioprefetch); // should after INIT_PATCHSET(cpktrace)
+    INIT_PATCHSET(movieprefetch);
+    INIT_PATCHSET(combatprefetch); // should after INIT_PATCHSET(cpktrace)
+    INIT_PATCHSET(sndcache); // should after INIT_PATCHSET(audioprefetch)
+    INIT_PATCHSET(modoverlay); // should after INIT_PATCHSET(sndcache) and INIT_PATCHSET(cpktblcache)
+    INIT_PATCHSET(cpkindex); // should after INIT_PATCHSET(cpktblcache) and INIT_PATCHSET(modoverlay)
     INIT_PATCHSET(fixnosndcrash);
+    INIT_PATCHSET(texbudget);
+    INIT_PATCHSET(heapstat);
+    INIT_PATCHSET(frametrace);
+    INIT_PATCHSET(telemetry);
+    INIT_PATCHSET(scenetrim); // should after INIT_PATCHSET(fixloading)
+    INIT_PATCHSET(gameprofile);
     
     if (INIT_PATCHSET(graphicspatch)) {
         // these are subpatchs of graphics patch
@@ -146,6 +209,11 @@ static void init_stage2()
         INIT_PATCHSET(fixortho);
         INIT_PATCHSET(nolockablebackbuffer);
         INIT_PATCHSET(fixreset);
+        INIT_PATCHSET(d3d9ex);
+        INIT_PATCHSET(d3dthread); // should after INIT_PATCHSET(d3d9ex)
+        INIT_PATCHSET(rawcursor);
+        INIT_PATCHSET(hwcursor);
+        INIT_PATCHSET(hiddenthrottle);
         if (INIT_PATCHSET(fixui)) { 
             // must called after INIT_PATCHSET(graphicspatch)
             // must called after INIT_PATCHSET(setlocale) because of D3DXCreateFont need charset information
@@ -164,18 +232,36 @@ static void init_stage2()
         }
         INIT_PATCHSET(fixeffect);
         INIT_PATCHSET(forcesettexture);
+        INIT_PATCHSET(filterd3dstate);
+        INIT_PATCHSET(occlusionstat);
+        INIT_PATCHSET(vramstat);
+        INIT_PATCHSET(dynvbring);
         INIT_PATCHSET(fixtrail);
         INIT_PATCHSET(screenshot);
     }
+    INIT_PATCHSET(smoothdelta); // should before INIT_PATCHSET(benchmark)
+    INIT_PATCHSET(benchmark); // should after INIT_PATCHSET(graphicspatch)
+    INIT_PATCHSET(microbench);
+    INIT_PATCHSET(hitchlog); // should after INIT_PATCHSET(cpktrace)
+    INIT_PATCHSET(loadtimes); // should after INIT_PATCHSET(hitchlog)
+    INIT_PATCHSET(chrometrace); // should after INIT_PATCHSET(nommapcpk)
+    INIT_PATCHSET(configreload);
     
     // load external plugins
+    startup_begin("init_plugins");
     init_plugins();
+    startup_end();
     
     // show_about() must called after init_locale()
     show_about();
     
     // check incompatible tools
     check_badtools();
+    
+    startup_end();
+    
+    // write startup timeline to log
+    startup_report();
 }
 
 
@@ -235,10 +321,22 @@ fail:
     return 0;
 }
 
+// called by cached_unpacker_entry(), instead of unpacker
+void cached_unpacker_init()
+{
+    init_stage2();
+}
+
 unsigned sforce_unpacker_init()
 {
     init_stage1();
     
+    // skip unpacker if unpacked image can be restored from cache
+    if (get_int_from_configfile("unpackcache")) {
+        if (unpackcache_load()) return (unsigned) cached_unpacker_entry;
+        unpackcache_pending = 1;
+    }
+    
     // our DLL is loaded as fake unpacker
     // we should load the real unpacker, patch it, and execute it
     HMODULE unpacker = LoadLibrary(EXTERNAL_UNPACKER);
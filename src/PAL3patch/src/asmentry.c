@@ -39,3 +39,34 @@ __declspec(naked) void __stdcall asmentry(unsigned patch_id)
         RET
     }
 }
+
+// lite entry, same trapframe layout, but FPU state is not saved
+// and patch_proc is called directly without stack check
+__declspec(naked) void __stdcall asmentry_lite(unsigned patch_id)
+{
+    __asm {
+        PUSHFD
+        SUB ESP, X
+        PUSH DWORD PTR [ESP + Y]
+        PUSH DWORD PTR [ESP + Y]
+        PUSH DWORD PTR [ESP + Y]
+        PUSHAD
+        ADD DWORD PTR [ESP + 0xC], Z
+        SUB ESP, 0x6C
+        PUSH ESP
+        CALL DWORD PTR [ESP + 0x98]
+        ADD ESP, 0x4
+        ADD ESP, 0x6C
+        MOV ECX, DWORD PTR [ESP + 0xC]
+        MOV EAX, DWORD PTR [ESP + 0x24]
+        MOV EDX, DWORD PTR [ESP + 0x20]
+        SUB ECX, 0x8
+        MOV DWORD PTR [ECX + 0x4], EAX
+        MOV DWORD PTR [ECX], EDX
+        MOV DWORD PTR [ESP + 0x20], ECX
+        POPAD
+        POP ESP
+        POPFD
+        RET
+    }
+}
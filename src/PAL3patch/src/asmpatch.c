@@ -3,7 +3,9 @@
 void patchentry(struct trapframe *tf)
 {
     unsigned old_esp = tf->esp;
+    CHROMETRACE_BEGIN("asmpatch", TOUINT(tf->patch_proc));
     tf->patch_proc(tf);
+    CHROMETRACE_END();
     unsigned new_esp = tf->esp;
     if (new_esp < old_esp && old_esp - new_esp > max_push_dwords * 4) {
         fail("too many stack memory allocated.");
@@ -12,22 +14,66 @@ void patchentry(struct trapframe *tf)
 
 
 
-void make_asmpatch_proc_call(unsigned addr, patch_proc_t patch_proc, unsigned size)
+// thunks are shared by patches with same patch_proc,
+// so re-applying patches (e.g. after plugin reload) doesn't consume more dyncode
+struct asmpatch_thunk {
+    patch_proc_t patch_proc;
+    void *entry;
+    unsigned char *dyncode;
+};
+static struct bvec asmpatch_thunks;
+static int asmpatch_thunks_init = 0;
+
+static unsigned char *get_asmpatch_thunk(patch_proc_t patch_proc, void *entry)
 {
-    if (size < 5) fail("size is too small.");
+    struct asmpatch_thunk *p;
+    if (!asmpatch_thunks_init) {
+        bvec_ctor(&asmpatch_thunks);
+        asmpatch_thunks_init = 1;
+    }
+    for (p = bvec_tbegin(&asmpatch_thunks, struct asmpatch_thunk); p != bvec_tend(&asmpatch_thunks, struct asmpatch_thunk); p++) {
+        if (p->patch_proc == patch_proc && p->entry == entry) return p->dyncode;
+    }
     
     unsigned jmpimm;
     unsigned char *dyncode = alloc_dyncode_buffer(16);
     memcpy(dyncode, "\xFF\x34\xE4\xC7\x44\xE4\x04", 7);
     memcpy(dyncode + 7, &patch_proc, 4); // PUSH patch_id
-    jmpimm = TOUINT(asmentry) - (TOUINT(dyncode) + 16);
-    dyncode[11] = 0xE9; memcpy(dyncode + 12, &jmpimm, 4); // JMP asmentry
+    jmpimm = TOUINT(entry) - (TOUINT(dyncode) + 16);
+    dyncode[11] = 0xE9; memcpy(dyncode + 12, &jmpimm, 4); // JMP entry
     flush_instruction_cache(dyncode, 16);
     
-    unsigned char *buf = malloc(size);
+    struct asmpatch_thunk newthunk = { patch_proc, entry, dyncode };
+    bvec_tpushback(&asmpatch_thunks, &newthunk, struct asmpatch_thunk);
+    return dyncode;
+}
+
+static void make_asmpatch_call(unsigned addr, patch_proc_t patch_proc, void *entry, unsigned size)
+{
+    if (size < 5) fail("size is too small.");
+    
+    unsigned jmpimm;
+    unsigned char *dyncode = get_asmpatch_thunk(patch_proc, entry);
+    
+    unsigned char smallbuf[16];
+    unsigned char *buf = size <= sizeof(smallbuf) ? smallbuf : malloc(size);
     memset(buf + 5, 0x90, size - 5);
     jmpimm = TOUINT(dyncode) - (addr + 5);
     buf[0] = 0xE8; memcpy(buf + 1, &jmpimm, 4);
     memcpy_to_process(addr, buf, size);
-    free(buf);
+    if (buf != smallbuf) free(buf);
+}
+
+void make_asmpatch_proc_call(unsigned addr, patch_proc_t patch_proc, unsigned size)
+{
+    make_asmpatch_call(addr, patch_proc, asmentry, size);
+}
+
+void make_asmpatch_lite_proc_call(unsigned addr, patch_proc_t patch_proc, unsigned size)
+{
+#ifdef ASMPATCH_LITE_DEBUG
+    make_asmpatch_call(addr, patch_proc, asmentry, size);
+#else
+    make_asmpatch_call(addr, patch_proc, asmentry_lite, size);
+#endif
 }
@@ -192,6 +192,174 @@ void bvec_bpop(struct bvec *v, size_t size)
 
 
 
+// small-buffer byte vector
+
+static int sbvec_isinline(const struct sbvec *v)
+{
+    return v->v.begin == v->buf;
+}
+void sbvec_ctor(struct sbvec *v)
+{
+    v->v.begin = v->v.end = v->buf;
+    v->v.capacity = PTRADD(v->buf, SBVEC_INLINE_SIZE);
+#ifdef BVEC_DEBUG
+    memset(v->buf, BVEC_FILLBYTE, SBVEC_INLINE_SIZE);
+#endif
+}
+void sbvec_bctor(struct sbvec *v, const void *data, size_t size)
+{
+    sbvec_ctor(v);
+    sbvec_bpush(v, data, size);
+}
+void sbvec_cctor(struct sbvec *v, const struct sbvec *src)
+{
+    sbvec_ctor(v);
+    sbvec_cpush(v, src);
+}
+void sbvec_dtor(struct sbvec *v)
+{
+    if (!sbvec_isinline(v)) free(v->v.begin);
+#ifdef BVEC_DEBUG
+    memset(v, BVEC_FILLBYTE, sizeof(struct sbvec));
+#endif
+}
+void *sbvec_mdtor(struct sbvec *v)
+{
+    // inline data must be copied out, since the struct itself will go away
+    if (!sbvec_isinline(v)) return v->v.begin;
+    size_t size = sbvec_bsize(v);
+    void *buffer = malloc(size ? size : 1);
+    bvec_assert(buffer, "out of memory");
+    memcpy(buffer, v->buf, size);
+    return buffer;
+}
+void sbvec_clear(struct sbvec *v)
+{
+    bvec_clear(&v->v);
+}
+void sbvec_fclear(struct sbvec *v)
+{
+    sbvec_dtor(v);
+    sbvec_ctor(v);
+}
+void sbvec_copy(struct sbvec *dst, const struct sbvec *src)
+{
+    if (dst != src) {
+        sbvec_clear(dst);
+        sbvec_cpush(dst, src);
+    }
+}
+void sbvec_move(struct sbvec *dst, struct sbvec *src)
+{
+    // heap buffer can be stolen, inline data must be copied
+    if (dst != src) {
+        if (sbvec_isinline(src)) {
+            sbvec_clear(dst);
+            sbvec_cpush(dst, src);
+        } else {
+            sbvec_dtor(dst);
+            dst->v = src->v;
+        }
+        sbvec_ctor(src);
+    }
+}
+void sbvec_swap(struct sbvec *a, struct sbvec *b)
+{
+    if (a != b) {
+        struct sbvec t;
+        sbvec_ctor(&t);
+        sbvec_move(&t, a);
+        sbvec_move(a, b);
+        sbvec_move(b, &t);
+        sbvec_dtor(&t);
+    }
+}
+static void sbvec_brealloc(struct sbvec *v, size_t capacity)
+{
+    // same as bvec_brealloc, but data is moved back to inline buffer if fits
+    // internal use only
+    size_t size = sbvec_bsize(v);
+    bvec_dbgassert(capacity >= size);
+    void *buffer;
+    if (capacity <= SBVEC_INLINE_SIZE) {
+        if (sbvec_isinline(v)) return;
+        buffer = v->v.begin;
+        memcpy(v->buf, buffer, size);
+        free(buffer);
+        buffer = v->buf;
+        capacity = SBVEC_INLINE_SIZE;
+    } else if (sbvec_isinline(v)) {
+        buffer = malloc(capacity);
+        bvec_assert(buffer, "out of memory");
+        memcpy(buffer, v->buf, size);
+    } else {
+        buffer = realloc(v->v.begin, capacity);
+        bvec_assert(buffer, "out of memory");
+    }
+#ifdef BVEC_DEBUG
+    bvec_dbgmemset(PTRADD(buffer, size), BVEC_FILLBYTE, capacity - size);
+#endif
+    v->v.begin = buffer;
+    v->v.end = PTRADD(v->v.begin, size);
+    v->v.capacity = PTRADD(v->v.begin, capacity);
+}
+void sbvec_shrink(struct sbvec *v)
+{
+    size_t size = sbvec_bsize(v);
+    size_t capacity = sbvec_bcapacity(v);
+    while (capacity > SBVEC_INLINE_SIZE && capacity / 2 >= size) capacity /= 2;
+    sbvec_brealloc(v, capacity);
+}
+void sbvec_breserve(struct sbvec *v, size_t size)
+{
+    // capacity is never zero, since inline buffer is always there
+    size_t old_capacity = sbvec_bcapacity(v);
+    
+    size_t new_capacity = old_capacity;
+    while (new_capacity < size) {
+        bvec_assert(new_capacity * 2 > new_capacity, "integer overflow");
+        new_capacity *= 2;
+    }
+    
+    if (new_capacity > old_capacity) {
+        sbvec_brealloc(v, new_capacity);
+    }
+}
+void sbvec_bresize(struct sbvec *v, size_t size)
+{
+    size_t old_size = sbvec_bsize(v);
+    if (size > old_size) {
+        sbvec_breserve(v, size);
+    }
+    v->v.end = PTRADD(v->v.begin, size);
+}
+void sbvec_bpush(struct sbvec *v, const void *data, size_t size)
+{
+    if (size) {
+        size_t old_size = sbvec_bsize(v);
+        size_t new_size = old_size + size;
+        bvec_assert(new_size > old_size, "interger overflow");
+        sbvec_bresize(v, new_size);
+        memcpy(PTRADD(v->v.begin, old_size), data, size);
+    }
+}
+void sbvec_cpush(struct sbvec *dst, const struct sbvec *src)
+{
+    bvec_dbgassert(dst != src);
+    sbvec_bpush(dst, sbvec_bdata(src), sbvec_bsize(src));
+}
+void sbvec_bpop(struct sbvec *v, size_t size)
+{
+    if (size) {
+        size_t old_size = sbvec_bsize(v);
+        size_t new_size = old_size - size;
+        bvec_assert(new_size < old_size, "interger underflow");
+        sbvec_bresize(v, new_size);
+    }
+}
+
+
+
 
 
 // high-level interface (value)
@@ -222,34 +390,34 @@ void bvec_push_ptr(struct bvec *v, void *val)
 
 // string template
 
-#define BVEC_STRING_IMPL(clsname, tchar, tname, printf) \
+#define BVEC_STRING_IMPL(clsname, tchar, tname, printf, vec, fmtbuf) \
 \
 void CONCAT3(clsname, _, ctor)(struct clsname *s) \
 { \
     tchar t = 0; \
-    bvec_tctor(&s->v, &t, 1, tchar); \
+    CONCAT(vec, _tctor)(&s->v, &t, 1, tchar); \
 } \
 void CONCAT3(clsname, _, cctor)(struct clsname *s, const struct clsname *src) \
 { \
-    bvec_cctor(&s->v, &src->v); \
+    CONCAT(vec, _cctor)(&s->v, &src->v); \
 } \
 void CONCAT3(clsname, _, sctor)(struct clsname *s, const tchar *str) \
 { \
-    bvec_tctor(&s->v, str, CONCAT(tname, len)(str) + 1, tchar); \
+    CONCAT(vec, _tctor)(&s->v, str, CONCAT(tname, len)(str) + 1, tchar); \
 } \
 void CONCAT3(clsname, _, dtor)(struct clsname *s) \
 { \
-    bvec_dtor(&s->v); \
+    CONCAT(vec, _dtor)(&s->v); \
 } \
 tchar *CONCAT3(clsname, _, mdtor)(struct clsname *s) \
 { \
-    return bvec_mdtor(&s->v); \
+    return CONCAT(vec, _mdtor)(&s->v); \
 } \
 void CONCAT3(clsname, _, clear)(struct clsname *s) \
 { \
     tchar t = 0; \
-    bvec_clear(&s->v); \
-    bvec_tpush(&s->v, &t, 1, tchar); \
+    CONCAT(vec, _clear)(&s->v); \
+    CONCAT(vec, _tpush)(&s->v, &t, 1, tchar); \
 } \
 void CONCAT3(clsname, _, fclear)(struct clsname *s) \
 { \
@@ -259,38 +427,38 @@ void CONCAT3(clsname, _, fclear)(struct clsname *s) \
 void CONCAT3(clsname, _, copy)(struct clsname *dst, const struct clsname *src) \
 { \
     if (dst != src) { \
-        bvec_copy(&dst->v, &src->v); \
+        CONCAT(vec, _copy)(&dst->v, &src->v); \
     } \
 } \
 void CONCAT3(clsname, _, move)(struct clsname *dst, struct clsname *src) \
 { \
     if (dst != src) { \
         tchar t = 0; \
-        bvec_move(&dst->v, &src->v); \
-        bvec_tpush(&src->v, &t, 1, tchar); \
+        CONCAT(vec, _move)(&dst->v, &src->v); \
+        CONCAT(vec, _tpush)(&src->v, &t, 1, tchar); \
     } \
 } \
 void CONCAT3(clsname, _, swap)(struct clsname *a, struct clsname *b) \
 { \
     if (a != b) { \
-        bvec_swap(&a->v, &b->v); \
+        CONCAT(vec, _swap)(&a->v, &b->v); \
     } \
 } \
 const tchar *CONCAT4(clsname, _, get, tname)(const struct clsname *s) \
 { \
-    return bvec_tdata(&s->v, tchar); \
+    return CONCAT(vec, _tdata)(&s->v, tchar); \
 } \
 tchar *CONCAT3(clsname, _, data)(const struct clsname *s) \
 { \
-    return bvec_tdata(&s->v, tchar); \
+    return CONCAT(vec, _tdata)(&s->v, tchar); \
 } \
 tchar *CONCAT3(clsname, _, begin)(const struct clsname *s) \
 { \
-    return bvec_tbegin(&s->v, tchar); \
+    return CONCAT(vec, _tbegin)(&s->v, tchar); \
 } \
 tchar *CONCAT3(clsname, _, end)(const struct clsname *s) \
 { \
-    return bvec_tend(&s->v, tchar) - 1; \
+    return CONCAT(vec, _tend)(&s->v, tchar) - 1; \
 } \
 int CONCAT3(clsname, _, empty)(const struct clsname *s) \
 { \
@@ -298,11 +466,11 @@ int CONCAT3(clsname, _, empty)(const struct clsname *s) \
 } \
 size_t CONCAT3(clsname, _, size)(const struct clsname *s) \
 { \
-    return bvec_tsize(&s->v, tchar) - 1; \
+    return CONCAT(vec, _tsize)(&s->v, tchar) - 1; \
 } \
 void CONCAT3(clsname, _, shrink)(struct clsname *s) \
 { \
-    bvec_shrink(&s->v); \
+    CONCAT(vec, _shrink)(&s->v); \
 } \
 size_t CONCAT4(clsname, _, tname, len)(const struct clsname *s) \
 { \
@@ -310,13 +478,13 @@ size_t CONCAT4(clsname, _, tname, len)(const struct clsname *s) \
 } \
 void CONCAT4(clsname, _, tname, cpy)(struct clsname *s, const tchar *str) \
 { \
-    bvec_clear(&s->v); \
-    bvec_tpush(&s->v, str, CONCAT(tname, len)(str) + 1, tchar); \
+    CONCAT(vec, _clear)(&s->v); \
+    CONCAT(vec, _tpush)(&s->v, str, CONCAT(tname, len)(str) + 1, tchar); \
 } \
 void CONCAT4(clsname, _, tname, cat)(struct clsname *s, const tchar *str) \
 { \
-    bvec_tpopback(&s->v, tchar); \
-    bvec_tpush(&s->v, str, CONCAT(tname, len)(str) + 1, tchar); \
+    CONCAT(vec, _tpopback)(&s->v, tchar); \
+    CONCAT(vec, _tpush)(&s->v, str, CONCAT(tname, len)(str) + 1, tchar); \
 } \
 void CONCAT4(clsname, _, tname, ncat)(struct clsname *s, const tchar *str, size_t n) \
 { \
@@ -330,9 +498,9 @@ void CONCAT3(clsname, _, push)(struct clsname *s, const tchar *str, size_t n) \
 { \
     if (n) { \
         tchar t = 0; \
-        bvec_tpopback(&s->v, tchar); \
-        bvec_tpush(&s->v, str, n, tchar); \
-        bvec_tpush(&s->v, &t, 1, tchar); \
+        CONCAT(vec, _tpopback)(&s->v, tchar); \
+        CONCAT(vec, _tpush)(&s->v, str, n, tchar); \
+        CONCAT(vec, _tpush)(&s->v, &t, 1, tchar); \
     } \
 } \
 void CONCAT3(clsname, _, pop)(struct clsname *s, size_t n) \
@@ -351,19 +519,19 @@ void CONCAT3(clsname, _, cpush)(struct clsname *dst, const struct clsname *src)
 void CONCAT3(clsname, _, trunc)(struct clsname *s, size_t n) \
 { \
     tchar t = 0; \
-    bvec_tresize(&s->v, n, tchar); \
-    bvec_tpush(&s->v, &t, 1, tchar); \
+    CONCAT(vec, _tresize)(&s->v, n, tchar); \
+    CONCAT(vec, _tpush)(&s->v, &t, 1, tchar); \
 } \
 void CONCAT3(clsname, _, pushback)(struct clsname *s, tchar c) \
 { \
     tchar t = 0; \
     *CONCAT3(clsname, _, end)(s) = c; \
-    bvec_tpush(&s->v, &t, 1, tchar); \
+    CONCAT(vec, _tpush)(&s->v, &t, 1, tchar); \
 } \
 void CONCAT3(clsname, _, popback)(struct clsname *s) \
 { \
     CONCAT3(clsname, _, end)(s)[-1] = 0; \
-    bvec_tpopback(&s->v, tchar); \
+    CONCAT(vec, _tpopback)(&s->v, tchar); \
 } \
 tchar *CONCAT3(clsname, _, getbuffer)(struct clsname *s, size_t size) \
 { \
@@ -377,12 +545,12 @@ tchar *CONCAT3(clsname, _, getbuffer)(struct clsname *s, size_t size) \
     /*   dtor()                           */ \
     /* after calling this function        */ \
      \
-    if (size) bvec_tresize(&s->v, size, tchar); \
-    return bvec_tdata(&s->v, tchar); \
+    if (size) CONCAT(vec, _tresize)(&s->v, size, tchar); \
+    return CONCAT(vec, _tdata)(&s->v, tchar); \
 } \
 void CONCAT3(clsname, _, commitbuffer)(struct clsname *s) \
 { \
-    bvec_tresize(&s->v, CONCAT(tname, len)(CONCAT3(clsname, _, data)(s)) + 1, tchar); \
+    CONCAT(vec, _tresize)(&s->v, CONCAT(tname, len)(CONCAT3(clsname, _, data)(s)) + 1, tchar); \
 } \
 void CONCAT3(clsname, _, discardbuffer)(struct clsname *s) \
 { \
@@ -391,7 +559,7 @@ void CONCAT3(clsname, _, discardbuffer)(struct clsname *s) \
 int CONCAT3(clsname, _, vformat)(struct clsname *s, const tchar *fmt, va_list ap) \
 { \
     int ret; \
-    size_t size = BVEC_STRING_DEFAULT_FORMATBUFFER; \
+    size_t size = (fmtbuf); \
      \
     while (1) { \
         tchar *buf = CONCAT3(clsname, _, getbuffer)(s, size); \
@@ -422,31 +590,66 @@ int CONCAT3(clsname, _, format)(struct clsname *s, const tchar *fmt, ...) \
 } \
 // TEMPLATE END
 
-BVEC_STRING_IMPL(wstr, wchar_t, wcs, wprintf)
-BVEC_STRING_IMPL(cstr, char, str, printf)
+BVEC_STRING_IMPL(wstr, wchar_t, wcs, wprintf, bvec, BVEC_STRING_DEFAULT_FORMATBUFFER)
+BVEC_STRING_IMPL(cstr, char, str, printf, bvec, BVEC_STRING_DEFAULT_FORMATBUFFER)
+BVEC_STRING_IMPL(swstr, wchar_t, wcs, wprintf, sbvec, SBVEC_STRING_DEFAULT_FORMATBUFFER(wchar_t))
+BVEC_STRING_IMPL(scstr, char, str, printf, sbvec, SBVEC_STRING_DEFAULT_FORMATBUFFER(char))
 
 
 // wstr wrapper
+//   plain system codepages are converted into string buffer directly,
+//   UTF-8 and CJK table conversions go through *_alloc() helpers
 
 
-void wstr_cs2wcs(struct wstr *s, const char *cstr, UINT src_cp)
-{
-    wchar_t *t = cs2wcs_alloc(cstr, src_cp);
-    wstr_wcscpy(s, t);
-    free(t);
-}
-void cstr_wcs2cs(struct cstr *s, const wchar_t *wstr, UINT dst_cp)
-{
-    char *t = wcs2cs_alloc(wstr, dst_cp);
-    cstr_strcpy(s, t);
-    free(t);
-}
-void cstr_cs2cs(struct cstr *s, const char *cstr, UINT src_cp, UINT dst_cp)
-{
-    char *t = cs2cs_alloc(cstr, src_cp, dst_cp);
-    cstr_strcpy(s, t);
-    free(t);
-} 
+#define BVEC_STRING_CONV_IMPL(wclsname, cclsname) \
+\
+void CONCAT3(wclsname, _, cs2wcs)(struct wclsname *s, const char *cstr, UINT src_cp) \
+{ \
+    if (src_cp != CP_UTF8 && !cjktable_get(src_cp)) { \
+        int len = MultiByteToWideChar(src_cp, 0, cstr, -1, NULL, 0); \
+        if (len > 0) { \
+            wchar_t *buf = CONCAT3(wclsname, _, getbuffer)(s, len); \
+            if (MultiByteToWideChar(src_cp, 0, cstr, -1, buf, len) == len) { \
+                CONCAT3(wclsname, _, commitbuffer)(s); \
+                return; \
+            } \
+            CONCAT3(wclsname, _, discardbuffer)(s); \
+        } \
+    } \
+    wchar_t *t = cs2wcs_alloc(cstr, src_cp); \
+    CONCAT3(wclsname, _, wcscpy)(s, t); \
+    free(t); \
+} \
+void CONCAT3(cclsname, _, wcs2cs)(struct cclsname *s, const wchar_t *wstr, UINT dst_cp) \
+{ \
+    if (dst_cp != CP_UTF8) { \
+        int len = WideCharToMultiByte(dst_cp, 0, wstr, -1, NULL, 0, NULL, NULL); \
+        if (len > 0) { \
+            char *buf = CONCAT3(cclsname, _, getbuffer)(s, len); \
+            if (WideCharToMultiByte(dst_cp, 0, wstr, -1, buf, len, NULL, NULL) == len) { \
+                CONCAT3(cclsname, _, commitbuffer)(s); \
+                return; \
+            } \
+            CONCAT3(cclsname, _, discardbuffer)(s); \
+        } \
+    } \
+    char *t = wcs2cs_alloc(wstr, dst_cp); \
+    CONCAT3(cclsname, _, strcpy)(s, t); \
+    free(t); \
+} \
+void CONCAT3(cclsname, _, cs2cs)(struct cclsname *s, const char *cstr, UINT src_cp, UINT dst_cp) \
+{ \
+    /* intermediate string is short-lived, keep it off heap if possible */ \
+    struct swstr t; \
+    swstr_ctor(&t); \
+    swstr_cs2wcs(&t, cstr, src_cp); \
+    CONCAT3(cclsname, _, wcs2cs)(s, swstr_getwcs(&t), dst_cp); \
+    swstr_dtor(&t); \
+} \
+// TEMPLATE END
+
+BVEC_STRING_CONV_IMPL(wstr, cstr)
+BVEC_STRING_CONV_IMPL(swstr, scstr)
 
 
 
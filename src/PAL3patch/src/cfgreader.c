@@ -1,105 +1,287 @@
 #include "common.h"
 
-struct config_line {
-    char *key, *val;
-};
-
-static struct config_line cfgdata[MAX_CONFIG_LINES];
+static struct config_value *cfgdata;
 static int cfglines;
+static char *cfgbuf; // file data, keys and values of cfgdata point into it
+static char **cfgowned; // values replaced by reload, allocated for each value, NULL if still in cfgbuf
+static struct bvec cfgretired; // char *, values replaced again, kept since users may still hold them
 static int cfg_loaded = 0;
 
-static int config_line_cmp(const void *a, const void *b)
+// hash index of cfgdata, keys are case-insensitive, -1 means empty
+static int *cfghash;
+static unsigned cfghash_mask;
+
+static int config_value_cmp(const void *a, const void *b)
 {
-    const struct config_line *pa = a, *pb = b;
+    const struct config_value *pa = a, *pb = b;
     return stricmp(pa->key, pb->key);
 }
 
+static unsigned config_key_hash(const char *key)
+{
+    // FNV-1a of lower case key
+    unsigned h = 2166136261u;
+    for (; *key; key++) {
+        unsigned char ch = *key;
+        if ('A' <= ch && ch <= 'Z') ch += 'a' - 'A';
+        h ^= ch;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void build_config_hash()
+{
+    unsigned size = 64;
+    int i;
+    while (size < (unsigned) cfglines * 2) size <<= 1;
+    cfghash = malloc(size * sizeof(int));
+    if (!cfghash) fail("can't allocate config hash table.");
+    memset(cfghash, -1, size * sizeof(int));
+    cfghash_mask = size - 1;
+    for (i = 0; i < cfglines; i++) {
+        unsigned pos = config_key_hash(cfgdata[i].key) & cfghash_mask;
+        while (cfghash[pos] >= 0) pos = (pos + 1) & cfghash_mask;
+        cfghash[pos] = i;
+    }
+}
+
 #define badcfg(fmt, ...) fail_with_extra_msg(wstr_badcfgfile_text, wstr_badcfgfile_title, fmt, ## __VA_ARGS__)
 
-void read_config_file()
+// parse config file to sorted array
+//   the file is read at once and tokenized in place,
+//   keys and values point into *buffer, which should be freed after them
+//   return 1 if success, 0 if config file is bad, -1 if config file can't open
+//   error message is stored in cfgerr
+static char cfgerr[MAXLINE];
+#define cfgerror(fmt, ...) do { snprintf(cfgerr, sizeof(cfgerr), fmt, ## __VA_ARGS__); goto bad; } while (0)
+static int load_config_lines(struct config_value **data, int *nlines, char **buffer)
 {
-    cfglines = 0;
-    FILE *fp = NULL;
+    struct bvec lines;
+    bvec_ctor(&lines);
+    char *filedata = NULL;
     if (wal_check1(CONFIG_FILE, CONFIG_FILE_WAL, CONFIG_FILE_SUM)) {
-        fp = robust_fopen(CONFIG_FILE, "r");
+        filedata = read_file_as_cstring(CONFIG_FILE);
     }
-    if (!fp) {
-        fail_with_extra_msg(wstr_nocfgfile_text, wstr_nocfgfile_title, "can't open config file '%s'.", CONFIG_FILE);
+    if (!filedata) {
+        snprintf(cfgerr, sizeof(cfgerr), "can't open config file '%s'.", CONFIG_FILE);
+        return -1;
     }
     
-    char buf[MAXLINE];
-    char *ptr;
-    fscanf(fp, UTF8_BOM_STR);
+    char *buf, *ptr;
+    char *next = filedata;
+    if (strncmp(next, UTF8_BOM_STR, strlen(UTF8_BOM_STR)) == 0) next += strlen(UTF8_BOM_STR);
     int linenum = 0;
-    while (fgets(buf, sizeof(buf), fp)) {
+    while (next && *next) {
         linenum++;
         
+        // cut the line, remove '\n' and '\r' at end of line
+        buf = next;
+        next = strchr(buf, '\n');
+        if (next) *next++ = '\0';
+        ptr = buf + strlen(buf);
+        if (ptr > buf && ptr[-1] == '\r') ptr[-1] = '\0';
+        
         // ltrim the line
-        for (ptr = buf; *ptr && is_spacechar(*ptr); ptr++);
-        memmove(buf, ptr, strlen(ptr) + 1);
+        while (*buf && is_spacechar(*buf)) buf++;
         
         // skip empty and comment lines
         if (!buf[0] || buf[0] == ';' || buf[0] == '#' || (buf[0] == '/' && buf[1] == '/')) continue;
         
-        // remove '\n' and end of line
-        ptr = strchr(buf, '\n');
-        if (ptr) *ptr = '\0';
-        
         // parse 'key' and 'value'
         ptr = strchr(buf, '=');
-        if (!ptr) badcfg("invalid config data at line %d", linenum);
+        if (!ptr) cfgerror("invalid config data at line %d", linenum);
         *ptr = '\0';
         char *keystr = buf, *valstr = ptr + 1;
         
         // rtrim 'key'
         while (ptr > buf && is_spacechar(ptr[-1])) ptr[-1] = '\0', ptr--;
-        if (!buf[0]) badcfg("key is empty at line %d", linenum);
+        if (!buf[0]) cfgerror("key is empty at line %d", linenum);
         
         // ltrim 'value'
         while (*valstr && is_spacechar(*valstr)) valstr++;
         
         // save this config line to array
-        if (cfglines >= MAX_CONFIG_LINES) badcfg("too many config lines.");
-        cfgdata[cfglines].key = strdup(keystr);
-        cfgdata[cfglines].val = strdup(valstr);
-        cfglines++;
+        struct config_value line;
+        memset(&line, 0, sizeof(line));
+        line.key = keystr;
+        line.str = valstr;
+        bvec_tpushback(&lines, &line, struct config_value);
     }
-    fclose(fp);
     
     // sort the array
-    qsort(cfgdata, cfglines, sizeof(struct config_line), config_line_cmp);
+    int n = bvec_tsize(&lines, struct config_value);
+    struct config_value *arr = bvec_tbegin(&lines, struct config_value);
+    qsort(arr, n, sizeof(struct config_value), config_value_cmp);
     
     // check for duplicate keys
     int i;
-    for (i = 1; i < cfglines; i++) {
-        int ret = config_line_cmp(&cfgdata[i - 1], &cfgdata[i]);
-        if (ret == 0) badcfg("duplicate key '%s'.", cfgdata[i].key);
+    for (i = 1; i < n; i++) {
+        int ret = config_value_cmp(&arr[i - 1], &arr[i]);
+        if (ret == 0) cfgerror("duplicate key '%s'.", arr[i].key);
     }
     
+    *nlines = n;
+    *data = bvec_tmdtor(&lines, struct config_value);
+    *buffer = filedata;
+    return 1;
+bad:
+    free(filedata);
+    bvec_dtor(&lines);
+    return 0;
+}
+
+void read_config_file()
+{
+    int ret = load_config_lines(&cfgdata, &cfglines, &cfgbuf);
+    if (ret < 0) fail_with_extra_msg(wstr_nocfgfile_text, wstr_nocfgfile_title, "%s", cfgerr);
+    if (ret == 0) badcfg("%s", cfgerr);
+    build_config_hash();
     cfg_loaded = 1;
 }
 
+static int config_str_isint(const char *str)
+{
+    int val;
+    return sscanf(str, "%d", &val) == 1;
+}
+
+static int config_str_isdouble(const char *str)
+{
+    double val;
+    return sscanf(str, "%lf", &val) == 1;
+}
+
+// reload config file
+//   values of existing keys are updated in place, so pointers from get_config_value() keep valid
+//   replaced strings are never freed, so pointers from get_string_from_configfile() keep valid too,
+//   but they are not updated
+//   new keys are ignored until restart, since the hash index is not rebuilt
+//   return number of changed values, or -1 if config file can't be read
+int reload_config_file()
+{
+    struct config_value *data;
+    char *buffer;
+    int n, i, changed = 0;
+    if (!cfg_loaded) return -1;
+    if (!cfgowned) {
+        cfgowned = calloc(cfglines, sizeof(char *));
+        if (!cfgowned) return -1;
+    }
+    if (load_config_lines(&data, &n, &buffer) <= 0) {
+        plog("can't reload config file: %s", cfgerr);
+        return -1;
+    }
+    for (i = 0; i < cfglines; i++) {
+        cfgdata[i].changed = 0;
+    }
+    for (i = 0; i < n; i++) {
+        struct config_value *v = find_config_value(data[i].key);
+        if (!v) {
+            plog("new config key '%s' is ignored, restart is required.", data[i].key);
+        } else if (strcmp(v->str, data[i].str) != 0) {
+            // a bad number would be fatal in accessors, keep old value instead
+            // keys which are not read yet are typed by their old value
+            int isint = (v->parsed & CONFIG_PARSED_INT) || config_str_isint(v->str);
+            int isdouble = (v->parsed & CONFIG_PARSED_DOUBLE) || config_str_isdouble(v->str);
+            if ((isint && !config_str_isint(data[i].str)) || (isdouble && !config_str_isdouble(data[i].str))) {
+                plog("invalid value '%s' for config key '%s' is ignored.", data[i].str, v->key);
+                continue;
+            }
+            
+            char *str = strdup(data[i].str);
+            if (!str) continue;
+            if (cfgowned[v - cfgdata]) bvec_tpushback(&cfgretired, &cfgowned[v - cfgdata], char *);
+            cfgowned[v - cfgdata] = str;
+            v->str = str;
+            v->parsed = 0;
+            v->changed = 1;
+            changed++;
+        }
+    }
+    free(data);
+    free(buffer);
+    return changed;
+}
+
+int config_value_changed(const char *key)
+{
+    struct config_value *v = find_config_value(key);
+    return v ? v->changed : 0;
+}
+
+struct config_value *find_config_value(const char *key)
+{
+    if (!cfg_loaded) return NULL;
+    unsigned pos;
+    int i;
+    for (pos = config_key_hash(key) & cfghash_mask; (i = cfghash[pos]) >= 0; pos = (pos + 1) & cfghash_mask) {
+        if (stricmp(cfgdata[i].key, key) == 0) return &cfgdata[i];
+    }
+    return NULL;
+}
+
+struct config_value *get_config_value(const char *key)
+{
+    struct config_value *ret = find_config_value(key);
+    if (!ret) badcfg("can't find config line with key '%s'.", key);
+    return ret;
+}
+
+int config_value_int(struct config_value *v)
+{
+    if (!(v->parsed & CONFIG_PARSED_INT)) {
+        v->ival = str2int(v->str);
+        v->parsed |= CONFIG_PARSED_INT;
+    }
+    return v->ival;
+}
+
+double config_value_double(struct config_value *v)
+{
+    if (!(v->parsed & CONFIG_PARSED_DOUBLE)) {
+        v->dval = str2double(v->str);
+        v->parsed |= CONFIG_PARSED_DOUBLE;
+    }
+    return v->dval;
+}
+
+int config_value_tuple(struct config_value *v, double *out, int maxn)
+{
+    if (!(v->parsed & CONFIG_PARSED_TUPLE)) {
+        const char *ptr = v->str;
+        char *end;
+        v->ntuple = 0;
+        while (v->ntuple < CONFIG_MAXTUPLE) {
+            double val = strtod(ptr, &end);
+            if (end == ptr) break;
+            v->tuple[v->ntuple++] = val;
+            for (ptr = end; *ptr && is_spacechar(*ptr); ptr++);
+            if (*ptr != ',' && *ptr != ':' && *ptr != 'x') break;
+            ptr++;
+        }
+        v->parsed |= CONFIG_PARSED_TUPLE;
+    }
+    int i;
+    for (i = 0; i < v->ntuple && i < maxn; i++) out[i] = v->tuple[i];
+    return v->ntuple;
+}
+
 const char *get_string_from_configfile_unsafe(const char *key)
 {
-    struct config_line tmp;
-    tmp.key = (char *) key;
-    struct config_line *result;
-    result = bsearch(&tmp, cfgdata, cfglines, sizeof(struct config_line), config_line_cmp);
+    struct config_value *result = find_config_value(key);
     if (!result) return NULL;
-    return result->val;
+    return result->str;
 }
 
 const char *get_string_from_configfile(const char *key)
 {
-    const char *ret = get_string_from_configfile_unsafe(key);
-    if (!ret) badcfg("can't find config line with key '%s'.", key);
-    return ret;
+    return get_config_value(key)->str;
 }
 
 int get_int_from_configfile(const char *key)
 {
-    const char *valstr = get_string_from_configfile(key);
-    return str2int(valstr);
+    return config_value_int(get_config_value(key));
 }
 
 void dump_all_config(FILE *fp)
@@ -110,7 +292,7 @@ void dump_all_config(FILE *fp)
     }
     int i;
     for (i = 0; i < cfglines; i++) {
-        fprintf(fp, "  %s=%s\n", cfgdata[i].key, cfgdata[i].val);
+        fprintf(fp, "  %s=%s\n", cfgdata[i].key, cfgdata[i].str);
     }
 }
 
@@ -205,6 +205,234 @@ fail:
 }
 
 
+// cached directory index
+//   files in a directory are read once, sorted, and kept as UTF-8 full paths
+//   a change notification is registered for each indexed directory,
+//   the index is rebuilt on next use after the directory is changed
+//   directories which can't be watched are enumerated every time
+//
+//   the index holds all files of a directory, pattern is matched here,
+//   only '*' and '?' are supported, ASCII letters are case-insensitive
+//   lists are reference counted, so a callback may enumerate again or invalidate indexes
+
+#define MAX_DIRINDEX 32
+
+struct dirindex_file {
+    char *path;
+    const char *name; // points into path
+};
+struct dirindex_list {
+    int refcount;
+    int count;
+    struct dirindex_file *files;
+};
+struct dirindex {
+    wchar_t *dirpath; // full path, NULL if slot is empty
+    HANDLE hnotify;
+    struct dirindex_list *list;
+    unsigned last_use;
+};
+
+static struct dirindex dirindex_table[MAX_DIRINDEX];
+static unsigned dirindex_clock;
+static CRITICAL_SECTION dirindex_cs;
+
+static void dirindex_list_release(struct dirindex_list *list)
+{
+    int i;
+    if (!list) return;
+    EnterCriticalSection(&dirindex_cs);
+    int refcount = --list->refcount;
+    LeaveCriticalSection(&dirindex_cs);
+    if (refcount) return;
+    for (i = 0; i < list->count; i++) {
+        free(list->files[i].path);
+    }
+    free(list->files);
+    free(list);
+}
+
+static void dirindex_slot_clear(struct dirindex *d)
+{
+    if (d->hnotify != INVALID_HANDLE_VALUE) FindCloseChangeNotification(d->hnotify);
+    free(d->dirpath);
+    dirindex_list_release(d->list);
+    memset(d, 0, sizeof(*d));
+    d->hnotify = INVALID_HANDLE_VALUE;
+}
+
+// read all files in directory, a missing directory gives an empty list like enum_files()
+static struct dirindex_list *dirindex_build(const wchar_t *wdirpath)
+{
+    struct bvec wnames; // wchar_t *
+    struct dirindex_list *list;
+    WIN32_FIND_DATAW FindFileData;
+    HANDLE hFind;
+    wchar_t *searchpatt;
+    size_t dirlen = wcslen(wdirpath);
+    int i, n;
+    
+    bvec_ctor(&wnames);
+    
+    searchpatt = malloc((dirlen + 3) * sizeof(wchar_t));
+    wcscpy(searchpatt, wdirpath);
+    wcscpy(searchpatt + dirlen, L"\\*");
+    hFind = FindFirstFileW(searchpatt, &FindFileData);
+    free(searchpatt);
+    
+    if (hFind != INVALID_HANDLE_VALUE) {
+        do {
+            // skip dirs
+            if ((FindFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) continue;
+            
+            // construct full path
+            wchar_t *wpath = malloc((dirlen + wcslen(FindFileData.cFileName) + 2) * sizeof(wchar_t));
+            wcscpy(wpath, wdirpath);
+            wpath[dirlen] = L'\\';
+            wcscpy(wpath + dirlen + 1, FindFileData.cFileName);
+            bvec_tpushback(&wnames, &wpath, wchar_t *);
+        } while (FindNextFileW(hFind, &FindFileData));
+        FindClose(hFind);
+    }
+    
+    // sort files, same order as enum_files()
+    n = bvec_tsize(&wnames, wchar_t *);
+    qsort(bvec_tdata(&wnames, wchar_t *), n, sizeof(wchar_t *), wfilename_cmp);
+    
+    // convert to utf8
+    list = malloc(sizeof(struct dirindex_list));
+    list->refcount = 1;
+    list->count = n;
+    list->files = malloc(imax(n, 1) * sizeof(struct dirindex_file));
+    for (i = 0; i < n; i++) {
+        char *path = wcs2cs_alloc(bvec_tat(&wnames, i, wchar_t *), CP_UTF8);
+        list->files[i].path = path;
+        list->files[i].name = get_filepart(path);
+    }
+    
+    for (i = 0; i < n; i++) {
+        free(bvec_tat(&wnames, i, wchar_t *));
+    }
+    bvec_dtor(&wnames);
+    return list;
+}
+
+// get a referenced file list for directory, returns NULL if failed
+static struct dirindex_list *dirindex_get(const char *dirpath)
+{
+    wchar_t wdirpath[MAXLINE];
+    struct dirindex *d, *victim = NULL;
+    struct dirindex_list *list;
+    int i;
+    
+    if (!utf8_filepath_to_wstr_fullpath(dirpath, wdirpath, MAXLINE, NULL)) return NULL;
+    
+    EnterCriticalSection(&dirindex_cs);
+    
+    // find indexed directory, rebuild index if it is changed
+    for (i = 0; i < MAX_DIRINDEX; i++) {
+        d = &dirindex_table[i];
+        if (!d->dirpath) {
+            if (!victim || victim->dirpath) victim = d;
+            continue;
+        }
+        if (wcsicmp(d->dirpath, wdirpath) == 0) {
+            if (WaitForSingleObject(d->hnotify, 0) == WAIT_OBJECT_0) {
+                FindNextChangeNotification(d->hnotify);
+                dirindex_list_release(d->list);
+                d->list = dirindex_build(wdirpath);
+            }
+            d->last_use = ++dirindex_clock;
+            list = d->list;
+            list->refcount++;
+            goto done;
+        }
+        if (!victim || (victim->dirpath && d->last_use < victim->last_use)) victim = d;
+    }
+    
+    // not indexed, watch it before reading, so changes during reading are not lost
+    HANDLE hnotify = FindFirstChangeNotificationW(wdirpath, FALSE, FILE_NOTIFY_CHANGE_FILE_NAME);
+    list = dirindex_build(wdirpath);
+    if (hnotify != INVALID_HANDLE_VALUE) {
+        if (victim->dirpath) dirindex_slot_clear(victim);
+        victim->dirpath = wcsdup(wdirpath);
+        victim->hnotify = hnotify;
+        victim->list = list;
+        victim->last_use = ++dirindex_clock;
+        list->refcount++;
+    }
+    // if the directory can't be watched, the list is used only once
+    
+done:
+    LeaveCriticalSection(&dirindex_cs);
+    return list;
+}
+
+// match utf8 name with pattern
+static int dirindex_lower(int ch)
+{
+    if ('A' <= ch && ch <= 'Z') ch += 'a' - 'A';
+    return ch;
+}
+static int dirindex_match(const char *patt, const char *name)
+{
+    while (*patt) {
+        if (*patt == '*') {
+            while (*patt == '*') patt++;
+            if (!*patt) return 1;
+            for (; *name; name++) {
+                if (dirindex_match(patt, name)) return 1;
+            }
+            return 0;
+        }
+        if (!*name) return 0;
+        if (*patt != '?' && dirindex_lower(*patt) != dirindex_lower(*name)) return 0;
+        patt++;
+        name++;
+    }
+    return !*name;
+}
+
+// same as enum_files(), but uses cached directory index
+//  return value is total matched file count, or -1 if failed
+//   if pattern == NULL, all files in directory are matched
+int enum_files_cached(const char *dirpath, const char *pattern, void (*func)(const char *filepath, void *arg), void *arg)
+{
+    struct dirindex_list *list = dirindex_get(dirpath);
+    int sum = 0;
+    int i;
+    
+    if (!list) return -1;
+    for (i = 0; i < list->count; i++) {
+        if (pattern && !dirindex_match(pattern, list->files[i].name)) continue;
+        if (func) func(list->files[i].path, arg);
+        sum++;
+    }
+    dirindex_list_release(list);
+    return sum;
+}
+
+// drop all cached directory indexes, they will be read again on next use
+void flush_dirindex()
+{
+    int i;
+    EnterCriticalSection(&dirindex_cs);
+    for (i = 0; i < MAX_DIRINDEX; i++) {
+        if (dirindex_table[i].dirpath) dirindex_slot_clear(&dirindex_table[i]);
+    }
+    LeaveCriticalSection(&dirindex_cs);
+}
+
+void init_dirindex()
+{
+    int i;
+    InitializeCriticalSection(&dirindex_cs);
+    for (i = 0; i < MAX_DIRINDEX; i++) {
+        dirindex_table[i].hnotify = INVALID_HANDLE_VALUE;
+    }
+}
+
+
 int create_dir(const char *dirpath)
 {
     return !!CreateDirectoryA(dirpath, NULL);
@@ -258,3 +486,18 @@ int robust_unlink(const char *filename)
     }
     return ret;
 }
+
+// replace newname with oldname by MoveFileEx(), returns 0 if success
+//   fails without retrying if MoveFileEx() is not available (win9x)
+int robust_rename(const char *oldname, const char *newname)
+{
+    int i;
+    for (i = 0; i < ROBUST_MAXTRY; i++) {
+        if (i) Sleep(ROBUST_WAIT);
+        reset_attrib(newname);
+        if (MoveFileExA(oldname, newname, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) return 0;
+        DWORD err = GetLastError();
+        if (err != ERROR_ACCESS_DENIED && err != ERROR_SHARING_VIOLATION) break;
+    }
+    return -1;
+}
@@ -1,48 +1,355 @@
 #include "common.h"
 
 // the hook framework
-static int nr_hooks[MAX_HOOK_TYPES];
-static void *hookfunc[MAX_HOOK_TYPES][MAX_HOOKS];
+//   every function registered to a hook type owns a slot, slots are never freed,
+//   so profile data is kept after the hook is removed,
+//   and a function added to the same type again will reuse its old slot
+//
+//   hooks are called through dispatch lists, which are copy-on-write,
+//   a running dispatch keeps using the list it started with,
+//   replaced lists are freed after all running dispatches are finished
+struct hook_slot {
+    void *funcptr;
+    struct hook_profile_entry profile; // since last reset_hook_profile()
+    struct hook_profile_entry profile_total; // since start
+};
+struct hook_node {
+    void *funcptr;
+    int slot;
+    int priority;
+    int handle;
+};
+struct hook_list {
+    int n;
+    struct hook_node node[];
+};
+struct hook_handle {
+    int active;
+};
+
+// gameloop hooks have a dispatch list for each type, after normal hook types
+// hooks for unknown gameloop types are kept in list of HOOKID_GAMELOOP
+#define GAMELOOP_LIST(type) ((type) >= 0 && (type) < MAX_GAMELOOP_TYPES ? MAX_HOOK_TYPES + (type) : HOOKID_GAMELOOP)
+
+// wndproc hooks have a dispatch list for each message with filtered hooks, after gameloop lists
+#define WNDPROC_MAXMSGS 64
+#define WNDPROC_LIST(hookid, index) (MAX_HOOK_TYPES + MAX_GAMELOOP_TYPES + ((hookid) - HOOKID_PREWNDPROC) * WNDPROC_MAXMSGS + (index))
+#define MAX_HOOK_LISTS (MAX_HOOK_TYPES + MAX_GAMELOOP_TYPES + 2 * WNDPROC_MAXMSGS)
+
+static struct bvec hook_slots[MAX_HOOK_TYPES]; // struct hook_slot
+static struct hook_list *hook_lists[MAX_HOOK_LISTS];
+static struct bvec hook_handles; // struct hook_handle, handle value is index + 1
+static struct bvec hook_retired; // struct hook_list *, lists to free after dispatch
+static int hook_dispatch_depth;
+
+static const char *const hook_name[MAX_HOOK_TYPES] = {
+    [HOOKID_ATEXIT] = "atexit",
+    [HOOKID_GAMELOOP] = "gameloop",
+    [HOOKID_GETCURSORPOS] = "getcursorpos",
+    [HOOKID_SETCURSORPOS] = "setcursorpos",
+    [HOOKID_POSTD3DCREATE] = "postd3dcreate",
+    [HOOKID_ONLOSTDEVICE] = "onlostdevice",
+    [HOOKID_ONRESETDEVICE] = "onresetdevice",
+    [HOOKID_PREENDSCENE] = "preendscene",
+    [HOOKID_POSTPRESENT] = "postpresent",
+    [HOOKID_POSTPAL3CREATE] = "postpal3create",
+    [HOOKID_POSTGAMECREATE] = "postgamecreate",
+    [HOOKID_PREPAL3DESTROY] = "prepal3destroy",
+    [HOOKID_GAMEPAUSERESUME] = "pauseresume",
+    [HOOKID_PREWNDPROC] = "prewndproc",
+    [HOOKID_POSTWNDPROC] = "postwndproc",
+    [HOOKID_GRPKBDSTATE] = "grpkbdstate",
+    [HOOKID_CONFIGCHANGE] = "configchange",
+};
+const char *get_hook_name(int hookid)
+{
+    return hookid >= 0 && hookid < MAX_HOOK_TYPES && hook_name[hookid] ? hook_name[hookid] : "unknown";
+}
+
+// time spent in each hook function, only recorded when hook_profile_enabled
+//   profile of each slot is reset by gameprofile every report interval,
+//   profile_total is kept since start, and is reported at exit
+//   if 'hookprofile' is enabled, which may also show recent costs in showfps
+int hook_profile_enabled = 0;
+static int hook_profile_flag;
+static struct hook_profile_entry hook_profile_recent[MAX_HOOK_TYPES]; // per type, since last overlay update
+static LARGE_INTEGER hook_profile_freq;
+#define PROFILE_HOOK_CALL(hookid, index, call) \
+    do { \
+        CHROMETRACE_BEGIN(get_hook_name(hookid), (index)); \
+        if (hook_profile_enabled) { \
+            LARGE_INTEGER t1_, t2_; \
+            QueryPerformanceCounter(&t1_); \
+            call; \
+            QueryPerformanceCounter(&t2_); \
+            add_hook_profile(hookid, index, t2_.QuadPart - t1_.QuadPart); \
+        } else { \
+            call; \
+        } \
+        CHROMETRACE_END(); \
+    } while (0)
+static void add_hook_profile_entry(struct hook_profile_entry *entry, LONGLONG ticks)
+{
+    entry->ticks += ticks;
+    entry->calls++;
+    if (ticks > entry->max_ticks) entry->max_ticks = ticks;
+}
+static void add_hook_profile(int hookid, int index, LONGLONG ticks)
+{
+    struct hook_slot *slot = &bvec_tat(&hook_slots[hookid], index, struct hook_slot);
+    add_hook_profile_entry(&slot->profile, ticks);
+    add_hook_profile_entry(&slot->profile_total, ticks);
+    add_hook_profile_entry(&hook_profile_recent[hookid], ticks);
+}
+int get_hook_profile(int hookid, int index, void **funcptr, struct hook_profile_entry *entry)
+{
+    if (hookid < 0 || hookid >= MAX_HOOK_TYPES || index < 0 || (size_t) index >= bvec_tsize(&hook_slots[hookid], struct hook_slot)) return 0;
+    struct hook_slot *slot = &bvec_tat(&hook_slots[hookid], index, struct hook_slot);
+    *funcptr = slot->funcptr;
+    *entry = slot->profile;
+    return 1;
+}
+void reset_hook_profile()
+{
+    int i;
+    struct hook_slot *slot;
+    for (i = 0; i < MAX_HOOK_TYPES; i++) {
+        for (slot = bvec_tbegin(&hook_slots[i], struct hook_slot); slot != bvec_tend(&hook_slots[i], struct hook_slot); slot++) {
+            memset(&slot->profile, 0, sizeof(slot->profile));
+        }
+    }
+}
 
+static double hook_profile_us(LONGLONG ticks)
+{
+    return ticks * 1000000.0 / hook_profile_freq.QuadPart;
+}
+void get_hook_profile_text(char *buf, int size)
+{
+    static char text[MAXLINE];
+    static LARGE_INTEGER last_update;
+    LARGE_INTEGER now;
+    int i;
+    *buf = '\0';
+    if (hook_profile_flag < 2) return;
+    
+    // update text every second
+    QueryPerformanceCounter(&now);
+    if (now.QuadPart - last_update.QuadPart >= hook_profile_freq.QuadPart) {
+        double seconds = last_update.QuadPart ? (now.QuadPart - last_update.QuadPart) / (double) hook_profile_freq.QuadPart : 0.0;
+        text[0] = '\0';
+        for (i = 0; i < MAX_HOOK_TYPES && seconds > 0; i++) {
+            struct hook_profile_entry *entry = &hook_profile_recent[i];
+            if (!entry->calls) continue;
+            int len = strlen(text);
+            snprintf(text + len, sizeof(text) - len, "HOOK %-13s %8.3fms/s, %6.0f calls/s, max %8.1fus\n", get_hook_name(i), hook_profile_us(entry->ticks) / 1000.0 / seconds, entry->calls / seconds, hook_profile_us(entry->max_ticks));
+        }
+        memset(hook_profile_recent, 0, sizeof(hook_profile_recent));
+        last_update = now;
+    }
+    snprintf(buf, size, "%s", text);
+}
+static void hook_profile_report()
+{
+    int i;
+    struct hook_slot *slot;
+    for (i = 0; i < MAX_HOOK_TYPES; i++) {
+        struct hook_profile_entry sum;
+        memset(&sum, 0, sizeof(sum));
+        for (slot = bvec_tbegin(&hook_slots[i], struct hook_slot); slot != bvec_tend(&hook_slots[i], struct hook_slot); slot++) {
+            struct hook_profile_entry *entry = &slot->profile_total;
+            sum.ticks += entry->ticks;
+            sum.calls += entry->calls;
+            if (entry->max_ticks > sum.max_ticks) sum.max_ticks = entry->max_ticks;
+        }
+        if (!sum.calls) continue;
+        
+        // one log message per hook type, with cost of each hook function
+        char msg[MAXLINE];
+        snprintf(msg, sizeof(msg), "hook %s: %u calls, total %.3fms, max %.1fus", get_hook_name(i), sum.calls, hook_profile_us(sum.ticks) / 1000.0, hook_profile_us(sum.max_ticks));
+        for (slot = bvec_tbegin(&hook_slots[i], struct hook_slot); slot != bvec_tend(&hook_slots[i], struct hook_slot); slot++) {
+            struct hook_profile_entry *entry = &slot->profile_total;
+            char sym[MAXLINE];
+            if (!entry->calls) continue;
+            get_address_symbol(slot->funcptr, sym, sizeof(sym));
+            int len = strlen(msg);
+            snprintf(msg + len, sizeof(msg) - len, "\n  %-32s %8u calls, total %10.3fms, avg %8.1fus, max %8.1fus", sym, entry->calls, hook_profile_us(entry->ticks) / 1000.0, hook_profile_us(entry->ticks) / entry->calls, hook_profile_us(entry->max_ticks));
+        }
+        plog("%s", msg);
+    }
+}
+static void init_hook_profile()
+{
+    hook_profile_flag = get_int_from_configfile("hookprofile");
+    if (!QueryPerformanceFrequency(&hook_profile_freq)) {
+        hook_profile_flag = 0;
+        return;
+    }
+    if (hook_profile_flag) {
+        hook_profile_enabled = 1;
+        add_atexit_hook(hook_profile_report);
+    }
+}
+
+static void replace_hook_list(int listid, struct hook_list *list)
+{
+    if (hook_lists[listid]) {
+        if (hook_dispatch_depth) {
+            bvec_tpushback(&hook_retired, &hook_lists[listid], struct hook_list *);
+        } else {
+            free(hook_lists[listid]);
+        }
+    }
+    hook_lists[listid] = list;
+}
+static void insert_hook_node(int listid, const struct hook_node *node)
+{
+    struct hook_list *old = hook_lists[listid];
+    int n = old ? old->n : 0;
+    int i, pos;
+    struct hook_list *list = malloc(sizeof(struct hook_list) + (n + 1) * sizeof(struct hook_node));
+    if (!list) fail("can't allocate hook list.");
+    
+    // keep ascending priority, same priority in registration order
+    for (pos = 0; pos < n && old->node[pos].priority <= node->priority; pos++);
+    for (i = 0; i < pos; i++) list->node[i] = old->node[i];
+    list->node[pos] = *node;
+    for (i = pos; i < n; i++) list->node[i + 1] = old->node[i];
+    list->n = n + 1;
+    replace_hook_list(listid, list);
+}
+static void delete_hook_node(int listid, int handle)
+{
+    struct hook_list *old = hook_lists[listid];
+    int i, n;
+    if (!old) return;
+    for (n = i = 0; i < old->n; i++) {
+        if (old->node[i].handle != handle) n++;
+    }
+    if (n == old->n) return;
+    
+    struct hook_list *list = NULL;
+    if (n > 0) {
+        list = malloc(sizeof(struct hook_list) + n * sizeof(struct hook_node));
+        if (!list) fail("can't allocate hook list.");
+        for (n = i = 0; i < old->n; i++) {
+            if (old->node[i].handle != handle) list->node[n++] = old->node[i];
+        }
+        list->n = n;
+    }
+    replace_hook_list(listid, list);
+}
+static struct hook_node new_hook_node(int hookid, void *funcptr, int priority)
+{
+    if (hookid < 0 || hookid >= MAX_HOOK_TYPES) fail("invalid hook type %d.", hookid);
+    
+    // find or allocate slot
+    struct bvec *slots = &hook_slots[hookid];
+    struct hook_slot *slot;
+    for (slot = bvec_tbegin(slots, struct hook_slot); slot != bvec_tend(slots, struct hook_slot); slot++) {
+        if (slot->funcptr == funcptr) break;
+    }
+    if (slot == bvec_tend(slots, struct hook_slot)) {
+        struct hook_slot newslot;
+        memset(&newslot, 0, sizeof(newslot));
+        newslot.funcptr = funcptr;
+        bvec_tpushback(slots, &newslot, struct hook_slot);
+        slot = &bvec_tback(slots, struct hook_slot);
+    }
+    
+    struct hook_handle newhandle = { .active = 1 };
+    bvec_tpushback(&hook_handles, &newhandle, struct hook_handle);
+    return (struct hook_node) {
+        .funcptr = funcptr,
+        .slot = slot - bvec_tbegin(slots, struct hook_slot),
+        .priority = priority,
+        .handle = bvec_tsize(&hook_handles, struct hook_handle),
+    };
+}
+static int hook_node_active(const struct hook_node *node)
+{
+    // hooks removed by previous hook function in same dispatch shall not be called
+    return bvec_tat(&hook_handles, node->handle - 1, struct hook_handle).active;
+}
+int add_hook_ex(int hookid, void *funcptr, int priority)
+{
+    if (hookid == HOOKID_GAMELOOP) return add_gameloop_hook_ex(funcptr, GAMELOOP_MASK_ALL, priority);
+    if (hookid == HOOKID_PREWNDPROC || hookid == HOOKID_POSTWNDPROC) return add_wndproc_hook_ex(hookid, funcptr, NULL, priority);
+    struct hook_node node = new_hook_node(hookid, funcptr, priority);
+    insert_hook_node(hookid, &node);
+    return node.handle;
+}
+void remove_hook(int handle)
+{
+    int i;
+    if (handle <= 0 || (size_t) handle > bvec_tsize(&hook_handles, struct hook_handle)) return;
+    struct hook_handle *h = &bvec_tat(&hook_handles, handle - 1, struct hook_handle);
+    if (!h->active) return;
+    h->active = 0;
+    for (i = 0; i < MAX_HOOK_LISTS; i++) {
+        delete_hook_node(i, handle);
+    }
+}
 static void add_hook(int hookid, void *funcptr)
 {
-    if (hookid >= MAX_HOOK_TYPES) fail("invalid hook type %d.", hookid);
-    if (nr_hooks[hookid] >= MAX_HOOKS) fail("too many hooks for type %d.", hookid);
-    hookfunc[hookid][nr_hooks[hookid]++] = funcptr;
+    add_hook_ex(hookid, funcptr, HOOK_PRIORITY_DEFAULT);
 }
 
-static void run_hooks_witharg(int hookid, void *arg, int (*brkcond)(void *arg))
+static struct hook_list *hook_dispatch_begin(int listid)
+{
+    hook_dispatch_depth++;
+    return hook_lists[listid];
+}
+static void hook_dispatch_end()
 {
+    if (--hook_dispatch_depth == 0 && !bvec_empty(&hook_retired)) {
+        struct hook_list **p;
+        for (p = bvec_tbegin(&hook_retired, struct hook_list *); p != bvec_tend(&hook_retired, struct hook_list *); p++) {
+            free(*p);
+        }
+        bvec_clear(&hook_retired);
+    }
+}
+static void run_hook_list_witharg(int hookid, int listid, void *arg, int (*brkcond)(void *arg))
+{
+    struct hook_list *list = hook_dispatch_begin(listid);
     int i;
-    for (i = 0; i < nr_hooks[hookid]; i++) {
-        ((void (*)(void *)) hookfunc[hookid][i])(arg);
+    for (i = 0; list && i < list->n; i++) {
+        struct hook_node *node = &list->node[i];
+        if (!hook_node_active(node)) continue;
+        PROFILE_HOOK_CALL(hookid, node->slot, ((void (*)(void *)) node->funcptr)(arg));
         if (brkcond && brkcond(arg)) break;
     }
+    hook_dispatch_end();
+}
+static void run_hooks_witharg(int hookid, void *arg, int (*brkcond)(void *arg))
+{
+    run_hook_list_witharg(hookid, hookid, arg, brkcond);
 }
 static void run_hooks(int hookid, int (*brkcond)(void))
 {
+    struct hook_list *list = hook_dispatch_begin(hookid);
     int i;
-    for (i = 0; i < nr_hooks[hookid]; i++) {
-        ((void (*)(void)) hookfunc[hookid][i])();
+    for (i = 0; list && i < list->n; i++) {
+        struct hook_node *node = &list->node[i];
+        if (!hook_node_active(node)) continue;
+        PROFILE_HOOK_CALL(hookid, node->slot, ((void (*)(void)) node->funcptr)());
         if (brkcond && brkcond()) break;
     }
+    hook_dispatch_end();
 }
 static void run_hooks_reverse_witharg(int hookid, void *arg, int (*brkcond)(void *arg))
 {
+    struct hook_list *list = hook_dispatch_begin(hookid);
     int i;
-    for (i = nr_hooks[hookid] - 1; i >= 0; i--) {
-        ((void (*)(void *)) hookfunc[hookid][i])(arg);
+    for (i = list ? list->n - 1 : -1; i >= 0; i--) {
+        struct hook_node *node = &list->node[i];
+        if (!hook_node_active(node)) continue;
+        PROFILE_HOOK_CALL(hookid, node->slot, ((void (*)(void *)) node->funcptr)(arg));
         if (brkcond && brkcond(arg)) break;
     }
+    hook_dispatch_end();
 }
-/*static void run_hooks_reverse(int hookid, int (*brkcond)(void))
-{
-    int i;
-    for (i = nr_hooks[hookid] - 1; i >= 0; i--) {
-        ((void (*)(void)) hookfunc[hookid][i])();
-        if (brkcond && brkcond()) break;
-    }
-}*/
 
 
 
@@ -77,13 +384,19 @@ static void init_preendscene_postpresent_hook()
 
 
 // OnLostDevice and OnResetDevice hooks
+//   time spent on every reset is logged,
+//   time between end of OnLostDevice hooks and begin of OnResetDevice hooks is spent in Reset()
+static LARGE_INTEGER reset_lost_begin, reset_lost_end;
+static unsigned reset_count;
 void add_onlostdevice_hook(void (*funcptr)(void))
 {
     add_hook(HOOKID_ONLOSTDEVICE, funcptr);
 }
 void call_onlostdevice_hooks()
 {
+    QueryPerformanceCounter(&reset_lost_begin);
     run_hooks(HOOKID_ONLOSTDEVICE, NULL);
+    QueryPerformanceCounter(&reset_lost_end);
 }
 void add_onresetdevice_hook(void (*funcptr)(void))
 {
@@ -91,7 +404,19 @@ void add_onresetdevice_hook(void (*funcptr)(void))
 }
 void call_onresetdevice_hooks()
 {
+    LARGE_INTEGER freq, t1, t2;
+    QueryPerformanceCounter(&t1);
     run_hooks(HOOKID_ONRESETDEVICE, NULL);
+    QueryPerformanceCounter(&t2);
+    
+    if (reset_lost_end.QuadPart && QueryPerformanceFrequency(&freq)) {
+        double ms = 1000.0 / freq.QuadPart;
+        plog("device reset #%u: release %.1f ms, reset %.1f ms, restore %.1f ms.", ++reset_count,
+            (reset_lost_end.QuadPart - reset_lost_begin.QuadPart) * ms,
+            (t1.QuadPart - reset_lost_end.QuadPart) * ms,
+            (t2.QuadPart - t1.QuadPart) * ms);
+    }
+    reset_lost_end.QuadPart = 0;
 }
 
 
@@ -111,6 +436,24 @@ static void init_postd3dcreate_hook()
 }
 
 
+// device vtable patching
+//   whole vtable is copied, since 9Ex methods may be called by others
+//   vtable is copied from device, so methods replaced by patchsets hooked earlier are chained
+static const GUID hook_IID_IDirect3DDevice9Ex = { 0xb18b10ce, 0x2649, 0x405a, { 0x87, 0x0f, 0x95, 0xf7, 0x77, 0xd4, 0x31, 0x3a } };
+unsigned patch_device_vtable(IDirect3DDevice9 *dev, IDirect3DDevice9ExVtbl *vtbl)
+{
+    IDirect3DDevice9Ex *devex;
+    memset(vtbl, 0, sizeof(*vtbl));
+    if (SUCCEEDED(IDirect3DDevice9_QueryInterface(dev, &hook_IID_IDirect3DDevice9Ex, (void **) &devex))) {
+        *vtbl = *devex->lpVtbl;
+        IDirect3DDevice9Ex_Release(devex);
+        return sizeof(IDirect3DDevice9ExVtbl);
+    }
+    *(IDirect3DDevice9Vtbl *) vtbl = *dev->lpVtbl;
+    return sizeof(IDirect3DDevice9Vtbl);
+}
+
+
 // post PAL3::Create and pre PAL3::Destroy hooks
 void add_postpal3create_hook(void (*funcptr)(void))
 {
@@ -178,7 +521,9 @@ void set_pauseresume(int state)
 static void PAL3_Update_wrapper(float deltaTime)
 {
     set_pauseresume(0);
+    call_gameloop_hooks(GAMEEVENT_UPDATE_ATBEGIN, &deltaTime);
     PAL3_Update(deltaTime);
+    call_gameloop_hooks(GAMEEVENT_UPDATE_ATEND, NULL);
 }
 static void init_pauseresume_hook()
 {
@@ -212,15 +557,32 @@ static void init_atexit_hook()
 
 
 // gameloop hook
+//   each type has its own dispatch list, see GAMELOOP_LIST()
+//   unknown types only call unfiltered hooks
+int add_gameloop_hook_ex(void (*funcptr)(void *), unsigned typemask, int priority)
+{
+    // hook function will only be called for types in typemask
+    struct hook_node node = new_hook_node(HOOKID_GAMELOOP, funcptr, priority);
+    int type;
+    for (type = 0; type < MAX_GAMELOOP_TYPES; type++) {
+        if (typemask & GAMELOOP_MASK(type)) insert_hook_node(GAMELOOP_LIST(type), &node);
+    }
+    if ((typemask & GAMELOOP_MASK_ALL) == GAMELOOP_MASK_ALL) insert_hook_node(GAMELOOP_LIST(-1), &node);
+    return node.handle;
+}
+void add_gameloop_hook_filtered(void (*funcptr)(void *), unsigned typemask)
+{
+    add_gameloop_hook_ex(funcptr, typemask, HOOK_PRIORITY_DEFAULT);
+}
 void add_gameloop_hook(void (*funcptr)(void *))
 {
     // you need to check gameloop_hookflag in your hook function
-    add_hook(HOOKID_GAMELOOP, funcptr);
+    add_gameloop_hook_filtered(funcptr, GAMELOOP_MASK_ALL);
 }
 void call_gameloop_hooks(int type, void *data)
 {
     struct game_loop_hook_data arg = { .type = type, .data = data };
-    run_hooks_witharg(HOOKID_GAMELOOP, &arg, NULL);
+    run_hook_list_witharg(HOOKID_GAMELOOP, GAMELOOP_LIST(type), &arg, NULL);
 }
 static MAKE_ASMPATCH(gameloop_normal)
 {
@@ -285,10 +647,35 @@ static void init_gameloop_hook()
 
 
 // GetCursorPos hook
+//   if cursor cache is enabled (by rawcursor), hooked position is computed once
+//   and reused until invalidate_cursorpos_cache() is called,
+//   which should be done when cursor is moved, or when any hook's transform is changed
+static int cursorcache_enabled;
+static int cursorcache_valid;
+static POINT cursorcache_pt;
+void enable_cursorpos_cache(int enabled)
+{
+    cursorcache_enabled = enabled;
+    cursorcache_valid = 0;
+}
+void invalidate_cursorpos_cache()
+{
+    cursorcache_valid = 0;
+}
 static BOOL WINAPI GetCursorPos_wrapper(LPPOINT lpPoint)
 {
+    if (cursorcache_valid) {
+        *lpPoint = cursorcache_pt;
+        return TRUE;
+    }
     BOOL ret = GetCursorPos(lpPoint);
-    if (ret) run_hooks_witharg(HOOKID_GETCURSORPOS, lpPoint, NULL);
+    if (ret) {
+        run_hooks_witharg(HOOKID_GETCURSORPOS, lpPoint, NULL);
+        if (cursorcache_enabled) {
+            cursorcache_pt = *lpPoint;
+            cursorcache_valid = 1;
+        }
+    }
     return ret;
 }
 void add_getcursorpos_hook(void (*funcptr)(void *))
@@ -310,6 +697,7 @@ static BOOL WINAPI SetCursorPos_wrapper(int X, int Y)
 {
     POINT pt = (POINT) { .x = X, .y = Y };
     run_hooks_reverse_witharg(HOOKID_SETCURSORPOS, &pt, NULL);
+    invalidate_cursorpos_cache();
     return SetCursorPos(pt.x, pt.y);
 }
 void add_setcursorpos_hook(void (*funcptr)(void *))
@@ -323,6 +711,61 @@ static void init_setcursorpos_hook()
 
 
 // WndProc hooks
+//   filtered hooks are in dispatch lists of their messages, see WNDPROC_LIST()
+//   unfiltered hooks are in list of hook type, and in every message list
+//   messages without a list only call unfiltered hooks
+static UINT wndproc_msgs[2][WNDPROC_MAXMSGS];
+static int wndproc_nr_msgs[2];
+
+static int wndproc_find_list(int hookid, UINT msg, int create)
+{
+    // returns list id for msg, -1 if there are too many messages to create one
+    UINT *msgs = wndproc_msgs[hookid - HOOKID_PREWNDPROC];
+    int *nr_msgs = &wndproc_nr_msgs[hookid - HOOKID_PREWNDPROC];
+    int i;
+    for (i = 0; i < *nr_msgs; i++) {
+        if (msgs[i] == msg) return WNDPROC_LIST(hookid, i);
+    }
+    if (!create) return hookid;
+    if (*nr_msgs >= WNDPROC_MAXMSGS) return -1;
+    
+    // new message list starts with unfiltered hooks
+    struct hook_list *all = hook_lists[hookid];
+    if (all) {
+        size_t size = sizeof(struct hook_list) + all->n * sizeof(struct hook_node);
+        struct hook_list *list = malloc(size);
+        if (!list) fail("can't allocate hook list.");
+        memcpy(list, all, size);
+        hook_lists[WNDPROC_LIST(hookid, i)] = list;
+    }
+    msgs[i] = msg;
+    ++*nr_msgs;
+    return WNDPROC_LIST(hookid, i);
+}
+int add_wndproc_hook_ex(int hookid, void (*funcptr)(void *), const UINT *msglist, int priority)
+{
+    // hook function will only be called for messages in msglist, NULL means all messages
+    if (hookid != HOOKID_PREWNDPROC && hookid != HOOKID_POSTWNDPROC) fail("invalid wndproc hook type %d.", hookid);
+    struct hook_node node = new_hook_node(hookid, funcptr, priority);
+    const UINT *p, *q;
+    int i;
+    if (msglist) {
+        for (p = msglist; *p && wndproc_find_list(hookid, *p, 1) >= 0; p++);
+        if (!*p) {
+            for (p = msglist; *p; p++) {
+                for (q = msglist; q < p && *q != *p; q++);
+                if (q == p) insert_hook_node(wndproc_find_list(hookid, *p, 0), &node);
+            }
+            return node.handle;
+        }
+        warning("too many filtered wndproc messages, hook %p is called for all messages.", funcptr);
+    }
+    insert_hook_node(hookid, &node);
+    for (i = 0; i < wndproc_nr_msgs[hookid - HOOKID_PREWNDPROC]; i++) {
+        insert_hook_node(WNDPROC_LIST(hookid, i), &node);
+    }
+    return node.handle;
+}
 
 static int wndproc_brkcond(void *arg)
 {
@@ -340,7 +783,7 @@ static int call_wndproc_hook(int hookid, HWND *hWnd, UINT *Msg, WPARAM *wParam,
         .processed = 0,
     };
     
-    run_hooks_witharg(hookid, &data, wndproc_brkcond);
+    run_hook_list_witharg(hookid, wndproc_find_list(hookid, *Msg, 0), &data, wndproc_brkcond);
     
     if (data.processed) {
         *hWnd = data.hWnd;
@@ -358,6 +801,10 @@ void add_prewndproc_hook(void (*funcptr)(void *))
 {
     add_hook(HOOKID_PREWNDPROC, funcptr);
 }
+void add_prewndproc_hook_filtered(void (*funcptr)(void *), const UINT *msglist)
+{
+    add_wndproc_hook_ex(HOOKID_PREWNDPROC, funcptr, msglist, HOOK_PRIORITY_DEFAULT);
+}
 int call_prewndproc_hook(HWND *hWnd, UINT *Msg, WPARAM *wParam, LPARAM *lParam, LRESULT *retvalue)
 {
     return call_wndproc_hook(HOOKID_PREWNDPROC, hWnd, Msg, wParam, lParam, retvalue);
@@ -366,6 +813,10 @@ void add_postwndproc_hook(void (*funcptr)(void *))
 {
     add_hook(HOOKID_POSTWNDPROC, funcptr);
 }
+void add_postwndproc_hook_filtered(void (*funcptr)(void *), const UINT *msglist)
+{
+    add_wndproc_hook_ex(HOOKID_POSTWNDPROC, funcptr, msglist, HOOK_PRIORITY_DEFAULT);
+}
 int call_postwndproc_hook(HWND *hWnd, UINT *Msg, WPARAM *wParam, LPARAM *lParam, LRESULT *retvalue)
 {
     return call_wndproc_hook(HOOKID_POSTWNDPROC, hWnd, Msg, wParam, lParam, retvalue);
@@ -390,11 +841,22 @@ static void init_grpkbdstate_hook()
 
 
 
+// config change hook
+void add_configchange_hook(void (*funcptr)(void))
+{
+    add_hook(HOOKID_CONFIGCHANGE, funcptr);
+}
+void call_configchange_hooks()
+{
+    run_hooks(HOOKID_CONFIGCHANGE, NULL);
+}
+
+
+
 
 // init all hooks
 void init_hooks()
 {
-    memset(nr_hooks, 0, sizeof(nr_hooks));
     init_gameloop_hook();
     init_atexit_hook();
     init_getcursorpos_hook();
@@ -404,4 +866,5 @@ void init_hooks()
     init_preendscene_postpresent_hook();
     init_pauseresume_hook();
     init_grpkbdstate_hook();
+    init_hook_profile();
 }
@@ -0,0 +1,278 @@
+#include "common.h"
+
+// job system
+//   a fixed pool of worker threads, each worker has its own deque
+//   jobs submitted from a worker go to its own deque and run LIFO,
+//   jobs from other threads go to global queue,
+//   idle workers steal from the oldest end of other workers' deques
+//   continuations are queued when parent completes
+
+#define JOBSYS_MAXWORKERS 8
+
+struct job {
+    volatile LONG refcount;
+    volatile LONG done;
+    job_func_t func;
+    void *arg;
+    int on_main;
+    HANDLE event; // set when done
+    struct job *next; // link in continuation list
+    struct job *cont; // continuations, protected by jobsys_cs
+};
+
+struct job_deque {
+    CRITICAL_SECTION cs;
+    struct job **buf;
+    unsigned cap, head, count;
+};
+
+static int nr_workers;
+static struct job_deque worker_deques[JOBSYS_MAXWORKERS];
+static struct job_deque global_queue, main_queue;
+static HANDLE jobsys_sem;
+static DWORD jobsys_tls;
+static DWORD main_thread_id;
+static CRITICAL_SECTION jobsys_cs;
+
+static void deque_ctor(struct job_deque *q)
+{
+    InitializeCriticalSection(&q->cs);
+    q->buf = NULL;
+    q->cap = q->head = q->count = 0;
+}
+
+static void deque_push(struct job_deque *q, struct job *job)
+{
+    unsigned i;
+    EnterCriticalSection(&q->cs);
+    if (q->count == q->cap) {
+        unsigned newcap = q->cap ? q->cap * 2 : 64;
+        struct job **newbuf = malloc(newcap * sizeof(struct job *));
+        if (!newbuf) fail("can't allocate job queue.");
+        for (i = 0; i < q->count; i++) newbuf[i] = q->buf[(q->head + i) % q->cap];
+        free(q->buf);
+        q->buf = newbuf;
+        q->cap = newcap;
+        q->head = 0;
+    }
+    q->buf[(q->head + q->count++) % q->cap] = job;
+    LeaveCriticalSection(&q->cs);
+}
+
+static struct job *deque_pop_back(struct job_deque *q)
+{
+    struct job *job = NULL;
+    EnterCriticalSection(&q->cs);
+    if (q->count) job = q->buf[(q->head + --q->count) % q->cap];
+    LeaveCriticalSection(&q->cs);
+    return job;
+}
+
+static struct job *deque_pop_front(struct job_deque *q)
+{
+    struct job *job = NULL;
+    EnterCriticalSection(&q->cs);
+    if (q->count) {
+        job = q->buf[q->head];
+        q->head = (q->head + 1) % q->cap;
+        q->count--;
+    }
+    LeaveCriticalSection(&q->cs);
+    return job;
+}
+
+static int current_worker()
+{
+    // returns -1 if not a worker thread
+    return (int) TOUINT(TlsGetValue(jobsys_tls)) - 1;
+}
+
+static void job_enqueue(struct job *job)
+{
+    if (job->on_main) {
+        deque_push(&main_queue, job);
+        return;
+    }
+    int self = current_worker();
+    deque_push(self >= 0 ? &worker_deques[self] : &global_queue, job);
+    ReleaseSemaphore(jobsys_sem, 1, NULL);
+}
+
+static struct job *job_new(job_func_t func, void *arg, int on_main)
+{
+    struct job *job = malloc(sizeof(struct job));
+    if (!job) fail("can't allocate job.");
+    memset(job, 0, sizeof(*job));
+    job->refcount = 2; // one for caller, one for job system
+    job->func = func;
+    job->arg = arg;
+    job->on_main = on_main;
+    job->event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!job->event) fail("can't create job event.");
+    return job;
+}
+
+static void job_execute(struct job *job)
+{
+    struct job *cont, *next;
+    if (job->func) {
+        CHROMETRACE_BEGIN("job", TOUINT(job->func));
+        job->func(job->arg);
+        CHROMETRACE_END();
+    }
+    
+    EnterCriticalSection(&jobsys_cs);
+    job->done = 1;
+    cont = job->cont;
+    job->cont = NULL;
+    LeaveCriticalSection(&jobsys_cs);
+    SetEvent(job->event);
+    
+    for (; cont; cont = next) {
+        next = cont->next;
+        job_enqueue(cont);
+    }
+    job_release(job);
+}
+
+static struct job *find_job(int self)
+{
+    struct job *job;
+    int i;
+    if (self >= 0 && (job = deque_pop_back(&worker_deques[self]))) return job;
+    if ((job = deque_pop_front(&global_queue))) return job;
+    for (i = 1; i <= nr_workers; i++) {
+        int victim = (imax(self, 0) + i) % nr_workers;
+        if (victim != self && (job = deque_pop_front(&worker_deques[victim]))) return job;
+    }
+    return NULL;
+}
+
+static int run_one_job()
+{
+    struct job *job = find_job(current_worker());
+    if (!job) return 0;
+    job_execute(job);
+    return 1;
+}
+
+static int run_main_jobs(int limit)
+{
+    struct job *job;
+    int n = 0;
+    while (n < limit && (job = deque_pop_front(&main_queue))) {
+        job_execute(job);
+        n++;
+    }
+    return n;
+}
+
+static DWORD WINAPI job_worker(LPVOID lpParameter)
+{
+    TlsSetValue(jobsys_tls, lpParameter);
+    while (WaitForSingleObject(jobsys_sem, INFINITE) == WAIT_OBJECT_0) {
+        if (chrometrace_enabled) chrometrace_thread_name("job worker");
+        while (run_one_job());
+    }
+    return 0;
+}
+
+static struct job *job_add(struct job *parent, job_func_t func, void *arg, int on_main)
+{
+    struct job *job = job_new(func, arg, on_main);
+    int deferred = 0;
+    EnterCriticalSection(&jobsys_cs);
+    if (parent && !parent->done) {
+        job->next = parent->cont;
+        parent->cont = job;
+        deferred = 1;
+    }
+    LeaveCriticalSection(&jobsys_cs);
+    if (!deferred) job_enqueue(job);
+    return job;
+}
+
+struct job *job_submit(job_func_t func, void *arg)
+{
+    return job_add(NULL, func, arg, 0);
+}
+struct job *job_then(struct job *parent, job_func_t func, void *arg)
+{
+    return job_add(parent, func, arg, 0);
+}
+struct job *job_then_main(struct job *parent, job_func_t func, void *arg)
+{
+    return job_add(parent, func, arg, 1);
+}
+void job_post_main(job_func_t func, void *arg)
+{
+    job_release(job_add(NULL, func, arg, 1));
+}
+
+void job_wait(struct job *job)
+{
+    int is_main = GetCurrentThreadId() == main_thread_id;
+    while (!job->done) {
+        if (run_one_job()) continue;
+        if (is_main && run_main_jobs(1)) continue;
+        WaitForSingleObject(job->event, 1);
+    }
+}
+
+int job_done(struct job *job)
+{
+    return job->done;
+}
+
+void job_release(struct job *job)
+{
+    if (job && InterlockedDecrement(&job->refcount) == 0) {
+        CloseHandle(job->event);
+        free(job);
+    }
+}
+
+int job_worker_count()
+{
+    return nr_workers;
+}
+
+static void jobsys_gameloop_hook(void *arg)
+{
+    // only run jobs queued before this frame, new ones wait for next frame
+    unsigned n;
+    EnterCriticalSection(&main_queue.cs);
+    n = main_queue.count;
+    LeaveCriticalSection(&main_queue.cs);
+    run_main_jobs(n);
+}
+
+void init_jobsys()
+{
+    SYSTEM_INFO si;
+    int i;
+    
+    GetSystemInfo(&si);
+    nr_workers = imax(1, imin((int) si.dwNumberOfProcessors - 1, JOBSYS_MAXWORKERS));
+    main_thread_id = GetCurrentThreadId();
+    InitializeCriticalSection(&jobsys_cs);
+    deque_ctor(&global_queue);
+    deque_ctor(&main_queue);
+    
+    jobsys_tls = TlsAlloc();
+    if (jobsys_tls == TLS_OUT_OF_INDEXES) fail("can't allocate TLS index for job system.");
+    jobsys_sem = CreateSemaphore(NULL, 0, LONG_MAX, NULL);
+    if (!jobsys_sem) fail("can't create job system semaphore.");
+    
+    for (i = 0; i < nr_workers; i++) {
+        deque_ctor(&worker_deques[i]);
+    }
+    for (i = 0; i < nr_workers; i++) {
+        HANDLE hThread = CreateThread(NULL, 0, job_worker, TOPTR(i + 1), 0, NULL);
+        if (!hThread) fail("can't create job worker thread.");
+        sched_set_thread(hThread, SCHED_WORKER);
+        CloseHandle(hThread);
+    }
+    
+    add_gameloop_hook_ex(jobsys_gameloop_hook, GAMELOOP_MASK(GAMELOOP_NORMAL) | GAMELOOP_MASK(GAMELOOP_SLEEP) | GAMELOOP_MASK(GAMELOOP_DEVICELOST) | GAMELOOP_MASK(GAMELOOP_MOVIE), HOOK_PRIORITY_DEFAULT);
+}
@@ -16,6 +16,218 @@ static void write_logfile_header(FILE *fp)
     dump_all_config(fp);
 }
 
+
+// asynchronous log writer
+//   plog() puts formatted messages into a lock-free ring (bounded queue,
+//   each slot carries a sequence number), and a background thread writes
+//   them to LOG_FILE, which is kept open until atexit hooks
+//   messages are written synchronously before init_logger(), after atexit
+//   hooks, and when the ring is full; fail() drains the ring by itself,
+//   so messages before a crash are preserved
+//   after atexit hooks, LOG_FILE is opened for each message and closed again
+//   rate limit only applies to log output, warning message boxes are not limited,
+//   and messages from atexit hooks (e.g. reports) are not limited at all
+
+#define LOG_RINGSIZE 64
+#define LOG_RATELIMIT_SLOTS 256 // must be power of 2
+#define LOG_RATELIMIT_WINDOW 1000 // in ms
+#define LOG_RATELIMIT_BURST 20 // max messages from one call site in a window
+
+struct log_slot {
+    volatile LONG seq;
+    LONG lineno;
+    SYSTEMTIME time;
+    char msg[MAXLINE];
+};
+
+struct log_ratelimit_slot {
+    volatile LONG key;
+    volatile LONG window;
+    volatile LONG count;
+    volatile LONG suppressed;
+};
+
+static struct log_slot log_ring[LOG_RINGSIZE];
+static volatile LONG log_head;
+static LONG log_tail; // protected by log_cs
+static struct log_ratelimit_slot log_ratelimit_slots[LOG_RATELIMIT_SLOTS];
+
+static int log_initialized;
+static volatile LONG log_async;
+static CRITICAL_SECTION log_cs; // protects log_fp and consumer side of ring
+static HANDLE log_event;
+static FILE *log_fp;
+static int log_started; // header is written
+static int log_closed; // atexit hooks are called
+static volatile LONG log_unlimited; // atexit hooks are running
+
+static void log_lock()
+{
+    if (log_initialized) EnterCriticalSection(&log_cs);
+}
+static void log_unlock()
+{
+    if (log_initialized) LeaveCriticalSection(&log_cs);
+}
+
+static void log_write(LONG lineno, const SYSTEMTIME *t, const char *msg)
+{
+    // caller must hold log lock
+    OutputDebugString(msg);
+    if (!log_fp) {
+        if (log_started) {
+            log_fp = fopen(LOG_FILE, "a");
+            if (!log_fp) return;
+        } else {
+            log_fp = robust_fopen(LOG_FILE, "w");
+            if (!log_fp) return;
+            write_logfile_header(log_fp);
+            fputs("========== start ==========\n\n", log_fp);
+            log_started = 1;
+        }
+    }
+    fprintf(log_fp, "timestamp:\n  %04hu-%02hu-%02hu %02hu:%02hu:%02hu.%03hu\n", t->wYear, t->wMonth, t->wDay, t->wHour, t->wMinute, t->wSecond, t->wMilliseconds);
+    fputs("details:\n", log_fp);
+    fputs(msg, log_fp);
+    fputs("\n\n", log_fp);
+    if (lineno >= MAXLOGLINES) {
+        fputs("too many messages, log truncated.\n", log_fp);
+    }
+}
+
+static void log_release()
+{
+    // caller must hold log lock
+    if (!log_fp) return;
+    if (log_closed) {
+        fclose(log_fp);
+        log_fp = NULL;
+    } else {
+        fflush(log_fp);
+    }
+}
+
+static void log_drain()
+{
+    // caller must hold log lock
+    while (1) {
+        struct log_slot *s = &log_ring[(unsigned) log_tail % LOG_RINGSIZE];
+        if (s->seq != log_tail + 1) break;
+        log_write(s->lineno, &s->time, s->msg);
+        InterlockedExchange(&s->seq, log_tail + LOG_RINGSIZE);
+        log_tail++;
+    }
+    log_release();
+}
+
+static int log_push(LONG lineno, const SYSTEMTIME *t, const char *msg)
+{
+    // returns 0 if ring is full
+    LONG pos = log_head;
+    while (1) {
+        struct log_slot *s = &log_ring[(unsigned) pos % LOG_RINGSIZE];
+        LONG seq = s->seq;
+        if (seq == pos) {
+            LONG old = InterlockedCompareExchange(&log_head, pos + 1, pos);
+            if (old == pos) {
+                s->lineno = lineno;
+                s->time = *t;
+                snprintf(s->msg, sizeof(s->msg), "%s", msg);
+                InterlockedExchange(&s->seq, pos + 1);
+                return 1;
+            }
+            pos = old;
+        } else if (seq - pos < 0) {
+            return 0;
+        } else {
+            pos = log_head;
+        }
+    }
+}
+
+static int log_ratelimit(const char *file, int line, LONG *suppressed)
+{
+    // returns 0 if message should be dropped
+    // call sites are keyed by hash, sites with same hash share one limit
+    unsigned key = (TOUINT(file) ^ (line * 2654435761u)) | 1;
+    unsigned i, pos = key;
+    struct log_ratelimit_slot *s = NULL;
+    for (i = 0; i < LOG_RATELIMIT_SLOTS; i++, pos++) {
+        s = &log_ratelimit_slots[pos & (LOG_RATELIMIT_SLOTS - 1)];
+        LONG old = InterlockedCompareExchange(&s->key, key, 0);
+        if (old == 0 || (unsigned) old == key) break;
+    }
+    if (i >= LOG_RATELIMIT_SLOTS) return 1; // table full, no limit
+    if (log_unlimited) {
+        // report messages previously suppressed, but don't limit
+        *suppressed = InterlockedExchange(&s->suppressed, 0);
+        return 1;
+    }
+    
+    LONG window = GetTickCount() / LOG_RATELIMIT_WINDOW;
+    if (s->window != window && InterlockedExchange(&s->window, window) != window) {
+        InterlockedExchange(&s->count, 0);
+        *suppressed = InterlockedExchange(&s->suppressed, 0);
+    }
+    if (InterlockedIncrement(&s->count) > LOG_RATELIMIT_BURST) {
+        InterlockedIncrement(&s->suppressed);
+        return 0;
+    }
+    return 1;
+}
+
+static DWORD WINAPI log_flusher(LPVOID lpParameter)
+{
+    while (WaitForSingleObject(log_event, INFINITE) == WAIT_OBJECT_0) {
+        log_lock();
+        log_drain();
+        log_unlock();
+    }
+    return 0;
+}
+
+void flush_log()
+{
+    log_lock();
+    log_drain();
+    log_unlock();
+}
+
+static void log_atexit_begin()
+{
+    InterlockedExchange(&log_unlimited, 1);
+}
+
+static void log_atexit()
+{
+    // atexit hooks may be followed by TerminateProcess(), switch to synchronous mode
+    InterlockedExchange(&log_async, 0);
+    log_lock();
+    log_closed = 1;
+    log_drain();
+    log_unlock();
+}
+
+void init_logger()
+{
+    int i;
+    for (i = 0; i < LOG_RINGSIZE; i++) log_ring[i].seq = i;
+    InitializeCriticalSection(&log_cs);
+    log_initialized = 1;
+    add_hook_ex(HOOKID_ATEXIT, log_atexit_begin, HOOK_PRIORITY_FIRST);
+    
+    log_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!log_event) return;
+    HANDLE hThread = CreateThread(NULL, 0, log_flusher, NULL, 0, NULL);
+    if (!hThread) return;
+    sched_set_thread(hThread, SCHED_BACKGROUND);
+    CloseHandle(hThread);
+    
+    add_hook_ex(HOOKID_ATEXIT, log_atexit, HOOK_PRIORITY_LAST);
+    InterlockedExchange(&log_async, 1);
+}
+
+
 void NORETURN fail_impl(const char *file, int line, const char *func, const wchar_t *extra_msg, const wchar_t *extra_msg_title, const char *fmt, ...)
 {
     va_list ap;
@@ -27,6 +239,10 @@ void NORETURN fail_impl(const char *file, int line, const char *func, const wcha
     snprintf(msgbuf, sizeof(msgbuf), "  file: %s\n  line: %d\n  func: %s\nmessage:\n  ", file, line, func);
     len = strlen(msgbuf);
     vsnprintf(msgbuf + len, sizeof(msgbuf) - len, fmt, ap);
+    
+    // write pending log messages first
+    flush_log();
+    
     OutputDebugString(msgbuf); OutputDebugString("\n");
     FILE *fp = robust_fopen(ERROR_FILE, "w");
     if (fp) {
@@ -55,42 +271,41 @@ void NORETURN fail_impl(const char *file, int line, const char *func, const wcha
     va_end(ap);
 }
 
-static long long plog_lines = 0;
+static volatile LONG plog_lines = 0;
 static long long plog_msgboxes = 0;
 void plog_impl(int is_warning, const char *file, int line, const char *func, const char *fmt, ...)
 {
+    LONG suppressed = 0;
+    int logged = log_ratelimit(file, line, &suppressed);
+    if (!logged && !is_warning) return;
+    
     va_list ap;
     va_start(ap, fmt);
-    char buf[MAXLINE];
     char msgbuf[MAXLINE];
     int len;
     snprintf(msgbuf, sizeof(msgbuf), "  file: %s\n  line: %d\n  func: %s\nmessage:\n  ", file, line, func);
     len = strlen(msgbuf);
     vsnprintf(msgbuf + len, sizeof(msgbuf) - len, fmt, ap);
-    OutputDebugString(msgbuf); OutputDebugString("\n");
-    plog_lines++;
-    if (plog_lines <= MAXLOGLINES) {
-        FILE *fp = plog_lines > 1 ? fopen(LOG_FILE, "a") : robust_fopen(LOG_FILE, "w");
-        if (fp) {
-            if (plog_lines == 1) {
-                write_logfile_header(fp);
-                
-                fputs("========== start ==========\n\n", fp);
-            }
-            
+    if (suppressed) {
+        int msglen = strlen(msgbuf);
+        snprintf(msgbuf + msglen, sizeof(msgbuf) - msglen, "\n  (%ld similar messages from this call site were suppressed)", (long) suppressed);
+    }
+    strncat(msgbuf, "\n", sizeof(msgbuf) - strlen(msgbuf) - 1);
+    
+    LONG lineno = logged ? InterlockedIncrement(&plog_lines) : plog_lines;
+    if (lineno <= MAXLOGLINES) {
+        if (logged) {
             SYSTEMTIME SystemTime;
             GetLocalTime(&SystemTime);
-            snprintf(buf, sizeof(buf), "  %04hu-%02hu-%02hu %02hu:%02hu:%02hu.%03hu\n", SystemTime.wYear, SystemTime.wMonth, SystemTime.wDay, SystemTime.wHour, SystemTime.wMinute, SystemTime.wSecond, SystemTime.wMilliseconds);
-            fputs("timestamp:\n", fp);
-            fputs(buf, fp);
-            
-            fputs("details:\n", fp);
-            fputs(msgbuf, fp);
-            fputs("\n\n\n", fp);
-            if (plog_lines >= MAXLOGLINES) {
-                fputs("too many messages, log truncated.\n", fp);
+            if (log_async && log_push(lineno, &SystemTime, msgbuf)) {
+                SetEvent(log_event);
+            } else {
+                log_lock();
+                log_drain();
+                log_write(lineno, &SystemTime, msgbuf);
+                log_release();
+                log_unlock();
             }
-            fclose(fp);
         }
         if (is_warning) {
             if (plog_msgboxes + 1 <= MAXWARNMSGBOXES) {
@@ -108,3 +323,111 @@ void plog_impl(int is_warning, const char *file, int line, const char *func, con
     
     va_end(ap);
 }
+
+
+// startup timeline
+//   startup_begin() and startup_end() record QPC timestamps around
+//   initialization steps, steps can be nested
+//   startup_report() writes the timeline to log if 'startuptime' is enabled,
+//   steps finished after that (e.g. font preloading) are logged one by one
+
+#define STARTUP_MAXSTEPS 512
+#define STARTUP_MAXDEPTH 8
+#define STARTUP_NAMELEN 64
+
+struct startup_step {
+    char name[STARTUP_NAMELEN];
+    int depth;
+    LONGLONG begin, end;
+    unsigned nr_memcpy;
+};
+
+static LARGE_INTEGER startup_freq, startup_origin;
+static struct startup_step startup_steps[STARTUP_MAXSTEPS];
+static int startup_nsteps;
+static int startup_stack[STARTUP_MAXDEPTH];
+static int startup_depth;
+static int startup_reported;
+
+static double startup_ms(LONGLONG ticks)
+{
+    return startup_freq.QuadPart ? ticks * 1000.0 / startup_freq.QuadPart : 0.0;
+}
+
+static int startup_format_step(char *buf, size_t size, const struct startup_step *s)
+{
+    return snprintf(buf, size, "  %+10.3fms %9.3fms %6u  %*s%s\n", startup_ms(s->begin - startup_origin.QuadPart), startup_ms(s->end - s->begin), s->nr_memcpy, s->depth * 2, "", s->name);
+}
+
+void startup_begin(const char *fmt, ...)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    if (!startup_freq.QuadPart) {
+        QueryPerformanceFrequency(&startup_freq);
+        startup_origin = now;
+    }
+    
+    int idx = -1;
+    if (startup_nsteps < STARTUP_MAXSTEPS) {
+        idx = startup_nsteps++;
+        struct startup_step *s = &startup_steps[idx];
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(s->name, sizeof(s->name), fmt, ap);
+        va_end(ap);
+        s->depth = startup_depth;
+        s->begin = s->end = now.QuadPart;
+        s->nr_memcpy = memcpy_to_process_count;
+    }
+    if (startup_depth < STARTUP_MAXDEPTH) startup_stack[startup_depth] = idx;
+    startup_depth++;
+}
+
+void startup_end()
+{
+    if (startup_depth <= 0) return;
+    startup_depth--;
+    int idx = startup_depth < STARTUP_MAXDEPTH ? startup_stack[startup_depth] : -1;
+    if (idx < 0) return;
+    
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    struct startup_step *s = &startup_steps[idx];
+    s->end = now.QuadPart;
+    s->nr_memcpy = memcpy_to_process_count - s->nr_memcpy;
+    
+    if (startup_reported > 0) {
+        char buf[MAXLINE];
+        startup_format_step(buf, sizeof(buf), s);
+        str_rtrim(buf, "\n");
+        plog("startup timeline (late step):\n%s", buf);
+    }
+}
+
+void startup_report()
+{
+    if (startup_reported) return;
+    startup_reported = 1;
+    if (!get_int_from_configfile("startuptime")) {
+        // don't log late steps either
+        startup_reported = -1;
+        return;
+    }
+    
+    // log in chunks, since plog() truncates long messages
+    char buf[MAXLINE - 256];
+    int i, len = 0, part = 0;
+    for (i = 0; i <= startup_nsteps; i++) {
+        char line[STARTUP_NAMELEN + 128];
+        int n = 0;
+        if (i < startup_nsteps) n = startup_format_step(line, sizeof(line), &startup_steps[i]);
+        if (len > 0 && (i == startup_nsteps || len + n >= (int) sizeof(buf))) {
+            plog("startup timeline (part %d, offset / duration / memcpy_to_process() calls / step):\n%s", ++part, buf);
+            len = 0;
+        }
+        if (n > 0) len += snprintf(buf + len, sizeof(buf) - len, "%s", line);
+    }
+    if (startup_nsteps >= STARTUP_MAXSTEPS) plog("startup timeline: too many steps, some are not recorded.");
+    plog("startup timeline: %u memcpy_to_process() calls in total.", memcpy_to_process_count);
+}
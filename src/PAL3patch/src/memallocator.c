@@ -10,3 +10,145 @@ void init_memory_allocators()
     gb_mem_allocator = make_memory_allocator(gbmalloc, gbfree);
     patch_mem_allocator = make_memory_allocator(malloc, free);
 }
+
+// find the Win32 heap behind an allocator
+//   a probe block is allocated and searched in all process heaps
+//   the probe is big enough to skip MSVC small-block heap
+#define HEAP_PROBESIZE 65536
+#define HEAP_MAXHEAPS 64
+static int heap_contains(HANDLE heap, const void *ptr)
+{
+    PROCESS_HEAP_ENTRY e;
+    int found = 0;
+    if (!HeapLock(heap)) return 0;
+    e.lpData = NULL;
+    while (HeapWalk(heap, &e)) {
+        if ((e.wFlags & PROCESS_HEAP_ENTRY_BUSY) && TOUINT(ptr) - TOUINT(e.lpData) < e.cbData) {
+            found = 1;
+            break;
+        }
+    }
+    HeapUnlock(heap);
+    return found;
+}
+HANDLE find_allocator_heap(const struct memory_allocator *allocator)
+{
+    HANDLE list[HEAP_MAXHEAPS];
+    HANDLE ret = NULL;
+    void *probe = allocator->malloc(HEAP_PROBESIZE);
+    if (!probe) return NULL;
+    DWORD i, n = imin(GetProcessHeaps(HEAP_MAXHEAPS, list), HEAP_MAXHEAPS);
+    for (i = 0; i < n; i++) {
+        if (heap_contains(list[i], probe)) {
+            ret = list[i];
+            break;
+        }
+    }
+    allocator->free(probe);
+    return ret;
+}
+
+
+
+// arena allocator
+
+#define MEM_ARENA_ALIGN 8
+#define FRAME_ARENA_CHUNKSIZE 65536
+
+struct mem_arena_chunk {
+    struct mem_arena_chunk *next;
+    size_t size;
+    size_t used;
+    size_t last; // offset of most recent allocation
+};
+#define MEM_ARENA_ROUNDUP(size) (((size) + (MEM_ARENA_ALIGN - 1)) & ~(size_t) (MEM_ARENA_ALIGN - 1))
+#define MEM_ARENA_CHUNKDATA(chunk) PTRADD((chunk), MEM_ARENA_ROUNDUP(sizeof(struct mem_arena_chunk)))
+
+static struct mem_arena_chunk *mem_arena_newchunk(size_t size)
+{
+    struct mem_arena_chunk *chunk = malloc(MEM_ARENA_ROUNDUP(sizeof(struct mem_arena_chunk)) + size);
+    if (!chunk) fail("out of memory for arena chunk of %u bytes.", (unsigned) size);
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = chunk->last = 0;
+    return chunk;
+}
+void mem_arena_ctor(struct mem_arena *arena, size_t chunk_size)
+{
+    arena->head = NULL;
+    arena->chunk_size = chunk_size;
+}
+void mem_arena_dtor(struct mem_arena *arena)
+{
+    struct mem_arena_chunk *chunk, *next;
+    for (chunk = arena->head; chunk; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    arena->head = NULL;
+}
+void *mem_arena_alloc(struct mem_arena *arena, size_t size)
+{
+    struct mem_arena_chunk *chunk = arena->head;
+    size = MEM_ARENA_ROUNDUP(size);
+    if (!chunk || chunk->size - chunk->used < size) {
+        // new chunk is at least twice as large as previous one
+        size_t chunk_size = chunk ? chunk->size * 2 : arena->chunk_size;
+        while (chunk_size < size) chunk_size *= 2;
+        chunk = mem_arena_newchunk(chunk_size);
+        chunk->next = arena->head;
+        arena->head = chunk;
+    }
+    chunk->last = chunk->used;
+    chunk->used += size;
+    return PTRADD(MEM_ARENA_CHUNKDATA(chunk), chunk->last);
+}
+void mem_arena_free(struct mem_arena *arena, void *ptr)
+{
+    // allocation and free in pairs don't consume arena space
+    struct mem_arena_chunk *chunk = arena->head;
+    if (chunk && ptr == PTRADD(MEM_ARENA_CHUNKDATA(chunk), chunk->last)) {
+        chunk->used = chunk->last;
+    }
+}
+void mem_arena_reset(struct mem_arena *arena)
+{
+    // if more than one chunk is used, replace them with a single chunk
+    // so next round can be served from one chunk
+    struct mem_arena_chunk *chunk = arena->head;
+    if (!chunk) return;
+    if (chunk->next) {
+        size_t total = 0;
+        for (; chunk; chunk = chunk->next) total += chunk->size;
+        mem_arena_dtor(arena);
+        arena->head = mem_arena_newchunk(total);
+    } else {
+        chunk->used = chunk->last = 0;
+    }
+}
+
+
+// per-frame arena
+
+struct mem_arena frame_mem_arena;
+struct memory_allocator frame_mem_allocator;
+
+static void *frame_malloc(size_t size)
+{
+    return mem_arena_alloc(&frame_mem_arena, size);
+}
+static void frame_free(void *ptr)
+{
+    mem_arena_free(&frame_mem_arena, ptr);
+}
+static void frame_arena_gameloop_hook(void *arg)
+{
+    mem_arena_reset(&frame_mem_arena);
+}
+
+void init_memory_arenas()
+{
+    mem_arena_ctor(&frame_mem_arena, FRAME_ARENA_CHUNKSIZE);
+    frame_mem_allocator = make_memory_allocator(frame_malloc, frame_free);
+    add_gameloop_hook_ex(frame_arena_gameloop_hook, GAMELOOP_MASK(GAMELOOP_NORMAL) | GAMELOOP_MASK(GAMELOOP_SLEEP) | GAMELOOP_MASK(GAMELOOP_DEVICELOST) | GAMELOOP_MASK(GAMELOOP_MOVIE), HOOK_PRIORITY_FIRST);
+}
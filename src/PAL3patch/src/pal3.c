@@ -98,7 +98,7 @@ void ensure_cooperative_level(int requirefocus)
 
 // load image bits from file in memory, using D3DX
 // will allocate memory from given allocator
-void *load_image_bits(void *filedata, unsigned filelen, int *width, int *height, int *bitcount, const struct memory_allocator *mem_allocator)
+void *load_image_bits(const void *filedata, unsigned filelen, int *width, int *height, int *bitcount, const struct memory_allocator *mem_allocator)
 {
     D3DXIMAGE_INFO img_info;
     D3DLOCKED_RECT lrc;
@@ -175,6 +175,51 @@ const char *vfs_cpkname()
     return cpkname ? cpkname : "";
 }
 
+// find the loaded CPK object which uses given file handle
+// will return NULL if not found
+struct CPK *vfs_findcpk(HANDLE hFile)
+{
+    struct CPK *cpks[] = {
+        g_pVFileSys ? &g_pVFileSys->m_cpk : NULL,
+        &g_bink.m_Cpk,
+        &g_bink.m_Cpk2,
+        &SoundMgr_Inst()->m_Cpk,
+    };
+    unsigned i;
+    for (i = 0; i < sizeof(cpks) / sizeof(cpks[0]); i++) {
+        if (cpks[i] && cpks[i]->m_bLoaded && cpks[i]->m_dwCPKHandle == TOUINT(hFile)) {
+            return cpks[i];
+        }
+    }
+    return NULL;
+}
+
+// check if views of given CPK are mapped with given handle
+// it is the mapping handle, or the file handle under nommapcpk
+int is_cpk_handle(struct CPK *cpk, HANDLE hFileMappingObject)
+{
+    return cpk->m_bLoaded && (cpk->m_dwCPKMappingHandle == TOUINT(hFileMappingObject) || cpk->m_dwCPKHandle == TOUINT(hFileMappingObject));
+}
+
+// find the loaded CPK object which maps views with given handle
+// will return NULL if not found
+struct CPK *vfs_findcpk_mapping(HANDLE hFileMappingObject)
+{
+    struct CPK *cpks[] = {
+        g_pVFileSys ? &g_pVFileSys->m_cpk : NULL,
+        &g_bink.m_Cpk,
+        &g_bink.m_Cpk2,
+        &SoundMgr_Inst()->m_Cpk,
+    };
+    unsigned i;
+    for (i = 0; i < sizeof(cpks) / sizeof(cpks[0]); i++) {
+        if (cpks[i] && is_cpk_handle(cpks[i], hFileMappingObject)) {
+            return cpks[i];
+        }
+    }
+    return NULL;
+}
+
 void clamp_rect(void *bits, int width, int height, int bitcount, int pitch, int left, int top, int right, int bottom)
 {
     int i, j;
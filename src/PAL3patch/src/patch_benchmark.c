@@ -0,0 +1,464 @@
+#include "common.h"
+
+// benchmark mode
+//   flag = 1: record, flag = 2: replay
+//   PAL3::Update() is always given a fixed deltaTime, and fpslimit is disabled
+//   keyboard state and cursor position of each frame are recorded to BENCHMARK_FILE,
+//   together with keyboard and mouse window messages and the frame they arrived in,
+//   and fed back to game in replay mode, game quits when replay ends
+//   while replaying, real keyboard and mouse messages are discarded
+//   a summary is written to BENCHMARK_RESULT at exit,
+//   and time of each frame is written to BENCHMARK_TRACE, so runs can be diffed
+//
+//   each combat in the run is also reported on its own, with its frame times
+//   and texture/effect load times (from hitchlog_event()), so a replay made in
+//   combat editor (testcombat) gives repeatable numbers of each combat setup
+//
+//   NOTE: DirectInput mouse state is not recorded
+//         game's random numbers are not controlled, so scripts with random
+//         behaviour may differ between runs
+//
+//   file layout:
+//     struct benchmark_filehdr
+//     { DWORD index, struct benchmark_frame } [nr_changes] (only frames differ from previous one)
+//     struct benchmark_msg [nr_msgs]
+
+#define BENCHMARK_FILE "PAL3patch.benchmark"
+#define BENCHMARK_RESULT "PAL3patch.benchmark.txt"
+#define BENCHMARK_TRACE "PAL3patch.benchmark.csv"
+#define BENCHMARK_MAGIC 0x4B484342 // "BCHK"
+#define BENCHMARK_VERSION 2
+#define BENCHMARK_LONGFRAME_MS 250.0 // frames longer than this are counted as loading
+#define BENCHMARK_MAXCOMBAT 64
+
+enum {
+    BENCHMARK_RECORD = 1,
+    BENCHMARK_REPLAY = 2,
+};
+
+struct benchmark_filehdr {
+    unsigned magic;
+    unsigned version;
+    unsigned fps;
+    unsigned nr_frames;
+    unsigned nr_changes;
+    unsigned nr_msgs;
+};
+struct benchmark_frame {
+    POINT cursor;
+    BYTE keyraw[256];
+};
+struct benchmark_msg {
+    unsigned frame; // index of frame which follows this message
+    UINT msg;
+    WPARAM wParam;
+    LPARAM lParam;
+};
+struct benchmark_combat {
+    unsigned first, last; // range of frametime[]
+    LONGLONG begin, end;
+    double texture_ms, effect_ms;
+    unsigned textures, effects;
+};
+
+// PROCESS_MEMORY_COUNTERS from psapi.h
+struct myPROCESS_MEMORY_COUNTERS {
+    DWORD cb;
+    DWORD PageFaultCount;
+    SIZE_T PeakWorkingSetSize;
+    SIZE_T WorkingSetSize;
+    SIZE_T QuotaPeakPagedPoolUsage;
+    SIZE_T QuotaPagedPoolUsage;
+    SIZE_T QuotaPeakNonPagedPoolUsage;
+    SIZE_T QuotaNonPagedPoolUsage;
+    SIZE_T PagefileUsage;
+    SIZE_T PeakPagefileUsage;
+};
+
+static int bench_mode;
+static unsigned bench_fps;
+static float bench_dt;
+static struct benchmark_frame *frames;
+static unsigned nr_frames, max_frames;
+static unsigned cur_frame; // index of frame being updated
+static int bench_done;
+static struct bvec msgs; // struct benchmark_msg
+static unsigned cur_msg; // next message to replay
+static int injecting;
+
+static LARGE_INTEGER qpc_freq, qpc_begin, qpc_last;
+static double *frametime; // in ms
+static unsigned nr_frametime, max_frametime;
+static unsigned nr_longframes;
+static double longframe_ms;
+
+int benchmark_enabled = 0;
+static DWORD bench_threadid;
+static struct benchmark_combat combats[BENCHMARK_MAXCOMBAT];
+static unsigned nr_combats;
+static int in_combat;
+static int update_pending; // cur_frame should be increased after update
+
+static struct benchmark_frame *get_frame(unsigned idx)
+{
+    if (bench_mode == BENCHMARK_REPLAY) return idx < nr_frames ? &frames[idx] : NULL;
+    
+    // record mode, grow frame list
+    if (idx >= max_frames) {
+        unsigned new_max = imax(max_frames * 2, 4096);
+        struct benchmark_frame *new_frames = realloc(frames, new_max * sizeof(struct benchmark_frame));
+        if (!new_frames) return NULL;
+        memset(new_frames + max_frames, 0, (new_max - max_frames) * sizeof(struct benchmark_frame));
+        frames = new_frames;
+        max_frames = new_max;
+    }
+    if (idx >= nr_frames) nr_frames = idx + 1;
+    return &frames[idx];
+}
+
+static void add_frametime(double ms)
+{
+    if (nr_frametime >= max_frametime) {
+        unsigned new_max = imax(max_frametime * 2, 4096);
+        double *new_frametime = realloc(frametime, new_max * sizeof(double));
+        if (!new_frametime) return;
+        frametime = new_frametime;
+        max_frametime = new_max;
+    }
+    frametime[nr_frametime++] = ms;
+    if (ms >= BENCHMARK_LONGFRAME_MS) {
+        nr_longframes++;
+        longframe_ms += ms;
+    }
+}
+
+static int double_cmp(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+void benchmark_event(int type, LONGLONG begin, LONGLONG end)
+{
+    // only loads of game thread during combat are counted
+    if (!in_combat || bench_done || GetCurrentThreadId() != bench_threadid) return;
+    struct benchmark_combat *c = &combats[nr_combats - 1];
+    double ms = (end - begin) * 1000.0 / qpc_freq.QuadPart;
+    switch (type) {
+        case HITCHLOG_TEXTURE: c->texture_ms += ms; c->textures++; break;
+        case HITCHLOG_EFFECT: c->effect_ms += ms; c->effects++; break;
+    }
+}
+
+static void update_combat(LARGE_INTEGER now)
+{
+    int combat = PAL3_s_gamestate == GAME_COMBAT;
+    if (combat == in_combat) return;
+    if (combat) {
+        if (nr_combats >= BENCHMARK_MAXCOMBAT) return;
+        struct benchmark_combat *c = &combats[nr_combats++];
+        memset(c, 0, sizeof(*c));
+        c->first = nr_frametime;
+        c->begin = now.QuadPart;
+    } else {
+        struct benchmark_combat *c = &combats[nr_combats - 1];
+        c->last = nr_frametime;
+        c->end = now.QuadPart;
+    }
+    in_combat = combat;
+}
+
+static void write_combat_result(FILE *fp)
+{
+    unsigned i, j;
+    for (i = 0; i < nr_combats; i++) {
+        struct benchmark_combat *c = &combats[i];
+        if (i == nr_combats - 1 && in_combat) {
+            // combat is not finished when benchmark ends
+            LARGE_INTEGER now;
+            QueryPerformanceCounter(&now);
+            c->last = nr_frametime;
+            c->end = now.QuadPart;
+        }
+        unsigned n = c->last - c->first;
+        fprintf(fp, "combat %u: frames %u, time %.3fs", i + 1, n, (c->end - c->begin) / (double) qpc_freq.QuadPart);
+        if (n > 0) {
+            double *t = malloc(n * sizeof(double));
+            if (t) {
+                double sum = 0;
+                memcpy(t, frametime + c->first, n * sizeof(double));
+                for (j = 0; j < n; j++) sum += t[j];
+                qsort(t, n, sizeof(double), double_cmp);
+                fprintf(fp, ", avg %.3fms, p99 %.3fms, max %.3fms", sum / n, t[imin(n * 99 / 100, n - 1)], t[n - 1]);
+                free(t);
+            }
+        }
+        fprintf(fp, ", textures %u %.3fms, effects %u %.3fms\n", c->textures, c->texture_ms, c->effects, c->effect_ms);
+    }
+}
+
+static void write_trace()
+{
+    FILE *fp = robust_fopen(BENCHMARK_TRACE, "w");
+    unsigned i;
+    if (!fp) goto fail;
+    fprintf(fp, "frame,ms\n");
+    for (i = 0; i < nr_frametime; i++) {
+        fprintf(fp, "%u,%.3f\n", i, frametime[i]);
+    }
+    if (safe_fclose(&fp) != 0) goto fail;
+    return;
+fail:
+    warning("can't write benchmark trace file '%s'.", BENCHMARK_TRACE);
+}
+
+static void write_result()
+{
+    FILE *fp = robust_fopen(BENCHMARK_RESULT, "w");
+    if (!fp) {
+        warning("can't write benchmark result file '%s'.", BENCHMARK_RESULT);
+        return;
+    }
+    
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    fprintf(fp, "%s %s\n", bench_mode == BENCHMARK_REPLAY ? "replay" : "record", patch_version);
+    fprintf(fp, "%s\n", build_info);
+    fprintf(fp, "fixed fps: %u\n", bench_fps);
+    fprintf(fp, "frames: %u\n", nr_frametime);
+    fprintf(fp, "total time: %.3fs\n", (now.QuadPart - qpc_begin.QuadPart) / (double) qpc_freq.QuadPart);
+    
+    // must before frametime[] is sorted
+    write_combat_result(fp);
+    write_trace();
+    
+    unsigned n = nr_frametime;
+    if (n > 0) {
+        double sum = 0;
+        unsigned i;
+        for (i = 0; i < n; i++) sum += frametime[i];
+        qsort(frametime, n, sizeof(double), double_cmp);
+        fprintf(fp, "frame time avg: %.3fms\n", sum / n);
+        fprintf(fp, "frame time min: %.3fms\n", frametime[0]);
+        fprintf(fp, "frame time median: %.3fms\n", frametime[n / 2]);
+        fprintf(fp, "frame time p99: %.3fms\n", frametime[imin(n * 99 / 100, n - 1)]);
+        fprintf(fp, "frame time p99.9: %.3fms\n", frametime[imin(n * 999 / 1000, n - 1)]);
+        fprintf(fp, "frame time max: %.3fms\n", frametime[n - 1]);
+        fprintf(fp, "average fps: %.3f\n", n * 1000.0 / sum);
+    }
+    fprintf(fp, "long frames (>=%.0fms, loading): %u, %.3fs\n", BENCHMARK_LONGFRAME_MS, nr_longframes, longframe_ms / 1000.0);
+    
+    HMODULE hPsapi = LoadLibrary("PSAPI.DLL");
+    BOOL (WINAPI *myGetProcessMemoryInfo)(HANDLE, struct myPROCESS_MEMORY_COUNTERS *, DWORD) = hPsapi ? (void *) GetProcAddress(hPsapi, "GetProcessMemoryInfo") : NULL;
+    struct myPROCESS_MEMORY_COUNTERS pmc;
+    memset(&pmc, 0, sizeof(pmc));
+    pmc.cb = sizeof(pmc);
+    if (myGetProcessMemoryInfo && myGetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+        fprintf(fp, "peak working set: %.1fMB\n", pmc.PeakWorkingSetSize / 1048576.0);
+        fprintf(fp, "peak pagefile usage: %.1fMB\n", pmc.PeakPagefileUsage / 1048576.0);
+    } else {
+        fprintf(fp, "peak memory: unknown\n");
+    }
+    
+    if (safe_fclose(&fp) != 0) {
+        warning("can't write benchmark result file '%s'.", BENCHMARK_RESULT);
+    }
+}
+
+static void save_record()
+{
+    FILE *fp = robust_fopen(BENCHMARK_FILE, "wb");
+    if (!fp) goto fail;
+    struct benchmark_filehdr hdr = {
+        .magic = BENCHMARK_MAGIC,
+        .version = BENCHMARK_VERSION,
+        .fps = bench_fps,
+        .nr_frames = nr_frames,
+        .nr_msgs = bvec_tsize(&msgs, struct benchmark_msg),
+    };
+    DWORD i;
+    for (i = 0; i < nr_frames; i++) {
+        if (i == 0 || memcmp(&frames[i], &frames[i - 1], sizeof(struct benchmark_frame)) != 0) hdr.nr_changes++;
+    }
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    for (i = 0; i < nr_frames; i++) {
+        if (i == 0 || memcmp(&frames[i], &frames[i - 1], sizeof(struct benchmark_frame)) != 0) {
+            fwrite(&i, sizeof(i), 1, fp);
+            fwrite(&frames[i], sizeof(struct benchmark_frame), 1, fp);
+        }
+    }
+    fwrite(bvec_tdata(&msgs, struct benchmark_msg), sizeof(struct benchmark_msg), hdr.nr_msgs, fp);
+    if (safe_fclose(&fp) != 0) goto fail;
+    plog("benchmark: %u frames (%u changed), %u messages recorded.", hdr.nr_frames, hdr.nr_changes, hdr.nr_msgs);
+    return;
+fail:
+    warning("can't write benchmark record file '%s'.", BENCHMARK_FILE);
+}
+
+static int load_record()
+{
+    FILE *fp = robust_fopen(BENCHMARK_FILE, "rb");
+    if (!fp) return 0;
+    struct benchmark_filehdr hdr;
+    struct benchmark_msg m;
+    DWORD i, index, last = 0;
+    int ret = 0;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != BENCHMARK_MAGIC || hdr.version != BENCHMARK_VERSION || hdr.fps == 0) goto done;
+    if (hdr.nr_changes > hdr.nr_frames || (hdr.nr_frames && !hdr.nr_changes)) goto done;
+    frames = malloc(imax(hdr.nr_frames, 1) * sizeof(struct benchmark_frame));
+    if (!frames) goto done;
+    
+    // expand changed frames, unchanged frames are copies of previous one
+    for (i = 0; i < hdr.nr_changes; i++) {
+        if (fread(&index, sizeof(index), 1, fp) != 1) goto done;
+        if (index >= hdr.nr_frames || (i == 0 ? index != 0 : index <= last)) goto done;
+        for (; last + 1 < index; last++) frames[last + 1] = frames[last];
+        if (fread(&frames[index], sizeof(struct benchmark_frame), 1, fp) != 1) goto done;
+        last = index;
+    }
+    for (; last + 1 < hdr.nr_frames; last++) frames[last + 1] = frames[last];
+    for (i = 0; i < hdr.nr_msgs; i++) {
+        if (fread(&m, sizeof(m), 1, fp) != 1) goto done;
+        bvec_tpushback(&msgs, &m, struct benchmark_msg);
+    }
+    nr_frames = max_frames = hdr.nr_frames;
+    bench_fps = hdr.fps; // replay must use the same timestep
+    ret = 1;
+done:
+    fclose(fp);
+    return ret;
+}
+
+static void benchmark_updatebegin_hook(void *arg)
+{
+    struct game_loop_hook_data *hookarg = arg;
+    LARGE_INTEGER now;
+    *(float *) hookarg->data = bench_dt;
+    if (bench_done) return;
+    update_pending = 1;
+    
+    QueryPerformanceCounter(&now);
+    if (qpc_last.QuadPart) add_frametime((now.QuadPart - qpc_last.QuadPart) * 1000.0 / qpc_freq.QuadPart);
+    qpc_last = now;
+    update_combat(now);
+    
+    if (bench_mode == BENCHMARK_REPLAY && cur_frame >= nr_frames) {
+        // replay finished
+        bench_done = 1;
+        write_result();
+        plog("benchmark: replay finished, %u frames.", nr_frames);
+        PostQuitMessage(0);
+    }
+    if (bench_mode == BENCHMARK_REPLAY && !bench_done) {
+        // feed messages which arrived before this frame
+        unsigned n = bvec_tsize(&msgs, struct benchmark_msg);
+        for (; cur_msg < n && bvec_tat(&msgs, cur_msg, struct benchmark_msg).frame <= cur_frame; cur_msg++) {
+            struct benchmark_msg *m = &bvec_tat(&msgs, cur_msg, struct benchmark_msg);
+            injecting = 1;
+            SendMessage(game_hwnd, m->msg, m->wParam, m->lParam);
+            injecting = 0;
+        }
+    }
+}
+
+static void benchmark_updateend_hook(void *arg)
+{
+    if (update_pending) {
+        cur_frame++;
+        update_pending = 0;
+    }
+}
+
+static int is_input_msg(UINT msg)
+{
+    switch (msg) {
+        case WM_KEYDOWN:
+        case WM_KEYUP:
+        case WM_SYSKEYDOWN:
+        case WM_SYSKEYUP:
+        case WM_CHAR:
+        case WM_SYSCHAR:
+            return 1;
+    }
+    return WM_MOUSEFIRST <= msg && msg <= WM_MOUSELAST;
+}
+
+static void benchmark_prewndproc_hook(void *arg)
+{
+    struct wndproc_hook_data *wp = arg;
+    if (bench_done || !is_input_msg(wp->Msg)) return;
+    if (bench_mode == BENCHMARK_REPLAY) {
+        // only replayed messages are passed to game
+        if (!injecting) {
+            wp->retvalue = 0;
+            wp->processed = 1;
+        }
+    } else {
+        struct benchmark_msg m = { cur_frame, wp->Msg, wp->wParam, wp->lParam };
+        bvec_tpushback(&msgs, &m, struct benchmark_msg);
+    }
+}
+
+static void benchmark_grpkbdstate_hook()
+{
+    struct benchmark_frame *f = get_frame(cur_frame);
+    if (!f || bench_done) return;
+    if (bench_mode == BENCHMARK_REPLAY) {
+        memcpy(g_input.m_keyRaw, f->keyraw, sizeof(f->keyraw));
+    } else {
+        memcpy(f->keyraw, g_input.m_keyRaw, sizeof(f->keyraw));
+    }
+}
+
+static void benchmark_getcursorpos_hook(void *arg)
+{
+    POINT *ppoint = arg;
+    struct benchmark_frame *f = get_frame(cur_frame);
+    if (!f || bench_done) return;
+    if (bench_mode == BENCHMARK_REPLAY) {
+        *ppoint = f->cursor;
+    } else {
+        f->cursor = *ppoint;
+    }
+}
+
+static void benchmark_atexit()
+{
+    if (bench_mode == BENCHMARK_RECORD) save_record();
+    if (!bench_done) write_result();
+}
+
+MAKE_PATCHSET(benchmark)
+{
+    bench_mode = flag;
+    bench_fps = imax(get_int_from_configfile("benchmark_fps"), 1);
+    bvec_ctor(&msgs);
+    if (bench_mode == BENCHMARK_REPLAY) {
+        if (!load_record()) {
+            warning("can't load benchmark record file '%s', benchmark disabled.", BENCHMARK_FILE);
+            return;
+        }
+    } else if (bench_mode != BENCHMARK_RECORD) {
+        fail("unknown flag %d for benchmark.", flag);
+    }
+    bench_dt = 1.0f / bench_fps;
+    if (!QueryPerformanceFrequency(&qpc_freq)) {
+        fail("can't query performance frequency for benchmark.");
+    }
+    QueryPerformanceCounter(&qpc_begin);
+    bench_threadid = GetCurrentThreadId();
+    
+    disable_fpslimit();
+    
+    // fixed timestep must override other hooks, e.g. smoothdelta
+    add_gameloop_hook_ex(benchmark_updatebegin_hook, GAMELOOP_MASK(GAMEEVENT_UPDATE_ATBEGIN), HOOK_PRIORITY_LAST);
+    add_gameloop_hook_filtered(benchmark_updateend_hook, GAMELOOP_MASK(GAMEEVENT_UPDATE_ATEND));
+    
+    // cursor hook must run after other cursor hooks, since we record the final position
+    add_grpkbdstate_hook(benchmark_grpkbdstate_hook);
+    add_getcursorpos_hook(benchmark_getcursorpos_hook);
+    add_prewndproc_hook(benchmark_prewndproc_hook);
+    add_atexit_hook(benchmark_atexit);
+    
+    benchmark_enabled = 1;
+}
@@ -186,5 +186,5 @@ static MAKE_THISCALL(bool, _TextureLib_Data_GetLibInfo_wrapper, struct _TextureL
 MAKE_PATCHSET(clampuilib)
 {
     INIT_WRAPPER_CALL(_TextureLib_Data_GetLibInfo_wrapper, { 0x0044F19A });
-    add_texture_hook(texlib_loader);
+    add_texture_hook_filtered(texlib_loader, NULL, make_texture_hook_magic(TEXLIB_MAGIC), NULL);
 }
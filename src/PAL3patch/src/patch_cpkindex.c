@@ -0,0 +1,287 @@
+#include "common.h"
+
+// hash index for CPK tables
+//   every CPK lookup (CPK::Open() of scene, movie, sound and base data CPKs) finds
+//   the table entry by binary search on CRC of lower case path, that is ~15 probes per layer,
+//   and most probes of a layered lookup are misses in layers which don't have the file
+//   CPK::GetTableIndexFromCRC() is replaced by an open-addressing table per CPK object,
+//   a miss stops at the first empty slot, so both hits and misses take about one probe
+//
+//   engine reads tables with ReadFile(), we hook it in GBENGINE's IAT (after cpktblcache
+//   and modoverlay, so tables served from cache are seen too), and a read into an indexed
+//   CPK object marks its index stale, handle and size of the table are checked as well
+//   original function is probed once with fake tables before it is replaced,
+//   the patch is not applied if the results differ from ours
+//   for equal CRCs, we learn whether engine returns the lowest index or the binary search
+//   midpoint, and look up such CRCs the same way
+//
+//   CRC of the path is still computed by engine (see fastcrc32), memoizing paths would cost
+//   a string hash per lookup, which is as expensive as the CRC itself
+
+#define CPKIDX_MAXCPK 8
+
+struct cpkidx {
+    struct CPK *cpk; // only compared, object may be freed when engine is shutting down
+    char name[sizeof(((struct CPK *) 0)->m_szCPKFileName)];
+    unsigned lastuse;
+    volatile LONG stale;
+
+    // statistics
+    unsigned nr_hit, nr_miss, nr_rebuild;
+
+    // fingerprint of indexed table
+    ULONG handle;
+    int num;
+
+    // open-addressing table, stores index to m_CPKTable, -1 means empty
+    int *slot;
+    unsigned mask;
+};
+
+static struct cpkidx cpkidx_list[CPKIDX_MAXCPK];
+static int cpkidx_count;
+static unsigned cpkidx_clock;
+static unsigned cpkidx_nr_unloaded, cpkidx_nr_recycled;
+static int cpkidx_notfound = -1; // learned from original function
+static int cpkidx_dupmid; // learned from original function, equal CRCs return midpoint
+static BOOL (WINAPI *ReadFile_next)(HANDLE, LPVOID, DWORD, LPDWORD, LPOVERLAPPED);
+
+static void cpkidx_report_one(struct cpkidx *idx)
+{
+    plog("  %s: %u hits, %u misses, %u rebuilds, %d entries.", idx->name, idx->nr_hit, idx->nr_miss, idx->nr_rebuild, idx->num);
+}
+
+static void cpkidx_report()
+{
+    int i;
+    plog("cpk index: %d CPKs, %u recycled, %u lookups on unloaded CPKs.", cpkidx_count, cpkidx_nr_recycled, cpkidx_nr_unloaded);
+    for (i = 0; i < cpkidx_count; i++) {
+        if (cpkidx_list[i].cpk) cpkidx_report_one(&cpkidx_list[i]);
+    }
+}
+
+static int cpkidx_tablenum(struct CPK *cpk)
+{
+    // same bound as engine's binary search
+    return imin(cpk->m_CPKHeader.dwValidTableNum, sizeof(cpk->m_CPKTable) / sizeof(cpk->m_CPKTable[0]));
+}
+
+static int cpkidx_valid(struct cpkidx *idx)
+{
+    struct CPK *cpk = idx->cpk;
+    return !idx->stale && idx->handle == cpk->m_dwCPKHandle && idx->num == cpkidx_tablenum(cpk);
+}
+
+static BOOL WINAPI ReadFile_cpkindex(HANDLE hFile, LPVOID lpBuffer, DWORD nNumberOfBytesToRead, LPDWORD lpNumberOfBytesRead, LPOVERLAPPED lpOverlapped)
+{
+    BOOL ret = ReadFile_next(hFile, lpBuffer, nNumberOfBytesToRead, lpNumberOfBytesRead, lpOverlapped);
+    int i;
+    for (i = 0; i < cpkidx_count; i++) {
+        struct CPK *cpk = cpkidx_list[i].cpk;
+        if (cpk && PTRADD(lpBuffer, nNumberOfBytesToRead) > (void *) cpk && lpBuffer < (void *) (cpk + 1)) {
+            InterlockedExchange(&cpkidx_list[i].stale, 1);
+        }
+    }
+    return ret;
+}
+
+static int cpkidx_rebuild(struct cpkidx *idx)
+{
+    struct CPK *cpk = idx->cpk;
+    int num = cpkidx_tablenum(cpk);
+    unsigned size = 64;
+    int i;
+    while (size < (unsigned) num * 2) size <<= 1;
+
+    if (!idx->slot || idx->mask + 1 != size) {
+        free(idx->slot);
+        idx->slot = malloc(size * sizeof(int));
+        if (!idx->slot) return 0;
+        idx->mask = size - 1;
+    }
+    memset(idx->slot, -1, size * sizeof(int));
+    InterlockedExchange(&idx->stale, 0);
+
+    // insert in table order, so lowest index of equal CRCs is probed first
+    for (i = 0; i < num; i++) {
+        unsigned pos = cpk->m_CPKTable[i].dwCRC & idx->mask;
+        while (idx->slot[pos] >= 0) pos = (pos + 1) & idx->mask;
+        idx->slot[pos] = i;
+    }
+
+    idx->handle = cpk->m_dwCPKHandle;
+    idx->num = num;
+    strcpy(idx->name, cpk->m_szCPKFileName);
+    idx->nr_rebuild++;
+    return 1;
+}
+
+static struct cpkidx *cpkidx_get(struct CPK *cpk)
+{
+    int i;
+    struct cpkidx *idx = NULL;
+    for (i = 0; i < cpkidx_count; i++) {
+        if (cpkidx_list[i].cpk == cpk) {
+            idx = &cpkidx_list[i];
+            break;
+        }
+    }
+    if (!idx) {
+        if (cpkidx_count < CPKIDX_MAXCPK) {
+            idx = &cpkidx_list[cpkidx_count++];
+        } else {
+            // recycle least recently used one
+            idx = &cpkidx_list[0];
+            for (i = 1; i < cpkidx_count && idx->cpk; i++) {
+                if (!cpkidx_list[i].cpk || cpkidx_list[i].lastuse < idx->lastuse) idx = &cpkidx_list[i];
+            }
+            if (idx->cpk) {
+                cpkidx_report_one(idx);
+                cpkidx_nr_recycled++;
+            }
+            free(idx->slot);
+        }
+        memset(idx, 0, sizeof(*idx));
+        idx->cpk = cpk;
+        if (!cpkidx_rebuild(idx)) {
+            idx->cpk = NULL;
+            return NULL;
+        }
+    }
+    idx->lastuse = ++cpkidx_clock;
+
+    if (!cpkidx_valid(idx) && !cpkidx_rebuild(idx)) {
+        idx->cpk = NULL;
+        return NULL;
+    }
+    return idx;
+}
+
+static int cpkidx_lowerbound(struct CPK *cpk, unsigned long crc)
+{
+    int lo = 0, hi = cpkidx_tablenum(cpk);
+    int n = hi;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cpk->m_CPKTable[mid].dwCRC < crc) lo = mid + 1; else hi = mid;
+    }
+    return lo < n && cpk->m_CPKTable[lo].dwCRC == crc ? lo : cpkidx_notfound;
+}
+
+static int cpkidx_midpoint(struct CPK *cpk, unsigned long crc)
+{
+    int lo = 0, hi = cpkidx_tablenum(cpk) - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (cpk->m_CPKTable[mid].dwCRC == crc) return mid;
+        if (cpk->m_CPKTable[mid].dwCRC < crc) lo = mid + 1; else hi = mid - 1;
+    }
+    return cpkidx_notfound;
+}
+
+static int cpkidx_bsearch(struct CPK *cpk, unsigned long crc)
+{
+    return cpkidx_dupmid ? cpkidx_midpoint(cpk, crc) : cpkidx_lowerbound(cpk, crc);
+}
+
+static MAKE_THISCALL(int, CPK_GetTableIndexFromCRC, struct CPK *this, unsigned long crc)
+{
+    int i;
+    struct cpkidx *idx;
+    if (!this->m_bLoaded) {
+        // table may be half loaded, don't index it
+        cpkidx_nr_unloaded++;
+        return cpkidx_bsearch(this, crc);
+    }
+    idx = cpkidx_get(this);
+    if (!idx) return cpkidx_bsearch(this, crc);
+    unsigned pos;
+    for (pos = crc & idx->mask; (i = idx->slot[pos]) >= 0; pos = (pos + 1) & idx->mask) {
+        if (this->m_CPKTable[i].dwCRC == crc) {
+            idx->nr_hit++;
+            // i is the lowest index of equal CRCs, engine may return another one
+            if (cpkidx_dupmid && i + 1 < idx->num && this->m_CPKTable[i + 1].dwCRC == crc) return cpkidx_midpoint(this, crc);
+            return i;
+        }
+    }
+    idx->nr_miss++;
+    return cpkidx_notfound;
+}
+
+static int cpkidx_probe(unsigned addr)
+{
+    // run original function on small fake tables, check hits, misses and bounds
+    static const unsigned long crcs[] = { 0x10, 0x20, 0x30, 0x40, 0x50 };
+    static const unsigned long tests[] = { 0x00, 0x10, 0x18, 0x30, 0x50, 0x60, 0x70 };
+    // tables with equal CRCs (zero terminated), lowest index and midpoint differ in each of them
+    static const unsigned long dups[][9] = {
+        { 0x10, 0x20, 0x20, 0x20, 0x20, 0x20, 0x30 },
+        { 0x20, 0x20, 0x20, 0x30, 0x40 },
+        { 0x10, 0x20, 0x40, 0x40, 0x40, 0x40, 0x40, 0x50 },
+        { 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10 },
+    };
+    struct CPK *cpk = calloc(1, sizeof(struct CPK));
+    int i, j, n, ret = 1, miss = -1, first_miss = 1, lower_ok = 1, mid_ok = 1;
+    if (!cpk) return 0;
+    for (i = 0; i < 6; i++) cpk->m_CPKTable[i].dwCRC = i < 5 ? crcs[i] : 0x60; // entry 5 is out of bound
+    cpk->m_CPKHeader.dwValidTableNum = 5;
+    cpk->m_bLoaded = 1;
+    for (i = 0; i < (int) (sizeof(tests) / sizeof(tests[0])); i++) {
+        int r = THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(addr, int, struct CPK *, unsigned long), cpk, tests[i]);
+        int expected = -2;
+        for (j = 0; j < 5; j++) {
+            if (crcs[j] == tests[i]) expected = j;
+        }
+        if (expected == -2) {
+            // not found, all misses must agree, and must not look like an index in bound
+            if (first_miss) miss = r, first_miss = 0;
+            if (r != miss || (r >= 0 && r < 5)) ret = 0;
+        } else if (r != expected) {
+            ret = 0;
+        }
+    }
+    if (ret) {
+        cpkidx_notfound = miss;
+        for (i = 0; i < (int) (sizeof(dups) / sizeof(dups[0])); i++) {
+            for (n = 0; n < 9 && dups[i][n]; n++);
+            for (j = 0; j < 9; j++) cpk->m_CPKTable[j].dwCRC = dups[i][j];
+            cpk->m_CPKHeader.dwValidTableNum = n;
+            for (j = 0; j < n; j++) {
+                unsigned long crc = dups[i][j];
+                int r = THISCALL_WRAPPER(MAKE_THISCALL_FUNCPTR(addr, int, struct CPK *, unsigned long), cpk, crc);
+                if (r != cpkidx_lowerbound(cpk, crc)) lower_ok = 0;
+                if (r != cpkidx_midpoint(cpk, crc)) mid_ok = 0;
+            }
+        }
+        if (lower_ok) {
+            cpkidx_dupmid = 0;
+        } else if (mid_ok) {
+            cpkidx_dupmid = 1;
+        } else {
+            ret = 0;
+        }
+    }
+    free(cpk);
+    return ret;
+}
+
+MAKE_PATCHSET(cpkindex)
+{
+    if (is_win9x()) {
+        // IAT patching is not compatible with KernelEx
+        warning("cpkindex doesn't support win9x.");
+        return;
+    }
+    void *func = GetProcAddress(GetModuleHandle("GBENGINE.DLL"), "?GetTableIndexFromCRC@CPK@@AAEHK@Z");
+    if (!func) {
+        warning("can't find CPK::GetTableIndexFromCRC(), cpkindex is not applied.");
+        return;
+    }
+    if (!cpkidx_probe(TOUINT(func))) {
+        warning("CPK::GetTableIndexFromCRC() behaves unexpectedly, cpkindex is not applied.");
+        return;
+    }
+    add_atexit_hook(cpkidx_report);
+    ReadFile_next = hook_import_table(TOPTR(gboffset + 0x10000000), "KERNEL32.DLL", "ReadFile", ReadFile_cpkindex);
+    make_jmp(TOUINT(func), CPK_GetTableIndexFromCRC);
+}
@@ -0,0 +1,1148 @@
+#include "common.h"
+
+// deferred Direct3D 9 command submission
+//   device calls made by game thread are recorded to a command queue,
+//   and replayed in order by a render thread, so driver overhead of a frame
+//   overlaps game update of next frame
+//   device is created with D3DCREATE_MULTITHREADED, so calls made directly
+//   on other threads are serialized by Direct3D runtime
+//   both CreateDevice() and CreateDeviceEx() are wrapped, so it works with d3d9ex
+//
+//   device is given a modified copy of its vtable
+//     state setting, drawing, Clear(), BeginScene(), EndScene() and Present() are recorded
+//     every other method is a sync point: a thunk waits until queue is drained,
+//     then jumps to original method, so Get*(), Create*(), Reset() etc. see
+//     same device state as without queue
+//   objects created by device are also given modified vtables
+//     LockRect(), LockBox() and GetDC() of textures and surfaces are sync points
+//     Lock() of buffers is a sync point, unless D3DLOCK_NOOVERWRITE is used
+//     with d3dthread=2, D3DLOCK_DISCARD locks of buffers are deferred instead:
+//       Lock() gives staging memory, Unlock() records an upload, which does
+//       the real lock and copy on render thread, so per-frame dynamic geometry
+//       doesn't drain the queue, later locks of that buffer wait its last upload
+//     Apply() and Capture() of state blocks, Issue() of queries are recorded
+//     GetData() of a query waits until its last Issue() is replayed
+//
+//   recorded calls return D3D_OK, Present() returns result of last replayed one
+//   objects referenced by recorded calls are kept alive until replayed
+//   calls between BeginStateBlock() and EndStateBlock(), calls on other threads,
+//   and calls too large for queue are made directly after sync
+//   at most one frame is queued, Present() waits until last one is replayed
+//   GPU timings (e.g. showfps_gputime) are measured on replay, one frame late
+//
+//   device is hooked before other post-create hooks, so their wrappers
+//   are on top of ours, and still run on game thread
+
+#define D3DTHREAD_QUEUESIZE (4 * 1048576)
+#define D3DTHREAD_MAXCMD (D3DTHREAD_QUEUESIZE / 4)
+#define D3DTHREAD_MAXARGS 8
+#define D3DTHREAD_MAXCOPIES 2
+#define D3DTHREAD_MAXREFS 2
+#define D3DTHREAD_MAXCLASSES 32
+#define D3DTHREAD_QUERYMAP 256
+#define D3DTHREAD_MAXLOCKS 16
+#define D3DTHREAD_BUFFERMAP 256
+
+// a call, described by wrappers
+struct dt_call {
+    void *func;
+    void *obj;
+    int nargs;
+    DWORD args[D3DTHREAD_MAXARGS];
+
+    // pointer arguments, data is copied to queue
+    int nr_copies;
+    struct {
+        int arg;
+        unsigned size;
+    } copies[D3DTHREAD_MAXCOPIES];
+
+    // objects referenced until replayed
+    int nr_refs;
+    IUnknown *refs[D3DTHREAD_MAXREFS];
+
+    int present;
+};
+
+// a recorded call in queue, followed by copied data
+struct dt_cmd {
+    unsigned size; // size of whole command, zero means wrap to queue head
+    void *func;
+    void *obj;
+    int nargs;
+    DWORD args[D3DTHREAD_MAXARGS];
+    IUnknown *refs[D3DTHREAD_MAXREFS];
+    int present;
+};
+
+// a patched object class
+struct dt_class {
+    void **orig; // vtable of original class
+    void **vtbl; // our copy, vtbl[-1] is orig
+};
+
+static unsigned char *dt_queue;
+static volatile LONG dt_wpos, dt_rpos; // byte offsets in queue
+static volatile LONG dt_cmd_seq, dt_done_seq; // number of recorded and replayed commands
+static volatile LONG dt_idle, dt_nr_waiting, dt_quit;
+static HANDLE dt_data_event, dt_done_event, dt_thread;
+static DWORD dt_game_tid, dt_render_tid;
+static int dt_running, dt_recording, dt_mt;
+static LONG dt_present_seq;
+static volatile HRESULT dt_present_hr;
+
+static struct dt_class dt_classes[D3DTHREAD_MAXCLASSES];
+static int dt_nr_classes;
+static CRITICAL_SECTION dt_class_cs;
+
+static struct {
+    IDirect3DQuery9 *query;
+    LONG seq;
+} dt_querymap[D3DTHREAD_QUERYMAP];
+
+// deferred buffer locks, only touched by game thread
+static int dt_deferlock;
+static struct dt_lock {
+    void *buffer;
+    void *func; // upload function
+    unsigned char *data;
+    UINT offset, size;
+    DWORD flags;
+    int nested;
+} dt_locks[D3DTHREAD_MAXLOCKS];
+
+// last upload of each buffer, protected by dt_class_cs
+static struct {
+    void *buffer;
+    LONG seq;
+} dt_buffermap[D3DTHREAD_BUFFERMAP];
+static LONG dt_buffermap_evicted; // newest upload whose entry is overwritten
+
+static struct perfcounter *dt_pc_cmds, *dt_pc_direct, *dt_pc_failed, *dt_pc_sync, *dt_pc_deferlock;
+
+static const GUID dt_IID_IDirect3D9Ex = { 0x02177241, 0x69FC, 0x400C, { 0x8F, 0xF1, 0x93, 0xA4, 0x4D, 0xF6, 0x86, 0x1D } };
+
+// big enough for both IDirect3D9 and IDirect3D9Ex
+static IDirect3D9ExVtbl d3d9_vtbl;
+static IDirect3D9 *(WINAPI *Real_Direct3DCreate9)(UINT);
+static HRESULT (STDMETHODCALLTYPE *Real_CreateDevice)(IDirect3D9 *, UINT, D3DDEVTYPE, HWND, DWORD, D3DPRESENT_PARAMETERS *, IDirect3DDevice9 **);
+static HRESULT (STDMETHODCALLTYPE *Real_CreateDeviceEx)(IDirect3D9Ex *, UINT, D3DDEVTYPE, HWND, DWORD, D3DPRESENT_PARAMETERS *, D3DDISPLAYMODEEX *, IDirect3DDevice9Ex **);
+
+// big enough for both IDirect3DDevice9 and IDirect3DDevice9Ex
+static IDirect3DDevice9ExVtbl device_vtbl, real_device_vtbl;
+#define REAL ((IDirect3DDevice9Vtbl *) &real_device_vtbl)
+
+#define DT_SLOT(type, method) (offsetof(type, method) / sizeof(void *))
+#define DT_ORIG(obj, type) ((type *) ((void **) (obj)->lpVtbl)[-1])
+
+
+
+// queue and render thread
+
+static HRESULT dt_invoke(void *func, void *obj, const DWORD *a, int n)
+{
+    // all arguments are 32-bit, so a method can be called as taking DWORDs
+    switch (n) {
+        case 0: return ((HRESULT (STDMETHODCALLTYPE *)(void *)) func)(obj);
+        case 1: return ((HRESULT (STDMETHODCALLTYPE *)(void *, DWORD)) func)(obj, a[0]);
+        case 2: return ((HRESULT (STDMETHODCALLTYPE *)(void *, DWORD, DWORD)) func)(obj, a[0], a[1]);
+        case 3: return ((HRESULT (STDMETHODCALLTYPE *)(void *, DWORD, DWORD, DWORD)) func)(obj, a[0], a[1], a[2]);
+        case 4: return ((HRESULT (STDMETHODCALLTYPE *)(void *, DWORD, DWORD, DWORD, DWORD)) func)(obj, a[0], a[1], a[2], a[3]);
+        case 6: return ((HRESULT (STDMETHODCALLTYPE *)(void *, DWORD, DWORD, DWORD, DWORD, DWORD, DWORD)) func)(obj, a[0], a[1], a[2], a[3], a[4], a[5]);
+        case 8: return ((HRESULT (STDMETHODCALLTYPE *)(void *, DWORD, DWORD, DWORD, DWORD, DWORD, DWORD, DWORD, DWORD)) func)(obj, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+        default: fail("invalid argument count %d.", n);
+    }
+}
+
+static void dt_execute(struct dt_cmd *c)
+{
+    int i;
+    HRESULT hr = dt_invoke(c->func, c->obj, c->args, c->nargs);
+    if (c->present) {
+        dt_present_hr = hr;
+    } else if (FAILED(hr)) {
+        // calls may legally fail while device is lost
+        perfcounter_add(dt_pc_failed, 1);
+    }
+    for (i = 0; i < D3DTHREAD_MAXREFS; i++) {
+        if (c->refs[i]) c->refs[i]->lpVtbl->Release(c->refs[i]);
+    }
+}
+
+static DWORD WINAPI dt_thread_proc(LPVOID lpParameter)
+{
+    if (chrometrace_enabled) chrometrace_thread_name("d3d thread");
+    sched_set_thread(GetCurrentThread(), SCHED_GAME);
+    while (1) {
+        LONG r = dt_rpos;
+        if (r == dt_wpos) {
+            // announce we are idle, then check again before sleeping
+            InterlockedExchange(&dt_idle, 1);
+            if (r == dt_wpos) {
+                if (dt_quit) break;
+                WaitForSingleObject(dt_data_event, INFINITE);
+            }
+            InterlockedExchange(&dt_idle, 0);
+            continue;
+        }
+
+        struct dt_cmd *c = (struct dt_cmd *) (dt_queue + r);
+        unsigned size = c->size;
+        if (!size) {
+            InterlockedExchange(&dt_rpos, 0);
+            continue;
+        }
+        dt_execute(c);
+        InterlockedExchange(&dt_rpos, r + size);
+        InterlockedIncrement(&dt_done_seq);
+        if (dt_nr_waiting) SetEvent(dt_done_event);
+    }
+    return 0;
+}
+
+// wait until command 'seq' is replayed
+static void dt_wait(LONG seq)
+{
+    if (dt_done_seq - seq >= 0 || GetCurrentThreadId() == dt_render_tid) return;
+
+    LARGE_INTEGER freq, begin, end;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&begin);
+    InterlockedIncrement(&dt_nr_waiting);
+    while (dt_done_seq - seq < 0) {
+        // timeout in case event is consumed by other waiter
+        WaitForSingleObject(dt_done_event, 1);
+    }
+    InterlockedDecrement(&dt_nr_waiting);
+    QueryPerformanceCounter(&end);
+    perfcounter_sample(dt_pc_sync, (end.QuadPart - begin.QuadPart) * 1000.0 / freq.QuadPart);
+}
+
+// wait until queue is drained, called by sync thunks
+static void dt_sync(void)
+{
+    if (dt_running) dt_wait(dt_cmd_seq);
+}
+
+// alloc contiguous space at queue tail, only game thread records
+static struct dt_cmd *dt_alloc(unsigned size)
+{
+    while (1) {
+        LONG w = dt_wpos, r = dt_rpos;
+        // tail never reaches head, so wpos == rpos means empty
+        if (w >= r) {
+            if (w + size < D3DTHREAD_QUEUESIZE) return (struct dt_cmd *) (dt_queue + w);
+            if ((LONG) size < r) {
+                ((struct dt_cmd *) (dt_queue + w))->size = 0;
+                InterlockedExchange(&dt_wpos, 0);
+                continue;
+            }
+        } else {
+            if (w + (LONG) size < r) return (struct dt_cmd *) (dt_queue + w);
+        }
+        // queue is full, wait render thread
+        dt_wait(dt_done_seq + 1);
+    }
+}
+
+static void dt_wake(void)
+{
+    if (InterlockedCompareExchange(&dt_idle, 0, 1) == 1) SetEvent(dt_data_event);
+}
+
+static int dt_can_defer(void)
+{
+    return dt_running && !dt_recording && GetCurrentThreadId() == dt_game_tid;
+}
+
+static HRESULT dt_record(struct dt_call *c)
+{
+    unsigned size = sizeof(struct dt_cmd);
+    int i;
+
+    for (i = 0; i < c->nr_copies; i++) {
+        if (c->args[c->copies[i].arg]) size += (c->copies[i].size + 3) & ~3;
+    }
+    if (!dt_can_defer() || size > D3DTHREAD_MAXCMD) {
+        perfcounter_add(dt_pc_direct, 1);
+        dt_sync();
+        return dt_invoke(c->func, c->obj, c->args, c->nargs);
+    }
+
+    struct dt_cmd *cmd = dt_alloc(size);
+    unsigned char *data = (unsigned char *) (cmd + 1);
+    cmd->size = size;
+    cmd->func = c->func;
+    cmd->obj = c->obj;
+    cmd->nargs = c->nargs;
+    cmd->present = c->present;
+    memcpy(cmd->args, c->args, sizeof(cmd->args));
+    for (i = 0; i < c->nr_copies; i++) {
+        DWORD *arg = &cmd->args[c->copies[i].arg];
+        if (*arg) {
+            memcpy(data, TOPTR(*arg), c->copies[i].size);
+            *arg = TOUINT(data);
+            data += (c->copies[i].size + 3) & ~3;
+        }
+    }
+    memset(cmd->refs, 0, sizeof(cmd->refs));
+    for (i = 0; i < c->nr_refs; i++) {
+        if (c->refs[i]) c->refs[i]->lpVtbl->AddRef(c->refs[i]);
+        cmd->refs[i] = c->refs[i];
+    }
+
+    InterlockedExchange(&dt_wpos, dt_wpos + size);
+    InterlockedIncrement(&dt_cmd_seq);
+    perfcounter_add(dt_pc_cmds, 1);
+    dt_wake();
+    return D3D_OK;
+}
+
+static void dt_copy(struct dt_call *c, int arg, unsigned size)
+{
+    c->copies[c->nr_copies].arg = arg;
+    c->copies[c->nr_copies].size = size;
+    c->nr_copies++;
+}
+
+static void dt_ref(struct dt_call *c, void *obj)
+{
+    c->refs[c->nr_refs++] = obj;
+}
+
+static DWORD f2dw(float f)
+{
+    union { float f; DWORD d; } u;
+    u.f = f;
+    return u.d;
+}
+
+static unsigned dt_vertexcount(D3DPRIMITIVETYPE PrimitiveType, UINT PrimitiveCount)
+{
+    switch (PrimitiveType) {
+        case D3DPT_POINTLIST: return PrimitiveCount;
+        case D3DPT_LINELIST: return PrimitiveCount * 2;
+        case D3DPT_LINESTRIP: return PrimitiveCount + 1;
+        case D3DPT_TRIANGLELIST: return PrimitiveCount * 3;
+        case D3DPT_TRIANGLESTRIP: return PrimitiveCount + 2;
+        case D3DPT_TRIANGLEFAN: return PrimitiveCount + 2;
+        default: return 0;
+    }
+}
+
+// thunk for a sync point: PUSHAD; CALL dt_sync; POPAD; JMP [slot]
+static void *dt_sync_thunk(void *slot)
+{
+    unsigned char *code = alloc_dyncode_buffer(13);
+    code[0] = 0x60;
+    code[1] = 0xE8;
+    *(unsigned *) (code + 2) = TOUINT(dt_sync) - TOUINT(code + 6);
+    code[6] = 0x61;
+    code[7] = 0xFF;
+    code[8] = 0x25;
+    memcpy(code + 9, &slot, 4);
+    flush_instruction_cache(code, 13);
+    return code;
+}
+
+
+
+// object classes
+
+static void dt_patch_object(void *obj, unsigned size, void (*setup)(void **vtbl, void **orig))
+{
+    void ***pvtbl = obj;
+    int i;
+
+    EnterCriticalSection(&dt_class_cs);
+    for (i = 0; i < dt_nr_classes; i++) {
+        if (*pvtbl == dt_classes[i].vtbl) goto done;
+        if (*pvtbl == dt_classes[i].orig) break;
+    }
+    if (i == dt_nr_classes) {
+        if (dt_nr_classes >= D3DTHREAD_MAXCLASSES) {
+            // unpatched objects still work, but their locks don't sync
+            warning("too many object classes for d3d thread.");
+            goto done;
+        }
+        void **block = malloc(sizeof(void *) + size);
+        if (!block) fail("out of memory.");
+        block[0] = *pvtbl;
+        memcpy(block + 1, *pvtbl, size);
+        setup(block + 1, *pvtbl);
+        dt_classes[i].orig = *pvtbl;
+        dt_classes[i].vtbl = block + 1;
+        dt_nr_classes++;
+    }
+    *pvtbl = dt_classes[i].vtbl;
+done:
+    LeaveCriticalSection(&dt_class_cs);
+}
+
+static unsigned dt_bufferhash(void *buffer)
+{
+    return (TOUINT(buffer) >> 4) % D3DTHREAD_BUFFERMAP;
+}
+
+static void dt_mark_buffer(void *buffer, LONG seq)
+{
+    unsigned h = dt_bufferhash(buffer);
+    EnterCriticalSection(&dt_class_cs);
+    if (dt_buffermap[h].buffer && dt_buffermap[h].buffer != buffer) dt_buffermap_evicted = dt_buffermap[h].seq;
+    dt_buffermap[h].buffer = buffer;
+    dt_buffermap[h].seq = seq;
+    LeaveCriticalSection(&dt_class_cs);
+}
+
+// wait until last upload of buffer is replayed
+static void dt_wait_buffer(void *buffer)
+{
+    if (!dt_deferlock) return;
+    unsigned h = dt_bufferhash(buffer);
+    LONG seq;
+    EnterCriticalSection(&dt_class_cs);
+    seq = dt_buffermap[h].buffer == buffer ? dt_buffermap[h].seq : dt_buffermap_evicted;
+    LeaveCriticalSection(&dt_class_cs);
+    if (dt_running) dt_wait(seq);
+}
+
+static struct dt_lock *dt_find_lock(void *buffer)
+{
+    int i;
+    for (i = 0; i < D3DTHREAD_MAXLOCKS; i++) {
+        if (dt_locks[i].buffer == buffer) return &dt_locks[i];
+    }
+    return NULL;
+}
+
+// try to defer a lock, size of whole buffer is already resolved
+// return non-zero if lock is handled, result is stored to 'hr'
+static int dt_defer_lock(void *buffer, void *func, UINT OffsetToLock, UINT SizeToLock, void **ppbData, DWORD Flags, HRESULT *hr)
+{
+    if (!dt_deferlock || GetCurrentThreadId() != dt_game_tid) return 0;
+    
+    // nested lock of a deferred buffer must stay in staging memory
+    struct dt_lock *l = dt_find_lock(buffer);
+    if (l) {
+        if (OffsetToLock < l->offset || OffsetToLock + SizeToLock > l->offset + l->size) {
+            *hr = D3DERR_INVALIDCALL;
+        } else {
+            l->nested++;
+            *ppbData = l->data + (OffsetToLock - l->offset);
+            *hr = D3D_OK;
+        }
+        return 1;
+    }
+    
+    if (!(Flags & D3DLOCK_DISCARD) || (Flags & D3DLOCK_READONLY) || !dt_can_defer()) return 0;
+    if (!SizeToLock || SizeToLock > D3DTHREAD_MAXCMD - sizeof(struct dt_cmd)) return 0;
+    l = dt_find_lock(NULL);
+    if (!l) return 0;
+    l->data = malloc(SizeToLock);
+    if (!l->data) return 0;
+    l->buffer = buffer;
+    l->func = func;
+    l->offset = OffsetToLock;
+    l->size = SizeToLock;
+    l->flags = Flags;
+    l->nested = 0;
+    *ppbData = l->data;
+    *hr = D3D_OK;
+    perfcounter_add(dt_pc_deferlock, 1);
+    return 1;
+}
+
+// record upload of a deferred lock, return non-zero if buffer is deferred
+static int dt_defer_unlock(void *buffer)
+{
+    if (!dt_deferlock || GetCurrentThreadId() != dt_game_tid) return 0;
+    struct dt_lock *l = dt_find_lock(buffer);
+    if (!l) return 0;
+    if (l->nested) {
+        l->nested--;
+        return 1;
+    }
+    
+    // made directly after sync if device is no longer deferring
+    struct dt_call c = { l->func, buffer, 4, { l->offset, l->size, l->flags, TOUINT(l->data) } };
+    dt_copy(&c, 3, l->size);
+    dt_ref(&c, buffer);
+    dt_record(&c);
+    dt_mark_buffer(buffer, dt_cmd_seq);
+    free(l->data);
+    memset(l, 0, sizeof(*l));
+    return 1;
+}
+
+static HRESULT STDMETHODCALLTYPE VB_Upload(IDirect3DVertexBuffer9 *This, UINT OffsetToLock, UINT SizeToLock, DWORD Flags, const void *pData)
+{
+    void *ptr;
+    HRESULT hr = DT_ORIG(This, IDirect3DVertexBuffer9Vtbl)->Lock(This, OffsetToLock, SizeToLock, &ptr, Flags);
+    if (FAILED(hr)) return hr;
+    memcpy(ptr, pData, SizeToLock);
+    return DT_ORIG(This, IDirect3DVertexBuffer9Vtbl)->Unlock(This);
+}
+
+static HRESULT STDMETHODCALLTYPE IB_Upload(IDirect3DIndexBuffer9 *This, UINT OffsetToLock, UINT SizeToLock, DWORD Flags, const void *pData)
+{
+    void *ptr;
+    HRESULT hr = DT_ORIG(This, IDirect3DIndexBuffer9Vtbl)->Lock(This, OffsetToLock, SizeToLock, &ptr, Flags);
+    if (FAILED(hr)) return hr;
+    memcpy(ptr, pData, SizeToLock);
+    return DT_ORIG(This, IDirect3DIndexBuffer9Vtbl)->Unlock(This);
+}
+
+static HRESULT STDMETHODCALLTYPE VB_Lock_wrapper(IDirect3DVertexBuffer9 *This, UINT OffsetToLock, UINT SizeToLock, void **ppbData, DWORD Flags)
+{
+    HRESULT hr;
+    UINT size = SizeToLock;
+    D3DVERTEXBUFFER_DESC desc;
+    if (!size && dt_deferlock && SUCCEEDED(DT_ORIG(This, IDirect3DVertexBuffer9Vtbl)->GetDesc(This, &desc)) && desc.Size > OffsetToLock) size = desc.Size - OffsetToLock;
+    if (dt_defer_lock(This, VB_Upload, OffsetToLock, size, ppbData, Flags, &hr)) return hr;
+    
+    if (!(Flags & D3DLOCK_NOOVERWRITE)) dt_sync(); else dt_wait_buffer(This);
+    return DT_ORIG(This, IDirect3DVertexBuffer9Vtbl)->Lock(This, OffsetToLock, SizeToLock, ppbData, Flags);
+}
+
+static HRESULT STDMETHODCALLTYPE VB_Unlock_wrapper(IDirect3DVertexBuffer9 *This)
+{
+    if (dt_defer_unlock(This)) return D3D_OK;
+    return DT_ORIG(This, IDirect3DVertexBuffer9Vtbl)->Unlock(This);
+}
+
+static HRESULT STDMETHODCALLTYPE IB_Lock_wrapper(IDirect3DIndexBuffer9 *This, UINT OffsetToLock, UINT SizeToLock, void **ppbData, DWORD Flags)
+{
+    HRESULT hr;
+    UINT size = SizeToLock;
+    D3DINDEXBUFFER_DESC desc;
+    if (!size && dt_deferlock && SUCCEEDED(DT_ORIG(This, IDirect3DIndexBuffer9Vtbl)->GetDesc(This, &desc)) && desc.Size > OffsetToLock) size = desc.Size - OffsetToLock;
+    if (dt_defer_lock(This, IB_Upload, OffsetToLock, size, ppbData, Flags, &hr)) return hr;
+    
+    if (!(Flags & D3DLOCK_NOOVERWRITE)) dt_sync(); else dt_wait_buffer(This);
+    return DT_ORIG(This, IDirect3DIndexBuffer9Vtbl)->Lock(This, OffsetToLock, SizeToLock, ppbData, Flags);
+}
+
+static HRESULT STDMETHODCALLTYPE IB_Unlock_wrapper(IDirect3DIndexBuffer9 *This)
+{
+    if (dt_defer_unlock(This)) return D3D_OK;
+    return DT_ORIG(This, IDirect3DIndexBuffer9Vtbl)->Unlock(This);
+}
+
+static void dt_setup_surface(void **vtbl, void **orig)
+{
+    vtbl[DT_SLOT(IDirect3DSurface9Vtbl, LockRect)] = dt_sync_thunk(&orig[DT_SLOT(IDirect3DSurface9Vtbl, LockRect)]);
+    vtbl[DT_SLOT(IDirect3DSurface9Vtbl, GetDC)] = dt_sync_thunk(&orig[DT_SLOT(IDirect3DSurface9Vtbl, GetDC)]);
+}
+
+static void dt_patch_surface(IDirect3DSurface9 *surf)
+{
+    if (surf) dt_patch_object(surf, sizeof(IDirect3DSurface9Vtbl), dt_setup_surface);
+}
+
+static HRESULT STDMETHODCALLTYPE Texture_GetSurfaceLevel_wrapper(IDirect3DTexture9 *This, UINT Level, IDirect3DSurface9 **ppSurfaceLevel)
+{
+    HRESULT hr = DT_ORIG(This, IDirect3DTexture9Vtbl)->GetSurfaceLevel(This, Level, ppSurfaceLevel);
+    if (SUCCEEDED(hr)) dt_patch_surface(*ppSurfaceLevel);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE CubeTexture_GetCubeMapSurface_wrapper(IDirect3DCubeTexture9 *This, D3DCUBEMAP_FACES FaceType, UINT Level, IDirect3DSurface9 **ppCubeMapSurface)
+{
+    HRESULT hr = DT_ORIG(This, IDirect3DCubeTexture9Vtbl)->GetCubeMapSurface(This, FaceType, Level, ppCubeMapSurface);
+    if (SUCCEEDED(hr)) dt_patch_surface(*ppCubeMapSurface);
+    return hr;
+}
+
+static void dt_setup_texture(void **vtbl, void **orig)
+{
+    vtbl[DT_SLOT(IDirect3DTexture9Vtbl, LockRect)] = dt_sync_thunk(&orig[DT_SLOT(IDirect3DTexture9Vtbl, LockRect)]);
+    ((IDirect3DTexture9Vtbl *) vtbl)->GetSurfaceLevel = Texture_GetSurfaceLevel_wrapper;
+}
+
+static void dt_setup_cubetexture(void **vtbl, void **orig)
+{
+    vtbl[DT_SLOT(IDirect3DCubeTexture9Vtbl, LockRect)] = dt_sync_thunk(&orig[DT_SLOT(IDirect3DCubeTexture9Vtbl, LockRect)]);
+    ((IDirect3DCubeTexture9Vtbl *) vtbl)->GetCubeMapSurface = CubeTexture_GetCubeMapSurface_wrapper;
+}
+
+static void dt_setup_volumetexture(void **vtbl, void **orig)
+{
+    vtbl[DT_SLOT(IDirect3DVolumeTexture9Vtbl, LockBox)] = dt_sync_thunk(&orig[DT_SLOT(IDirect3DVolumeTexture9Vtbl, LockBox)]);
+}
+
+static void dt_setup_vertexbuffer(void **vtbl, void **orig)
+{
+    ((IDirect3DVertexBuffer9Vtbl *) vtbl)->Lock = VB_Lock_wrapper;
+    ((IDirect3DVertexBuffer9Vtbl *) vtbl)->Unlock = VB_Unlock_wrapper;
+}
+
+static void dt_setup_indexbuffer(void **vtbl, void **orig)
+{
+    ((IDirect3DIndexBuffer9Vtbl *) vtbl)->Lock = IB_Lock_wrapper;
+    ((IDirect3DIndexBuffer9Vtbl *) vtbl)->Unlock = IB_Unlock_wrapper;
+}
+
+static HRESULT STDMETHODCALLTYPE StateBlock_Capture_wrapper(IDirect3DStateBlock9 *This)
+{
+    struct dt_call c = { DT_ORIG(This, IDirect3DStateBlock9Vtbl)->Capture, This, 0 };
+    dt_ref(&c, This);
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE StateBlock_Apply_wrapper(IDirect3DStateBlock9 *This)
+{
+    struct dt_call c = { DT_ORIG(This, IDirect3DStateBlock9Vtbl)->Apply, This, 0 };
+    dt_ref(&c, This);
+    return dt_record(&c);
+}
+
+static void dt_setup_stateblock(void **vtbl, void **orig)
+{
+    ((IDirect3DStateBlock9Vtbl *) vtbl)->Capture = StateBlock_Capture_wrapper;
+    ((IDirect3DStateBlock9Vtbl *) vtbl)->Apply = StateBlock_Apply_wrapper;
+}
+
+static unsigned dt_queryhash(IDirect3DQuery9 *query)
+{
+    return (TOUINT(query) >> 4) % D3DTHREAD_QUERYMAP;
+}
+
+static HRESULT STDMETHODCALLTYPE Query_Issue_wrapper(IDirect3DQuery9 *This, DWORD dwIssueFlags)
+{
+    struct dt_call c = { DT_ORIG(This, IDirect3DQuery9Vtbl)->Issue, This, 1, { dwIssueFlags } };
+    dt_ref(&c, This);
+    HRESULT hr = dt_record(&c);
+
+    unsigned h = dt_queryhash(This);
+    EnterCriticalSection(&dt_class_cs);
+    dt_querymap[h].query = This;
+    dt_querymap[h].seq = dt_cmd_seq;
+    LeaveCriticalSection(&dt_class_cs);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE Query_GetData_wrapper(IDirect3DQuery9 *This, void *pData, DWORD dwSize, DWORD dwGetDataFlags)
+{
+    // if last issue is overwritten by other query, wait whole queue
+    unsigned h = dt_queryhash(This);
+    LONG seq;
+    EnterCriticalSection(&dt_class_cs);
+    seq = dt_querymap[h].query == This ? dt_querymap[h].seq : dt_cmd_seq;
+    LeaveCriticalSection(&dt_class_cs);
+    if (dt_running) dt_wait(seq);
+    return DT_ORIG(This, IDirect3DQuery9Vtbl)->GetData(This, pData, dwSize, dwGetDataFlags);
+}
+
+static void dt_setup_query(void **vtbl, void **orig)
+{
+    ((IDirect3DQuery9Vtbl *) vtbl)->Issue = Query_Issue_wrapper;
+    ((IDirect3DQuery9Vtbl *) vtbl)->GetData = Query_GetData_wrapper;
+}
+
+
+
+// device methods which are recorded
+
+static HRESULT STDMETHODCALLTYPE SetRenderState_wrapper(IDirect3DDevice9 *This, D3DRENDERSTATETYPE State, DWORD Value)
+{
+    struct dt_call c = { REAL->SetRenderState, This, 2, { State, Value } };
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE SetTextureStageState_wrapper(IDirect3DDevice9 *This, DWORD Stage, D3DTEXTURESTAGESTATETYPE Type, DWORD Value)
+{
+    struct dt_call c = { REAL->SetTextureStageState, This, 3, { Stage, Type, Value } };
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE SetSamplerState_wrapper(IDirect3DDevice9 *This, DWORD Sampler, D3DSAMPLERSTATETYPE Type, DWORD Value)
+{
+    struct dt_call c = { REAL->SetSamplerState, This, 3, { Sampler, Type, Value } };
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE SetTexture_wrapper(IDirect3DDevice9 *This, DWORD Stage, IDirect3DBaseTexture9 *pTexture)
+{
+    struct dt_call c = { REAL->SetTexture, This, 2, { Stage, TOUINT(pTexture) } };
+    dt_ref(&c, pTexture);
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE SetTransform_wrapper(IDirect3DDevice9 *This, D3DTRANSFORMSTATETYPE State, const D3DMATRIX *pMatrix)
+{
+    struct dt_call c = { REAL->SetTransform, This, 2, { State, TOUINT(pMatrix) } };
+    dt_copy(&c, 1, sizeof(D3DMATRIX));
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE MultiplyTransform_wrapper(IDirect3DDevice9 *This, D3DTRANSFORMSTATETYPE State, const D3DMATRIX *pMatrix)
+{
+    struct dt_call c = { REAL->MultiplyTransform, This, 2, { State, TOUINT(pMatrix) } };
+    dt_copy(&c, 1, sizeof(D3DMATRIX));
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE SetViewport_wrapper(IDirect3DDevice9 *This, const D3DVIEWPORT9 *pViewport)
+{
+    struct dt_call c = { REAL->SetViewport, This, 1, { TOUINT(pViewport) } };
+    dt_copy(&c, 0, sizeof(D3DVIEWPORT9));
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE SetMaterial_wrapper(IDirect3DDevice9 *This, const D3DMATERIAL9 *pMaterial)
+{
+    struct dt_call c = { REAL->SetMaterial, This, 1, { TOUINT(pMaterial) } };
+    dt_copy(&c, 0, sizeof(D3DMATERIAL9));
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE SetLight_wrapper(IDirect3DDevice9 *This, DWORD Index, const D3DLIGHT9 *pLight)
+{
+    struct dt_call c = { REAL->SetLight, This, 2, { Index, TOUINT(pLight) } };
+    dt_copy(&c, 1, sizeof(D3DLIGHT9));
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE LightEnable_wrapper(IDirect3DDevice9 *This, DWORD Index, BOOL Enable)
+{
+    struct dt_call c = { REAL->LightEnable, This, 2, { Index, Enable } };
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE SetClipPlane_wrapper(IDirect3DDevice9 *This, DWORD Index, const float *pPlane)
+{
+    struct dt_call c = { REAL->SetClipPlane, This, 2, { Index, TOUINT(pPlane) } };
+    dt_copy(&c, 1, 4 * sizeof(float));
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE SetScissorRect_wrapper(IDirect3DDevice9 *This, const RECT *pRect)
+{
+    struct dt_call c = { REAL->SetScissorRect, This, 1, { TOUINT(pRect) } };
+    dt_copy(&c, 0, sizeof(RECT));
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE SetRenderTarget_wrapper(IDirect3DDevice9 *This, DWORD RenderTargetIndex, IDirect3DSurface9 *pRenderTarget)
+{
+    struct dt_call c = { REAL->SetRenderTarget, This, 2, { RenderTargetIndex, TOUINT(pRenderTarget) } };
+    dt_ref(&c, pRenderTarget);
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE SetDepthStencilSurface_wrapper(IDirect3DDevice9 *This, IDirect3DSurface9 *pNewZStencil)
+{
+    struct dt_call c = { REAL->SetDepthStencilSurface, This, 1, { TOUINT(pNewZStencil) } };
+    dt_ref(&c, pNewZStencil);
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE Clear_wrapper(IDirect3DDevice9 *This, DWORD Count, const D3DRECT *pRects, DWORD Flags, D3DCOLOR Color, float Z, DWORD Stencil)
+{
+    struct dt_call c = { REAL->Clear, This, 6, { Count, TOUINT(pRects), Flags, Color, f2dw(Z), Stencil } };
+    dt_copy(&c, 1, Count * sizeof(D3DRECT));
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE BeginScene_wrapper(IDirect3DDevice9 *This)
+{
+    struct dt_call c = { REAL->BeginScene, This, 0 };
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE EndScene_wrapper(IDirect3DDevice9 *This)
+{
+    struct dt_call c = { REAL->EndScene, This, 0 };
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE SetStreamSource_wrapper(IDirect3DDevice9 *This, UINT StreamNumber, IDirect3DVertexBuffer9 *pStreamData, UINT OffsetInBytes, UINT Stride)
+{
+    struct dt_call c = { REAL->SetStreamSource, This, 4, { StreamNumber, TOUINT(pStreamData), OffsetInBytes, Stride } };
+    dt_ref(&c, pStreamData);
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE SetStreamSourceFreq_wrapper(IDirect3DDevice9 *This, UINT StreamNumber, UINT Divider)
+{
+    struct dt_call c = { REAL->SetStreamSourceFreq, This, 2, { StreamNumber, Divider } };
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE SetIndices_wrapper(IDirect3DDevice9 *This, IDirect3DIndexBuffer9 *pIndexData)
+{
+    struct dt_call c = { REAL->SetIndices, This, 1, { TOUINT(pIndexData) } };
+    dt_ref(&c, pIndexData);
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE SetFVF_wrapper(IDirect3DDevice9 *This, DWORD FVF)
+{
+    struct dt_call c = { REAL->SetFVF, This, 1, { FVF } };
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE SetVertexDeclaration_wrapper(IDirect3DDevice9 *This, IDirect3DVertexDeclaration9 *pDecl)
+{
+    struct dt_call c = { REAL->SetVertexDeclaration, This, 1, { TOUINT(pDecl) } };
+    dt_ref(&c, pDecl);
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE SetVertexShader_wrapper(IDirect3DDevice9 *This, IDirect3DVertexShader9 *pShader)
+{
+    struct dt_call c = { REAL->SetVertexShader, This, 1, { TOUINT(pShader) } };
+    dt_ref(&c, pShader);
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE SetPixelShader_wrapper(IDirect3DDevice9 *This, IDirect3DPixelShader9 *pShader)
+{
+    struct dt_call c = { REAL->SetPixelShader, This, 1, { TOUINT(pShader) } };
+    dt_ref(&c, pShader);
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE SetVertexShaderConstantF_wrapper(IDirect3DDevice9 *This, UINT StartRegister, const float *pConstantData, UINT Vector4fCount)
+{
+    struct dt_call c = { REAL->SetVertexShaderConstantF, This, 3, { StartRegister, TOUINT(pConstantData), Vector4fCount } };
+    dt_copy(&c, 1, Vector4fCount * 4 * sizeof(float));
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE SetPixelShaderConstantF_wrapper(IDirect3DDevice9 *This, UINT StartRegister, const float *pConstantData, UINT Vector4fCount)
+{
+    struct dt_call c = { REAL->SetPixelShaderConstantF, This, 3, { StartRegister, TOUINT(pConstantData), Vector4fCount } };
+    dt_copy(&c, 1, Vector4fCount * 4 * sizeof(float));
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE DrawPrimitive_wrapper(IDirect3DDevice9 *This, D3DPRIMITIVETYPE PrimitiveType, UINT StartVertex, UINT PrimitiveCount)
+{
+    struct dt_call c = { REAL->DrawPrimitive, This, 3, { PrimitiveType, StartVertex, PrimitiveCount } };
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE DrawIndexedPrimitive_wrapper(IDirect3DDevice9 *This, D3DPRIMITIVETYPE PrimitiveType, INT BaseVertexIndex, UINT MinVertexIndex, UINT NumVertices, UINT startIndex, UINT primCount)
+{
+    struct dt_call c = { REAL->DrawIndexedPrimitive, This, 6, { PrimitiveType, BaseVertexIndex, MinVertexIndex, NumVertices, startIndex, primCount } };
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE DrawPrimitiveUP_wrapper(IDirect3DDevice9 *This, D3DPRIMITIVETYPE PrimitiveType, UINT PrimitiveCount, const void *pVertexStreamZeroData, UINT VertexStreamZeroStride)
+{
+    struct dt_call c = { REAL->DrawPrimitiveUP, This, 4, { PrimitiveType, PrimitiveCount, TOUINT(pVertexStreamZeroData), VertexStreamZeroStride } };
+    dt_copy(&c, 2, dt_vertexcount(PrimitiveType, PrimitiveCount) * VertexStreamZeroStride);
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE DrawIndexedPrimitiveUP_wrapper(IDirect3DDevice9 *This, D3DPRIMITIVETYPE PrimitiveType, UINT MinVertexIndex, UINT NumVertices, UINT PrimitiveCount, const void *pIndexData, D3DFORMAT IndexDataFormat, const void *pVertexStreamZeroData, UINT VertexStreamZeroStride)
+{
+    struct dt_call c = { REAL->DrawIndexedPrimitiveUP, This, 8, { PrimitiveType, MinVertexIndex, NumVertices, PrimitiveCount, TOUINT(pIndexData), IndexDataFormat, TOUINT(pVertexStreamZeroData), VertexStreamZeroStride } };
+    // indices are relative to pVertexStreamZeroData, so vertices before MinVertexIndex are copied too
+    dt_copy(&c, 4, dt_vertexcount(PrimitiveType, PrimitiveCount) * (IndexDataFormat == D3DFMT_INDEX32 ? 4 : 2));
+    dt_copy(&c, 6, (MinVertexIndex + NumVertices) * VertexStreamZeroStride);
+    return dt_record(&c);
+}
+
+static HRESULT STDMETHODCALLTYPE Present_wrapper(IDirect3DDevice9 *This, const RECT *pSourceRect, const RECT *pDestRect, HWND hDestWindowOverride, const RGNDATA *pDirtyRegion)
+{
+    if (!dt_can_defer() || pDirtyRegion) {
+        dt_sync();
+        return REAL->Present(This, pSourceRect, pDestRect, hDestWindowOverride, pDirtyRegion);
+    }
+
+    struct dt_call c = { REAL->Present, This, 4, { TOUINT(pSourceRect), TOUINT(pDestRect), TOUINT(hDestWindowOverride), 0 } };
+    dt_copy(&c, 0, sizeof(RECT));
+    dt_copy(&c, 1, sizeof(RECT));
+    c.present = 1;
+    dt_record(&c);
+
+    // keep at most one frame in queue
+    dt_wait(dt_present_seq);
+    dt_present_seq = dt_cmd_seq;
+    return dt_present_hr;
+}
+
+
+
+// device methods which are sync points and patch returned objects
+
+static HRESULT STDMETHODCALLTYPE BeginStateBlock_wrapper(IDirect3DDevice9 *This)
+{
+    dt_sync();
+    HRESULT hr = REAL->BeginStateBlock(This);
+    if (SUCCEEDED(hr)) dt_recording = 1;
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE EndStateBlock_wrapper(IDirect3DDevice9 *This, IDirect3DStateBlock9 **ppSB)
+{
+    dt_sync();
+    HRESULT hr = REAL->EndStateBlock(This, ppSB);
+    dt_recording = 0;
+    if (SUCCEEDED(hr)) dt_patch_object(*ppSB, sizeof(IDirect3DStateBlock9Vtbl), dt_setup_stateblock);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE CreateStateBlock_wrapper(IDirect3DDevice9 *This, D3DSTATEBLOCKTYPE Type, IDirect3DStateBlock9 **ppSB)
+{
+    dt_sync();
+    HRESULT hr = REAL->CreateStateBlock(This, Type, ppSB);
+    if (SUCCEEDED(hr)) dt_patch_object(*ppSB, sizeof(IDirect3DStateBlock9Vtbl), dt_setup_stateblock);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE CreateQuery_wrapper(IDirect3DDevice9 *This, D3DQUERYTYPE Type, IDirect3DQuery9 **ppQuery)
+{
+    dt_sync();
+    HRESULT hr = REAL->CreateQuery(This, Type, ppQuery);
+    // ppQuery is NULL when checking support
+    if (SUCCEEDED(hr) && ppQuery) dt_patch_object(*ppQuery, sizeof(IDirect3DQuery9Vtbl), dt_setup_query);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE CreateTexture_wrapper(IDirect3DDevice9 *This, UINT Width, UINT Height, UINT Levels, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DTexture9 **ppTexture, HANDLE *pSharedHandle)
+{
+    dt_sync();
+    HRESULT hr = REAL->CreateTexture(This, Width, Height, Levels, Usage, Format, Pool, ppTexture, pSharedHandle);
+    if (SUCCEEDED(hr)) dt_patch_object(*ppTexture, sizeof(IDirect3DTexture9Vtbl), dt_setup_texture);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE CreateVolumeTexture_wrapper(IDirect3DDevice9 *This, UINT Width, UINT Height, UINT Depth, UINT Levels, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DVolumeTexture9 **ppVolumeTexture, HANDLE *pSharedHandle)
+{
+    dt_sync();
+    HRESULT hr = REAL->CreateVolumeTexture(This, Width, Height, Depth, Levels, Usage, Format, Pool, ppVolumeTexture, pSharedHandle);
+    if (SUCCEEDED(hr)) dt_patch_object(*ppVolumeTexture, sizeof(IDirect3DVolumeTexture9Vtbl), dt_setup_volumetexture);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE CreateCubeTexture_wrapper(IDirect3DDevice9 *This, UINT EdgeLength, UINT Levels, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DCubeTexture9 **ppCubeTexture, HANDLE *pSharedHandle)
+{
+    dt_sync();
+    HRESULT hr = REAL->CreateCubeTexture(This, EdgeLength, Levels, Usage, Format, Pool, ppCubeTexture, pSharedHandle);
+    if (SUCCEEDED(hr)) dt_patch_object(*ppCubeTexture, sizeof(IDirect3DCubeTexture9Vtbl), dt_setup_cubetexture);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE CreateVertexBuffer_wrapper(IDirect3DDevice9 *This, UINT Length, DWORD Usage, DWORD FVF, D3DPOOL Pool, IDirect3DVertexBuffer9 **ppVertexBuffer, HANDLE *pSharedHandle)
+{
+    dt_sync();
+    HRESULT hr = REAL->CreateVertexBuffer(This, Length, Usage, FVF, Pool, ppVertexBuffer, pSharedHandle);
+    if (SUCCEEDED(hr)) dt_patch_object(*ppVertexBuffer, sizeof(IDirect3DVertexBuffer9Vtbl), dt_setup_vertexbuffer);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE CreateIndexBuffer_wrapper(IDirect3DDevice9 *This, UINT Length, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DIndexBuffer9 **ppIndexBuffer, HANDLE *pSharedHandle)
+{
+    dt_sync();
+    HRESULT hr = REAL->CreateIndexBuffer(This, Length, Usage, Format, Pool, ppIndexBuffer, pSharedHandle);
+    if (SUCCEEDED(hr)) dt_patch_object(*ppIndexBuffer, sizeof(IDirect3DIndexBuffer9Vtbl), dt_setup_indexbuffer);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE CreateRenderTarget_wrapper(IDirect3DDevice9 *This, UINT Width, UINT Height, D3DFORMAT Format, D3DMULTISAMPLE_TYPE MultiSample, DWORD MultisampleQuality, BOOL Lockable, IDirect3DSurface9 **ppSurface, HANDLE *pSharedHandle)
+{
+    dt_sync();
+    HRESULT hr = REAL->CreateRenderTarget(This, Width, Height, Format, MultiSample, MultisampleQuality, Lockable, ppSurface, pSharedHandle);
+    if (SUCCEEDED(hr)) dt_patch_surface(*ppSurface);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE CreateDepthStencilSurface_wrapper(IDirect3DDevice9 *This, UINT Width, UINT Height, D3DFORMAT Format, D3DMULTISAMPLE_TYPE MultiSample, DWORD MultisampleQuality, BOOL Discard, IDirect3DSurface9 **ppSurface, HANDLE *pSharedHandle)
+{
+    dt_sync();
+    HRESULT hr = REAL->CreateDepthStencilSurface(This, Width, Height, Format, MultiSample, MultisampleQuality, Discard, ppSurface, pSharedHandle);
+    if (SUCCEEDED(hr)) dt_patch_surface(*ppSurface);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE CreateOffscreenPlainSurface_wrapper(IDirect3DDevice9 *This, UINT Width, UINT Height, D3DFORMAT Format, D3DPOOL Pool, IDirect3DSurface9 **ppSurface, HANDLE *pSharedHandle)
+{
+    dt_sync();
+    HRESULT hr = REAL->CreateOffscreenPlainSurface(This, Width, Height, Format, Pool, ppSurface, pSharedHandle);
+    if (SUCCEEDED(hr)) dt_patch_surface(*ppSurface);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE GetBackBuffer_wrapper(IDirect3DDevice9 *This, UINT iSwapChain, UINT iBackBuffer, D3DBACKBUFFER_TYPE Type, IDirect3DSurface9 **ppBackBuffer)
+{
+    dt_sync();
+    HRESULT hr = REAL->GetBackBuffer(This, iSwapChain, iBackBuffer, Type, ppBackBuffer);
+    if (SUCCEEDED(hr)) dt_patch_surface(*ppBackBuffer);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE GetRenderTarget_wrapper(IDirect3DDevice9 *This, DWORD RenderTargetIndex, IDirect3DSurface9 **ppRenderTarget)
+{
+    dt_sync();
+    HRESULT hr = REAL->GetRenderTarget(This, RenderTargetIndex, ppRenderTarget);
+    if (SUCCEEDED(hr)) dt_patch_surface(*ppRenderTarget);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE GetDepthStencilSurface_wrapper(IDirect3DDevice9 *This, IDirect3DSurface9 **ppZStencilSurface)
+{
+    dt_sync();
+    HRESULT hr = REAL->GetDepthStencilSurface(This, ppZStencilSurface);
+    if (SUCCEEDED(hr)) dt_patch_surface(*ppZStencilSurface);
+    return hr;
+}
+
+
+
+// hook device
+
+static void dt_hook_device(void)
+{
+    IDirect3DDevice9 *dev = GB_GfxMgr->m_pd3dDevice;
+    IDirect3DDevice9Vtbl *vtbl = (IDirect3DDevice9Vtbl *) &device_vtbl;
+    unsigned i, size;
+
+    if (!dev || dev->lpVtbl == vtbl) return;
+    if (!dt_mt) {
+        warning("device is not multithreaded, d3d thread disabled.");
+        return;
+    }
+
+    size = patch_device_vtable(dev, &real_device_vtbl);
+
+    // every method is a sync point by default
+    memset(&device_vtbl, 0, sizeof(device_vtbl));
+    for (i = 0; i < size / sizeof(void *); i++) {
+        ((void **) &device_vtbl)[i] = dt_sync_thunk(&((void **) &real_device_vtbl)[i]);
+    }
+    vtbl->QueryInterface = REAL->QueryInterface;
+    vtbl->AddRef = REAL->AddRef;
+
+    vtbl->SetRenderState = SetRenderState_wrapper;
+    vtbl->SetTextureStageState = SetTextureStageState_wrapper;
+    vtbl->SetSamplerState = SetSamplerState_wrapper;
+    vtbl->SetTexture = SetTexture_wrapper;
+    vtbl->SetTransform = SetTransform_wrapper;
+    vtbl->MultiplyTransform = MultiplyTransform_wrapper;
+    vtbl->SetViewport = SetViewport_wrapper;
+    vtbl->SetMaterial = SetMaterial_wrapper;
+    vtbl->SetLight = SetLight_wrapper;
+    vtbl->LightEnable = LightEnable_wrapper;
+    vtbl->SetClipPlane = SetClipPlane_wrapper;
+    vtbl->SetScissorRect = SetScissorRect_wrapper;
+    vtbl->SetRenderTarget = SetRenderTarget_wrapper;
+    vtbl->SetDepthStencilSurface = SetDepthStencilSurface_wrapper;
+    vtbl->Clear = Clear_wrapper;
+    vtbl->BeginScene = BeginScene_wrapper;
+    vtbl->EndScene = EndScene_wrapper;
+    vtbl->SetStreamSource = SetStreamSource_wrapper;
+    vtbl->SetStreamSourceFreq = SetStreamSourceFreq_wrapper;
+    vtbl->SetIndices = SetIndices_wrapper;
+    vtbl->SetFVF = SetFVF_wrapper;
+    vtbl->SetVertexDeclaration = SetVertexDeclaration_wrapper;
+    vtbl->SetVertexShader = SetVertexShader_wrapper;
+    vtbl->SetPixelShader = SetPixelShader_wrapper;
+    vtbl->SetVertexShaderConstantF = SetVertexShaderConstantF_wrapper;
+    vtbl->SetPixelShaderConstantF = SetPixelShaderConstantF_wrapper;
+    vtbl->DrawPrimitive = DrawPrimitive_wrapper;
+    vtbl->DrawIndexedPrimitive = DrawIndexedPrimitive_wrapper;
+    vtbl->DrawPrimitiveUP = DrawPrimitiveUP_wrapper;
+    vtbl->DrawIndexedPrimitiveUP = DrawIndexedPrimitiveUP_wrapper;
+    vtbl->Present = Present_wrapper;
+
+    vtbl->BeginStateBlock = BeginStateBlock_wrapper;
+    vtbl->EndStateBlock = EndStateBlock_wrapper;
+    vtbl->CreateStateBlock = CreateStateBlock_wrapper;
+    vtbl->CreateQuery = CreateQuery_wrapper;
+    vtbl->CreateTexture = CreateTexture_wrapper;
+    vtbl->CreateVolumeTexture = CreateVolumeTexture_wrapper;
+    vtbl->CreateCubeTexture = CreateCubeTexture_wrapper;
+    vtbl->CreateVertexBuffer = CreateVertexBuffer_wrapper;
+    vtbl->CreateIndexBuffer = CreateIndexBuffer_wrapper;
+    vtbl->CreateRenderTarget = CreateRenderTarget_wrapper;
+    vtbl->CreateDepthStencilSurface = CreateDepthStencilSurface_wrapper;
+    vtbl->CreateOffscreenPlainSurface = CreateOffscreenPlainSurface_wrapper;
+    vtbl->GetBackBuffer = GetBackBuffer_wrapper;
+    vtbl->GetRenderTarget = GetRenderTarget_wrapper;
+    vtbl->GetDepthStencilSurface = GetDepthStencilSurface_wrapper;
+
+    dt_queue = malloc(D3DTHREAD_QUEUESIZE);
+    dt_data_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    dt_done_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (!dt_queue || !dt_data_event || !dt_done_event) fail("can't init d3d thread.");
+    dt_thread = CreateThread(NULL, 0, dt_thread_proc, NULL, 0, &dt_render_tid);
+    if (!dt_thread) {
+        warning("can't create d3d thread.");
+        return;
+    }
+
+    dt_game_tid = GetCurrentThreadId();
+    dt_running = 1;
+    dev->lpVtbl = vtbl;
+}
+
+static HRESULT STDMETHODCALLTYPE D3D9_CreateDevice_wrapper(IDirect3D9 *This, UINT Adapter, D3DDEVTYPE DeviceType, HWND hFocusWindow, DWORD BehaviorFlags, D3DPRESENT_PARAMETERS *pPresentationParameters, IDirect3DDevice9 **ppReturnedDeviceInterface)
+{
+    // recorded calls are replayed on render thread
+    HRESULT hr = Real_CreateDevice(This, Adapter, DeviceType, hFocusWindow, BehaviorFlags | D3DCREATE_MULTITHREADED, pPresentationParameters, ppReturnedDeviceInterface);
+    dt_mt = SUCCEEDED(hr);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE D3D9_CreateDeviceEx_wrapper(IDirect3D9Ex *This, UINT Adapter, D3DDEVTYPE DeviceType, HWND hFocusWindow, DWORD BehaviorFlags, D3DPRESENT_PARAMETERS *pPresentationParameters, D3DDISPLAYMODEEX *pFullscreenDisplayMode, IDirect3DDevice9Ex **ppReturnedDeviceInterface)
+{
+    // d3d9ex creates the device by this, from its CreateDevice() wrapper
+    HRESULT hr = Real_CreateDeviceEx(This, Adapter, DeviceType, hFocusWindow, BehaviorFlags | D3DCREATE_MULTITHREADED, pPresentationParameters, pFullscreenDisplayMode, ppReturnedDeviceInterface);
+    dt_mt = SUCCEEDED(hr);
+    return hr;
+}
+
+static IDirect3D9 *WINAPI Direct3DCreate9_wrapper(UINT SDKVersion)
+{
+    IDirect3D9 *d3d9 = Real_Direct3DCreate9(SDKVersion);
+    IDirect3D9Ex *d3d9ex;
+    if (!d3d9) return NULL;
+
+    // object may be a 9Ex one
+    if (SUCCEEDED(IDirect3D9_QueryInterface(d3d9, &dt_IID_IDirect3D9Ex, (void **) &d3d9ex))) {
+        d3d9_vtbl = *d3d9ex->lpVtbl;
+        IDirect3D9Ex_Release(d3d9ex);
+        Real_CreateDeviceEx = d3d9_vtbl.CreateDeviceEx;
+        d3d9_vtbl.CreateDeviceEx = D3D9_CreateDeviceEx_wrapper;
+    } else {
+        *(IDirect3D9Vtbl *) &d3d9_vtbl = *d3d9->lpVtbl;
+    }
+    Real_CreateDevice = (void *) d3d9_vtbl.CreateDevice;
+    d3d9_vtbl.CreateDevice = (void *) D3D9_CreateDevice_wrapper;
+    d3d9->lpVtbl = (IDirect3D9Vtbl *) &d3d9_vtbl;
+    return d3d9;
+}
+
+static void dt_report(void)
+{
+    if (!dt_running) return;
+
+    // drain queue, later calls are made directly
+    dt_sync();
+    dt_running = 0;
+    dt_quit = 1;
+    SetEvent(dt_data_event);
+    WaitForSingleObject(dt_thread, INFINITE);
+    CloseHandle(dt_thread);
+    plog("d3d thread: %u commands recorded, %d object classes.", (unsigned) dt_cmd_seq, dt_nr_classes);
+}
+
+MAKE_PATCHSET(d3dthread)
+{
+    InitializeCriticalSection(&dt_class_cs);
+    dt_pc_cmds = perfcounter_register("d3dthread.commands", PERFCOUNTER_COUNTER, PERFCOUNTER_TRACE);
+    dt_pc_direct = perfcounter_register("d3dthread.direct", PERFCOUNTER_COUNTER, PERFCOUNTER_TRACE);
+    dt_pc_failed = perfcounter_register("d3dthread.failed", PERFCOUNTER_COUNTER, 0);
+    dt_pc_sync = perfcounter_register("d3dthread.sync_ms", PERFCOUNTER_HISTOGRAM, PERFCOUNTER_OVERLAY | PERFCOUNTER_TRACE);
+    dt_pc_deferlock = perfcounter_register("d3dthread.deferred_locks", PERFCOUNTER_COUNTER, PERFCOUNTER_TRACE);
+    dt_deferlock = flag >= 2;
+
+    Real_Direct3DCreate9 = hook_import_table(TOPTR(gboffset + 0x10000000), "D3D9.DLL", "Direct3DCreate9", Direct3DCreate9_wrapper);
+
+    // run before all others, so their wrappers are on top of ours
+    add_hook_ex(HOOKID_POSTD3DCREATE, dt_hook_device, HOOK_PRIORITY_FIRST - 1);
+    add_atexit_hook(dt_report);
+}
@@ -0,0 +1,241 @@
+#include "common.h"
+
+// dynamic vertex ring buffer
+//   small vertex batches drawn from system memory every frame (effects, showfps graph, etc.)
+//   go through DrawPrimitiveUP() and DrawIndexedPrimitiveUP()
+//   we copy these batches into one shared dynamic vertex buffer (and index buffer),
+//   appending with D3DLOCK_NOOVERWRITE and starting over with D3DLOCK_DISCARD when full,
+//   so the driver never waits for GPU and never copies the data again
+//
+//   stream 0 and indices are set to NULL after draw, same as the UP functions,
+//   batches too large for the ring, or with 32-bit indices, are passed through
+//   we patch the device vtable by giving it a modified copy of its vtable
+//
+//   the ring is discarded at start of every frame, so a wrap means one frame
+//   needs more than ring size, then both rings are doubled before next frame,
+//   up to a limit chosen from available video memory
+//   vertex positions are also kept below device's MaxVertexIndex
+
+#define DYNVB_VBSIZE (1024 * 1024)
+#define DYNVB_IBSIZE (128 * 1024)
+#define DYNVB_MAXVBSIZE (16 * 1024 * 1024)
+#define DYNVB_MAXIBSIZE (2 * 1024 * 1024)
+
+static IDirect3DVertexBuffer9 *dynvb_vb;
+static IDirect3DIndexBuffer9 *dynvb_ib;
+static UINT dynvb_vbpos, dynvb_ibpos;
+static UINT dynvb_vbsize, dynvb_ibsize, dynvb_maxvbsize, dynvb_maxibsize;
+static UINT dynvb_maxvertex;
+static UINT dynvb_frameused;
+static int dynvb_newframe_vb, dynvb_newframe_ib;
+static int dynvb_wrapped;
+static unsigned dynvb_nr_draws, dynvb_nr_passed, dynvb_nr_discards, dynvb_nr_grows;
+static struct perfcounter *dynvb_pc_bytes, *dynvb_pc_wraps, *dynvb_pc_framekb, *dynvb_pc_sizekb;
+
+static IDirect3DDevice9ExVtbl device_vtbl; // big enough for both IDirect3DDevice9 and IDirect3DDevice9Ex
+static IDirect3DDevice9Vtbl real_vtbl;
+
+static UINT dynvb_vertexcount(D3DPRIMITIVETYPE PrimitiveType, UINT PrimitiveCount)
+{
+    switch (PrimitiveType) {
+        case D3DPT_POINTLIST: return PrimitiveCount;
+        case D3DPT_LINELIST: return PrimitiveCount * 2;
+        case D3DPT_LINESTRIP: return PrimitiveCount + 1;
+        case D3DPT_TRIANGLELIST: return PrimitiveCount * 3;
+        case D3DPT_TRIANGLESTRIP: return PrimitiveCount + 2;
+        case D3DPT_TRIANGLEFAN: return PrimitiveCount + 2;
+        default: return 0;
+    }
+}
+
+static int dynvb_append_vertex(CONST void *data, UINT count, UINT stride, UINT *start)
+{
+    UINT size = count * stride;
+    DWORD flags = D3DLOCK_NOOVERWRITE;
+    void *ptr;
+    if (!dynvb_vb || stride == 0 || size == 0 || size > dynvb_vbsize || count - 1 > dynvb_maxvertex) return 0;
+    
+    // vertex must be aligned to stride, so it can be addressed by vertex index
+    UINT pos = (dynvb_vbpos + stride - 1) / stride * stride;
+    if (dynvb_newframe_vb) {
+        pos = 0;
+        flags = D3DLOCK_DISCARD;
+        dynvb_newframe_vb = 0;
+    } else if (pos + size > dynvb_vbsize || pos / stride + count - 1 > dynvb_maxvertex) {
+        pos = 0;
+        flags = D3DLOCK_DISCARD;
+        dynvb_nr_discards++;
+        dynvb_wrapped = 1;
+        perfcounter_add(dynvb_pc_wraps, 1);
+    }
+    if (FAILED(IDirect3DVertexBuffer9_Lock(dynvb_vb, pos, size, &ptr, flags))) return 0;
+    memcpy(ptr, data, size);
+    IDirect3DVertexBuffer9_Unlock(dynvb_vb);
+    dynvb_vbpos = pos + size;
+    dynvb_frameused += size;
+    perfcounter_add(dynvb_pc_bytes, size);
+    *start = pos / stride;
+    return 1;
+}
+
+static int dynvb_append_index(CONST void *data, UINT count, UINT *start)
+{
+    UINT size = count * sizeof(WORD);
+    DWORD flags = D3DLOCK_NOOVERWRITE;
+    void *ptr;
+    if (!dynvb_ib || size == 0 || size > dynvb_ibsize) return 0;
+    
+    UINT pos = dynvb_ibpos;
+    if (dynvb_newframe_ib) {
+        pos = 0;
+        flags = D3DLOCK_DISCARD;
+        dynvb_newframe_ib = 0;
+    } else if (pos + size > dynvb_ibsize) {
+        pos = 0;
+        flags = D3DLOCK_DISCARD;
+        dynvb_nr_discards++;
+        dynvb_wrapped = 1;
+        perfcounter_add(dynvb_pc_wraps, 1);
+    }
+    if (FAILED(IDirect3DIndexBuffer9_Lock(dynvb_ib, pos, size, &ptr, flags))) return 0;
+    memcpy(ptr, data, size);
+    IDirect3DIndexBuffer9_Unlock(dynvb_ib);
+    dynvb_ibpos = pos + size;
+    dynvb_frameused += size;
+    perfcounter_add(dynvb_pc_bytes, size);
+    *start = pos / sizeof(WORD);
+    return 1;
+}
+
+static HRESULT STDMETHODCALLTYPE DrawPrimitiveUP_wrapper(IDirect3DDevice9 *This, D3DPRIMITIVETYPE PrimitiveType, UINT PrimitiveCount, CONST void *pVertexStreamZeroData, UINT VertexStreamZeroStride)
+{
+    UINT start;
+    if (!dynvb_append_vertex(pVertexStreamZeroData, dynvb_vertexcount(PrimitiveType, PrimitiveCount), VertexStreamZeroStride, &start)) {
+        dynvb_nr_passed++;
+        return real_vtbl.DrawPrimitiveUP(This, PrimitiveType, PrimitiveCount, pVertexStreamZeroData, VertexStreamZeroStride);
+    }
+    dynvb_nr_draws++;
+    real_vtbl.SetStreamSource(This, 0, dynvb_vb, 0, VertexStreamZeroStride);
+    HRESULT hr = real_vtbl.DrawPrimitive(This, PrimitiveType, start, PrimitiveCount);
+    real_vtbl.SetStreamSource(This, 0, NULL, 0, 0);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE DrawIndexedPrimitiveUP_wrapper(IDirect3DDevice9 *This, D3DPRIMITIVETYPE PrimitiveType, UINT MinVertexIndex, UINT NumVertices, UINT PrimitiveCount, CONST void *pIndexData, D3DFORMAT IndexDataFormat, CONST void *pVertexStreamZeroData, UINT VertexStreamZeroStride)
+{
+    UINT vstart, istart;
+    
+    // indices are relative to pVertexStreamZeroData, so vertices before MinVertexIndex are copied too
+    if (IndexDataFormat != D3DFMT_INDEX16
+     || !dynvb_append_index(pIndexData, dynvb_vertexcount(PrimitiveType, PrimitiveCount), &istart)
+     || !dynvb_append_vertex(pVertexStreamZeroData, MinVertexIndex + NumVertices, VertexStreamZeroStride, &vstart)) {
+        // index data may be appended already, it's just left unused
+        dynvb_nr_passed++;
+        return real_vtbl.DrawIndexedPrimitiveUP(This, PrimitiveType, MinVertexIndex, NumVertices, PrimitiveCount, pIndexData, IndexDataFormat, pVertexStreamZeroData, VertexStreamZeroStride);
+    }
+    dynvb_nr_draws++;
+    real_vtbl.SetStreamSource(This, 0, dynvb_vb, 0, VertexStreamZeroStride);
+    real_vtbl.SetIndices(This, dynvb_ib);
+    HRESULT hr = real_vtbl.DrawIndexedPrimitive(This, PrimitiveType, vstart, MinVertexIndex, NumVertices, istart, PrimitiveCount);
+    real_vtbl.SetStreamSource(This, 0, NULL, 0, 0);
+    real_vtbl.SetIndices(This, NULL);
+    return hr;
+}
+
+static void dynvb_create()
+{
+    IDirect3DDevice9 *dev = GB_GfxMgr->m_pd3dDevice;
+    if (FAILED(IDirect3DDevice9_CreateVertexBuffer(dev, dynvb_vbsize, D3DUSAGE_DYNAMIC | D3DUSAGE_WRITEONLY, 0, D3DPOOL_DEFAULT, &dynvb_vb, NULL))) {
+        warning("can't create dynamic vertex ring buffer.");
+        dynvb_vb = NULL;
+    }
+    if (FAILED(IDirect3DDevice9_CreateIndexBuffer(dev, dynvb_ibsize, D3DUSAGE_DYNAMIC | D3DUSAGE_WRITEONLY, D3DFMT_INDEX16, D3DPOOL_DEFAULT, &dynvb_ib, NULL))) {
+        warning("can't create dynamic index ring buffer.");
+        dynvb_ib = NULL;
+    }
+    perfcounter_set(dynvb_pc_sizekb, (dynvb_vbsize + dynvb_ibsize) / 1024.0);
+    
+    // first lock will discard
+    dynvb_newframe_vb = dynvb_newframe_ib = 1;
+}
+
+static void dynvb_release()
+{
+    if (dynvb_vb) {
+        IDirect3DVertexBuffer9_Release(dynvb_vb);
+        dynvb_vb = NULL;
+    }
+    if (dynvb_ib) {
+        IDirect3DIndexBuffer9_Release(dynvb_ib);
+        dynvb_ib = NULL;
+    }
+}
+
+static void dynvb_postpresent()
+{
+    perfcounter_sample(dynvb_pc_framekb, dynvb_frameused / 1024.0);
+    dynvb_frameused = 0;
+    dynvb_newframe_vb = dynvb_newframe_ib = 1;
+    
+    // last frame didn't fit, grow both rings
+    if (dynvb_wrapped && (dynvb_vbsize < dynvb_maxvbsize || dynvb_ibsize < dynvb_maxibsize)) {
+        dynvb_release();
+        dynvb_vbsize = imin(dynvb_vbsize * 2, dynvb_maxvbsize);
+        dynvb_ibsize = imin(dynvb_ibsize * 2, dynvb_maxibsize);
+        dynvb_create();
+        dynvb_nr_grows++;
+    }
+    dynvb_wrapped = 0;
+}
+
+static void dynvb_initsize()
+{
+    IDirect3DDevice9 *dev = GB_GfxMgr->m_pd3dDevice;
+    
+    // don't let rings take more than 1/16 of available video memory
+    UINT mem = IDirect3DDevice9_GetAvailableTextureMem(dev) / 16;
+    dynvb_maxvbsize = imax(imin(mem / 9 * 8, DYNVB_MAXVBSIZE), DYNVB_VBSIZE);
+    dynvb_maxibsize = imax(imin(mem / 9, DYNVB_MAXIBSIZE), DYNVB_IBSIZE);
+    dynvb_vbsize = DYNVB_VBSIZE;
+    dynvb_ibsize = DYNVB_IBSIZE;
+    
+    // zero means hardware vertex processing is not reported, assume 16-bit
+    dynvb_maxvertex = GB_GfxMgr->m_d3dCaps.MaxVertexIndex;
+    if (dynvb_maxvertex == 0) dynvb_maxvertex = 0xFFFF;
+}
+
+static void hook_device()
+{
+    IDirect3DDevice9 *dev = GB_GfxMgr->m_pd3dDevice;
+    IDirect3DDevice9Vtbl *vtbl = (IDirect3DDevice9Vtbl *) &device_vtbl;
+    
+    if (!dev || dev->lpVtbl == vtbl) return;
+    
+    patch_device_vtable(dev, &device_vtbl);
+    real_vtbl = *vtbl;
+    
+    vtbl->DrawPrimitiveUP = DrawPrimitiveUP_wrapper;
+    vtbl->DrawIndexedPrimitiveUP = DrawIndexedPrimitiveUP_wrapper;
+    dev->lpVtbl = vtbl;
+    
+    dynvb_initsize();
+    dynvb_create();
+    add_onlostdevice_hook(dynvb_release);
+    add_onresetdevice_hook(dynvb_create);
+    add_postpresent_hook(dynvb_postpresent);
+}
+
+static void dynvb_report()
+{
+    plog("dynamic vertex ring: %u draws redirected, %u passed through, %u wraps, %u grows, size %u KB + %u KB.", dynvb_nr_draws, dynvb_nr_passed, dynvb_nr_discards, dynvb_nr_grows, dynvb_vbsize / 1024, dynvb_ibsize / 1024);
+}
+
+MAKE_PATCHSET(dynvbring)
+{
+    dynvb_pc_bytes = perfcounter_register("dynvb.bytes", PERFCOUNTER_COUNTER, PERFCOUNTER_TRACE);
+    dynvb_pc_wraps = perfcounter_register("dynvb.wraps", PERFCOUNTER_COUNTER, PERFCOUNTER_TRACE);
+    dynvb_pc_framekb = perfcounter_register("dynvb.frame_kb", PERFCOUNTER_HISTOGRAM, 0);
+    dynvb_pc_sizekb = perfcounter_register("dynvb.size_kb", PERFCOUNTER_GAUGE, 0);
+    add_postd3dcreate_hook(hook_device);
+    add_atexit_hook(dynvb_report);
+}
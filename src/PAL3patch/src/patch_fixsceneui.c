@@ -89,9 +89,9 @@ static MAKE_ASMPATCH(UISceneMap_Render_fixroleicon_part1)
 {
     R_ECX = M_DWORD(R_EBX + 0x21F0); // oldcode
     
+    // both scales are folded into one matrix operation, this runs for every role icon
     struct gbMatrixStack *pview = TOPTR(R_ESI);
-    gbMatrixStack_Scale(pview, sceneui_scalefactor, sceneui_scalefactor, 1.0);
-    gbMatrixStack_Scale(pview, (4.0 / 3.0) / get_frect_aspect_ratio(&game_frect), 1.0, 1.0);
+    gbMatrixStack_Scale(pview, sceneui_scalefactor * (4.0 / 3.0) / get_frect_aspect_ratio(&game_frect), sceneui_scalefactor, 1.0);
 }
 static MAKE_ASMPATCH(UISceneMap_Render_fixroleicon_part2)
 {
@@ -1,5 +1,11 @@
 #include "common.h"
 
+// underwater effect
+//   the scene is rendered into RenderTarget::m_ScreenPlane, then drawn to back buffer
+//   through a distorted quad (bumpmap in mode 0, vertex grid in mode 1)
+//   the distortion samples the current frame, so its output can't be cached over frames,
+//   and a smaller target would mean rendering the whole scene at lower resolution
+//   only the per-frame CPU work on the distortion vertices is reduced here
 
 struct fvf_xyztex2 {
     float x, y, z;
@@ -54,6 +60,11 @@ static MAKE_ASMPATCH(fixtexcoord_mode0_part2)
 
 static void fixtexcoord_mode1_fixvert(struct fvf_xyztex2 *v)
 {
+    // compiled transform only depends on render target size, cache it
+    static fTRANSFORM tr;
+    static fRECT tr_dst_frect;
+    static int tr_valid;
+    
     fRECT src_frect, dst_frect;
     set_frect_ltrb(&src_frect, 0.1, 0.1, 1.0, 1.0);
     if (!RenderTarget_Inst()->m_iMode) {
@@ -61,14 +72,22 @@ static void fixtexcoord_mode1_fixvert(struct fvf_xyztex2 *v)
     } else {
         set_frect_ltrb(&dst_frect, 0.0, 0.0, 1.0, 1.0);
     }
+    if (!tr_valid || memcmp(&tr_dst_frect, &dst_frect, sizeof(fRECT)) != 0) {
+        compile_transform(&tr, &src_frect, &dst_frect, TR_SCALE_LOW, TR_SCALE_LOW, 1.0);
+        tr_dst_frect = dst_frect;
+        tr_valid = 1;
+    }
+    
     int i;
     int n = 100;
+    fPOINT fpoint[100];
+    for (i = 0; i < n; i++) {
+        set_fpoint(&fpoint[i], v[i].u1, v[i].v1);
+    }
+    transform_fpoint_batch(fpoint, fpoint, n, &tr);
     for (i = 0; i < n; i++) {
-        fPOINT fpoint;
-        set_fpoint(&fpoint, v[i].u1, v[i].v1);
-        transform_fpoint(&fpoint, &fpoint, &src_frect, &dst_frect, TR_SCALE_LOW, TR_SCALE_LOW, 1.0);
-        v[i].u1 = fpoint.x;
-        v[i].v1 = fpoint.y;
+        v[i].u1 = fpoint[i].x;
+        v[i].v1 = fpoint[i].y;
     }
 }
 
@@ -17,6 +17,18 @@ static double fpslimit_target_period;
 static double default_fps = -1;
 static double standard_fps = 60;
 
+// waitable timer method
+//   sleep on a (high resolution if available) waitable timer
+//   and only spin for the last part of frame, the spin margin
+//   follows the worst oversleep recently measured
+#define FPSLIMIT_SPIN_MIN 0.0002
+#define FPSLIMIT_SPIN_MAX 0.004
+#define FPSLIMIT_SPIN_DECAY 0.99
+#define myCREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+static HANDLE fpslimit_timer;
+static double fpslimit_spin = FPSLIMIT_SPIN_MAX;
+static double fpslimit_oversleep;
+
 static void set_fpslimit(double target_fps) // if target_fps is zero or negative, disable fpslimit
 {
     if (target_fps > 0) {
@@ -38,6 +50,38 @@ static void update_fpslimit()
     }
     set_fpslimit(fps);
 }
+static void fpslimit_timer_wait(double remain)
+{
+    if (remain <= fpslimit_spin) return;
+    
+    double period = remain - fpslimit_spin;
+    LARGE_INTEGER qwDue, qwBegin, qwEnd;
+    qwDue.QuadPart = -(LONGLONG) (period * 1e7); // relative, in 100ns
+    if (!SetWaitableTimer(fpslimit_timer, &qwDue, 0, NULL, NULL, FALSE)) return;
+    QueryPerformanceCounter(&qwBegin);
+    WaitForSingleObject(fpslimit_timer, INFINITE);
+    QueryPerformanceCounter(&qwEnd);
+    
+    // adapt spin margin to measured oversleep
+    double oversleep = (qwEnd.QuadPart - qwBegin.QuadPart) / (double) fpslimit_qwTicksPerSec.QuadPart - period;
+    fpslimit_oversleep = fmax(oversleep, fpslimit_oversleep * FPSLIMIT_SPIN_DECAY);
+    fpslimit_spin = fmin(fmax(fpslimit_oversleep * 1.25, FPSLIMIT_SPIN_MIN), FPSLIMIT_SPIN_MAX);
+}
+static void fpslimit_timer_init()
+{
+    HANDLE (WINAPI *myCreateWaitableTimerExW)(LPSECURITY_ATTRIBUTES, LPCWSTR, DWORD, DWORD) = (void *) GetProcAddress(GetModuleHandle("KERNEL32.DLL"), "CreateWaitableTimerExW");
+    if (myCreateWaitableTimerExW) {
+        // high resolution timer is supported since Windows 10 1803
+        fpslimit_timer = myCreateWaitableTimerExW(NULL, NULL, myCREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    }
+    if (!fpslimit_timer) {
+        // fallback to normal waitable timer, which follows timeBeginPeriod()
+        fpslimit_timer = CreateWaitableTimer(NULL, TRUE, NULL);
+    }
+    if (!fpslimit_timer) {
+        warning("can't create waitable timer, fallback to sleep.");
+    }
+}
 static void fpslimit_hook()
 {
     update_fpslimit();
@@ -48,12 +92,37 @@ static void fpslimit_hook()
             if (!fpslimit_enabled) break;
             double diff = (qwTime.QuadPart - fpslimit_qwLast.QuadPart) / (double) fpslimit_qwTicksPerSec.QuadPart;
             if (diff >= fpslimit_target_period) break;
-            int sleepms = floor((fpslimit_target_period - diff) * 1000.0);
-            if (sleepms > 2) Sleep(sleepms - 2);
+            if (fpslimit_timer) {
+                fpslimit_timer_wait(fpslimit_target_period - diff);
+            } else {
+                int sleepms = floor((fpslimit_target_period - diff) * 1000.0);
+                if (sleepms > 2) Sleep(sleepms - 2);
+            }
         }
         fpslimit_qwLast.QuadPart = qwTime.QuadPart;
     }
 }
+static int fpslimit_disabled = 0;
+void disable_fpslimit(void)
+{
+    default_fps = standard_fps = -1;
+    fpslimit_disabled = 1;
+}
+double get_fpslimit_period(void) // zero if fpslimit is disabled
+{
+    return fpslimit_enabled ? fpslimit_target_period : 0.0;
+}
+static void fpslimit_configchange()
+{
+    double fps[2];
+    if (fpslimit_disabled || !config_value_changed("game_fpslimit")) return;
+    if (config_value_tuple(get_config_value("game_fpslimit"), fps, 2) != 2) {
+        plog("invalid game_fpslimit config string, ignored.");
+        return;
+    }
+    default_fps = fps[0];
+    standard_fps = fps[1];
+}
 static void fpslimit_init()
 {
     if (sscanf(get_string_from_configfile("game_fpslimit"), "%lf,%lf", &default_fps, &standard_fps) != 2) {
@@ -66,7 +135,12 @@ static void fpslimit_init()
     }
     fpslimit_qwLast.QuadPart = 0;
     
+    if (fpslimit_qwTicksPerSec.QuadPart > 0 && get_int_from_configfile("game_fpslimit_method") == 1) {
+        fpslimit_timer_init();
+    }
+    
     add_postpresent_hook(fpslimit_hook);
+    add_configchange_hook(fpslimit_configchange);
 }
 
 
@@ -87,18 +161,22 @@ static void *CArrayList_GetPtr(struct CArrayList *this, UINT Entry)
     else
         return *(((void**) this->m_pData) + Entry);
 }
-static int *CArrayList_FindInt(struct CArrayList *this, int target, int *subscript)
+// index first entry of each int value in [0, n) with one pass, index[v] is -1 if not found
+//   so a list of preferences can be resolved without scanning list again for each one
+static void CArrayList_IndexInt(struct CArrayList *this, int *index, int n)
 {
     int i;
-    for (i = 0; i < (int) this->m_NumEntries; i++) {
-        int *cur = CArrayList_GetPtr(this, i);
-        if (*cur == target) {
-            if (subscript) *subscript = i;
-            return cur;
-        }
+    for (i = 0; i < n; i++) index[i] = -1;
+    for (i = (int) this->m_NumEntries - 1; i >= 0; i--) {
+        int v = *(int *) CArrayList_GetPtr(this, i);
+        if (0 <= v && v < n) index[v] = i;
     }
-    if (subscript) *subscript = -1;
-    return NULL;
+}
+static int *CArrayList_IndexedPtr(struct CArrayList *this, const int *index, int n, int target, int *subscript)
+{
+    int i = (0 <= target && target < n) ? index[target] : -1;
+    if (subscript) *subscript = i;
+    return i >= 0 ? CArrayList_GetPtr(this, i) : NULL;
 }
 
 
@@ -107,16 +185,19 @@ static int *CArrayList_FindInt(struct CArrayList *this, int target, int *subscri
 
 
 // the Z-buffer patch
+#define ZBUF_INDEXSIZE 128 // all depth formats we prefer are less than this
 static int zbuf_flag;
 static int zbuf_tmpint;
 static MAKE_ASMPATCH(zbuf)
 {
     struct CArrayList *this = TOPTR(R_ECX);
+    int index[ZBUF_INDEXSIZE];
+    CArrayList_IndexInt(this, index, ZBUF_INDEXSIZE);
     if (zbuf_flag == INT_MAX) {
         int *result = NULL;
-        if (!result) result = CArrayList_FindInt(this, D3DFMT_D24S8, NULL);
-        if (!result) result = CArrayList_FindInt(this, D3DFMT_D24X8, NULL);
-        if (!result) result = CArrayList_FindInt(this, D3DFMT_D16, NULL);
+        if (!result) result = CArrayList_IndexedPtr(this, index, ZBUF_INDEXSIZE, D3DFMT_D24S8, NULL);
+        if (!result) result = CArrayList_IndexedPtr(this, index, ZBUF_INDEXSIZE, D3DFMT_D24X8, NULL);
+        if (!result) result = CArrayList_IndexedPtr(this, index, ZBUF_INDEXSIZE, D3DFMT_D16, NULL);
         if (!result) result = CArrayList_GetPtr(this, 0);
         R_EAX = TOUINT(result);
         return;
@@ -128,15 +209,15 @@ static MAKE_ASMPATCH(zbuf)
         int *result = NULL;
         switch (zbuf_flag) {
             case 16:
-                if (!result) result = CArrayList_FindInt(this, D3DFMT_D16, NULL);
+                if (!result) result = CArrayList_IndexedPtr(this, index, ZBUF_INDEXSIZE, D3DFMT_D16, NULL);
                 break;
             case 24:
-                if (!result) result = CArrayList_FindInt(this, D3DFMT_D24S8, NULL);
-                if (!result) result = CArrayList_FindInt(this, D3DFMT_D24X8, NULL);
-                if (!result) result = CArrayList_FindInt(this, D3DFMT_D24X4S4, NULL);
+                if (!result) result = CArrayList_IndexedPtr(this, index, ZBUF_INDEXSIZE, D3DFMT_D24S8, NULL);
+                if (!result) result = CArrayList_IndexedPtr(this, index, ZBUF_INDEXSIZE, D3DFMT_D24X8, NULL);
+                if (!result) result = CArrayList_IndexedPtr(this, index, ZBUF_INDEXSIZE, D3DFMT_D24X4S4, NULL);
                 break;
             case 32:
-                if (!result) result = CArrayList_FindInt(this, D3DFMT_D32, NULL);
+                if (!result) result = CArrayList_IndexedPtr(this, index, ZBUF_INDEXSIZE, D3DFMT_D32, NULL);
                 break;
         }
         if (!result) {
@@ -162,7 +243,11 @@ static void patch_depth_buffer_config(const char *cfgstr)
 
 
 // multisample patch
+#define MS_INDEXSIZE (D3DMULTISAMPLE_16_SAMPLES + 1)
 static int ms_tflag, ms_qflag;
+static int ms3d_enabled;
+static D3DMULTISAMPLE_TYPE ms3d_type;
+static DWORD ms3d_quality;
 static void set_multisample_config(struct CArrayList *tl, struct CArrayList *ql, int *tret, int *qret)
 {
     if (ms_tflag < 0 || ms_qflag < 0) {
@@ -190,12 +275,14 @@ static void set_multisample_config(struct CArrayList *tl, struct CArrayList *ql,
         D3DMULTISAMPLE_16_SAMPLES,
     };
     const UINT msTypeArrayCount = sizeof(msTypeArray) / sizeof(msTypeArray[0]);
+    int index[MS_INDEXSIZE];
     int id;
+    CArrayList_IndexInt(tl, index, MS_INDEXSIZE);
     if (ms_tflag == INT_MAX) {
         int *pt = NULL;
-        if (!pt) pt = CArrayList_FindInt(tl, D3DMULTISAMPLE_8_SAMPLES, &id);
-        if (!pt) pt = CArrayList_FindInt(tl, D3DMULTISAMPLE_4_SAMPLES, &id);
-        if (!pt) pt = CArrayList_FindInt(tl, D3DMULTISAMPLE_NONE, &id);
+        if (!pt) pt = CArrayList_IndexedPtr(tl, index, MS_INDEXSIZE, D3DMULTISAMPLE_8_SAMPLES, &id);
+        if (!pt) pt = CArrayList_IndexedPtr(tl, index, MS_INDEXSIZE, D3DMULTISAMPLE_4_SAMPLES, &id);
+        if (!pt) pt = CArrayList_IndexedPtr(tl, index, MS_INDEXSIZE, D3DMULTISAMPLE_NONE, &id);
         if (!pt) {
             id = 0;
             pt = CArrayList_GetPtr(tl, id);
@@ -205,7 +292,7 @@ static void set_multisample_config(struct CArrayList *tl, struct CArrayList *ql,
         fail("invalid multisample type configuration.");
     } else {
         int tprefer = msTypeArray[ms_tflag];
-        int *pt = CArrayList_FindInt(tl, tprefer, &id);
+        int *pt = CArrayList_IndexedPtr(tl, index, MS_INDEXSIZE, tprefer, &id);
         if (!pt) {
             warning("multisample type not supported, fallback to default configuration.");
             *tret = *qret = 0;
@@ -224,13 +311,23 @@ static void set_multisample_config(struct CArrayList *tl, struct CArrayList *ql,
     }
     *qret = q;
 }
+static void apply_multisample_config(struct CArrayList *tl, struct CArrayList *ql, int *tret, int *qret)
+{
+    set_multisample_config(tl, ql, tret, qret);
+    if (ms3d_enabled) {
+        // back buffer is created without multisample, see multisample 3D only patch
+        ms3d_type = *tret;
+        ms3d_quality = *qret;
+        *tret = *qret = 0;
+    }
+}
 static MAKE_ASMPATCH(multisample_windowed)
 {
-    set_multisample_config(TOPTR(M_DWORD(R_EBP + 0x18)), TOPTR(M_DWORD(R_EBP + 0x1C)), TOPTR(R_EDI + 0x694), TOPTR(R_EDI + 0x698));
+    apply_multisample_config(TOPTR(M_DWORD(R_EBP + 0x18)), TOPTR(M_DWORD(R_EBP + 0x1C)), TOPTR(R_EDI + 0x694), TOPTR(R_EDI + 0x698));
 }
 static MAKE_ASMPATCH(multisample_fullscreen)
 {
-    set_multisample_config(TOPTR(M_DWORD(R_ECX + 0x18)), TOPTR(M_DWORD(R_ECX + 0x1C)), TOPTR(R_ESI + 0x6CC), TOPTR(R_ESI + 0x6D0));
+    apply_multisample_config(TOPTR(M_DWORD(R_ECX + 0x18)), TOPTR(M_DWORD(R_ECX + 0x1C)), TOPTR(R_ESI + 0x6CC), TOPTR(R_ESI + 0x6D0));
 }
 static void patch_multisample_config(const char *cfgstr)
 {
@@ -249,6 +346,180 @@ static void patch_multisample_config(const char *cfgstr)
 
 
 
+// multisample 3D only patch
+//   back buffer is created without multisample, 3D scene is rendered to our own
+//   multisample render target, which is resolved to back buffer by StretchRect()
+//   once per frame, right before first UI quad or text is drawn (or at EndScene()),
+//   so UI is drawn without multisample and only once
+//
+//   engine may have saved its "default" surfaces in either phase,
+//   so SetRenderTarget() and SetDepthStencilSurface() swap them to surfaces of current phase
+//   we patch the device vtable by giving it a modified copy of its vtable
+enum {
+    MS3D_OFF,
+    MS3D_SCENE, // drawing to multisample surfaces
+    MS3D_UI,    // resolved, drawing to back buffer
+};
+static int ms3d_phase;
+static IDirect3DSurface9 *ms3d_rt, *ms3d_ds;
+static IDirect3DSurface9 *ms3d_bb, *ms3d_bbds;
+static int ms3d_stencil;
+static unsigned ms3d_nr_resolve, ms3d_nr_forced;
+
+static IDirect3DDevice9ExVtbl ms3d_vtbl; // big enough for both IDirect3DDevice9 and IDirect3DDevice9Ex
+
+static HRESULT (STDMETHODCALLTYPE *Real_SetRenderTarget)(IDirect3DDevice9 *, DWORD, IDirect3DSurface9 *);
+static HRESULT (STDMETHODCALLTYPE *Real_SetDepthStencilSurface)(IDirect3DDevice9 *, IDirect3DSurface9 *);
+
+static HRESULT STDMETHODCALLTYPE SetRenderTarget_ms3d(IDirect3DDevice9 *This, DWORD RenderTargetIndex, IDirect3DSurface9 *pRenderTarget)
+{
+    if (RenderTargetIndex == 0) {
+        if (ms3d_phase == MS3D_SCENE && pRenderTarget == ms3d_bb) {
+            pRenderTarget = ms3d_rt;
+        } else if (ms3d_phase == MS3D_UI && pRenderTarget == ms3d_rt) {
+            pRenderTarget = ms3d_bb;
+        }
+    }
+    return Real_SetRenderTarget(This, RenderTargetIndex, pRenderTarget);
+}
+static HRESULT STDMETHODCALLTYPE SetDepthStencilSurface_ms3d(IDirect3DDevice9 *This, IDirect3DSurface9 *pNewZStencil)
+{
+    if (pNewZStencil) {
+        if (ms3d_phase == MS3D_SCENE && pNewZStencil == ms3d_bbds) {
+            pNewZStencil = ms3d_ds;
+        } else if (ms3d_phase == MS3D_UI && pNewZStencil == ms3d_ds) {
+            pNewZStencil = ms3d_bbds;
+        }
+    }
+    return Real_SetDepthStencilSurface(This, pNewZStencil);
+}
+
+static void ms3d_bind(IDirect3DSurface9 *rt, IDirect3DSurface9 *ds)
+{
+    IDirect3DDevice9 *dev = GB_GfxMgr->m_pd3dDevice;
+    D3DVIEWPORT9 vp;
+    
+    // SetRenderTarget() will reset viewport
+    IDirect3DDevice9_GetViewport(dev, &vp);
+    Real_SetRenderTarget(dev, 0, rt);
+    Real_SetDepthStencilSurface(dev, ds);
+    IDirect3DDevice9_SetViewport(dev, &vp);
+}
+
+static void ms3d_resolve(int force)
+{
+    IDirect3DDevice9 *dev = GB_GfxMgr->m_pd3dDevice;
+    if (ms3d_phase != MS3D_SCENE) return;
+    
+    if (!force) {
+        // engine may be rendering to texture, quads drawn there are part of 3D scene
+        IDirect3DSurface9 *cur;
+        if (FAILED(IDirect3DDevice9_GetRenderTarget(dev, 0, &cur))) return;
+        IDirect3DSurface9_Release(cur);
+        if (cur != ms3d_rt) return;
+    } else {
+        ms3d_nr_forced++;
+    }
+    
+    ms3d_phase = MS3D_UI;
+    IDirect3DDevice9_StretchRect(dev, ms3d_rt, NULL, ms3d_bb, NULL, D3DTEXF_NONE);
+    ms3d_bind(ms3d_bb, ms3d_bbds);
+    
+    // scene depth is in multisample depth buffer, give UI a clean one
+    if (ms3d_bbds) {
+        IDirect3DDevice9_Clear(dev, 0, NULL, D3DCLEAR_ZBUFFER | (ms3d_stencil ? D3DCLEAR_STENCIL : 0), 0, 1.0f, 0);
+    }
+    ms3d_nr_resolve++;
+}
+void multisample_end3d()
+{
+    // called before drawing UI
+    ms3d_resolve(0);
+}
+static void ms3d_preendscene()
+{
+    // no UI in this frame
+    ms3d_resolve(1);
+}
+static void ms3d_postpresent()
+{
+    if (ms3d_phase == MS3D_OFF) return;
+    ms3d_phase = MS3D_SCENE;
+    ms3d_bind(ms3d_rt, ms3d_ds);
+}
+
+static void ms3d_release()
+{
+    // device still references bound surfaces
+    if (ms3d_phase != MS3D_OFF) ms3d_bind(ms3d_bb, ms3d_bbds);
+    ms3d_phase = MS3D_OFF;
+    if (ms3d_rt) { IDirect3DSurface9_Release(ms3d_rt); ms3d_rt = NULL; }
+    if (ms3d_ds) { IDirect3DSurface9_Release(ms3d_ds); ms3d_ds = NULL; }
+    if (ms3d_bb) { IDirect3DSurface9_Release(ms3d_bb); ms3d_bb = NULL; }
+    if (ms3d_bbds) { IDirect3DSurface9_Release(ms3d_bbds); ms3d_bbds = NULL; }
+}
+static void ms3d_create()
+{
+    IDirect3DDevice9 *dev = GB_GfxMgr->m_pd3dDevice;
+    D3DPRESENT_PARAMETERS *pp = &GB_GfxMgr->m_d3dpp;
+    D3DSURFACE_DESC desc;
+    
+    if (FAILED(IDirect3DDevice9_GetBackBuffer(dev, 0, 0, D3DBACKBUFFER_TYPE_MONO, &ms3d_bb))) goto fail;
+    if (FAILED(IDirect3DSurface9_GetDesc(ms3d_bb, &desc))) goto fail;
+    if (FAILED(IDirect3DDevice9_CreateRenderTarget(dev, desc.Width, desc.Height, desc.Format, ms3d_type, ms3d_quality, FALSE, &ms3d_rt, NULL))) goto fail;
+    if (pp->EnableAutoDepthStencil) {
+        if (FAILED(IDirect3DDevice9_GetDepthStencilSurface(dev, &ms3d_bbds))) goto fail;
+        if (FAILED(IDirect3DDevice9_CreateDepthStencilSurface(dev, desc.Width, desc.Height, pp->AutoDepthStencilFormat, ms3d_type, ms3d_quality, FALSE, &ms3d_ds, NULL))) goto fail;
+        switch (pp->AutoDepthStencilFormat) {
+            case D3DFMT_D15S1: case D3DFMT_D24S8: case D3DFMT_D24X4S4: case D3DFMT_D24FS8: ms3d_stencil = 1; break;
+            default: ms3d_stencil = 0; break;
+        }
+    }
+    
+    ms3d_phase = MS3D_SCENE;
+    ms3d_bind(ms3d_rt, ms3d_ds);
+    return;
+fail:
+    warning("can't create multisample surfaces, 3D scene will be rendered without multisample.");
+    ms3d_release();
+}
+
+static void ms3d_hookdevice()
+{
+    IDirect3DDevice9 *dev = GB_GfxMgr->m_pd3dDevice;
+    IDirect3DDevice9Vtbl *vtbl = (IDirect3DDevice9Vtbl *) &ms3d_vtbl;
+    
+    if (!dev || dev->lpVtbl == vtbl || ms3d_type == D3DMULTISAMPLE_NONE) return;
+    
+    patch_device_vtable(dev, &ms3d_vtbl);
+    
+    Real_SetRenderTarget = vtbl->SetRenderTarget;
+    Real_SetDepthStencilSurface = vtbl->SetDepthStencilSurface;
+    vtbl->SetRenderTarget = SetRenderTarget_ms3d;
+    vtbl->SetDepthStencilSurface = SetDepthStencilSurface_ms3d;
+    dev->lpVtbl = vtbl;
+    
+    ms3d_create();
+    add_hook_ex(HOOKID_PREENDSCENE, ms3d_preendscene, HOOK_PRIORITY_FIRST);
+    add_hook_ex(HOOKID_POSTPRESENT, ms3d_postpresent, HOOK_PRIORITY_LAST);
+    add_onlostdevice_hook(ms3d_release);
+    add_onresetdevice_hook(ms3d_create);
+}
+static void ms3d_report()
+{
+    plog("multisample 3D only: %u resolves, %u at EndScene.", ms3d_nr_resolve, ms3d_nr_forced);
+}
+static void init_multisample_3d_patch()
+{
+    if (!get_int_from_configfile("game_multisample_3donly")) return;
+    if (!ms_tflag && !ms_qflag) return;
+    ms3d_enabled = 1;
+    add_hook_ex(HOOKID_POSTD3DCREATE, ms3d_hookdevice, HOOK_PRIORITY_FIRST);
+    add_atexit_hook(ms3d_report);
+}
+
+
+
 
 
 
@@ -312,6 +583,13 @@ static void patch_resolution_config(const char *cfgstr)
 
 // refreshrate patch
 static int prefered_refreshrate = 60;
+// display mode list is only walked when mode changes, not at every reset
+static struct {
+    struct CArrayList *list;
+    UINT nr_modes;
+    D3DDISPLAYMODE mode; // mode before recalc
+    UINT refreshrate;
+} refreshrate_cache;
 static MAKE_ASMPATCH(recalc_fullscreen_refreshrate)
 {
     struct gbGfxManager_D3D *this = TOPTR(R_ECX);
@@ -319,8 +597,14 @@ static MAKE_ASMPATCH(recalc_fullscreen_refreshrate)
     struct D3DAdapterInfo *pBestAdapterInfo = this->m_d3dSettings.pFullscreen_AdapterInfo;
     D3DDISPLAYMODE *pBestDisplayMode = &this->m_d3dSettings.Fullscreen_DisplayMode;
 
-    if (prefered_refreshrate > 0) {   
+    if (prefered_refreshrate > 0 && refreshrate_cache.list == pBestAdapterInfo->pDisplayModeList && refreshrate_cache.nr_modes == pBestAdapterInfo->pDisplayModeList->m_NumEntries && memcmp(&refreshrate_cache.mode, pBestDisplayMode, sizeof(D3DDISPLAYMODE)) == 0) {
+        // same mode as last time (e.g. device reset)
+        pBestDisplayMode->RefreshRate = refreshrate_cache.refreshrate;
+    } else if (prefered_refreshrate > 0) {
         unsigned idm;
+        refreshrate_cache.list = pBestAdapterInfo->pDisplayModeList;
+        refreshrate_cache.nr_modes = pBestAdapterInfo->pDisplayModeList->m_NumEntries;
+        refreshrate_cache.mode = *pBestDisplayMode;
         for (idm = 0; idm < pBestAdapterInfo->pDisplayModeList->m_NumEntries; idm++) {
             D3DDISPLAYMODE *pdm = CArrayList_GetPtr(pBestAdapterInfo->pDisplayModeList, idm);
             if (pBestDisplayMode->Width == pdm->Width && pBestDisplayMode->Height == pdm->Height && pBestDisplayMode->Format == pdm->Format) {
@@ -329,6 +613,7 @@ static MAKE_ASMPATCH(recalc_fullscreen_refreshrate)
                 }
             }
         }
+        refreshrate_cache.refreshrate = pBestDisplayMode->RefreshRate;
     }
     
     // oldcode
@@ -391,12 +676,14 @@ void try_goto_desktop()
 static int topmost_ms = 0;
 static int topmost_countdown = 0;
 static DWORD topmost_create;
+static int topmost_hook;
 static void topmost_gameloop_hook(void *arg)
 {
     if (topmost_countdown) {
         if (timeGetTime() - topmost_create >= (unsigned) topmost_ms) {
             SetWindowPos(game_hwnd, HWND_NOTOPMOST, 0, 0, 0, 0, SWP_NOMOVE | SWP_NOSIZE);
             topmost_countdown = 0;
+            remove_hook(topmost_hook);
         }
     }
 }
@@ -648,7 +935,7 @@ static void init_window_patch(int flag)
     }
     if (topmost_ms != 0) {
         SIMPLE_PATCH(gboffset + 0x1001A9E2, "\x6A\xFE", "\x6A\xFF", 2);
-        add_gameloop_hook(topmost_gameloop_hook);
+        topmost_hook = add_gameloop_hook_ex(topmost_gameloop_hook, GAMELOOP_MASK_ALL, HOOK_PRIORITY_DEFAULT);
     }
 
     // hook CreateWindowEx
@@ -838,6 +1125,7 @@ MAKE_PATCHSET(graphicspatch)
     patch_refreshrate_config(get_string_from_configfile("game_refreshrate"));
     patch_depth_buffer_config(get_string_from_configfile("game_zbufferbits"));
     patch_multisample_config(get_string_from_configfile("game_multisample"));
+    init_multisample_3d_patch();
     init_resolution_and_window_patch();
     init_scalefactor_table();
     fpslimit_init();
@@ -0,0 +1,222 @@
+#include "common.h"
+
+// heap telemetry
+//   a background thread walks the CRT heaps of PAL3.EXE, GBENGINE.DLL and
+//   PAL3PATCH.DLL every few seconds, and scans the process address space
+//   live bytes, peak bytes, net allocation rate and block size histogram
+//   are collected for each heap, and the largest free region of address space
+//   shows how fragmented it is
+//
+//   heap functions are not hooked, the heap of each module is found by
+//   find_allocator_heap(), see memallocator.c
+//   blocks served by MSVC small-block heap are not visible to us
+
+#define HEAPSTAT_NBUCKET 9 // <=64B, <=256B, ..., <=1MB, >1MB
+
+enum heapstat_module {
+    HEAPSTAT_PAL3,
+    HEAPSTAT_GB,
+    HEAPSTAT_PATCH,
+    MAX_HEAPSTAT_MODULE // EOF
+};
+
+struct heap_stat {
+    HANDLE heap; // NULL if not found or shared with another module
+    size_t live;
+    size_t peak;
+    size_t free; // committed but free bytes inside heap
+    unsigned blocks;
+    double rate; // bytes per second
+    unsigned hist[HEAPSTAT_NBUCKET];
+};
+
+struct va_stat {
+    size_t free;
+    size_t largest;
+};
+
+static const char *const module_names[MAX_HEAPSTAT_MODULE] = { "PAL3", "GBENGINE", "PATCH" };
+static struct heap_stat heaps[MAX_HEAPSTAT_MODULE];
+static struct va_stat va;
+static unsigned nr_samples;
+
+int heapstat_enabled;
+static DWORD sample_period;
+static CRITICAL_SECTION heapstat_cs;
+static HANDLE quit_event;
+static HANDLE sampler_thread;
+
+static int size_bucket(size_t size)
+{
+    int i;
+    for (i = 0; i < HEAPSTAT_NBUCKET - 1; i++) {
+        if (size <= (64u << (2 * i))) break;
+    }
+    return i;
+}
+
+static void walk_heap(HANDLE heap, struct heap_stat *st)
+{
+    PROCESS_HEAP_ENTRY e;
+    if (!HeapLock(heap)) return;
+    e.lpData = NULL;
+    while (HeapWalk(heap, &e)) {
+        if (e.wFlags & PROCESS_HEAP_ENTRY_BUSY) {
+            st->live += e.cbData;
+            st->blocks++;
+            st->hist[size_bucket(e.cbData)]++;
+        } else if (!(e.wFlags & (PROCESS_HEAP_REGION | PROCESS_HEAP_UNCOMMITTED_RANGE))) {
+            st->free += e.cbData;
+        }
+    }
+    HeapUnlock(heap);
+}
+
+static void scan_va(struct va_stat *st)
+{
+    SYSTEM_INFO si;
+    MEMORY_BASIC_INFORMATION mbi;
+    GetSystemInfo(&si);
+    memset(st, 0, sizeof(*st));
+    unsigned addr = TOUINT(si.lpMinimumApplicationAddress);
+    while (addr < TOUINT(si.lpMaximumApplicationAddress) && VirtualQuery(TOPTR(addr), &mbi, sizeof(mbi)) == sizeof(mbi)) {
+        if (mbi.State == MEM_FREE) {
+            st->free += mbi.RegionSize;
+            if (mbi.RegionSize > st->largest) st->largest = mbi.RegionSize;
+        }
+        if (addr + mbi.RegionSize <= addr) break;
+        addr += mbi.RegionSize;
+    }
+}
+
+static void heapstat_sample(double dt)
+{
+    struct heap_stat st[MAX_HEAPSTAT_MODULE];
+    struct va_stat v;
+    int i;
+    
+    // walk without holding our lock, only this thread writes the stats
+    memset(st, 0, sizeof(st));
+    for (i = 0; i < MAX_HEAPSTAT_MODULE; i++) {
+        st[i].heap = heaps[i].heap;
+        if (st[i].heap) walk_heap(st[i].heap, &st[i]);
+    }
+    scan_va(&v);
+    
+    EnterCriticalSection(&heapstat_cs);
+    for (i = 0; i < MAX_HEAPSTAT_MODULE; i++) {
+        st[i].peak = st[i].live > heaps[i].peak ? st[i].live : heaps[i].peak;
+        st[i].rate = nr_samples && dt > 0 ? ((double) st[i].live - heaps[i].live) / dt : 0;
+        heaps[i] = st[i];
+    }
+    va = v;
+    nr_samples++;
+    LeaveCriticalSection(&heapstat_cs);
+}
+
+static DWORD WINAPI heapstat_thread(LPVOID lpParameter)
+{
+    DWORD last = GetTickCount();
+    do {
+        DWORD now = GetTickCount();
+        heapstat_sample((now - last) / 1000.0);
+        last = now;
+    } while (WaitForSingleObject(quit_event, sample_period) == WAIT_TIMEOUT);
+    return 0;
+}
+
+int heapstat_get_summary(double *live_mb, double *vafree_mb)
+{
+    // total live bytes of all heaps, and the largest free region
+    int i, ret = 0;
+    if (!heapstat_enabled) return 0;
+    EnterCriticalSection(&heapstat_cs);
+    if (nr_samples) {
+        size_t live = 0;
+        for (i = 0; i < MAX_HEAPSTAT_MODULE; i++) live += heaps[i].live;
+        *live_mb = live / 1048576.0;
+        *vafree_mb = va.largest / 1048576.0;
+        ret = 1;
+    }
+    LeaveCriticalSection(&heapstat_cs);
+    return ret;
+}
+
+void get_heapstat_text(char *buf, int size)
+{
+    // overlay lines for showfps
+    char *ptr = buf;
+    int i;
+    *ptr = '\0';
+    if (!heapstat_enabled) return;
+    EnterCriticalSection(&heapstat_cs);
+    if (nr_samples) {
+        for (i = 0; i < MAX_HEAPSTAT_MODULE; i++) {
+            struct heap_stat *st = &heaps[i];
+            if (!st->heap) continue;
+            snprintf(ptr, buf + size - ptr, "HEAP %s = %.1fMB (peak %.1fMB, %+.3fMB/s, %u blocks)\n", module_names[i], st->live / 1048576.0, st->peak / 1048576.0, st->rate / 1048576.0, st->blocks);
+            ptr += strlen(ptr);
+        }
+        snprintf(ptr, buf + size - ptr, "VA FREE = %.1fMB (largest %.1fMB)\n", va.free / 1048576.0, va.largest / 1048576.0);
+    }
+    LeaveCriticalSection(&heapstat_cs);
+}
+
+static void heapstat_atexit()
+{
+    int i, j;
+    SetEvent(quit_event);
+    WaitForSingleObject(sampler_thread, INFINITE);
+    CloseHandle(sampler_thread);
+    
+    for (i = 0; i < MAX_HEAPSTAT_MODULE; i++) {
+        struct heap_stat *st = &heaps[i];
+        if (!st->heap) continue;
+        char hist[MAXLINE];
+        char *ptr = hist;
+        *ptr = '\0';
+        for (j = 0; j < HEAPSTAT_NBUCKET; j++) {
+            snprintf(ptr, hist + sizeof(hist) - ptr, " %u", st->hist[j]);
+            ptr += strlen(ptr);
+        }
+        plog("heap stat: %s live %.1fMB, peak %.1fMB, free %.1fMB, %u blocks, histogram%s", module_names[i], st->live / 1048576.0, st->peak / 1048576.0, st->free / 1048576.0, st->blocks, hist);
+    }
+    plog("heap stat: %u samples, address space free %.1fMB, largest %.1fMB.", nr_samples, va.free / 1048576.0, va.largest / 1048576.0);
+}
+
+MAKE_PATCHSET(heapstat)
+{
+    if (is_win9x()) {
+        // HeapWalk() is not implemented on win9x
+        warning("heapstat doesn't support win9x.");
+        return;
+    }
+    sample_period = imax(flag, 1) * 1000u;
+    
+    const struct memory_allocator *allocators[MAX_HEAPSTAT_MODULE] = { &pal3_mem_allocator, &gb_mem_allocator, &patch_mem_allocator };
+    int i, j;
+    for (i = 0; i < MAX_HEAPSTAT_MODULE; i++) {
+        heaps[i].heap = find_allocator_heap(allocators[i]);
+        if (!heaps[i].heap) {
+            plog("heap stat: heap of %s not found.", module_names[i]);
+            continue;
+        }
+        for (j = 0; j < i; j++) {
+            if (heaps[i].heap == heaps[j].heap) {
+                plog("heap stat: %s shares heap with %s.", module_names[i], module_names[j]);
+                heaps[i].heap = NULL;
+                break;
+            }
+        }
+    }
+    
+    InitializeCriticalSection(&heapstat_cs);
+    quit_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!quit_event) fail("can't create heap stat event.");
+    sampler_thread = CreateThread(NULL, 0, heapstat_thread, NULL, 0, NULL);
+    if (!sampler_thread) fail("can't create heap stat thread.");
+    sched_set_thread(sampler_thread, SCHED_BACKGROUND);
+    heapstat_enabled = 1;
+    
+    add_atexit_hook(heapstat_atexit);
+}
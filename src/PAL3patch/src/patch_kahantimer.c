@@ -27,6 +27,7 @@ MAKE_PATCHSET(kahantimer)
 {
     // patch PAL3::Update
     // not using a wrapper because there is already a wrapper in hook.c
+    // FPU stack is empty at patch site, since the FLD above is removed
     SIMPLE_PATCH_NOP(0x004055D0, "\xD9\x05\xA0\xDA\xBF\x00\xD8\x44\x24\x04", 10);
-    INIT_ASMPATCH(update_gametime, 0x004055E4, 6, "\xD9\x1D\xA0\xDA\xBF\x00");
+    INIT_ASMPATCH_LITE(update_gametime, 0x004055E4, 6, "\xD9\x1D\xA0\xDA\xBF\x00");
 }
@@ -0,0 +1,266 @@
+#include "common.h"
+
+// microbenchmarks of patch utilities
+//   times pure-C helpers of the patch in isolation, inside the game process,
+//   so engine functions like gbCrc32Compute() can be measured too
+//   run once after PAL3 is created, results are written to MICROBENCH_RESULT
+//   each case is run for MICROBENCH_ROUNDS rounds, ns/op is reported with
+//   mean, standard deviation and minimum of all rounds
+//
+//   effect hooks are run over every .gbf file in MICROBENCH_DIR,
+//   extract effect files there to include this case
+
+#define MICROBENCH_RESULT "PAL3patch.microbench.txt"
+#define MICROBENCH_DIR "microbench"
+#define MICROBENCH_ROUNDS 16
+#define MICROBENCH_BASEOPS 10000
+
+struct mb_case {
+    const char *name;
+    unsigned ops; // per round, before scaling
+    void (*run)(unsigned n);
+};
+
+static unsigned mb_scale;
+static volatile unsigned mb_sink; // keep results alive
+static struct bvec mb_effects; // char *, contents of effect files
+static struct bvec mb_effnames; // char *
+
+static const char mb_text[] = "sOFTsTAR PAL3 microbench \xCF\xC9\xBD\xA3\xC6\xE6\xCF\xC0\xB4\xAB\xC8\xFD 0123456789";
+
+static void mb_bvec_push(unsigned n)
+{
+    struct bvec v;
+    unsigned i;
+    bvec_ctor(&v);
+    for (i = 0; i < n; i++) {
+        bvec_push_unsigned(&v, i);
+        if ((i & 1023) == 1023) bvec_clear(&v);
+    }
+    mb_sink += bvec_tsize(&v, unsigned);
+    bvec_dtor(&v);
+}
+
+static void mb_cstr_strcat(unsigned n)
+{
+    struct cstr s;
+    unsigned i;
+    cstr_ctor(&s);
+    for (i = 0; i < n; i++) {
+        cstr_strcat(&s, "effect\\");
+        if ((i & 255) == 255) cstr_clear(&s);
+    }
+    mb_sink += cstr_strlen(&s);
+    cstr_dtor(&s);
+}
+
+static void mb_scstr_format(unsigned n)
+{
+    struct scstr s;
+    unsigned i;
+    scstr_ctor(&s);
+    for (i = 0; i < n; i++) {
+        scstr_format(&s, "%s\\%u.tga", "texture", i);
+    }
+    mb_sink += scstr_strlen(&s);
+    scstr_dtor(&s);
+}
+
+static void mb_utf8_to_utf16(unsigned n)
+{
+    unsigned i;
+    for (i = 0; i < n; i++) {
+        wchar_t *w = utf8_to_utf16("PAL3patch \xE4\xBB\x99\xE5\x89\x91\xE5\xA5\x87\xE4\xBE\xA0\xE4\xBC\xA0 microbench");
+        mb_sink += w[0];
+        free(w);
+    }
+}
+
+static void mb_cjktable_decode(unsigned n)
+{
+    const wchar_t *table = cjktable_get(CODEPAGE_CHS);
+    wchar_t buf[sizeof(mb_text)];
+    unsigned i;
+    if (!table) return;
+    for (i = 0; i < n; i++) {
+        mb_sink += cjktable_decode(mb_text, sizeof(mb_text) - 1, table, buf);
+    }
+}
+
+static void mb_config_lookup(unsigned n)
+{
+    static const char *keys[] = { "graphicspatch", "fixui", "benchmark_fps", "microbench" };
+    unsigned i;
+    for (i = 0; i < n; i++) {
+        mb_sink += get_int_from_configfile(keys[i & 3]);
+    }
+}
+
+static void mb_config_reload(unsigned n)
+{
+    unsigned i;
+    for (i = 0; i < n; i++) {
+        mb_sink += reload_config_file();
+    }
+}
+
+static void mb_gbcrc32(unsigned n)
+{
+    static const char *paths[] = { "scene\\q01\\q01.scn", "basedata\\ui\\gameui\\main.tga", "music\\p01.mp3", "effect\\geom_diffuse_t.gbf" };
+    unsigned i;
+    for (i = 0; i < n; i++) {
+        mb_sink += gbCrc32Compute(paths[i & 3]);
+    }
+}
+
+static void mb_sha1_4k(unsigned n)
+{
+    static unsigned char buf[4096];
+    unsigned char sum[20];
+    SHA1_CTX ctx;
+    unsigned i;
+    SHA1Init(&ctx);
+    for (i = 0; i < n; i++) {
+        SHA1Update(&ctx, buf, sizeof(buf));
+    }
+    SHA1Final(sum, &ctx);
+    mb_sink += sum[0];
+}
+
+static void mb_transform_frect(unsigned n)
+{
+    fRECT src = { 0, 0, 800, 600 }, dst = { 0, 0, 1920, 1080 };
+    fRECT rect = { 10, 20, 110, 70 }, out;
+    unsigned i;
+    for (i = 0; i < n; i++) {
+        transform_frect(&out, &rect, &src, &dst, TR_SCALE_MID, TR_SCALE_MID, 1.0);
+        rect.left = out.left - (int) out.left;
+    }
+    mb_sink += (int) out.right;
+}
+
+static void mb_ftlayout_addrect(unsigned n)
+{
+    struct ftlayout *l = malloc(sizeof(struct ftlayout));
+    unsigned i;
+    int u, v;
+    if (!l) return;
+    ftlayout_clear(l, 1024, 1024, FTFONT_TEXTURE_MARGIN);
+    for (i = 0; i < n; i++) {
+        // glyph-like sizes, start over when texture is full
+        if (ftlayout_addrect(l, 12 + i % 21, 16 + i % 13, &u, &v) <= 0) {
+            ftlayout_clear(l, 1024, 1024, FTFONT_TEXTURE_MARGIN);
+        }
+    }
+    mb_sink += l->nr_nodes;
+    free(l);
+}
+
+static void mb_effhook(unsigned n)
+{
+    unsigned i, nr = bvec_tsize(&mb_effects, char *);
+    if (!nr) return;
+    for (i = 0; i < n; i++) {
+        char *s = run_all_effect_hooks(bvec_tat(&mb_effnames, i % nr, char *), bvec_tat(&mb_effects, i % nr, char *));
+        mb_sink += s[0];
+        free(s);
+    }
+}
+
+static const struct mb_case mb_cases[] = {
+    { "bvec_push_unsigned", 100000, mb_bvec_push },
+    { "cstr_strcat", 100000, mb_cstr_strcat },
+    { "scstr_format", 10000, mb_scstr_format },
+    { "utf8_to_utf16", 10000, mb_utf8_to_utf16 },
+    { "cjktable_decode", 10000, mb_cjktable_decode },
+    { "get_int_from_configfile", 100000, mb_config_lookup },
+    { "reload_config_file", 10, mb_config_reload },
+    { "gbCrc32Compute", 100000, mb_gbcrc32 },
+    { "SHA1Update(4KB)", 1000, mb_sha1_4k },
+    { "transform_frect", 100000, mb_transform_frect },
+    { "ftlayout_addrect", 100000, mb_ftlayout_addrect },
+    { "run_all_effect_hooks", 100, mb_effhook },
+};
+
+static void mb_load_effect(const char *filepath, void *arg)
+{
+    FILE *fp = robust_fopen(filepath, "rb");
+    struct cstr s;
+    char buf[4096];
+    size_t len;
+    if (!fp) return;
+    cstr_ctor(&s);
+    while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        cstr_push(&s, buf, len);
+    }
+    fclose(fp);
+    char *text = cstr_mdtor(&s);
+    char *name = strdup(get_filepart(filepath));
+    bvec_tpushback(&mb_effects, &text, char *);
+    bvec_tpushback(&mb_effnames, &name, char *);
+}
+
+static int double_cmp(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void microbench_run()
+{
+    LARGE_INTEGER freq, begin, end;
+    double ns[MICROBENCH_ROUNDS];
+    unsigned i, r;
+
+    FILE *fp = robust_fopen(MICROBENCH_RESULT, "w");
+    if (!fp) {
+        warning("can't write microbench result file '%s'.", MICROBENCH_RESULT);
+        return;
+    }
+    QueryPerformanceFrequency(&freq);
+
+    bvec_ctor(&mb_effects);
+    bvec_ctor(&mb_effnames);
+    enum_files(MICROBENCH_DIR, "*.gbf", mb_load_effect, NULL);
+
+    fprintf(fp, "microbench %s\n", patch_version);
+    fprintf(fp, "%s\n", build_info);
+    fprintf(fp, "rounds: %u, scale: %u, effect files: %u\n", MICROBENCH_ROUNDS, mb_scale, (unsigned) bvec_tsize(&mb_effects, char *));
+    fprintf(fp, "%-24s %12s %12s %12s %12s\n", "case", "ops/round", "mean ns/op", "stddev", "min");
+    for (i = 0; i < sizeof(mb_cases) / sizeof(mb_cases[0]); i++) {
+        const struct mb_case *c = &mb_cases[i];
+        unsigned n = c->ops * mb_scale;
+        double sum = 0, sqsum = 0;
+
+        c->run(imax(n / 16, 1)); // warm up
+        for (r = 0; r < MICROBENCH_ROUNDS; r++) {
+            QueryPerformanceCounter(&begin);
+            c->run(n);
+            QueryPerformanceCounter(&end);
+            ns[r] = (end.QuadPart - begin.QuadPart) * 1e9 / freq.QuadPart / n;
+            sum += ns[r];
+            sqsum += ns[r] * ns[r];
+        }
+        double mean = sum / MICROBENCH_ROUNDS;
+        double var = sqsum / MICROBENCH_ROUNDS - mean * mean;
+        qsort(ns, MICROBENCH_ROUNDS, sizeof(double), double_cmp);
+        fprintf(fp, "%-24s %12u %12.1f %12.1f %12.1f\n", c->name, n, mean, sqrt(var > 0 ? var : 0), ns[0]);
+        plog("microbench: %s %.1f ns/op.", c->name, mean);
+    }
+
+    for (i = 0; i < bvec_tsize(&mb_effects, char *); i++) {
+        free(bvec_tat(&mb_effects, i, char *));
+        free(bvec_tat(&mb_effnames, i, char *));
+    }
+    bvec_dtor(&mb_effects);
+    bvec_dtor(&mb_effnames);
+    if (safe_fclose(&fp) != 0) {
+        warning("can't write microbench result file '%s'.", MICROBENCH_RESULT);
+    }
+}
+
+MAKE_PATCHSET(microbench)
+{
+    mb_scale = flag;
+    add_postpal3create_hook(microbench_run);
+}
@@ -9,10 +9,84 @@ static int (WINAPI *BinkPause)(HBINK bink, int pause);
 static IDirect3DTexture9 *mf_tex = NULL;
 static double mf_tex_u1, mf_tex_v1, mf_tex_u2, mf_tex_v2;
 static double mf_tex_ratio;
+static int mf_tex_dirty_width, mf_tex_dirty_height; // area of mf_tex written by movies since last zero-fill
+static int mf_tex_prealloc; // create textures after device is created, see movieprefetch in config
 static int mf_tex_clamp;
 static int mf_bink_dstsurfacetype;
 static fRECT mf_frect;
 
+// dynamic textures, rotated every frame and locked with D3DLOCK_DISCARD
+//   so we don't wait for GPU to finish with last frame
+//   clamp_rect() reads back texels, which is very slow on dynamic textures,
+//   so in this mode texture coords are shrunk by half a texel instead
+#define MF_MAXDYNTEX 3
+static int mf_dyntex_count; // zero if dynamic textures are not used
+static IDirect3DTexture9 *mf_dyntex[MF_MAXDYNTEX];
+static int mf_dyntex_cur;
+
+// YUV textures, see movieyuv in config
+//   Bink writes YV12 planes instead of RGB, each plane is uploaded to a L8 texture
+//   and converted by a pixel shader, so CPU doesn't do color conversion and
+//   only 12 bits per pixel are uploaded
+//   textures are dynamic and rotated like above if movietexcount is used
+#define BINKSURFACEYV12 15
+static int mf_yuv; // zero if YUV textures are not used
+static IDirect3DTexture9 *mf_yuvtex[MF_MAXDYNTEX][3]; // Y, U, V
+static IDirect3DPixelShader9 *mf_yuv_shader;
+static void *mf_yuv_buf; // decode buffer when frame is not from decode thread, as large as Y texture
+static int mf_yuv_pitch, mf_yuv_height;
+
+// BT.601 video range, rgb = (y - 16) * c1 + (u - 128) * c2 + (v - 128) * c3
+// offsets are folded into c0
+static const DWORD mf_yuv_shader_code[] = {
+    0xFFFF0200,                                                             // ps_2_0
+    0x05000051, 0xA00F0000, 0xBF5FCBB9, 0x3F081B62, 0xBF8AF5F3, 0x3F800000, // def c0, -0.874202, 0.531668, -1.085631, 1.0
+    0x05000051, 0xA00F0001, 0x3F950A85, 0x3F950A85, 0x3F950A85, 0x00000000, // def c1, 1.164384, 1.164384, 1.164384, 0.0
+    0x05000051, 0xA00F0002, 0x00000000, 0xBEC89507, 0x40011A54, 0x00000000, // def c2, 0.0, -0.391762, 2.017232, 0.0
+    0x05000051, 0xA00F0003, 0x3FCC4A9D, 0xBF501EAC, 0x00000000, 0x00000000, // def c3, 1.596027, -0.812968, 0.0, 0.0
+    0x0200001F, 0x80000000, 0xB0030000,                                     // dcl t0.xy
+    0x0200001F, 0x90000000, 0xA00F0800,                                     // dcl_2d s0
+    0x0200001F, 0x90000000, 0xA00F0801,                                     // dcl_2d s1
+    0x0200001F, 0x90000000, 0xA00F0802,                                     // dcl_2d s2
+    0x03000042, 0x800F0000, 0xB0E40000, 0xA0E40800,                         // texld r0, t0, s0
+    0x03000042, 0x800F0001, 0xB0E40000, 0xA0E40801,                         // texld r1, t0, s1
+    0x03000042, 0x800F0002, 0xB0E40000, 0xA0E40802,                         // texld r2, t0, s2
+    0x04000004, 0x800F0003, 0x80000000, 0xA0E40001, 0xA0E40000,             // mad r3, r0.x, c1, c0
+    0x04000004, 0x800F0003, 0x80000001, 0xA0E40002, 0x80E40003,             // mad r3, r1.x, c2, r3
+    0x04000004, 0x801F0003, 0x80000002, 0xA0E40003, 0x80E40003,             // mad_sat r3, r2.x, c3, r3
+    0x02000001, 0x800F0800, 0x80E40003,                                     // mov oC0, r3
+    0x0000FFFF,                                                             // end
+};
+
+// decode thread
+//   when enabled, BinkWait(), BinkDoFrame() and BinkCopyToBuffer() are called by
+//   a worker thread, which decodes every frame into a small queue of system memory
+//   buffers as soon as it is due, render thread only uploads the newest one
+//   while worker is active, all Bink calls on the movie are serialized by mf_bink_cs
+//   NOTE: gbBinkVideo::DrawFrameEx() advances the movie, so frames are never decoded twice
+#define MF_MAXQUEUE 3
+enum {
+    MFQ_FREE,
+    MFQ_DECODING,
+    MFQ_READY,
+    MFQ_UPLOADING,
+};
+struct mf_queue_item {
+    int state;
+    unsigned seq;
+    void *buf;
+    int ret;
+    int skipped;
+};
+static int mf_queue_size; // zero if decode thread is not used
+static struct mf_queue_item mf_queue[MF_MAXQUEUE];
+static int mf_queue_pitch, mf_queue_height;
+static unsigned mf_queue_seq;
+static CRITICAL_SECTION mf_queue_cs, mf_bink_cs;
+static HANDLE mf_worker_event, mf_ready_event;
+static volatile LONG mf_worker_active;
+static struct gbBinkVideo *mf_worker_bink;
+
 // status
 static int mf_movie_playing = 0;
 static int mf_movie_paused = 0;
@@ -29,6 +103,8 @@ struct mf_vertex_t {
 #define MF_VBUF_TRANGLE_COUNT 2
 #define MF_VBUF_SIZE (MF_VBUF_TRANGLE_COUNT * 3)
 #define MF_VBUF_SIZE_BYTES (MF_VERTEX_SIZE * MF_VBUF_SIZE)
+static struct mf_vertex_t mf_vbuf_last[MF_VBUF_SIZE]; // used with dynamic textures
+static int mf_vbuf_dirty;
 
 static void mf_fillvbuf_rect(struct mf_vertex_t *vbuf, const fRECT *frect, float u1, float v1, float u2, float v2)
 {
@@ -67,12 +143,106 @@ static void init_movieframe_vertbuf()
 {
     // we need init vertbuf only once
     if (!mf_vbuf) {
-        if (FAILED(IDirect3DDevice9_CreateVertexBuffer(GB_GfxMgr->m_pd3dDevice, MF_VBUF_SIZE_BYTES, 0, MF_VERTEX_FVF, D3DPOOL_MANAGED, &mf_vbuf, NULL))) {
-            fail("can't create vertex buffer for movie frame.");
+        if (mf_dyntex_count) {
+            // dynamic vertex buffer, must be recreated after device reset
+            if (FAILED(IDirect3DDevice9_CreateVertexBuffer(GB_GfxMgr->m_pd3dDevice, MF_VBUF_SIZE_BYTES, D3DUSAGE_DYNAMIC | D3DUSAGE_WRITEONLY, MF_VERTEX_FVF, D3DPOOL_DEFAULT, &mf_vbuf, NULL))) {
+                fail("can't create dynamic vertex buffer for movie frame.");
+            }
+            mf_vbuf_dirty = 1;
+        } else {
+            if (FAILED(IDirect3DDevice9_CreateVertexBuffer(GB_GfxMgr->m_pd3dDevice, MF_VBUF_SIZE_BYTES, 0, MF_VERTEX_FVF, D3DPOOL_MANAGED, &mf_vbuf, NULL))) {
+                fail("can't create vertex buffer for movie frame.");
+            }
         }
     }
 }
 
+static int init_movieframe_dyntex()
+{
+    int i;
+    for (i = 0; i < mf_dyntex_count; i++) {
+        if (!mf_dyntex[i] && FAILED(IDirect3DDevice9_CreateTexture(GB_GfxMgr->m_pd3dDevice, MF_TEX_WIDTH, MF_TEX_HEIGHT, 1, D3DUSAGE_DYNAMIC, GB_GfxMgr->m_d3dsdBackBuffer.Format, D3DPOOL_DEFAULT, &mf_dyntex[i], NULL))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+static void release_movieframe_dyntex()
+{
+    int i;
+    for (i = 0; i < MF_MAXDYNTEX; i++) {
+        if (mf_dyntex[i]) {
+            IDirect3DTexture9_Release(mf_dyntex[i]);
+            mf_dyntex[i] = NULL;
+        }
+    }
+}
+static int init_movieframe_yuvtex()
+{
+    int i, j;
+    int count = mf_dyntex_count ? mf_dyntex_count : 1;
+    DWORD usage = mf_dyntex_count ? D3DUSAGE_DYNAMIC : 0;
+    D3DPOOL pool = mf_dyntex_count ? D3DPOOL_DEFAULT : D3DPOOL_MANAGED;
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < 3; j++) {
+            // U and V planes are half size
+            int shift = j ? 1 : 0;
+            if (!mf_yuvtex[i][j] && FAILED(IDirect3DDevice9_CreateTexture(GB_GfxMgr->m_pd3dDevice, MF_TEX_WIDTH >> shift, MF_TEX_HEIGHT >> shift, 1, usage, D3DFMT_L8, pool, &mf_yuvtex[i][j], NULL))) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+static void release_movieframe_yuvtex()
+{
+    int i, j;
+    for (i = 0; i < MF_MAXDYNTEX; i++) {
+        for (j = 0; j < 3; j++) {
+            if (mf_yuvtex[i][j]) {
+                IDirect3DTexture9_Release(mf_yuvtex[i][j]);
+                mf_yuvtex[i][j] = NULL;
+            }
+        }
+    }
+}
+static int mf_yuv_upload(IDirect3DTexture9 **tex, void *buf, DWORD lockflags)
+{
+    // YV12 layout: Y plane, then V and U planes with half pitch and half height
+    void *planes[3];
+    int i, y;
+    planes[0] = buf;
+    planes[2] = PTRADD(planes[0], mf_yuv_pitch * mf_yuv_height);
+    planes[1] = PTRADD(planes[2], (mf_yuv_pitch / 2) * (mf_yuv_height / 2));
+    for (i = 0; i < 3; i++) {
+        int pitch = i ? mf_yuv_pitch / 2 : mf_yuv_pitch;
+        int height = i ? mf_yuv_height / 2 : mf_yuv_height;
+        D3DLOCKED_RECT lrc;
+        if (FAILED(IDirect3DTexture9_LockRect(tex[i], 0, &lrc, NULL, lockflags))) return 0;
+        for (y = 0; y < height; y++) {
+            memcpy(PTRADD(lrc.pBits, y * lrc.Pitch), PTRADD(planes[i], y * pitch), pitch);
+        }
+        IDirect3DTexture9_UnlockRect(tex[i], 0);
+    }
+    return 1;
+}
+static void movieframe_onlostdevice()
+{
+    // release D3DPOOL_DEFAULT resources, they will be recreated when needed
+    release_movieframe_dyntex();
+    release_movieframe_yuvtex();
+    if (mf_vbuf) {
+        IDirect3DVertexBuffer9_Release(mf_vbuf);
+        mf_vbuf = NULL;
+    }
+}
+static void create_movieframe_texture();
+static void movieframe_onresetdevice()
+{
+    init_movieframe_vertbuf();
+    if (mf_tex_prealloc) create_movieframe_texture();
+}
+
 
 static void get_movie_uv(const char *filename, int movie_width, int movie_height)
 {
@@ -138,15 +308,61 @@ static void get_movie_uv(const char *filename, int movie_width, int movie_height
     mf_tex_u2 *= (double) movie_width / MF_TEX_WIDTH;
     mf_tex_v1 *= (double) movie_height / MF_TEX_HEIGHT;
     mf_tex_v2 *= (double) movie_height / MF_TEX_HEIGHT;
+    
+    if (mf_dyntex_count || mf_yuv) {
+        // don't sample texels outside movie rect when filtering
+        // U and V textures are half size, so shrink by a whole texel in YUV mode
+        double d = mf_yuv ? 1.0 : 0.5;
+        mf_tex_u1 += d / MF_TEX_WIDTH;
+        mf_tex_u2 -= d / MF_TEX_WIDTH;
+        mf_tex_v1 += d / MF_TEX_HEIGHT;
+        mf_tex_v2 -= d / MF_TEX_HEIGHT;
+    }
 }
 
-static void init_movieframe_texture(const char *filename, int movie_width, int movie_height)
+static void create_movieframe_texture()
 {
+    int old_category = vramstat_set_category(VRAM_MOVIE);
+    
+    // create YUV textures and decode buffer
+    if (mf_yuv) {
+        if (!mf_yuv_buf) mf_yuv_buf = malloc(MF_TEX_WIDTH * MF_TEX_HEIGHT * 3 / 2);
+        if (!mf_yuv_buf || !init_movieframe_yuvtex()) {
+            warning("can't create YUV textures for movie frame, fallback to RGB texture.");
+            release_movieframe_yuvtex();
+            mf_yuv = 0;
+        }
+    }
+    
     // create texture
-    if (!mf_tex) {
+    if (!mf_yuv && mf_dyntex_count && !init_movieframe_dyntex()) {
+        warning("can't create dynamic textures for movie frame, fallback to managed texture.");
+        release_movieframe_dyntex();
+        mf_dyntex_count = 0;
+    }
+    if (!mf_yuv && !mf_dyntex_count && !mf_tex) {
         if (FAILED(IDirect3DDevice9_CreateTexture(GB_GfxMgr->m_pd3dDevice, MF_TEX_WIDTH, MF_TEX_HEIGHT, 1, 0, GB_GfxMgr->m_d3dsdBackBuffer.Format, D3DPOOL_MANAGED, &mf_tex, NULL))) {
             fail("can't create texture for movie frame.");
         }
+        
+        // fill the texture with zeros
+        D3DLOCKED_RECT lrc;
+        IDirect3DTexture9_LockRect(mf_tex, 0, &lrc, NULL, 0);
+        memset(lrc.pBits, 0, lrc.Pitch * MF_TEX_HEIGHT);
+        IDirect3DTexture9_UnlockRect(mf_tex, 0);
+        mf_tex_dirty_width = mf_tex_dirty_height = 0;
+    }
+    
+    vramstat_set_category(old_category);
+}
+
+static void init_movieframe_texture(const char *filename, int movie_width, int movie_height)
+{
+    // create texture if not created yet
+    create_movieframe_texture();
+    if (mf_yuv) {
+        mf_yuv_pitch = (movie_width + 15) & ~15;
+        mf_yuv_height = (movie_height + 1) & ~1;
     }
     
     // set texture information
@@ -154,11 +370,15 @@ static void init_movieframe_texture(const char *filename, int movie_width, int m
     get_ratio_frect(&mf_frect, &game_frect, mf_tex_ratio, TR_CENTER, TR_CENTER);
     
     // prepare target surface type for BinkVideo
-    switch (GB_GfxMgr->m_d3dsdBackBuffer.Format) {
-        case D3DFMT_R5G6B5:   mf_bink_dstsurfacetype = 10; break;
-        case D3DFMT_X8R8G8B8: mf_bink_dstsurfacetype = 3; break;
-        case D3DFMT_X1R5G5B5: mf_bink_dstsurfacetype = 9; break;
-        default:              mf_bink_dstsurfacetype = 0; break;
+    if (mf_yuv) {
+        mf_bink_dstsurfacetype = BINKSURFACEYV12;
+    } else {
+        switch (GB_GfxMgr->m_d3dsdBackBuffer.Format) {
+            case D3DFMT_R5G6B5:   mf_bink_dstsurfacetype = 10; break;
+            case D3DFMT_X8R8G8B8: mf_bink_dstsurfacetype = 3; break;
+            case D3DFMT_X1R5G5B5: mf_bink_dstsurfacetype = 9; break;
+            default:              mf_bink_dstsurfacetype = 0; break;
+        }
     }
 }
 
@@ -171,16 +391,138 @@ static int __stdcall BinkDoFrame_wrapper(HBINK bink)
 }
 static int __stdcall BinkCopyToBuffer_wrapper(HBINK bink, void *dest_addr, int dest_pitch, unsigned dest_height, unsigned dest_x, unsigned dest_y, unsigned copy_flags)
 {
+    // discarded textures and queued buffers have undefined content, so always copy whole frame
+    if (mf_dyntex_count || mf_worker_active) copy_flags |= BINKCOPYALL;
     return last_BinkCopyToBuffer_retval = BinkCopyToBuffer(bink, dest_addr, dest_pitch, dest_height, dest_x, dest_y, copy_flags);
 }
 
+// get a buffer to decode into, overwrites oldest ready frame if queue is full
+static struct mf_queue_item *mf_queue_acquire()
+{
+    int i;
+    struct mf_queue_item *item = NULL;
+    EnterCriticalSection(&mf_queue_cs);
+    for (i = 0; i < mf_queue_size; i++) {
+        if (mf_queue[i].state == MFQ_FREE) {
+            item = &mf_queue[i];
+            break;
+        }
+        if (mf_queue[i].state == MFQ_READY && (!item || mf_queue[i].seq < item->seq)) {
+            item = &mf_queue[i];
+        }
+    }
+    if (item) {
+        item->state = MFQ_DECODING;
+        item->seq = ++mf_queue_seq;
+    }
+    LeaveCriticalSection(&mf_queue_cs);
+    return item;
+}
+// get newest ready frame to upload, older frames are dropped
+static struct mf_queue_item *mf_queue_take()
+{
+    int i;
+    struct mf_queue_item *item = NULL;
+    EnterCriticalSection(&mf_queue_cs);
+    for (i = 0; i < mf_queue_size; i++) {
+        if (mf_queue[i].state == MFQ_READY && (!item || mf_queue[i].seq > item->seq)) {
+            item = &mf_queue[i];
+        }
+    }
+    if (item) {
+        for (i = 0; i < mf_queue_size; i++) {
+            if (mf_queue[i].state == MFQ_READY) mf_queue[i].state = MFQ_FREE;
+        }
+        item->state = MFQ_UPLOADING;
+    }
+    LeaveCriticalSection(&mf_queue_cs);
+    return item;
+}
+static void mf_queue_release(struct mf_queue_item *item, int state)
+{
+    EnterCriticalSection(&mf_queue_cs);
+    item->state = state;
+    LeaveCriticalSection(&mf_queue_cs);
+}
+static int mf_queue_hasready()
+{
+    int i, ret = 0;
+    EnterCriticalSection(&mf_queue_cs);
+    for (i = 0; i < mf_queue_size; i++) {
+        if (mf_queue[i].state == MFQ_READY) ret = 1;
+    }
+    LeaveCriticalSection(&mf_queue_cs);
+    return ret;
+}
+
+static DWORD WINAPI movie_decode_thread(LPVOID lpParameter)
+{
+    while (WaitForSingleObject(mf_worker_event, INFINITE) == WAIT_OBJECT_0) {
+        while (mf_worker_active) {
+            struct mf_queue_item *item = NULL;
+            EnterCriticalSection(&mf_bink_cs);
+            if (mf_worker_active && !gbBinkVideo_BinkWait(mf_worker_bink) && (item = mf_queue_acquire())) {
+                item->ret = gbBinkVideo_DrawFrameEx(mf_worker_bink, item->buf, mf_queue_pitch, mf_queue_height, 0, 0, mf_bink_dstsurfacetype);
+                item->skipped = last_BinkDoFrame_retval || last_BinkCopyToBuffer_retval;
+                mf_queue_release(item, MFQ_READY);
+                SetEvent(mf_ready_event);
+            }
+            LeaveCriticalSection(&mf_bink_cs);
+            if (!item) Sleep(1);
+        }
+    }
+    return 0;
+}
+
+static void stop_movie_decode()
+{
+    if (!mf_worker_active) return;
+    InterlockedExchange(&mf_worker_active, 0);
+    
+    // wait until worker leaves Bink functions
+    EnterCriticalSection(&mf_bink_cs);
+    LeaveCriticalSection(&mf_bink_cs);
+}
+
+static void movie_decode_atbegin(void *arg)
+{
+    int i;
+    
+    if (!g_bink.m_hBink || !mf_bink_dstsurfacetype) return;
+    
+    // alloc frame buffers, YV12 frames take 12 bits per pixel
+    int size;
+    if (mf_yuv) {
+        mf_queue_pitch = mf_yuv_pitch;
+        mf_queue_height = mf_yuv_height;
+        size = mf_queue_pitch * mf_queue_height * 3 / 2;
+    } else {
+        int bytesperpixel = mf_bink_dstsurfacetype == 3 ? 4 : 2;
+        mf_queue_pitch = gbBinkVideo_Width(&g_bink) * bytesperpixel;
+        mf_queue_height = gbBinkVideo_Height(&g_bink);
+        size = mf_queue_pitch * mf_queue_height;
+    }
+    for (i = 0; i < mf_queue_size; i++) {
+        free(mf_queue[i].buf);
+        mf_queue[i].buf = malloc(imax(size, 1));
+        if (!mf_queue[i].buf) {
+            warning("can't alloc movie frame buffer, decode thread disabled for this movie.");
+            return;
+        }
+        mf_queue[i].state = MFQ_FREE;
+    }
+    
+    // start worker
+    mf_worker_bink = &g_bink;
+    ResetEvent(mf_ready_event);
+    InterlockedExchange(&mf_worker_active, 1);
+    SetEvent(mf_worker_event);
+}
+
 static void movie_playback_atopen(void *arg)
 {
     struct game_loop_hook_data *hookarg = arg;
     
-    // check hook type
-    if (hookarg->type != GAMEEVENT_MOVIE_ATOPEN) return;
-    
     if (!g_bink.m_hBink) return;
     
     struct gbAudioManager *pAudioMgr = SoundMgr_GetAudioMgr(SoundMgr_Inst());
@@ -195,11 +537,21 @@ static void movie_playback_atopen(void *arg)
     // init vertex buffer and texture
     init_movieframe_texture(moviefile, gbBinkVideo_Width(&g_bink), gbBinkVideo_Height(&g_bink));
     
-    // fill the texture with zeros
-    D3DLOCKED_RECT lrc;
-    IDirect3DTexture9_LockRect(mf_tex, 0, &lrc, NULL, 0);
-    memset(lrc.pBits, 0, lrc.Pitch * MF_TEX_HEIGHT);
-    IDirect3DTexture9_UnlockRect(mf_tex, 0);
+    // fill the texture with zeros if last movie was larger
+    // not needed for dynamic and YUV textures, since texels outside movie are never sampled
+    if (!mf_dyntex_count && !mf_yuv) {
+        int movie_width = gbBinkVideo_Width(&g_bink);
+        int movie_height = gbBinkVideo_Height(&g_bink);
+        if (mf_tex_dirty_width > movie_width || mf_tex_dirty_height > movie_height) {
+            D3DLOCKED_RECT lrc;
+            RECT rc = { 0, 0, mf_tex_dirty_width, mf_tex_dirty_height };
+            IDirect3DTexture9_LockRect(mf_tex, 0, &lrc, &rc, 0);
+            memset(lrc.pBits, 0, lrc.Pitch * mf_tex_dirty_height);
+            IDirect3DTexture9_UnlockRect(mf_tex, 0);
+        }
+        mf_tex_dirty_width = movie_width;
+        mf_tex_dirty_height = movie_height;
+    }
     
     // set playing flag for cursor
     mf_movie_playing = 1;
@@ -210,39 +562,108 @@ static void movie_playback_atopen(void *arg)
 
 static MAKE_THISCALL(int, gbBinkVideo_DrawFrame, struct gbBinkVideo *this)
 {
-    int ret;
+    int ret, i;
     // check if we have inited
-    if (!mf_tex || !mf_bink_dstsurfacetype) {
+    if ((!mf_tex && !mf_dyntex_count && !mf_yuv) || !mf_bink_dstsurfacetype) {
         return 0;
     }
     
     // check cooperative level
     gbGfxManager_D3D_EnsureCooperativeLevel(GB_GfxMgr, 1);
+    
+    // select texture, dynamic textures may be released by device reset
+    IDirect3DTexture9 *tex = mf_tex;
+    IDirect3DTexture9 **yuvtex = NULL;
+    DWORD lockflags = 0;
+    if (mf_yuv) {
+        if (!mf_vbuf || !init_movieframe_yuvtex()) return 0;
+        if (mf_dyntex_count) {
+            mf_dyntex_cur = (mf_dyntex_cur + 1) % mf_dyntex_count;
+            lockflags = D3DLOCK_DISCARD;
+        } else {
+            mf_dyntex_cur = 0;
+        }
+        yuvtex = mf_yuvtex[mf_dyntex_cur];
+    } else if (mf_dyntex_count) {
+        if (!mf_vbuf || !init_movieframe_dyntex()) return 0;
+        mf_dyntex_cur = (mf_dyntex_cur + 1) % mf_dyntex_count;
+        tex = mf_dyntex[mf_dyntex_cur];
+        lockflags = D3DLOCK_DISCARD;
+    }
 
     // upload movie frame to texture
-    D3DLOCKED_RECT lrc;
-    IDirect3DTexture9_LockRect(mf_tex, 0, &lrc, NULL, 0);
-    ret = gbBinkVideo_DrawFrameEx(this, lrc.pBits, lrc.Pitch, gbBinkVideo_Height(this), 0, 0, mf_bink_dstsurfacetype);
-    int bitcount = gbGfxManager_D3D_GetBackBufferBitCount(GB_GfxMgr);
-    if (mf_tex_clamp && bitcount) {
-        int left = floor(MF_TEX_WIDTH * mf_tex_u1 + eps);
-        int top = floor(MF_TEX_HEIGHT * mf_tex_v1 + eps);
-        int right = floor(MF_TEX_WIDTH * mf_tex_u2 + eps);
-        int bottom = floor(MF_TEX_HEIGHT * mf_tex_v2 + eps);
-        clamp_rect(lrc.pBits, MF_TEX_WIDTH, MF_TEX_HEIGHT, bitcount, lrc.Pitch, left, top, right, bottom);
-    }
-    IDirect3DTexture9_UnlockRect(mf_tex, 0);
-
-    if (last_BinkDoFrame_retval || last_BinkCopyToBuffer_retval) {
+    // if decode thread is active, just copy the newest decoded frame
+    struct mf_queue_item *item = NULL;
+    int skipped;
+    if (mf_worker_active && !(item = mf_queue_take())) return 0;
+    if (yuvtex) {
+        // YUV frames are always decoded to system memory, planes are copied after
+        void *buf = mf_yuv_buf;
+        if (item) {
+            buf = item->buf;
+            ret = item->ret;
+            skipped = item->skipped;
+        } else {
+            ret = gbBinkVideo_DrawFrameEx(this, buf, mf_yuv_pitch, mf_yuv_height, 0, 0, mf_bink_dstsurfacetype);
+            skipped = last_BinkDoFrame_retval || last_BinkCopyToBuffer_retval;
+        }
+        int uploaded = skipped || mf_yuv_upload(yuvtex, buf, lockflags);
+        if (item) mf_queue_release(item, MFQ_FREE);
+        if (!uploaded) return ret;
+    } else {
+        D3DLOCKED_RECT lrc;
+        if (FAILED(IDirect3DTexture9_LockRect(tex, 0, &lrc, NULL, lockflags))) {
+            if (item) mf_queue_release(item, MFQ_FREE);
+            return 0;
+        }
+        if (item) {
+            int y;
+            for (y = 0; y < mf_queue_height; y++) {
+                memcpy(PTRADD(lrc.pBits, y * lrc.Pitch), PTRADD(item->buf, y * mf_queue_pitch), mf_queue_pitch);
+            }
+            ret = item->ret;
+            skipped = item->skipped;
+            mf_queue_release(item, MFQ_FREE);
+        } else {
+            ret = gbBinkVideo_DrawFrameEx(this, lrc.pBits, lrc.Pitch, gbBinkVideo_Height(this), 0, 0, mf_bink_dstsurfacetype);
+            skipped = last_BinkDoFrame_retval || last_BinkCopyToBuffer_retval;
+        }
+        int bitcount = gbGfxManager_D3D_GetBackBufferBitCount(GB_GfxMgr);
+        if (mf_tex_clamp && bitcount && !mf_dyntex_count) {
+            int left = floor(MF_TEX_WIDTH * mf_tex_u1 + eps);
+            int top = floor(MF_TEX_HEIGHT * mf_tex_v1 + eps);
+            int right = floor(MF_TEX_WIDTH * mf_tex_u2 + eps);
+            int bottom = floor(MF_TEX_HEIGHT * mf_tex_v2 + eps);
+            clamp_rect(lrc.pBits, MF_TEX_WIDTH, MF_TEX_HEIGHT, bitcount, lrc.Pitch, left, top, right, bottom);
+        }
+        IDirect3DTexture9_UnlockRect(tex, 0);
+    }
+
+    if (skipped) {
         // the binkvideo tells us frame is skipped
         return ret;
     }
     
     // upload vertex
     struct mf_vertex_t *vbuf;
-    IDirect3DVertexBuffer9_Lock(mf_vbuf, 0, 0, (void *) &vbuf, 0);
-    mf_fillvbuf_rect(vbuf, &mf_frect, mf_tex_u1, mf_tex_v1, mf_tex_u2, mf_tex_v2);
-    IDirect3DVertexBuffer9_Unlock(mf_vbuf);
+    if (mf_dyntex_count) {
+        // only rewrite dynamic vertex buffer when changed
+        struct mf_vertex_t newvbuf[MF_VBUF_SIZE];
+        memset(newvbuf, 0, sizeof(newvbuf));
+        mf_fillvbuf_rect(newvbuf, &mf_frect, mf_tex_u1, mf_tex_v1, mf_tex_u2, mf_tex_v2);
+        if (mf_vbuf_dirty || memcmp(newvbuf, mf_vbuf_last, sizeof(newvbuf)) != 0) {
+            if (SUCCEEDED(IDirect3DVertexBuffer9_Lock(mf_vbuf, 0, 0, (void *) &vbuf, D3DLOCK_DISCARD))) {
+                memcpy(vbuf, newvbuf, sizeof(newvbuf));
+                IDirect3DVertexBuffer9_Unlock(mf_vbuf);
+                memcpy(mf_vbuf_last, newvbuf, sizeof(newvbuf));
+                mf_vbuf_dirty = 0;
+            }
+        }
+    } else {
+        IDirect3DVertexBuffer9_Lock(mf_vbuf, 0, 0, (void *) &vbuf, 0);
+        mf_fillvbuf_rect(vbuf, &mf_frect, mf_tex_u1, mf_tex_v1, mf_tex_u2, mf_tex_v2);
+        IDirect3DVertexBuffer9_Unlock(mf_vbuf);
+    }
     
     // prepare d3d state
     IDirect3DDevice9_SetRenderState(GB_GfxMgr->m_pd3dDevice, D3DRS_CULLMODE, D3DCULL_NONE);
@@ -255,7 +676,21 @@ static MAKE_THISCALL(int, gbBinkVideo_DrawFrame, struct gbBinkVideo *this)
     IDirect3DDevice9_SetRenderState(GB_GfxMgr->m_pd3dDevice, D3DRS_LIGHTING, FALSE);
     IDirect3DDevice9_SetSamplerState(GB_GfxMgr->m_pd3dDevice, 0, D3DSAMP_MAGFILTER, D3DTEXF_LINEAR);
     IDirect3DDevice9_SetSamplerState(GB_GfxMgr->m_pd3dDevice, 0, D3DSAMP_MINFILTER, D3DTEXF_LINEAR);
-    if (mf_tex_clamp) {
+    
+    // YUV planes use stage 0 to 2, sampler states of stage 1 and 2 are restored after drawing
+    DWORD oldsamp[3][4];
+    static const D3DSAMPLERSTATETYPE sampstates[4] = { D3DSAMP_MAGFILTER, D3DSAMP_MINFILTER, D3DSAMP_ADDRESSU, D3DSAMP_ADDRESSV };
+    if (yuvtex) {
+        int j;
+        for (i = 0; i < 3; i++) {
+            for (j = 0; j < 4; j++) {
+                if (i) IDirect3DDevice9_GetSamplerState(GB_GfxMgr->m_pd3dDevice, i, sampstates[j], &oldsamp[i][j]);
+                IDirect3DDevice9_SetSamplerState(GB_GfxMgr->m_pd3dDevice, i, sampstates[j], j < 2 ? D3DTEXF_LINEAR : D3DTADDRESS_CLAMP);
+            }
+            IDirect3DDevice9_SetTexture(GB_GfxMgr->m_pd3dDevice, i, (void *) yuvtex[i]);
+        }
+        IDirect3DDevice9_SetPixelShader(GB_GfxMgr->m_pd3dDevice, mf_yuv_shader);
+    } else if (mf_tex_clamp) {
         IDirect3DDevice9_SetSamplerState(GB_GfxMgr->m_pd3dDevice, 0, D3DSAMP_ADDRESSU, D3DTADDRESS_CLAMP);
         IDirect3DDevice9_SetSamplerState(GB_GfxMgr->m_pd3dDevice, 0, D3DSAMP_ADDRESSV, D3DTADDRESS_CLAMP);
     } else {
@@ -264,7 +699,7 @@ static MAKE_THISCALL(int, gbBinkVideo_DrawFrame, struct gbBinkVideo *this)
         IDirect3DDevice9_SetSamplerState(GB_GfxMgr->m_pd3dDevice, 0, D3DSAMP_BORDERCOLOR, 0x00000000);
     }
     
-    IDirect3DDevice9_SetTexture(GB_GfxMgr->m_pd3dDevice, 0, (void *) mf_tex);
+    if (!yuvtex) IDirect3DDevice9_SetTexture(GB_GfxMgr->m_pd3dDevice, 0, (void *) tex);
     
     // clear surface
     IDirect3DDevice9_Clear(GB_GfxMgr->m_pd3dDevice, 0, NULL, D3DCLEAR_TARGET | D3DCLEAR_ZBUFFER, 0x00000000, 1.0f, 0);
@@ -275,6 +710,18 @@ static MAKE_THISCALL(int, gbBinkVideo_DrawFrame, struct gbBinkVideo *this)
     IDirect3DDevice9_SetStreamSource(GB_GfxMgr->m_pd3dDevice, 0, mf_vbuf, 0, MF_VERTEX_SIZE);
     IDirect3DDevice9_DrawPrimitive(GB_GfxMgr->m_pd3dDevice, D3DPT_TRIANGLELIST, 0, MF_VBUF_TRANGLE_COUNT);
     
+    // restore state changed by YUV drawing
+    if (yuvtex) {
+        int j;
+        IDirect3DDevice9_SetPixelShader(GB_GfxMgr->m_pd3dDevice, NULL);
+        for (i = 1; i < 3; i++) {
+            IDirect3DDevice9_SetTexture(GB_GfxMgr->m_pd3dDevice, i, NULL);
+            for (j = 0; j < 4; j++) {
+                IDirect3DDevice9_SetSamplerState(GB_GfxMgr->m_pd3dDevice, i, sampstates[j], oldsamp[i][j]);
+            }
+        }
+    }
+    
     // end scene
     call_preendscene_hooks();
     IDirect3DDevice9_EndScene(GB_GfxMgr->m_pd3dDevice);
@@ -289,6 +736,7 @@ static MAKE_THISCALL(int, gbBinkVideo_DrawFrame, struct gbBinkVideo *this)
 static void movie_checkpause_hook(void *arg)
 {
     int paused = *(int *) arg;
+    if (mf_worker_active) EnterCriticalSection(&mf_bink_cs);
     if (paused) {
         mf_movie_paused = 1;
         if (g_bink.m_hBink) {
@@ -300,13 +748,12 @@ static void movie_checkpause_hook(void *arg)
             BinkPause(g_bink.m_hBink, 0);
         }
     }
+    if (mf_worker_active) LeaveCriticalSection(&mf_bink_cs);
 }
 static void movie_playback_atstop(void *arg)
 {
-    struct game_loop_hook_data *hookarg = arg;
-    
-    // check hook type
-    if (hookarg->type != GAMEEVENT_MOVIE_ATEND) return;
+    // stop decode thread before movie is closed
+    stop_movie_decode();
     
     // reset cursor status
     mf_movie_playing = 0;
@@ -315,11 +762,36 @@ static void movie_playback_atstop(void *arg)
 
 static MAKE_THISCALL(int, gbBinkVideo_BinkWait_wrapper, struct gbBinkVideo *this)
 {
+    if (mf_worker_active) {
+        // frames are decoded by worker, tell engine to draw when one is ready
+        if (mf_queue_hasready()) return 0;
+        WaitForSingleObject(mf_ready_event, 1);
+        return 1;
+    }
     int ret = gbBinkVideo_BinkWait(this);
     if (ret) Sleep(1);
     return ret;
 }
 
+static void check_movieframe_caps()
+{
+    D3DCAPS9 caps;
+    if (FAILED(IDirect3DDevice9_GetDeviceCaps(GB_GfxMgr->m_pd3dDevice, &caps))) memset(&caps, 0, sizeof(caps));
+    if (mf_dyntex_count && !(caps.Caps2 & D3DCAPS2_DYNAMICTEXTURES)) {
+        warning("dynamic textures are not supported, movietexcount is ignored.");
+        mf_dyntex_count = 0;
+    }
+    if (mf_yuv && !mf_yuv_shader) {
+        if (caps.PixelShaderVersion < D3DPS_VERSION(2, 0)) {
+            warning("pixel shader 2.0 is not supported, movieyuv is ignored.");
+            mf_yuv = 0;
+        } else if (FAILED(IDirect3DDevice9_CreatePixelShader(GB_GfxMgr->m_pd3dDevice, mf_yuv_shader_code, &mf_yuv_shader))) {
+            warning("can't create pixel shader for movie frame, movieyuv is ignored.");
+            mf_yuv = 0;
+        }
+    }
+}
+
 static void hook_gbBinkVideo()
 {
     // import BinkPause
@@ -329,10 +801,10 @@ static void hook_gbBinkVideo()
     make_jmp(0x0053C470, gbBinkVideo_DrawFrame);
     
     // hook open operation
-    add_gameloop_hook(movie_playback_atopen);
+    add_gameloop_hook_filtered(movie_playback_atopen, GAMELOOP_MASK(GAMEEVENT_MOVIE_ATOPEN));
     
     // cleanup when movie loop exits
-    add_gameloop_hook(movie_playback_atstop);
+    add_gameloop_hook_filtered(movie_playback_atstop, GAMELOOP_MASK(GAMEEVENT_MOVIE_ATEND));
     
     // check state for pausing movie
     add_pauseresume_hook(movie_checkpause_hook);
@@ -371,12 +843,117 @@ static void after_unknownlocktype()
 }
 
 
+// async screenshot
+//   GetFrontBufferData() waits for GPU to finish everything, which causes a small hitch
+//   in this mode, back buffer is copied to a rotating default pool surface at the end of every frame,
+//   this copy is done by GPU and doesn't stall, an event query is issued after each copy
+//   when screenshot is taken, newest copy which is already finished is read back instead
+#define SS_MAXCOPY 2
+static int ss_async;
+static int ss_async_ready;
+static IDirect3DSurface9 *ss_copy[SS_MAXCOPY];
+static IDirect3DQuery9 *ss_copy_query[SS_MAXCOPY];
+static int ss_copy_valid[SS_MAXCOPY];
+static int ss_copy_next;
+
+static void ss_async_release()
+{
+    int i;
+    ss_async_ready = 0;
+    for (i = 0; i < SS_MAXCOPY; i++) {
+        if (ss_copy[i]) IDirect3DSurface9_Release(ss_copy[i]);
+        if (ss_copy_query[i]) IDirect3DQuery9_Release(ss_copy_query[i]);
+        ss_copy[i] = NULL;
+        ss_copy_query[i] = NULL;
+        ss_copy_valid[i] = 0;
+    }
+}
+static void ss_async_create()
+{
+    IDirect3DDevice9 *pd3dDevice = GB_GfxMgr->m_pd3dDevice;
+    IDirect3DSurface9 *pBackBuffer;
+    D3DSURFACE_DESC desc;
+    int i;
+    if (FAILED(IDirect3DDevice9_GetBackBuffer(pd3dDevice, 0, 0, D3DBACKBUFFER_TYPE_MONO, &pBackBuffer))) return;
+    IDirect3DSurface9_GetDesc(pBackBuffer, &desc);
+    IDirect3DSurface9_Release(pBackBuffer);
+    
+    // engine can only read 32-bit screenshot
+    if (desc.Format != D3DFMT_X8R8G8B8 && desc.Format != D3DFMT_A8R8G8B8) return;
+    
+    for (i = 0; i < SS_MAXCOPY; i++) {
+        if (FAILED(IDirect3DDevice9_CreateRenderTarget(pd3dDevice, desc.Width, desc.Height, desc.Format, D3DMULTISAMPLE_NONE, 0, FALSE, &ss_copy[i], NULL))
+         || FAILED(IDirect3DDevice9_CreateQuery(pd3dDevice, D3DQUERYTYPE_EVENT, &ss_copy_query[i]))) {
+            warning("can't create surfaces for async screenshot.");
+            ss_async_release();
+            return;
+        }
+    }
+    ss_copy_next = 0;
+    ss_async_ready = 1;
+}
+static void ss_async_preendscene()
+{
+    IDirect3DDevice9 *pd3dDevice = GB_GfxMgr->m_pd3dDevice;
+    IDirect3DSurface9 *pBackBuffer;
+    if (!ss_async_ready) return;
+    if (FAILED(IDirect3DDevice9_GetBackBuffer(pd3dDevice, 0, 0, D3DBACKBUFFER_TYPE_MONO, &pBackBuffer))) return;
+    
+    // StretchRect() also resolves multisampled back buffer
+    int slot = ss_copy_next;
+    ss_copy_valid[slot] = SUCCEEDED(IDirect3DDevice9_StretchRect(pd3dDevice, pBackBuffer, NULL, ss_copy[slot], NULL, D3DTEXF_NONE));
+    if (ss_copy_valid[slot]) IDirect3DQuery9_Issue(ss_copy_query[slot], D3DISSUE_END);
+    ss_copy_next = (slot + 1) % SS_MAXCOPY;
+    IDirect3DSurface9_Release(pBackBuffer);
+}
+static IDirect3DSurface9 *ss_surface;
+static int ss_async_readback(int *width, int *height)
+{
+    IDirect3DDevice9 *pd3dDevice = gfxmgr->m_pd3dDevice;
+    int i, pick = -1;
+    if (!ss_async_ready) return 0;
+    
+    // prefer newest finished copy, otherwise wait for newest one
+    for (i = 1; i <= SS_MAXCOPY; i++) {
+        int slot = (ss_copy_next + SS_MAXCOPY - i) % SS_MAXCOPY;
+        if (!ss_copy_valid[slot]) continue;
+        if (pick < 0) pick = slot;
+        if (IDirect3DQuery9_GetData(ss_copy_query[slot], NULL, 0, 0) == S_OK) {
+            pick = slot;
+            break;
+        }
+    }
+    if (pick < 0) return 0;
+    
+    D3DSURFACE_DESC desc;
+    IDirect3DSurface9_GetDesc(ss_copy[pick], &desc);
+    if (FAILED(IDirect3DDevice9_CreateOffscreenPlainSurface(pd3dDevice, desc.Width, desc.Height, desc.Format, D3DPOOL_SYSTEMMEM, &ss_surface, NULL))) return 0;
+    if (FAILED(IDirect3DDevice9_GetRenderTargetData(pd3dDevice, ss_copy[pick], ss_surface))) {
+        IDirect3DSurface9_Release(ss_surface);
+        ss_surface = NULL;
+        return 0;
+    }
+    *width = desc.Width;
+    *height = desc.Height;
+    return 1;
+}
+static void init_async_screenshot()
+{
+    ss_async = get_int_from_configfile("asyncscreenshot");
+    if (!ss_async) return;
+    add_postd3dcreate_hook(ss_async_create);
+    add_onlostdevice_hook(ss_async_release);
+    add_onresetdevice_hook(ss_async_create);
+    add_preendscene_hook(ss_async_preendscene);
+}
+
+
 // screenshot hooks
 static int ss_enable;
-static IDirect3DSurface9 *ss_surface;
-static void before_screenshot(struct gbSurfaceDesc *surface)
+static void frontbuffer_readback(int *width, int *height, RECT *pGameRect)
 {
     int surface_width, surface_height;
+    RECT GameRect;
     if (gfxmgr->DrvInfo.fullscreen) {
         surface_width = game_width;
         surface_height = game_height;
@@ -393,7 +970,6 @@ static void before_screenshot(struct gbSurfaceDesc *surface)
     } else {
         IDirect3DDevice9_ColorFill(gfxmgr->m_pd3dDevice, ss_surface, NULL, 0xFF000000);
     }
-    RECT GameRect;
     if (gfxmgr->DrvInfo.fullscreen) {
         GameRect.left = GameRect.top = 0;
         GameRect.right = game_width;
@@ -407,6 +983,22 @@ static void before_screenshot(struct gbSurfaceDesc *surface)
         GameRect.right = GameRect.left + game_width;
         GameRect.bottom = GameRect.top + game_height;
     }
+    *width = surface_width;
+    *height = surface_height;
+    *pGameRect = GameRect;
+}
+static void before_screenshot(struct gbSurfaceDesc *surface)
+{
+    int surface_width, surface_height;
+    RECT GameRect;
+    if (ss_enable && ss_async_readback(&surface_width, &surface_height)) {
+        // copy of back buffer contains game area only
+        GameRect.left = GameRect.top = 0;
+        GameRect.right = surface_width;
+        GameRect.bottom = surface_height;
+    } else {
+        frontbuffer_readback(&surface_width, &surface_height, &GameRect);
+    }
 
     fRECT frect;
     set_frect_rect(&frect, &GameRect);
@@ -488,6 +1080,7 @@ MAKE_PATCHSET(nolockablebackbuffer)
     
     // load screenshot settings
     ss_enable = !get_int_from_configfile("skipscreenshot");
+    if (ss_enable) init_async_screenshot();
     
     // lock/unlock hooks
     SIMPLE_PATCH(gboffset + 0x1001A20F, "\xC7\x81\x08\x07\x00\x00\x03\x00\x00\x00", "\xC7\x81\x08\x07\x00\x00\x02\x00\x00\x00", 10);
@@ -495,7 +1088,39 @@ MAKE_PATCHSET(nolockablebackbuffer)
     make_jmp(gboffset + 0x10018F40, LockBackBuffer);
     make_jmp(gboffset + 0x10019030, UnlockBackBuffer);
     
+    // load movie texture settings
+    mf_dyntex_count = get_int_from_configfile("movietexcount");
+    if (mf_dyntex_count < 0 || mf_dyntex_count > MF_MAXDYNTEX) {
+        fail("invalid movietexcount value %d.", mf_dyntex_count);
+    }
+    mf_yuv = get_int_from_configfile("movieyuv");
+    
     // gbBinkVideo hooks
     hook_gbBinkVideo();
+    add_postd3dcreate_hook(check_movieframe_caps);
     add_postd3dcreate_hook(init_movieframe_vertbuf);
+    mf_tex_prealloc = get_int_from_configfile("movieprefetch") > 0;
+    if (mf_tex_prealloc) add_postd3dcreate_hook(create_movieframe_texture);
+    if (mf_dyntex_count) {
+        add_onlostdevice_hook(movieframe_onlostdevice);
+        add_onresetdevice_hook(movieframe_onresetdevice);
+    }
+    
+    // movie decode thread
+    mf_queue_size = get_int_from_configfile("moviedecodethread");
+    if (mf_queue_size < 0 || mf_queue_size > MF_MAXQUEUE) {
+        fail("invalid moviedecodethread value %d.", mf_queue_size);
+    }
+    if (mf_queue_size) {
+        InitializeCriticalSection(&mf_queue_cs);
+        InitializeCriticalSection(&mf_bink_cs);
+        mf_worker_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+        mf_ready_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if (!mf_worker_event || !mf_ready_event) fail("can't create events for movie decode thread.");
+        HANDLE hThread = CreateThread(NULL, 0, movie_decode_thread, NULL, 0, NULL);
+        if (!hThread) fail("can't create movie decode thread.");
+        sched_set_thread(hThread, SCHED_WORKER);
+        CloseHandle(hThread);
+        add_gameloop_hook_filtered(movie_decode_atbegin, GAMELOOP_MASK(GAMEEVENT_MOVIE_ATBEGIN));
+    }
 }
@@ -0,0 +1,191 @@
+#include "common.h"
+
+// occlusion statistics
+//   every DrawPrimitive() and DrawIndexedPrimitive() call is wrapped in an occlusion query,
+//   so we can see how many draws end up with no visible pixels at all
+//   (hidden by other objects, outside the view, or fully rejected otherwise)
+//   this only measures, nothing is culled, it tells whether occlusion culling is worth doing
+//
+//   queries are read OCCL_FRAMES - 1 frames later without waiting for GPU,
+//   a frame is discarded if any of its queries are not ready yet
+//   we patch the device vtable by giving it a modified copy of its vtable
+
+#define OCCL_MAXQUERY 1024
+#define OCCL_FRAMES 3
+
+struct occl_frame {
+    IDirect3DQuery9 *query[OCCL_MAXQUERY];
+    UINT prims[OCCL_MAXQUERY];
+    int nr_created;
+    int n;
+    unsigned overflow;
+};
+
+struct occl_stat {
+    unsigned draws, hidden;
+    unsigned long long prims, hidden_prims;
+    unsigned overflow;
+};
+
+static struct occl_frame frames[OCCL_FRAMES];
+static int cur_frame;
+static int occl_ready;
+
+static struct occl_stat last_stat; // last complete frame
+static int last_stat_valid;
+static struct occl_stat total_stat;
+static unsigned nr_frames, nr_discarded;
+
+static IDirect3DDevice9ExVtbl device_vtbl; // big enough for both IDirect3DDevice9 and IDirect3DDevice9Ex
+
+static HRESULT (STDMETHODCALLTYPE *Real_DrawPrimitive)(IDirect3DDevice9 *, D3DPRIMITIVETYPE, UINT, UINT);
+static HRESULT (STDMETHODCALLTYPE *Real_DrawIndexedPrimitive)(IDirect3DDevice9 *, D3DPRIMITIVETYPE, INT, UINT, UINT, UINT, UINT);
+
+static IDirect3DQuery9 *occl_begin(UINT prims)
+{
+    struct occl_frame *f = &frames[cur_frame];
+    if (!occl_ready) return NULL;
+    if (f->n >= OCCL_MAXQUERY) {
+        f->overflow++;
+        return NULL;
+    }
+    if (f->n >= f->nr_created) {
+        if (FAILED(IDirect3DDevice9_CreateQuery(GB_GfxMgr->m_pd3dDevice, D3DQUERYTYPE_OCCLUSION, &f->query[f->n]))) {
+            f->overflow++;
+            return NULL;
+        }
+        f->nr_created++;
+    }
+    IDirect3DQuery9 *q = f->query[f->n];
+    f->prims[f->n] = prims;
+    f->n++;
+    IDirect3DQuery9_Issue(q, D3DISSUE_BEGIN);
+    return q;
+}
+
+static HRESULT STDMETHODCALLTYPE DrawPrimitive_wrapper(IDirect3DDevice9 *This, D3DPRIMITIVETYPE PrimitiveType, UINT StartVertex, UINT PrimitiveCount)
+{
+    IDirect3DQuery9 *q = occl_begin(PrimitiveCount);
+    HRESULT hr = Real_DrawPrimitive(This, PrimitiveType, StartVertex, PrimitiveCount);
+    if (q) IDirect3DQuery9_Issue(q, D3DISSUE_END);
+    return hr;
+}
+
+static HRESULT STDMETHODCALLTYPE DrawIndexedPrimitive_wrapper(IDirect3DDevice9 *This, D3DPRIMITIVETYPE PrimitiveType, INT BaseVertexIndex, UINT MinVertexIndex, UINT NumVertices, UINT startIndex, UINT primCount)
+{
+    IDirect3DQuery9 *q = occl_begin(primCount);
+    HRESULT hr = Real_DrawIndexedPrimitive(This, PrimitiveType, BaseVertexIndex, MinVertexIndex, NumVertices, startIndex, primCount);
+    if (q) IDirect3DQuery9_Issue(q, D3DISSUE_END);
+    return hr;
+}
+
+static void occl_collect(struct occl_frame *f)
+{
+    struct occl_stat st;
+    int i;
+    memset(&st, 0, sizeof(st));
+    st.overflow = f->overflow;
+    for (i = 0; i < f->n; i++) {
+        DWORD samples;
+        if (IDirect3DQuery9_GetData(f->query[i], &samples, sizeof(samples), 0) != S_OK) {
+            // GPU is too far behind, or device is lost
+            nr_discarded++;
+            return;
+        }
+        st.draws++;
+        st.prims += f->prims[i];
+        if (samples == 0) {
+            st.hidden++;
+            st.hidden_prims += f->prims[i];
+        }
+    }
+    last_stat = st;
+    last_stat_valid = 1;
+    total_stat.draws += st.draws;
+    total_stat.hidden += st.hidden;
+    total_stat.prims += st.prims;
+    total_stat.hidden_prims += st.hidden_prims;
+    total_stat.overflow += st.overflow;
+    nr_frames++;
+}
+
+static void occl_postpresent()
+{
+    if (!occl_ready) return;
+    
+    // oldest frame is reused for next frame
+    cur_frame = (cur_frame + 1) % OCCL_FRAMES;
+    struct occl_frame *f = &frames[cur_frame];
+    if (f->n > 0 || f->overflow > 0) occl_collect(f);
+    f->n = 0;
+    f->overflow = 0;
+}
+
+static void occl_onlostdevice()
+{
+    int i, j;
+    occl_ready = 0;
+    for (i = 0; i < OCCL_FRAMES; i++) {
+        for (j = 0; j < frames[i].nr_created; j++) {
+            IDirect3DQuery9_Release(frames[i].query[j]);
+        }
+        memset(&frames[i], 0, sizeof(frames[i]));
+    }
+}
+
+static void occl_onresetdevice()
+{
+    occl_ready = 1;
+}
+
+static void hook_device()
+{
+    IDirect3DDevice9 *dev = GB_GfxMgr->m_pd3dDevice;
+    IDirect3DDevice9Vtbl *vtbl = (IDirect3DDevice9Vtbl *) &device_vtbl;
+    
+    if (!dev || dev->lpVtbl == vtbl) return;
+    
+    // check support, queries are created when needed
+    if (FAILED(IDirect3DDevice9_CreateQuery(dev, D3DQUERYTYPE_OCCLUSION, NULL))) {
+        warning("occlusion query is not supported, occlusion statistics disabled.");
+        return;
+    }
+    
+    patch_device_vtable(dev, &device_vtbl);
+    
+    Real_DrawPrimitive = vtbl->DrawPrimitive;
+    Real_DrawIndexedPrimitive = vtbl->DrawIndexedPrimitive;
+    vtbl->DrawPrimitive = DrawPrimitive_wrapper;
+    vtbl->DrawIndexedPrimitive = DrawIndexedPrimitive_wrapper;
+    dev->lpVtbl = vtbl;
+    
+    add_postpresent_hook(occl_postpresent);
+    add_onlostdevice_hook(occl_onlostdevice);
+    add_onresetdevice_hook(occl_onresetdevice);
+    occl_ready = 1;
+}
+
+void get_occlusionstat_text(char *buf, int size)
+{
+    // overlay lines for showfps
+    *buf = '\0';
+    if (!last_stat_valid) return;
+    snprintf(buf, size, "OCCL = %u/%u draws hidden (%.1f%% prims)%s\n",
+        last_stat.hidden, last_stat.draws,
+        last_stat.prims ? last_stat.hidden_prims * 100.0 / last_stat.prims : 0.0,
+        last_stat.overflow ? ", overflow" : "");
+}
+
+static void occl_report()
+{
+    plog("occlusion stat: %u frames (%u discarded), %u/%u draws hidden, %.1f%% prims hidden, %u draws not tested.",
+        nr_frames, nr_discarded, total_stat.hidden, total_stat.draws,
+        total_stat.prims ? total_stat.hidden_prims * 100.0 / total_stat.prims : 0.0,
+        total_stat.overflow);
+}
+
+MAKE_PATCHSET(occlusionstat)
+{
+    add_postd3dcreate_hook(hook_device);
+    add_atexit_hook(occl_report);
+}
@@ -1,21 +1,108 @@
 #include "common.h"
 
+// precise resource lookup
+//   gbResManager::FindResByName() compares full names, not only CRC32 of names
+//   lookups are a linear scan, resources are added and removed by engine code
+//   we don't hook, so a hash index couldn't be kept in sync without checking
+//   the whole buffer on every lookup, which costs as much as the scan
+//
+//   per-manager lookup statistics are written to log at exit,
+//   texture and sound managers included, least recently used slot is recycled
+//   when all slots are taken
+
+#define RESSTAT_MAXMGR 16
+
+struct resstat {
+    struct gbResManager *mgr;
+    char name[32];
+    unsigned lastuse;
+    unsigned nr_hit, nr_miss;
+    int peaknum, maxnum;
+};
+
+static struct resstat resstat_list[RESSTAT_MAXMGR];
+static int resstat_count;
+static unsigned resstat_clock;
+static unsigned resstat_nr_recycled;
+
+static void resstat_setname(struct resstat *st)
+{
+    struct gbResManager *mgr = st->mgr;
+    struct gbAudioManager *audiodrv = SoundMgr_GetAudioMgr(SoundMgr_Inst());
+    if (GB_GfxMgr && GB_GfxMgr->pTexResMgr == mgr) {
+        strcpy(st->name, "texture");
+    } else if (audiodrv && &audiodrv->SndDataMgr == mgr) {
+        strcpy(st->name, "sound");
+    } else {
+        snprintf(st->name, sizeof(st->name), "%p", mgr);
+    }
+}
+
+static void resstat_report_one(struct resstat *st)
+{
+    plog("  %s: %u hits, %u misses, peak %d of %d resources.", st->name, st->nr_hit, st->nr_miss, st->peaknum, st->maxnum);
+}
+
+static void resstat_report()
+{
+    int i;
+    plog("resource manager: %d managers, %u recycled.", resstat_count, resstat_nr_recycled);
+    for (i = 0; i < resstat_count; i++) {
+        resstat_report_one(&resstat_list[i]);
+    }
+}
+
+static struct resstat *resstat_get(struct gbResManager *mgr)
+{
+    int i;
+    struct resstat *st;
+    for (i = 0; i < resstat_count; i++) {
+        if (resstat_list[i].mgr == mgr) {
+            st = &resstat_list[i];
+            goto done;
+        }
+    }
+    if (resstat_count < RESSTAT_MAXMGR) {
+        st = &resstat_list[resstat_count++];
+    } else {
+        // recycle least recently used one
+        st = &resstat_list[0];
+        for (i = 1; i < resstat_count; i++) {
+            if (resstat_list[i].lastuse < st->lastuse) st = &resstat_list[i];
+        }
+        resstat_report_one(st);
+        resstat_nr_recycled++;
+    }
+    memset(st, 0, sizeof(*st));
+    st->mgr = mgr;
+    resstat_setname(st);
+done:
+    st->lastuse = ++resstat_clock;
+    st->peaknum = imax(st->peaknum, mgr->CurNum);
+    st->maxnum = mgr->MaxNum;
+    return st;
+}
+
 static MAKE_THISCALL(struct gbResource *, gbResManager_FindResByName, struct gbResManager *this, const char *resname)
 {
     if (!resname) return NULL;
     unsigned hash = gbCrc32Compute(resname);
+    struct resstat *st = resstat_get(this);
     int i;
     for (i = 0; i < this->CurNum; i++) {
         struct gbResource *cur = this->pBuffer[i];
         if (cur->NameCrc32 == hash && strcmp(cur->pName, resname) == 0) {
             cur->baseclass.RefCount++;
+            st->nr_hit++;
             return cur;
         }
     }
+    st->nr_miss++;
     return NULL;
 }
 
 MAKE_PATCHSET(preciseresmgr)
 {
+    add_atexit_hook(resstat_report);
     make_jmp(gboffset + 0x100201B0, gbResManager_FindResByName);
 }
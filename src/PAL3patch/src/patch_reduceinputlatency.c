@@ -3,20 +3,95 @@
 
 
 // method1: reduce latency by doing event query after presenting each frame
+//   queries are kept in a ring, with depth N we wait for the frame presented N-1 frames ago
+//   instead of busy waiting, sleep until the predicted completion time, then spin shortly
+//   the prediction follows measured issue-to-complete time
+#define METHOD1_MAXDEPTH 4
+#define METHOD1_SPINMS 1.0
+#define METHOD1_PREDICT_ALPHA 0.1
+static IDirect3DQuery9 *method1_query[METHOD1_MAXDEPTH];
+static LARGE_INTEGER method1_issuetime[METHOD1_MAXDEPTH];
+static int method1_issued[METHOD1_MAXDEPTH];
+static int method1_depth;
+static int method1_cur;
+static LARGE_INTEGER method1_freq;
+static double method1_predict; // in ms
+static LARGE_INTEGER method1_donetime;
+
+static double method1_elapsed(int idx)
+{
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (now.QuadPart - method1_issuetime[idx].QuadPart) * 1000.0 / method1_freq.QuadPart;
+}
+static int method1_done(int idx)
+{
+    // treat errors (e.g. device lost) as done
+    return IDirect3DQuery9_GetData(method1_query[idx], NULL, 0, D3DGETDATA_FLUSH) != S_FALSE;
+}
+static void method1_wait(int idx)
+{
+    if (!method1_issued[idx]) return;
+    method1_issued[idx] = 0;
+    
+    if (!method1_done(idx)) {
+        double remain = method1_predict - method1_elapsed(idx) - METHOD1_SPINMS;
+        if (remain >= 1.0) {
+            Sleep(floor(remain));
+        }
+        while (!method1_done(idx)) YieldProcessor();
+    }
+    QueryPerformanceCounter(&method1_donetime);
+    
+    // we may have overslept, the prediction will be pulled back by at most METHOD1_SPINMS each time
+    method1_predict += (method1_elapsed(idx) - method1_predict) * METHOD1_PREDICT_ALPHA;
+}
 static void method1_hook()
 {
-    IDirect3DQuery9 *pQuery;
-    if (IDirect3DDevice9_CreateQuery(GB_GfxMgr->m_pd3dDevice, D3DQUERYTYPE_EVENT, &pQuery) == D3D_OK) {
-        if (pQuery) {
-            IDirect3DQuery9_Issue(pQuery, D3DISSUE_END);
-            while (IDirect3DQuery9_GetData(pQuery, NULL, 0, D3DGETDATA_FLUSH) == S_FALSE); // busy wait
-            IDirect3DQuery9_Release(pQuery);
+    IDirect3DQuery9 **ppQuery = &method1_query[method1_cur];
+    if (!*ppQuery) {
+        if (IDirect3DDevice9_CreateQuery(GB_GfxMgr->m_pd3dDevice, D3DQUERYTYPE_EVENT, ppQuery) != D3D_OK) {
+            *ppQuery = NULL;
         }
     }
+    if (*ppQuery) {
+        IDirect3DQuery9_Issue(*ppQuery, D3DISSUE_END);
+        QueryPerformanceCounter(&method1_issuetime[method1_cur]);
+        method1_issued[method1_cur] = 1;
+    }
+    
+    method1_cur = (method1_cur + 1) % method1_depth;
+    method1_wait(method1_cur);
+}
+static void method1_onlostdevice()
+{
+    int i;
+    for (i = 0; i < METHOD1_MAXDEPTH; i++) {
+        if (method1_query[i]) {
+            IDirect3DQuery9_Release(method1_query[i]);
+            method1_query[i] = NULL;
+        }
+        method1_issued[i] = 0;
+    }
 }
 static void method1_init()
 {
+    if (!QueryPerformanceFrequency(&method1_freq)) {
+        warning("can't query performance frequency.");
+        return;
+    }
+    method1_depth = imin(imax(get_int_from_configfile("reduceinputlatency_depth"), 1), METHOD1_MAXDEPTH);
     add_postpresent_hook(method1_hook);
+    add_onlostdevice_hook(method1_onlostdevice);
+}
+static void method1_configchange()
+{
+    if (!config_value_changed("reduceinputlatency_depth")) return;
+    
+    // drop queries in flight, they are recreated by method1_hook()
+    method1_onlostdevice();
+    method1_cur = 0;
+    method1_depth = imin(imax(get_int_from_configfile("reduceinputlatency_depth"), 1), METHOD1_MAXDEPTH);
 }
 
 
@@ -109,11 +184,99 @@ static void method2_init()
 
 
 
+// method3: just-in-time frame start
+//   GPU is synchronized like method1, then before next frame starts (and input is sampled)
+//   we sleep until the estimated next vblank minus the recent worst frame cost
+//   vblank is estimated by GetRasterStatus(), if it's not available, method3 acts like method1
+//   fpslimit waits in post-present hook, which is before us, so limiter deadline is kept
+#define METHOD3_HISTORY 32
+#define METHOD3_MARGINMS 1.5
+#define METHOD3_VBLANK_RATIO 0.04 // assume vblank lines are 4% of visible lines
+static double method3_cost[METHOD3_HISTORY]; // frame start to GPU done, in ms
+static int method3_cost_pos;
+static LARGE_INTEGER method3_starttime;
+static double method3_period; // refresh period, in ms
+static UINT method3_height;
+static UINT method3_maxscanline;
+static int method3_noraster;
+
+static double method3_qpcms(LARGE_INTEGER *a, LARGE_INTEGER *b)
+{
+    return (b->QuadPart - a->QuadPart) * 1000.0 / method1_freq.QuadPart;
+}
+static void method3_update_displaymode()
+{
+    D3DDISPLAYMODE mode;
+    method3_period = 0;
+    if (SUCCEEDED(IDirect3DDevice9_GetDisplayMode(GB_GfxMgr->m_pd3dDevice, 0, &mode)) && mode.RefreshRate > 0) {
+        method3_period = 1000.0 / mode.RefreshRate;
+        method3_height = mode.Height;
+        method3_maxscanline = 0;
+    }
+}
+static int method3_time_to_vblank(double *ms)
+{
+    D3DRASTER_STATUS rs;
+    if (method3_noraster || method3_period <= 0) return 0;
+    if (FAILED(IDirect3DDevice9_GetRasterStatus(GB_GfxMgr->m_pd3dDevice, 0, &rs))) {
+        warning("can't get raster status, just-in-time frame start disabled.");
+        method3_noraster = 1;
+        return 0;
+    }
+    
+    // some drivers count scanlines in vblank, use the largest one seen
+    if (rs.ScanLine > method3_maxscanline) method3_maxscanline = rs.ScanLine;
+    double total = fmax(method3_maxscanline + 1, method3_height * (1.0 + METHOD3_VBLANK_RATIO));
+    if (rs.InVBlank || rs.ScanLine >= method3_height) {
+        *ms = method3_period;
+    } else {
+        *ms = (method3_height - rs.ScanLine) / total * method3_period;
+    }
+    return 1;
+}
+static void method3_gameloop_hook(void *arg)
+{
+    // record cost of last frame
+    if (method3_starttime.QuadPart && method1_donetime.QuadPart > method3_starttime.QuadPart) {
+        method3_cost[method3_cost_pos] = method3_qpcms(&method3_starttime, &method1_donetime);
+        method3_cost_pos = (method3_cost_pos + 1) % METHOD3_HISTORY;
+    }
+    
+    double ttv;
+    if (method3_time_to_vblank(&ttv)) {
+        int i;
+        double cost = 0;
+        for (i = 0; i < METHOD3_HISTORY; i++) cost = fmax(cost, method3_cost[i]);
+        
+        // if there is not enough time before next vblank, start immediately
+        double delay = ttv - cost - METHOD3_MARGINMS;
+        if (delay >= 1.0) Sleep(floor(delay));
+    }
+    QueryPerformanceCounter(&method3_starttime);
+}
+static void method3_onresetdevice()
+{
+    method3_update_displaymode();
+    method3_starttime.QuadPart = 0;
+}
+static void method3_init()
+{
+    method1_init();
+    method1_depth = 1;
+    if (!method1_freq.QuadPart) return;
+    add_postd3dcreate_hook(method3_update_displaymode);
+    add_onresetdevice_hook(method3_onresetdevice);
+    add_gameloop_hook_filtered(method3_gameloop_hook, GAMELOOP_MASK(GAMELOOP_NORMAL));
+}
+
+
+
 MAKE_PATCHSET(reduceinputlatency)
 {
     switch (flag) {
-        case 1: method1_init(); break;
+        case 1: method1_init(); add_configchange_hook(method1_configchange); break;
         case 2: method2_init(); break;
+        case 3: method3_init(); break;
         default: fail("invalid reduce input latency configuration %d.", flag);
     }
 }
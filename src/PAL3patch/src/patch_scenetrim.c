@@ -0,0 +1,120 @@
+#include "common.h"
+#include <malloc.h>
+
+// trim heaps at scene transitions
+//   a load is the run of consecutive frames in which UpdateLoading() is called,
+//   when it finishes, CRT heaps of PAL3.EXE, GBENGINE.DLL and PAL3PATCH.DLL and process heap
+//   are compacted by HeapCompact(), which coalesces free blocks and decommits free pages,
+//   and _heapmin() gives back free memory of our own CRT
+//   game CRTs are linked statically, their small-block heaps can't be trimmed from here
+//
+//   patch-owned allocations are not moved to a per-scene arena, since none of them
+//   is bounded by a scene: glyph and string caches are shared by all scenes,
+//   and texture hook temporaries are freed as soon as each texture is loaded
+
+#define SCENETRIM_MAXHEAPS 4
+
+struct myPROCESS_MEMORY_COUNTERS {
+    DWORD cb;
+    DWORD PageFaultCount;
+    SIZE_T PeakWorkingSetSize;
+    SIZE_T WorkingSetSize;
+    SIZE_T QuotaPeakPagedPoolUsage;
+    SIZE_T QuotaPagedPoolUsage;
+    SIZE_T QuotaPeakNonPagedPoolUsage;
+    SIZE_T QuotaNonPagedPoolUsage;
+    SIZE_T PagefileUsage;
+    SIZE_T PeakPagefileUsage;
+};
+
+static BOOL (WINAPI *myGetProcessMemoryInfo)(HANDLE, struct myPROCESS_MEMORY_COUNTERS *, DWORD);
+static HANDLE st_heaps[SCENETRIM_MAXHEAPS];
+static int st_nr_heaps;
+static int st_frame_loading, st_loading;
+static unsigned st_nr_trims;
+static double st_total_ms;
+static unsigned long long st_total_freed;
+
+static void (*UpdateLoading_next)(void);
+
+static void st_addheap(HANDLE heap)
+{
+    int i;
+    if (!heap) return;
+    for (i = 0; i < st_nr_heaps; i++) {
+        if (st_heaps[i] == heap) return;
+    }
+    if (st_nr_heaps < SCENETRIM_MAXHEAPS) st_heaps[st_nr_heaps++] = heap;
+}
+
+static SIZE_T st_commit()
+{
+    struct myPROCESS_MEMORY_COUNTERS pmc;
+    memset(&pmc, 0, sizeof(pmc));
+    pmc.cb = sizeof(pmc);
+    if (myGetProcessMemoryInfo && myGetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+        return pmc.PagefileUsage;
+    }
+    return 0;
+}
+
+static void st_trim()
+{
+    LARGE_INTEGER freq, begin, end;
+    int i;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&begin);
+    SIZE_T before = st_commit();
+    
+    for (i = 0; i < st_nr_heaps; i++) {
+        HeapCompact(st_heaps[i], 0);
+    }
+    _heapmin();
+    
+    SIZE_T after = st_commit();
+    QueryPerformanceCounter(&end);
+    if (before > after) st_total_freed += before - after;
+    st_total_ms += (end.QuadPart - begin.QuadPart) * 1000.0 / freq.QuadPart;
+    st_nr_trims++;
+}
+
+static void UpdateLoading_scenetrim(void)
+{
+    st_frame_loading = 1;
+    UpdateLoading_next();
+}
+
+static void st_gameloop_hook(void *arg)
+{
+    if (st_frame_loading) {
+        st_loading = 1;
+    } else if (st_loading) {
+        // load is finished at begin of this frame
+        st_loading = 0;
+        st_trim();
+    }
+    st_frame_loading = 0;
+}
+
+static void st_report()
+{
+    plog("scenetrim: %u trims, %.1fms total, %.1fMB commit released.", st_nr_trims, st_total_ms, st_total_freed / 1048576.0);
+}
+
+MAKE_PATCHSET(scenetrim)
+{
+    HMODULE hPsapi = LoadLibrary("PSAPI.DLL");
+    myGetProcessMemoryInfo = hPsapi ? (void *) GetProcAddress(hPsapi, "GetProcessMemoryInfo") : NULL;
+    
+    st_addheap(find_allocator_heap(&pal3_mem_allocator));
+    st_addheap(find_allocator_heap(&gb_mem_allocator));
+    st_addheap(find_allocator_heap(&patch_mem_allocator));
+    st_addheap(GetProcessHeap());
+    
+    // chain to current target, fixloading, cpkprefetch, loadtimes and telemetry may have patched UpdateLoading() calls
+    UpdateLoading_next = TOPTR(get_wrapper_branch_jtarget(0x0041FA84));
+    INIT_WRAPPER_CALL(UpdateLoading_scenetrim, { 0x0041FA84, 0x0041FB0A, 0x0041FC35, 0x0041FCE1, 0x0041FD19 });
+    
+    add_gameloop_hook_filtered(st_gameloop_hook, GAMELOOP_MASK(GAMELOOP_NORMAL));
+    add_atexit_hook(st_report);
+}
@@ -1,41 +1,341 @@
 #include "common.h"
 
+// screenshot
+//   back buffer is copied to a system memory surface with GetRenderTargetData()
+//   (resolved by StretchRect() first if multisampled), and encoded by a worker thread
+//   surfaces are always created and released on game thread
+//
+// burst capture
+//   downscaled frames of last N seconds are kept in a ring of system memory surfaces,
+//   SHIFT+F8 dumps them as a JPG sequence to a sub directory of snap
+//   frames are read back from render targets filled BURST_NRT captures ago,
+//   so we don't wait for GPU
+
+#define SCREENSHOT_MAXJOBS 4
+#define BURST_NRT 3
+#define BURST_MAXWIDTH 640
+
 static int screenshot_flag = 0;
+static D3DXIMAGE_FILEFORMAT screenshot_format;
+static const char *screenshot_ext;
 
 #define SCREENSHOT_MSG_TIME 5000
 static wchar_t screenshot_msg[MAXLINE];
 static DWORD screenshot_msg_time;
 static int screenshot_msg_enable = 0;
 
-static void screenshot_hook()
+enum {
+    SSJOB_FREE,
+    SSJOB_PENDING,
+    SSJOB_DONE,
+};
+struct screenshot_job {
+    int state;
+    IDirect3DSurface9 *surface;
+    IDirect3DSurface9 **frames; // burst frames, oldest first, filename is directory
+    int nr_frames;
+    char filename[MAXLINE];
+    int success;
+};
+static struct screenshot_job ss_jobs[SCREENSHOT_MAXJOBS];
+static CRITICAL_SECTION ss_cs;
+static HANDLE ss_event, ss_idle_event;
+
+static DWORD WINAPI screenshot_thread(LPVOID lpParameter)
 {
-    if (screenshot_flag) {
+    while (WaitForSingleObject(ss_event, INFINITE) == WAIT_OBJECT_0) {
+        while (1) {
+            struct screenshot_job *job = NULL;
+            int i;
+            EnterCriticalSection(&ss_cs);
+            for (i = 0; i < SCREENSHOT_MAXJOBS; i++) {
+                if (ss_jobs[i].state == SSJOB_PENDING) {
+                    job = &ss_jobs[i];
+                    break;
+                }
+            }
+            if (!job) SetEvent(ss_idle_event);
+            LeaveCriticalSection(&ss_cs);
+            if (!job) break;
+            
+            int success;
+            if (job->frames) {
+                char buf[MAXLINE];
+                success = 1;
+                for (i = 0; i < job->nr_frames; i++) {
+                    snprintf(buf, sizeof(buf), "%s\\%04d.jpg", job->filename, i);
+                    if (FAILED(D3DXSaveSurfaceToFileA(buf, D3DXIFF_JPG, job->frames[i], NULL, NULL))) success = 0;
+                }
+            } else {
+                success = SUCCEEDED(D3DXSaveSurfaceToFileA(job->filename, screenshot_format, job->surface, NULL, NULL));
+            }
+            EnterCriticalSection(&ss_cs);
+            job->success = success;
+            job->state = SSJOB_DONE;
+            LeaveCriticalSection(&ss_cs);
+        }
+    }
+    return 0;
+}
 
-        // create directory
-        create_dir("snap");
-        
-        // prepare filename
-        char buf[MAXLINE];
-        SYSTEMTIME SystemTime;
-        GetLocalTime(&SystemTime);
-        snprintf(buf, sizeof(buf), "snap\\%04hu%02hu%02hu_%02hu%02hu%02hu_%03hu.bmp", SystemTime.wYear, SystemTime.wMonth, SystemTime.wDay, SystemTime.wHour, SystemTime.wMinute, SystemTime.wSecond, SystemTime.wMilliseconds);
-    
-        // save image
-        IDirect3DSurface9 *suf = NULL;
-        if (SUCCEEDED(IDirect3DDevice9_GetBackBuffer(GB_GfxMgr->m_pd3dDevice, 0, 0, D3DBACKBUFFER_TYPE_MONO, &suf))) {
-            if (SUCCEEDED(D3DXSaveSurfaceToFileA(buf, D3DXIFF_BMP, suf, NULL, NULL))) {
-                snwprintf(screenshot_msg, sizeof(screenshot_msg) / sizeof(wchar_t), wstr_screenshot_msg, buf);
-                screenshot_msg_time = timeGetTime();
-                screenshot_msg_enable = 1;
+static IDirect3DSurface9 *capture_backbuffer()
+{
+    IDirect3DDevice9 *pd3dDevice = GB_GfxMgr->m_pd3dDevice;
+    IDirect3DSurface9 *backbuffer = NULL, *resolved = NULL, *sysmem = NULL;
+    D3DSURFACE_DESC desc;
+    if (FAILED(IDirect3DDevice9_GetBackBuffer(pd3dDevice, 0, 0, D3DBACKBUFFER_TYPE_MONO, &backbuffer))) goto fail;
+    if (FAILED(IDirect3DSurface9_GetDesc(backbuffer, &desc))) goto fail;
+    
+    // GetRenderTargetData() can't read multisampled surface, resolve it first
+    IDirect3DSurface9 *src = backbuffer;
+    if (desc.MultiSampleType != D3DMULTISAMPLE_NONE) {
+        if (FAILED(IDirect3DDevice9_CreateRenderTarget(pd3dDevice, desc.Width, desc.Height, desc.Format, D3DMULTISAMPLE_NONE, 0, FALSE, &resolved, NULL))) goto fail;
+        if (FAILED(IDirect3DDevice9_StretchRect(pd3dDevice, backbuffer, NULL, resolved, NULL, D3DTEXF_NONE))) goto fail;
+        src = resolved;
+    }
+    
+    if (FAILED(IDirect3DDevice9_CreateOffscreenPlainSurface(pd3dDevice, desc.Width, desc.Height, desc.Format, D3DPOOL_SYSTEMMEM, &sysmem, NULL))) goto fail;
+    if (FAILED(IDirect3DDevice9_GetRenderTargetData(pd3dDevice, src, sysmem))) {
+        IDirect3DSurface9_Release(sysmem);
+        sysmem = NULL;
+    }
+fail:
+    if (resolved) IDirect3DSurface9_Release(resolved);
+    if (backbuffer) IDirect3DSurface9_Release(backbuffer);
+    return sysmem;
+}
+
+static struct screenshot_job *screenshot_newjob(const char *ext)
+{
+    struct screenshot_job *job = NULL;
+    int i;
+    EnterCriticalSection(&ss_cs);
+    for (i = 0; i < SCREENSHOT_MAXJOBS; i++) {
+        if (ss_jobs[i].state == SSJOB_FREE) {
+            job = &ss_jobs[i];
+            break;
+        }
+    }
+    LeaveCriticalSection(&ss_cs);
+    if (!job) {
+        warning("too many pending screenshots.");
+        return NULL;
+    }
+    
+    // create directory
+    create_dir("snap");
+    
+    // prepare filename
+    SYSTEMTIME SystemTime;
+    GetLocalTime(&SystemTime);
+    snprintf(job->filename, sizeof(job->filename), "snap\\%04hu%02hu%02hu_%02hu%02hu%02hu_%03hu%s%s", SystemTime.wYear, SystemTime.wMonth, SystemTime.wDay, SystemTime.wHour, SystemTime.wMinute, SystemTime.wSecond, SystemTime.wMilliseconds, ext ? "." : "", ext ? ext : "");
+    job->surface = NULL;
+    job->frames = NULL;
+    job->nr_frames = 0;
+    return job;
+}
+static void screenshot_submit(struct screenshot_job *job)
+{
+    EnterCriticalSection(&ss_cs);
+    job->state = SSJOB_PENDING;
+    ResetEvent(ss_idle_event);
+    LeaveCriticalSection(&ss_cs);
+    SetEvent(ss_event);
+}
+
+static void screenshot_take()
+{
+    struct screenshot_job *job = screenshot_newjob(screenshot_ext);
+    if (!job) return;
+    
+    // copy image, and let worker save it
+    job->surface = capture_backbuffer();
+    if (!job->surface) {
+        warning("screenshot failed.");
+        return;
+    }
+    screenshot_submit(job);
+}
+
+
+
+static int burst_size; // ring size, zero if disabled
+static DWORD burst_interval; // in ms
+static IDirect3DSurface9 **burst_ring;
+static int burst_head, burst_count;
+static int burst_width, burst_height;
+static D3DFORMAT burst_format;
+static IDirect3DSurface9 *burst_rt[BURST_NRT], *burst_resolve;
+static int burst_rt_filled[BURST_NRT];
+static unsigned burst_tick;
+static DWORD burst_last;
+static int burst_flag;
+static int burst_dumping; // ring is being written by worker
+
+static int burst_init(const D3DSURFACE_DESC *bbdesc)
+{
+    IDirect3DDevice9 *pd3dDevice = GB_GfxMgr->m_pd3dDevice;
+    int i;
+    
+    // system memory surfaces survive device reset, so create them only once
+    if (!burst_ring) {
+        burst_width = imin(bbdesc->Width, BURST_MAXWIDTH);
+        burst_height = imax(1, (double) bbdesc->Height * burst_width / bbdesc->Width + 0.5);
+        burst_format = bbdesc->Format;
+        burst_ring = calloc(burst_size, sizeof(IDirect3DSurface9 *));
+        if (!burst_ring) goto fail;
+        for (i = 0; i < burst_size; i++) {
+            if (FAILED(IDirect3DDevice9_CreateOffscreenPlainSurface(pd3dDevice, burst_width, burst_height, burst_format, D3DPOOL_SYSTEMMEM, &burst_ring[i], NULL))) goto fail;
+        }
+    }
+    
+    for (i = 0; i < BURST_NRT; i++) {
+        if (!burst_rt[i]) {
+            if (FAILED(IDirect3DDevice9_CreateRenderTarget(pd3dDevice, burst_width, burst_height, burst_format, D3DMULTISAMPLE_NONE, 0, FALSE, &burst_rt[i], NULL))) return 0;
+            burst_rt_filled[i] = 0;
+        }
+    }
+    return 1;
+fail:
+    warning("can't create surfaces for burst capture, burst capture disabled.");
+    if (burst_ring) {
+        for (i = 0; i < burst_size; i++) {
+            if (burst_ring[i]) IDirect3DSurface9_Release(burst_ring[i]);
+        }
+        free(burst_ring);
+        burst_ring = NULL;
+    }
+    burst_size = 0;
+    return 0;
+}
+
+static void burst_onlostdevice()
+{
+    int i;
+    for (i = 0; i < BURST_NRT; i++) {
+        if (burst_rt[i]) {
+            IDirect3DSurface9_Release(burst_rt[i]);
+            burst_rt[i] = NULL;
+        }
+    }
+    if (burst_resolve) {
+        IDirect3DSurface9_Release(burst_resolve);
+        burst_resolve = NULL;
+    }
+}
+
+static void burst_capture()
+{
+    IDirect3DDevice9 *pd3dDevice = GB_GfxMgr->m_pd3dDevice;
+    IDirect3DSurface9 *backbuffer = NULL;
+    D3DSURFACE_DESC desc;
+    
+    if (!burst_size || burst_dumping) return;
+    DWORD now = timeGetTime();
+    if (now - burst_last < burst_interval) return;
+    burst_last = now;
+    
+    if (FAILED(IDirect3DDevice9_GetBackBuffer(pd3dDevice, 0, 0, D3DBACKBUFFER_TYPE_MONO, &backbuffer))) return;
+    if (FAILED(IDirect3DSurface9_GetDesc(backbuffer, &desc)) || !burst_init(&desc)) goto done;
+    
+    // read back the target filled BURST_NRT captures ago
+    int t = burst_tick++ % BURST_NRT;
+    if (burst_rt_filled[t]) {
+        int slot = (burst_head + burst_count) % burst_size;
+        if (SUCCEEDED(IDirect3DDevice9_GetRenderTargetData(pd3dDevice, burst_rt[t], burst_ring[slot]))) {
+            if (burst_count < burst_size) {
+                burst_count++;
             } else {
-                warning("screenshot failed.");
+                burst_head = (burst_head + 1) % burst_size;
             }
-            IDirect3DSurface9_Release(suf);
         }
+        burst_rt_filled[t] = 0;
+    }
+    
+    // downscale current frame, resolve it first if multisampled
+    IDirect3DSurface9 *src = backbuffer;
+    if (desc.MultiSampleType != D3DMULTISAMPLE_NONE) {
+        D3DSURFACE_DESC rdesc;
+        if (burst_resolve && (FAILED(IDirect3DSurface9_GetDesc(burst_resolve, &rdesc)) || rdesc.Width != desc.Width || rdesc.Height != desc.Height || rdesc.Format != desc.Format)) {
+            IDirect3DSurface9_Release(burst_resolve);
+            burst_resolve = NULL;
+        }
+        if (!burst_resolve && FAILED(IDirect3DDevice9_CreateRenderTarget(pd3dDevice, desc.Width, desc.Height, desc.Format, D3DMULTISAMPLE_NONE, 0, FALSE, &burst_resolve, NULL))) goto done;
+        if (FAILED(IDirect3DDevice9_StretchRect(pd3dDevice, backbuffer, NULL, burst_resolve, NULL, D3DTEXF_NONE))) goto done;
+        src = burst_resolve;
+    }
+    if (SUCCEEDED(IDirect3DDevice9_StretchRect(pd3dDevice, src, NULL, burst_rt[t], NULL, D3DTEXF_LINEAR))) {
+        burst_rt_filled[t] = 1;
+    }
+done:
+    IDirect3DSurface9_Release(backbuffer);
+}
+
+static void burst_dump()
+{
+    int i;
+    if (!burst_count || burst_dumping) return;
+    struct screenshot_job *job = screenshot_newjob(NULL);
+    if (!job) return;
+    job->frames = malloc(burst_count * sizeof(IDirect3DSurface9 *));
+    if (!job->frames) {
+        warning("can't alloc memory for burst capture.");
+        return;
+    }
+    for (i = 0; i < burst_count; i++) {
+        job->frames[i] = burst_ring[(burst_head + i) % burst_size];
+    }
+    job->nr_frames = burst_count;
+    create_dir(job->filename);
+    
+    // stop capturing until worker is done
+    burst_dumping = 1;
+    screenshot_submit(job);
+}
+
+static void screenshot_collect()
+{
+    int i;
+    EnterCriticalSection(&ss_cs);
+    for (i = 0; i < SCREENSHOT_MAXJOBS; i++) {
+        struct screenshot_job *job = &ss_jobs[i];
+        if (job->state != SSJOB_DONE) continue;
+        if (job->surface) {
+            IDirect3DSurface9_Release(job->surface);
+            job->surface = NULL;
+        }
+        if (job->frames) {
+            free(job->frames);
+            job->frames = NULL;
+            burst_dumping = 0;
+        }
+        if (job->success) {
+            snwprintf(screenshot_msg, sizeof(screenshot_msg) / sizeof(wchar_t), wstr_screenshot_msg, job->filename);
+            screenshot_msg_time = timeGetTime();
+            screenshot_msg_enable = 1;
+        } else {
+            warning("screenshot failed.");
+        }
+        job->state = SSJOB_FREE;
+    }
+    LeaveCriticalSection(&ss_cs);
+}
+
+static void screenshot_hook()
+{
+    if (screenshot_flag) {
+        screenshot_take();
         
         // reset flag
         screenshot_flag = 0;
     }
+    if (burst_flag) {
+        burst_dump();
+        burst_flag = 0;
+    }
+    
+    screenshot_collect();
+    burst_capture();
     
     if (screenshot_msg_enable) {
         print_wstring_begin();
@@ -47,6 +347,12 @@ static void screenshot_hook()
     }
 }
 
+static void screenshot_atexit()
+{
+    // wait pending screenshots to be written
+    WaitForSingleObject(ss_idle_event, 10000);
+}
+
 
 static int screenshot_enabled = 0;
 // this function may be called by outside functions
@@ -62,12 +368,17 @@ static void screenshot_wndproc_hook(void *arg)
     struct wndproc_hook_data *data = arg;
     
     if (data->Msg == WM_KEYUP && data->wParam == VK_F8) {
-        if (try_screenshot()) {
+        if (burst_size && GetKeyState(VK_SHIFT) < 0) {
+            burst_flag = 1;
+            data->retvalue = 0;
+            data->processed = 1;
+        } else if (try_screenshot()) {
             data->retvalue = 0;
             data->processed = 1;
         }
     }
 }
+static const UINT screenshot_wndproc_msgs[] = { WM_KEYUP, 0 };
 
 static void screenshot_grpkbdstate_hook()
 {
@@ -76,8 +387,30 @@ static void screenshot_grpkbdstate_hook()
 
 MAKE_PATCHSET(screenshot)
 {
+    switch (flag) {
+        case 1: screenshot_format = D3DXIFF_BMP; screenshot_ext = "bmp"; break;
+        case 2: screenshot_format = D3DXIFF_PNG; screenshot_ext = "png"; break;
+        case 3: screenshot_format = D3DXIFF_JPG; screenshot_ext = "jpg"; break;
+        default: fail("unknown screenshot flag %d.", flag);
+    }
+    
+    InitializeCriticalSection(&ss_cs);
+    ss_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    ss_idle_event = CreateEvent(NULL, TRUE, TRUE, NULL);
+    if (!ss_event || !ss_idle_event) fail("can't create events for screenshot.");
+    HANDLE hThread = CreateThread(NULL, 0, screenshot_thread, NULL, 0, NULL);
+    if (!hThread) fail("can't create screenshot thread.");
+    sched_set_thread(hThread, SCHED_BACKGROUND);
+    CloseHandle(hThread);
+    
+    // burst capture
+    burst_size = imax(get_int_from_configfile("screenshot_burst"), 0) * imax(get_int_from_configfile("screenshot_burst_fps"), 1);
+    burst_interval = 1000 / imax(get_int_from_configfile("screenshot_burst_fps"), 1);
+    if (burst_size) add_onlostdevice_hook(burst_onlostdevice);
+    
     screenshot_enabled = 1;
     add_preendscene_hook(screenshot_hook);
-    add_postwndproc_hook(screenshot_wndproc_hook);
+    add_postwndproc_hook_filtered(screenshot_wndproc_hook, screenshot_wndproc_msgs);
     add_grpkbdstate_hook(screenshot_grpkbdstate_hook);
+    add_atexit_hook(screenshot_atexit);
 }
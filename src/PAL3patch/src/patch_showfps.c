@@ -25,6 +25,223 @@ static double jitter_limit;
 static double standard_fps1, standard_fps2;
 static struct jitter_info_t jitter_info[MAX_JITTER_QUEUE];
 
+// frame time statistics, press F7 to toggle
+//   frame times are kept in a ring buffer, percentiles are
+//   recalculated together with fps, the graph shows latest frames
+#define FRAMETIME_RING 2048
+#define FRAMETIME_GRAPH_FRAMES 240
+#define FRAMETIME_GRAPH_HEIGHT 80
+#define FRAMETIME_GRAPH_MAXMS 50.0
+struct frametime_vertex_t {
+    float x, y, z, rhw;
+    D3DCOLOR color;
+};
+#define FRAMETIME_VERTEX_FVF (D3DFVF_XYZRHW | D3DFVF_DIFFUSE)
+static int frametime_enabled;
+static int frametime_visible;
+static double frametime_ring[FRAMETIME_RING]; // in ms
+static double frametime_sorted[FRAMETIME_RING];
+static unsigned frametime_head, frametime_count;
+static double frametime_avg, frametime_low1, frametime_low01, frametime_max;
+static struct frametime_vertex_t frametime_vbuf[FRAMETIME_GRAPH_FRAMES + 4];
+
+static int frametime_cmp(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+static void frametime_update()
+{
+    unsigned i, n = frametime_count;
+    if (!n) return;
+    double sum = 0;
+    for (i = 0; i < n; i++) {
+        frametime_sorted[i] = frametime_ring[i];
+        sum += frametime_ring[i];
+    }
+    qsort(frametime_sorted, n, sizeof(double), frametime_cmp);
+    frametime_avg = sum / n;
+    frametime_max = frametime_sorted[n - 1];
+    // x% low is the fps of the (100-x)th percentile frame time
+    frametime_low1 = 1000.0 / frametime_sorted[imin(n * 99 / 100, n - 1)];
+    frametime_low01 = 1000.0 / frametime_sorted[imin(n * 999 / 1000, n - 1)];
+}
+static void frametime_draw()
+{
+    IDirect3DDevice9 *pd3dDevice = GB_GfxMgr->m_pd3dDevice;
+    float x0 = 10, y0 = GB_GfxMgr->m_d3dsdBackBuffer.Height - 10;
+    float yscale = FRAMETIME_GRAPH_HEIGHT / FRAMETIME_GRAPH_MAXMS;
+    unsigned n = imin(frametime_count, FRAMETIME_GRAPH_FRAMES);
+    unsigned i;
+    if (n < 2) return;
+    
+    for (i = 0; i < n; i++) {
+        unsigned idx = (frametime_head + FRAMETIME_RING - n + i) % FRAMETIME_RING;
+        double ms = fmin(frametime_ring[idx], FRAMETIME_GRAPH_MAXMS);
+        frametime_vbuf[i] = (struct frametime_vertex_t) { x0 + i, y0 - ms * yscale, 0.0f, 1.0f, ms * standard_fps1 > 2000.0 ? 0xFFFF4040 : 0xFF40FF40 };
+    }
+    
+    // reference line at first standard fps
+    float yref = y0 - fmin(1000.0 / standard_fps1, FRAMETIME_GRAPH_MAXMS) * yscale;
+    frametime_vbuf[n] = (struct frametime_vertex_t) { x0, yref, 0.0f, 1.0f, 0xFFFFFF00 };
+    frametime_vbuf[n + 1] = (struct frametime_vertex_t) { x0 + FRAMETIME_GRAPH_FRAMES, yref, 0.0f, 1.0f, 0xFFFFFF00 };
+    frametime_vbuf[n + 2] = (struct frametime_vertex_t) { x0, y0, 0.0f, 1.0f, 0xFFFFFFFF };
+    frametime_vbuf[n + 3] = (struct frametime_vertex_t) { x0 + FRAMETIME_GRAPH_FRAMES, y0, 0.0f, 1.0f, 0xFFFFFFFF };
+    
+    IDirect3DDevice9_SetTexture(pd3dDevice, 0, NULL);
+    IDirect3DDevice9_SetTextureStageState(pd3dDevice, 0, D3DTSS_COLOROP, D3DTOP_SELECTARG1);
+    IDirect3DDevice9_SetTextureStageState(pd3dDevice, 0, D3DTSS_COLORARG1, D3DTA_DIFFUSE);
+    IDirect3DDevice9_SetTextureStageState(pd3dDevice, 0, D3DTSS_ALPHAOP, D3DTOP_SELECTARG1);
+    IDirect3DDevice9_SetTextureStageState(pd3dDevice, 0, D3DTSS_ALPHAARG1, D3DTA_DIFFUSE);
+    IDirect3DDevice9_SetRenderState(pd3dDevice, D3DRS_LIGHTING, FALSE);
+    IDirect3DDevice9_SetRenderState(pd3dDevice, D3DRS_ALPHABLENDENABLE, FALSE);
+    IDirect3DDevice9_SetVertexShader(pd3dDevice, NULL);
+    IDirect3DDevice9_SetPixelShader(pd3dDevice, NULL);
+    IDirect3DDevice9_SetFVF(pd3dDevice, FRAMETIME_VERTEX_FVF);
+    IDirect3DDevice9_DrawPrimitiveUP(pd3dDevice, D3DPT_LINESTRIP, n - 1, frametime_vbuf, sizeof(struct frametime_vertex_t));
+    IDirect3DDevice9_DrawPrimitiveUP(pd3dDevice, D3DPT_LINELIST, 2, frametime_vbuf + n, sizeof(struct frametime_vertex_t));
+}
+static void frametime_wndproc_hook(void *arg)
+{
+    struct wndproc_hook_data *data = arg;
+    
+    if (data->Msg == WM_KEYUP && data->wParam == VK_F7) {
+        frametime_visible = !frametime_visible;
+        data->retvalue = 0;
+        data->processed = 1;
+    }
+}
+static const UINT frametime_wndproc_msgs[] = { WM_KEYUP, 0 };
+static void frametime_grpkbdstate_hook()
+{
+    g_input.m_keyRaw[DIK_F7] = 0;
+}
+static int frametime_wndproc_handle, frametime_grpkbdstate_handle;
+static void frametime_set_hotkey(int enabled)
+{
+    if (enabled && !frametime_wndproc_handle) {
+        frametime_wndproc_handle = add_wndproc_hook_ex(HOOKID_POSTWNDPROC, frametime_wndproc_hook, frametime_wndproc_msgs, HOOK_PRIORITY_DEFAULT);
+        frametime_grpkbdstate_handle = add_hook_ex(HOOKID_GRPKBDSTATE, frametime_grpkbdstate_hook, HOOK_PRIORITY_DEFAULT);
+    } else if (!enabled && frametime_wndproc_handle) {
+        remove_hook(frametime_wndproc_handle);
+        remove_hook(frametime_grpkbdstate_handle);
+        frametime_wndproc_handle = frametime_grpkbdstate_handle = 0;
+    }
+}
+
+// GPU time
+//   timestamp queries are issued at post-present (frame begin/end) and at our pre-EndScene hook,
+//   so 'render' is all engine drawing of the frame, 'overlay' is pre-EndScene hooks, EndScene and Present
+//   results are read GPUTIME_SLOTS frames later without flushing, frames not ready by then are dropped
+#define GPUTIME_SLOTS 4
+#define GPUTIME_SMOOTH 0.05
+struct gputime_slot {
+    IDirect3DQuery9 *disjoint, *freq;
+    IDirect3DQuery9 *ts_begin, *ts_mid, *ts_end;
+    int issued; // begin issued
+    int mid_issued;
+};
+static int gputime_enabled;
+static struct gputime_slot gputime_slots[GPUTIME_SLOTS];
+static int gputime_cur;
+static int gputime_valid;
+static double gputime_render, gputime_overlay; // in ms
+static struct perfcounter *gputime_pc; // 'gpu.frame_ms', render and overlay
+
+static void gputime_release()
+{
+    int i;
+    for (i = 0; i < GPUTIME_SLOTS; i++) {
+        struct gputime_slot *slot = &gputime_slots[i];
+        IDirect3DQuery9 **q[] = { &slot->disjoint, &slot->freq, &slot->ts_begin, &slot->ts_mid, &slot->ts_end };
+        int j;
+        for (j = 0; j < (int) (sizeof(q) / sizeof(q[0])); j++) {
+            if (*q[j]) {
+                IDirect3DQuery9_Release(*q[j]);
+                *q[j] = NULL;
+            }
+        }
+        slot->issued = slot->mid_issued = 0;
+    }
+}
+static void gputime_create()
+{
+    IDirect3DDevice9 *pd3dDevice = GB_GfxMgr->m_pd3dDevice;
+    int i;
+    for (i = 0; i < GPUTIME_SLOTS; i++) {
+        struct gputime_slot *slot = &gputime_slots[i];
+        if (FAILED(IDirect3DDevice9_CreateQuery(pd3dDevice, D3DQUERYTYPE_TIMESTAMPDISJOINT, &slot->disjoint))) slot->disjoint = NULL;
+        if (FAILED(IDirect3DDevice9_CreateQuery(pd3dDevice, D3DQUERYTYPE_TIMESTAMPFREQ, &slot->freq))) slot->freq = NULL;
+        if (FAILED(IDirect3DDevice9_CreateQuery(pd3dDevice, D3DQUERYTYPE_TIMESTAMP, &slot->ts_begin))) slot->ts_begin = NULL;
+        if (FAILED(IDirect3DDevice9_CreateQuery(pd3dDevice, D3DQUERYTYPE_TIMESTAMP, &slot->ts_mid))) slot->ts_mid = NULL;
+        if (FAILED(IDirect3DDevice9_CreateQuery(pd3dDevice, D3DQUERYTYPE_TIMESTAMP, &slot->ts_end))) slot->ts_end = NULL;
+        if (!slot->disjoint || !slot->freq || !slot->ts_begin || !slot->ts_mid || !slot->ts_end) {
+            warning("timestamp query is not supported, can't show GPU time.");
+            gputime_release();
+            gputime_enabled = 0;
+            return;
+        }
+    }
+}
+static void gputime_collect(struct gputime_slot *slot)
+{
+    BOOL disjoint;
+    UINT64 freq, t0, t1, t2;
+    if (!slot->issued) return;
+    slot->issued = 0;
+    if (!slot->mid_issued) return;
+    
+    // never flush here, we don't want to stall
+    if (IDirect3DQuery9_GetData(slot->disjoint, &disjoint, sizeof(disjoint), 0) != S_OK || disjoint) return;
+    if (IDirect3DQuery9_GetData(slot->freq, &freq, sizeof(freq), 0) != S_OK || freq == 0) return;
+    if (IDirect3DQuery9_GetData(slot->ts_begin, &t0, sizeof(t0), 0) != S_OK) return;
+    if (IDirect3DQuery9_GetData(slot->ts_mid, &t1, sizeof(t1), 0) != S_OK) return;
+    if (IDirect3DQuery9_GetData(slot->ts_end, &t2, sizeof(t2), 0) != S_OK) return;
+    if (t1 < t0 || t2 < t1) return;
+    
+    double render = (t1 - t0) * 1000.0 / freq;
+    double overlay = (t2 - t1) * 1000.0 / freq;
+    if (gputime_valid) {
+        gputime_render += (render - gputime_render) * GPUTIME_SMOOTH;
+        gputime_overlay += (overlay - gputime_overlay) * GPUTIME_SMOOTH;
+    } else {
+        gputime_render = render;
+        gputime_overlay = overlay;
+        gputime_valid = 1;
+    }
+    perfcounter_set(gputime_pc, gputime_render + gputime_overlay);
+}
+static void gputime_postpresent()
+{
+    if (!gputime_enabled || !gputime_slots[0].disjoint) return;
+    
+    // end current frame
+    struct gputime_slot *slot = &gputime_slots[gputime_cur];
+    if (slot->issued) {
+        IDirect3DQuery9_Issue(slot->ts_end, D3DISSUE_END);
+        IDirect3DQuery9_Issue(slot->disjoint, D3DISSUE_END);
+    }
+    
+    // begin next frame, using oldest slot
+    gputime_cur = (gputime_cur + 1) % GPUTIME_SLOTS;
+    slot = &gputime_slots[gputime_cur];
+    gputime_collect(slot);
+    IDirect3DQuery9_Issue(slot->disjoint, D3DISSUE_BEGIN);
+    IDirect3DQuery9_Issue(slot->ts_begin, D3DISSUE_END);
+    IDirect3DQuery9_Issue(slot->freq, D3DISSUE_END);
+    slot->issued = 1;
+    slot->mid_issued = 0;
+}
+static void gputime_preendscene()
+{
+    if (!gputime_enabled || !gputime_slots[0].disjoint) return;
+    struct gputime_slot *slot = &gputime_slots[gputime_cur];
+    if (slot->issued && !slot->mid_issued) {
+        IDirect3DQuery9_Issue(slot->ts_mid, D3DISSUE_END);
+        slot->mid_issued = 1;
+    }
+}
+
 static void showfps_calcfps()
 {
     fcnt++;
@@ -54,11 +271,19 @@ static void showfps_calcfps()
             };
         }
     }
+    
+    if (frametime_enabled && qwLastTime.QuadPart != 0) {
+        // record frame time
+        frametime_ring[frametime_head] = (qwTime.QuadPart - qwLastTime.QuadPart) * 1000.0 / qwTicksPerSec.QuadPart;
+        frametime_head = (frametime_head + 1) % FRAMETIME_RING;
+        if (frametime_count < FRAMETIME_RING) frametime_count++;
+    }
 
     // update fps
     if (cur_time - last_time >= 0.5) {
         fps = fcnt / (cur_time - last_time);
         fcnt = 0;
+        if (frametime_enabled) frametime_update();
         last_time = cur_time;
     }
         
@@ -68,9 +293,11 @@ static void showfps_calcfps()
 static void showfps_postpresent()
 {
     showfps_calcfps();
+    gputime_postpresent();
 }
 static void showfps_onendscene()
 {
+    gputime_preendscene();
     if (!pFPSFont) return;
 
     char jstr[MAXLINE];
@@ -100,8 +327,38 @@ static void showfps_onendscene()
         snprintf(vstr, sizeof(vstr), "PAL3patch %s\n%s\n", patch_version, build_info);
     }
     
+    char tstr[MAXLINE];
+    get_texture_stat_text(tstr, sizeof(tstr));
+    
+    char mstr[MAXLINE];
+    get_heapstat_text(mstr, sizeof(mstr));
+    
+    char hstr[MAXLINE];
+    get_hook_profile_text(hstr, sizeof(hstr));
+    
+    char ostr[MAXLINE];
+    get_occlusionstat_text(ostr, sizeof(ostr));
+    
+    char rstr[MAXLINE];
+    get_vramstat_text(rstr, sizeof(rstr));
+    
+    char pstr[MAXLINE];
+    perfcounter_get_text(pstr, sizeof(pstr), PERFCOUNTER_OVERLAY, '\n');
+    
+    char fstr[MAXLINE];
+    fstr[0] = '\0';
+    if (frametime_enabled && frametime_visible && frametime_count > 0) {
+        snprintf(fstr, sizeof(fstr), "AVG = %.3fms, 1%% LOW = %.1f, 0.1%% LOW = %.1f, MAX = %.3fms\n", frametime_avg, frametime_low1, frametime_low01, frametime_max);
+    }
+    
+    char gstr[MAXLINE];
+    gstr[0] = '\0';
+    if (gputime_enabled && gputime_valid) {
+        snprintf(gstr, sizeof(gstr), "GPU = %.3fms (render %.3fms, overlay %.3fms)\n", gputime_render + gputime_overlay, gputime_render, gputime_overlay);
+    }
+    
     wchar_t buf[MAXLINE];
-    snwprintf(buf, sizeof(buf) / sizeof(wchar_t), L"%hsFPS = %.3f\n\n%hs", vstr, fps, jstr);
+    snwprintf(buf, sizeof(buf) / sizeof(wchar_t), L"%hsFPS = %.3f\n%hs%hs%hs%hs%hs%hs%hs%hs\n%hs", vstr, fps, gstr, fstr, tstr, mstr, ostr, rstr, pstr, hstr, jstr);
 
     
     IDirect3DStateBlock9_Capture(pFPSStateBlock);
@@ -132,10 +389,14 @@ static void showfps_onendscene()
     ID3DXFont_DrawTextW(pFPSFont, pFPSSprite, buf, -1, &rc, DT_NOCLIP, 0xFFFFFFFF);
     ID3DXSprite_End(pFPSSprite);
     
+    // draw frame time graph
+    if (frametime_enabled && frametime_visible) frametime_draw();
+    
     IDirect3DStateBlock9_Apply(pFPSStateBlock);
 }
 static void showfps_onlostdevice()
 {
+    if (gputime_enabled) gputime_release();
     if (!pFPSFont) return;
     ID3DXFont_OnLostDevice(pFPSFont);
     ID3DXSprite_OnLostDevice(pFPSSprite);
@@ -143,6 +404,7 @@ static void showfps_onlostdevice()
 }
 static void showfps_onresetdevice()
 {
+    if (gputime_enabled) gputime_create();
     if (!pFPSFont) return;
     ID3DXFont_OnResetDevice(pFPSFont);
     ID3DXSprite_OnResetDevice(pFPSSprite);
@@ -153,6 +415,8 @@ static void showfps_onresetdevice()
 }
 static void showfps_initfont()
 {
+    if (gputime_enabled) gputime_create();
+    
     if (FAILED(D3DXCreateFontW(GB_GfxMgr->m_pd3dDevice, 12, 0, 0, 0, FALSE, DEFAULT_CHARSET, OUT_DEFAULT_PRECIS, PROOF_QUALITY, DEFAULT_PITCH | FF_DONTCARE, L"Fixedsys", &pFPSFont))) {
         warning("can't create font for showing FPS.");
         pFPSFont = NULL;
@@ -166,9 +430,29 @@ static void showfps_initfont()
         fail("can't create state block for showing FPS.");
     }
 }
+static void showfps_configchange()
+{
+    // gputime needs device resources, it is not reloaded
+    showver_flag = get_int_from_configfile("showfps_showversion");
+    frametime_enabled = get_int_from_configfile("showfps_frametime");
+    frametime_set_hotkey(frametime_enabled);
+    
+    double jitter[3];
+    if (config_value_tuple(get_config_value("showfps_showjitter"), jitter, 3) == 3) {
+        jitter_limit = jitter[0];
+        standard_fps1 = jitter[1];
+        standard_fps2 = jitter[2];
+    } else {
+        plog("invalid showfps showjitter config string, ignored.");
+    }
+}
 MAKE_PATCHSET(showfps)
 {
     showver_flag = get_int_from_configfile("showfps_showversion");
+    frametime_enabled = get_int_from_configfile("showfps_frametime");
+    frametime_visible = 1;
+    gputime_enabled = get_int_from_configfile("showfps_gputime");
+    if (gputime_enabled) gputime_pc = perfcounter_register("gpu.frame_ms", PERFCOUNTER_GAUGE, 0);
 
     const char *jitter_cfgstr = get_string_from_configfile("showfps_showjitter");
     if (sscanf(jitter_cfgstr, "%lf,%lf,%lf", &jitter_limit, &standard_fps1, &standard_fps2) != 3) {
@@ -188,6 +472,8 @@ MAKE_PATCHSET(showfps)
     add_onresetdevice_hook(showfps_onresetdevice);
     add_preendscene_hook(showfps_onendscene);
     add_postpresent_hook(showfps_postpresent);
+    frametime_set_hotkey(frametime_enabled);
+    add_configchange_hook(showfps_configchange);
     
     memset(jitter_info, 0, sizeof(jitter_info));
 }
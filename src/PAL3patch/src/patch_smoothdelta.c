@@ -0,0 +1,84 @@
+#include "common.h"
+
+// frame delta smoothing
+//   deltaTime given to PAL3::Update() follows raw frame time, so scheduling
+//   noise at a steady frame rate turns into animation judder
+//   everything driven by deltaTime (game clock, effects, animations) sees the filtered value
+//   mode 1: median of last N deltas
+//   mode 2: like mode 1, but locked to fps limiter period when median is close to it
+//   time is not lost: difference between raw and filtered deltas is accumulated,
+//   and a fraction is paid back every frame, so game clock keeps following wall clock
+//   long frames (loading, hitches) are passed through and restart the filter
+
+#define SMOOTHDELTA_MAXWINDOW 15
+#define SMOOTHDELTA_PAYBACK 0.1f // fraction of accumulated error paid back per frame
+#define SMOOTHDELTA_RESYNC 4.0f // restart if delta is this many times longer than median
+#define SMOOTHDELTA_MAXERROR 0.05f // pay back at once if error grows over this many seconds
+#define SMOOTHDELTA_LOCKRANGE 0.25f // lock to limiter period if median is within this fraction
+
+static int sd_mode, sd_window;
+static float sd_history[SMOOTHDELTA_MAXWINDOW];
+static int sd_count, sd_pos;
+static float sd_error;
+
+static void sd_reset(void)
+{
+    sd_count = sd_pos = 0;
+    sd_error = 0.0f;
+}
+
+static float sd_median(void)
+{
+    float sorted[SMOOTHDELTA_MAXWINDOW];
+    int i, j;
+    for (i = 0; i < sd_count; i++) {
+        float x = sd_history[i];
+        for (j = i; j > 0 && sorted[j - 1] > x; j--) sorted[j] = sorted[j - 1];
+        sorted[j] = x;
+    }
+    return sorted[sd_count / 2];
+}
+
+static float sd_filter(float dt)
+{
+    // pass through invalid values, the game handles them as before
+    if (!(dt > 0.0f)) return dt;
+    
+    // long frame absorbs error left by filter
+    if (sd_count && dt > sd_median() * SMOOTHDELTA_RESYNC) {
+        dt += sd_error;
+        sd_reset();
+        return dt;
+    }
+    
+    sd_history[sd_pos] = dt;
+    sd_pos = (sd_pos + 1) % sd_window;
+    if (sd_count < sd_window) sd_count++;
+    
+    float base = sd_median();
+    if (sd_mode == 2) {
+        float period = get_fpslimit_period();
+        if (period > 0.0f && fabs(base - period) < period * SMOOTHDELTA_LOCKRANGE) base = period;
+    }
+    
+    sd_error += dt - base;
+    float pay = fabs(sd_error) > SMOOTHDELTA_MAXERROR ? sd_error : sd_error * SMOOTHDELTA_PAYBACK;
+    if (base + pay < 0.0f) pay = -base;
+    sd_error -= pay;
+    return base + pay;
+}
+
+static void sd_updatebegin_hook(void *arg)
+{
+    struct game_loop_hook_data *hookarg = arg;
+    float *deltaTime = hookarg->data;
+    *deltaTime = sd_filter(*deltaTime);
+}
+
+MAKE_PATCHSET(smoothdelta)
+{
+    sd_mode = flag;
+    sd_window = imin(imax(get_int_from_configfile("smoothdelta_window"), 1), SMOOTHDELTA_MAXWINDOW);
+    
+    add_gameloop_hook_filtered(sd_updatebegin_hook, GAMELOOP_MASK(GAMEEVENT_UPDATE_ATBEGIN));
+}
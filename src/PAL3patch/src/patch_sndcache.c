@@ -0,0 +1,151 @@
+#include "common.h"
+
+// sound effect cache
+//   combat effects load the same short samples from SoundMgr's CPK again and again,
+//   each load maps a view of the CPK entry and unmaps it after MSS has used it
+//   unmapped views of this CPK are kept in a bounded cache keyed by CPK entry,
+//   a later load of the same entry gets the cached view back, already resident,
+//   least recently used idle views are unmapped when cache exceeds its budget
+//
+//   MSS sample handles and decoded PCM are not reachable from here,
+//   so decoding is still done by MSS, only mapping and reading are avoided
+
+#define MAX_SNDCACHE 256
+
+struct sndview {
+    HANDLE hmap;
+    DWORD access;
+    DWORD off, len;
+    void *base;
+    int refs;
+    unsigned last_use;
+};
+
+static struct sndview sndlist[MAX_SNDCACHE];
+static unsigned snd_budget, snd_total, snd_peak;
+static unsigned snd_clock;
+static unsigned snd_hit, snd_miss, snd_evict;
+static CRITICAL_SECTION snd_cs;
+
+static LPVOID (WINAPI *MapViewOfFile_next)(HANDLE, DWORD, DWORD, DWORD, SIZE_T);
+static BOOL (WINAPI *UnmapViewOfFile_next)(LPCVOID);
+
+static void snd_release(struct sndview *v)
+{
+    UnmapViewOfFile_next(v->base);
+    snd_total -= v->len;
+    memset(v, 0, sizeof(*v));
+}
+
+static void snd_shrink(void)
+{
+    // evict least recently used idle views until cache fits in budget
+    while (snd_total > snd_budget) {
+        int i;
+        struct sndview *victim = NULL;
+        for (i = 0; i < MAX_SNDCACHE; i++) {
+            struct sndview *v = &sndlist[i];
+            if (v->base && v->refs == 0 && (!victim || v->last_use < victim->last_use)) victim = v;
+        }
+        if (!victim) break;
+        snd_release(victim);
+        snd_evict++;
+    }
+}
+
+static LPVOID WINAPI MapViewOfFile_sndcache(HANDLE hFileMappingObject, DWORD dwDesiredAccess, DWORD dwFileOffsetHigh, DWORD dwFileOffsetLow, SIZE_T dwNumberOfBytesToMap)
+{
+    int i;
+    struct sndview *slot = NULL;
+    DWORD off = dwFileOffsetLow, size = dwNumberOfBytesToMap;
+
+    if (dwFileOffsetHigh != 0 || size == 0 || size > snd_budget || !is_cpk_handle(&SoundMgr_Inst()->m_Cpk, hFileMappingObject)) {
+        return MapViewOfFile_next(hFileMappingObject, dwDesiredAccess, dwFileOffsetHigh, dwFileOffsetLow, dwNumberOfBytesToMap);
+    }
+
+    EnterCriticalSection(&snd_cs);
+    for (i = 0; i < MAX_SNDCACHE; i++) {
+        struct sndview *v = &sndlist[i];
+        if (v->base && v->hmap == hFileMappingObject && v->access == dwDesiredAccess && v->off == off && v->len == size) {
+            v->refs++;
+            v->last_use = ++snd_clock;
+            snd_hit++;
+            LeaveCriticalSection(&snd_cs);
+            return v->base;
+        }
+        if (!v->base && !slot) slot = v;
+    }
+    snd_miss++;
+    LeaveCriticalSection(&snd_cs);
+
+    void *base = MapViewOfFile_next(hFileMappingObject, dwDesiredAccess, dwFileOffsetHigh, dwFileOffsetLow, dwNumberOfBytesToMap);
+    if (!base) return NULL;
+
+    EnterCriticalSection(&snd_cs);
+    if (!slot || slot->base) {
+        // no empty slot, or slot is taken while we are mapping
+        // search again, prefer empty slot, then least recently used idle view
+        for (slot = NULL, i = 0; i < MAX_SNDCACHE; i++) {
+            struct sndview *v = &sndlist[i];
+            if (!v->base) { slot = v; break; }
+            if (v->refs == 0 && (!slot || v->last_use < slot->last_use)) slot = v;
+        }
+        if (slot && slot->base) {
+            snd_release(slot);
+            snd_evict++;
+        }
+    }
+    if (slot) {
+        slot->hmap = hFileMappingObject;
+        slot->access = dwDesiredAccess;
+        slot->off = off;
+        slot->len = size;
+        slot->base = base;
+        slot->refs = 1;
+        slot->last_use = ++snd_clock;
+        snd_total += size;
+        snd_peak = imax(snd_peak, snd_total);
+        snd_shrink();
+    }
+    LeaveCriticalSection(&snd_cs);
+    return base;
+}
+
+static BOOL WINAPI UnmapViewOfFile_sndcache(LPCVOID lpBaseAddress)
+{
+    int i;
+    EnterCriticalSection(&snd_cs);
+    for (i = 0; i < MAX_SNDCACHE; i++) {
+        struct sndview *v = &sndlist[i];
+        if (v->base == lpBaseAddress && v->refs > 0) {
+            // keep view mapped, unless its CPK is closed
+            v->refs--;
+            if (v->refs == 0 && !is_cpk_handle(&SoundMgr_Inst()->m_Cpk, v->hmap)) snd_release(v);
+            snd_shrink();
+            LeaveCriticalSection(&snd_cs);
+            return TRUE;
+        }
+    }
+    LeaveCriticalSection(&snd_cs);
+    return UnmapViewOfFile_next(lpBaseAddress);
+}
+
+static void snd_report(void)
+{
+    plog("sndcache: %u hit, %u miss, %u evicted, peak usage %u KB of %u KB.", snd_hit, snd_miss, snd_evict, snd_peak / 1024, snd_budget / 1024);
+}
+
+MAKE_PATCHSET(sndcache)
+{
+    snd_budget = imax(flag, 0) * 1048576u;
+    if (!snd_budget) return;
+
+    InitializeCriticalSection(&snd_cs);
+    add_atexit_hook(snd_report);
+
+    // chain to current targets, since nommapcpk, cpktrace and audioprefetch may have patched these calls
+    MapViewOfFile_next = TOPTR(get_wrapper_branch_jtarget(gboffset + 0x1002DB42));
+    UnmapViewOfFile_next = TOPTR(get_wrapper_branch_jtarget(gboffset + 0x1002DB61));
+    make_wrapper_branch(gboffset + 0x1002DB42, MapViewOfFile_sndcache);
+    make_wrapper_branch(gboffset + 0x1002DB61, UnmapViewOfFile_sndcache);
+}
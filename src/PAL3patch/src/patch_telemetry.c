@@ -0,0 +1,160 @@
+#include "common.h"
+
+// shared-memory telemetry for external monitors
+//   after each present, frame metrics and all performance counters are
+//   written to named file mapping TELEMETRY_NAME, so capture rigs can watch
+//   the game without an overlay in the recording
+//   the game only writes to memory, nothing is drawn or waited for
+//
+//   layout is struct telemetry_section below, readers should check magic,
+//   version and size, newer versions only append fields
+//   seq is odd while the section is being written, readers should copy
+//   the section and retry if seq was odd or has changed during the copy
+//
+//   gputime is from showfps_gputime ('gpu.frame_ms' counter), heap and
+//   vafree are from heapstat, they are -1 if not available
+
+#define TELEMETRY_NAME "PAL3patch_Telemetry"
+#define TELEMETRY_MAGIC 0x4D4C4554 // "TELM"
+#define TELEMETRY_VERSION 1
+#define TELEMETRY_SCENELEN 32
+#define TELEMETRY_MAXCOUNTERS 128
+
+struct telemetry_counter {
+    char name[PERFCOUNTER_NAMELEN];
+    int type; // enum perfcounter_type
+    unsigned count;
+    double value, min, max; // see struct perfcounter_value
+};
+
+struct telemetry_section {
+    DWORD magic;
+    DWORD version;
+    DWORD size; // sizeof(struct telemetry_section)
+    DWORD pid;
+    volatile LONG seq;
+    DWORD frame;
+    double time; // seconds since game start
+    double fps; // average of last second
+    double frametime; // present-to-present time of last frame, in ms
+    double gputime; // in ms
+    double heap, vafree; // in MB
+    int loading; // UpdateLoading() was called in last frame
+    int gamestate; // PAL3_s_gamestate
+    char scene[TELEMETRY_SCENELEN]; // vfs_cpkname()
+    DWORD nr_counters;
+    struct telemetry_counter counters[TELEMETRY_MAXCOUNTERS];
+};
+
+static HANDLE tm_mapping;
+static struct telemetry_section *tm;
+static LARGE_INTEGER tm_freq, tm_begin, tm_last, tm_fps_begin;
+static unsigned tm_frame, tm_fps_frames;
+static double tm_fps;
+static int tm_frame_loading;
+static struct perfcounter *tm_gpu_pc;
+
+static void (*UpdateLoading_next)(void);
+
+static void UpdateLoading_telemetry()
+{
+    tm_frame_loading = 1;
+    UpdateLoading_next();
+}
+
+static void tm_postpresent_hook()
+{
+    LARGE_INTEGER now;
+    struct perfcounter_value v;
+    double heap, vafree;
+    int i, n;
+    
+    QueryPerformanceCounter(&now);
+    tm_frame++;
+    tm_fps_frames++;
+    if (now.QuadPart - tm_fps_begin.QuadPart >= tm_freq.QuadPart) {
+        tm_fps = tm_fps_frames * (double) tm_freq.QuadPart / (now.QuadPart - tm_fps_begin.QuadPart);
+        tm_fps_frames = 0;
+        tm_fps_begin = now;
+    }
+    if (!tm_gpu_pc) tm_gpu_pc = perfcounter_find("gpu.frame_ms");
+    
+    InterlockedIncrement(&tm->seq);
+    tm->frame = tm_frame;
+    tm->time = (now.QuadPart - tm_begin.QuadPart) / (double) tm_freq.QuadPart;
+    tm->fps = tm_fps;
+    tm->frametime = (now.QuadPart - tm_last.QuadPart) * 1000.0 / tm_freq.QuadPart;
+    if (tm_gpu_pc) {
+        perfcounter_read(tm_gpu_pc, &v);
+        tm->gputime = v.value;
+    } else {
+        tm->gputime = -1;
+    }
+    if (heapstat_get_summary(&heap, &vafree)) {
+        tm->heap = heap;
+        tm->vafree = vafree;
+    } else {
+        tm->heap = tm->vafree = -1;
+    }
+    tm->loading = tm_frame_loading;
+    tm->gamestate = PAL3_s_gamestate;
+    snprintf(tm->scene, sizeof(tm->scene), "%s", g_pVFileSys ? vfs_cpkname() : "");
+    n = imin(perfcounter_count(), TELEMETRY_MAXCOUNTERS);
+    for (i = 0; i < n; i++) {
+        struct perfcounter *pc = perfcounter_at(i);
+        struct telemetry_counter *c = &tm->counters[i];
+        perfcounter_read(pc, &v);
+        snprintf(c->name, sizeof(c->name), "%s", perfcounter_name(pc));
+        c->type = v.type;
+        c->count = v.count;
+        c->value = v.value;
+        c->min = v.min;
+        c->max = v.max;
+    }
+    tm->nr_counters = n;
+    InterlockedIncrement(&tm->seq);
+    
+    tm_last = now;
+    tm_frame_loading = 0;
+}
+
+static void tm_atexit()
+{
+    UnmapViewOfFile(tm);
+    CloseHandle(tm_mapping);
+}
+
+MAKE_PATCHSET(telemetry)
+{
+    if (!QueryPerformanceFrequency(&tm_freq)) {
+        warning("can't query performance frequency, telemetry disabled.");
+        return;
+    }
+    QueryPerformanceCounter(&tm_begin);
+    tm_last = tm_fps_begin = tm_begin;
+    
+    tm_mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(struct telemetry_section), TELEMETRY_NAME);
+    if (!tm_mapping) {
+        warning("can't create telemetry section '%s'.", TELEMETRY_NAME);
+        return;
+    }
+    tm = MapViewOfFile(tm_mapping, FILE_MAP_WRITE, 0, 0, sizeof(struct telemetry_section));
+    if (!tm) {
+        warning("can't map telemetry section '%s'.", TELEMETRY_NAME);
+        CloseHandle(tm_mapping);
+        return;
+    }
+    memset(tm, 0, sizeof(struct telemetry_section));
+    tm->magic = TELEMETRY_MAGIC;
+    tm->version = TELEMETRY_VERSION;
+    tm->size = sizeof(struct telemetry_section);
+    tm->pid = GetCurrentProcessId();
+    tm->gputime = tm->heap = tm->vafree = -1;
+    
+    // chain to current target, fixloading, cpkprefetch and loadtimes may have patched UpdateLoading() calls
+    UpdateLoading_next = TOPTR(get_wrapper_branch_jtarget(0x0041FA84));
+    INIT_WRAPPER_CALL(UpdateLoading_telemetry, { 0x0041FA84, 0x0041FB0A, 0x0041FC35, 0x0041FCE1, 0x0041FD19 });
+    
+    add_postpresent_hook(tm_postpresent_hook);
+    add_atexit_hook(tm_atexit);
+}
@@ -0,0 +1,452 @@
+#include "common.h"
+
+// texture memory budget
+//   we track every texture in texture resource manager, and when the
+//   estimated texture memory is over budget, textures not used for a while
+//   are evicted: their pixels are written to a swap file, and the D3D texture
+//   is replaced by a 1x1 stand-in texture
+//   IDirect3DDevice9::SetTexture() is hooked (by replacing device's vftable),
+//   so we know when a texture is used, and stand-ins are reloaded when bound
+//
+//   only managed textures can be read back, others are never evicted
+//   entries forget their gbTexture when it is destroyed (see texlife.c),
+//   textures which can't be watched are never evicted
+
+#define TEXBUDGET_SWAPFILE "PAL3patch.texswap"
+#define TEXBUDGET_SCANFRAMES 30
+#define TEXBUDGET_MINIDLE 600 // frames
+#define TEXBUDGET_MAXLEVELS 16
+#define TEXBUDGET_MAXFREE 1024
+
+struct tb_entry {
+    struct gbTexture_D3D *tex;
+    IDirect3DBaseTexture9 *ptr; // current pTex, real texture or stand-in
+    unsigned lastframe;
+    unsigned size;
+    unsigned seen;
+    int shared; // more than one gbTexture uses this D3D texture
+    int evicted;
+    int failed;
+
+    // valid if evicted
+    D3DSURFACE_DESC desc;
+    DWORD levels;
+    DWORD swapoff;
+};
+
+struct tb_extent {
+    DWORD offset;
+    DWORD size;
+};
+
+static unsigned budget;
+static unsigned frame;
+static unsigned scan_id;
+
+static struct tb_entry *entries;
+static int nr_entries, entries_cap;
+static int *slots; // hash index by ptr, stores index to entries, -1 means empty
+static unsigned slots_mask;
+static int nr_slots_used;
+
+static HANDLE hSwap = INVALID_HANDLE_VALUE;
+static DWORD swap_end;
+static struct tb_extent freelist[TEXBUDGET_MAXFREE];
+static int nr_free;
+
+static struct texbudget_stats stats;
+
+static IDirect3DDevice9Vtbl tb_vtbl;
+static HRESULT (STDMETHODCALLTYPE *SetTexture_real)(IDirect3DDevice9 *, DWORD, IDirect3DBaseTexture9 *);
+
+
+
+// pixel format helpers
+
+static int tb_levelinfo(D3DFORMAT fmt, UINT width, UINT height, unsigned *rowbytes, unsigned *rows)
+{
+    unsigned bpp = 0, blocksize = 0;
+    switch (fmt) {
+        case D3DFMT_A8R8G8B8: case D3DFMT_X8R8G8B8: bpp = 4; break;
+        case D3DFMT_R8G8B8: bpp = 3; break;
+        case D3DFMT_R5G6B5: case D3DFMT_X1R5G5B5: case D3DFMT_A1R5G5B5: case D3DFMT_A4R4G4B4: bpp = 2; break;
+        case D3DFMT_A8: case D3DFMT_L8: bpp = 1; break;
+        case D3DFMT_DXT1: blocksize = 8; break;
+        case D3DFMT_DXT2: case D3DFMT_DXT3: case D3DFMT_DXT4: case D3DFMT_DXT5: blocksize = 16; break;
+        default: return 0;
+    }
+    if (blocksize) {
+        *rowbytes = imax((width + 3) / 4, 1) * blocksize;
+        *rows = imax((height + 3) / 4, 1);
+    } else {
+        *rowbytes = width * bpp;
+        *rows = height;
+    }
+    return 1;
+}
+
+static unsigned tb_texsize(IDirect3DTexture9 *tex)
+{
+    DWORD i, levels = IDirect3DTexture9_GetLevelCount(tex);
+    unsigned size = 0, rowbytes, rows;
+    D3DSURFACE_DESC desc;
+    for (i = 0; i < levels; i++) {
+        if (FAILED(IDirect3DTexture9_GetLevelDesc(tex, i, &desc))) break;
+        if (!tb_levelinfo(desc.Format, desc.Width, desc.Height, &rowbytes, &rows)) {
+            rowbytes = desc.Width * 4; // guess
+            rows = desc.Height;
+        }
+        size += rowbytes * rows;
+    }
+    return size;
+}
+
+
+
+// swap file
+
+static DWORD swap_alloc(DWORD size)
+{
+    int i;
+    for (i = 0; i < nr_free; i++) {
+        if (freelist[i].size >= size) {
+            DWORD offset = freelist[i].offset;
+            freelist[i].offset += size;
+            freelist[i].size -= size;
+            if (!freelist[i].size) freelist[i] = freelist[--nr_free];
+            return offset;
+        }
+    }
+    DWORD offset = swap_end;
+    swap_end += size;
+    return offset;
+}
+
+static void swap_free(DWORD offset, DWORD size)
+{
+    int i;
+    if (offset + size == swap_end) {
+        swap_end = offset;
+        return;
+    }
+    for (i = 0; i < nr_free; i++) {
+        if (freelist[i].offset + freelist[i].size == offset) {
+            freelist[i].size += size;
+            return;
+        }
+        if (offset + size == freelist[i].offset) {
+            freelist[i].offset = offset;
+            freelist[i].size += size;
+            return;
+        }
+    }
+    if (nr_free < TEXBUDGET_MAXFREE) freelist[nr_free++] = (struct tb_extent) { offset, size };
+    // otherwise, the space is leaked, but still correct
+}
+
+static int swap_io(int write, DWORD offset, void *buf, DWORD size)
+{
+    DWORD nbytes;
+    if (SetFilePointer(hSwap, offset, NULL, FILE_BEGIN) == INVALID_SET_FILE_POINTER) return 0;
+    if (write) {
+        return WriteFile(hSwap, buf, size, &nbytes, NULL) && nbytes == size;
+    } else {
+        return ReadFile(hSwap, buf, size, &nbytes, NULL) && nbytes == size;
+    }
+}
+
+// copy all levels between texture and swap file
+static int swap_texture(int write, IDirect3DTexture9 *tex, DWORD levels, DWORD offset)
+{
+    DWORD i;
+    unsigned j, rowbytes, rows;
+    D3DSURFACE_DESC desc;
+    D3DLOCKED_RECT lrc;
+    for (i = 0; i < levels; i++) {
+        if (FAILED(IDirect3DTexture9_GetLevelDesc(tex, i, &desc))) return 0;
+        if (!tb_levelinfo(desc.Format, desc.Width, desc.Height, &rowbytes, &rows)) return 0;
+        if (FAILED(IDirect3DTexture9_LockRect(tex, i, &lrc, NULL, write ? D3DLOCK_READONLY : 0))) return 0;
+        int ok = 1;
+        if (lrc.Pitch == (INT) rowbytes) {
+            ok = swap_io(write, offset, lrc.pBits, rowbytes * rows);
+        } else {
+            for (j = 0; ok && j < rows; j++) {
+                ok = swap_io(write, offset + j * rowbytes, PTRADD(lrc.pBits, j * lrc.Pitch), rowbytes);
+            }
+        }
+        IDirect3DTexture9_UnlockRect(tex, i);
+        if (!ok) return 0;
+        offset += rowbytes * rows;
+    }
+    return 1;
+}
+
+
+
+// hash index
+
+static unsigned tb_hash(const void *ptr)
+{
+    return (TOUINT(ptr) >> 4) * 2654435761u;
+}
+
+static struct tb_entry *tb_find(IDirect3DBaseTexture9 *ptr)
+{
+    unsigned pos;
+    int i;
+    if (!slots) return NULL;
+    for (pos = tb_hash(ptr) & slots_mask; (i = slots[pos]) >= 0; pos = (pos + 1) & slots_mask) {
+        if (entries[i].ptr == ptr) return &entries[i];
+    }
+    return NULL;
+}
+
+static void tb_reindex(void);
+static void tb_index(int i)
+{
+    if (!slots || nr_slots_used * 4 >= (int) (slots_mask + 1) * 3) {
+        tb_reindex();
+        return;
+    }
+    unsigned pos;
+    for (pos = tb_hash(entries[i].ptr) & slots_mask; slots[pos] >= 0; pos = (pos + 1) & slots_mask);
+    slots[pos] = i;
+    nr_slots_used++;
+}
+
+static void tb_reindex(void)
+{
+    unsigned size = 256;
+    int i;
+    while (size < (unsigned) nr_entries * 4) size <<= 1;
+    if (!slots || slots_mask + 1 != size) {
+        free(slots);
+        slots = malloc(size * sizeof(int));
+        if (!slots) fail("can't allocate texture budget index.");
+        slots_mask = size - 1;
+    }
+    memset(slots, -1, size * sizeof(int));
+    nr_slots_used = 0;
+    for (i = 0; i < nr_entries; i++) tb_index(i);
+}
+
+
+
+// eviction and reloading
+
+static void tb_evict(struct tb_entry *e)
+{
+    IDirect3DDevice9 *dev = GB_GfxMgr->m_pd3dDevice;
+    IDirect3DTexture9 *tex = (IDirect3DTexture9 *) e->ptr;
+    IDirect3DTexture9 *standin = NULL;
+
+    if (FAILED(IDirect3DTexture9_GetLevelDesc(tex, 0, &e->desc))) goto fail;
+    e->levels = imin(IDirect3DTexture9_GetLevelCount(tex), TEXBUDGET_MAXLEVELS);
+    e->swapoff = swap_alloc(e->size);
+    if (!swap_texture(1, tex, e->levels, e->swapoff)) {
+        swap_free(e->swapoff, e->size);
+        goto fail;
+    }
+    if (FAILED(IDirect3DDevice9_CreateTexture(dev, 1, 1, 1, 0, e->desc.Format, D3DPOOL_MANAGED, &standin, NULL))) {
+        swap_free(e->swapoff, e->size);
+        goto fail;
+    }
+
+    // gbTexture takes the stand-in, and we keep another reference to it
+    e->tex->pTex = (IDirect3DBaseTexture9 *) standin;
+    IDirect3DTexture9_AddRef(standin);
+    IDirect3DTexture9_Release(tex);
+    e->ptr = (IDirect3DBaseTexture9 *) standin;
+    e->evicted = 1;
+    tb_index(e - entries);
+    stats.evictions++;
+    stats.resident_bytes -= e->size;
+    return;
+fail:
+    e->failed = 1;
+}
+
+static void tb_drop_standin(struct tb_entry *e)
+{
+    swap_free(e->swapoff, e->size);
+    IDirect3DBaseTexture9_Release(e->ptr);
+    e->evicted = 0;
+    e->ptr = NULL;
+}
+
+static IDirect3DBaseTexture9 *tb_reload(struct tb_entry *e)
+{
+    IDirect3DBaseTexture9 *standin = e->ptr;
+    IDirect3DTexture9 *tex = NULL;
+
+    // gbTexture is destroyed, or its D3D texture is replaced by someone else
+    if (!e->tex || e->tex->pTex != standin) return standin;
+
+    if (FAILED(IDirect3DDevice9_CreateTexture(GB_GfxMgr->m_pd3dDevice, e->desc.Width, e->desc.Height, e->levels, e->desc.Usage, e->desc.Format, D3DPOOL_MANAGED, &tex, NULL))) goto fail;
+    if (!swap_texture(0, tex, e->levels, e->swapoff)) goto fail;
+
+    e->tex->pTex = (IDirect3DBaseTexture9 *) tex;
+    IDirect3DBaseTexture9_Release(standin); // reference of gbTexture
+    tb_drop_standin(e);
+    e->ptr = (IDirect3DBaseTexture9 *) tex;
+    e->lastframe = frame;
+    tb_index(e - entries);
+    stats.misses++;
+    stats.resident_bytes += e->size;
+    return e->ptr;
+fail:
+    // keep the stand-in, texture will be blank
+    if (tex) IDirect3DTexture9_Release(tex);
+    stats.failures++;
+    e->failed = 1;
+    return standin;
+}
+
+static HRESULT STDMETHODCALLTYPE SetTexture_wrapper(IDirect3DDevice9 *This, DWORD Stage, IDirect3DBaseTexture9 *pTexture)
+{
+    if (pTexture) {
+        struct tb_entry *e = tb_find(pTexture);
+        if (e) {
+            if (!e->evicted) {
+                e->lastframe = frame;
+                stats.hits++;
+            } else if (!e->failed) {
+                pTexture = tb_reload(e);
+            }
+        }
+    }
+    return SetTexture_real(This, Stage, pTexture);
+}
+
+static void tb_hookdevice(void)
+{
+    IDirect3DDevice9 *dev = GB_GfxMgr->m_pd3dDevice;
+    if (!dev || dev->lpVtbl == &tb_vtbl) return;
+    tb_vtbl = *dev->lpVtbl;
+    SetTexture_real = tb_vtbl.SetTexture;
+    tb_vtbl.SetTexture = SetTexture_wrapper;
+    dev->lpVtbl = &tb_vtbl;
+}
+
+
+
+// periodic scan
+
+static struct tb_entry *tb_newentry(void)
+{
+    if (nr_entries >= entries_cap) {
+        entries_cap = imax(entries_cap * 2, 256);
+        entries = realloc(entries, entries_cap * sizeof(struct tb_entry));
+        if (!entries) fail("can't allocate texture budget entries.");
+    }
+    struct tb_entry *e = &entries[nr_entries++];
+    memset(e, 0, sizeof(*e));
+    return e;
+}
+
+static int tb_lrucmp(const void *a, const void *b)
+{
+    const struct tb_entry *x = *(struct tb_entry * const *) a, *y = *(struct tb_entry * const *) b;
+    return x->lastframe < y->lastframe ? -1 : x->lastframe > y->lastframe;
+}
+
+static void tb_scan(void)
+{
+    struct gbResManager *mgr = GB_GfxMgr->pTexResMgr;
+    int i, j;
+    scan_id++;
+
+    // mark textures in resource manager
+    for (i = 0; mgr && i < mgr->CurNum; i++) {
+        struct gbTexture_D3D *tex = (struct gbTexture_D3D *) mgr->pBuffer[i];
+        if (!tex || !tex->pTex || tex->pDS) continue;
+        struct tb_entry *e = tb_find(tex->pTex);
+        if (!e) {
+            e = tb_newentry();
+            e->ptr = tex->pTex;
+            e->lastframe = frame;
+            e->size = IDirect3DBaseTexture9_GetType(tex->pTex) == D3DRTYPE_TEXTURE ? tb_texsize((IDirect3DTexture9 *) tex->pTex) : 0;
+            e->failed = !e->size;
+            tb_index(e - entries);
+        } else if (e->seen == scan_id && e->tex != tex) {
+            e->shared = 1;
+        }
+        e->tex = tex;
+        e->seen = scan_id;
+        if (!e->failed && !texlife_watch((struct gbTexture *) tex)) e->failed = 1;
+    }
+
+    // drop entries not in resource manager any more
+    stats.resident_bytes = 0;
+    for (i = j = 0; i < nr_entries; i++) {
+        struct tb_entry *e = &entries[i];
+        if (e->seen != scan_id) {
+            if (e->evicted) tb_drop_standin(e);
+            continue;
+        }
+        if (!e->evicted) stats.resident_bytes += e->size;
+        entries[j++] = *e;
+    }
+    nr_entries = j;
+    tb_reindex();
+
+    // evict least recently used textures
+    if (stats.resident_bytes <= budget) return;
+    struct tb_entry **lru = malloc(imax(nr_entries, 1) * sizeof(struct tb_entry *));
+    if (!lru) return;
+    for (i = j = 0; i < nr_entries; i++) {
+        struct tb_entry *e = &entries[i];
+        if (e->evicted || e->shared || e->failed || !e->tex) continue;
+        if (frame - e->lastframe < TEXBUDGET_MINIDLE) continue;
+        D3DSURFACE_DESC desc;
+        if (FAILED(IDirect3DTexture9_GetLevelDesc((IDirect3DTexture9 *) e->ptr, 0, &desc)) || desc.Pool != D3DPOOL_MANAGED) {
+            e->failed = 1;
+            continue;
+        }
+        lru[j++] = e;
+    }
+    qsort(lru, j, sizeof(struct tb_entry *), tb_lrucmp);
+    for (i = 0; i < j && stats.resident_bytes > budget; i++) {
+        tb_evict(lru[i]);
+    }
+    free(lru);
+}
+
+static void tb_texdestroy(struct gbTexture *tex)
+{
+    // D3D texture is not released yet, find entry by it
+    struct gbTexture_D3D *d3dtex = (struct gbTexture_D3D *) tex;
+    struct tb_entry *e = d3dtex->pTex ? tb_find(d3dtex->pTex) : NULL;
+    if (e && e->tex == d3dtex) e->tex = NULL;
+}
+
+static void tb_preendscene(void)
+{
+    tb_hookdevice();
+    if (++frame % TEXBUDGET_SCANFRAMES == 0) tb_scan();
+}
+
+static void tb_cleanup(void)
+{
+    plog("texture budget: %u hit, %u miss, %u evicted, %u failed.", stats.hits, stats.misses, stats.evictions, stats.failures);
+    CloseHandle(hSwap);
+    robust_unlink(TEXBUDGET_SWAPFILE);
+}
+
+void get_texbudget_stats(struct texbudget_stats *result)
+{
+    *result = stats;
+}
+
+MAKE_PATCHSET(texbudget)
+{
+    budget = flag * 1048576u;
+    hSwap = CreateFileA(TEXBUDGET_SWAPFILE, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, NULL);
+    if (hSwap == INVALID_HANDLE_VALUE) {
+        warning("can't create texture swap file.");
+        return;
+    }
+    add_preendscene_hook(tb_preendscene);
+    add_atexit_hook(tb_cleanup);
+    add_texlife_hook(tb_texdestroy);
+}
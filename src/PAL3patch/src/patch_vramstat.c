@@ -0,0 +1,339 @@
+#include "common.h"
+
+// video memory accounting
+//   every resource created by device's Create*() methods is given a small tracker object
+//   by SetPrivateData() with D3DSPD_IUNKNOWN, Direct3D releases it when resource is destroyed,
+//   so we know live bytes of each category and pool without hooking Release() of every resource
+//   we patch the device vtable by giving it a modified copy of its vtable
+//
+//   sizes are estimated from format and size of every level, driver padding is not counted
+//   category of a texture is VRAM_TEXTURE unless creator sets another one by vramstat_set_category()
+//   render targets, depth stencils, plain surfaces and buffers are classified by type and usage
+//   backbuffer and implicit depth stencil are not created by Create*(), so they are not counted
+
+struct vramstat_tracker {
+    IUnknownVtbl *lpVtbl;
+    LONG ref;
+    unsigned bytes;
+    unsigned char category;
+    unsigned char pool;
+};
+
+struct vramstat_entry {
+    unsigned long long bytes, peak;
+    unsigned count;
+};
+
+#define VRAMSTAT_MAXPOOL 4 // D3DPOOL_DEFAULT, D3DPOOL_MANAGED, D3DPOOL_SYSTEMMEM, D3DPOOL_SCRATCH
+
+static const char *const category_names[MAX_VRAM_CATEGORY] = {
+    [VRAM_TEXTURE] = "texture",
+    [VRAM_RENDERTARGET] = "rendertarget",
+    [VRAM_GLYPH] = "glyph",
+    [VRAM_MOVIE] = "movie",
+    [VRAM_SURFACE] = "surface",
+    [VRAM_DYNBUF] = "dynbuf",
+    [VRAM_BUFFER] = "buffer",
+};
+static const char *const pool_names[VRAMSTAT_MAXPOOL] = { "default", "managed", "sysmem", "scratch" };
+
+int vramstat_enabled = 0;
+static CRITICAL_SECTION vs_cs;
+static struct vramstat_entry vs_stat[MAX_VRAM_CATEGORY][VRAMSTAT_MAXPOOL];
+static unsigned long long vs_vram, vs_vram_peak; // default and managed pool
+static int vs_category = -1;
+static DWORD vs_category_thread;
+static unsigned vs_nr_untracked;
+
+static const GUID vs_IID_IUnknown = { 0x00000000, 0x0000, 0x0000, { 0xc0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46 } };
+static const GUID vs_GUID_tracker = { 0x5a1c3e7b, 0x10d4, 0x4b8e, { 0x9f, 0x27, 0x6c, 0x3d, 0x51, 0xa2, 0x8e, 0x04 } };
+static IDirect3DDevice9ExVtbl device_vtbl; // big enough for both IDirect3DDevice9 and IDirect3DDevice9Ex
+
+static HRESULT (STDMETHODCALLTYPE *Real_CreateTexture)(IDirect3DDevice9 *, UINT, UINT, UINT, DWORD, D3DFORMAT, D3DPOOL, IDirect3DTexture9 **, HANDLE *);
+static HRESULT (STDMETHODCALLTYPE *Real_CreateVolumeTexture)(IDirect3DDevice9 *, UINT, UINT, UINT, UINT, DWORD, D3DFORMAT, D3DPOOL, IDirect3DVolumeTexture9 **, HANDLE *);
+static HRESULT (STDMETHODCALLTYPE *Real_CreateCubeTexture)(IDirect3DDevice9 *, UINT, UINT, DWORD, D3DFORMAT, D3DPOOL, IDirect3DCubeTexture9 **, HANDLE *);
+static HRESULT (STDMETHODCALLTYPE *Real_CreateVertexBuffer)(IDirect3DDevice9 *, UINT, DWORD, DWORD, D3DPOOL, IDirect3DVertexBuffer9 **, HANDLE *);
+static HRESULT (STDMETHODCALLTYPE *Real_CreateIndexBuffer)(IDirect3DDevice9 *, UINT, DWORD, D3DFORMAT, D3DPOOL, IDirect3DIndexBuffer9 **, HANDLE *);
+static HRESULT (STDMETHODCALLTYPE *Real_CreateRenderTarget)(IDirect3DDevice9 *, UINT, UINT, D3DFORMAT, D3DMULTISAMPLE_TYPE, DWORD, BOOL, IDirect3DSurface9 **, HANDLE *);
+static HRESULT (STDMETHODCALLTYPE *Real_CreateDepthStencilSurface)(IDirect3DDevice9 *, UINT, UINT, D3DFORMAT, D3DMULTISAMPLE_TYPE, DWORD, BOOL, IDirect3DSurface9 **, HANDLE *);
+static HRESULT (STDMETHODCALLTYPE *Real_CreateOffscreenPlainSurface)(IDirect3DDevice9 *, UINT, UINT, D3DFORMAT, D3DPOOL, IDirect3DSurface9 **, HANDLE *);
+
+int vramstat_set_category(int category)
+{
+    // only resources created by calling thread are affected
+    int old = vs_category;
+    vs_category = category;
+    vs_category_thread = GetCurrentThreadId();
+    return old;
+}
+
+static unsigned format_bytes(D3DFORMAT fmt, UINT w, UINT h)
+{
+    switch (fmt) {
+        case D3DFMT_DXT1:
+            return ((w + 3) / 4) * ((h + 3) / 4) * 8;
+        case D3DFMT_DXT2: case D3DFMT_DXT3: case D3DFMT_DXT4: case D3DFMT_DXT5:
+            return ((w + 3) / 4) * ((h + 3) / 4) * 16;
+        case D3DFMT_A8: case D3DFMT_L8: case D3DFMT_P8: case D3DFMT_A4L4: case D3DFMT_R3G3B2:
+            return w * h;
+        case D3DFMT_R5G6B5: case D3DFMT_X1R5G5B5: case D3DFMT_A1R5G5B5: case D3DFMT_A4R4G4B4: case D3DFMT_X4R4G4B4:
+        case D3DFMT_A8L8: case D3DFMT_V8U8: case D3DFMT_L16: case D3DFMT_D16: case D3DFMT_D16_LOCKABLE: case D3DFMT_D15S1: case D3DFMT_R16F:
+        case D3DFMT_A8R3G3B2: case D3DFMT_A8P8:
+            return w * h * 2;
+        case D3DFMT_R8G8B8:
+            return w * h * 3;
+        case D3DFMT_A16B16G16R16: case D3DFMT_A16B16G16R16F: case D3DFMT_G32R32F:
+            return w * h * 8;
+        case D3DFMT_A32B32G32R32F:
+            return w * h * 16;
+        default:
+            // most other formats, including 32-bit color and depth formats
+            return w * h * 4;
+    }
+}
+static unsigned surface_bytes(const D3DSURFACE_DESC *desc)
+{
+    unsigned samples = desc->MultiSampleType >= D3DMULTISAMPLE_2_SAMPLES ? desc->MultiSampleType : 1;
+    return format_bytes(desc->Format, desc->Width, desc->Height) * samples;
+}
+
+static void vs_account(struct vramstat_tracker *t, int sign)
+{
+    struct vramstat_entry *e = &vs_stat[t->category][t->pool];
+    EnterCriticalSection(&vs_cs);
+    if (sign > 0) {
+        e->bytes += t->bytes;
+        e->count++;
+        if (e->bytes > e->peak) e->peak = e->bytes;
+        if (t->pool <= D3DPOOL_MANAGED) {
+            vs_vram += t->bytes;
+            if (vs_vram > vs_vram_peak) vs_vram_peak = vs_vram;
+        }
+    } else {
+        e->bytes -= t->bytes;
+        e->count--;
+        if (t->pool <= D3DPOOL_MANAGED) vs_vram -= t->bytes;
+    }
+    LeaveCriticalSection(&vs_cs);
+}
+
+static HRESULT STDMETHODCALLTYPE tracker_QueryInterface(IUnknown *This, REFIID riid, void **ppvObject)
+{
+    if (memcmp(riid, &vs_IID_IUnknown, sizeof(GUID)) == 0) {
+        *ppvObject = This;
+        IUnknown_AddRef(This);
+        return S_OK;
+    }
+    *ppvObject = NULL;
+    return E_NOINTERFACE;
+}
+static ULONG STDMETHODCALLTYPE tracker_AddRef(IUnknown *This)
+{
+    return InterlockedIncrement(&((struct vramstat_tracker *) This)->ref);
+}
+static ULONG STDMETHODCALLTYPE tracker_Release(IUnknown *This)
+{
+    struct vramstat_tracker *t = (struct vramstat_tracker *) This;
+    LONG ref = InterlockedDecrement(&t->ref);
+    if (ref == 0) {
+        // resource is destroyed
+        vs_account(t, -1);
+        free(t);
+    }
+    return ref;
+}
+static IUnknownVtbl tracker_vtbl = {
+    .QueryInterface = tracker_QueryInterface,
+    .AddRef = tracker_AddRef,
+    .Release = tracker_Release,
+};
+
+static void vs_track(IDirect3DResource9 *res, int category, D3DPOOL pool, unsigned bytes)
+{
+    struct vramstat_tracker *t = malloc(sizeof(struct vramstat_tracker));
+    if (!t) return;
+    t->lpVtbl = &tracker_vtbl;
+    t->ref = 1;
+    t->bytes = bytes;
+    t->category = category;
+    t->pool = imin(pool, VRAMSTAT_MAXPOOL - 1);
+    
+    // resource holds the only reference after this
+    if (FAILED(IDirect3DResource9_SetPrivateData(res, &vs_GUID_tracker, t, sizeof(IUnknown *), D3DSPD_IUNKNOWN))) {
+        vs_nr_untracked++;
+        free(t);
+        return;
+    }
+    vs_account(t, 1);
+    IUnknown_Release((IUnknown *) t);
+}
+
+static int texture_category(DWORD Usage)
+{
+    if (Usage & (D3DUSAGE_RENDERTARGET | D3DUSAGE_DEPTHSTENCIL)) return VRAM_RENDERTARGET;
+    if (vs_category >= 0 && GetCurrentThreadId() == vs_category_thread) return vs_category;
+    return VRAM_TEXTURE;
+}
+
+static HRESULT STDMETHODCALLTYPE CreateTexture_wrapper(IDirect3DDevice9 *This, UINT Width, UINT Height, UINT Levels, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DTexture9 **ppTexture, HANDLE *pSharedHandle)
+{
+    HRESULT hr = Real_CreateTexture(This, Width, Height, Levels, Usage, Format, Pool, ppTexture, pSharedHandle);
+    if (SUCCEEDED(hr)) {
+        // real level count and pool, lower layers may change them
+        IDirect3DTexture9 *tex = *ppTexture;
+        DWORD i, n = IDirect3DTexture9_GetLevelCount(tex);
+        unsigned bytes = 0;
+        D3DSURFACE_DESC desc;
+        desc.Pool = Pool;
+        for (i = 0; i < n; i++) {
+            if (SUCCEEDED(IDirect3DTexture9_GetLevelDesc(tex, i, &desc))) bytes += surface_bytes(&desc);
+        }
+        vs_track((IDirect3DResource9 *) tex, texture_category(Usage), desc.Pool, bytes);
+    }
+    return hr;
+}
+static HRESULT STDMETHODCALLTYPE CreateVolumeTexture_wrapper(IDirect3DDevice9 *This, UINT Width, UINT Height, UINT Depth, UINT Levels, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DVolumeTexture9 **ppVolumeTexture, HANDLE *pSharedHandle)
+{
+    HRESULT hr = Real_CreateVolumeTexture(This, Width, Height, Depth, Levels, Usage, Format, Pool, ppVolumeTexture, pSharedHandle);
+    if (SUCCEEDED(hr)) {
+        IDirect3DVolumeTexture9 *tex = *ppVolumeTexture;
+        DWORD i, n = IDirect3DVolumeTexture9_GetLevelCount(tex);
+        unsigned bytes = 0;
+        D3DVOLUME_DESC desc;
+        desc.Pool = Pool;
+        for (i = 0; i < n; i++) {
+            if (SUCCEEDED(IDirect3DVolumeTexture9_GetLevelDesc(tex, i, &desc))) bytes += format_bytes(desc.Format, desc.Width, desc.Height) * desc.Depth;
+        }
+        vs_track((IDirect3DResource9 *) tex, texture_category(Usage), desc.Pool, bytes);
+    }
+    return hr;
+}
+static HRESULT STDMETHODCALLTYPE CreateCubeTexture_wrapper(IDirect3DDevice9 *This, UINT EdgeLength, UINT Levels, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DCubeTexture9 **ppCubeTexture, HANDLE *pSharedHandle)
+{
+    HRESULT hr = Real_CreateCubeTexture(This, EdgeLength, Levels, Usage, Format, Pool, ppCubeTexture, pSharedHandle);
+    if (SUCCEEDED(hr)) {
+        IDirect3DCubeTexture9 *tex = *ppCubeTexture;
+        DWORD i, n = IDirect3DCubeTexture9_GetLevelCount(tex);
+        unsigned bytes = 0;
+        D3DSURFACE_DESC desc;
+        desc.Pool = Pool;
+        for (i = 0; i < n; i++) {
+            if (SUCCEEDED(IDirect3DCubeTexture9_GetLevelDesc(tex, i, &desc))) bytes += surface_bytes(&desc) * 6;
+        }
+        vs_track((IDirect3DResource9 *) tex, texture_category(Usage), desc.Pool, bytes);
+    }
+    return hr;
+}
+static HRESULT STDMETHODCALLTYPE CreateVertexBuffer_wrapper(IDirect3DDevice9 *This, UINT Length, DWORD Usage, DWORD FVF, D3DPOOL Pool, IDirect3DVertexBuffer9 **ppVertexBuffer, HANDLE *pSharedHandle)
+{
+    HRESULT hr = Real_CreateVertexBuffer(This, Length, Usage, FVF, Pool, ppVertexBuffer, pSharedHandle);
+    if (SUCCEEDED(hr)) {
+        D3DVERTEXBUFFER_DESC desc;
+        if (FAILED(IDirect3DVertexBuffer9_GetDesc(*ppVertexBuffer, &desc))) desc.Pool = Pool, desc.Usage = Usage;
+        vs_track((IDirect3DResource9 *) *ppVertexBuffer, (desc.Usage & D3DUSAGE_DYNAMIC) ? VRAM_DYNBUF : VRAM_BUFFER, desc.Pool, Length);
+    }
+    return hr;
+}
+static HRESULT STDMETHODCALLTYPE CreateIndexBuffer_wrapper(IDirect3DDevice9 *This, UINT Length, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DIndexBuffer9 **ppIndexBuffer, HANDLE *pSharedHandle)
+{
+    HRESULT hr = Real_CreateIndexBuffer(This, Length, Usage, Format, Pool, ppIndexBuffer, pSharedHandle);
+    if (SUCCEEDED(hr)) {
+        D3DINDEXBUFFER_DESC desc;
+        if (FAILED(IDirect3DIndexBuffer9_GetDesc(*ppIndexBuffer, &desc))) desc.Pool = Pool, desc.Usage = Usage;
+        vs_track((IDirect3DResource9 *) *ppIndexBuffer, (desc.Usage & D3DUSAGE_DYNAMIC) ? VRAM_DYNBUF : VRAM_BUFFER, desc.Pool, Length);
+    }
+    return hr;
+}
+static void vs_track_surface(IDirect3DSurface9 *surface, int category)
+{
+    D3DSURFACE_DESC desc;
+    if (SUCCEEDED(IDirect3DSurface9_GetDesc(surface, &desc))) {
+        vs_track((IDirect3DResource9 *) surface, category, desc.Pool, surface_bytes(&desc));
+    }
+}
+static HRESULT STDMETHODCALLTYPE CreateRenderTarget_wrapper(IDirect3DDevice9 *This, UINT Width, UINT Height, D3DFORMAT Format, D3DMULTISAMPLE_TYPE MultiSample, DWORD MultisampleQuality, BOOL Lockable, IDirect3DSurface9 **ppSurface, HANDLE *pSharedHandle)
+{
+    HRESULT hr = Real_CreateRenderTarget(This, Width, Height, Format, MultiSample, MultisampleQuality, Lockable, ppSurface, pSharedHandle);
+    if (SUCCEEDED(hr)) vs_track_surface(*ppSurface, VRAM_RENDERTARGET);
+    return hr;
+}
+static HRESULT STDMETHODCALLTYPE CreateDepthStencilSurface_wrapper(IDirect3DDevice9 *This, UINT Width, UINT Height, D3DFORMAT Format, D3DMULTISAMPLE_TYPE MultiSample, DWORD MultisampleQuality, BOOL Discard, IDirect3DSurface9 **ppSurface, HANDLE *pSharedHandle)
+{
+    HRESULT hr = Real_CreateDepthStencilSurface(This, Width, Height, Format, MultiSample, MultisampleQuality, Discard, ppSurface, pSharedHandle);
+    if (SUCCEEDED(hr)) vs_track_surface(*ppSurface, VRAM_RENDERTARGET);
+    return hr;
+}
+static HRESULT STDMETHODCALLTYPE CreateOffscreenPlainSurface_wrapper(IDirect3DDevice9 *This, UINT Width, UINT Height, D3DFORMAT Format, D3DPOOL Pool, IDirect3DSurface9 **ppSurface, HANDLE *pSharedHandle)
+{
+    HRESULT hr = Real_CreateOffscreenPlainSurface(This, Width, Height, Format, Pool, ppSurface, pSharedHandle);
+    if (SUCCEEDED(hr)) vs_track_surface(*ppSurface, VRAM_SURFACE);
+    return hr;
+}
+
+static void hook_device()
+{
+    IDirect3DDevice9 *dev = GB_GfxMgr->m_pd3dDevice;
+    IDirect3DDevice9Vtbl *vtbl = (IDirect3DDevice9Vtbl *) &device_vtbl;
+    
+    if (!dev || dev->lpVtbl == vtbl) return;
+    
+    patch_device_vtable(dev, &device_vtbl);
+    
+    Real_CreateTexture = vtbl->CreateTexture;
+    Real_CreateVolumeTexture = vtbl->CreateVolumeTexture;
+    Real_CreateCubeTexture = vtbl->CreateCubeTexture;
+    Real_CreateVertexBuffer = vtbl->CreateVertexBuffer;
+    Real_CreateIndexBuffer = vtbl->CreateIndexBuffer;
+    Real_CreateRenderTarget = vtbl->CreateRenderTarget;
+    Real_CreateDepthStencilSurface = vtbl->CreateDepthStencilSurface;
+    Real_CreateOffscreenPlainSurface = vtbl->CreateOffscreenPlainSurface;
+    vtbl->CreateTexture = CreateTexture_wrapper;
+    vtbl->CreateVolumeTexture = CreateVolumeTexture_wrapper;
+    vtbl->CreateCubeTexture = CreateCubeTexture_wrapper;
+    vtbl->CreateVertexBuffer = CreateVertexBuffer_wrapper;
+    vtbl->CreateIndexBuffer = CreateIndexBuffer_wrapper;
+    vtbl->CreateRenderTarget = CreateRenderTarget_wrapper;
+    vtbl->CreateDepthStencilSurface = CreateDepthStencilSurface_wrapper;
+    vtbl->CreateOffscreenPlainSurface = CreateOffscreenPlainSurface_wrapper;
+    dev->lpVtbl = vtbl;
+}
+
+void get_vramstat_text(char *buf, int size)
+{
+    // overlay lines for showfps
+    char *ptr = buf;
+    int i;
+    *buf = '\0';
+    if (!vramstat_enabled || !GB_GfxMgr || !GB_GfxMgr->m_pd3dDevice) return;
+    EnterCriticalSection(&vs_cs);
+    snprintf(ptr, buf + size - ptr, "VRAM = %.1fMB (peak %.1fMB, available %uMB)\n", vs_vram / 1048576.0, vs_vram_peak / 1048576.0, IDirect3DDevice9_GetAvailableTextureMem(GB_GfxMgr->m_pd3dDevice) / 1048576);
+    ptr += strlen(ptr);
+    for (i = 0; i < MAX_VRAM_CATEGORY; i++) {
+        struct vramstat_entry *d = &vs_stat[i][D3DPOOL_DEFAULT], *m = &vs_stat[i][D3DPOOL_MANAGED];
+        if (!d->count && !m->count) continue;
+        snprintf(ptr, buf + size - ptr, " %-12s %8.1fMB (%u default, %u managed)\n", category_names[i], (d->bytes + m->bytes) / 1048576.0, d->count, m->count);
+        ptr += strlen(ptr);
+    }
+    LeaveCriticalSection(&vs_cs);
+}
+
+static void vs_report()
+{
+    int i, j;
+    plog("vramstat: %.1fMB in default and managed pools at exit, peak %.1fMB, %u resources not tracked.", vs_vram / 1048576.0, vs_vram_peak / 1048576.0, vs_nr_untracked);
+    for (i = 0; i < MAX_VRAM_CATEGORY; i++) {
+        for (j = 0; j < VRAMSTAT_MAXPOOL; j++) {
+            struct vramstat_entry *e = &vs_stat[i][j];
+            if (!e->peak) continue;
+            plog("  %-12s %-7s %8.1fMB now, %8.1fMB peak, %u resources.", category_names[i], pool_names[j], e->bytes / 1048576.0, e->peak / 1048576.0, e->count);
+        }
+    }
+}
+
+MAKE_PATCHSET(vramstat)
+{
+    vramstat_enabled = 1;
+    InitializeCriticalSection(&vs_cs);
+    add_postd3dcreate_hook(hook_device);
+    add_atexit_hook(vs_report);
+}
@@ -0,0 +1,347 @@
+#include "common.h"
+#include <emmintrin.h>
+
+#ifndef PF_XMMI64_INSTRUCTIONS_AVAILABLE
+#define PF_XMMI64_INSTRUCTIONS_AVAILABLE 10
+#endif
+
+static int has_sse2;
+
+int pixel_has_sse2(void)
+{
+    return has_sse2;
+}
+
+
+
+// scalar versions
+
+static void premultiply_scalar(unsigned char *p, int count)
+{
+    int i, k;
+    for (i = 0; i < count; i++, p += 4) {
+        unsigned a = p[3];
+        for (k = 0; k < 3; k++) {
+            unsigned x = p[k] * a + 128;
+            p[k] = (x + (x >> 8)) >> 8;
+        }
+    }
+}
+
+static void unpremultiply_scalar(unsigned char *p, int count)
+{
+    int i, k;
+    for (i = 0; i < count; i++, p += 4) {
+        unsigned a = p[3];
+        if (!a) continue;
+        for (k = 0; k < 3; k++) {
+            p[k] = imin((p[k] * 255 + a / 2) / a, 255);
+        }
+    }
+}
+
+
+
+// SSE2 versions
+
+static SSE2_FUNC void premultiply_sse2(unsigned char *p, int count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(128);
+    const __m128i amask = _mm_set_epi16(0xFF, 0, 0, 0, 0xFF, 0, 0, 0); // keep alpha
+    const __m128i cmask = _mm_set_epi16(0, 0xFF, 0xFF, 0xFF, 0, 0xFF, 0xFF, 0xFF);
+    int i;
+    for (i = 0; i + 4 <= count; i += 4, p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        __m128i alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xFF), 0xFF);
+        __m128i ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xFF), 0xFF);
+        __m128i xlo = _mm_add_epi16(_mm_mullo_epi16(lo, alo), round);
+        __m128i xhi = _mm_add_epi16(_mm_mullo_epi16(hi, ahi), round);
+        xlo = _mm_srli_epi16(_mm_add_epi16(xlo, _mm_srli_epi16(xlo, 8)), 8);
+        xhi = _mm_srli_epi16(_mm_add_epi16(xhi, _mm_srli_epi16(xhi, 8)), 8);
+        xlo = _mm_or_si128(_mm_and_si128(xlo, cmask), _mm_and_si128(lo, amask));
+        xhi = _mm_or_si128(_mm_and_si128(xhi, cmask), _mm_and_si128(hi, amask));
+        _mm_storeu_si128((__m128i *) p, _mm_packus_epi16(xlo, xhi));
+    }
+    premultiply_scalar(p, count - i);
+}
+
+static SSE2_FUNC void unpremultiply_sse2(unsigned char *p, int count)
+{
+    // (c * 255 + a / 2) / a is never close enough to an integer to be
+    // rounded by float division, so truncating the float result is exact
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i amask = _mm_set1_epi32(0xFF000000);
+    const __m128 f255 = _mm_set1_ps(255.0f);
+    int i, k;
+    for (i = 0; i + 4 <= count; i += 4, p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) p);
+        __m128i zeroa = _mm_cmpeq_epi32(_mm_and_si128(v, amask), zero); // all 1s if alpha == 0
+        if (_mm_movemask_epi8(zeroa) == 0xFFFF) continue;
+        __m128 a = _mm_cvtepi32_ps(_mm_srli_epi32(v, 24));
+        __m128 ahalf = _mm_cvtepi32_ps(_mm_srli_epi32(v, 25));
+        __m128 adiv = _mm_or_ps(a, _mm_and_ps(_mm_castsi128_ps(zeroa), _mm_set1_ps(1.0f))); // avoid divide by zero
+        __m128i r = _mm_and_si128(v, amask);
+        for (k = 0; k < 3; k++) {
+            __m128 c = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(v, k * 8), _mm_set1_epi32(0xFF)));
+            __m128 q = _mm_div_ps(_mm_add_ps(_mm_mul_ps(c, f255), ahalf), adiv);
+            __m128i x = _mm_cvttps_epi32(_mm_min_ps(q, f255));
+            r = _mm_or_si128(r, _mm_slli_epi32(x, k * 8));
+        }
+        // keep pixels with alpha == 0
+        r = _mm_or_si128(_mm_and_si128(zeroa, v), _mm_andnot_si128(zeroa, r));
+        _mm_storeu_si128((__m128i *) p, r);
+    }
+    unpremultiply_scalar(p, count - i);
+}
+
+// DXT block compression
+//   endpoints are bounding box of block colors, inset by 1/16 of its size,
+//   alpha endpoints are exact minimum and maximum, so alpha-tested edges are kept
+//   each pixel picks the nearest palette entry, by sum of absolute channel differences
+
+static void dxt_fetch_block(unsigned *block, const unsigned char *src, int width, int height, int bitcount, int bx, int by)
+{
+    int x, y;
+    for (y = 0; y < 4; y++) {
+        int sy = imin(by * 4 + y, height - 1);
+        for (x = 0; x < 4; x++) {
+            int sx = imin(bx * 4 + x, width - 1);
+            const unsigned char *p = src + (sy * width + sx) * (bitcount / 8);
+            block[y * 4 + x] = p[0] | (p[1] << 8) | (p[2] << 16) | (bitcount == 32 ? (unsigned) p[3] << 24 : 0xFF000000);
+        }
+    }
+}
+
+static unsigned dxt_to565(unsigned c)
+{
+    unsigned r = (c >> 16) & 0xFF, g = (c >> 8) & 0xFF, b = c & 0xFF;
+    return ((r * 31 + 127) / 255) << 11 | ((g * 63 + 127) / 255) << 5 | (b * 31 + 127) / 255;
+}
+
+static unsigned dxt_from565(unsigned c)
+{
+    unsigned r = (c >> 11) & 0x1F, g = (c >> 5) & 0x3F, b = c & 0x1F;
+    return ((r << 3) | (r >> 2)) << 16 | ((g << 2) | (g >> 4)) << 8 | ((b << 3) | (b >> 2));
+}
+
+// make endpoints and palette from bounding box, returns endpoints as c0 | c1 << 16
+static unsigned dxt_endpoints(unsigned mn, unsigned mx, unsigned *pal)
+{
+    unsigned lo = 0, hi = 0;
+    int k;
+    for (k = 0; k < 24; k += 8) {
+        unsigned a = (mn >> k) & 0xFF, b = (mx >> k) & 0xFF;
+        unsigned inset = (b - a) >> 4;
+        lo |= (a + inset) << k;
+        hi |= (b - inset) << k;
+    }
+    unsigned c0 = dxt_to565(hi), c1 = dxt_to565(lo);
+    pal[0] = dxt_from565(c0);
+    pal[1] = dxt_from565(c1);
+    pal[2] = pal[3] = 0;
+    for (k = 0; k < 24; k += 8) {
+        unsigned a = (pal[0] >> k) & 0xFF, b = (pal[1] >> k) & 0xFF;
+        pal[2] |= ((a * 2 + b) / 3) << k;
+        pal[3] |= ((a + b * 2) / 3) << k;
+    }
+    return c0 | c1 << 16;
+}
+
+static void dxt_put_color(unsigned char *out, unsigned endpoints, unsigned indices)
+{
+    // if c0 == c1, block is in 3-color mode, but index 0 is still c0
+    if ((endpoints & 0xFFFF) == endpoints >> 16) indices = 0;
+    memcpy(out, &endpoints, 4);
+    memcpy(out + 4, &indices, 4);
+}
+
+static void dxt_alpha_block(unsigned char *out, const unsigned *block)
+{
+    unsigned a0 = 0, a1 = 255, pal[8];
+    int i, k;
+    for (i = 0; i < 16; i++) {
+        a0 = imax(a0, block[i] >> 24);
+        a1 = imin(a1, block[i] >> 24);
+    }
+    // a0 > a1 selects 8-value mode, if equal index 0 is a0 in either mode
+    pal[0] = a0;
+    pal[1] = a1;
+    for (k = 2; k < 8; k++) pal[k] = ((8 - k) * a0 + (k - 1) * a1) / 7;
+
+    unsigned long long bits = 0;
+    for (i = 0; i < 16 && a0 != a1; i++) {
+        int a = block[i] >> 24, best = 0, bestd = 256;
+        for (k = 0; k < 8; k++) {
+            int d = abs(a - (int) pal[k]);
+            if (d < bestd) {
+                bestd = d;
+                best = k;
+            }
+        }
+        bits |= (unsigned long long) best << (i * 3);
+    }
+    out[0] = a0;
+    out[1] = a1;
+    for (i = 0; i < 6; i++) out[2 + i] = bits >> (i * 8);
+}
+
+static void dxt_color_scalar(unsigned char *out, const unsigned *block)
+{
+    unsigned mn = 0xFFFFFF, mx = 0, pal[4], indices = 0;
+    int i, k;
+    for (k = 0; k < 24; k += 8) {
+        unsigned a = 255, b = 0;
+        for (i = 0; i < 16; i++) {
+            unsigned c = (block[i] >> k) & 0xFF;
+            a = imin(a, c);
+            b = imax(b, c);
+        }
+        mn = (mn & ~(0xFFu << k)) | a << k;
+        mx = (mx & ~(0xFFu << k)) | b << k;
+    }
+    unsigned endpoints = dxt_endpoints(mn, mx, pal);
+    for (i = 0; i < 16; i++) {
+        int best = 0, bestd = INT_MAX;
+        for (k = 0; k < 4; k++) {
+            int d = abs((int) (block[i] & 0xFF) - (int) (pal[k] & 0xFF))
+                  + abs((int) ((block[i] >> 8) & 0xFF) - (int) ((pal[k] >> 8) & 0xFF))
+                  + abs((int) ((block[i] >> 16) & 0xFF) - (int) ((pal[k] >> 16) & 0xFF));
+            if (d < bestd) {
+                bestd = d;
+                best = k;
+            }
+        }
+        indices |= best << (i * 2);
+    }
+    dxt_put_color(out, endpoints, indices);
+}
+
+static SSE2_FUNC void dxt_color_sse2(unsigned char *out, const unsigned *block)
+{
+    const __m128i cmask = _mm_set1_epi32(0x00FFFFFF);
+    const __m128i bmask = _mm_set1_epi32(0xFF);
+    __m128i row[4], pal[4];
+    unsigned p[4];
+    int i, k;
+
+    // bounding box, alpha is ignored
+    __m128i mn = _mm_set1_epi32(-1), mx = _mm_setzero_si128();
+    for (i = 0; i < 4; i++) {
+        row[i] = _mm_loadu_si128((const __m128i *) (block + i * 4));
+        mn = _mm_min_epu8(mn, row[i]);
+        mx = _mm_max_epu8(mx, row[i]);
+    }
+    mn = _mm_min_epu8(mn, _mm_shuffle_epi32(mn, 0x4E));
+    mn = _mm_min_epu8(mn, _mm_shuffle_epi32(mn, 0xB1));
+    mx = _mm_max_epu8(mx, _mm_shuffle_epi32(mx, 0x4E));
+    mx = _mm_max_epu8(mx, _mm_shuffle_epi32(mx, 0xB1));
+    unsigned endpoints = dxt_endpoints(_mm_cvtsi128_si32(mn) & 0xFFFFFF, _mm_cvtsi128_si32(mx) & 0xFFFFFF, p);
+    for (k = 0; k < 4; k++) pal[k] = _mm_set1_epi32(p[k]);
+
+    // nearest palette entry, 4 pixels at a time
+    unsigned indices = 0;
+    for (i = 0; i < 4; i++) {
+        __m128i best = _mm_set1_epi32(INT_MAX), idx = _mm_setzero_si128();
+        for (k = 0; k < 4; k++) {
+            __m128i ad = _mm_and_si128(_mm_or_si128(_mm_subs_epu8(row[i], pal[k]), _mm_subs_epu8(pal[k], row[i])), cmask);
+            __m128i d = _mm_add_epi32(_mm_add_epi32(_mm_and_si128(ad, bmask), _mm_and_si128(_mm_srli_epi32(ad, 8), bmask)), _mm_srli_epi32(ad, 16));
+            __m128i lt = _mm_cmplt_epi32(d, best);
+            best = _mm_or_si128(_mm_and_si128(lt, d), _mm_andnot_si128(lt, best));
+            idx = _mm_or_si128(_mm_and_si128(lt, _mm_set1_epi32(k)), _mm_andnot_si128(lt, idx));
+        }
+        unsigned lane[4];
+        _mm_storeu_si128((__m128i *) lane, idx);
+        indices |= (lane[0] | lane[1] << 2 | lane[2] << 4 | lane[3] << 6) << (i * 8);
+    }
+    dxt_put_color(out, endpoints, indices);
+}
+
+
+
+// kernels without SIMD versions
+
+void pixel_r8g8b8_to_a8r8g8b8(void *dst, const void *src, int count)
+{
+    // convert 4 pixels (3 DWORDs) at a time
+    const unsigned char *s = src;
+    unsigned *d = dst;
+    int i;
+    for (i = 0; i + 4 <= count; i += 4, s += 12, d += 4) {
+        unsigned w0, w1, w2;
+        memcpy(&w0, s, 4);
+        memcpy(&w1, s + 4, 4);
+        memcpy(&w2, s + 8, 4);
+        d[0] = w0 | 0xFF000000;
+        d[1] = (w0 >> 24) | (w1 << 8) | 0xFF000000;
+        d[2] = (w1 >> 16) | (w2 << 16) | 0xFF000000;
+        d[3] = (w2 >> 8) | 0xFF000000;
+    }
+    for (; i < count; i++, s += 3, d++) {
+        *d = s[0] | (s[1] << 8) | (s[2] << 16) | 0xFF000000;
+    }
+}
+
+void pixel_scale_gray(unsigned char *dst, const unsigned char *src, int count, int num_grays)
+{
+    // usually num_grays is 256, which is a plain copy
+    if (num_grays == 256) {
+        memcpy(dst, src, count);
+        return;
+    }
+    int i;
+    for (i = 0; i < count; i++) dst[i] = src[i] * 255 / (num_grays - 1);
+}
+
+
+
+int pixel_is_opaque(const void *bits, int count)
+{
+    const unsigned *p = bits;
+    int i;
+    for (i = 0; i < count; i++) {
+        if ((p[i] >> 24) != 0xFF) return 0;
+    }
+    return 1;
+}
+
+unsigned pixel_dxt_size(int width, int height, int dxt5)
+{
+    return ((width + 3) / 4) * ((height + 3) / 4) * (dxt5 ? 16 : 8);
+}
+
+void pixel_compress_dxt(void *dst, const void *src, int width, int height, int bitcount, int dxt5)
+{
+    unsigned block[16];
+    unsigned char *out = dst;
+    int bx, by;
+    for (by = 0; by < (height + 3) / 4; by++) {
+        for (bx = 0; bx < (width + 3) / 4; bx++) {
+            dxt_fetch_block(block, src, width, height, bitcount, bx, by);
+            if (dxt5) {
+                dxt_alpha_block(out, block);
+                out += 8;
+            }
+            if (has_sse2) dxt_color_sse2(out, block); else dxt_color_scalar(out, block);
+            out += 8;
+        }
+    }
+}
+
+void pixel_premultiply_alpha(void *bits, int count)
+{
+    if (has_sse2) premultiply_sse2(bits, count); else premultiply_scalar(bits, count);
+}
+
+void pixel_unpremultiply_alpha(void *bits, int count)
+{
+    if (has_sse2) unpremultiply_sse2(bits, count); else unpremultiply_scalar(bits, count);
+}
+
+void init_pixel_kernels(void)
+{
+    // win9x doesn't report SSE2, so scalar versions are always used there
+    has_sse2 = !!IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE);
+}
@@ -43,6 +43,10 @@ int version_string_compare(const char *a, const char *b)
 
 int plugin_log_indent = 0;
 
+// plugin prepare steps may write log concurrently
+static CRITICAL_SECTION plugin_log_cs;
+static int plugin_log_cs_ready = 0;
+
 static void make_plugin_log_header()
 {
     static int flag = 0;
@@ -63,6 +67,7 @@ static void make_plugin_log_header()
 
 static void write_plugin_log(const char *module, int indent, const char *message)
 {
+    if (plugin_log_cs_ready) EnterCriticalSection(&plugin_log_cs);
     make_plugin_log_header();
     
     int real_indent = (indent % MAX_PLUGIN_LOG_INDENT + MAX_PLUGIN_LOG_INDENT) % MAX_PLUGIN_LOG_INDENT;
@@ -91,6 +96,7 @@ static void write_plugin_log(const char *module, int indent, const char *message
         
         fclose(fp);
     }
+    if (plugin_log_cs_ready) LeaveCriticalSection(&plugin_log_cs);
 }
 
 static wchar_t *msgbox_buf = NULL;
@@ -176,6 +182,167 @@ static struct plugin_desc *plugin_list_head = NULL;
 
 static struct wstr plugin_report_body;
 
+
+// parallel prepare steps
+//   search_plugins() loads all plugin DLLs in directory first,
+//   runs their prepare steps on a worker pool,
+//   then registers plugins and calls their entries in order
+
+#define PLUGIN_PREPARE_MAXTHREADS 8
+
+struct plugin_prepare_job {
+    char *filename;
+    HMODULE handle; // extra reference, released after registration
+    DECL_PLUGINPREPARE(*prepare);
+    int result;
+};
+
+struct plugin_prepare_batch {
+    struct plugin_prepare_job *jobs;
+    int n;
+    volatile LONG next;
+};
+
+static struct plugin_prepare_batch *cur_prepare_batch = NULL;
+
+static DWORD WINAPI plugin_prepare_worker(LPVOID lpParameter)
+{
+    struct plugin_prepare_batch *batch = lpParameter;
+    LONG i;
+    while ((i = InterlockedIncrement(&batch->next) - 1) < batch->n) {
+        struct plugin_prepare_job *job = &batch->jobs[i];
+        if (job->prepare) job->result = job->prepare();
+    }
+    return 0;
+}
+
+static void run_plugin_prepare_batch(struct plugin_prepare_batch *batch)
+{
+    HANDLE hThreads[PLUGIN_PREPARE_MAXTHREADS];
+    int nr_threads = 0;
+    int nr_workers = 0;
+    int i;
+    SYSTEM_INFO si;
+    
+    for (i = 0; i < batch->n; i++) {
+        if (batch->jobs[i].prepare) nr_workers++;
+    }
+    if (nr_workers == 0) return;
+    
+    GetSystemInfo(&si);
+    nr_workers = imin(nr_workers, imin(si.dwNumberOfProcessors, PLUGIN_PREPARE_MAXTHREADS));
+    pplog("running prepare procedures with %d thread%s ...", nr_workers, nr_workers > 1 ? "s" : "");
+    
+    // current thread is also a worker
+    batch->next = 0;
+    for (i = 1; i < nr_workers; i++) {
+        HANDLE hThread = CreateThread(NULL, 0, plugin_prepare_worker, batch, 0, NULL);
+        if (!hThread) break;
+        hThreads[nr_threads++] = hThread;
+    }
+    plugin_prepare_worker(batch);
+    if (nr_threads) WaitForMultipleObjects(nr_threads, hThreads, TRUE, INFINITE);
+    for (i = 0; i < nr_threads; i++) CloseHandle(hThreads[i]);
+}
+
+static struct plugin_prepare_job *find_plugin_prepare_job(HMODULE hModule)
+{
+    int i;
+    if (!cur_prepare_batch) return NULL;
+    for (i = 0; i < cur_prepare_batch->n; i++) {
+        if (cur_prepare_batch->jobs[i].handle == hModule) return &cur_prepare_batch->jobs[i];
+    }
+    return NULL;
+}
+
+// plugin manifest
+//   the startup walk of search_plugins("plugins") is recorded as a flat list of
+//   resolved directives, together with the directories searched (checked by mtime)
+//   and the plugin list files read (checked by size and mtime)
+//   on next startup, if none of them changed, the list is replayed without walking
+//   directives issued by plugins themselves are not recorded,
+//   since they will be issued again when the plugin is initialized
+//
+//   file layout:
+//     struct plugin_manifest_hdr
+//     { struct plugin_manifest_rec, NUL-terminated strings } [...]
+//     sha1 of all records
+
+#define PLUGIN_MANIFEST_FILE "PAL3patch.plugin_manifest"
+#define PLUGIN_MANIFEST_MAGIC 0x464E4D50 // "PMNF"
+#define PLUGIN_MANIFEST_VERSION 1
+#define PLUGIN_MANIFEST_MAXSIZE (4 << 20)
+
+enum {
+    MANIFEST_DIR,        // directory searched
+    MANIFEST_FILE,       // plugin list file read
+    MANIFEST_DIRECTIVE,  // DLL/DLL2/LIB/LIB2 directive and its resolved parameter
+    MANIFEST_LAZY,       // lazy condition, directive and resolved parameter
+    MANIFEST_BATCH,      // begin of DLLs found in directory
+    MANIFEST_BATCH_DLL,  // DLL found in directory
+    MANIFEST_TYPE_COUNT // EOF
+};
+
+static const int manifest_nstr[MANIFEST_TYPE_COUNT] = { 1, 1, 2, 3, 1, 1 };
+
+struct plugin_manifest_hdr {
+    unsigned magic;
+    unsigned version;
+    unsigned patch_version;
+    unsigned size; // bytes of all records
+};
+
+struct plugin_manifest_rec {
+    int type;
+    unsigned len; // bytes of strings
+    DWORD size_lo, size_hi;
+    FILETIME mtime;
+};
+
+static int manifest_recording = 0;
+static int manifest_broken = 0;
+static int plugin_entry_depth = 0;
+static struct bvec manifest_buf;
+
+static int get_manifest_attr(const char *path, struct plugin_manifest_rec *rec)
+{
+    wchar_t *wpath_managed = NULL;
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    int ret = !!GetFileAttributesExW(cs2wcs_managed(path, CP_UTF8, &wpath_managed), GetFileExInfoStandard, &attr);
+    free(wpath_managed);
+    if (ret) {
+        rec->size_lo = attr.nFileSizeLow;
+        rec->size_hi = attr.nFileSizeHigh;
+        rec->mtime = attr.ftLastWriteTime;
+    }
+    return ret;
+}
+
+static void manifest_record(int type, const char *s1, const char *s2, const char *s3)
+{
+    const char *s[3] = { s1, s2, s3 };
+    struct plugin_manifest_rec rec;
+    int i;
+    
+    if (!manifest_recording || manifest_broken || plugin_entry_depth > 0) return;
+    
+    memset(&rec, 0, sizeof(rec));
+    rec.type = type;
+    if (type == MANIFEST_DIR || type == MANIFEST_FILE) {
+        if (!get_manifest_attr(s1, &rec)) {
+            manifest_broken = 1;
+            return;
+        }
+    }
+    for (i = 0; i < manifest_nstr[type]; i++) {
+        rec.len += strlen(s[i]) + 1;
+    }
+    bvec_tpushback(&manifest_buf, &rec, struct plugin_manifest_rec);
+    for (i = 0; i < manifest_nstr[type]; i++) {
+        bvec_bpush(&manifest_buf, s[i], strlen(s[i]) + 1);
+    }
+}
+
 // check if plugin already loaded, O(n)
 static int check_register_plugin(struct plugin_desc *newplugin)
 {
@@ -211,13 +378,16 @@ static void load_plugin_dll_with_mode(const char *filename, int mode, int type)
     struct plugin_desc *newplugin = NULL;
     HMODULE hModule = NULL;
     DECL_PLUGINENTRY(*entry);
+    DECL_PLUGINPREPARE(*prepare);
+    struct plugin_prepare_job *job;
     int r;
     int success = 0;
-    struct wstr errmsg, line, namepart;
-    wstr_ctor(&errmsg);
-    wstr_ctor(&line);
-    wstr_ctor(&namepart);
+    struct swstr errmsg, line, namepart;
+    swstr_ctor(&errmsg);
+    swstr_ctor(&line);
+    swstr_ctor(&namepart);
     
+    startup_begin("%s %s", type == 0 ? "plugin" : "library", get_filepart(filename));
     dwFlags = mode ? LOAD_WITH_ALTERED_SEARCH_PATH : 0;
     
     newplugin = malloc(sizeof(struct plugin_desc));
@@ -230,7 +400,7 @@ static void load_plugin_dll_with_mode(const char *filename, int mode, int type)
     if (!hModule) {
         pplog("error: LoadLibraryEx() failed.");
         try_goto_desktop();
-        wstr_wcscpy(&errmsg, wstr_pluginerr_loadfailed);
+        swstr_wcscpy(&errmsg, wstr_pluginerr_loadfailed);
         goto fail;
     }
 
@@ -245,7 +415,7 @@ static void load_plugin_dll_with_mode(const char *filename, int mode, int type)
         if (!entry) {
             pplog("error: GetProcAddress() failed.");
             try_goto_desktop();
-            wstr_wcscpy(&errmsg, wstr_pluginerr_noentry);
+            swstr_wcscpy(&errmsg, wstr_pluginerr_noentry);
             goto fail;
         }
 
@@ -267,14 +437,38 @@ static void load_plugin_dll_with_mode(const char *filename, int mode, int type)
         if (newplugin->builton)  pplog("plugin built on      : %s", newplugin->builton);
         if (newplugin->compiler) pplog("plugin compiler      : %s", newplugin->compiler);
 
+        prepare = TOPTR(GetProcAddress(hModule, TOSTR(PLUGINSYMBOL_PREPARE)));
+        if (prepare) {
+            job = find_plugin_prepare_job(hModule);
+            if (job && job->prepare) {
+                r = job->result;
+                pplog("plugin prepare procedure returned %d on worker thread.", r);
+            } else {
+                pplog("executing plugin prepare procedure ...");
+                pplog_enter();
+                plugin_entry_depth++;
+                r = prepare();
+                plugin_entry_depth--;
+                pplog_leave();
+            }
+            if (r != 0) {
+                pplog("error: prepare procedure returns %d.", r);
+                try_goto_desktop();
+                swstr_format(&errmsg, wstr_pluginerr_initfailed, r);
+                goto initfail;
+            }
+        }
+
         pplog("executing plugin initialization procedure ...");
         pplog_enter();
+        plugin_entry_depth++;
         r = entry();
+        plugin_entry_depth--;
         pplog_leave();
         if (r != 0) {
             pplog("error: initialization procedure returns %d.", r);
             try_goto_desktop();
-            wstr_format(&errmsg, wstr_pluginerr_initfailed, r);
+            swstr_format(&errmsg, wstr_pluginerr_initfailed, r);
             goto initfail;
         }
     }
@@ -287,25 +481,26 @@ done:
     
     if (type == 0) {
         if (success && newplugin->friendly_name) {
-            wstr_format(&namepart, wstr_pluginreport_namepart, newplugin->friendly_name, newplugin->version ? " " : "", newplugin->version ? newplugin->version : "");
+            swstr_format(&namepart, wstr_pluginreport_namepart, newplugin->friendly_name, newplugin->version ? " " : "", newplugin->version ? newplugin->version : "");
         } else {
-            wstr_wcscpy(&namepart, get_wfilepart(wfilename_managed));
+            swstr_wcscpy(&namepart, get_wfilepart(wfilename_managed));
         }
         if (success) {
-            wstr_format(&line, wstr_pluginreport_success, wstr_getwcs(&namepart));
+            swstr_format(&line, wstr_pluginreport_success, swstr_getwcs(&namepart));
         } else {
-            wstr_format(&line, wstr_pluginreport_failed, wstr_getwcs(&namepart), wstr_getwcs(&errmsg));
+            swstr_format(&line, wstr_pluginreport_failed, swstr_getwcs(&namepart), swstr_getwcs(&errmsg));
         }
-        wstr_wcscat(&plugin_report_body, wstr_getwcs(&line));
+        wstr_wcscat(&plugin_report_body, swstr_getwcs(&line));
     }
     
     if (success) newplugin = NULL;
     free(newplugin);
     free(wfilename_managed);
     free(u8name_managed);
-    wstr_dtor(&errmsg);
-    wstr_dtor(&line);
-    wstr_dtor(&namepart);
+    swstr_dtor(&errmsg);
+    swstr_dtor(&line);
+    swstr_dtor(&namepart);
+    startup_end();
     return;
 fail:
 skip:
@@ -343,6 +538,163 @@ void load_plugin_library_and_dependents(const char *filename)
     pplog_leave();
 }
 
+// lazy plugin activation
+//   in plugin list files, a line of
+//     WHEN <condition> <directive> <parameter>
+//   defers the directive until the condition first matches, conditions are
+//     GAMESTATE=<n>     PAL3_s_gamestate equals n
+//     SCENE=<cpkname>   current scene CPK name equals cpkname, e.g. "q01.cpk"
+//     TEXTURE=<prefix>  a texture with path prefix is loaded
+//   conditions are checked once per frame, so the texture which triggers
+//     activation is loaded before the plugin is
+//   startup-only hooks (e.g. post-PAL3-create) have already been run
+//     when lazy plugins are initialized
+
+enum {
+    LAZY_GAMESTATE,
+    LAZY_SCENE,
+    LAZY_TEXTURE,
+};
+
+struct lazy_plugin {
+    int type;
+    int gamestate;
+    char *arg; // scene CPK name or texture path prefix
+    char *directive;
+    char *parameter;
+    int triggered; // set by texture hook
+    int done;
+};
+
+static struct lazy_plugin *lazy_plugins = NULL;
+static int nr_lazy_plugins = 0;
+static int nr_lazy_pending = 0;
+
+static int run_plugin_directive(const char *directive, const char *parameter);
+
+static char texpath_normchar(char ch)
+{
+    if (ch == '/') return '\\';
+    if ('A' <= ch && ch <= 'Z') return ch + ('a' - 'A');
+    return ch;
+}
+static int texpath_prefix_match(const char *texpath, const char *prefix)
+{
+    for (; *prefix; texpath++, prefix++) {
+        if (texpath_normchar(*texpath) != texpath_normchar(*prefix)) return 0;
+    }
+    return 1;
+}
+
+static void lazy_plugin_texture_hook(struct texture_hook_info *thinfo)
+{
+    int i;
+    if (thinfo->type != TH_PRE_IMAGELOAD || !nr_lazy_pending) return;
+    if (test_texture_hook_magic(thinfo)) return;
+    for (i = 0; i < nr_lazy_plugins; i++) {
+        struct lazy_plugin *p = &lazy_plugins[i];
+        if (!p->done && p->type == LAZY_TEXTURE && texpath_prefix_match(thinfo->texpath, p->arg)) {
+            p->triggered = 1;
+        }
+    }
+}
+
+static void lazy_plugin_gameloop_hook(void *arg)
+{
+    int i, match;
+    if (!nr_lazy_pending) return;
+    
+    const char *scene = NULL;
+    if (g_pVFileSys && g_pVFileSys->m_cpk.m_bLoaded) {
+        scene = get_filepart(g_pVFileSys->m_cpk.m_szCPKFileName);
+    }
+    
+    // activation may add more lazy entries, so don't keep pointers across it
+    for (i = 0; i < nr_lazy_plugins; i++) {
+        struct lazy_plugin *p = &lazy_plugins[i];
+        if (p->done) continue;
+        switch (p->type) {
+            case LAZY_GAMESTATE: match = PAL3_s_gamestate == p->gamestate; break;
+            case LAZY_SCENE: match = scene && stricmp(scene, p->arg) == 0; break;
+            case LAZY_TEXTURE: match = p->triggered; break;
+            default: match = 0; break;
+        }
+        if (!match) continue;
+        p->done = 1;
+        nr_lazy_pending--;
+        
+        char *directive = p->directive, *parameter = p->parameter;
+        pplog("activating lazy plugin directive '%s %s' ...", directive, parameter);
+        pplog_enter();
+        run_plugin_directive(directive, parameter);
+        pplog_leave();
+    }
+}
+
+static int add_lazy_plugin(const char *condition, const char *directive, const char *parameter)
+{
+    static int hooks_added = 0;
+    struct lazy_plugin p;
+    const char *value = strchr(condition, '=');
+    
+    memset(&p, 0, sizeof(p));
+    if (!value || !*++value) return 0;
+    if (strnicmp(condition, "GAMESTATE=", 10) == 0) {
+        p.type = LAZY_GAMESTATE;
+        p.gamestate = atoi(value);
+    } else if (strnicmp(condition, "SCENE=", 6) == 0) {
+        p.type = LAZY_SCENE;
+    } else if (strnicmp(condition, "TEXTURE=", 8) == 0) {
+        p.type = LAZY_TEXTURE;
+    } else {
+        return 0;
+    }
+    p.arg = strdup(value);
+    p.directive = strdup(directive);
+    p.parameter = strdup(parameter);
+    
+    if ((nr_lazy_plugins & (nr_lazy_plugins - 1)) == 0) {
+        struct lazy_plugin *newlist = realloc(lazy_plugins, imax(nr_lazy_plugins * 2, 16) * sizeof(struct lazy_plugin));
+        if (!newlist) fail("can't allocate lazy plugin list.");
+        lazy_plugins = newlist;
+    }
+    lazy_plugins[nr_lazy_plugins++] = p;
+    nr_lazy_pending++;
+    
+    if (!hooks_added) {
+        add_gameloop_hook_filtered(lazy_plugin_gameloop_hook, GAMELOOP_MASK(GAMELOOP_NORMAL));
+        add_texture_hook(lazy_plugin_texture_hook);
+        hooks_added = 1;
+    }
+    return 1;
+}
+
+static int run_plugin_directive(const char *directive, const char *parameter)
+{
+    int is_dll = 1;
+    if (stricmp(directive, "DLL") == 0 || stricmp(directive, "LOAD_DLL") == 0) {
+        load_plugin_dll(parameter);
+    } else if (stricmp(directive, "DLL2") == 0 || stricmp(directive, "LOAD_DLL_AND_DEPENDENTS") == 0) {
+        load_plugin_dll_and_dependents(parameter);
+    } else if (stricmp(directive, "LIB") == 0 || stricmp(directive, "LOAD_LIBRARY") == 0) {
+        load_plugin_library(parameter);
+    } else if (stricmp(directive, "LIB2") == 0 || stricmp(directive, "LOAD_LIBRARY_AND_DEPENDENTS") == 0) {
+        load_plugin_library_and_dependents(parameter);
+    } else if (stricmp(directive, "LIST") == 0 || stricmp(directive, "LOAD_PLUGIN") == 0) {
+        is_dll = 0;
+        load_plugin_list(parameter);
+    } else if (stricmp(directive, "DIR") == 0 || stricmp(directive, "SEARCH_DIR") == 0) {
+        is_dll = 0;
+        search_plugins(parameter);
+    } else {
+        return 0;
+    }
+    
+    // list files and directories record their own contents
+    if (is_dll) manifest_record(MANIFEST_DIRECTIVE, directive, parameter, NULL);
+    return 1;
+}
+
 void load_plugin_list(const char *filename)
 {
     char *filestr = NULL;
@@ -355,6 +707,7 @@ void load_plugin_list(const char *filename)
     const char *line_delim = "\r\n";
     char *line_saveptr;
     char *directive, *parameter;
+    char *condition;
     char *token_saveptr;
     
     pplog("executing plugin file '%s' ...", filename);
@@ -364,6 +717,9 @@ void load_plugin_list(const char *filename)
     if (!utf8_filepath_to_wstr_fullpath(filename, fullpath, MAXLINE, &fullpath_filepart)) goto fail;
     if (!fullpath_filepart) goto fail;
     
+    // record before reading, so a change during reading invalidates manifest
+    manifest_record(MANIFEST_FILE, filename, NULL, NULL);
+    
     // read whole file as a string
     filestr = read_file_as_cstring(wcs2cs_managed(fullpath, CP_UTF8, &cstr_managed));
     if (!filestr) goto fail;
@@ -386,6 +742,19 @@ void load_plugin_list(const char *filename)
         }
         str_trim(parameter, SPACECHAR_LIST);
         
+        // split lazy activation condition
+        condition = NULL;
+        if (stricmp(directive, "WHEN") == 0) {
+            condition = strtok_r(parameter, SPACECHAR_LIST, &token_saveptr);
+            directive = strtok_r(NULL, SPACECHAR_LIST, &token_saveptr);
+            parameter = strtok_r(NULL, line_delim, &token_saveptr);
+            if (!directive || !parameter) {
+                pplog("error: incomplete lazy directive '%s'.", condition);
+                goto fail;
+            }
+            str_trim(parameter, SPACECHAR_LIST);
+        }
+        
         // resolve relative path if needed
         if (is_relpath(parameter)) {
 
@@ -399,19 +768,14 @@ void load_plugin_list(const char *filename)
             
         }
 
-        if (stricmp(directive, "DLL") == 0 || stricmp(directive, "LOAD_DLL") == 0) {
-            load_plugin_dll(parameter);
-        } else if (stricmp(directive, "DLL2") == 0 || stricmp(directive, "LOAD_DLL_AND_DEPENDENTS") == 0) {
-            load_plugin_dll_and_dependents(parameter);
-        } else if (stricmp(directive, "LIB") == 0 || stricmp(directive, "LOAD_LIBRARY") == 0) {
-            load_plugin_library(parameter);
-        } else if (stricmp(directive, "LIB2") == 0 || stricmp(directive, "LOAD_LIBRARY_AND_DEPENDENTS") == 0) {
-            load_plugin_library_and_dependents(parameter);
-        } else if (stricmp(directive, "LIST") == 0 || stricmp(directive, "LOAD_PLUGIN") == 0) {
-            load_plugin_list(parameter);
-        } else if (stricmp(directive, "DIR") == 0 || stricmp(directive, "SEARCH_DIR") == 0) {
-            search_plugins(parameter);
-        } else {
+        if (condition) {
+            if (!add_lazy_plugin(condition, directive, parameter)) {
+                pplog("error: unknown lazy condition '%s'.", condition);
+                goto fail;
+            }
+            pplog("directive '%s %s' deferred until '%s'.", directive, parameter, condition);
+            manifest_record(MANIFEST_LAZY, condition, directive, parameter);
+        } else if (!run_plugin_directive(directive, parameter)) {
             pplog("error: unknown directive '%s'.", directive);
             goto fail;
         }
@@ -426,6 +790,7 @@ done:
     return;
 fail:
     pplog("error occurred while executing plugin file.");
+    manifest_broken = 1;
     goto done;
 }
 
@@ -437,7 +802,7 @@ static void enum_plugin_files_funchelper(const char *filename, void *arg)
 }
 static void enum_plugin_files(const char *dirpath, const char *pattern, void (*func)(const char *filepath))
 {
-    int r = enum_files(dirpath, pattern, enum_plugin_files_funchelper, func);
+    int r = enum_files_cached(dirpath, pattern, enum_plugin_files_funchelper, func);
     if (r == 0) {
         pplog("no file found in directory '%s' with pattern '%s'.", dirpath, pattern);
     } else if (r < 0) {
@@ -445,23 +810,226 @@ static void enum_plugin_files(const char *dirpath, const char *pattern, void (*f
     }
 }
 
+static void add_plugin_prepare_job(const char *filename, void *arg)
+{
+    struct plugin_prepare_batch *batch = arg;
+    struct plugin_prepare_job *job;
+    wchar_t *wfilename_managed = NULL;
+    
+    if ((batch->n & (batch->n - 1)) == 0) {
+        job = realloc(batch->jobs, imax(batch->n * 2, 16) * sizeof(struct plugin_prepare_job));
+        if (!job) return;
+        batch->jobs = job;
+    }
+    job = &batch->jobs[batch->n++];
+    memset(job, 0, sizeof(*job));
+    job->filename = strdup(filename);
+    
+    // load dll early to find its prepare step
+    job->handle = LoadLibraryExW(cs2wcs_managed(filename, CP_UTF8, &wfilename_managed), NULL, 0);
+    if (job->handle) job->prepare = TOPTR(GetProcAddress(job->handle, TOSTR(PLUGINSYMBOL_PREPARE)));
+    free(wfilename_managed);
+}
+
+static void run_plugin_dll_batch(struct plugin_prepare_batch *batch)
+{
+    struct plugin_prepare_batch *prev_batch = cur_prepare_batch;
+    int i;
+    
+    run_plugin_prepare_batch(batch);
+    
+    // register plugins in order
+    cur_prepare_batch = batch;
+    for (i = 0; i < batch->n; i++) {
+        if (batch->jobs[i].filename) load_plugin_dll(batch->jobs[i].filename);
+    }
+    cur_prepare_batch = prev_batch;
+    
+    for (i = 0; i < batch->n; i++) {
+        if (batch->jobs[i].handle) FreeLibrary(batch->jobs[i].handle);
+        free(batch->jobs[i].filename);
+    }
+    free(batch->jobs);
+    memset(batch, 0, sizeof(*batch));
+}
+
+static void search_plugin_dlls(const char *dirpath)
+{
+    struct plugin_prepare_batch batch;
+    int r, i;
+    
+    memset(&batch, 0, sizeof(batch));
+    r = enum_files_cached(dirpath, "*.dll", add_plugin_prepare_job, &batch);
+    if (r == 0) {
+        pplog("no file found in directory '%s' with pattern '%s'.", dirpath, "*.dll");
+    } else if (r < 0) {
+        pplog("error occurred while enumerating files.");
+    }
+    
+    manifest_record(MANIFEST_BATCH, dirpath, NULL, NULL);
+    for (i = 0; i < batch.n; i++) {
+        if (batch.jobs[i].filename) manifest_record(MANIFEST_BATCH_DLL, batch.jobs[i].filename, NULL, NULL);
+    }
+    
+    run_plugin_dll_batch(&batch);
+}
+
 void search_plugins(const char *dirpath)
 {
     pplog("searching plugins in directory '%s' ...", dirpath);
     pplog_enter();
+    manifest_record(MANIFEST_DIR, dirpath, NULL, NULL);
     enum_plugin_files(dirpath, "*.plugin", load_plugin_list);
-    enum_plugin_files(dirpath, "*.dll", load_plugin_dll);
+    search_plugin_dlls(dirpath);
     pplog("search finished.");
     pplog_leave();
 }
 
+// run a manifest, returns 0 if it is missing or out of date
+static int replay_plugin_manifest(void)
+{
+    FILE *fp = NULL;
+    char *data = NULL;
+    struct plugin_manifest_hdr hdr;
+    struct plugin_prepare_batch batch;
+    unsigned char sum[20], filesum[20];
+    SHA1_CTX ctx;
+    int ret = 0;
+    int pass;
+    
+    memset(&batch, 0, sizeof(batch));
+    fp = robust_fopen(PLUGIN_MANIFEST_FILE, "rb");
+    if (!fp) goto done;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1) goto bad;
+    if (hdr.magic != PLUGIN_MANIFEST_MAGIC || hdr.version != PLUGIN_MANIFEST_VERSION || hdr.patch_version != PATCH_VERSION || hdr.size > PLUGIN_MANIFEST_MAXSIZE) goto bad;
+    data = malloc(imax(hdr.size, 1));
+    if (!data) goto bad;
+    if (fread(data, 1, hdr.size, fp) != hdr.size) goto bad;
+    if (fread(filesum, sizeof(filesum), 1, fp) != 1) goto bad;
+    SHA1Init(&ctx);
+    SHA1Update(&ctx, (const unsigned char *) &hdr, sizeof(hdr));
+    SHA1Update(&ctx, (const unsigned char *) data, hdr.size);
+    SHA1Final(sum, &ctx);
+    if (memcmp(sum, filesum, sizeof(sum)) != 0) goto bad;
+    
+    // pass 0: validate records and check dependencies
+    // pass 1: run directives
+    for (pass = 0; pass < 2; pass++) {
+        char *ptr = data, *end = data + hdr.size;
+        if (pass == 1) {
+            pplog("replaying plugin manifest '%s' ...", PLUGIN_MANIFEST_FILE);
+            pplog_enter();
+        }
+        while (ptr < end) {
+            struct plugin_manifest_rec rec, cur;
+            const char *s[3];
+            char *q, *qend;
+            int nstr = 0;
+            
+            if ((size_t) (end - ptr) < sizeof(rec)) goto bad;
+            memcpy(&rec, ptr, sizeof(rec));
+            ptr += sizeof(rec);
+            if (rec.type < 0 || rec.type >= MANIFEST_TYPE_COUNT || rec.len > (size_t) (end - ptr)) goto bad;
+            if (rec.len == 0 || ptr[rec.len - 1] != '\0') goto bad;
+            for (q = ptr, qend = ptr + rec.len; q < qend && nstr < 3; q += strlen(q) + 1) s[nstr++] = q;
+            if (q != qend || nstr != manifest_nstr[rec.type]) goto bad;
+            ptr += rec.len;
+            
+            if (pass == 0) {
+                if (rec.type == MANIFEST_DIR || rec.type == MANIFEST_FILE) {
+                    memset(&cur, 0, sizeof(cur));
+                    if (!get_manifest_attr(s[0], &cur)) goto outdated;
+                    if (rec.size_lo != cur.size_lo || rec.size_hi != cur.size_hi || CompareFileTime(&rec.mtime, &cur.mtime) != 0) goto outdated;
+                }
+                continue;
+            }
+            
+            // DLLs in a batch are prepared together, as search_plugins() does
+            if (rec.type != MANIFEST_BATCH_DLL) run_plugin_dll_batch(&batch);
+            switch (rec.type) {
+                case MANIFEST_DIRECTIVE:
+                    run_plugin_directive(s[0], s[1]);
+                    break;
+                case MANIFEST_LAZY:
+                    if (add_lazy_plugin(s[0], s[1], s[2])) {
+                        pplog("directive '%s %s' deferred until '%s'.", s[1], s[2], s[0]);
+                    }
+                    break;
+                case MANIFEST_BATCH:
+                    pplog("loading plugin dlls found in directory '%s' ...", s[0]);
+                    break;
+                case MANIFEST_BATCH_DLL:
+                    add_plugin_prepare_job(s[0], &batch);
+                    break;
+            }
+        }
+        if (pass == 1) {
+            run_plugin_dll_batch(&batch);
+            pplog("replay finished.");
+            pplog_leave();
+        }
+    }
+    ret = 1;
+    goto done;
+    
+outdated:
+    pplog("plugin manifest is out of date, rebuilding.");
+    goto done;
+bad:
+    // can't be reached in pass 1, since all records are validated in pass 0
+    pplog("invalid plugin manifest, rebuilding.");
+done:
+    safe_fclose(&fp);
+    free(data);
+    return ret;
+}
+
+static void save_plugin_manifest(void)
+{
+    FILE *fp;
+    struct plugin_manifest_hdr hdr;
+    unsigned char sum[20];
+    SHA1_CTX ctx;
+    
+    if (manifest_broken) {
+        robust_unlink(PLUGIN_MANIFEST_FILE);
+        return;
+    }
+    
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = PLUGIN_MANIFEST_MAGIC;
+    hdr.version = PLUGIN_MANIFEST_VERSION;
+    hdr.patch_version = PATCH_VERSION;
+    hdr.size = bvec_bsize(&manifest_buf);
+    SHA1Init(&ctx);
+    SHA1Update(&ctx, (const unsigned char *) &hdr, sizeof(hdr));
+    SHA1Update(&ctx, bvec_bdata(&manifest_buf), hdr.size);
+    SHA1Final(sum, &ctx);
+    
+    fp = robust_fopen(PLUGIN_MANIFEST_FILE, "wb");
+    if (!fp) return;
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    fwrite(bvec_bdata(&manifest_buf), 1, hdr.size, fp);
+    fwrite(sum, sizeof(sum), 1, fp);
+    if (safe_fclose(&fp) != 0) robust_unlink(PLUGIN_MANIFEST_FILE);
+}
+
 void init_plugins()
 {
     int flag = get_int_from_configfile("loadplugins");
     if (flag) {
         wstr_ctor(&plugin_report_body);
+        InitializeCriticalSection(&plugin_log_cs);
+        plugin_log_cs_ready = 1;
         
-        search_plugins("plugins");
+        if (!replay_plugin_manifest()) {
+            bvec_ctor(&manifest_buf);
+            manifest_recording = 1;
+            search_plugins("plugins");
+            manifest_recording = 0;
+            save_plugin_manifest();
+            bvec_dtor(&manifest_buf);
+        }
         pplog("total %d plugin%s loaded at game startup time.", total_plugins, total_plugins > 1 ? "s" : "");
 
         if (flag == 1 && wstr_at(&plugin_report_body, 0)) {
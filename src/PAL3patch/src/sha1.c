@@ -1,4 +1,12 @@
 #include "common.h"
+#include <tmmintrin.h>
+#ifdef __GNUC__
+#include <cpuid.h>
+#define SSSE3_FUNC __attribute__((target("ssse3")))
+#else
+#include <intrin.h>
+#define SSSE3_FUNC
+#endif
 
 /* from valgrind tests */
 
@@ -45,6 +53,86 @@ A million repetitions of "a"
 #define R4(v,w,x,y,z,i) z+=(w^x^y)+blk(i)+0xCA62C1D6+rol(v,5);w=rol(w,30);
 
 
+/* SSSE3 version: message schedule is expanded 4 words at a time
+ * W[i..i+3] = rol(W[i-3]^W[i-8]^W[i-14]^W[i-16], 1), where W[i+3] depends on W[i],
+ * so lane 3 is fixed up afterwards using rol(a^b, 1) == rol(a, 1)^rol(b, 1)
+ * used only if CPU supports SSSE3 (CPUID.1:ECX bit 9) and OS supports XMM state
+ */
+
+#ifndef PF_XMMI64_INSTRUCTIONS_AVAILABLE
+#define PF_XMMI64_INSTRUCTIONS_AVAILABLE 10
+#endif
+
+static int sha1_has_ssse3 = -1;
+
+static int sha1_detect_ssse3(void)
+{
+    unsigned ecx;
+#ifdef __GNUC__
+    unsigned eax, ebx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return 0;
+#else
+    int info[4];
+    __cpuid(info, 1);
+    ecx = info[2];
+#endif
+    /* SSE2 feature flag from OS implies XMM state is saved */
+    return IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE) && (ecx & (1 << 9));
+}
+
+static SSSE3_FUNC void SHA1Schedule_ssse3(uint32_t W[80], const unsigned char buffer[64])
+{
+    const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+    __m128i t, r;
+    int i;
+    for (i = 0; i < 16; i += 4) {
+        t = _mm_loadu_si128((const __m128i *) &buffer[i * 4]);
+        _mm_storeu_si128((__m128i *) &W[i], _mm_shuffle_epi8(t, bswap));
+    }
+    for (i = 16; i < 80; i += 4) {
+        t = _mm_xor_si128(_mm_loadu_si128((const __m128i *) &W[i - 16]), _mm_loadu_si128((const __m128i *) &W[i - 14]));
+        t = _mm_xor_si128(t, _mm_loadu_si128((const __m128i *) &W[i - 8]));
+        t = _mm_xor_si128(t, _mm_srli_si128(_mm_loadu_si128((const __m128i *) &W[i - 4]), 4)); /* W[i-3], W[i-2], W[i-1], 0 */
+        r = _mm_or_si128(_mm_slli_epi32(t, 1), _mm_srli_epi32(t, 31));
+        t = _mm_slli_si128(r, 12); /* 0, 0, 0, W[i] */
+        r = _mm_xor_si128(r, _mm_or_si128(_mm_slli_epi32(t, 1), _mm_srli_epi32(t, 31)));
+        _mm_storeu_si128((__m128i *) &W[i], r);
+    }
+}
+
+static void SHA1Transform_ssse3(uint32_t state[5], const unsigned char buffer[64])
+{
+    uint32_t W[80];
+    uint32_t a, b, c, d, e, t;
+    int i;
+    SHA1Schedule_ssse3(W, buffer);
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    for (i = 0; i < 20; i++) {
+        t = rol(a,5) + ((b&(c^d))^d) + e + W[i] + 0x5A827999; e = d; d = c; c = rol(b,30); b = a; a = t;
+    }
+    for (; i < 40; i++) {
+        t = rol(a,5) + (b^c^d) + e + W[i] + 0x6ED9EBA1; e = d; d = c; c = rol(b,30); b = a; a = t;
+    }
+    for (; i < 60; i++) {
+        t = rol(a,5) + (((b|c)&d)|(b&c)) + e + W[i] + 0x8F1BBCDC; e = d; d = c; c = rol(b,30); b = a; a = t;
+    }
+    for (; i < 80; i++) {
+        t = rol(a,5) + (b^c^d) + e + W[i] + 0xCA62C1D6; e = d; d = c; c = rol(b,30); b = a; a = t;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    /* Wipe variables */
+    memset(W, '\0', sizeof(W));
+}
+
+
 /* Hash a single 512-bit block. This is the core of the algorithm. */
 
 void SHA1Transform(uint32_t state[5], const unsigned char buffer[64])
@@ -54,6 +142,11 @@ void SHA1Transform(uint32_t state[5], const unsigned char buffer[64])
         unsigned char c[64];
         uint32_t l[16];
     } CHAR64LONG16;
+    if (sha1_has_ssse3 < 0) sha1_has_ssse3 = sha1_detect_ssse3();
+    if (sha1_has_ssse3) {
+        SHA1Transform_ssse3(state, buffer);
+        return;
+    }
 #ifdef SHA1HANDSOFF
     CHAR64LONG16 block[1];  /* use array to appear as a pointer */
     memcpy(block, buffer, 64);
@@ -148,9 +241,9 @@ void SHA1Update(SHA1_CTX* context, const unsigned char* data, uint32_t len)
 
 void SHA1Final(unsigned char digest[20], SHA1_CTX* context)
 {
+    static const unsigned char padding[64] = { 0200 };
     unsigned i;
     unsigned char finalcount[8];
-    unsigned char c;
 
 #if 0	/* untested "improvement" by DHR */
     /* Convert context->count to a sequence of bytes
@@ -174,12 +267,8 @@ void SHA1Final(unsigned char digest[20], SHA1_CTX* context)
          >> ((3-(i & 3)) * 8) ) & 255);  /* Endian independent */
     }
 #endif
-    c = 0200;
-    SHA1Update(context, &c, 1);
-    while ((context->count[0] & 504) != 448) {
-	c = 0000;
-        SHA1Update(context, &c, 1);
-    }
+    /* Pad with 0200 and zeros to 56 mod 64 bytes, in one update */
+    SHA1Update(context, padding, ((55 - ((context->count[0] >> 3) & 63)) & 63) + 1);
     SHA1Update(context, finalcount, 8);  /* Should cause a SHA1Transform() */
     for (i = 0; i < 20; i++) {
         digest[i] = (unsigned char)
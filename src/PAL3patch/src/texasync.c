@@ -0,0 +1,347 @@
+#include "common.h"
+
+// asynchronous texture loading
+//   used when all interested hooks set thinfo->async in TH_PRE_IMAGELOAD stage
+//   the DDS file is read on render thread, since gbVFileSystem is not thread-safe
+//   decoding and TH_POST_IMAGELOAD processing are done by worker threads
+//   engine loads a 1x1 placeholder, which will be replaced in pre-endscene hook
+//   replacements are created in managed pool, whose system memory copy acts as staging buffer,
+//   and are committed to video memory with PreLoad(), until per-frame byte budget is used up
+
+#define TEXASYNC_MAXTHREADS 8
+
+struct texasync_job {
+    struct texasync_job *next;
+    struct texture_hook_info thinfo;
+    unsigned char hooks[MAX_TEXTURE_HOOKS]; // non-zero if hook is interested
+    int levels;
+    void *fdata;
+    unsigned fdatalen;
+    IDirect3DSurface9 *suf; // scratch surface for decoding, created on render thread
+    struct texmip_chain mip;
+    struct texdxt_data dxt;
+    int statidx; // texture stat record index
+    unsigned decode_us; // time spent by worker
+    struct gbTexture *tex;
+    IDirect3DBaseTexture9 *placeholder; // we hold a reference
+    struct texasync_job *livenext; // list of bound jobs
+};
+
+struct texasync_queue {
+    struct texasync_job *head;
+    struct texasync_job *tail;
+};
+
+int texasync_enabled;
+static CRITICAL_SECTION texasync_cs;
+static HANDLE texasync_sem;
+static HANDLE texasync_idle;
+static struct texasync_queue texasync_todo, texasync_done;
+static int texasync_inflight;
+struct texasync_job *texasync_curjob;
+static struct texasync_job *texasync_live; // bound jobs, tex is cleared when gbTexture is destroyed
+static unsigned texasync_budget; // bytes per frame
+static unsigned texasync_uploaded, texasync_dropped;
+static unsigned texasync_kbytes;
+
+static void texasync_push(struct texasync_queue *q, struct texasync_job *job)
+{
+    job->next = NULL;
+    if (q->tail) q->tail->next = job; else q->head = job;
+    q->tail = job;
+}
+
+static struct texasync_job *texasync_pop(struct texasync_queue *q)
+{
+    struct texasync_job *job = q->head;
+    if (job) {
+        q->head = job->next;
+        if (!q->head) q->tail = NULL;
+    }
+    return job;
+}
+
+void texasync_freejob(struct texasync_job *job)
+{
+    if (!job) return;
+    if (job->placeholder) {
+        // job is bound, remove it from live list
+        struct texasync_job **p;
+        EnterCriticalSection(&texasync_cs);
+        for (p = &texasync_live; *p; p = &(*p)->livenext) {
+            if (*p == job) {
+                *p = job->livenext;
+                break;
+            }
+        }
+        LeaveCriticalSection(&texasync_cs);
+    }
+    if (job->suf) IDirect3DSurface9_Release(job->suf);
+    if (job->placeholder) IDirect3DBaseTexture9_Release(job->placeholder);
+    job->thinfo.mem_allocator->free(job->fdata);
+    job->thinfo.mem_allocator->free(job->thinfo.bits);
+    texmip_free(&job->mip);
+    texdxt_free(&job->dxt);
+    free(job);
+}
+
+// try to start async loading, should be called instead of dds_loader
+// returns non-zero if started, and a placeholder image is filled in thinfo
+int texasync_begin(struct gbTexture *this, struct texture_hook_info *thinfo, const unsigned char *hooks)
+{
+    if (thinfo->bits || test_texture_hook_noautoload(thinfo)) return 0;
+    if (!texlife_watch(this)) return 0;
+
+    struct texasync_job *job = calloc(1, sizeof(struct texasync_job));
+    if (!job) return 0;
+    job->thinfo.mem_allocator = &patch_mem_allocator;
+    job->statidx = -1;
+
+    // replace extension to .dds, same as dds_loader
+    char dds_fpath[MAXLINE];
+    strcpy(dds_fpath, thinfo->loadpath);
+    if (!strrchr(dds_fpath, '.')) goto fail;
+    strcpy(strrchr(dds_fpath, '.'), ".dds");
+    job->fdata = vfs_readfile(dds_fpath, &job->fdatalen, job->thinfo.mem_allocator);
+    if (!job->fdata) goto fail;
+
+    D3DXIMAGE_INFO img_info;
+    if (FAILED(D3DXGetImageInfoFromFileInMemory(job->fdata, job->fdatalen, &img_info))) goto fail;
+    if (FAILED(IDirect3DDevice9_CreateOffscreenPlainSurface(GB_GfxMgr->m_pd3dDevice, img_info.Width, img_info.Height, D3DFMT_A8R8G8B8, D3DPOOL_SCRATCH, &job->suf, NULL))) {
+        job->suf = NULL;
+        goto fail;
+    }
+    void *placeholder = thinfo->mem_allocator->malloc(4);
+    if (!placeholder) goto fail;
+    memset(placeholder, 0, 4);
+
+    job->thinfo = *thinfo;
+    job->thinfo.mem_allocator = &patch_mem_allocator;
+    job->thinfo.type = TH_POST_IMAGELOAD;
+    job->thinfo.bits = NULL;
+    job->thinfo.width = img_info.Width;
+    job->thinfo.height = img_info.Height;
+    job->thinfo.bitcount = 32;
+    job->thinfo.div_alpha = 0;
+    memcpy(job->hooks, hooks, nr_texhooks);
+    job->levels = this->nLevels;
+
+    // engine should see real texture size
+    thinfo->bits = placeholder;
+    thinfo->width = 1;
+    thinfo->height = 1;
+    thinfo->bitcount = 32;
+    thinfo->div_alpha = 0;
+    if (!thinfo->fakewidth) thinfo->fakewidth = img_info.Width;
+    if (!thinfo->fakeheight) thinfo->fakeheight = img_info.Height;
+    texasync_curjob = job;
+    return 1;
+fail:
+    texasync_freejob(job);
+    return 0;
+}
+
+// bind placeholder D3D texture to job, and submit it to workers
+void texasync_bind(struct gbTexture *this, int statidx)
+{
+    struct gbTexture_D3D *d3dtex = (struct gbTexture_D3D *) this;
+    struct texasync_job *job = texasync_curjob;
+    texasync_curjob = NULL;
+    job->statidx = statidx;
+    if (!d3dtex->pTex || d3dtex->pDS) {
+        texasync_freejob(job);
+        return;
+    }
+    job->tex = this;
+    job->placeholder = d3dtex->pTex;
+    IDirect3DBaseTexture9_AddRef(job->placeholder);
+
+    EnterCriticalSection(&texasync_cs);
+    job->livenext = texasync_live;
+    texasync_live = job;
+    texasync_push(&texasync_todo, job);
+    if (texasync_inflight++ == 0) ResetEvent(texasync_idle);
+    LeaveCriticalSection(&texasync_cs);
+    ReleaseSemaphore(texasync_sem, 1, NULL);
+}
+
+static void texasync_decode(struct texasync_job *job)
+{
+    struct texture_hook_info *thinfo = &job->thinfo;
+    D3DLOCKED_RECT lrc;
+    int i;
+
+    if (SUCCEEDED(D3DXLoadSurfaceFromFileInMemory(job->suf, NULL, NULL, job->fdata, job->fdatalen, NULL, D3DX_DEFAULT, 0, NULL))) {
+        if (SUCCEEDED(IDirect3DSurface9_LockRect(job->suf, &lrc, NULL, D3DLOCK_READONLY))) {
+            thinfo->bits = thinfo->mem_allocator->malloc(thinfo->width * thinfo->height * 4);
+            if (thinfo->bits) {
+                for (i = 0; i < thinfo->height; i++) {
+                    memcpy(PTRADD(thinfo->bits, i * thinfo->width * 4), PTRADD(lrc.pBits, i * lrc.Pitch), thinfo->width * 4);
+                }
+            }
+            IDirect3DSurface9_UnlockRect(job->suf);
+        }
+    }
+    thinfo->mem_allocator->free(job->fdata);
+    job->fdata = NULL;
+    if (!thinfo->bits) return;
+
+    run_texture_hooks_masked(thinfo, job->hooks);
+    if (texmip_wanted(thinfo)) texmip_generate(&job->mip, thinfo);
+    if (texdxt_wanted(thinfo)) texdxt_generate(&job->dxt, thinfo, &job->mip, job->levels, 0);
+}
+
+static DWORD WINAPI texasync_worker(LPVOID lpParameter)
+{
+    while (WaitForSingleObject(texasync_sem, INFINITE) == WAIT_OBJECT_0) {
+        EnterCriticalSection(&texasync_cs);
+        struct texasync_job *job = texasync_pop(&texasync_todo);
+        LeaveCriticalSection(&texasync_cs);
+        if (!job) continue;
+
+        LONGLONG t = texstat_enabled ? texstat_now() : 0;
+        texasync_decode(job);
+        if (texstat_enabled) job->decode_us = texstat_us(t, texstat_now());
+
+        EnterCriticalSection(&texasync_cs);
+        texasync_push(&texasync_done, job);
+        if (--texasync_inflight == 0) SetEvent(texasync_idle);
+        LeaveCriticalSection(&texasync_cs);
+    }
+    return 0;
+}
+
+// returns bytes uploaded
+static unsigned texasync_upload(struct texasync_job *job)
+{
+    struct texture_hook_info *thinfo = &job->thinfo;
+    struct gbTexture_D3D *d3dtex = (struct gbTexture_D3D *) job->tex;
+    IDirect3DBaseTexture9 *placeholder = job->placeholder;
+    IDirect3DTexture9 *tex = NULL;
+    IDirect3DSurface9 *suf = NULL;
+    D3DSURFACE_DESC desc;
+    unsigned bytes = 0;
+    LONGLONG t = texstat_enabled ? texstat_now() : 0;
+
+    // gbTexture is destroyed, or its D3D texture is replaced by someone else
+    if (!job->tex || d3dtex->pTex != placeholder) goto drop;
+
+    if (!thinfo->bits) goto drop;
+    if (IDirect3DBaseTexture9_GetType(placeholder) != D3DRTYPE_TEXTURE) goto drop;
+    if (FAILED(IDirect3DTexture9_GetLevelDesc((IDirect3DTexture9 *) placeholder, 0, &desc))) goto drop;
+    if (job->dxt.levels && (tex = texdxt_create(&job->dxt))) {
+        int i;
+        for (i = 0; i < job->dxt.levels; i++) bytes += pixel_dxt_size(job->dxt.width[i], job->dxt.height[i], job->dxt.dxt5);
+        texdxt_applied++;
+        goto commit;
+    }
+    int levels = job->mip.levels ? job->mip.levels + 1 : imax(job->levels, 0);
+    if (FAILED(D3DXCreateTexture(GB_GfxMgr->m_pd3dDevice, thinfo->width, thinfo->height, levels, 0, desc.Format, D3DPOOL_MANAGED, &tex))) {
+        tex = NULL;
+        goto drop;
+    }
+    if (FAILED(IDirect3DTexture9_GetSurfaceLevel(tex, 0, &suf))) {
+        suf = NULL;
+        goto drop;
+    }
+    RECT rc = { 0, 0, thinfo->width, thinfo->height };
+    D3DFORMAT fmt = thinfo->bitcount == 32 ? D3DFMT_A8R8G8B8 : D3DFMT_R8G8B8;
+    if (FAILED(D3DXLoadSurfaceFromMemory(suf, NULL, NULL, thinfo->bits, fmt, thinfo->width * (thinfo->bitcount / 8), NULL, &rc, D3DX_FILTER_NONE, 0))) goto drop;
+    if (job->mip.levels && texmip_load(tex, &job->mip)) {
+        texmip_applied++;
+    } else if (IDirect3DTexture9_GetLevelCount(tex) > 1) {
+        D3DXFilterTexture((IDirect3DBaseTexture9 *) tex, NULL, 0, D3DX_DEFAULT);
+    }
+
+    bytes = thinfo->width * thinfo->height * 4;
+    if (IDirect3DTexture9_GetLevelCount(tex) > 1) bytes += bytes / 3;
+
+commit:
+    // commit to video memory now, instead of at first draw
+    IDirect3DTexture9_PreLoad(tex);
+
+    // replace placeholder, release the reference held by gbTexture
+    d3dtex->pTex = (IDirect3DBaseTexture9 *) tex;
+    tex = NULL;
+    IDirect3DBaseTexture9_Release(placeholder);
+    job->tex->Width = thinfo->fakewidth ? thinfo->fakewidth : thinfo->width;
+    job->tex->Height = thinfo->fakeheight ? thinfo->fakeheight : thinfo->height;
+    texasync_uploaded++;
+    texasync_kbytes += (bytes + 1023) >> 10;
+    if (texstat_enabled) texstat_addasync(job->statidx, job->decode_us, texstat_us(t, texstat_now()));
+    goto done;
+drop:
+    texasync_dropped++;
+done:
+    if (suf) IDirect3DSurface9_Release(suf);
+    if (tex) IDirect3DTexture9_Release(tex);
+    texasync_freejob(job);
+    return bytes;
+}
+
+// gbTexture is being destroyed, its pending jobs will be dropped
+static void texasync_texdestroy(struct gbTexture *tex)
+{
+    struct texasync_job *job;
+    EnterCriticalSection(&texasync_cs);
+    for (job = texasync_live; job; job = job->livenext) {
+        if (job->tex == tex) job->tex = NULL;
+    }
+    LeaveCriticalSection(&texasync_cs);
+}
+
+// upload finished jobs until budget is used up, at least one job is uploaded
+static void texasync_upload_done(unsigned budget)
+{
+    unsigned used = 0;
+    while (used < budget) {
+        EnterCriticalSection(&texasync_cs);
+        struct texasync_job *job = texasync_pop(&texasync_done);
+        LeaveCriticalSection(&texasync_cs);
+        if (!job) break;
+        used += texasync_upload(job);
+    }
+}
+
+static void texasync_preendscene(void)
+{
+    texasync_upload_done(texasync_budget);
+}
+
+static void texasync_onlostdevice(void)
+{
+    // wait and upload all pending textures, so we hold no placeholders during reset
+    // managed textures can be created while device is lost
+    WaitForSingleObject(texasync_idle, INFINITE);
+    texasync_upload_done(UINT_MAX);
+}
+
+static void texasync_report(void)
+{
+    plog("texture async: %u uploaded (%u KB), %u dropped.", texasync_uploaded, texasync_kbytes, texasync_dropped);
+}
+
+void init_texture_async(void)
+{
+    int nr_threads = imin(get_int_from_configfile("texturehook_async"), TEXASYNC_MAXTHREADS);
+    if (nr_threads <= 0) return;
+    int budget = get_int_from_configfile("texturehook_uploadbudget");
+    texasync_budget = budget > 0 ? budget * 1024u : UINT_MAX;
+
+    InitializeCriticalSection(&texasync_cs);
+    texasync_sem = CreateSemaphore(NULL, 0, 0x7FFFFFFF, NULL);
+    texasync_idle = CreateEvent(NULL, TRUE, TRUE, NULL);
+    if (!texasync_sem || !texasync_idle) fail("can't create texture async objects.");
+    int i;
+    for (i = 0; i < nr_threads; i++) {
+        HANDLE hThread = CreateThread(NULL, 0, texasync_worker, NULL, 0, NULL);
+        if (!hThread) fail("can't create texture async thread.");
+        sched_set_thread(hThread, SCHED_BACKGROUND);
+        CloseHandle(hThread);
+    }
+    add_preendscene_hook(texasync_preendscene);
+    add_onlostdevice_hook(texasync_onlostdevice);
+    add_atexit_hook(texasync_report);
+    add_texlife_hook(texasync_texdestroy);
+    texasync_enabled = 1;
+}
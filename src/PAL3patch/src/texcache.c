@@ -0,0 +1,288 @@
+#include "common.h"
+
+// persistent texture cache
+//   used when all interested hooks set thinfo->cachever in TH_PRE_IMAGELOAD stage
+//   final image after TH_POST_IMAGELOAD processing is stored in TEXCACHE_DIR
+//   as uncompressed DDS, so later loads skip both decoding and hooks
+//   cache key is hash of source file, texture path, and interested hooks (module name and cachever)
+//   extra image info is stored in DDS reserved fields, mip chain is stored if generated
+//   compressed textures are stored as DXT1/DXT5 DDS with their mip levels
+
+#define TEXCACHE_DIR "PAL3patch.texcache"
+#define TEXCACHE_MAGIC 0x43585450 // "PTXC"
+#define TEXCACHE_VERSION 2
+#define TEXCACHE_MAXSIZE 16384
+
+struct texcache_ddshdr {
+    DWORD magic; // "DDS "
+    DWORD dwSize;
+    DWORD dwFlags;
+    DWORD dwHeight;
+    DWORD dwWidth;
+    DWORD dwPitchOrLinearSize;
+    DWORD dwDepth;
+    DWORD dwMipMapCount;
+    DWORD dwReserved1[11]; // magic, version, fakewidth, fakeheight, div_alpha
+    struct {
+        DWORD dwSize;
+        DWORD dwFlags;
+        DWORD dwFourCC;
+        DWORD dwRGBBitCount;
+        DWORD dwRBitMask;
+        DWORD dwGBitMask;
+        DWORD dwBBitMask;
+        DWORD dwABitMask;
+    } ddspf;
+    DWORD dwCaps;
+    DWORD dwCaps2;
+    DWORD dwCaps3;
+    DWORD dwCaps4;
+    DWORD dwReserved2;
+};
+
+int texcache_enabled;
+static unsigned texcache_modhash[MAX_TEXTURE_HOOKS];
+unsigned char texcache_curkey[20];
+int texcache_curvalid;
+int texcache_hit;
+static unsigned texcache_hits, texcache_misses, texcache_stored;
+
+static unsigned texcache_gethookhash(int i)
+{
+    // hash of lowercased module file name, stable between runs
+    if (!texcache_modhash[i]) {
+        char modname[MAXLINE];
+        texhook_modname(i, modname, sizeof(modname));
+        texcache_modhash[i] = texdedup_strhash(str_tolower(modname)) | 1;
+    }
+    return texcache_modhash[i];
+}
+
+static void texcache_path(const unsigned char *key, char *path)
+{
+    int i;
+    strcpy(path, TEXCACHE_DIR "\\");
+    for (i = 0; i < 20; i++) sprintf(path + strlen(path), "%02x", key[i]);
+    strcat(path, ".dds");
+}
+
+static int texcache_read(const unsigned char *key, struct texture_hook_info *thinfo, struct texmip_chain *chain, struct texdxt_data *dxt)
+{
+    char path[MAXLINE];
+    texcache_path(key, path);
+    FILE *fp = robust_fopen(path, "rb");
+    if (!fp) return 0;
+
+    struct texcache_ddshdr hdr;
+    void *bits = NULL;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1) goto fail;
+    if (hdr.magic != 0x20534444 || hdr.dwReserved1[0] != TEXCACHE_MAGIC || hdr.dwReserved1[1] != TEXCACHE_VERSION) goto fail;
+    if (hdr.dwWidth == 0 || hdr.dwWidth > TEXCACHE_MAXSIZE || hdr.dwHeight == 0 || hdr.dwHeight > TEXCACHE_MAXSIZE) goto fail;
+    if (hdr.ddspf.dwFlags & 0x4) { // FOURCC
+        // compressed, engine loads a placeholder
+        if (hdr.ddspf.dwFourCC != 0x31545844 && hdr.ddspf.dwFourCC != 0x35545844) goto fail; // "DXT1", "DXT5"
+        if (hdr.dwMipMapCount > TEXMIP_MAXLEVELS + 1) goto fail;
+        dxt->dxt5 = hdr.ddspf.dwFourCC == 0x35545844;
+        int w = hdr.dwWidth, h = hdr.dwHeight;
+        while (dxt->levels < imax(hdr.dwMipMapCount, 1)) {
+            unsigned size = pixel_dxt_size(w, h, dxt->dxt5);
+            void *blocks = malloc(size);
+            if (!blocks) goto fail;
+            dxt->width[dxt->levels] = w;
+            dxt->height[dxt->levels] = h;
+            dxt->blocks[dxt->levels++] = blocks;
+            if (fread(blocks, 1, size, fp) != size) goto fail;
+            w = imax(w / 2, 1);
+            h = imax(h / 2, 1);
+        }
+        bits = thinfo->mem_allocator->malloc(4);
+        if (!bits) goto fail;
+        memset(bits, 0, 4);
+        fclose(fp);
+
+        thinfo->bits = bits;
+        thinfo->width = 1;
+        thinfo->height = 1;
+        thinfo->bitcount = 32;
+        thinfo->fakewidth = hdr.dwReserved1[2] ? hdr.dwReserved1[2] : hdr.dwWidth;
+        thinfo->fakeheight = hdr.dwReserved1[3] ? hdr.dwReserved1[3] : hdr.dwHeight;
+        thinfo->div_alpha = 0;
+        return 1;
+    }
+    if (hdr.ddspf.dwRGBBitCount != 32 && hdr.ddspf.dwRGBBitCount != 24) goto fail;
+    unsigned size = hdr.dwWidth * hdr.dwHeight * (hdr.ddspf.dwRGBBitCount / 8);
+    bits = thinfo->mem_allocator->malloc(size);
+    if (!bits || fread(bits, 1, size, fp) != size) goto fail;
+    if (hdr.dwMipMapCount > 1) {
+        // mip chain is only stored for 32-bit images
+        if (hdr.ddspf.dwRGBBitCount != 32 || hdr.dwMipMapCount > TEXMIP_MAXLEVELS + 1) goto fail;
+        int w = hdr.dwWidth, h = hdr.dwHeight;
+        while (chain->levels < (int) hdr.dwMipMapCount - 1) {
+            w = imax(w / 2, 1);
+            h = imax(h / 2, 1);
+            unsigned *mipbits = malloc(w * h * 4);
+            if (!mipbits) goto fail;
+            chain->width[chain->levels] = w;
+            chain->height[chain->levels] = h;
+            chain->bits[chain->levels++] = mipbits;
+            if (fread(mipbits, w * 4, h, fp) != (unsigned) h) goto fail;
+        }
+    }
+    fclose(fp);
+
+    thinfo->bits = bits;
+    thinfo->width = hdr.dwWidth;
+    thinfo->height = hdr.dwHeight;
+    thinfo->bitcount = hdr.ddspf.dwRGBBitCount;
+    thinfo->fakewidth = hdr.dwReserved1[2];
+    thinfo->fakeheight = hdr.dwReserved1[3];
+    thinfo->div_alpha = hdr.dwReserved1[4];
+    return 1;
+fail:
+    thinfo->mem_allocator->free(bits);
+    texmip_free(chain);
+    texdxt_free(dxt);
+    fclose(fp);
+    return 0;
+}
+
+void texcache_write(const unsigned char *key, const struct texture_hook_info *thinfo, const struct texmip_chain *chain, const struct texdxt_data *dxt)
+{
+    char path[MAXLINE];
+    texcache_path(key, path);
+    FILE *fp = robust_fopen(path, "wb");
+    if (!fp) return;
+
+    unsigned pitch = thinfo->width * (thinfo->bitcount / 8);
+    struct texcache_ddshdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = 0x20534444;
+    hdr.dwSize = 124;
+    hdr.dwFlags = 0x100F; // CAPS | HEIGHT | WIDTH | PITCH | PIXELFORMAT
+    hdr.dwHeight = thinfo->height;
+    hdr.dwWidth = thinfo->width;
+    hdr.dwPitchOrLinearSize = pitch;
+    hdr.dwReserved1[0] = TEXCACHE_MAGIC;
+    hdr.dwReserved1[1] = TEXCACHE_VERSION;
+    hdr.dwReserved1[2] = thinfo->fakewidth;
+    hdr.dwReserved1[3] = thinfo->fakeheight;
+    hdr.dwReserved1[4] = thinfo->div_alpha;
+    hdr.ddspf.dwSize = 32;
+    hdr.ddspf.dwFlags = thinfo->bitcount == 32 ? 0x41 : 0x40; // RGB | ALPHAPIXELS
+    hdr.ddspf.dwRGBBitCount = thinfo->bitcount;
+    hdr.ddspf.dwRBitMask = 0x00FF0000;
+    hdr.ddspf.dwGBitMask = 0x0000FF00;
+    hdr.ddspf.dwBBitMask = 0x000000FF;
+    hdr.ddspf.dwABitMask = thinfo->bitcount == 32 ? 0xFF000000 : 0;
+    hdr.dwCaps = 0x1000; // TEXTURE
+    if (dxt->levels) {
+        hdr.dwFlags = 0x81007; // CAPS | HEIGHT | WIDTH | PIXELFORMAT | LINEARSIZE
+        hdr.dwPitchOrLinearSize = pixel_dxt_size(dxt->width[0], dxt->height[0], dxt->dxt5);
+        hdr.ddspf.dwFlags = 0x4; // FOURCC
+        hdr.ddspf.dwFourCC = dxt->dxt5 ? 0x35545844 : 0x31545844; // "DXT5" : "DXT1"
+        hdr.ddspf.dwRGBBitCount = 0;
+        hdr.ddspf.dwRBitMask = hdr.ddspf.dwGBitMask = hdr.ddspf.dwBBitMask = hdr.ddspf.dwABitMask = 0;
+        if (dxt->levels > 1) {
+            hdr.dwFlags |= 0x20000; // MIPMAPCOUNT
+            hdr.dwMipMapCount = dxt->levels;
+            hdr.dwCaps |= 0x400008; // MIPMAP | COMPLEX
+        }
+    } else if (chain->levels) {
+        hdr.dwFlags |= 0x20000; // MIPMAPCOUNT
+        hdr.dwMipMapCount = chain->levels + 1;
+        hdr.dwCaps |= 0x400008; // MIPMAP | COMPLEX
+    }
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    int i;
+    if (dxt->levels) {
+        for (i = 0; i < dxt->levels; i++) {
+            fwrite(dxt->blocks[i], 1, pixel_dxt_size(dxt->width[i], dxt->height[i], dxt->dxt5), fp);
+        }
+    } else {
+        fwrite(thinfo->bits, pitch, thinfo->height, fp);
+        for (i = 0; i < chain->levels; i++) {
+            fwrite(chain->bits[i], chain->width[i] * 4, chain->height[i], fp);
+        }
+    }
+    if (safe_fclose(&fp) != 0) {
+        robust_unlink(path);
+        return;
+    }
+    texcache_stored++;
+}
+
+// compute cache key, and try load image from cache
+// should be called instead of dds_loader
+// returns non-zero if image is loaded (from cache or source DDS)
+int texcache_lookup(struct texture_hook_info *thinfo, const unsigned char *hooks, const unsigned *vers)
+{
+    if (thinfo->bits || test_texture_hook_noautoload(thinfo)) return 0;
+
+    // read source, DDS first, same as dds_loader
+    char dds_fpath[MAXLINE];
+    int is_dds = 0;
+    unsigned fdatalen;
+    const void *fdataptr = NULL;
+    strcpy(dds_fpath, thinfo->loadpath);
+    if (strrchr(dds_fpath, '.')) {
+        strcpy(strrchr(dds_fpath, '.'), ".dds");
+        fdataptr = open_texture_hook_view(dds_fpath, &fdatalen);
+        is_dds = !!fdataptr;
+    }
+    if (!fdataptr) fdataptr = open_texture_hook_view(thinfo->loadpath, &fdatalen);
+    if (!fdataptr) return 0;
+
+    SHA1_CTX ctx;
+    int i;
+    SHA1Init(&ctx);
+    SHA1Update(&ctx, fdataptr, fdatalen);
+    SHA1Update(&ctx, (const unsigned char *) thinfo->cpkname, strlen(thinfo->cpkname) + 1);
+    SHA1Update(&ctx, (const unsigned char *) thinfo->texpath, strlen(thinfo->texpath) + 1);
+    for (i = 0; i < nr_texhooks; i++) {
+        if (hooks[i]) {
+            unsigned h[2] = { texcache_gethookhash(i), vers[i] };
+            SHA1Update(&ctx, (const unsigned char *) h, sizeof(h));
+        }
+    }
+    SHA1Update(&ctx, (const unsigned char *) &texmip_filter, sizeof(texmip_filter));
+    if (texdxt_pathok(thinfo->texpath)) {
+        // compressed levels depend on nLevels when no mip chain is generated
+        int h[2] = { 1, texdxt_curlevels };
+        SHA1Update(&ctx, (const unsigned char *) h, sizeof(h));
+    }
+    SHA1Final(texcache_curkey, &ctx);
+    texcache_curvalid = 1;
+
+    int ret = 0;
+    if (texcache_read(texcache_curkey, thinfo, &texmip_cur, &texdxt_cur)) {
+        texcache_hit = 1;
+        texcache_hits++;
+        ret = 1;
+    } else {
+        texcache_misses++;
+        if (is_dds) {
+            // since we already have the file, do dds_loader's work here
+            dds_loader_frommem(thinfo, fdataptr, fdatalen);
+            ret = 1;
+        }
+    }
+    close_texture_hook_view(fdataptr);
+    return ret;
+}
+
+static void texcache_report(void)
+{
+    plog("texture cache: %u hit, %u miss, %u stored.", texcache_hits, texcache_misses, texcache_stored);
+}
+
+void init_texture_cache(void)
+{
+    texcache_enabled = get_int_from_configfile("texturecache");
+    if (!texcache_enabled) return;
+    if (!file_exists(TEXCACHE_DIR) && !create_dir(TEXCACHE_DIR)) {
+        warning("can't create texture cache directory '%s'.", TEXCACHE_DIR);
+        texcache_enabled = 0;
+        return;
+    }
+    add_atexit_hook(texcache_report);
+}
@@ -0,0 +1,224 @@
+#include "common.h"
+
+// texture load statistics
+//   every texture loaded by gbTexture::LoadTexture gets a record, times are in microseconds
+//     open: our file loading in texhook_part1 (cache, async, dds_loader, patch-side decoders)
+//     decode: engine image decoding, and our post-processing (mipmap, cache, dedup)
+//     hooks: time spent in texture hooks, also recorded per hook
+//     upload: D3D texture creation, including async upload
+//             (if engine loads a DDS by D3DX directly, decoding is also counted here)
+//   slowest textures are shown by showfps, all records are written to TEXSTAT_FILE at exit
+
+#define TEXSTAT_FILE "PAL3patch.texstat.csv"
+#define TEXSTAT_MAXRECORDS 65536
+#define TEXSTAT_SHOWTOP 5
+
+int texstat_enabled;
+static LARGE_INTEGER texstat_freq;
+static struct texstat_record *texstat_list;
+static int texstat_count, texstat_cap;
+static unsigned texstat_dropped;
+static double texstat_total_ms;
+static int texstat_top[TEXSTAT_SHOWTOP];
+static int texstat_nr_top;
+struct texstat_record texstat_cur;
+static LONGLONG texstat_mark; // time of last stage boundary
+static unsigned texstat_pending_us; // hook time since last stage boundary
+
+LONGLONG texstat_now(void)
+{
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return t.QuadPart;
+}
+
+unsigned texstat_us(LONGLONG from, LONGLONG to)
+{
+    return (to - from) * 1000000 / texstat_freq.QuadPart;
+}
+
+static unsigned texstat_total(const struct texstat_record *rec)
+{
+    return rec->open_us + rec->decode_us + rec->hook_us + rec->upload_us;
+}
+
+void texstat_begin(void)
+{
+    memset(&texstat_cur, 0, sizeof(texstat_cur));
+    texstat_mark = texstat_now();
+    texstat_pending_us = 0;
+}
+
+// end current stage, time spent in hooks is excluded
+void texstat_stage(unsigned *stage_us)
+{
+    LONGLONG t = texstat_now();
+    unsigned us = texstat_us(texstat_mark, t);
+    *stage_us += us > texstat_pending_us ? us - texstat_pending_us : 0;
+    texstat_mark = t;
+    texstat_pending_us = 0;
+}
+
+static void texstat_addhook(struct texstat_record *rec, int hookid, unsigned us)
+{
+    int i;
+    rec->hook_us += us;
+    for (i = 0; i < rec->nr_hooks; i++) {
+        if (rec->hooks[i].hookid == hookid) {
+            rec->hooks[i].us += us;
+            return;
+        }
+    }
+    if (rec->nr_hooks < TEXSTAT_MAXHOOKS) {
+        rec->hooks[rec->nr_hooks].hookid = hookid;
+        rec->hooks[rec->nr_hooks].us = us;
+        rec->nr_hooks++;
+    }
+}
+
+// record time spent in a texture hook, which is called at begin
+void texstat_hook(int hookid, LONGLONG begin)
+{
+    unsigned us = texstat_us(begin, texstat_now());
+    texstat_addhook(&texstat_cur, hookid, us);
+    texstat_pending_us += us;
+}
+
+static void texstat_update_top(int idx)
+{
+    // keep indexes of slowest textures, in descending order
+    int i;
+    unsigned total = texstat_total(&texstat_list[idx]);
+    for (i = 0; i < texstat_nr_top; i++) {
+        if (texstat_top[i] == idx) {
+            memmove(&texstat_top[i], &texstat_top[i + 1], (texstat_nr_top - i - 1) * sizeof(int));
+            texstat_nr_top--;
+            break;
+        }
+    }
+    for (i = texstat_nr_top; i > 0 && total > texstat_total(&texstat_list[texstat_top[i - 1]]); i--) {
+        if (i < TEXSTAT_SHOWTOP) texstat_top[i] = texstat_top[i - 1];
+    }
+    if (i < TEXSTAT_SHOWTOP) {
+        texstat_top[i] = idx;
+        if (texstat_nr_top < TEXSTAT_SHOWTOP) texstat_nr_top++;
+    }
+}
+
+// save current record, returns record index or -1 if dropped
+int texstat_end(struct texture_hook_info *thinfo, struct gbTexture *this)
+{
+    texstat_stage(&texstat_cur.upload_us);
+    texstat_cur.width = thinfo->width ? thinfo->width : this->Width;
+    texstat_cur.height = thinfo->height ? thinfo->height : this->Height;
+    texstat_cur.bytes = texstat_cur.width * texstat_cur.height * (thinfo->bitcount ? thinfo->bitcount / 8 : 4);
+
+    if (texstat_count >= texstat_cap) {
+        int cap = imin(imax(texstat_cap * 2, 256), TEXSTAT_MAXRECORDS);
+        struct texstat_record *list = cap > texstat_cap ? realloc(texstat_list, cap * sizeof(struct texstat_record)) : NULL;
+        if (!list) {
+            texstat_dropped++;
+            return -1;
+        }
+        texstat_list = list;
+        texstat_cap = cap;
+    }
+    char name[MAXLINE * 2];
+    snprintf(name, sizeof(name), "%s|%s", thinfo->cpkname, thinfo->texpath);
+    texstat_cur.name = strdup(name);
+    if (!texstat_cur.name) {
+        texstat_dropped++;
+        return -1;
+    }
+    texstat_list[texstat_count] = texstat_cur;
+    texstat_total_ms += texstat_total(&texstat_cur) / 1000.0;
+    texstat_update_top(texstat_count);
+    return texstat_count++;
+}
+
+// add time of async stages to a saved record
+void texstat_addasync(int idx, unsigned decode_us, unsigned upload_us)
+{
+    if (idx < 0) return;
+    texstat_total_ms += (decode_us + upload_us) / 1000.0;
+    texstat_list[idx].decode_us += decode_us;
+    texstat_list[idx].upload_us += upload_us;
+    texstat_update_top(idx);
+}
+
+void get_texture_stat_text(char *buf, int size)
+{
+    int i;
+    *buf = '\0';
+    if (!texstat_enabled) return;
+    snprintf(buf, size, "TEX = %d, %.1fms\n", texstat_count, texstat_total_ms);
+    for (i = 0; i < texstat_nr_top; i++) {
+        struct texstat_record *rec = &texstat_list[texstat_top[i]];
+        int len = strlen(buf);
+        snprintf(buf + len, size - len, " %8.2fms %4dx%-4d %s\n", texstat_total(rec) / 1000.0, rec->width, rec->height, rec->name);
+    }
+}
+
+static void texstat_csvstr(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"') fputc('"', fp);
+        fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+static int texstat_cmp(const void *a, const void *b)
+{
+    unsigned x = texstat_total(&texstat_list[*(const int *) a]);
+    unsigned y = texstat_total(&texstat_list[*(const int *) b]);
+    return x > y ? -1 : x < y;
+}
+
+static void texstat_save(void)
+{
+    plog("texture stat: %d records, %u dropped, %.1fms total.", texstat_count, texstat_dropped, texstat_total_ms);
+    FILE *fp = robust_fopen(TEXSTAT_FILE, "w");
+    if (!fp) {
+        warning("can't write texture stat file '%s'.", TEXSTAT_FILE);
+        return;
+    }
+
+    // rank by total time
+    int *order = malloc(imax(texstat_count, 1) * sizeof(int));
+    int i, j;
+    if (order) {
+        for (i = 0; i < texstat_count; i++) order[i] = i;
+        qsort(order, texstat_count, sizeof(int), texstat_cmp);
+    }
+
+    char modname[MAX_TEXTURE_HOOKS][64];
+    for (i = 0; i < nr_texhooks; i++) texhook_modname(i, modname[i], sizeof(modname[i]));
+
+    fprintf(fp, "cpkname|texpath,width,height,bytes,total_ms,open_ms,decode_ms,hook_ms,upload_ms,hooks\n");
+    for (i = 0; i < texstat_count; i++) {
+        struct texstat_record *rec = &texstat_list[order ? order[i] : i];
+        texstat_csvstr(fp, rec->name);
+        fprintf(fp, ",%d,%d,%u,%.3f,%.3f,%.3f,%.3f,%.3f,\"", rec->width, rec->height, rec->bytes,
+            texstat_total(rec) / 1000.0, rec->open_us / 1000.0, rec->decode_us / 1000.0, rec->hook_us / 1000.0, rec->upload_us / 1000.0);
+        for (j = 0; j < rec->nr_hooks; j++) {
+            fprintf(fp, "%s%s#%d=%.3f", j ? ";" : "", modname[rec->hooks[j].hookid], rec->hooks[j].hookid, rec->hooks[j].us / 1000.0);
+        }
+        fprintf(fp, "\"\n");
+    }
+    free(order);
+    if (safe_fclose(&fp) != 0) warning("can't write texture stat file '%s'.", TEXSTAT_FILE);
+}
+
+void init_texture_stat(void)
+{
+    texstat_enabled = get_int_from_configfile("texturestat");
+    if (!texstat_enabled) return;
+    if (!QueryPerformanceFrequency(&texstat_freq)) {
+        warning("can't query performance frequency, texture stat disabled.");
+        texstat_enabled = 0;
+        return;
+    }
+    add_atexit_hook(texstat_save);
+}
@@ -1,9 +1,89 @@
 #include "common.h"
 
+// read-only file views
+//   uncompressed CPK entries are viewed directly from CPK's file mapping
+//   (or nommapcpk's view buffer), so no extra copy is made
+//   other files (compressed entries, or files outside CPK) are read into memory
+
+#define TEXVIEW_MAX 8
+
+struct texview {
+    const void *data;
+    struct CPK *cpk;
+    struct CPKFile *cpkfp; // NULL if data is a copy
+};
+
+static struct texview texview_list[TEXVIEW_MAX];
+
+const void *open_texture_hook_view(const char *filepath, unsigned *length)
+{
+    int i;
+    struct texview *view = NULL;
+    for (i = 0; i < TEXVIEW_MAX; i++) {
+        if (!texview_list[i].data) {
+            view = &texview_list[i];
+            break;
+        }
+    }
+    if (!view) return NULL;
+
+    struct CPK *cpk = &g_pVFileSys->m_cpk;
+    if (cpk->m_bLoaded && cpk->m_eMode == CPKM_FileMapping) {
+        struct CPKFile *cpkfp = CPK_Open(cpk, filepath);
+        if (cpkfp) {
+            if (!cpkfp->bCompressed && cpkfp->lpStartAddress) {
+                view->data = cpkfp->lpStartAddress;
+                view->cpk = cpk;
+                view->cpkfp = cpkfp;
+                *length = cpkfp->dwFileSize;
+                return view->data;
+            }
+            CPK_Close(cpk, cpkfp);
+        }
+    }
+
+    view->data = vfs_readfile(filepath, length, &patch_mem_allocator);
+    view->cpk = NULL;
+    view->cpkfp = NULL;
+    return view->data;
+}
+
+void close_texture_hook_view(const void *data)
+{
+    int i;
+    if (!data) return;
+    for (i = 0; i < TEXVIEW_MAX; i++) {
+        struct texview *view = &texview_list[i];
+        if (view->data == data) {
+            if (view->cpkfp) {
+                CPK_Close(view->cpk, view->cpkfp);
+            } else {
+                patch_mem_allocator.free((void *) view->data);
+            }
+            view->data = NULL;
+            return;
+        }
+    }
+}
+
+
+
+void dds_loader_frommem(struct texture_hook_info *thinfo, const void *fdataptr, unsigned fdatalen)
+{
+    int width, height, bitcount;
+    void *bits = load_image_bits(fdataptr, fdatalen, &width, &height, &bitcount, thinfo->mem_allocator);
+    if (bits) {
+        thinfo->bits = bits;
+        thinfo->width = width;
+        thinfo->height = height;
+        thinfo->bitcount = bitcount;
+        thinfo->div_alpha = 0;
+    }
+}
+
 static void dds_loader(struct texture_hook_info *thinfo)
 {
-    void *fdataptr = NULL;
-    void *bits = NULL;
+    const void *fdataptr = NULL;
     
     // check if image already loaded
     if (thinfo->bits) goto done;
@@ -19,24 +99,14 @@ static void dds_loader(struct texture_hook_info *thinfo)
     
     // try read dds file
     unsigned fdatalen;
-    fdataptr = vfs_readfile(dds_fpath, &fdatalen, thinfo->mem_allocator);
+    fdataptr = open_texture_hook_view(dds_fpath, &fdatalen);
     if (!fdataptr) goto done;
     
     // try load dds file
-    int width, height, bitcount;
-    bits = load_image_bits(fdataptr, fdatalen, &width, &height, &bitcount, thinfo->mem_allocator);
-    if (bits) {
-        thinfo->bits = bits;
-        thinfo->width = width;
-        thinfo->height = height;
-        thinfo->bitcount = bitcount;
-        thinfo->div_alpha = 0;
-        bits = NULL;
-    }
+    dds_loader_frommem(thinfo, fdataptr, fdatalen);
     
 done:
-    thinfo->mem_allocator->free(fdataptr);
-    thinfo->mem_allocator->free(bits);
+    close_texture_hook_view(fdataptr);
 }
 
 
@@ -81,19 +151,179 @@ void mark_texture_hook_noautoload(struct texture_hook_info *thinfo)
 
 
 
-static int nr_texhooks = 0;
+int nr_texhooks = 0;
 static void (*texhooks[MAX_TEXTURE_HOOKS])(struct texture_hook_info *);
 
-void add_texture_hook(void (*funcptr)(struct texture_hook_info *))
+// get file name of the module which hook belongs to
+void texhook_modname(int i, char *buf, int size)
+{
+    MEMORY_BASIC_INFORMATION mbi;
+    char modpath[MAXLINE] = "";
+    if (VirtualQuery((LPCVOID) texhooks[i], &mbi, sizeof(mbi))) {
+        GetModuleFileNameA((HMODULE) mbi.AllocationBase, modpath, sizeof(modpath));
+    }
+    snprintf(buf, size, "%s", get_filepart(modpath));
+}
+
+// hook filters
+//   path prefixes are stored in a trie, each node has a mask of hooks whose prefix ends there
+//   unfiltered hooks are in the mask of root node
+//   paths are compared case-insensitively, and '/' is treated as '\\'
+
+#define TEXHOOK_MASKWORDS ((MAX_TEXTURE_HOOKS + 31) / 32)
+
+struct texhook_filter {
+    char *cpkname; // NULL matches any
+    char *ext; // NULL matches any
+};
+
+struct texhook_trienode {
+    char ch;
+    int child;
+    int sibling;
+    unsigned mask[TEXHOOK_MASKWORDS];
+};
+
+static struct texhook_filter texhook_filters[MAX_TEXTURE_HOOKS];
+static struct texhook_trienode *texhook_trie;
+static int texhook_trie_size, texhook_trie_cap;
+static unsigned char texhook_match[MAX_TEXTURE_HOOKS]; // hooks matching current texture
+
+char texhook_normchar(char ch)
+{
+    if (ch == '/') return '\\';
+    if ('A' <= ch && ch <= 'Z') return ch + ('a' - 'A');
+    return ch;
+}
+
+static int texhook_trie_newnode(char ch)
+{
+    if (texhook_trie_size >= texhook_trie_cap) {
+        texhook_trie_cap = imax(texhook_trie_cap * 2, 64);
+        texhook_trie = realloc(texhook_trie, texhook_trie_cap * sizeof(struct texhook_trienode));
+        if (!texhook_trie) fail("can't allocate texture hook trie.");
+    }
+    struct texhook_trienode *node = &texhook_trie[texhook_trie_size];
+    memset(node, 0, sizeof(*node));
+    node->ch = ch;
+    node->child = node->sibling = -1;
+    return texhook_trie_size++;
+}
+
+static int texhook_trie_findchild(int cur, char ch)
+{
+    int i;
+    for (i = texhook_trie[cur].child; i >= 0; i = texhook_trie[i].sibling) {
+        if (texhook_trie[i].ch == ch) return i;
+    }
+    return -1;
+}
+
+static void texhook_trie_insert(const char *prefix, int hookid)
+{
+    if (!texhook_trie) texhook_trie_newnode('\0');
+    int cur = 0;
+    for (; prefix && *prefix; prefix++) {
+        char ch = texhook_normchar(*prefix);
+        int next = texhook_trie_findchild(cur, ch);
+        if (next < 0) {
+            next = texhook_trie_newnode(ch);
+            texhook_trie[next].sibling = texhook_trie[cur].child;
+            texhook_trie[cur].child = next;
+        }
+        cur = next;
+    }
+    texhook_trie[cur].mask[hookid / 32] |= 1u << (hookid % 32);
+}
+
+void add_texture_hook_filtered(void (*funcptr)(struct texture_hook_info *), const char *cpkname, const char *prefix, const char *ext)
 {
     if (nr_texhooks >= MAX_TEXTURE_HOOKS) fail("too many texture hooks.");
+    struct texhook_filter *filter = &texhook_filters[nr_texhooks];
+    filter->cpkname = cpkname && *cpkname ? strdup(cpkname) : NULL;
+    filter->ext = ext && *ext ? strdup(ext) : NULL;
+    texhook_trie_insert(prefix, nr_texhooks);
     texhooks[nr_texhooks++] = funcptr;
 }
+void add_texture_hook(void (*funcptr)(struct texture_hook_info *))
+{
+    add_texture_hook_filtered(funcptr, NULL, NULL, NULL);
+}
+
+// find hooks matching current texture, result is stored in texhook_match
+static void match_texture_hooks(struct texture_hook_info *thinfo)
+{
+    unsigned mask[TEXHOOK_MASKWORDS];
+    const char *p;
+    int cur, i;
+    memset(mask, 0, sizeof(mask));
+    if (texhook_trie) {
+        for (cur = 0, p = thinfo->texpath; cur >= 0; cur = *p ? texhook_trie_findchild(cur, texhook_normchar(*p++)) : -1) {
+            for (i = 0; i < TEXHOOK_MASKWORDS; i++) mask[i] |= texhook_trie[cur].mask[i];
+        }
+    }
+
+    const char *ext = strrchr(get_filepart(thinfo->texpath), '.');
+    for (i = 0; i < nr_texhooks; i++) {
+        struct texhook_filter *filter = &texhook_filters[i];
+        texhook_match[i] = (mask[i / 32] >> (i % 32)) & 1;
+        if (filter->cpkname && stricmp(filter->cpkname, thinfo->cpkname) != 0) texhook_match[i] = 0;
+        if (filter->ext && (!ext || stricmp(filter->ext, ext) != 0)) texhook_match[i] = 0;
+    }
+}
+
+// call a texture hook, and record time spent in it
+static void call_texture_hook(int i, struct texture_hook_info *thinfo)
+{
+    if (texstat_enabled) {
+        LONGLONG t = texstat_now();
+        texhooks[i](thinfo);
+        texstat_hook(i, t);
+    } else {
+        texhooks[i](thinfo);
+    }
+}
+
 static void run_texture_hooks(struct texture_hook_info *thinfo)
 {
     int i;
     for (i = 0; i < nr_texhooks; i++) {
-        texhooks[i](thinfo);
+        if (texhook_match[i]) call_texture_hook(i, thinfo);
+    }
+}
+
+// run hooks in TH_PRE_IMAGELOAD stage, and record which hooks are interested
+// thinfo->async and thinfo->cachever are non-zero only if all interested hooks set them
+static void run_texture_hooks_pre(struct texture_hook_info *thinfo, unsigned char *hooks, unsigned *vers)
+{
+    int i;
+    int async = 1;
+    unsigned cachever = 1;
+    for (i = 0; i < nr_texhooks; i++) {
+        hooks[i] = 0;
+        vers[i] = 0;
+        if (!texhook_match[i]) continue;
+        int interested = thinfo->interested;
+        thinfo->interested = 0;
+        thinfo->async = 0;
+        thinfo->cachever = 0;
+        call_texture_hook(i, thinfo);
+        hooks[i] = !!thinfo->interested;
+        vers[i] = thinfo->cachever;
+        if (thinfo->interested && !thinfo->async) async = 0;
+        if (thinfo->interested && !thinfo->cachever) cachever = 0;
+        thinfo->interested |= interested;
+    }
+    thinfo->async = async;
+    thinfo->cachever = cachever;
+}
+
+// run hooks recorded by run_texture_hooks_pre(), for async workers
+void run_texture_hooks_masked(struct texture_hook_info *thinfo, const unsigned char *hooks)
+{
+    int i;
+    for (i = 0; i < nr_texhooks; i++) {
+        if (hooks[i]) texhooks[i](thinfo);
     }
 }
 
@@ -101,6 +331,7 @@ static void run_texture_hooks(struct texture_hook_info *thinfo)
 
 
 static struct texture_hook_info g_thinfo;
+static LARGE_INTEGER g_hitchlog_begin;
 
 static MAKE_ASMPATCH(texhook_part1)
 {
@@ -115,6 +346,9 @@ static MAKE_ASMPATCH(texhook_part1)
         texpath = this->baseclass.pName;
     }
     
+    if (texstat_enabled) texstat_begin();
+    if (hitchlog_enabled || loadtimes_enabled || benchmark_enabled || chrometrace_enabled) QueryPerformanceCounter(&g_hitchlog_begin);
+    
     // fill thinfo
     struct texture_hook_info *thinfo = &g_thinfo;
     strcpy(thinfo->cpkname, vfs_cpkname());
@@ -130,9 +364,29 @@ static MAKE_ASMPATCH(texhook_part1)
     thinfo->bitcount = 0;
     thinfo->fakewidth = 0;
     thinfo->fakeheight = 0;
+    thinfo->async = 0;
+    thinfo->cachever = 0;
+    thinfo->fastdecode = 0;
+    texdedup_curvalid = 0;
+    texcache_curvalid = 0;
+    texcache_hit = 0;
+    
+    // drop async job and mip chain if last texture failed to load
+    texasync_freejob(texasync_curjob);
+    texasync_curjob = NULL;
+    texmip_free(&texmip_cur);
+    texdxt_free(&texdxt_cur);
+    texdxt_curlevels = this->nLevels;
     
     // run hooks
-    run_texture_hooks(thinfo);
+    match_texture_hooks(thinfo);
+    unsigned char hooks[MAX_TEXTURE_HOOKS];
+    unsigned vers[MAX_TEXTURE_HOOKS];
+    if (texasync_enabled || texcache_enabled) {
+        run_texture_hooks_pre(thinfo, hooks, vers);
+    } else {
+        run_texture_hooks(thinfo);
+    }
     
     if (thinfo->interested) {
         if (fp) {
@@ -142,9 +396,13 @@ static MAKE_ASMPATCH(texhook_part1)
             fp = NULL;
         }
         
-        // call DDS loader to load image
-        dds_loader(thinfo);
+        // call DDS loader to load image, try cache and async loading first
+        int loaded = texcache_enabled && thinfo->cachever && texcache_lookup(thinfo, hooks, vers);
+        if (!loaded) loaded = texasync_enabled && thinfo->async && texasync_begin(this, thinfo, hooks);
+        if (!loaded) dds_loader(thinfo);
     }
+    if (!fp && (texdec_enabled || thinfo->fastdecode)) texdec_loader(thinfo);
+    if (texstat_enabled) texstat_stage(&texstat_cur.open_us);
     
     // oldcode
     R_ESI = R_EAX = TOUINT(fp);
@@ -226,9 +484,18 @@ static MAKE_ASMPATCH(texhook_part4)
     thinfo->bitcount = this->BitCount;
     thinfo->bits = this->pBits;
     thinfo->type = TH_POST_IMAGELOAD;
+    if (texstat_enabled) texstat_stage(&texstat_cur.decode_us);
     
-    // run hooks
-    run_texture_hooks(thinfo);
+    // run hooks, async textures are processed by workers
+    if (!texasync_curjob) {
+        if (!texcache_hit) run_texture_hooks(thinfo);
+        if (!texcache_hit && texmip_wanted(thinfo)) texmip_generate(&texmip_cur, thinfo);
+        if (!texcache_hit && texdxt_wanted(thinfo)) texdxt_generate(&texdxt_cur, thinfo, &texmip_cur, texdxt_curlevels, 1);
+        if (texcache_curvalid && !texcache_hit && thinfo->bits) texcache_write(texcache_curkey, thinfo, &texmip_cur, &texdxt_cur);
+        if (texdedup_enabled && thinfo->bits) texdedup_compute(thinfo);
+        if (!texcache_hit && texdxt_cur.levels) texdxt_placeholder(thinfo);
+    }
+    if (texstat_enabled) texstat_stage(&texstat_cur.decode_us);
     
     // write back to gbImage2D
     this->Width = thinfo->width;
@@ -250,6 +517,26 @@ static MAKE_ASMPATCH(texhook_part5)
     struct texture_hook_info *thinfo = &g_thinfo;
     if (thinfo->fakewidth) this->Width = thinfo->fakewidth;
     if (thinfo->fakeheight) this->Height = thinfo->fakeheight;
+    int statidx = texstat_enabled ? texstat_end(thinfo, this) : -1;
+    if (hitchlog_enabled || loadtimes_enabled || benchmark_enabled || chrometrace_enabled) {
+        LARGE_INTEGER end;
+        char name[MAXLINE * 2];
+        QueryPerformanceCounter(&end);
+        snprintf(name, sizeof(name), "%s|%s", thinfo->cpkname, thinfo->texpath);
+        hitchlog_event(HITCHLOG_TEXTURE, name, this->Width * this->Height * (thinfo->bitcount ? thinfo->bitcount / 8 : 4), g_hitchlog_begin.QuadPart, end.QuadPart);
+    }
+    if (texasync_curjob) {
+        texasync_bind(this, statidx);
+    } else {
+        if (texdxt_cur.levels) {
+            texdxt_apply(this, &texdxt_cur);
+        } else if (texmip_cur.levels) {
+            texmip_apply(this, &texmip_cur);
+        }
+        texmip_free(&texmip_cur);
+        texdxt_free(&texdxt_cur);
+        if (texdedup_enabled) texdedup_apply(this);
+    }
     
     // oldcode
     this->baseclass.IsLoaded = 1;
@@ -257,6 +544,13 @@ static MAKE_ASMPATCH(texhook_part5)
 
 void init_texture_hooks()
 {
+    init_texture_stat();
+    init_texture_dedup();
+    init_texture_mipmap();
+    init_texture_compress();
+    init_texture_async();
+    init_texture_cache();
+    init_texture_decode();
     INIT_ASMPATCH(texhook_part1, gboffset + 0x1002063C, 6, "\x8B\xF0\x3B\xF5\x74\x79");
     INIT_ASMPATCH(texhook_part2, gboffset + 0x1001E497, 7, "\x8B\x9C\x24\x30\x01\x00\x00");
     INIT_ASMPATCH(texhook_part3, gboffset + 0x1001E517, 7, "\x83\xC4\x10\x85\xC0\x75\x26");
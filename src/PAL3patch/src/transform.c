@@ -1,4 +1,5 @@
 #include "common.h"
+#include <emmintrin.h>
 
 void set_rect(RECT *rect, int left, int top, int right, int bottom)
 {
@@ -232,3 +233,104 @@ void transform_fpoint(fPOINT *out_fpoint, const fPOINT *fpoint, const fRECT *src
     transform_frect(&frect, &frect, src_frect, dst_frect, lr_method, tb_method, len_factor);
     set_fpoint(out_fpoint, frect.left, frect.top);
 }
+
+
+
+/*
+    precompiled transform
+    
+    every transform method is linear in (start, length) of segment,
+    so transform of left/right (or top/bottom) of a rect can be written as
+        new_low  = lo_lo * low + lo_hi * high + offset
+        new_high = hi_lo * low + hi_hi * high + offset
+    compile_transform() computes these coefficients once for given arguments of transform_frect(),
+    then the batch functions transform arrays of rects or points with them (using SSE2 if available)
+    
+    results may differ from transform_frect() in last bits of precision
+    out == in is allowed for batch functions
+*/
+static void compile_traxis(fTRAXIS *ax, double src_low, double src_total, double dst_low, double dst_total, int method, double len_factor)
+{
+    // fseg transform: start' = a * start + b * length + e, length' = m * length
+    double r = dst_total / src_total, k = len_factor;
+    double a = 0.0, b = 0.0, e = 0.0, m = k;
+    switch (method) {
+        case TR_LOW:        a = k; break;
+        case TR_HIGH:       a = k; e = dst_total - src_total * k; break;
+        case TR_CENTER:     b = -k / 2.0; e = dst_total / 2.0; break;
+        case TR_SCALE_LOW:  a = r; break;
+        case TR_SCALE_HIGH: a = r; b = r - k; break;
+        case TR_SCALE_MID:  a = r; b = (r - k) / 2.0; break;
+        default:
+            fail("invalid segment translate method: %d", method);
+    }
+    ax->lo_lo = a - b;
+    ax->lo_hi = b;
+    ax->hi_lo = a - b - m;
+    ax->hi_hi = b + m;
+    ax->offset = e + dst_low - a * src_low;
+}
+void compile_transform(fTRANSFORM *tr, const fRECT *src_frect, const fRECT *dst_frect, int lr_method, int tb_method, double len_factor)
+{
+    compile_traxis(&tr->lr, src_frect->left, get_frect_width(src_frect), dst_frect->left, get_frect_width(dst_frect), lr_method, len_factor);
+    compile_traxis(&tr->tb, src_frect->top, get_frect_height(src_frect), dst_frect->top, get_frect_height(dst_frect), tb_method, len_factor);
+}
+
+static void transform_frect_batch_scalar(fRECT *out, const fRECT *in, int count, const fTRANSFORM *tr)
+{
+    int i;
+    for (i = 0; i < count; i++) {
+        double l = in[i].left, t = in[i].top, r = in[i].right, b = in[i].bottom;
+        out[i].left = tr->lr.lo_lo * l + tr->lr.lo_hi * r + tr->lr.offset;
+        out[i].top = tr->tb.lo_lo * t + tr->tb.lo_hi * b + tr->tb.offset;
+        out[i].right = tr->lr.hi_lo * l + tr->lr.hi_hi * r + tr->lr.offset;
+        out[i].bottom = tr->tb.hi_lo * t + tr->tb.hi_hi * b + tr->tb.offset;
+    }
+}
+static void transform_fpoint_batch_scalar(fPOINT *out, const fPOINT *in, int count, const fTRANSFORM *tr)
+{
+    double ax = tr->lr.lo_lo + tr->lr.lo_hi, ay = tr->tb.lo_lo + tr->tb.lo_hi;
+    int i;
+    for (i = 0; i < count; i++) {
+        out[i].x = ax * in[i].x + tr->lr.offset;
+        out[i].y = ay * in[i].y + tr->tb.offset;
+    }
+}
+
+// SSE2 versions, fRECT is loaded as (left, top) and (right, bottom)
+static SSE2_FUNC void transform_frect_batch_sse2(fRECT *out, const fRECT *in, int count, const fTRANSFORM *tr)
+{
+    const __m128d lo_lo = _mm_set_pd(tr->tb.lo_lo, tr->lr.lo_lo);
+    const __m128d lo_hi = _mm_set_pd(tr->tb.lo_hi, tr->lr.lo_hi);
+    const __m128d hi_lo = _mm_set_pd(tr->tb.hi_lo, tr->lr.hi_lo);
+    const __m128d hi_hi = _mm_set_pd(tr->tb.hi_hi, tr->lr.hi_hi);
+    const __m128d offset = _mm_set_pd(tr->tb.offset, tr->lr.offset);
+    int i;
+    for (i = 0; i < count; i++) {
+        __m128d lt = _mm_loadu_pd(&in[i].left);
+        __m128d rb = _mm_loadu_pd(&in[i].right);
+        __m128d nlt = _mm_add_pd(_mm_add_pd(_mm_mul_pd(lo_lo, lt), _mm_mul_pd(lo_hi, rb)), offset);
+        __m128d nrb = _mm_add_pd(_mm_add_pd(_mm_mul_pd(hi_lo, lt), _mm_mul_pd(hi_hi, rb)), offset);
+        _mm_storeu_pd(&out[i].left, nlt);
+        _mm_storeu_pd(&out[i].right, nrb);
+    }
+}
+static SSE2_FUNC void transform_fpoint_batch_sse2(fPOINT *out, const fPOINT *in, int count, const fTRANSFORM *tr)
+{
+    const __m128d scale = _mm_set_pd(tr->tb.lo_lo + tr->tb.lo_hi, tr->lr.lo_lo + tr->lr.lo_hi);
+    const __m128d offset = _mm_set_pd(tr->tb.offset, tr->lr.offset);
+    int i;
+    for (i = 0; i < count; i++) {
+        __m128d p = _mm_loadu_pd(&in[i].x);
+        _mm_storeu_pd(&out[i].x, _mm_add_pd(_mm_mul_pd(scale, p), offset));
+    }
+}
+
+void transform_frect_batch(fRECT *out_frect, const fRECT *frect, int count, const fTRANSFORM *tr)
+{
+    if (pixel_has_sse2()) transform_frect_batch_sse2(out_frect, frect, count, tr); else transform_frect_batch_scalar(out_frect, frect, count, tr);
+}
+void transform_fpoint_batch(fPOINT *out_fpoint, const fPOINT *fpoint, int count, const fTRANSFORM *tr)
+{
+    if (pixel_has_sse2()) transform_fpoint_batch_sse2(out_fpoint, fpoint, count, tr); else transform_fpoint_batch_scalar(out_fpoint, fpoint, count, tr);
+}
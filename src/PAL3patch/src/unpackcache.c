@@ -0,0 +1,385 @@
+#include "common.h"
+
+// unpacked image cache
+//   running the external unpacker takes a noticeable time on every launch,
+//   so after it has run, sections of PAL3.EXE are saved to UNPACKCACHE_FILE,
+//   and on next launch they are copied back directly, without loading the unpacker
+//
+//   IAT items are saved as imported names, since system DLLs may be loaded
+//   at other addresses, and they are linked again when restoring
+//   image is not cached if an IAT item can't be resolved to an export,
+//   e.g. it points into the unpacker
+//   image is not cached either if its sections still refer to the unpacker,
+//   i.e. contain an absolute pointer or a CALL/JMP/Jcc rel32 into the unpacker
+//   module, since the unpacker is not loaded when restoring from cache
+//   cache is only used when SHA1 of PAL3.EXE and the unpacker are unchanged
+//
+//   file layout:
+//     struct unpackcache_filehdr
+//     struct unpackcache_page [nr_pages] (pages of all zeros are not stored)
+//     struct unpackcache_import [nr_imports]
+//     sha1 of all above
+
+#define UNPACKCACHE_FILE "PAL3patch.unpackcache"
+#define UNPACKCACHE_MAGIC 0x4B434355 // "UCCK"
+#define UNPACKCACHE_VERSION 1
+#define UNPACKCACHE_PAGESIZE 4096
+#define UNPACKCACHE_MAXPAGES 0x2000
+#define UNPACKCACHE_MAXIMPORTS 1024
+
+struct unpackcache_filehdr {
+    unsigned magic;
+    unsigned version;
+    unsigned char exesum[20];
+    unsigned char unpackersum[20];
+    unsigned nr_pages;
+    unsigned nr_imports;
+};
+struct unpackcache_page {
+    DWORD addr;
+    unsigned char data[UNPACKCACHE_PAGESIZE];
+};
+struct unpackcache_import {
+    DWORD slot;
+    char dllname[MAX_PATH];
+    char funcname[128]; // empty if imported by ordinal
+    WORD ordinal;
+};
+
+int unpackcache_pending = 0;
+
+static int unpackcache_filesum(const char *filename, unsigned char sum[20])
+{
+    FILE *fp = robust_fopen(filename, "rb");
+    unsigned char *buf;
+    size_t len;
+    SHA1_CTX ctx;
+    int ret = 0;
+    if (!fp) return 0;
+    buf = malloc(65536);
+    if (!buf) goto done;
+    SHA1Init(&ctx);
+    while ((len = fread(buf, 1, 65536, fp)) > 0) {
+        SHA1Update(&ctx, buf, len);
+    }
+    if (!ferror(fp)) {
+        SHA1Final(sum, &ctx);
+        ret = 1;
+    }
+    free(buf);
+done:
+    fclose(fp);
+    return ret;
+}
+
+static int unpackcache_keysum(struct unpackcache_filehdr *hdr)
+{
+    char exepath[MAXLINE];
+    if (!GetModuleFileNameA(NULL, exepath, sizeof(exepath))) return 0;
+    return unpackcache_filesum(exepath, hdr->exesum) && unpackcache_filesum(EXTERNAL_UNPACKER, hdr->unpackersum);
+}
+
+// call func for each page of PAL3.EXE sections
+static void unpackcache_foreach_page(void (*func)(unsigned char *page, void *arg), void *arg)
+{
+    void *image_base = GetModuleHandle(NULL);
+    PIMAGE_DOS_HEADER pdoshdr = image_base;
+    PIMAGE_NT_HEADERS pnthdr = PTRADD(image_base, pdoshdr->e_lfanew);
+    PIMAGE_SECTION_HEADER psecthdr = PTRADD(image_base, pdoshdr->e_lfanew + sizeof(IMAGE_NT_HEADERS));
+    int sections = pnthdr->FileHeader.NumberOfSections;
+    int i;
+    for (i = 0; i < sections; i++) {
+        unsigned char *begin = PTRADD(image_base, psecthdr[i].VirtualAddress);
+        unsigned char *end = begin + (psecthdr[i].Misc.VirtualSize + UNPACKCACHE_PAGESIZE - 1) / UNPACKCACHE_PAGESIZE * UNPACKCACHE_PAGESIZE;
+        for (; begin < end; begin += UNPACKCACHE_PAGESIZE) {
+            func(begin, arg);
+        }
+    }
+}
+
+// find exported name of a function pointer, returns 0 if it is not an export
+static int unpackcache_findexport(void *funcptr, struct unpackcache_import *imp)
+{
+    MEMORY_BASIC_INFORMATION mbi;
+    char path[MAXLINE];
+    DWORD i, j;
+
+    if (!VirtualQuery(funcptr, &mbi, sizeof(mbi)) || !mbi.AllocationBase) return 0;
+    if (!GetModuleFileNameA(mbi.AllocationBase, path, sizeof(path))) return 0;
+
+    void *base = mbi.AllocationBase;
+    PIMAGE_DOS_HEADER pdoshdr = base;
+    PIMAGE_NT_HEADERS pnthdr = PTRADD(base, pdoshdr->e_lfanew);
+    PIMAGE_DATA_DIRECTORY pdir = &pnthdr->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT];
+    if (!pdir->VirtualAddress) return 0;
+    PIMAGE_EXPORT_DIRECTORY pexp = PTRADD(base, pdir->VirtualAddress);
+    DWORD *funcs = PTRADD(base, pexp->AddressOfFunctions);
+    DWORD *names = PTRADD(base, pexp->AddressOfNames);
+    WORD *ordinals = PTRADD(base, pexp->AddressOfNameOrdinals);
+    DWORD rva = TOUINT(funcptr) - TOUINT(base);
+
+    for (i = 0; i < pexp->NumberOfFunctions; i++) {
+        if (funcs[i] != rva) continue;
+        snprintf(imp->dllname, sizeof(imp->dllname), "%s", get_filepart(path));
+        imp->funcname[0] = 0;
+        imp->ordinal = pexp->Base + i;
+        for (j = 0; j < pexp->NumberOfNames; j++) {
+            if ((DWORD) ordinals[j] == i) {
+                snprintf(imp->funcname, sizeof(imp->funcname), "%s", (const char *) PTRADD(base, names[j]));
+                break;
+            }
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// find a reference into [lo, hi) in PAL3.EXE sections, returns 0 if none
+static DWORD unpackcache_findref(DWORD lo, DWORD hi)
+{
+    void *image_base = GetModuleHandle(NULL);
+    PIMAGE_DOS_HEADER pdoshdr = image_base;
+    PIMAGE_NT_HEADERS pnthdr = PTRADD(image_base, pdoshdr->e_lfanew);
+    PIMAGE_SECTION_HEADER psecthdr = PTRADD(image_base, pdoshdr->e_lfanew + sizeof(IMAGE_NT_HEADERS));
+    int sections = pnthdr->FileHeader.NumberOfSections;
+    int i;
+    for (i = 0; i < sections; i++) {
+        unsigned char *begin = PTRADD(image_base, psecthdr[i].VirtualAddress);
+        unsigned char *end = begin + psecthdr[i].Misc.VirtualSize;
+        unsigned char *p;
+        for (p = begin; p + 4 <= end; p++) {
+            DWORD val = *(DWORD *) p;
+            if (val >= lo && val < hi) return TOUINT(p);
+            // relative branch: E8/E9 rel32, or 0F 8x rel32
+            if (p > begin && (p[-1] == 0xE8 || p[-1] == 0xE9 || (p - 1 > begin && p[-2] == 0x0F && (p[-1] & 0xF0) == 0x80))) {
+                DWORD target = TOUINT(p) + 4 + val;
+                if (target >= lo && target < hi) return TOUINT(p);
+            }
+        }
+    }
+    return 0;
+}
+
+static int unpackcache_isimage(void *ptr)
+{
+    // IAT area may contain other data, only pointers into other loaded modules are imports
+    MEMORY_BASIC_INFORMATION mbi;
+    if (!VirtualQuery(ptr, &mbi, sizeof(mbi))) return 0;
+    return mbi.Type == MEM_IMAGE && mbi.AllocationBase != GetModuleHandle(NULL);
+}
+
+
+struct unpackcache_saver {
+    FILE *fp;
+    SHA1_CTX ctx;
+    unsigned nr_pages;
+};
+
+static void unpackcache_write(struct unpackcache_saver *s, const void *data, size_t size)
+{
+    fwrite(data, 1, size, s->fp);
+    SHA1Update(&s->ctx, data, size);
+}
+
+static int unpackcache_iszero(const unsigned char *page)
+{
+    int i;
+    for (i = 0; i < UNPACKCACHE_PAGESIZE; i++) {
+        if (page[i]) return 0;
+    }
+    return 1;
+}
+
+static void unpackcache_countpage(unsigned char *page, void *arg)
+{
+    if (!unpackcache_iszero(page)) ++*(unsigned *) arg;
+}
+
+static void unpackcache_savepage(unsigned char *page, void *arg)
+{
+    struct unpackcache_saver *s = arg;
+    if (unpackcache_iszero(page)) return;
+    DWORD addr = TOUINT(page);
+    unpackcache_write(s, &addr, sizeof(addr));
+    unpackcache_write(s, page, UNPACKCACHE_PAGESIZE);
+    s->nr_pages++;
+}
+
+// save unpacked image, must be called before anything of PAL3.EXE is patched
+void unpackcache_save()
+{
+    struct unpackcache_filehdr hdr;
+    struct unpackcache_saver s;
+    struct bvec imports; // struct unpackcache_import
+    unsigned char sum[20];
+    DWORD slot, ref;
+    HMODULE unpacker;
+    int i, n;
+
+    unpackcache_pending = 0;
+    startup_begin("unpackcache_save");
+    bvec_ctor(&imports);
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = UNPACKCACHE_MAGIC;
+    hdr.version = UNPACKCACHE_VERSION;
+    if (!unpackcache_keysum(&hdr)) goto fail;
+
+    // code pointers into the unpacker would dangle when restoring from cache
+    unpacker = GetModuleHandle(EXTERNAL_UNPACKER);
+    if (!unpacker) unpacker = GetModuleHandle(EXTERNAL_UNPACKER_FIXED);
+    if (unpacker) {
+        PIMAGE_DOS_HEADER pdoshdr = (void *) unpacker;
+        PIMAGE_NT_HEADERS pnthdr = PTRADD(unpacker, pdoshdr->e_lfanew);
+        DWORD lo = TOUINT(unpacker);
+        DWORD hi = lo + pnthdr->OptionalHeader.SizeOfImage;
+        if ((ref = unpackcache_findref(lo, hi)) != 0) {
+            warning("PAL3.EXE refers to unpacker at %08X, image is not cached.", ref);
+            goto done;
+        }
+    }
+
+    for (slot = PAL3_IAT_BEGIN; slot < PAL3_IAT_END; slot += sizeof(void *)) {
+        void *funcptr = *(void **) TOPTR(slot);
+        struct unpackcache_import imp;
+        if (!funcptr || !unpackcache_isimage(funcptr)) continue;
+        memset(&imp, 0, sizeof(imp));
+        imp.slot = slot;
+        if (!unpackcache_findexport(funcptr, &imp)) {
+            warning("IAT item %08X -> %08X is not an export, image is not cached.", slot, TOUINT(funcptr));
+            goto done;
+        }
+        bvec_tpushback(&imports, &imp, struct unpackcache_import);
+    }
+    hdr.nr_imports = bvec_tsize(&imports, struct unpackcache_import);
+    unpackcache_foreach_page(unpackcache_countpage, &hdr.nr_pages);
+
+    s.fp = robust_fopen(UNPACKCACHE_FILE, "wb");
+    if (!s.fp) goto fail;
+    s.nr_pages = 0;
+    SHA1Init(&s.ctx);
+    unpackcache_write(&s, &hdr, sizeof(hdr));
+    unpackcache_foreach_page(unpackcache_savepage, &s);
+    n = bvec_tsize(&imports, struct unpackcache_import);
+    for (i = 0; i < n; i++) {
+        unpackcache_write(&s, &bvec_tat(&imports, i, struct unpackcache_import), sizeof(struct unpackcache_import));
+    }
+    SHA1Final(sum, &s.ctx);
+    fwrite(sum, sizeof(sum), 1, s.fp);
+    if (safe_fclose(&s.fp) != 0 || s.nr_pages != hdr.nr_pages) {
+        robust_unlink(UNPACKCACHE_FILE);
+        goto fail;
+    }
+    plog("unpacked image cached, %u pages, %u imports.", hdr.nr_pages, hdr.nr_imports);
+    goto done;
+fail:
+    warning("can't write unpacked image cache file '%s'.", UNPACKCACHE_FILE);
+done:
+    bvec_dtor(&imports);
+    startup_end();
+}
+
+
+struct unpackcache_loader {
+    struct unpackcache_page *pages;
+    unsigned nr_pages;
+    unsigned cur;
+};
+
+static void unpackcache_loadpage(unsigned char *page, void *arg)
+{
+    struct unpackcache_loader *l = arg;
+    // pages are stored in the same order
+    if (l->cur < l->nr_pages && l->pages[l->cur].addr == TOUINT(page)) {
+        memcpy(page, l->pages[l->cur].data, UNPACKCACHE_PAGESIZE);
+        l->cur++;
+    } else {
+        memset(page, 0, UNPACKCACHE_PAGESIZE);
+    }
+}
+
+static void unpackcache_protect(unsigned char *page, void *arg)
+{
+    DWORD flOldProtect;
+    if (!VirtualProtect(page, UNPACKCACHE_PAGESIZE, PAGE_EXECUTE_READWRITE, &flOldProtect)) *(int *) arg = 0;
+}
+
+// restore unpacked image from cache, returns 0 if cache can't be used
+int unpackcache_load()
+{
+    struct unpackcache_filehdr hdr, key;
+    struct unpackcache_loader l;
+    struct unpackcache_import *imports = NULL;
+    FARPROC *funcptrs = NULL;
+    unsigned char sum[20], filesum[20];
+    SHA1_CTX ctx;
+    unsigned i;
+    int ret = 0;
+
+    startup_begin("unpackcache_load");
+    memset(&l, 0, sizeof(l));
+    FILE *fp = robust_fopen(UNPACKCACHE_FILE, "rb");
+    if (!fp) goto done;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1) goto bad;
+    if (hdr.magic != UNPACKCACHE_MAGIC || hdr.version != UNPACKCACHE_VERSION) goto bad;
+    if (hdr.nr_pages > UNPACKCACHE_MAXPAGES || hdr.nr_imports > UNPACKCACHE_MAXIMPORTS) goto bad;
+    if (!unpackcache_keysum(&key)) goto bad;
+    if (memcmp(hdr.exesum, key.exesum, sizeof(hdr.exesum)) != 0 || memcmp(hdr.unpackersum, key.unpackersum, sizeof(hdr.unpackersum)) != 0) {
+        plog("unpacked image cache is outdated.");
+        goto close;
+    }
+
+    l.nr_pages = hdr.nr_pages;
+    l.pages = malloc(imax(l.nr_pages, 1) * sizeof(struct unpackcache_page));
+    imports = malloc(imax(hdr.nr_imports, 1) * sizeof(struct unpackcache_import));
+    funcptrs = malloc(imax(hdr.nr_imports, 1) * sizeof(FARPROC));
+    if (!l.pages || !imports || !funcptrs) goto bad;
+    if (fread(l.pages, sizeof(struct unpackcache_page), l.nr_pages, fp) != l.nr_pages) goto bad;
+    if (fread(imports, sizeof(struct unpackcache_import), hdr.nr_imports, fp) != hdr.nr_imports) goto bad;
+    if (fread(filesum, sizeof(filesum), 1, fp) != 1) goto bad;
+
+    SHA1Init(&ctx);
+    SHA1Update(&ctx, (const unsigned char *) &hdr, sizeof(hdr));
+    SHA1Update(&ctx, (const unsigned char *) l.pages, l.nr_pages * sizeof(struct unpackcache_page));
+    SHA1Update(&ctx, (const unsigned char *) imports, hdr.nr_imports * sizeof(struct unpackcache_import));
+    SHA1Final(sum, &ctx);
+    if (memcmp(sum, filesum, sizeof(sum)) != 0) goto bad;
+
+    // resolve imports before touching image, so a failure leaves image untouched
+    for (i = 0; i < hdr.nr_imports; i++) {
+        struct unpackcache_import *imp = &imports[i];
+        imp->dllname[sizeof(imp->dllname) - 1] = 0;
+        imp->funcname[sizeof(imp->funcname) - 1] = 0;
+        HMODULE hmod = LoadLibraryA(imp->dllname);
+        funcptrs[i] = hmod ? GetProcAddress(hmod, imp->funcname[0] ? imp->funcname : (LPCSTR) (ULONG_PTR) imp->ordinal) : NULL;
+        if (!funcptrs[i] || imp->slot < PAL3_IAT_BEGIN || imp->slot >= PAL3_IAT_END) {
+            warning("can't resolve import %s!%s, unpacked image cache is not used.", imp->dllname, imp->funcname);
+            goto close;
+        }
+    }
+
+    int writable = 1;
+    unpackcache_foreach_page(unpackcache_protect, &writable);
+    if (!writable) {
+        warning("can't unprotect PAL3.EXE, unpacked image cache is not used.");
+        goto close;
+    }
+    unpackcache_foreach_page(unpackcache_loadpage, &l);
+    for (i = 0; i < hdr.nr_imports; i++) {
+        memcpy(TOPTR(imports[i].slot), &funcptrs[i], sizeof(FARPROC));
+    }
+    FlushInstructionCache(GetCurrentProcess(), NULL, 0);
+    plog("unpacked image restored from cache, %u pages, %u imports.", hdr.nr_pages, hdr.nr_imports);
+    ret = 1;
+    goto close;
+bad:
+    warning("invalid unpacked image cache file, ignored.");
+close:
+    fclose(fp);
+done:
+    free(l.pages);
+    free(imports);
+    free(funcptrs);
+    startup_end();
+    return ret;
+}
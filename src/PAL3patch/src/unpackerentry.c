@@ -13,3 +13,16 @@ __declspec(naked) void sforce_unpacker_entry(void)
         RET
     }
 }
+
+extern void cached_unpacker_init(void);
+
+// used instead of unpacker entry when unpacked image is restored from cache
+__declspec(naked) void cached_unpacker_entry(void)
+{
+    __asm {
+        PUSHAD
+        CALL cached_unpacker_init
+        POPAD
+        RET
+    }
+}
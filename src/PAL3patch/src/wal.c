@@ -2,7 +2,7 @@
 
 // simple write-ahead logging for atomic file replacement
 
-#define DATABUF_SIZE 4096
+#define DATABUF_SIZE 65536
 
 struct wal_checksum {
     unsigned char digest[20];
@@ -10,13 +10,15 @@ struct wal_checksum {
 static int calc_file_checksum(FILE *fp, struct wal_checksum *csum)
 {
 	int success = 1;
-	unsigned char databuf[DATABUF_SIZE];
+	unsigned char *databuf;
 	size_t datalen;
 	SHA1_CTX ctx;
 
+	databuf = malloc(DATABUF_SIZE);
+	if (!databuf) return 0;
 	SHA1Init(&ctx);
 	while (!feof(fp)) {
-        datalen = fread(databuf, 1, sizeof(databuf), fp);
+        datalen = fread(databuf, 1, DATABUF_SIZE, fp);
         if (ferror(fp)) {
             success = 0;
             break;
@@ -26,18 +28,114 @@ static int calc_file_checksum(FILE *fp, struct wal_checksum *csum)
         }
 	}
 	SHA1Final(csum->digest, &ctx);
+	free(databuf);
 
     return success;
 }
 
+// digests computed in this run, keyed by path, size and mtime
+//   a redo in this run (e.g. commit failed on a locked file) can skip rehashing
+//   not persisted, so recovery after a crash always hashes
+#define WAL_MAXDIGEST 16
+
+struct wal_digest {
+    char *path;
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    struct wal_checksum csum;
+};
+static struct wal_digest digest_cache[WAL_MAXDIGEST];
+static unsigned digest_next;
+static CRITICAL_SECTION digest_cs;
+
+static int get_file_attr(const char *path, WIN32_FILE_ATTRIBUTE_DATA *attr)
+{
+    return !!GetFileAttributesExA(path, GetFileExInfoStandard, attr);
+}
+
+static int same_file_attr(const WIN32_FILE_ATTRIBUTE_DATA *a, const WIN32_FILE_ATTRIBUTE_DATA *b)
+{
+    return a->nFileSizeLow == b->nFileSizeLow && a->nFileSizeHigh == b->nFileSizeHigh && CompareFileTime(&a->ftLastWriteTime, &b->ftLastWriteTime) == 0;
+}
+
+static struct wal_digest *digest_find(const char *path)
+{
+    int i;
+    for (i = 0; i < WAL_MAXDIGEST; i++) {
+        if (digest_cache[i].path && stricmp(digest_cache[i].path, path) == 0) return &digest_cache[i];
+    }
+    return NULL;
+}
+
+static void digest_forget_locked(const char *path)
+{
+    struct wal_digest *d = digest_find(path);
+    if (d) {
+        free(d->path);
+        d->path = NULL;
+    }
+}
+
+static void digest_store(const char *path, const struct wal_checksum *csum)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    if (!get_file_attr(path, &attr)) return;
+    EnterCriticalSection(&digest_cs);
+    struct wal_digest *d = digest_find(path);
+    if (!d) {
+        d = &digest_cache[digest_next++ % WAL_MAXDIGEST];
+        free(d->path);
+        d->path = strdup(path);
+    }
+    d->attr = attr;
+    d->csum = *csum;
+    LeaveCriticalSection(&digest_cs);
+}
+
+static int digest_lookup(const char *path, struct wal_checksum *csum)
+{
+    int ret = 0;
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    if (!get_file_attr(path, &attr)) return 0;
+    EnterCriticalSection(&digest_cs);
+    struct wal_digest *d = digest_find(path);
+    if (d && same_file_attr(&d->attr, &attr)) {
+        *csum = d->csum;
+        ret = 1;
+    }
+    LeaveCriticalSection(&digest_cs);
+    return ret;
+}
+
+static void digest_move(const char *oldpath, const char *newpath)
+{
+    // rename keeps size and mtime
+    EnterCriticalSection(&digest_cs);
+    digest_forget_locked(newpath);
+    struct wal_digest *d = digest_find(oldpath);
+    if (d) {
+        free(d->path);
+        d->path = strdup(newpath);
+    }
+    LeaveCriticalSection(&digest_cs);
+}
+
+static void digest_forget(const char *path)
+{
+    EnterCriticalSection(&digest_cs);
+    digest_forget_locked(path);
+    LeaveCriticalSection(&digest_cs);
+}
+
 static int copy_file_contents(FILE *dstfp, FILE *srcfp)
 {
     int success = 1;
-    char databuf[DATABUF_SIZE];
+    char *databuf;
     size_t datalen;
     
+    databuf = malloc(DATABUF_SIZE);
+    if (!databuf) return 0;
     while (!feof(srcfp)) {
-        datalen = fread(databuf, 1, sizeof(databuf), srcfp);
+        datalen = fread(databuf, 1, DATABUF_SIZE, srcfp);
         if (ferror(srcfp)) {
             success = 0;
             break;
@@ -49,11 +147,15 @@ static int copy_file_contents(FILE *dstfp, FILE *srcfp)
             }
         }
     }
+    free(databuf);
     
     return success;
 }
 
 // internal: overwrite dst with src, then destory checksum
+//   src is moved over dst if possible, so it's written only once,
+//   otherwise (e.g. win9x) src is copied to dst
+//   src may be already moved if redoing an interrupted commit
 static int do_overwrite(const char *dst[], const char *src[], int n, const char *sum)
 {
     int i;
@@ -62,6 +164,13 @@ static int do_overwrite(const char *dst[], const char *src[], int n, const char
     FILE *sumfp = NULL;
     
     for (i = 0; i < n; i++) {
+        if (!file_exists(src[i])) continue;
+        if (robust_rename(src[i], dst[i]) == 0) {
+            digest_move(src[i], dst[i]);
+            continue;
+        }
+        digest_forget(dst[i]);
+        
         srcfp = robust_fopen(src[i], "rb");
         if (!srcfp) goto fail;
         
@@ -98,6 +207,7 @@ static int do_cleanup(const char *src[], int n, const char *sum)
     if (robust_unlink(sum) != 0 && errno != ENOENT) success = 0;
     
     for (i = 0; i < n; i++) {
+        digest_forget(src[i]);
         if (robust_unlink(src[i]) != 0 && errno != ENOENT) success = 0;
     }
     
@@ -132,6 +242,8 @@ static int wal_replaceN(const char *dst[], const char *src[], int n, const char
         
         if (fflush(srcfp) != 0) goto fail;
         safe_fclose(&srcfp);
+        
+        digest_store(src[i], &csum);
     }
     
     if (fflush(sumfp) != 0) goto fail;
@@ -162,12 +274,17 @@ static int wal_checkN(const char *dst[], const char *src[], int n, const char *s
         
         if (fread(&csum1, sizeof(csum1), 1, sumfp) != 1) goto undo;
 
-        srcfp = robust_fopen(src[i], "rb");
-        if (!srcfp) goto undo;
+        // src may be already moved to dst by an interrupted commit
+        const char *path = file_exists(src[i]) ? src[i] : dst[i];
         
-        if (!calc_file_checksum(srcfp, &csum2)) goto undo;
+        if (!digest_lookup(path, &csum2)) {
+            srcfp = robust_fopen(path, "rb");
+            if (!srcfp) goto undo;
+            
+            if (!calc_file_checksum(srcfp, &csum2)) goto undo;
 
-        safe_fclose(&srcfp);
+            safe_fclose(&srcfp);
+        }
         
         if (memcmp(&csum1, &csum2, sizeof(struct wal_checksum)) != 0) goto undo;
     }
@@ -184,6 +301,11 @@ undo:
     return do_cleanup(src, n, sum);
 }
 
+void init_wal(void)
+{
+    InitializeCriticalSection(&digest_cs);
+}
+
 int wal_replace(char *dst[], char *src[], int n, const char *sum)
 {
     return wal_replaceN((const char **) dst, (const char **) src, n, sum);
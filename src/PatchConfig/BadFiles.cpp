@@ -1,10 +1,46 @@
 #include "stdafx.h"
 
 #ifdef BUILD_FOR_PAL3A
+
+typedef HANDLE (WINAPI *FindFirstFileExA_funcptr_t)(LPCSTR lpFileName, int fInfoLevelId, LPVOID lpFindFileData, int fSearchOp, LPVOID lpSearchFilter, DWORD dwAdditionalFlags);
+
+#define MyFindExInfoBasic ((int) 1)
+#define MyFindExSearchNameMatch ((int) 0)
+#define MyFIND_FIRST_EX_LARGE_FETCH 2
+
+// enumerate current directory once, set found[i] if names[i] exists
+//   names ends with NULL
+static void FindFilesInCurrentDirectory(const char **names, bool *found)
+{
+	WIN32_FIND_DATAA fd;
+	HANDLE hFind = INVALID_HANDLE_VALUE;
+	const char **ptr;
+
+	// basic info level and large fetch are only supported since Windows 7
+	HMODULE hKERNEL32 = GetModuleHandle(_T("KERNEL32.DLL"));
+	FindFirstFileExA_funcptr_t MyFindFirstFileExA = hKERNEL32 ? (FindFirstFileExA_funcptr_t) GetProcAddress(hKERNEL32, "FindFirstFileExA") : NULL;
+	if (MyFindFirstFileExA) {
+		hFind = MyFindFirstFileExA("*", MyFindExInfoBasic, &fd, MyFindExSearchNameMatch, NULL, MyFIND_FIRST_EX_LARGE_FETCH);
+	}
+	if (hFind == INVALID_HANDLE_VALUE) {
+		hFind = FindFirstFileA("*", &fd);
+	}
+	if (hFind == INVALID_HANDLE_VALUE) return;
+
+	do {
+		for (ptr = names; *ptr; ptr++) {
+			if (_stricmp(fd.cFileName, *ptr) == 0) {
+				found[ptr - names] = true;
+			}
+		}
+	} while (FindNextFileA(hFind, &fd));
+	FindClose(hFind);
+}
+
 void CheckBadFilesForPAL3A()
 {
-	const char *main_exe = "PAL3A.exe";
-	static const char *bad_files[] = {
+	static const char *files[] = {
+		"PAL3A.exe", // main exe, must be first
 #ifndef _DEBUG
 		"BugslayerUtil.dll",
 		"CollidePackage.dll",
@@ -15,14 +51,17 @@ void CheckBadFilesForPAL3A()
 #endif
 		NULL // EOF
 	};
+	bool found[sizeof(files) / sizeof(files[0])];
 
 	CString buf;
 	const char **ptr;
 	
-	if (!file_exists(main_exe)) return;
+	memset(found, 0, sizeof(found));
+	FindFilesInCurrentDirectory(files, found);
+	if (!found[0]) return;
 	buf.Empty();
-	for (ptr = bad_files; *ptr; ptr++) {
-		if (file_exists(*ptr)) {
+	for (ptr = files + 1; *ptr; ptr++) {
+		if (found[ptr - files]) {
 			buf += "    ";
 			buf += *ptr;
 			buf += "\n";
@@ -33,8 +72,8 @@ void CheckBadFilesForPAL3A()
 		msg.Format(IDS_HAVEBADFILE, (LPCTSTR) buf);
 		if (GetPleaseWaitDlg()->MessageBox(msg, STRTABLE(IDS_HAVEBADFILE_TITLE), MB_ICONWARNING | MB_YESNO | MB_DEFBUTTON1 | MB_TOPMOST | MB_SETFOREGROUND) == IDYES) {
 			buf.Empty();
-			for (ptr = bad_files; *ptr; ptr++) {
-				if (robust_unlink(*ptr) != 0 && errno != ENOENT) {
+			for (ptr = files + 1; *ptr; ptr++) {
+				if (found[ptr - files] && robust_unlink(*ptr) != 0 && errno != ENOENT) {
 					buf += "    ";
 					buf += *ptr;
 					buf += "\n";
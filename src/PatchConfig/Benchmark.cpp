@@ -0,0 +1,249 @@
+#include "stdafx.h"
+
+#ifdef BUILD_FOR_PAL3
+#define BENCHMARK_GAME_EXE     _T("PAL3.exe")
+#define BENCHMARK_RECORD_FILE  "PAL3patch.benchmark"
+#define BENCHMARK_HISTORY_FILE "PAL3patch.benchmark.history"
+#define FRAMETRACE_FILE        "PAL3patch.frametrace.csv"
+#endif
+
+#ifdef BUILD_FOR_PAL3A
+#define BENCHMARK_GAME_EXE     _T("PAL3A.exe")
+#define BENCHMARK_RECORD_FILE  "PAL3Apatch.benchmark"
+#define BENCHMARK_HISTORY_FILE "PAL3Apatch.benchmark.history"
+#define FRAMETRACE_FILE        "PAL3Apatch.frametrace.csv"
+#endif
+
+#define BENCHMARK_LONGFRAME_MS 250.0 // same as the patch, longer frames are counted as loading
+#define BENCHMARK_MAXSHOW 5
+
+// benchmark runner
+//   the game is launched in benchmark replay mode (benchmark=2) with current settings,
+//   frame trace is enabled for this run, and summarized after game exits
+//   results are appended to BENCHMARK_HISTORY_FILE, recent ones are shown together
+//
+//   history file format (UTF-8), one run per line:
+//     AVGFPS LOWFPS LATENCY|VALUE1|VALUE2|...   (values of BenchmarkKeys)
+
+static LPCTSTR BenchmarkKeys[] = {
+	_T("game_resolution"),
+	_T("game_multisample"),
+	_T("reduceinputlatency"),
+	_T("game_fpslimit"),
+};
+#define BENCHMARK_NKEYS ((int) (sizeof(BenchmarkKeys) / sizeof(BenchmarkKeys[0])))
+
+struct benchmark_result {
+	double avgfps;
+	double lowfps;  // 1% low, from 99th percentile frame time
+	double latency; // average time between pre-EndScene and post-Present, in ms
+	CString values[BENCHMARK_NKEYS];
+};
+
+static CString Utf8ToCString(const char *str)
+{
+	static wchar_t *buf_w = NULL;
+#if defined(_MBCS)
+	static char *buf_a = NULL;
+#endif
+	cs2wcs_managed(str, CP_UTF8, &buf_w);
+#if defined(_UNICODE)
+	return CString(buf_w);
+#elif defined(_MBCS)
+	wcs2cs_managed(buf_w, CP_ACP, &buf_a);
+	return CString(buf_a);
+#else
+#error
+#endif
+}
+
+static const char *CStringToUtf8(LPCTSTR str)
+{
+	static char *buf_utf8 = NULL;
+#if defined(_UNICODE)
+	return wcs2cs_managed(str, CP_UTF8, &buf_utf8);
+#elif defined(_MBCS)
+	static wchar_t *buf_w = NULL;
+	cs2wcs_managed(str, CP_ACP, &buf_w);
+	return wcs2cs_managed(buf_w, CP_UTF8, &buf_utf8);
+#else
+#error
+#endif
+}
+
+static int SummarizeFrameTrace(benchmark_result *r)
+{
+	char buf[MAXLINE];
+	std::vector<double> ft;
+	double sum = 0, latsum = 0;
+	unsigned frame;
+	double t, present, update, endscene;
+	unsigned n, p99;
+
+	FILE *fp = robust_fopen(FRAMETRACE_FILE, "r");
+	if (!fp) return 0;
+	while (fgets(buf, sizeof(buf), fp)) {
+		// header line is skipped here too
+		if (sscanf(buf, "%u,%lf,%lf,%lf,%lf", &frame, &t, &present, &update, &endscene) != 5) continue;
+		if (present <= 0 || present >= BENCHMARK_LONGFRAME_MS) continue;
+		ft.push_back(present);
+		sum += present;
+		latsum += endscene;
+	}
+	fclose(fp);
+
+	n = ft.size();
+	if (n == 0) return 0;
+	std::sort(ft.begin(), ft.end());
+	p99 = n * 99 / 100;
+	if (p99 >= n) p99 = n - 1;
+	r->avgfps = n * 1000.0 / sum;
+	r->lowfps = 1000.0 / ft[p99];
+	r->latency = latsum / n;
+	return 1;
+}
+
+static void LoadBenchmarkHistory(std::vector<benchmark_result> &hist)
+{
+	char buf[MAXLINE];
+	char *ptr, *next;
+	int i;
+
+	FILE *fp = robust_fopen(BENCHMARK_HISTORY_FILE, "r");
+	if (!fp) return;
+	while (fgets(buf, sizeof(buf), fp)) {
+		benchmark_result r;
+		ptr = strchr(buf, '\n');
+		if (ptr) *ptr = '\0';
+		if (sscanf(buf, "%lf %lf %lf", &r.avgfps, &r.lowfps, &r.latency) != 3) continue;
+		ptr = strchr(buf, '|');
+		for (i = 0; i < BENCHMARK_NKEYS && ptr; i++) {
+			ptr++;
+			next = strchr(ptr, '|');
+			if (next) *next = '\0';
+			r.values[i] = Utf8ToCString(ptr);
+			ptr = next;
+		}
+		hist.push_back(r);
+	}
+	fclose(fp);
+}
+
+static void AppendBenchmarkHistory(const benchmark_result *r)
+{
+	int i;
+	FILE *fp = robust_fopen(BENCHMARK_HISTORY_FILE, "a");
+	if (!fp) return;
+	fprintf(fp, "%.3f %.3f %.3f", r->avgfps, r->lowfps, r->latency);
+	for (i = 0; i < BENCHMARK_NKEYS; i++) {
+		fprintf(fp, "|%s", CStringToUtf8(r->values[i]));
+	}
+	fprintf(fp, "\n");
+	fclose(fp);
+}
+
+static void ShowBenchmarkHistory(CPatchConfigDlg *dlg)
+{
+	std::vector<benchmark_result> hist;
+	CString msg, lines, line;
+	int i, n;
+
+	LoadBenchmarkHistory(hist);
+	n = hist.size();
+	if (n > BENCHMARK_MAXSHOW) n = BENCHMARK_MAXSHOW;
+
+	// newest first
+	for (i = 0; i < n; i++) {
+		benchmark_result *r = &hist[hist.size() - 1 - i];
+		line.Format(IDS_BENCHMARK_RESULTLINE, i + 1, r->avgfps, r->lowfps, r->latency, (LPCTSTR) r->values[0], (LPCTSTR) r->values[1], (LPCTSTR) r->values[2], (LPCTSTR) r->values[3]);
+		lines += line;
+	}
+	msg.Format(IDS_BENCHMARK_RESULT, n, (LPCTSTR) lines);
+	dlg->MessageBox(msg, STRTABLE(IDS_BENCHMARK_TITLE), MB_ICONINFORMATION);
+}
+
+static int RunGameForBenchmark(CPatchConfigDlg *dlg)
+{
+	STARTUPINFO si;
+	PROCESS_INFORMATION pi;
+
+	memset(&si, 0, sizeof(si));
+	si.cb = sizeof(si);
+	memset(&pi, 0, sizeof(pi));
+
+	// game refuses to start while we are holding the mutex
+	ReleaseGameMutex();
+	if (!CreateProcess(BENCHMARK_GAME_EXE, NULL, NULL, NULL, FALSE, 0, NULL, NULL, &si, &pi)) {
+		AcquireGameMutex();
+		return 0;
+	}
+	while (MsgWaitForMultipleObjects(1, &pi.hProcess, FALSE, 100, QS_ALLEVENTS) != WAIT_OBJECT_0) {
+		DoEvents();
+	}
+	CloseHandle(pi.hProcess);
+	CloseHandle(pi.hThread);
+	AcquireGameMutex();
+	return 1;
+}
+
+void RunBenchmark(CPatchConfigDlg *dlg)
+{
+	CString *pBenchmark = FindConfigValue(_T("benchmark"));
+	CString *pFrameTrace = FindConfigValue(_T("frametrace"));
+	CString oldBenchmark, oldFrameTrace, msg;
+	benchmark_result r;
+	int i, ok;
+
+	if (!pBenchmark || !pFrameTrace || !file_exists(BENCHMARK_RECORD_FILE)) {
+		msg.Format(IDS_BENCHMARK_NORECORD, _T(BENCHMARK_RECORD_FILE));
+		dlg->MessageBox(msg, STRTABLE(IDS_BENCHMARK_TITLE), MB_ICONWARNING);
+		return;
+	}
+	if (dlg->MessageBox(STRTABLE(IDS_BENCHMARK_CONFIRM), STRTABLE(IDS_BENCHMARK_TITLE), MB_OKCANCEL | MB_ICONQUESTION) != IDOK) {
+		return;
+	}
+
+	for (i = 0; i < BENCHMARK_NKEYS; i++) {
+		CString *pValue = FindConfigValue(BenchmarkKeys[i]);
+		r.values[i] = pValue ? *pValue : EMPTYSTR;
+	}
+
+	// write current settings, with replay and frame trace turned on for this run only
+	oldBenchmark = *pBenchmark;
+	oldFrameTrace = *pFrameTrace;
+	*pBenchmark = _T("2");
+	*pFrameTrace = _T("1");
+	ok = TrySaveConfigData();
+	*pBenchmark = oldBenchmark;
+	*pFrameTrace = oldFrameTrace;
+	if (!ok) {
+		dlg->MessageBox(STRTABLE(IDS_CANTSAVE), STRTABLE(IDS_CANTSAVE_TITLE), MB_ICONWARNING);
+		return;
+	}
+	robust_unlink(FRAMETRACE_FILE);
+
+	dlg->SetTopMost(false);
+	ShowPleaseWaitDlg(dlg, STRTABLE(IDS_BENCHMARK_WAITFINISH));
+	ok = RunGameForBenchmark(dlg);
+	if (!ok) {
+		GetPleaseWaitDlg()->MessageBox(STRTABLE(IDS_BENCHMARK_CANTRUN), STRTABLE(IDS_BENCHMARK_TITLE), MB_ICONERROR);
+	}
+
+	// restore settings on disk
+	while (!TrySaveConfigData()) {
+		if (GetPleaseWaitDlg()->MessageBox(STRTABLE(IDS_CANTSAVE), STRTABLE(IDS_CANTSAVE_TITLE), MB_ICONWARNING | MB_RETRYCANCEL) == IDCANCEL) {
+			break;
+		}
+	}
+	DestroyPleaseWaitDlg();
+	dlg->SetTopMost(true);
+	dlg->SetForegroundWindow();
+	if (!ok) return;
+
+	if (!SummarizeFrameTrace(&r)) {
+		dlg->MessageBox(STRTABLE(IDS_BENCHMARK_NORESULT), STRTABLE(IDS_BENCHMARK_TITLE), MB_ICONWARNING);
+		return;
+	}
+	AppendBenchmarkHistory(&r);
+	ShowBenchmarkHistory(dlg);
+}
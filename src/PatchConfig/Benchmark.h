@@ -0,0 +1,6 @@
+#ifndef PAL3PATCHCONFIG_BENCHMARK
+#define PAL3PATCHCONFIG_BENCHMARK
+
+extern void RunBenchmark(CPatchConfigDlg *dlg);
+
+#endif
\ No newline at end of file
@@ -1,32 +1,175 @@
 #include "stdafx.h"
 
-void CheckForUpdates(CPatchConfigDlg *dlg)
-{
+#ifdef BUILD_FOR_PAL3
+#define UPDATECACHE_FILE "PAL3patch.updcache"
+#endif
+
+#ifdef BUILD_FOR_PAL3A
+#define UPDATECACHE_FILE "PAL3Apatch.updcache"
+#endif
+
 #define MAXRESPONSE (256 * 1024)
+#define MAXHEADERLEN 256
+#define UPDATE_NETTIMEOUT 15000
+#define UPDATE_TIMEOUT 30000
+
+// update request
+//   request is done by a worker thread, UI thread keeps pumping messages,
+//   and closes the internet handle to abort the request if it takes too long
+//
+//   last response is cached in UPDATECACHE_FILE with its ETag and Last-Modified,
+//   so server can answer with 304 if nothing is changed
+//
+//   cache file format:
+//     URL\n ETAG\n LASTMODIFIED\n RESPONSE
+struct update_request {
+	HINTERNET hInternet;
+	LPCTSTR url;
+	LPCTSTR headers;
+	char *data;
+	DWORD datalen;
+	DWORD httpcode;
+	TCHAR etag[MAXHEADERLEN];
+	TCHAR lastmod[MAXHEADERLEN];
+	int ok;
+};
+
+static unsigned __stdcall UpdateRequestThread(void *arg)
+{
+	struct update_request *req = (struct update_request *) arg;
+	HINTERNET hFile;
+	DWORD recvlen, sz;
+
+	hFile = InternetOpenUrl(req->hInternet, req->url, req->headers, (DWORD) -1L, INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTP | INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTPS | INTERNET_FLAG_NO_CACHE_WRITE | INTERNET_FLAG_NO_UI | INTERNET_FLAG_RELOAD, 0);
+	if (!hFile) return 0;
+
+	// query http status code
+	sz = sizeof(req->httpcode);
+	if (!HttpQueryInfo(hFile, HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER, &req->httpcode, &sz, NULL)) goto done;
+	if (req->httpcode == HTTP_STATUS_NOT_MODIFIED) {
+		req->ok = 1;
+		goto done;
+	}
+	if (req->httpcode < 200 || req->httpcode >= 300) goto done;
+
+	// receive data
+	req->datalen = 0;
+	while (1) {
+		if (req->datalen >= MAXRESPONSE) goto done;
+		if (InternetReadFile(hFile, req->data + req->datalen, MAXRESPONSE - req->datalen, &recvlen) == FALSE) goto done;
+		if (recvlen == 0) break;
+		req->datalen += recvlen;
+	}
+	req->data[req->datalen] = 0;
+
+	// validators for next request
+	sz = sizeof(req->etag);
+	if (!HttpQueryInfo(hFile, HTTP_QUERY_ETAG, req->etag, &sz, NULL)) req->etag[0] = 0;
+	sz = sizeof(req->lastmod);
+	if (!HttpQueryInfo(hFile, HTTP_QUERY_LAST_MODIFIED, req->lastmod, &sz, NULL)) req->lastmod[0] = 0;
+
+	req->ok = 1;
+done:
+	InternetCloseHandle(hFile);
+	return 0;
+}
+
+static void TCHARToUTF8Line(LPCTSTR str, char **pptr)
+{
+#if defined(_UNICODE)
+	wcs2cs_managed(str, CP_UTF8, pptr);
+#elif defined(_MBCS)
+	cs2cs_managed(str, CP_ACP, CP_UTF8, pptr);
+#else
+#error
+#endif
+}
 
+static int LoadUpdateCache(LPCTSTR url, char *data, DWORD *datalen, CString &etag, CString &lastmod)
+{
+	static char *urlbuf = NULL;
+	static wchar_t *valbuf_w = NULL;
+#if defined(_MBCS)
+	static char *valbuf_a = NULL;
+#endif
+	char line[MAXLINE];
+	int ret = 0;
+	int i;
+	FILE *fp = robust_fopen(UPDATECACHE_FILE, "rb");
+	if (!fp) return 0;
+
+	TCHARToUTF8Line(url, &urlbuf);
+	if (!fgets(line, sizeof(line), fp)) goto done;
+	line[strcspn(line, "\n")] = 0;
+	if (strcmp(line, urlbuf) != 0) goto done;
+	for (i = 0; i < 2; i++) {
+		if (!fgets(line, sizeof(line), fp)) goto done;
+		line[strcspn(line, "\n")] = 0;
+		cs2wcs_managed(line, CP_UTF8, &valbuf_w);
+#if defined(_UNICODE)
+		(i == 0 ? etag : lastmod) = CString(valbuf_w);
+#elif defined(_MBCS)
+		wcs2cs_managed(valbuf_w, CP_ACP, &valbuf_a);
+		(i == 0 ? etag : lastmod) = CString(valbuf_a);
+#endif
+	}
+	*datalen = fread(data, 1, MAXRESPONSE, fp);
+	data[*datalen] = 0;
+	ret = 1;
+done:
+	fclose(fp);
+	return ret;
+}
+
+static void SaveUpdateCache(LPCTSTR url, const struct update_request *req)
+{
+	static char *buf = NULL;
+	FILE *fp;
+	if (!req->etag[0] && !req->lastmod[0]) {
+		// server doesn't support conditional requests
+		robust_unlink(UPDATECACHE_FILE);
+		return;
+	}
+	fp = robust_fopen(UPDATECACHE_FILE, "wb");
+	if (!fp) return;
+	TCHARToUTF8Line(url, &buf);
+	fprintf(fp, "%s\n", buf);
+	TCHARToUTF8Line(req->etag, &buf);
+	fprintf(fp, "%s\n", buf);
+	TCHARToUTF8Line(req->lastmod, &buf);
+	fprintf(fp, "%s\n", buf);
+	fwrite(req->data, 1, req->datalen, fp);
+	if (safe_fclose(&fp) != 0) robust_unlink(UPDATECACHE_FILE);
+}
+
+void CheckForUpdates(CPatchConfigDlg *dlg)
+{
 #if defined(_MBCS)
 	static char *msg_a = NULL;
 #endif
 	static wchar_t *response = NULL;
 
 	bool retry;
-	HINTERNET hInternet, hFile;
+	HINTERNET hInternet;
+	HANDLE hThread;
 	CString url;
 	CString msg;
 	CString descloc;
 	CString urlparam;
 	CString website;
-	char databuf[MAXRESPONSE];
-	DWORD datalen, recvlen;
-	DWORD httpcode, httpcodesz;
+	CString headers, etag, lastmod;
+	struct update_request req;
+	char *databuf = NULL, *cachebuf = NULL;
+	DWORD datalen, cachelen;
+	DWORD timeout, starttime;
 	DWORD r;
 	unsigned acp;
+	int hascache;
 
 retry:
 
 	retry = false;
 	hInternet = NULL;
-	hFile = NULL;
 	
 	ShowPleaseWaitDlg(dlg, STRTABLE(IDS_WAITCHECKFORUPDATES));
 
@@ -34,30 +177,58 @@ retry:
 	acp = GetACP();
 	descloc = STRTABLE(IDS_CONFIGDESCLIST);
 	urlparam.Format(_T("?appname=%s&version=%hs&builton=%hs&compiler=%hs&locale=%s&codepage=%u"), PATCH_APPNAME, pVersionStr, pBuildDate, pCompiler, (LPCTSTR) descloc, acp);
+	url = CString(PATCH_UPDATEURL) + urlparam;
+
+	// response buffers
+	if (!databuf) databuf = (char *) malloc(MAXRESPONSE + 1);
+	if (!cachebuf) cachebuf = (char *) malloc(MAXRESPONSE + 1);
+	if (!databuf || !cachebuf) goto fail;
+
+	// make conditional request headers from last response
+	headers.Empty();
+	hascache = LoadUpdateCache(url, cachebuf, &cachelen, etag, lastmod);
+	if (hascache) {
+		if (!etag.IsEmpty()) headers += _T("If-None-Match: ") + etag + _T("\r\n");
+		if (!lastmod.IsEmpty()) headers += _T("If-Modified-Since: ") + lastmod + _T("\r\n");
+	}
 
 	// open internet handle
 	hInternet = InternetOpen(PATCH_UPDATEUA, INTERNET_OPEN_TYPE_PRECONFIG, NULL, NULL, 0);
 	if (!hInternet) goto fail;
+	timeout = UPDATE_NETTIMEOUT;
+	InternetSetOption(hInternet, INTERNET_OPTION_CONNECT_TIMEOUT, &timeout, sizeof(timeout));
+	InternetSetOption(hInternet, INTERNET_OPTION_SEND_TIMEOUT, &timeout, sizeof(timeout));
+	InternetSetOption(hInternet, INTERNET_OPTION_RECEIVE_TIMEOUT, &timeout, sizeof(timeout));
 
-	// make url and open it
-	url = CString(PATCH_UPDATEURL) + urlparam;
-	hFile = InternetOpenUrl(hInternet, url, NULL, 0, INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTP | INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTPS | INTERNET_FLAG_NO_CACHE_WRITE | INTERNET_FLAG_NO_UI | INTERNET_FLAG_PRAGMA_NOCACHE | INTERNET_FLAG_RELOAD, 0);
-	if (!hFile) goto fail;
-
-	// query http status code
-	httpcodesz = sizeof(httpcode);
-	if (!HttpQueryInfo(hFile, HTTP_QUERY_STATUS_CODE | HTTP_QUERY_FLAG_NUMBER, &httpcode, &httpcodesz, NULL)) goto fail;
-	if (httpcode < 200 || httpcode >= 300) goto fail;
+	// run request in worker thread, keep UI responsive meanwhile
+	memset(&req, 0, sizeof(req));
+	req.hInternet = hInternet;
+	req.url = url;
+	req.headers = headers.IsEmpty() ? NULL : (LPCTSTR) headers;
+	req.data = databuf;
+	hThread = (HANDLE) _beginthreadex(NULL, 0, UpdateRequestThread, &req, 0, NULL);
+	if (!hThread) goto fail;
+	starttime = GetTickCount();
+	while (MsgWaitForMultipleObjects(1, &hThread, FALSE, 100, QS_ALLINPUT) != WAIT_OBJECT_0) {
+		DoEvents();
+		if (hInternet && GetTickCount() - starttime > UPDATE_TIMEOUT) {
+			// abort request, worker will return soon
+			InternetCloseHandle(hInternet);
+			hInternet = NULL;
+		}
+	}
+	CloseHandle(hThread);
+	if (!hInternet || !req.ok) goto fail;
 
-	// receive data
-	datalen = 0;
-	while (1) {
-		if (datalen >= sizeof(databuf)) goto fail;
-		if (InternetReadFile(hFile, databuf + datalen, sizeof(databuf) - datalen, &recvlen) == FALSE) goto fail;
-		if (recvlen == 0) break;
-		datalen += recvlen;
+	// use cached response if not modified
+	if (req.httpcode == HTTP_STATUS_NOT_MODIFIED) {
+		if (!hascache) goto fail;
+		memcpy(databuf, cachebuf, cachelen + 1);
+		datalen = cachelen;
+	} else {
+		datalen = req.datalen;
+		SaveUpdateCache(url, &req);
 	}
-	databuf[datalen] = 0;
 
 	// decode response
 	cs2wcs_managed((datalen >= 3 && strncmp(databuf, "\xEF\xBB\xBF", 3) == 0 ? databuf + 3 : databuf), CP_UTF8, &response);
@@ -107,11 +278,12 @@ retry:
 	goto fail;
 
 done:
-	if (hFile) InternetCloseHandle(hFile);
 	if (hInternet) InternetCloseHandle(hInternet);
 
 	if (retry) goto retry;
 
+	free(databuf);
+	free(cachebuf);
 	DestroyPleaseWaitDlg();
 	return;
 
@@ -31,24 +31,30 @@ static int TryReadConfigFile()
 	cfgcomments.clear();
 	int ret = 0;
 	int seq = 0;
-    FILE *fp = NULL;
-    if (!wal_check1(CONFIG_FILE, CONFIG_FILE_WAL, CONFIG_FILE_SUM)) goto done;
-    fp = robust_fopen(CONFIG_FILE, "r");
-    if (!fp) goto done;
-    char buf[MAXLINE];
-    char *ptr;
-	fscanf(fp, "\xEF\xBB\xBF");
-	while (fgets(buf, sizeof(buf), fp)) {
+	char *filedata = NULL;
+	char *buf, *ptr, *next;
+	if (!wal_check1(CONFIG_FILE, CONFIG_FILE_WAL, CONFIG_FILE_SUM)) goto done;
+
+	// read at once and tokenize in place, same as the patch does
+	filedata = read_file_as_cstring(CONFIG_FILE);
+	if (!filedata) goto done;
+	next = filedata;
+	if (strncmp(next, "\xEF\xBB\xBF", 3) == 0) next += 3;
+	while (next && *next) {
 		seq++;
 
+		// cut the line, remove '\n' and '\r' at end of line
+		buf = next;
+		next = strchr(buf, '\n');
+		if (next) *next++ = '\0';
+		ptr = buf + strlen(buf);
+		if (ptr > buf && ptr[-1] == '\r') ptr[-1] = '\0';
+
 		// ltrim the line
-		for (ptr = buf; *ptr && is_spacechar(*ptr); ptr++);
-		memmove(buf, ptr, strlen(ptr) + 1);
+		while (*buf && is_spacechar(*buf)) buf++;
     
 		// skip empty and comment lines
 		if (!buf[0] || buf[0] == ';' || buf[0] == '#' || (buf[0] == '/' && buf[1] == '/')) {
-			ptr = strrchr(buf, '\n');
-			if (ptr) *ptr = '\0';
 			if (buf[0] != ';') {
 				cs2wcs_managed(buf, CP_UTF8, &valbuf_w);
 #if defined(_UNICODE)
@@ -63,10 +69,6 @@ static int TryReadConfigFile()
 			continue;
 		}
     
-		// remove '\n' and end of line
-		ptr = strrchr(buf, '\n');
-		if (ptr) *ptr = '\0';
-    
 		// parse 'key' and 'value'
 		ptr = strchr(buf, '=');
 		if (!ptr) goto done;
@@ -96,7 +98,7 @@ static int TryReadConfigFile()
 
     ret = 1;
 done:
-	if (fp) fclose(fp);
+	free(filedata);
 	return ret;
 }
 
@@ -124,20 +126,28 @@ int TryRebuildConfigFile()
 static int TryMatchConfigData()
 {
 	std::map<CString, std::pair<int, CString> >::iterator it;
+	std::vector<ConfigDescItem *>::iterator idx;
 	ConfigDescItem *pItem;
-	for (pItem = ConfigDescList; pItem->level >= 0; pItem++) {
-		if (pItem->key) {
-			// no need to free 'pItem->pvalue', automaticly freed by std::map
-			if ((it = cfgdata.find(CString(pItem->key))) != cfgdata.end()) {
-				pItem->pvalue = &it->second.second;
-			} else {
-				return 0;
-			}
-		}
+	int r = 0;
+
+	// both are sorted by key, so walk them together
+	it = cfgdata.begin();
+	for (idx = ConfigDescKeyIndex.begin(); idx != ConfigDescKeyIndex.end(); idx++) {
+		pItem = *idx;
+		while (it != cfgdata.end() && (r = it->first.Compare(pItem->key)) < 0) it++;
+		if (it == cfgdata.end() || r != 0) return 0;
+		// no need to free 'pItem->pvalue', automaticly freed by std::map
+		pItem->pvalue = &it->second.second;
 	}
 	return 1;
 }
 
+CString *FindConfigValue(LPCTSTR key)
+{
+	std::map<CString, std::pair<int, CString> >::iterator it = cfgdata.find(key);
+	return it != cfgdata.end() ? &it->second.second : NULL;
+}
+
 int TryLoadConfigData()
 {
 	return TryReadConfigFile() && TryMatchConfigData();
@@ -4,5 +4,6 @@
 extern int TryRebuildConfigFile();
 extern int TryLoadConfigData();
 extern int TrySaveConfigData();
+extern CString *FindConfigValue(LPCTSTR key);
 
 #endif
\ No newline at end of file
@@ -36,18 +36,39 @@ static ConfigDescListIndex ConfigDescListArray[] = {
 
 
 ConfigDescItem *ConfigDescList = NULL;
+std::vector<ConfigDescItem *> ConfigDescKeyIndex;
+
+static bool ConfigDescKeyLess(const ConfigDescItem *a, const ConfigDescItem *b)
+{
+	// same order as CString::operator<, so it can be merged with config data map
+	return _tcscmp(a->key, b->key) < 0;
+}
+
+static void BuildConfigDescKeyIndex()
+{
+	ConfigDescItem *pItem;
+	ConfigDescKeyIndex.clear();
+	if (!ConfigDescList) return;
+	for (pItem = ConfigDescList; pItem->level >= 0; pItem++) {
+		if (pItem->key) {
+			ConfigDescKeyIndex.push_back(pItem);
+		}
+	}
+	std::sort(ConfigDescKeyIndex.begin(), ConfigDescKeyIndex.end(), ConfigDescKeyLess);
+}
 
 void LoadConfigDescList(LPCTSTR name)
 {
 	int i;
 	int nlist = sizeof(ConfigDescListArray) / sizeof(ConfigDescListIndex);
 	
+	ConfigDescList = NULL;
 	for (i = 0; i < nlist; i++) {
 		if (_tcscmp(name, ConfigDescListArray[i].name) == 0) {
 			ConfigDescList = ConfigDescListArray[i].list;
-			return;
+			break;
 		}
 	}
 
-	ConfigDescList = NULL;
+	BuildConfigDescKeyIndex();
 }
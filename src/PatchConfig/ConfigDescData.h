@@ -60,6 +60,7 @@ struct ConfigDescListIndex {
 };
 
 extern ConfigDescItem *ConfigDescList;
+extern std::vector<ConfigDescItem *> ConfigDescKeyIndex; // option items, sorted by key
 
 void LoadConfigDescList(LPCTSTR name);
 
@@ -586,6 +586,14 @@ static ConfigDescItem LISTNAME[] = {
 		_T("ͨ£ϷĽڡsnapļ¡ĳЩ£Ȩ޵ԭϷܲûбڸĿ¼ڡ snap Ŀ¼ûҵԳʹô˹ҽ"),
 		OpenSnapFolder, NULL
 	},
+	{
+		1, true, true,
+		NULL,
+		_T("ܲ"),
+		_T("˹ܿʹõǰϷܲԣ֮ǰĲԽжԱȡԽ˱Ƚϡֱʡݡӳ١֡ơöܵӰ졣"),
+		_T("ԻԻطģʽϷط֮ǰ¼ƵĲҪȽļеġbenchmarkΪ 1 Ϸ¼ơڼʱáframetraceԽָԭá"),
+		RunBenchmark, _T("ʼܲ")
+	},
 	{
 		1, false, true,
 		NULL,
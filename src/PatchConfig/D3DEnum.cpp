@@ -1,9 +1,31 @@
 #include "stdafx.h"
 #include "dxstdafx.h"
 
+#ifdef BUILD_FOR_PAL3
+#define D3DENUMCACHE_FILE "PAL3patch.d3dcache"
+#endif
+
+#ifdef BUILD_FOR_PAL3A
+#define D3DENUMCACHE_FILE "PAL3Apatch.d3dcache"
+#endif
+
 static IDirect3D9 *pD3D = NULL;
 static CD3DEnumeration *pD3DEnum = NULL;
 
+// enumeration results used by config pages
+//   full enumeration is slow, so it is done by a background thread
+//   and the results are cached in D3DENUMCACHE_FILE,
+//   keyed by first adapter's identifier, driver version and display mode counts
+//   lists are deduplicated once by IndexD3DEnumResults(), so building a page is O(result)
+//     D3DModeList is sorted, largest first
+//     D3DDepthFormatList and D3DMultisampleList keep the enumeration order,
+//     only the first entry of each format or multisample type is kept
+static std::vector<std::pair<int, int> > D3DModeList;
+static std::vector<D3DFORMAT> D3DDepthFormatList;
+static std::vector<std::pair<D3DMULTISAMPLE_TYPE, DWORD> > D3DMultisampleList;
+static char D3DEnumCacheKey[256];
+static HANDLE hD3DEnumThread = NULL;
+
 typedef IDirect3D9 * (WINAPI *typeofDirect3DCreate9)(UINT SDKVersion);
 
 int CheckDX90SDKVersion()
@@ -23,6 +45,157 @@ int CheckDX90SDKVersion()
 	return 1;
 }
 
+static const D3DFORMAT D3DEnumAdapterFormats[] = { D3DFMT_X8R8G8B8, D3DFMT_X1R5G5B5, D3DFMT_R5G6B5, D3DFMT_A2R10G10B10 };
+
+static void MakeD3DEnumCacheKey(char *key)
+{
+	D3DADAPTER_IDENTIFIER9 ident;
+	const GUID *g;
+	unsigned i;
+	int len;
+
+	key[0] = '\0';
+	if (pD3D->GetAdapterCount() == 0 || FAILED(pD3D->GetAdapterIdentifier(0, 0, &ident))) return;
+	g = &ident.DeviceIdentifier;
+	len = sprintf(key, "%08lx-%04x-%04x-%02x%02x%02x%02x%02x%02x%02x%02x %08lx%08lx %04lx:%04lx",
+		g->Data1, g->Data2, g->Data3, g->Data4[0], g->Data4[1], g->Data4[2], g->Data4[3], g->Data4[4], g->Data4[5], g->Data4[6], g->Data4[7],
+		ident.DriverVersion.HighPart, ident.DriverVersion.LowPart, ident.VendorId, ident.DeviceId);
+
+	// mode list changes with attached monitor
+	for (i = 0; i < sizeof(D3DEnumAdapterFormats) / sizeof(D3DEnumAdapterFormats[0]); i++) {
+		len += sprintf(key + len, " %u", pD3D->GetAdapterModeCount(0, D3DEnumAdapterFormats[i]));
+	}
+}
+
+static int LoadD3DEnumCache()
+{
+	char line[1000];
+	int ret = 0;
+	FILE *fp;
+
+	if (!D3DEnumCacheKey[0]) return 0;
+	fp = robust_fopen(D3DENUMCACHE_FILE, "r");
+	if (!fp) return 0;
+	if (!fgets(line, sizeof(line), fp)) goto done;
+	line[strcspn(line, "\r\n")] = '\0';
+	if (strcmp(D3DEnumCacheKey, line) != 0) goto done;
+
+	while (fgets(line, sizeof(line), fp)) {
+		int a, b;
+		unsigned long q;
+		if (sscanf(line, "mode %d %d", &a, &b) == 2) {
+			D3DModeList.push_back(std::make_pair(a, b));
+		} else if (sscanf(line, "depth %d", &a) == 1) {
+			D3DDepthFormatList.push_back((D3DFORMAT) a);
+		} else if (sscanf(line, "msaa %d %lu", &a, &q) == 2) {
+			D3DMultisampleList.push_back(std::make_pair((D3DMULTISAMPLE_TYPE) a, (DWORD) q));
+		}
+	}
+	ret = 1;
+done:
+	fclose(fp);
+	if (!ret) {
+		D3DModeList.clear();
+		D3DDepthFormatList.clear();
+		D3DMultisampleList.clear();
+	}
+	return ret;
+}
+
+static void SaveD3DEnumCache()
+{
+	unsigned i;
+	FILE *fp;
+
+	if (!D3DEnumCacheKey[0]) return;
+	fp = robust_fopen(D3DENUMCACHE_FILE, "w");
+	if (!fp) return;
+	fprintf(fp, "%s\n", D3DEnumCacheKey);
+	for (i = 0; i < D3DModeList.size(); i++) {
+		fprintf(fp, "mode %d %d\n", D3DModeList[i].first, D3DModeList[i].second);
+	}
+	for (i = 0; i < D3DDepthFormatList.size(); i++) {
+		fprintf(fp, "depth %d\n", (int) D3DDepthFormatList[i]);
+	}
+	for (i = 0; i < D3DMultisampleList.size(); i++) {
+		fprintf(fp, "msaa %d %lu\n", (int) D3DMultisampleList[i].first, (unsigned long) D3DMultisampleList[i].second);
+	}
+	if (safe_fclose(&fp) != 0) robust_unlink(D3DENUMCACHE_FILE);
+}
+
+static void IndexD3DEnumResults()
+{
+	std::set<D3DFORMAT> fmtset;
+	std::set<D3DMULTISAMPLE_TYPE> mtypeset;
+	unsigned i, n;
+
+	std::sort(D3DModeList.begin(), D3DModeList.end(), std::greater<std::pair<int, int> > ());
+	D3DModeList.resize(std::unique(D3DModeList.begin(), D3DModeList.end()) - D3DModeList.begin());
+
+	for (i = n = 0; i < D3DDepthFormatList.size(); i++) {
+		if (fmtset.insert(D3DDepthFormatList[i]).second) {
+			D3DDepthFormatList[n++] = D3DDepthFormatList[i];
+		}
+	}
+	D3DDepthFormatList.resize(n);
+
+	for (i = n = 0; i < D3DMultisampleList.size(); i++) {
+		if (D3DMultisampleList[i].first != D3DMULTISAMPLE_NONMASKABLE && mtypeset.insert(D3DMultisampleList[i].first).second) {
+			D3DMultisampleList[n++] = D3DMultisampleList[i];
+		}
+	}
+	D3DMultisampleList.resize(n);
+}
+
+static void CollectD3DEnumResults()
+{
+	unsigned i, j;
+
+	if (pD3DEnum->m_pAdapterInfoList == NULL || pD3DEnum->m_pAdapterInfoList->Count() == 0) return;
+	D3DAdapterInfo *pD3DAdapterInfo = (D3DAdapterInfo *) pD3DEnum->m_pAdapterInfoList->GetPtr(0); // First Adapter
+	for (i = 0; i < pD3DAdapterInfo->pDisplayModeList->Count(); i++) {
+		D3DDISPLAYMODE *pDisplayMode = (D3DDISPLAYMODE *) pD3DAdapterInfo->pDisplayModeList->GetPtr(i);
+		D3DModeList.push_back(std::make_pair((int) pDisplayMode->Width, (int) pDisplayMode->Height));
+	}
+
+	if (pD3DAdapterInfo->pDeviceInfoList->Count() == 0) return;
+	D3DDeviceInfo *pD3DDeviceInfo = (D3DDeviceInfo *) pD3DAdapterInfo->pDeviceInfoList->GetPtr(0); // HAL
+	for (j = 0; j < pD3DDeviceInfo->pDeviceComboList->Count(); j++) {
+		D3DDeviceCombo *pDeviceComboList = (D3DDeviceCombo *) pD3DDeviceInfo->pDeviceComboList->GetPtr(j);
+		for (i = 0; i < pDeviceComboList->pDepthStencilFormatList->Count(); i++) {
+			D3DDepthFormatList.push_back(*(D3DFORMAT *) pDeviceComboList->pDepthStencilFormatList->GetPtr(i));
+		}
+		for (i = 0; i < pDeviceComboList->pMultiSampleTypeList->Count(); i++) {
+			D3DMULTISAMPLE_TYPE mtype = *(D3DMULTISAMPLE_TYPE *) pDeviceComboList->pMultiSampleTypeList->GetPtr(i);
+			DWORD maxq = *(DWORD *) pDeviceComboList->pMultiSampleQualityList->GetPtr(i);
+			D3DMultisampleList.push_back(std::make_pair(mtype, maxq));
+		}
+	}
+}
+
+static unsigned __stdcall D3DEnumThread(void *arg)
+{
+	pD3DEnum = new CD3DEnumeration;
+	pD3DEnum->ConfirmDeviceCallback = NULL;
+	pD3DEnum->AppUsesDepthBuffer = TRUE;
+	pD3DEnum->SetD3D(pD3D);
+	if (SUCCEEDED(pD3DEnum->Enumerate())) {
+		CollectD3DEnumResults();
+		IndexD3DEnumResults();
+		SaveD3DEnumCache();
+	}
+	return 0;
+}
+
+static void WaitD3DEnumeration()
+{
+	if (hD3DEnumThread) {
+		WaitForSingleObject(hD3DEnumThread, INFINITE);
+		CloseHandle(hD3DEnumThread);
+		hD3DEnumThread = NULL;
+	}
+}
+
 int InitD3DEnumeration()
 {
 	HMODULE hD3D9;
@@ -40,11 +213,15 @@ int InitD3DEnumeration()
 	if (!pD3D) {
 		goto fail;
 	}
-	pD3DEnum = new CD3DEnumeration;
-	pD3DEnum->ConfirmDeviceCallback = NULL;
-	pD3DEnum->AppUsesDepthBuffer = TRUE;
-	pD3DEnum->SetD3D(pD3D);
-	pD3DEnum->Enumerate();
+
+	// enumerate in background if cache is not usable
+	MakeD3DEnumCacheKey(D3DEnumCacheKey);
+	if (LoadD3DEnumCache()) {
+		IndexD3DEnumResults(); // cheap if already indexed
+	} else {
+		hD3DEnumThread = (HANDLE) _beginthreadex(NULL, 0, D3DEnumThread, NULL, 0, NULL);
+		if (!hD3DEnumThread) D3DEnumThread(NULL);
+	}
 	return 1;
 
 fail:
@@ -54,6 +231,7 @@ fail:
 
 void CleanupD3DEnumeration()
 {
+	WaitD3DEnumeration();
 	if (pD3DEnum) {
 		delete pD3DEnum;
 		pD3DEnum = NULL;
@@ -68,23 +246,12 @@ void CleanupD3DEnumeration()
 EnumDisplayMode EnumDisplayModeInstance;
 void EnumDisplayMode::EnumConfigValues(std::vector<CString> &result)
 {
-	std::vector<std::pair<int, int> > dlist;
 	std::vector<std::pair<int, int> >::iterator it;
 
-	if (pD3DEnum->m_pAdapterInfoList->Count() > 0) {
-		unsigned i;
-		D3DAdapterInfo *pD3DAdapterInfo = (D3DAdapterInfo *) pD3DEnum->m_pAdapterInfoList->GetPtr(0); // First Adapter
-		for (i = 0; i < pD3DAdapterInfo->pDisplayModeList->Count(); i++) {
-			D3DDISPLAYMODE *pDisplayMode = (D3DDISPLAYMODE *) pD3DAdapterInfo->pDisplayModeList->GetPtr(i);
-			dlist.push_back(std::make_pair(pDisplayMode->Width, pDisplayMode->Height));
-		}
-		std::sort(dlist.begin(), dlist.end(), std::greater<std::pair<int, int> > ());
-		dlist.resize(std::unique(dlist.begin(), dlist.end()) - dlist.begin());
-	}
-
+	WaitD3DEnumeration();
 	result.clear();
 	result.push_back(CString(_T("current")));
-	for (it = dlist.begin(); it != dlist.end(); it++) {
+	for (it = D3DModeList.begin(); it != D3DModeList.end(); it++) {
 		if (it->first >= 800 && it->second >= 600) {
 			CString str;
 			str.Format(_T("%dx%d"), it->first, it->second);
@@ -118,24 +285,12 @@ void EnumDepthBuffer::EnumConfigValues(std::vector<CString> &result)
 	result.push_back(CString(_T("16")));
 	result.push_back(CString(_T("24")));
 
-	if (pD3DEnum->m_pAdapterInfoList->Count() > 0) {
-		unsigned i, j;
-		D3DFORMAT fmt;
-		std::set<D3DFORMAT> fmtset;
-		D3DAdapterInfo *pD3DAdapterInfo = (D3DAdapterInfo *) pD3DEnum->m_pAdapterInfoList->GetPtr(0); // First Adapter
-		D3DDeviceInfo *pD3DDeviceInfo = (D3DDeviceInfo *) pD3DAdapterInfo->pDeviceInfoList->GetPtr(0); // HAL
-		D3DDeviceCombo *pDeviceComboList;
-		for (j = 0; j < pD3DDeviceInfo->pDeviceComboList->Count(); j++) {
-			pDeviceComboList = (D3DDeviceCombo *) pD3DDeviceInfo->pDeviceComboList->GetPtr(j);
-			for (i = 0; i < pDeviceComboList->pDepthStencilFormatList->Count(); i++) {
-				fmt = *(D3DFORMAT *) pDeviceComboList->pDepthStencilFormatList->GetPtr(i);
-				if (fmtset.insert(fmt).second) {
-					CString str;
-					str.Format(_T("%d"), -fmt);
-					result.push_back(str);
-				}
-			}
-		}
+	unsigned i;
+	WaitD3DEnumeration();
+	for (i = 0; i < D3DDepthFormatList.size(); i++) {
+		CString str;
+		str.Format(_T("%d"), -D3DDepthFormatList[i]);
+		result.push_back(str);
 	}
 }
 CString EnumDepthBuffer::GetValueTitle(const CString &value)
@@ -185,30 +340,20 @@ void EnumMultisample::EnumConfigValues(std::vector<CString> &result)
 	result.push_back(CString(_T("auto,auto")));
 	result.push_back(CString(_T("0,0")));
 
-	if (pD3DEnum->m_pAdapterInfoList->Count() > 0) {
-		unsigned i, j;
-		int q, maxq;
-		D3DMULTISAMPLE_TYPE mtype;
-		std::set<D3DMULTISAMPLE_TYPE> mtypeset;
-		D3DAdapterInfo *pD3DAdapterInfo = (D3DAdapterInfo *) pD3DEnum->m_pAdapterInfoList->GetPtr(0); // First Adapter
-		D3DDeviceInfo *pD3DDeviceInfo = (D3DDeviceInfo *) pD3DAdapterInfo->pDeviceInfoList->GetPtr(0); // HAL
-		D3DDeviceCombo *pDeviceComboList;
-		for (j = 0; j < pD3DDeviceInfo->pDeviceComboList->Count(); j++) {
-			pDeviceComboList = (D3DDeviceCombo *) pD3DDeviceInfo->pDeviceComboList->GetPtr(j);
-			for (i = 0; i < pDeviceComboList->pMultiSampleTypeList->Count(); i++) {
-				mtype = *(D3DMULTISAMPLE_TYPE *) pDeviceComboList->pMultiSampleTypeList->GetPtr(i);
-				maxq = *(DWORD *) pDeviceComboList->pMultiSampleQualityList->GetPtr(i);
-				if (mtype != D3DMULTISAMPLE_NONMASKABLE && mtypeset.insert(mtype).second) {
-					if (mtype != D3DMULTISAMPLE_NONE) {
-						for (q = 0; q < maxq; q++) {
-							CString key, val;
-							key.Format(IDS_MSAA_FORMAT, mtype, q);
-							val.Format(_T("%d,%d"), mtype, q);
-							result.push_back(val);
-							descmap.insert(std::make_pair(val, key));
-						}
-					}
-				}
+	unsigned i;
+	int q, maxq;
+	D3DMULTISAMPLE_TYPE mtype;
+	WaitD3DEnumeration();
+	for (i = 0; i < D3DMultisampleList.size(); i++) {
+		mtype = D3DMultisampleList[i].first;
+		maxq = D3DMultisampleList[i].second;
+		if (mtype != D3DMULTISAMPLE_NONE) {
+			for (q = 0; q < maxq; q++) {
+				CString key, val;
+				key.Format(IDS_MSAA_FORMAT, mtype, q);
+				val.Format(_T("%d,%d"), mtype, q);
+				result.push_back(val);
+				descmap.insert(std::make_pair(val, key));
 			}
 		}
 	}
@@ -1,35 +1,192 @@
 #include "stdafx.h"
 
 
+#ifdef BUILD_FOR_PAL3
+#define FONTCACHE_FILE "PAL3patch.fontcache"
+#endif
+
+#ifdef BUILD_FOR_PAL3A
+#define FONTCACHE_FILE "PAL3Apatch.fontcache"
+#endif
+
 EnumFontface EnumFontfaceInstance;
 
+// font index
+//   enumerating thousands of fonts is slow, so it is done by a background thread
+//   which is started when config tool starts, the index is cached in FONTCACHE_FILE
+//   and invalidated when fonts folder or font registry keys are modified
+//
+//   cache file format (UTF-8):
+//     KEY
+//     CHARSETMASK FACENAME   (charset mask in hex, see FontCharsetBit())
+
+#define FONTCHARSET_ANSI     0x01
+#define FONTCHARSET_SYMBOL   0x02
+#define FONTCHARSET_GB2312   0x04
+#define FONTCHARSET_BIG5     0x08
+#define FONTCHARSET_SHIFTJIS 0x10
+#define FONTCHARSET_HANGUL   0x20
+#define FONTCHARSET_OTHER    0x80
+#define FONTCHARSET_CJK (FONTCHARSET_GB2312 | FONTCHARSET_BIG5 | FONTCHARSET_SHIFTJIS | FONTCHARSET_HANGUL)
+
+static std::map<CString, unsigned> FontIndex; // face name => charset mask
+static char FontIndexKey[256];
+static HANDLE hFontEnumThread = NULL;
+
+static unsigned FontCharsetBit(BYTE charset)
+{
+	switch (charset) {
+	case ANSI_CHARSET: return FONTCHARSET_ANSI;
+	case SYMBOL_CHARSET: return FONTCHARSET_SYMBOL;
+	case GB2312_CHARSET: return FONTCHARSET_GB2312;
+	case CHINESEBIG5_CHARSET: return FONTCHARSET_BIG5;
+	case SHIFTJIS_CHARSET: return FONTCHARSET_SHIFTJIS;
+	case HANGUL_CHARSET: case JOHAB_CHARSET: return FONTCHARSET_HANGUL;
+	default: return FONTCHARSET_OTHER;
+	}
+}
+
+static void MakeFontIndexKey(char *key)
+{
+	char fontdir[MAX_PATH + 10];
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+	FILETIME ft[3];
+	HKEY hKey;
+	const char *regpath[] = { "Software\\Microsoft\\Windows NT\\CurrentVersion\\Fonts", "Software\\Microsoft\\Windows\\CurrentVersion\\Fonts" };
+	HKEY regroot[] = { HKEY_LOCAL_MACHINE, HKEY_CURRENT_USER };
+	int i, j;
+
+	memset(ft, 0, sizeof(ft));
+	if (GetWindowsDirectoryA(fontdir, MAX_PATH)) {
+		strcat(fontdir, "\\Fonts");
+		if (GetFileAttributesExA(fontdir, GetFileExInfoStandard, &attr)) ft[0] = attr.ftLastWriteTime;
+	}
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < 2; j++) {
+			if (RegOpenKeyExA(regroot[i], regpath[j], 0, KEY_QUERY_VALUE, &hKey) == ERROR_SUCCESS) {
+				FILETIME t;
+				if (RegQueryInfoKeyA(hKey, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, &t) == ERROR_SUCCESS) {
+					if (CompareFileTime(&t, &ft[i + 1]) > 0) ft[i + 1] = t;
+				}
+				RegCloseKey(hKey);
+			}
+		}
+	}
+	sprintf(key, "%08lx%08lx %08lx%08lx %08lx%08lx",
+		ft[0].dwHighDateTime, ft[0].dwLowDateTime, ft[1].dwHighDateTime, ft[1].dwLowDateTime, ft[2].dwHighDateTime, ft[2].dwLowDateTime);
+}
+
+static int LoadFontIndex()
+{
+	static wchar_t *facebuf_w = NULL;
+#if defined(_MBCS)
+	static char *facebuf_a = NULL;
+#endif
+	char buf[MAXLINE];
+	int ret = 0;
+	FILE *fp = robust_fopen(FONTCACHE_FILE, "r");
+	if (!fp) return 0;
+	if (!fgets(buf, sizeof(buf), fp)) goto done;
+	buf[strcspn(buf, "\r\n")] = '\0';
+	if (strcmp(buf, FontIndexKey) != 0) goto done;
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		unsigned mask;
+		int pos;
+		buf[strcspn(buf, "\r\n")] = '\0';
+		if (sscanf(buf, "%x %n", &mask, &pos) < 1 || !buf[pos]) continue;
+		cs2wcs_managed(buf + pos, CP_UTF8, &facebuf_w);
+#if defined(_UNICODE)
+		FontIndex[CString(facebuf_w)] |= mask;
+#elif defined(_MBCS)
+		wcs2cs_managed(facebuf_w, CP_ACP, &facebuf_a);
+		FontIndex[CString(facebuf_a)] |= mask;
+#else
+#error
+#endif
+	}
+	ret = 1;
+done:
+	fclose(fp);
+	if (!ret) FontIndex.clear();
+	return ret;
+}
+
+static void SaveFontIndex()
+{
+	static char *facebuf = NULL;
+	std::map<CString, unsigned>::iterator it;
+	FILE *fp = robust_fopen(FONTCACHE_FILE, "w");
+	if (!fp) return;
+	fprintf(fp, "%s\n", FontIndexKey);
+	for (it = FontIndex.begin(); it != FontIndex.end(); it++) {
+#if defined(_UNICODE)
+		wcs2cs_managed(it->first, CP_UTF8, &facebuf);
+#elif defined(_MBCS)
+		cs2cs_managed(it->first, CP_ACP, CP_UTF8, &facebuf);
+#else
+#error
+#endif
+		fprintf(fp, "%x %s\n", it->second, facebuf);
+	}
+	if (safe_fclose(&fp) != 0) robust_unlink(FONTCACHE_FILE);
+}
+
 static int CALLBACK EnumFontfaceHelper(ENUMLOGFONTEX *lpelfe, NEWTEXTMETRICEX *lpntme, DWORD FontType, LPARAM lParam)
 {
-	EnumFontface *arg = (EnumFontface *) lParam;
-	arg->buf.push_back(CString(lpelfe->elfLogFont.lfFaceName));
+	// called once for each charset of each face
+	FontIndex[CString(lpelfe->elfLogFont.lfFaceName)] |= FontCharsetBit(lpelfe->elfLogFont.lfCharSet);
 	return 1;
 }
 
-void EnumFontface::EnumConfigValues(std::vector<CString> &result)
+static unsigned __stdcall FontEnumThread(void *arg)
 {
-	std::vector<CString>::iterator it;
-	buf.clear();
+	HDC hDC = GetDC(NULL);
 	LOGFONT lf;
+	memset(&lf, 0, sizeof(lf));
 	lf.lfCharSet = DEFAULT_CHARSET;
 	lf.lfFaceName[0] = '\0';
 	lf.lfPitchAndFamily = 0;
-	EnumFontFamiliesEx(GetDC(NULL), &lf, (FONTENUMPROC) EnumFontfaceHelper, (LPARAM) this, 0);
-	std::sort(buf.begin(), buf.end());
-	buf.erase(std::unique(buf.begin(), buf.end()), buf.end());
+	EnumFontFamiliesEx(hDC, &lf, (FONTENUMPROC) EnumFontfaceHelper, 0, 0);
+	ReleaseDC(NULL, hDC);
+	SaveFontIndex();
+	return 0;
+}
+
+void StartFontEnumeration()
+{
+	MakeFontIndexKey(FontIndexKey);
+	if (LoadFontIndex()) return;
+	hFontEnumThread = (HANDLE) _beginthreadex(NULL, 0, FontEnumThread, NULL, 0, NULL);
+	if (!hFontEnumThread) FontEnumThread(NULL);
+}
+
+void WaitFontEnumeration()
+{
+	if (hFontEnumThread) {
+		WaitForSingleObject(hFontEnumThread, INFINITE);
+		CloseHandle(hFontEnumThread);
+		hFontEnumThread = NULL;
+	}
+}
+
+void EnumFontface::EnumConfigValues(std::vector<CString> &result)
+{
+	std::map<CString, unsigned>::iterator it;
+	WaitFontEnumeration();
+	buf.clear();
 	result.clear();
-	for (it = buf.begin(); it != buf.end(); it++) {
-		if (*it >= CString(_T("\x80"))) {
-			result.push_back(*it);
+
+	// CJK-capable fonts first, then others, both sorted by name
+	for (it = FontIndex.begin(); it != FontIndex.end(); it++) {
+		buf.push_back(it->first);
+		if (it->first.Left(1) != CString(_T("@")) && (it->second & FONTCHARSET_CJK)) {
+			result.push_back(it->first);
 		}
 	}
-	for (it = buf.begin(); it != buf.end(); it++) {
-		if (*it < CString(_T("\x80"))) {
-			result.push_back(*it);
+	for (it = FontIndex.begin(); it != FontIndex.end(); it++) {
+		if (it->first.Left(1) == CString(_T("@")) || !(it->second & FONTCHARSET_CJK)) {
+			result.push_back(it->first);
 		}
 	}
 	result.insert(result.begin(), CString(_T("freetype:")));
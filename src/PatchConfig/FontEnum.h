@@ -1,6 +1,9 @@
 #ifndef PAL3PATCHCONFIG_FONTENUM
 #define PAL3PATCHCONFIG_FONTENUM
 
+extern void StartFontEnumeration();
+extern void WaitFontEnumeration();
+
 extern class EnumFontface : public ConfigDescOptionListEnum {
 public:
 	std::vector<CString> buf;
@@ -149,9 +149,9 @@ void SHA1Update(SHA1_CTX* context, const unsigned char* data, uint32_t len)
 
 void SHA1Final(unsigned char digest[20], SHA1_CTX* context)
 {
+    static const unsigned char padding[64] = { 0200 };
     unsigned i;
     unsigned char finalcount[8];
-    unsigned char c;
 
 #if 0	/* untested "improvement" by DHR */
     /* Convert context->count to a sequence of bytes
@@ -175,12 +175,8 @@ void SHA1Final(unsigned char digest[20], SHA1_CTX* context)
          >> ((3-(i & 3)) * 8) ) & 255);  /* Endian independent */
     }
 #endif
-    c = 0200;
-    SHA1Update(context, &c, 1);
-    while ((context->count[0] & 504) != 448) {
-	c = 0000;
-        SHA1Update(context, &c, 1);
-    }
+    /* Pad with 0200 and zeros to 56 mod 64 bytes, in one update */
+    SHA1Update(context, padding, ((55 - ((context->count[0] >> 3) & 63)) & 63) + 1);
     SHA1Update(context, finalcount, 8);  /* Should cause a SHA1Transform() */
     for (i = 0; i < 20; i++) {
         digest[i] = (unsigned char)
@@ -195,7 +191,7 @@ void SHA1Final(unsigned char digest[20], SHA1_CTX* context)
 
 int GetFileSHA1(const char *fn, char *buf)
 {
-#define BUFSIZE 4096
+#define BUFSIZE 65536
 	int ret = 0;
 	unsigned char databuf[BUFSIZE];
 	int datalen;
@@ -222,3 +218,182 @@ done:
 	return ret;
 }
 
+
+// parallel and cached file hashing
+//   files are hashed by worker threads with large sequential reads,
+//   digest is cached with file size and mtime, so unchanged files are not read again
+//
+//   cache file format (one file per line):
+//     SIZE MTIME SHA1 FILENAME   (size and mtime in hex)
+
+#define SHA1_READSIZE (1024 * 1024)
+#define SHA1_MAXTHREAD 4
+
+struct sha1_cache_entry {
+	char fn[MAX_PATH];
+	unsigned __int64 size;
+	unsigned __int64 mtime;
+	char hash[SHA1_STR_SIZE];
+};
+
+struct sha1_job_list {
+	const char **fn;
+	char (*hashstr)[SHA1_STR_SIZE];
+	int *job;
+	int n;
+	volatile LONG next;
+};
+
+static int GetFileSHA1Sequential(const char *fn, char *buf, unsigned char *databuf)
+{
+	int ret = 0;
+	DWORD datalen;
+	unsigned char digest[SHA1_BYTE];
+	SHA1_CTX ctx;
+	int i;
+	HANDLE hFile = CreateFileA(fn, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+	if (hFile == INVALID_HANDLE_VALUE) return 0;
+
+	SHA1Init(&ctx);
+	while (1) {
+		if (!ReadFile(hFile, databuf, SHA1_READSIZE, &datalen, NULL)) goto done;
+		if (datalen == 0) break;
+		SHA1Update(&ctx, databuf, datalen);
+	}
+	SHA1Final(digest, &ctx);
+
+	for (i = 0; i < SHA1_BYTE; i++) {
+		sprintf(buf + i * 2, "%02x", (unsigned) digest[i]);
+	}
+
+	ret = 1;
+done:
+	CloseHandle(hFile);
+	return ret;
+}
+
+static unsigned __stdcall SHA1WorkerThread(void *arg)
+{
+	struct sha1_job_list *list = (struct sha1_job_list *) arg;
+	unsigned char *databuf = (unsigned char *) malloc(SHA1_READSIZE);
+	LONG i;
+
+	while ((i = InterlockedIncrement((LONG *) &list->next) - 1) < list->n) {
+		int id = list->job[i];
+		if (!databuf || !GetFileSHA1Sequential(list->fn[id], list->hashstr[id], databuf)) {
+			list->hashstr[id][0] = '\0';
+		}
+	}
+	free(databuf);
+	return 0;
+}
+
+static void RunSHA1Jobs(struct sha1_job_list *list)
+{
+	HANDLE hThread[SHA1_MAXTHREAD];
+	int nthread = 0;
+	int maxthread;
+	int i;
+	SYSTEM_INFO si;
+
+	GetSystemInfo(&si);
+	maxthread = si.dwNumberOfProcessors;
+	if (maxthread > SHA1_MAXTHREAD) maxthread = SHA1_MAXTHREAD;
+	if (maxthread > list->n) maxthread = list->n;
+
+	list->next = 0;
+	while (nthread < maxthread) {
+		hThread[nthread] = (HANDLE) _beginthreadex(NULL, 0, SHA1WorkerThread, list, 0, NULL);
+		if (!hThread[nthread]) break;
+		nthread++;
+	}
+
+	// also works if no thread can be created
+	SHA1WorkerThread(list);
+
+	if (nthread > 0) {
+		WaitForMultipleObjects(nthread, hThread, TRUE, INFINITE);
+		for (i = 0; i < nthread; i++) {
+			CloseHandle(hThread[i]);
+		}
+	}
+}
+
+static void LoadSHA1Cache(const char *cachefile, std::vector<struct sha1_cache_entry> &cache)
+{
+	char line[MAX_PATH + 100];
+	FILE *fp = robust_fopen(cachefile, "r");
+	if (!fp) return;
+	while (fgets(line, sizeof(line), fp)) {
+		struct sha1_cache_entry e;
+		int pos;
+		if (sscanf(line, "%I64x %I64x %40s %n", &e.size, &e.mtime, e.hash, &pos) < 3) continue;
+		if (strlen(e.hash) != SHA1_STR_SIZE - 1) continue;
+		strncpy(e.fn, line + pos, sizeof(e.fn));
+		e.fn[sizeof(e.fn) - 1] = '\0';
+		e.fn[strcspn(e.fn, "\r\n")] = '\0';
+		cache.push_back(e);
+	}
+	fclose(fp);
+}
+
+static void SaveSHA1Cache(const char *cachefile, const std::vector<struct sha1_cache_entry> &cache)
+{
+	unsigned i;
+	FILE *fp = robust_fopen(cachefile, "w");
+	if (!fp) return;
+	for (i = 0; i < cache.size(); i++) {
+		fprintf(fp, "%I64x %I64x %s %s\n", cache[i].size, cache[i].mtime, cache[i].hash, cache[i].fn);
+	}
+	if (safe_fclose(&fp) != 0) robust_unlink(cachefile);
+}
+
+void GetFilesSHA1(const char **fn, int n, char (*hashstr)[SHA1_STR_SIZE], const char *cachefile)
+{
+	std::vector<struct sha1_cache_entry> cache, newcache;
+	std::vector<int> job;
+	struct sha1_job_list list;
+	int i;
+	unsigned j;
+
+	LoadSHA1Cache(cachefile, cache);
+
+	newcache.resize(n);
+	for (i = 0; i < n; i++) {
+		WIN32_FILE_ATTRIBUTE_DATA attr;
+		struct sha1_cache_entry *e = &newcache[i];
+		hashstr[i][0] = '\0';
+		strncpy(e->fn, fn[i], sizeof(e->fn));
+		e->fn[sizeof(e->fn) - 1] = '\0';
+		e->hash[0] = '\0';
+		if (!GetFileAttributesExA(fn[i], GetFileExInfoStandard, &attr)) continue;
+		e->size = ((unsigned __int64) attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+		e->mtime = ((unsigned __int64) attr.ftLastWriteTime.dwHighDateTime << 32) | attr.ftLastWriteTime.dwLowDateTime;
+
+		for (j = 0; j < cache.size(); j++) {
+			if (stricmp(cache[j].fn, e->fn) == 0 && cache[j].size == e->size && cache[j].mtime == e->mtime) {
+				strcpy(hashstr[i], cache[j].hash);
+				break;
+			}
+		}
+		if (j >= cache.size()) job.push_back(i);
+	}
+
+	if (!job.empty()) {
+		list.fn = fn;
+		list.hashstr = hashstr;
+		list.job = &job[0];
+		list.n = job.size();
+		RunSHA1Jobs(&list);
+	}
+
+	// keep digests of existing files only
+	for (i = n - 1; i >= 0; i--) {
+		strcpy(newcache[i].hash, hashstr[i]);
+		if (!newcache[i].hash[0]) newcache.erase(newcache.begin() + i);
+	}
+	if (!job.empty() || newcache.size() != cache.size()) {
+		SaveSHA1Cache(cachefile, newcache);
+	}
+}
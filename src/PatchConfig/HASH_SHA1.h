@@ -25,5 +25,6 @@ void SHA1Final(unsigned char digest[20], SHA1_CTX* context);
 #define SHA1_BYTE 20
 #define SHA1_STR_SIZE (SHA1_BYTE * 2 + 1)
 extern int GetFileSHA1(const char *fn, char *buf);
+extern void GetFilesSHA1(const char **fn, int n, char (*hashstr)[SHA1_STR_SIZE], const char *cachefile);
 
 #endif
\ No newline at end of file
@@ -33,15 +33,16 @@ CPatchConfigApp theApp;
 /////////////////////////////////////////////////////////////////////////////
 // CPatchConfigApp initialization
 
-static int AcquireGameMutex()
+static HANDLE hGameMutex = NULL;
+
+int AcquireGameMutex()
 {
-	HANDLE hMutex;
 	DWORD dwWaitResult;
 
-	hMutex = CreateMutexA(NULL, FALSE, PATCH_MUTEXNAME);
-	if (hMutex == NULL) goto fail;
+	if (hGameMutex == NULL) hGameMutex = CreateMutexA(NULL, FALSE, PATCH_MUTEXNAME);
+	if (hGameMutex == NULL) goto fail;
 
-	dwWaitResult = WaitForSingleObject(hMutex, 100);
+	dwWaitResult = WaitForSingleObject(hGameMutex, 100);
 	if (dwWaitResult != WAIT_OBJECT_0 && dwWaitResult != WAIT_ABANDONED) goto fail;
 
 	return 1;
@@ -50,6 +51,12 @@ fail:
 	return 0;
 }
 
+// let the game run while we are still open, must be acquired again after game exits
+void ReleaseGameMutex()
+{
+	if (hGameMutex) ReleaseMutex(hGameMutex);
+}
+
 static int CheckCOMCTL32()
 {
 	DWORD dwMajorVersion = 0;
@@ -79,17 +86,40 @@ static int CheckCOMCTL32()
 	}
 }
 
+#ifdef BUILD_FOR_PAL3
+#define HASHCACHE_FILE "PAL3patch.hashcache"
+#endif
+
+#ifdef BUILD_FOR_PAL3A
+#define HASHCACHE_FILE "PAL3Apatch.hashcache"
+#endif
+
 static int VerifyPatchFiles()
 {
 	const int max_show = 10;
 	int cnt = 0;
 	CString buf;
 	const char **ptr;
+	std::vector<const char *> fnlist;
+	std::vector<const char *> hashlist;
+	int i, n;
+
 	for (ptr = pFileHash; *ptr; ptr += 2) {
-		const char *fn = ptr[0];
-		const char *hash = ptr[1];
-		char hashstr[SHA1_STR_SIZE];
-		if (!GetFileSHA1(fn, hashstr) || strcmp(hashstr, hash) != 0) {
+		fnlist.push_back(ptr[0]);
+		hashlist.push_back(ptr[1]);
+	}
+	n = fnlist.size();
+	if (n == 0) return 1;
+
+	// hash all files at once, failed ones are empty strings
+	std::vector<char> hashbuf(n * SHA1_STR_SIZE);
+	char (*hashstr)[SHA1_STR_SIZE] = (char (*)[SHA1_STR_SIZE]) &hashbuf[0];
+	GetFilesSHA1(&fnlist[0], n, hashstr, HASHCACHE_FILE);
+
+	for (i = 0; i < n; i++) {
+		const char *fn = fnlist[i];
+		const char *hash = hashlist[i];
+		if (strcmp(hashstr[i], hash) != 0) {
 			if (cnt <= max_show) {
 				buf += "  ";
 				buf += cnt < max_show ? fn : "...";
@@ -151,6 +181,7 @@ BOOL CPatchConfigApp::InitInstance()
 
 	ShowPleaseWaitDlg(NULL, STRTABLE(IDS_WAITINGENUMD3D));
 	if (!InitD3DEnumeration()) goto err;
+	StartFontEnumeration();
 
 	ShowPleaseWaitDlg(NULL, STRTABLE(IDS_WAITINGCHECKSYSTEM));
 	if (!CheckCOMCTL32()) goto err;
@@ -165,6 +196,7 @@ BOOL CPatchConfigApp::InitInstance()
 		dlg.DoModal();
 
 		CleanupD3DEnumeration();
+		WaitFontEnumeration();
 
 		// Since the dialog has been closed, return FALSE so that we exit the
 		//  application, rather than start the application's message pump.
@@ -174,6 +206,7 @@ BOOL CPatchConfigApp::InitInstance()
 err:
 	DestroyPleaseWaitDlg();
 	CleanupD3DEnumeration();
+	WaitFontEnumeration();
 	return FALSE;
 }
 
@@ -158,6 +158,10 @@ SOURCE=.\BadFiles.cpp
 # End Source File
 # Begin Source File
 
+SOURCE=.\Benchmark.cpp
+# End Source File
+# Begin Source File
+
 SOURCE=.\CheckForUpdates.cpp
 # End Source File
 # Begin Source File
@@ -255,6 +259,10 @@ SOURCE=.\BadFiles.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\Benchmark.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\CheckForUpdates.h
 # End Source File
 # Begin Source File
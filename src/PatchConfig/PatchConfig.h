@@ -39,6 +39,8 @@ public:
 };
 
 extern void DoEvents();
+extern int AcquireGameMutex();
+extern void ReleaseGameMutex();
 
 /////////////////////////////////////////////////////////////////////////////
 
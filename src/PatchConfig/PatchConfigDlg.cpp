@@ -172,11 +172,11 @@ void CPatchConfigDlg::SelectConfigItem(ConfigDescItem *pItem)
 		if (m_IsAdvMode && pItem->key) {
 			m_CfgTitle.Format(_T("%s (%s)"), pItem->title, pItem->key);
 		} else {
-			m_CfgTitle = CString(pItem->title);
+			m_CfgTitle = pItem->title;
 		}
 	}
 	if (reload) {
-		m_CfgDesc = CString(pItem->description);
+		m_CfgDesc = pItem->description;
 	}
 	if (reload) {
 		if (pItem->runfunc) {
@@ -199,10 +199,10 @@ void CPatchConfigDlg::SelectConfigItem(ConfigDescItem *pItem)
 		if (invflag < 0) {
 			if (reload) rbtn->SetWindowText(pOpt->title);
 			if (reload) rbtn->ShowWindow(SW_SHOW);
-			if (*pItem->pvalue == CString(pOpt->value)) {
+			if (*pItem->pvalue == pOpt->value) {
 				m_RadioVal = i;
 				SetRadioBtnStyle(i, 1, (reload ? 0 : -1));
-				m_OptDesc = CString(pOpt->description);
+				m_OptDesc = pOpt->description;
 				descflag = 1;
 			} else {
 				SetRadioBtnStyle(i, 0, (reload ? 0 : -1));
@@ -238,7 +238,7 @@ void CPatchConfigDlg::SelectConfigItem(ConfigDescItem *pItem)
 
 	if (!descflag) {
 		if (pItem->defoptdesc) {
-			m_OptDesc = CString(pItem->defoptdesc);
+			m_OptDesc = pItem->defoptdesc;
 		} else {
 			m_OptDesc = STRTABLE(IDS_NODESC);
 		}
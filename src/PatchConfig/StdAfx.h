@@ -38,6 +38,7 @@
 #include <wincrypt.h>
 
 #include <io.h>
+#include <process.h>
 #include <errno.h>
 
 #include <vector>
@@ -58,6 +59,7 @@ typedef unsigned int uint32_t;
 #include "PatchConfigDlg.h"
 
 #include "BadFiles.h"
+#include "Benchmark.h"
 #include "CheckForUpdates.h"
 #include "ChooseFromListDlg.h"
 #include "ConfigData.h"
@@ -53,3 +53,27 @@ int robust_unlink(const char *filename)
     }
     return ret;
 }
+
+// read whole file in one read, NUL-terminated, must be freed by caller
+char *read_file_as_cstring(const char *filepath)
+{
+    char *filedata = NULL;
+    FILE *fp = robust_fopen(filepath, "rb");
+    if (!fp) goto fail;
+    
+    long size;
+    size = _filelength(_fileno(fp));
+    if (size < 0) goto fail;
+    
+    filedata = (char *) malloc(size + 1);
+    if (!filedata) goto fail;
+    if (fread(filedata, 1, size, fp) != (size_t) size) goto fail;
+    filedata[size] = '\0';
+    
+    safe_fclose(&fp);
+    return filedata;
+fail:
+    free(filedata);
+    safe_fclose(&fp);
+    return NULL;
+}
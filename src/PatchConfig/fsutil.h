@@ -7,5 +7,6 @@ extern int reset_attrib(const char *filepath);
 extern FILE *robust_fopen(const char *filename, const char *mode);
 extern int safe_fclose(FILE **fp);
 extern int robust_unlink(const char *filename);
+extern char *read_file_as_cstring(const char *filepath);
 
 #endif
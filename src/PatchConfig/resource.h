@@ -73,6 +73,14 @@
 #define IDS_BADCOMCTL32_TITLE           71
 #define IDS_NOMUTEX                     72
 #define IDS_NOMUTEX_TITLE               73
+#define IDS_BENCHMARK_TITLE             74
+#define IDS_BENCHMARK_NORECORD          75
+#define IDS_BENCHMARK_CONFIRM           76
+#define IDS_BENCHMARK_WAITFINISH        77
+#define IDS_BENCHMARK_CANTRUN           78
+#define IDS_BENCHMARK_NORESULT          79
+#define IDS_BENCHMARK_RESULT            80
+#define IDS_BENCHMARK_RESULTLINE        81
 #define IDD_PATCHCONFIG                 102
 #define IDR_MAINFRAME                   128
 #define IDD_CHOOSEFROMLIST              129